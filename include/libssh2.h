@@ -304,6 +304,27 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
   void name(LIBSSH2_SESSION *session, void **session_abstract, \
             LIBSSH2_CHANNEL *channel, void **channel_abstract)
 
+#define LIBSSH2_CHANNEL_DATA_FUNC(name) \
+  size_t name(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, \
+              int stream_id, const char *data, size_t datalen, \
+              void **channel_abstract)
+
+#define LIBSSH2_LISTENER_ACCEPT_FUNC(name) \
+  void name(LIBSSH2_SESSION *session, LIBSSH2_LISTENER *listener, \
+            LIBSSH2_CHANNEL *channel, void **listener_abstract)
+
+/* Session pool callbacks: connect returns a session that is through
+   libssh2_session_handshake() and authenticated as USER with IDENTITY, or
+   NULL; close disconnects and frees a session the pool is done with */
+#define LIBSSH2_POOL_CONNECT_FUNC(name) \
+  LIBSSH2_SESSION *name(LIBSSH2_SESSION_POOL *pool, const char *host, \
+                        int port, const char *user, const char *identity, \
+                        void **pool_abstract)
+
+#define LIBSSH2_POOL_CLOSE_FUNC(name) \
+  void name(LIBSSH2_SESSION_POOL *pool, LIBSSH2_SESSION *session, \
+            void **pool_abstract)
+
 /* I/O callbacks */
 #define LIBSSH2_RECV_FUNC(name)  ssize_t name(libssh2_socket_t socket, \
                                               void *buffer, size_t length, \
@@ -336,12 +357,142 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 /* flags */
 #define LIBSSH2_FLAG_SIGPIPE        1
 #define LIBSSH2_FLAG_COMPRESS       2
+#define LIBSSH2_FLAG_KEX_GUESS      3
+#define LIBSSH2_FLAG_COMPRESS_LEVEL 4
+#define LIBSSH2_FLAG_CHANNEL_PIPELINE 5
+#define LIBSSH2_FLAG_STATS_TIMING   6
+#define LIBSSH2_FLAG_HISTOGRAMS     7
+#define LIBSSH2_FLAG_RELEASE_BUFFERS 8
+#define LIBSSH2_FLAG_WINDOW_MINADJUST 9
+#define LIBSSH2_FLAG_FEED           10
+#define LIBSSH2_FLAG_PUBLICKEY_DIRECT 11
+#define LIBSSH2_FLAG_SEND_QUEUE     12
 
 typedef struct _LIBSSH2_SESSION                     LIBSSH2_SESSION;
 typedef struct _LIBSSH2_CHANNEL                     LIBSSH2_CHANNEL;
 typedef struct _LIBSSH2_LISTENER                    LIBSSH2_LISTENER;
 typedef struct _LIBSSH2_KNOWNHOSTS                  LIBSSH2_KNOWNHOSTS;
+typedef struct _LIBSSH2_KNOWNHOST_STORE             LIBSSH2_KNOWNHOST_STORE;
 typedef struct _LIBSSH2_AGENT                       LIBSSH2_AGENT;
+typedef struct _LIBSSH2_USERAUTH_KEY                LIBSSH2_USERAUTH_KEY;
+typedef struct _LIBSSH2_POLLSET                     LIBSSH2_POLLSET;
+typedef struct _LIBSSH2_SESSION_GROUP               LIBSSH2_SESSION_GROUP;
+typedef struct _LIBSSH2_SESSION_POOL                LIBSSH2_SESSION_POOL;
+typedef struct _LIBSSH2_COMP_METHOD                 LIBSSH2_COMP_METHOD;
+typedef struct _LIBSSH2_CHANNEL_VIEW                LIBSSH2_CHANNEL_VIEW;
+typedef struct _LIBSSH2_SESSION_STATS               LIBSSH2_SESSION_STATS;
+typedef struct _LIBSSH2_CHANNEL_STATS               LIBSSH2_CHANNEL_STATS;
+typedef struct _LIBSSH2_HISTOGRAM                   LIBSSH2_HISTOGRAM;
+typedef struct _LIBSSH2_RELAY                       LIBSSH2_RELAY;
+typedef struct _LIBSSH2_RELAY_RESULT                LIBSSH2_RELAY_RESULT;
+
+/* A compression method to offer next to the built-in ones, see
+   libssh2_session_comp_method_add(3) */
+struct _LIBSSH2_COMP_METHOD
+{
+    const char *name;
+    int compress; /* 1 if it does compress, 0 if it doesn't */
+    int use_in_auth; /* 1 if compression should be used in userauth */
+    int (*init) (LIBSSH2_SESSION *session, int compress, void **abstract);
+    int (*comp) (LIBSSH2_SESSION *session,
+                 unsigned char *dest,
+                 size_t *dest_len,
+                 const unsigned char *src,
+                 size_t src_len,
+                 void **abstract);
+    int (*decomp) (LIBSSH2_SESSION *session,
+                   unsigned char **dest,
+                   size_t *dest_len,
+                   size_t payload_limit,
+                   const unsigned char *src,
+                   size_t src_len,
+                   void **abstract);
+    int (*dtor) (LIBSSH2_SESSION * session, int compress, void **abstract);
+};
+
+/* A socket and channel pair a relay is done with, see libssh2_relay_run(3) */
+struct _LIBSSH2_RELAY_RESULT
+{
+    libssh2_socket_t socket;
+    LIBSSH2_CHANNEL *channel;
+    void *abstract;
+    int rc;                            /* 0 or a LIBSSH2_ERROR_* code */
+    libssh2_uint64_t bytes_to_channel; /* read from the socket */
+    libssh2_uint64_t bytes_to_socket;  /* received on the channel */
+};
+
+/* Received channel data left in the packet it arrived in, see
+   libssh2_channel_read_peek(3) */
+struct _LIBSSH2_CHANNEL_VIEW
+{
+    const char *data;
+    size_t length;
+};
+
+/* Counters of a session since it was created, see libssh2_session_stats(3) */
+struct _LIBSSH2_SESSION_STATS
+{
+    libssh2_uint64_t bytes_sent;        /* to the socket, SSH framing and all */
+    libssh2_uint64_t bytes_received;
+    libssh2_uint64_t packets_sent;
+    libssh2_uint64_t packets_received;
+    libssh2_uint64_t send_calls;        /* calls of the send callback */
+    libssh2_uint64_t recv_calls;
+    libssh2_uint64_t send_eagain;       /* ...that returned EAGAIN */
+    libssh2_uint64_t recv_eagain;
+    libssh2_uint64_t allocs;            /* calls of the alloc callback */
+    /* microseconds spent in the cipher, the MAC and the compression, only
+       counted with LIBSSH2_FLAG_STATS_TIMING set */
+    libssh2_uint64_t crypt_us;
+    libssh2_uint64_t mac_us;
+    libssh2_uint64_t comp_us;
+    unsigned long packets_queued;       /* received, not handled yet */
+    unsigned long packets_queued_max;
+    unsigned long rekeys;               /* key re-exchanges after the first */
+    libssh2_uint64_t rekey_us;          /* how long they took together */
+    libssh2_uint64_t window_adjusts_sent;
+};
+
+/* Counters of a channel, see libssh2_channel_stats(3) */
+struct _LIBSSH2_CHANNEL_STATS
+{
+    libssh2_uint64_t bytes_read;
+    libssh2_uint64_t bytes_written;
+    libssh2_uint64_t window_adjusts_sent;
+    libssh2_uint64_t window_adjusts_received;
+    libssh2_uint64_t window_waits;      /* writes held up by a full window */
+    unsigned long packets_queued;       /* received, not read yet */
+    unsigned long requests_pending;     /* pipelined, not answered yet */
+};
+
+/* Latency histograms kept with LIBSSH2_FLAG_HISTOGRAMS set, see
+   libssh2_session_histogram(3) */
+#define LIBSSH2_HISTOGRAM_KEX           0
+#define LIBSSH2_HISTOGRAM_CHANNEL_OPEN  1
+#define LIBSSH2_HISTOGRAM_WINDOW_WAIT   2
+#define LIBSSH2_HISTOGRAM_SFTP_READ     3
+#define LIBSSH2_HISTOGRAM_SFTP_WRITE    4
+#define LIBSSH2_HISTOGRAM_SFTP_OPEN     5
+#define LIBSSH2_HISTOGRAM_SFTP_CLOSE    6
+#define LIBSSH2_HISTOGRAM_SFTP_STAT     7
+#define LIBSSH2_HISTOGRAM_SFTP_READDIR  8
+#define LIBSSH2_HISTOGRAM_SFTP_OTHER    9
+#define LIBSSH2_HISTOGRAM_COUNT         10
+
+/* Buckets 0 to 3 count 0 to 3 microseconds, above that every power of two
+   is split in four: bucket 4 * (e - 1) + m counts the values from
+   (4 + m) << (e - 2) up to the next bucket, for 2 <= e and 0 <= m < 4. The
+   last bucket also counts everything larger. */
+#define LIBSSH2_HISTOGRAM_BUCKETS       128
+
+struct _LIBSSH2_HISTOGRAM
+{
+    libssh2_uint64_t count;
+    libssh2_uint64_t sum_us;
+    libssh2_uint64_t min_us;
+    libssh2_uint64_t max_us;
+    libssh2_uint64_t buckets[LIBSSH2_HISTOGRAM_BUCKETS];
+};
 
 typedef struct _LIBSSH2_POLLFD {
     unsigned char type; /* LIBSSH2_POLLFD_* below */
@@ -394,11 +545,16 @@ typedef struct _LIBSSH2_POLLFD {
 /* Hash Types */
 #define LIBSSH2_HOSTKEY_HASH_MD5                            1
 #define LIBSSH2_HOSTKEY_HASH_SHA1                           2
+#define LIBSSH2_HOSTKEY_HASH_SHA256                         3
 
 /* Hostkey Types */
 #define LIBSSH2_HOSTKEY_TYPE_UNKNOWN			    0
 #define LIBSSH2_HOSTKEY_TYPE_RSA			    1
 #define LIBSSH2_HOSTKEY_TYPE_DSS			    2
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_256			    3
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_384			    4
+#define LIBSSH2_HOSTKEY_TYPE_ECDSA_521			    5
+#define LIBSSH2_HOSTKEY_TYPE_ED25519			    6
 
 /* Disconnect Codes (defined by SSH protocol) */
 #define SSH_DISCONNECT_HOST_NOT_ALLOWED_TO_CONNECT          1
@@ -503,6 +659,16 @@ LIBSSH2_API int libssh2_init(int flags);
  */
 LIBSSH2_API void libssh2_exit(void);
 
+/*
+ * libssh2_dh_precompute()
+ *
+ * Keep Diffie-Hellman ephemerals for the fixed groups computed ahead of
+ * the key exchanges that need them. Zero stops it.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_dh_precompute(int count);
+
 /*
  * libssh2_free()
  *
@@ -524,6 +690,23 @@ LIBSSH2_API int libssh2_session_supported_algs(LIBSSH2_SESSION* session,
                                                int method_type,
                                                const char*** algs);
 
+/* CPU instructions a method runs faster on, see libssh2_method_accel() */
+#define LIBSSH2_ACCEL_AES       0x0001 /* AES-NI, ARMv8 AES */
+#define LIBSSH2_ACCEL_CLMUL     0x0002 /* PCLMULQDQ, ARMv8 PMULL, for GCM */
+#define LIBSSH2_ACCEL_SHA1      0x0004 /* SHA extensions, ARMv8 SHA1 */
+#define LIBSSH2_ACCEL_SHA256    0x0008 /* SHA extensions, ARMv8 SHA2 */
+#define LIBSSH2_ACCEL_SHA512    0x0010 /* ARMv8.2 SHA512 */
+
+/*
+ * libssh2_method_accel()
+ *
+ * The LIBSSH2_ACCEL_* bits of the running CPU that the crypto backend makes
+ * use of for cipher or MAC METHOD of METHOD_TYPE, or for any method when
+ * METHOD is NULL. 0 means it runs in software, a negative number is an
+ * error code.
+ */
+LIBSSH2_API int libssh2_method_accel(int method_type, const char *method);
+
 /* Session API */
 LIBSSH2_API LIBSSH2_SESSION *
 libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
@@ -575,12 +758,31 @@ LIBSSH2_API int libssh2_session_block_directions(LIBSSH2_SESSION *session);
 
 LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag,
                                      int value);
+LIBSSH2_API ssize_t libssh2_session_feed_in(LIBSSH2_SESSION *session,
+                                            const char *buffer,
+                                            size_t length);
+LIBSSH2_API ssize_t libssh2_session_feed_out(LIBSSH2_SESSION *session,
+                                             char *buffer, size_t length);
+LIBSSH2_API int libssh2_session_stats(LIBSSH2_SESSION *session,
+                                      LIBSSH2_SESSION_STATS *stats);
+LIBSSH2_API int libssh2_session_histogram(LIBSSH2_SESSION *session,
+                                          int which,
+                                          LIBSSH2_HISTOGRAM *histogram);
+LIBSSH2_API libssh2_uint64_t
+libssh2_histogram_percentile(const LIBSSH2_HISTOGRAM *histogram,
+                             double percentile);
+LIBSSH2_API int
+libssh2_session_comp_method_add(LIBSSH2_SESSION *session,
+                                const LIBSSH2_COMP_METHOD *method);
 LIBSSH2_API const char *libssh2_session_banner_get(LIBSSH2_SESSION *session);
 
 /* Userauth API */
 LIBSSH2_API char *libssh2_userauth_list(LIBSSH2_SESSION *session,
                                         const char *username,
                                         unsigned int username_len);
+LIBSSH2_API int libssh2_userauth_list_set(LIBSSH2_SESSION *session,
+                                         const char *methods,
+                                         unsigned int methods_len);
 LIBSSH2_API int libssh2_userauth_authenticated(LIBSSH2_SESSION *session);
 
 LIBSSH2_API int libssh2_userauth_password_ex(LIBSSH2_SESSION *session,
@@ -651,6 +853,33 @@ libssh2_userauth_publickey_frommemory(LIBSSH2_SESSION *session,
                                       size_t privatekeyfiledata_len,
                                       const char *passphrase);
 
+/*
+ * A keypair loaded once and used to authenticate any number of sessions,
+ * without reading and parsing the key files for each of them.
+ */
+LIBSSH2_API int
+libssh2_userauth_key_fromfile(LIBSSH2_USERAUTH_KEY **key,
+                              const char *publickey,
+                              const char *privatekey,
+                              const char *passphrase);
+
+LIBSSH2_API int
+libssh2_userauth_key_frommemory(LIBSSH2_USERAUTH_KEY **key,
+                                const char *publickeyfiledata,
+                                size_t publickeyfiledata_len,
+                                const char *privatekeyfiledata,
+                                size_t privatekeyfiledata_len,
+                                const char *passphrase);
+
+LIBSSH2_API void
+libssh2_userauth_key_free(LIBSSH2_USERAUTH_KEY *key);
+
+LIBSSH2_API int
+libssh2_userauth_publickey_key(LIBSSH2_SESSION *session,
+                               const char *username,
+                               size_t username_len,
+                               LIBSSH2_USERAUTH_KEY *key);
+
 /*
  * response_callback is provided with filled by library prompts array,
  * but client must allocate and fill individual responses. Responses
@@ -672,6 +901,31 @@ libssh2_userauth_keyboard_interactive_ex(LIBSSH2_SESSION* session,
 
 LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds,
                              long timeout);
+LIBSSH2_API LIBSSH2_POLLSET *libssh2_pollset_init(LIBSSH2_SESSION *session);
+LIBSSH2_API int libssh2_pollset_add(LIBSSH2_POLLSET *set,
+                                    const LIBSSH2_POLLFD *fd);
+LIBSSH2_API int libssh2_pollset_remove(LIBSSH2_POLLSET *set,
+                                       const LIBSSH2_POLLFD *fd);
+LIBSSH2_API libssh2_socket_t libssh2_pollset_fd(LIBSSH2_POLLSET *set);
+LIBSSH2_API int libssh2_pollset_ready(LIBSSH2_POLLSET *set,
+                                      LIBSSH2_POLLFD *fds,
+                                      unsigned int max);
+LIBSSH2_API void libssh2_pollset_free(LIBSSH2_POLLSET *set);
+LIBSSH2_API LIBSSH2_RELAY *libssh2_relay_init(LIBSSH2_SESSION *session);
+LIBSSH2_API int libssh2_relay_add(LIBSSH2_RELAY *relay, libssh2_socket_t sock,
+                                  LIBSSH2_CHANNEL *channel, void *abstract);
+LIBSSH2_API int libssh2_relay_remove(LIBSSH2_RELAY *relay,
+                                     LIBSSH2_CHANNEL *channel);
+LIBSSH2_API int libssh2_relay_run(LIBSSH2_RELAY *relay, long timeout,
+                                  LIBSSH2_RELAY_RESULT *done,
+                                  unsigned int max);
+LIBSSH2_API void libssh2_relay_free(LIBSSH2_RELAY *relay);
+LIBSSH2_API int libssh2_transport_read(LIBSSH2_SESSION *session,
+                                       LIBSSH2_CHANNEL **channels,
+                                       unsigned int max);
+LIBSSH2_API int libssh2_transport_write(LIBSSH2_SESSION *session,
+                                        LIBSSH2_CHANNEL **channels,
+                                        unsigned int max);
 
 /* Channel API */
 #define LIBSSH2_CHANNEL_WINDOW_DEFAULT  (2*1024*1024)
@@ -715,6 +969,15 @@ LIBSSH2_API int libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener);
 
 LIBSSH2_API LIBSSH2_CHANNEL *
 libssh2_channel_forward_accept(LIBSSH2_LISTENER *listener);
+LIBSSH2_API int
+libssh2_channel_forward_accept_batch(LIBSSH2_LISTENER *listener,
+                                     LIBSSH2_CHANNEL **channels,
+                                     unsigned int max);
+LIBSSH2_API void
+libssh2_channel_forward_accept_callback(LIBSSH2_LISTENER *listener,
+                                        LIBSSH2_LISTENER_ACCEPT_FUNC(
+                                            (*callback)),
+                                        void *abstract);
 
 LIBSSH2_API int libssh2_channel_setenv_ex(LIBSSH2_CHANNEL *channel,
                                           const char *varname,
@@ -780,8 +1043,26 @@ LIBSSH2_API ssize_t libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel,
 #define libssh2_channel_read_stderr(channel, buf, buflen) \
   libssh2_channel_read_ex((channel), SSH_EXTENDED_DATA_STDERR, (buf), (buflen))
 
+LIBSSH2_API int libssh2_channel_read_peek_ex(LIBSSH2_CHANNEL *channel,
+                                             int stream_id,
+                                             LIBSSH2_CHANNEL_VIEW *views,
+                                             int count);
+#define libssh2_channel_read_peek(channel, views, count) \
+  libssh2_channel_read_peek_ex((channel), 0, (views), (count))
+LIBSSH2_API int libssh2_channel_read_consume_ex(LIBSSH2_CHANNEL *channel,
+                                                int stream_id, size_t count);
+#define libssh2_channel_read_consume(channel, count) \
+  libssh2_channel_read_consume_ex((channel), 0, (count))
+LIBSSH2_API ssize_t libssh2_channel_recvfile(LIBSSH2_CHANNEL *channel,
+                                             int fd, libssh2_uint64_t offset,
+                                             size_t count);
+
 LIBSSH2_API int libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel,
                                           int extended);
+LIBSSH2_API void
+libssh2_channel_data_callback(LIBSSH2_CHANNEL *channel,
+                              LIBSSH2_CHANNEL_DATA_FUNC((*callback)),
+                              void *abstract);
 
 LIBSSH2_API unsigned long
 libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
@@ -789,6 +1070,7 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
                                unsigned long *window_size_initial);
 #define libssh2_channel_window_read(channel) \
   libssh2_channel_window_read_ex((channel), NULL, NULL)
+LIBSSH2_API size_t libssh2_channel_read_buffered(LIBSSH2_CHANNEL *channel);
 
 /* libssh2_channel_receive_window_adjust is DEPRECATED, do not use! */
 LIBSSH2_API unsigned long
@@ -810,6 +1092,9 @@ LIBSSH2_API ssize_t libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel,
   libssh2_channel_write_ex((channel), 0, (buf), (buflen))
 #define libssh2_channel_write_stderr(channel, buf, buflen)  \
   libssh2_channel_write_ex((channel), SSH_EXTENDED_DATA_STDERR, (buf), (buflen))
+LIBSSH2_API ssize_t libssh2_channel_sendfile(LIBSSH2_CHANNEL *channel,
+                                             int fd, libssh2_uint64_t offset,
+                                             size_t count);
 
 LIBSSH2_API unsigned long
 libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel,
@@ -824,10 +1109,51 @@ LIBSSH2_API int libssh2_session_get_blocking(LIBSSH2_SESSION* session);
 LIBSSH2_API void libssh2_channel_set_blocking(LIBSSH2_CHANNEL *channel,
                                               int blocking);
 
+LIBSSH2_API void libssh2_channel_cork(LIBSSH2_CHANNEL *channel, int cork);
+
+/* Share of the outbound queue a channel gets when the socket is full,
+   relative to the other channels of the session */
+#define LIBSSH2_CHANNEL_WEIGHT_DEFAULT 16
+#define LIBSSH2_CHANNEL_WEIGHT_MAX 65535
+
+LIBSSH2_API int libssh2_channel_weight(LIBSSH2_CHANNEL *channel,
+                                       unsigned int weight);
+
+/* Token bucket pacing of the data sent, in bytes per second */
+LIBSSH2_API int libssh2_session_pace(LIBSSH2_SESSION *session,
+                                     libssh2_uint64_t rate, size_t burst);
+LIBSSH2_API int libssh2_channel_pace(LIBSSH2_CHANNEL *channel,
+                                     libssh2_uint64_t rate, size_t burst);
+LIBSSH2_API long libssh2_session_pace_delay(LIBSSH2_SESSION *session);
+
+LIBSSH2_API int libssh2_session_flush(LIBSSH2_SESSION *session);
+
 LIBSSH2_API void libssh2_session_set_timeout(LIBSSH2_SESSION* session,
                                              long timeout);
 LIBSSH2_API long libssh2_session_get_timeout(LIBSSH2_SESSION* session);
 
+/* Receive window modes for libssh2_session_window_mode() */
+#define LIBSSH2_WINDOW_FIXED 0 /* the window given at channel open */
+#define LIBSSH2_WINDOW_AUTO  1 /* tuned to what the channel needs */
+
+#define LIBSSH2_WINDOW_BUDGET_DEFAULT (64*1024*1024)
+
+LIBSSH2_API void libssh2_session_window_mode(LIBSSH2_SESSION *session,
+                                             int mode, size_t budget);
+
+LIBSSH2_API void libssh2_session_recv_buffer(LIBSSH2_SESSION *session,
+                                             size_t bytes);
+LIBSSH2_API void libssh2_session_rekey_limit(LIBSSH2_SESSION *session,
+                                             libssh2_uint64_t bytes,
+                                             unsigned int packets);
+LIBSSH2_API int libssh2_session_crypto_threads(LIBSSH2_SESSION *session,
+                                               int threads);
+LIBSSH2_API int libssh2_session_thread_safe(LIBSSH2_SESSION *session,
+                                            int enable);
+LIBSSH2_API void libssh2_session_read_budget(LIBSSH2_SESSION *session,
+                                             size_t bytes);
+LIBSSH2_API size_t libssh2_session_read_buffered(LIBSSH2_SESSION *session);
+
 /* libssh2_channel_handle_extended_data is DEPRECATED, do not use! */
 LIBSSH2_API void libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
                                                       int ignore_mode);
@@ -867,6 +1193,9 @@ LIBSSH2_API int libssh2_channel_get_exit_signal(LIBSSH2_CHANNEL* channel,
 LIBSSH2_API int libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel);
 LIBSSH2_API int libssh2_channel_eof(LIBSSH2_CHANNEL *channel);
 LIBSSH2_API int libssh2_channel_wait_eof(LIBSSH2_CHANNEL *channel);
+LIBSSH2_API int libssh2_channel_wait_replies(LIBSSH2_CHANNEL *channel);
+LIBSSH2_API int libssh2_channel_stats(LIBSSH2_CHANNEL *channel,
+                                      LIBSSH2_CHANNEL_STATS *stats);
 LIBSSH2_API int libssh2_channel_close(LIBSSH2_CHANNEL *channel);
 LIBSSH2_API int libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel);
 LIBSSH2_API int libssh2_channel_free(LIBSSH2_CHANNEL *channel);
@@ -950,13 +1279,17 @@ libssh2_knownhost_init(LIBSSH2_SESSION *session);
 #define LIBSSH2_KNOWNHOST_KEYENC_RAW      (1<<16)
 #define LIBSSH2_KNOWNHOST_KEYENC_BASE64   (2<<16)
 
-/* type of key (2 bits) */
-#define LIBSSH2_KNOWNHOST_KEY_MASK     (7<<18)
+/* type of key (4 bits) */
+#define LIBSSH2_KNOWNHOST_KEY_MASK     (15<<18)
 #define LIBSSH2_KNOWNHOST_KEY_SHIFT    18
 #define LIBSSH2_KNOWNHOST_KEY_RSA1     (1<<18)
 #define LIBSSH2_KNOWNHOST_KEY_SSHRSA   (2<<18)
 #define LIBSSH2_KNOWNHOST_KEY_SSHDSS   (3<<18)
-#define LIBSSH2_KNOWNHOST_KEY_UNKNOWN  (7<<18)
+#define LIBSSH2_KNOWNHOST_KEY_ECDSA_256 (4<<18)
+#define LIBSSH2_KNOWNHOST_KEY_ECDSA_384 (5<<18)
+#define LIBSSH2_KNOWNHOST_KEY_ECDSA_521 (6<<18)
+#define LIBSSH2_KNOWNHOST_KEY_ED25519  (7<<18)
+#define LIBSSH2_KNOWNHOST_KEY_UNKNOWN  (15<<18)
 
 LIBSSH2_API int
 libssh2_knownhost_add(LIBSSH2_KNOWNHOSTS *hosts,
@@ -1137,6 +1470,45 @@ libssh2_knownhost_get(LIBSSH2_KNOWNHOSTS *hosts,
                       struct libssh2_knownhost **store,
                       struct libssh2_knownhost *prev);
 
+/*
+ * libssh2_knownhost_store_init()
+ *
+ * Create a store of known hosts that belongs to no session. The collection
+ * it hands out is read-only and may be checked against by any number of
+ * sessions on any number of threads at once.
+ */
+LIBSSH2_API LIBSSH2_KNOWNHOST_STORE *
+libssh2_knownhost_store_init(void);
+
+/*
+ * libssh2_knownhost_store_readfile()
+ *
+ * Read a file into a new collection that replaces the one the store hands
+ * out, at once for every later libssh2_knownhost_store_get().
+ *
+ * Returns a negative value for error or number of successfully added hosts.
+ */
+LIBSSH2_API int
+libssh2_knownhost_store_readfile(LIBSSH2_KNOWNHOST_STORE *store,
+                                 const char *filename, int type);
+
+/*
+ * libssh2_knownhost_store_get()
+ *
+ * Take a reference to the collection a store hands out now. Give it back
+ * with libssh2_knownhost_free().
+ */
+LIBSSH2_API LIBSSH2_KNOWNHOSTS *
+libssh2_knownhost_store_get(LIBSSH2_KNOWNHOST_STORE *store);
+
+/*
+ * libssh2_knownhost_store_free()
+ *
+ * Free a store. Collections still referenced live on until given back.
+ */
+LIBSSH2_API void
+libssh2_knownhost_store_free(LIBSSH2_KNOWNHOST_STORE *store);
+
 #define HAVE_LIBSSH2_AGENT_API 0x010202 /* since 1.2.2 */
 
 struct libssh2_agent_publickey {
@@ -1205,6 +1577,45 @@ libssh2_agent_userauth(LIBSSH2_AGENT *agent,
                const char *username,
                struct libssh2_agent_publickey *identity);
 
+/*
+ * libssh2_agent_init_shared()
+ *
+ * Init an ssh-agent handle that is not tied to a session, to authenticate
+ * any number of sessions with one agent connection and identity list.
+ */
+LIBSSH2_API LIBSSH2_AGENT *
+libssh2_agent_init_shared(void);
+
+/*
+ * libssh2_agent_userauth_session()
+ *
+ * Do publickey user authentication of 'session' with the help of ssh-agent.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int
+libssh2_agent_userauth_session(LIBSSH2_AGENT *agent,
+               LIBSSH2_SESSION *session,
+               const char *username,
+               struct libssh2_agent_publickey *identity);
+
+/*
+ * libssh2_agent_get_fd()
+ *
+ * Returns the socket of the agent connection, or LIBSSH2_INVALID_SOCKET.
+ */
+LIBSSH2_API libssh2_socket_t
+libssh2_agent_get_fd(LIBSSH2_AGENT *agent);
+
+/*
+ * libssh2_agent_block_directions()
+ *
+ * Returns the LIBSSH2_SESSION_BLOCK_* directions the connection of a shared
+ * agent waits in.
+ */
+LIBSSH2_API int
+libssh2_agent_block_directions(LIBSSH2_AGENT *agent);
+
 /*
  * libssh2_agent_disconnect()
  *
@@ -1253,6 +1664,117 @@ LIBSSH2_API void libssh2_keepalive_config (LIBSSH2_SESSION *session,
 LIBSSH2_API int libssh2_keepalive_send (LIBSSH2_SESSION *session,
                                         int *seconds_to_next);
 
+/*
+ * libssh2_session_group_init()
+ *
+ * Create a group that keeps the keepalive and timeout deadlines of many
+ * non-blocking sessions on one timer wheel.
+ */
+LIBSSH2_API LIBSSH2_SESSION_GROUP *libssh2_session_group_init(void);
+
+/*
+ * libssh2_session_group_add()
+ *
+ * Put SESSION in GROUP. Its keepalives are then sent by
+ * libssh2_session_group_run(), which also reports it once nothing was
+ * received from the server for the session's timeout.
+ */
+LIBSSH2_API int libssh2_session_group_add(LIBSSH2_SESSION_GROUP *group,
+                                          LIBSSH2_SESSION *session);
+
+/*
+ * libssh2_session_group_remove()
+ *
+ * Take SESSION out of the group it is in. Freeing a session does so too.
+ */
+LIBSSH2_API int libssh2_session_group_remove(LIBSSH2_SESSION *session);
+
+/*
+ * libssh2_session_group_next()
+ *
+ * Milliseconds until libssh2_session_group_run() has to be called next, or
+ * -1 if no session in GROUP has a deadline.
+ */
+LIBSSH2_API long libssh2_session_group_next(LIBSSH2_SESSION_GROUP *group);
+
+/*
+ * libssh2_session_group_run()
+ *
+ * Send the keepalives that are due and fill in TIMED_OUT with up to MAX
+ * sessions whose timeout passed. Returns how many there are, or a negative
+ * error code.
+ */
+LIBSSH2_API int libssh2_session_group_run(LIBSSH2_SESSION_GROUP *group,
+                                          LIBSSH2_SESSION **timed_out,
+                                          unsigned int max);
+
+/*
+ * libssh2_session_group_free()
+ *
+ * Free GROUP. The sessions still in it are left alone.
+ */
+LIBSSH2_API void libssh2_session_group_free(LIBSSH2_SESSION_GROUP *group);
+
+/*
+ * libssh2_session_pool_init()
+ *
+ * Create a pool of authenticated sessions keyed by host, port, user and
+ * identity. CONNECT sets up a new one when no session of a key has room
+ * for another channel, CLOSE tears down the ones the pool lets go.
+ */
+LIBSSH2_API LIBSSH2_SESSION_POOL *
+libssh2_session_pool_init(LIBSSH2_POOL_CONNECT_FUNC((*connect_func)),
+                          LIBSSH2_POOL_CLOSE_FUNC((*close_func)),
+                          void *abstract);
+
+/*
+ * libssh2_session_pool_limits()
+ *
+ * At most MAX_CHANNELS channels per session and, unless MAX_RATE is 0, no
+ * new channels on a session moving more than MAX_RATE bytes a second.
+ * Sessions without channels for IDLE_MS milliseconds get evicted.
+ */
+LIBSSH2_API int libssh2_session_pool_limits(LIBSSH2_SESSION_POOL *pool,
+                                            unsigned int max_channels,
+                                            unsigned long max_rate,
+                                            long idle_ms);
+
+/*
+ * libssh2_session_pool_channel()
+ *
+ * Open a session channel to HOST, PORT as USER with IDENTITY, on a pooled
+ * session with room for it or on a new one, and store it in CHANNEL.
+ * IDENTITY may be NULL. Returns 0 or a negative error code.
+ */
+LIBSSH2_API int libssh2_session_pool_channel(LIBSSH2_SESSION_POOL *pool,
+                                             const char *host, int port,
+                                             const char *user,
+                                             const char *identity,
+                                             LIBSSH2_CHANNEL **channel);
+
+/*
+ * libssh2_session_pool_release()
+ *
+ * Free CHANNEL, gotten from libssh2_session_pool_channel(), and give its
+ * room on the session back to the pool.
+ */
+LIBSSH2_API int libssh2_session_pool_release(LIBSSH2_CHANNEL *channel);
+
+/*
+ * libssh2_session_pool_evict()
+ *
+ * Close the sessions without channels that were idle for the pool's idle
+ * time or failed. Returns how many, call it on a timer.
+ */
+LIBSSH2_API int libssh2_session_pool_evict(LIBSSH2_SESSION_POOL *pool);
+
+/*
+ * libssh2_session_pool_free()
+ *
+ * Close all sessions of POOL and free it.
+ */
+LIBSSH2_API void libssh2_session_pool_free(LIBSSH2_SESSION_POOL *pool);
+
 /* NOTE NOTE NOTE
    libssh2_trace() has no function in builds that aren't built with debug
    enabled
@@ -1276,6 +1798,41 @@ LIBSSH2_API int libssh2_trace_sethandler(LIBSSH2_SESSION *session,
                                          void* context,
                                          libssh2_trace_handler_func callback);
 
+/*
+ * Binary trace events, see libssh2_trace_events(3). Unlike libssh2_trace()
+ * these work in all builds.
+ */
+#define LIBSSH2_EVENT_PACKET_SENT       1
+#define LIBSSH2_EVENT_PACKET_RECEIVED   2
+#define LIBSSH2_EVENT_SOCKET_SEND       3
+#define LIBSSH2_EVENT_SOCKET_RECV       4
+#define LIBSSH2_EVENT_KEX_START         5
+#define LIBSSH2_EVENT_KEX_DONE          6
+#define LIBSSH2_EVENT_CHANNEL_OPEN      7
+#define LIBSSH2_EVENT_CHANNEL_CLOSE     8
+#define LIBSSH2_EVENT_WINDOW_ADJUST_SENT 9
+#define LIBSSH2_EVENT_WINDOW_ADJUST_RECEIVED 10
+#define LIBSSH2_EVENT_SFTP_REQUEST      11
+#define LIBSSH2_EVENT_SFTP_RESPONSE     12
+
+typedef struct _LIBSSH2_TRACE_EVENT {
+    libssh2_uint64_t time_ns;   /* monotonic clock, in nanoseconds */
+    libssh2_uint64_t bytes;
+    unsigned int event;         /* LIBSSH2_EVENT_* */
+    unsigned int channel;       /* local channel id, 0 if none */
+    unsigned int request_id;    /* SFTP request id or packet sequence number */
+    unsigned int info;          /* message type, or an error code */
+} LIBSSH2_TRACE_EVENT;
+
+typedef void (*libssh2_trace_event_func)(LIBSSH2_SESSION*,
+                                         void*,
+                                         const LIBSSH2_TRACE_EVENT *,
+                                         size_t);
+LIBSSH2_API int libssh2_trace_events(LIBSSH2_SESSION *session,
+                                     void *context, size_t batch,
+                                     libssh2_trace_event_func callback);
+LIBSSH2_API int libssh2_trace_events_flush(LIBSSH2_SESSION *session);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -110,6 +110,12 @@ libssh2_publickey_list_fetch(LIBSSH2_PUBLICKEY *pkey,
 LIBSSH2_API void libssh2_publickey_list_free(LIBSSH2_PUBLICKEY *pkey,
                                              libssh2_publickey_list *pkey_list);
 
+/* Go through the key list one key at a time without keeping it: KEY and
+   its attributes point into buffers of PKEY that the next call reuses.
+   Returns 1 for a key, 0 after the last one. */
+LIBSSH2_API int libssh2_publickey_list_next(LIBSSH2_PUBLICKEY *pkey,
+                                            libssh2_publickey_list *key);
+
 LIBSSH2_API int libssh2_publickey_shutdown(LIBSSH2_PUBLICKEY *pkey);
 
 #ifdef __cplusplus
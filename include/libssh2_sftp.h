@@ -59,6 +59,13 @@ typedef struct _LIBSSH2_SFTP                LIBSSH2_SFTP;
 typedef struct _LIBSSH2_SFTP_HANDLE         LIBSSH2_SFTP_HANDLE;
 typedef struct _LIBSSH2_SFTP_ATTRIBUTES     LIBSSH2_SFTP_ATTRIBUTES;
 typedef struct _LIBSSH2_SFTP_STATVFS        LIBSSH2_SFTP_STATVFS;
+typedef struct _LIBSSH2_SFTP_OP             LIBSSH2_SFTP_OP;
+typedef struct _LIBSSH2_SFTP_DIRENT         LIBSSH2_SFTP_DIRENT;
+typedef struct _LIBSSH2_SFTP_TRANSFER       LIBSSH2_SFTP_TRANSFER;
+typedef struct _LIBSSH2_SFTP_TRANSFER_RESULT LIBSSH2_SFTP_TRANSFER_RESULT;
+typedef struct _LIBSSH2_SFTP_WALK           LIBSSH2_SFTP_WALK;
+typedef struct _LIBSSH2_SFTP_IOVEC          LIBSSH2_SFTP_IOVEC;
+typedef struct _LIBSSH2_SFTP_HANDLE_STATS   LIBSSH2_SFTP_HANDLE_STATS;
 
 /* Flags for open_ex() */
 #define LIBSSH2_SFTP_OPENFILE           0
@@ -79,6 +86,9 @@ typedef struct _LIBSSH2_SFTP_STATVFS        LIBSSH2_SFTP_STATVFS;
 #define LIBSSH2_SFTP_READLINK           1
 #define LIBSSH2_SFTP_REALPATH           2
 
+/* Flags for libssh2_sftp_read_ahead() and libssh2_sftp_handle_read_ahead() */
+#define LIBSSH2_SFTP_READ_AHEAD_ADAPTIVE    0x00000001
+
 /* SFTP attribute flag bits */
 #define LIBSSH2_SFTP_ATTR_SIZE              0x00000001
 #define LIBSSH2_SFTP_ATTR_UIDGID            0x00000002
@@ -116,6 +126,81 @@ struct _LIBSSH2_SFTP_STATVFS {
     libssh2_uint64_t  f_namemax;  /* maximum filename length */
 };
 
+/* A directory entry as returned by libssh2_sftp_readdir_batch(). The
+   strings are zero terminated and point into memory owned by the handle */
+struct _LIBSSH2_SFTP_DIRENT {
+    const char *name;
+    size_t name_len;
+    const char *longentry;
+    size_t longentry_len;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+};
+
+/* Transfer directions for libssh2_sftp_transfer_add() and
+   libssh2_sftp_transfer_add_range() */
+#define LIBSSH2_SFTP_DOWNLOAD       0
+#define LIBSSH2_SFTP_UPLOAD         1
+/* an upload that leaves the all-zero parts of the file as holes */
+#define LIBSSH2_SFTP_UPLOAD_SPARSE  2
+
+/* A finished file as returned by libssh2_sftp_transfer_run(). The strings
+   stay valid until the next call for the same transfer */
+struct _LIBSSH2_SFTP_TRANSFER_RESULT {
+    const char *remote;
+    const char *local;
+    int direction;
+    void *abstract;
+    int rc;                   /* 0 or a LIBSSH2_ERROR_* code */
+    unsigned long sftp_errno; /* LIBSSH2_FX_* if the server failed it */
+    libssh2_uint64_t bytes;
+};
+
+/* Called by libssh2_sftp_walk_run() for each entry of directory 'dir'
+   (zero terminated), or with a NULL 'entry' and a LIBSSH2_ERROR_* 'rc' for a
+   directory that could not be listed to the end. Returns 0 to go on,
+   LIBSSH2_SFTP_WALK_SKIP to not walk into the directory 'entry' is, or a
+   negative code to stop the walk with */
+#define LIBSSH2_SFTP_WALK_FUNC(name) \
+    int name(const char *dir, size_t dir_len, \
+             const LIBSSH2_SFTP_DIRENT *entry, int rc, void *abstract)
+
+#define LIBSSH2_SFTP_WALK_SKIP 1
+
+/* Requests libssh2_sftp_async_mode() makes go off without waiting for the
+   answer */
+#define LIBSSH2_SFTP_ASYNC_CLOSE 0x00000001
+#define LIBSSH2_SFTP_ASYNC_FSYNC 0x00000002
+
+/* Called with the outcome of an asynchronous request of LIBSSH2_SFTP_ASYNC_*
+   'type' when its answer arrives. 'rc' is 0 or a LIBSSH2_ERROR_* code,
+   'sftp_errno' the LIBSSH2_FX_* the server answered with */
+#define LIBSSH2_SFTP_ASYNC_FUNC(name) \
+    void name(LIBSSH2_SFTP *sftp, int type, int rc, \
+              unsigned long sftp_errno, void *abstract)
+
+/* A range of a file for libssh2_sftp_readv() and libssh2_sftp_writev().
+   'result' is filled in with the number of bytes read or written, or a
+   LIBSSH2_ERROR_* code if the server failed the range */
+struct _LIBSSH2_SFTP_IOVEC {
+    libssh2_uint64_t offset;
+    char *buffer;
+    size_t length;
+    ssize_t result;
+};
+
+/* Counters of an SFTP handle, see libssh2_sftp_handle_stats(3) */
+struct _LIBSSH2_SFTP_HANDLE_STATS {
+    libssh2_uint64_t bytes_read;
+    libssh2_uint64_t bytes_written;
+    libssh2_uint64_t read_requests;     /* FXP_READ requests sent */
+    libssh2_uint64_t write_requests;    /* FXP_WRITE requests sent */
+    /* read requests answered by the time they were needed, and those that
+       had to be waited for */
+    libssh2_uint64_t read_ahead_hits;
+    libssh2_uint64_t read_ahead_misses;
+    unsigned long requests_outstanding; /* sent, not answered yet */
+};
+
 /* SFTP filetypes */
 #define LIBSSH2_SFTP_TYPE_REGULAR           1
 #define LIBSSH2_SFTP_TYPE_DIRECTORY         2
@@ -244,6 +329,9 @@ LIBSSH2_API int libssh2_sftp_readdir_ex(LIBSSH2_SFTP_HANDLE *handle, \
 #define libssh2_sftp_readdir(handle, buffer, buffer_maxlen, attrs)      \
     libssh2_sftp_readdir_ex((handle), (buffer), (buffer_maxlen), NULL, 0, \
                             (attrs))
+LIBSSH2_API int libssh2_sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *handle,
+                                           LIBSSH2_SFTP_DIRENT *entries,
+                                           unsigned int max_entries);
 
 LIBSSH2_API ssize_t libssh2_sftp_write(LIBSSH2_SFTP_HANDLE *handle,
                                        const char *buffer, size_t count);
@@ -258,6 +346,27 @@ LIBSSH2_API void libssh2_sftp_seek64(LIBSSH2_SFTP_HANDLE *handle,
                                      libssh2_uint64_t offset);
 #define libssh2_sftp_rewind(handle) libssh2_sftp_seek64((handle), 0)
 
+LIBSSH2_API int libssh2_sftp_read_ahead(LIBSSH2_SFTP *sftp, size_t bytes,
+                                        unsigned int requests,
+                                        unsigned long flags);
+LIBSSH2_API int libssh2_sftp_handle_read_ahead(LIBSSH2_SFTP_HANDLE *handle,
+                                               size_t bytes,
+                                               unsigned int requests,
+                                               unsigned long flags);
+LIBSSH2_API ssize_t libssh2_sftp_readv(LIBSSH2_SFTP_HANDLE *handle,
+                                       LIBSSH2_SFTP_IOVEC *iov,
+                                       unsigned int iovcnt);
+LIBSSH2_API ssize_t libssh2_sftp_writev(LIBSSH2_SFTP_HANDLE *handle,
+                                        LIBSSH2_SFTP_IOVEC *iov,
+                                        unsigned int iovcnt);
+LIBSSH2_API int libssh2_sftp_write_behind(LIBSSH2_SFTP *sftp, size_t bytes,
+                                          unsigned int requests);
+LIBSSH2_API int libssh2_sftp_handle_write_behind(LIBSSH2_SFTP_HANDLE *handle,
+                                                 size_t bytes,
+                                                 unsigned int requests);
+LIBSSH2_API int libssh2_sftp_handle_stats(LIBSSH2_SFTP_HANDLE *handle,
+                                          LIBSSH2_SFTP_HANDLE_STATS *stats);
+
 LIBSSH2_API size_t libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle);
 LIBSSH2_API libssh2_uint64_t libssh2_sftp_tell64(LIBSSH2_SFTP_HANDLE *handle);
 
@@ -297,6 +406,36 @@ LIBSSH2_API int libssh2_sftp_statvfs(LIBSSH2_SFTP *sftp,
                                      size_t path_len,
                                      LIBSSH2_SFTP_STATVFS *st);
 
+LIBSSH2_API int libssh2_sftp_extension(LIBSSH2_SFTP *sftp, const char *name,
+                                       const char **data, size_t *data_len);
+
+LIBSSH2_API int libssh2_sftp_copy_data(LIBSSH2_SFTP_HANDLE *src,
+                                       libssh2_uint64_t src_offset,
+                                       libssh2_uint64_t length,
+                                       LIBSSH2_SFTP_HANDLE *dst,
+                                       libssh2_uint64_t dst_offset);
+
+LIBSSH2_API ssize_t libssh2_sftp_check_file(LIBSSH2_SFTP_HANDLE *handle,
+                                            const char *algorithms,
+                                            libssh2_uint64_t offset,
+                                            libssh2_uint64_t length,
+                                            size_t block_size,
+                                            char *algorithm,
+                                            size_t algorithm_maxlen,
+                                            unsigned char *hash,
+                                            size_t hash_maxlen);
+LIBSSH2_API ssize_t libssh2_sftp_check_file_name(LIBSSH2_SFTP *sftp,
+                                                 const char *path,
+                                                 unsigned int path_len,
+                                                 const char *algorithms,
+                                                 libssh2_uint64_t offset,
+                                                 libssh2_uint64_t length,
+                                                 size_t block_size,
+                                                 char *algorithm,
+                                                 size_t algorithm_maxlen,
+                                                 unsigned char *hash,
+                                                 size_t hash_maxlen);
+
 LIBSSH2_API int libssh2_sftp_mkdir_ex(LIBSSH2_SFTP *sftp,
                                       const char *path,
                                       unsigned int path_len, long mode);
@@ -324,6 +463,10 @@ LIBSSH2_API int libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp,
     libssh2_sftp_stat_ex((sftp), (path), strlen(path), LIBSSH2_SFTP_SETSTAT, \
                          (attrs))
 
+LIBSSH2_API int libssh2_sftp_attr_cache(LIBSSH2_SFTP *sftp,
+                                        unsigned long ttl_ms,
+                                        unsigned int max_entries);
+
 LIBSSH2_API int libssh2_sftp_symlink_ex(LIBSSH2_SFTP *sftp,
                                         const char *path,
                                         unsigned int path_len,
@@ -339,6 +482,52 @@ LIBSSH2_API int libssh2_sftp_symlink_ex(LIBSSH2_SFTP *sftp,
     libssh2_sftp_symlink_ex((sftp), (path), strlen(path), (target), (maxlen), \
                             LIBSSH2_SFTP_REALPATH)
 
+/* Operations with their own state, any number of which can be in flight on
+   the same SFTP instance */
+LIBSSH2_API LIBSSH2_SFTP_OP *
+libssh2_sftp_op_stat(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, int stat_type,
+                     const LIBSSH2_SFTP_ATTRIBUTES *attrs);
+LIBSSH2_API int libssh2_sftp_op_stat_result(LIBSSH2_SFTP_OP *op,
+                                            LIBSSH2_SFTP_ATTRIBUTES *attrs);
+LIBSSH2_API LIBSSH2_SFTP_OP *
+libssh2_sftp_op_open(LIBSSH2_SFTP *sftp, const char *filename,
+                     unsigned int filename_len, unsigned long flags,
+                     long mode, int open_type);
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+libssh2_sftp_op_open_result(LIBSSH2_SFTP_OP *op);
+LIBSSH2_API void libssh2_sftp_op_free(LIBSSH2_SFTP_OP *op);
+
+LIBSSH2_API LIBSSH2_SFTP_TRANSFER *
+libssh2_sftp_transfer_init(LIBSSH2_SFTP *sftp, unsigned int max_files,
+                           size_t max_bytes);
+LIBSSH2_API int libssh2_sftp_transfer_add(LIBSSH2_SFTP_TRANSFER *xfer,
+                                          const char *remote,
+                                          const char *local, int direction,
+                                          long mode, void *abstract);
+LIBSSH2_API int
+libssh2_sftp_transfer_add_range(LIBSSH2_SFTP_TRANSFER *xfer,
+                                const char *remote, const char *local,
+                                int direction, long mode,
+                                libssh2_uint64_t offset,
+                                libssh2_uint64_t length, void *abstract);
+LIBSSH2_API int
+libssh2_sftp_transfer_run(LIBSSH2_SFTP_TRANSFER *xfer,
+                          LIBSSH2_SFTP_TRANSFER_RESULT *result);
+LIBSSH2_API void libssh2_sftp_transfer_free(LIBSSH2_SFTP_TRANSFER *xfer);
+
+LIBSSH2_API LIBSSH2_SFTP_WALK *
+libssh2_sftp_walk_init(LIBSSH2_SFTP *sftp, const char *path,
+                       unsigned int path_len, unsigned int max_dirs,
+                       LIBSSH2_SFTP_WALK_FUNC((*callback)), void *abstract);
+LIBSSH2_API int libssh2_sftp_walk_run(LIBSSH2_SFTP_WALK *walk);
+LIBSSH2_API void libssh2_sftp_walk_free(LIBSSH2_SFTP_WALK *walk);
+
+LIBSSH2_API int
+libssh2_sftp_async_mode(LIBSSH2_SFTP *sftp, unsigned long flags,
+                        LIBSSH2_SFTP_ASYNC_FUNC((*callback)), void *abstract);
+LIBSSH2_API int libssh2_sftp_async_wait(LIBSSH2_SFTP *sftp);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
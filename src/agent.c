@@ -50,6 +50,20 @@
 #endif
 #include "userauth.h"
 #include "session.h"
+#include "thread.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#ifdef HAVE_POLL
+#include <poll.h>
+#endif
+
+#if defined(PF_UNIX) && defined(HAVE_O_NONBLOCK)
+/* sign requests of a shared agent are written back to back on the
+   connection and answered as they come in */
+#define AGENT_PIPELINING
+#endif
 
 /* Requests from client to agent for protocol 1 key operations */
 #define SSH_AGENTC_REQUEST_RSA_IDENTITIES 1
@@ -90,6 +104,17 @@
 #define SSH_AGENT_CONSTRAIN_LIFETIME 1
 #define SSH_AGENT_CONSTRAIN_CONFIRM 2
 
+/* longest answer taken from an agent, as long as OpenSSH's agent takes */
+#define AGENT_MAX_MSGLEN (256 * 1024)
+
+/* how long a session waiting for its answer sleeps on the connection before
+   it looks again, another thread may have read the answer meanwhile */
+#ifdef LIBSSH2_THREADS
+#define AGENT_WAIT_MS 10
+#else
+#define AGENT_WAIT_MS 1000
+#endif
+
 /* non-blocking mode on agent connection is not yet implemented, but
    for future use. */
 typedef enum {
@@ -127,6 +152,28 @@ struct agent_ops {
     agent_disconnect_func disconnect;
 };
 
+/* A sign request on a shared agent. The agent answers requests in the order
+   they were written, so the queue is also the order the answers come in. */
+struct agent_request {
+    struct list_node node;      /* in the agent's queue until answered */
+    LIBSSH2_AGENT *agent;
+    LIBSSH2_SESSION *session;   /* NULL once the session gave up on it */
+    unsigned char *request;     /* with the length in front */
+    size_t request_len;
+    size_t sent;
+    unsigned char *response;
+    size_t response_len;
+    size_t received;
+    int rc;                     /* why the request failed */
+    int done;
+};
+
+/* what agent_sign_shared() gets as its abstract pointer */
+struct agent_sign_ctx {
+    LIBSSH2_AGENT *agent;
+    struct agent_publickey *identity;
+};
+
 struct _LIBSSH2_AGENT
 {
     LIBSSH2_SESSION *session;  /* the session this "belongs to" */
@@ -138,8 +185,30 @@ struct _LIBSSH2_AGENT
     struct agent_transaction_ctx transctx;
     struct agent_publickey *identity;
     struct list_head head;              /* list of public keys */
+
+    /* set by libssh2_agent_init_shared(), 'session' is then the agent's own
+       and any number of sessions sign through the one connection */
+    int shared;
+    int listed;                 /* the identities are fetched */
+    int nonblocking;            /* the connection is in non-blocking mode */
+    struct list_head queue;     /* requests not answered yet, oldest first */
+    struct agent_request *next_send; /* first request not fully written */
+    unsigned char len_buf[4];   /* length of the answer being read */
+    size_t len_got;
+    int broken;                 /* error the connection failed with */
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_t lock;       /* guards the queue and the connection */
+#endif
 };
 
+#ifdef LIBSSH2_THREADS
+#define AGENT_LOCK(agent) pthread_mutex_lock(&(agent)->lock)
+#define AGENT_UNLOCK(agent) pthread_mutex_unlock(&(agent)->lock)
+#else
+#define AGENT_LOCK(agent) do {} while(0)
+#define AGENT_UNLOCK(agent) do {} while(0)
+#endif
+
 #ifdef PF_UNIX
 static int
 agent_connect_unix(LIBSSH2_AGENT *agent)
@@ -371,6 +440,88 @@ static struct {
     {NULL, NULL}
 };
 
+/*
+ * agent_sign_request()
+ *
+ * Stores a request to sign 'data' with 'identity' at 's', which has room for
+ * AGENT_SIGN_REQUEST_LEN() bytes. Returns the length stored.
+ */
+#define AGENT_SIGN_REQUEST_LEN(identity, data_len) \
+    (1 + 4 + (identity)->external.blob_len + 4 + (data_len) + 4)
+
+static size_t
+agent_sign_request(unsigned char *s, struct agent_publickey *identity,
+                   const unsigned char *data, size_t data_len)
+{
+    unsigned char *start = s;
+
+    *s++ = SSH2_AGENTC_SIGN_REQUEST;
+    /* key blob */
+    _libssh2_store_str(&s, (const char *)identity->external.blob,
+                       identity->external.blob_len);
+    /* data */
+    _libssh2_store_str(&s, (const char *)data, data_len);
+
+    /* flags */
+    _libssh2_store_u32(&s, 0);
+
+    return s - start;
+}
+
+/*
+ * agent_sign_response()
+ *
+ * Picks the signature out of the agent's answer to a sign request and
+ * stores a copy allocated with the session in '*sig'.
+ */
+static int
+agent_sign_response(LIBSSH2_SESSION *session, unsigned char *s, ssize_t len,
+                    unsigned char **sig, size_t *sig_len)
+{
+    ssize_t method_len;
+
+    len--;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    if (*s != SSH2_AGENT_SIGN_RESPONSE)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    s++;
+
+    /* Skip the entire length of the signature */
+    len -= 4;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    s += 4;
+
+    /* Skip signing method */
+    len -= 4;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    method_len = _libssh2_ntohu32(s);
+    s += 4;
+    len -= method_len;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    s += method_len;
+
+    /* Read the signature */
+    len -= 4;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+    *sig_len = _libssh2_ntohu32(s);
+    s += 4;
+    len -= *sig_len;
+    if (len < 0)
+        return LIBSSH2_ERROR_AGENT_PROTOCOL;
+
+    *sig = LIBSSH2_ALLOC(session, *sig_len);
+    if (!*sig)
+        return LIBSSH2_ERROR_ALLOC;
+    memcpy(*sig, s, *sig_len);
+
+    return 0;
+}
+
 static int
 agent_sign(LIBSSH2_SESSION *session, unsigned char **sig, size_t *sig_len,
            const unsigned char *data, size_t data_len, void **abstract)
@@ -378,29 +529,18 @@ agent_sign(LIBSSH2_SESSION *session, unsigned char **sig, size_t *sig_len,
     LIBSSH2_AGENT *agent = (LIBSSH2_AGENT *) (*abstract);
     agent_transaction_ctx_t transctx = &agent->transctx;
     struct agent_publickey *identity = agent->identity;
-    ssize_t len = 1 + 4 + identity->external.blob_len + 4 + data_len + 4;
-    ssize_t method_len;
-    unsigned char *s;
+    size_t len = AGENT_SIGN_REQUEST_LEN(identity, data_len);
     int rc;
 
     /* Create a request to sign the data */
     if (transctx->state == agent_NB_state_init) {
-        s = transctx->request = LIBSSH2_ALLOC(session, len);
+        transctx->request = LIBSSH2_ALLOC(session, len);
         if (!transctx->request)
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                   "out of memory");
 
-        *s++ = SSH2_AGENTC_SIGN_REQUEST;
-        /* key blob */
-        _libssh2_store_str(&s, (const char *)identity->external.blob,
-                           identity->external.blob_len);
-        /* data */
-        _libssh2_store_str(&s, (const char *)data, data_len);
-
-        /* flags */
-        _libssh2_store_u32(&s, 0);
-
-        transctx->request_len = s - transctx->request;
+        transctx->request_len = agent_sign_request(transctx->request,
+                                                   identity, data, data_len);
         transctx->state = agent_NB_state_request_created;
     }
 
@@ -421,73 +561,358 @@ agent_sign(LIBSSH2_SESSION *session, unsigned char **sig, size_t *sig_len,
     LIBSSH2_FREE(session, transctx->request);
     transctx->request = NULL;
 
-    len = transctx->response_len;
-    s = transctx->response;
-    len--;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
-    }
-    if (*s != SSH2_AGENT_SIGN_RESPONSE) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+    rc = agent_sign_response(session, transctx->response,
+                             transctx->response_len, sig, sig_len);
+
+  error:
+    LIBSSH2_FREE(session, transctx->request);
+    transctx->request = NULL;
+
+    LIBSSH2_FREE(session, transctx->response);
+    transctx->response = NULL;
+
+    return _libssh2_error(session, rc, "agent sign failure");
+}
+
+static void
+agent_request_free(LIBSSH2_AGENT *agent, struct agent_request *req)
+{
+    LIBSSH2_FREE(agent->session, req->request);
+    if (req->response)
+        LIBSSH2_FREE(agent->session, req->response);
+    LIBSSH2_FREE(agent->session, req);
+}
+
+/*
+ * agent_request_done()
+ *
+ * Marks a request taken off the queue as answered, or failed with 'rc'.
+ * Called with the agent lock held.
+ */
+static void
+agent_request_done(LIBSSH2_AGENT *agent, struct agent_request *req, int rc)
+{
+    req->rc = rc;
+    req->done = 1;
+    if (!req->session)
+        /* nobody waits for this one anymore */
+        agent_request_free(agent, req);
+}
+
+/*
+ * agent_fail()
+ *
+ * Fails every queued request with 'rc', the connection cannot be trusted to
+ * be in step with the agent anymore. Called with the agent lock held.
+ */
+static void
+agent_fail(LIBSSH2_AGENT *agent, int rc)
+{
+    struct agent_request *req;
+
+    agent->broken = rc;
+    while ((req = _libssh2_list_first(&agent->queue))) {
+        _libssh2_list_remove(&req->node);
+        agent_request_done(agent, req, rc);
     }
-    s++;
+    agent->next_send = NULL;
+    agent->len_got = 0;
+}
 
-    /* Skip the entire length of the signature */
-    len -= 4;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+#ifdef AGENT_PIPELINING
+/*
+ * agent_pump()
+ *
+ * Writes whatever the connection takes of the queued requests and reads the
+ * answers that arrived, without blocking. Called with the agent lock held.
+ */
+static void
+agent_pump(LIBSSH2_AGENT *agent)
+{
+    struct agent_request *req;
+    ssize_t rc;
+
+    while ((req = agent->next_send)) {
+        rc = LIBSSH2_SEND_FD(agent->session, agent->fd,
+                             req->request + req->sent,
+                             req->request_len - req->sent, 0);
+        if (rc == -EAGAIN)
+            break;
+        if (rc < 0) {
+            agent_fail(agent, LIBSSH2_ERROR_SOCKET_SEND);
+            return;
+        }
+        req->sent += rc;
+        if (req->sent < req->request_len)
+            break;
+        agent->next_send = _libssh2_list_next(&req->node);
     }
-    s += 4;
 
-    /* Skip signing method */
-    len -= 4;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+    while ((req = _libssh2_list_first(&agent->queue)) &&
+           req->sent == req->request_len) {
+        if (agent->len_got < sizeof agent->len_buf) {
+            rc = LIBSSH2_RECV_FD(agent->session, agent->fd,
+                                 agent->len_buf + agent->len_got,
+                                 sizeof agent->len_buf - agent->len_got, 0);
+            if (rc == -EAGAIN)
+                return;
+            if (rc <= 0) {
+                agent_fail(agent, LIBSSH2_ERROR_SOCKET_RECV);
+                return;
+            }
+            agent->len_got += rc;
+            if (agent->len_got < sizeof agent->len_buf)
+                continue;
+
+            req->response_len = _libssh2_ntohu32(agent->len_buf);
+            if (req->response_len > AGENT_MAX_MSGLEN) {
+                agent_fail(agent, LIBSSH2_ERROR_AGENT_PROTOCOL);
+                return;
+            }
+            req->response = LIBSSH2_ALLOC(agent->session,
+                                          req->response_len + 1);
+            if (!req->response) {
+                agent_fail(agent, LIBSSH2_ERROR_ALLOC);
+                return;
+            }
+        }
+
+        if (req->received < req->response_len) {
+            rc = LIBSSH2_RECV_FD(agent->session, agent->fd,
+                                 req->response + req->received,
+                                 req->response_len - req->received, 0);
+            if (rc == -EAGAIN)
+                return;
+            if (rc <= 0) {
+                agent_fail(agent, LIBSSH2_ERROR_SOCKET_RECV);
+                return;
+            }
+            req->received += rc;
+            if (req->received < req->response_len)
+                continue;
+        }
+
+        agent->len_got = 0;
+        _libssh2_list_remove(&req->node);
+        agent_request_done(agent, req, 0);
     }
-    method_len = _libssh2_ntohu32(s);
-    s += 4;
-    len -= method_len;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+}
+
+/*
+ * agent_wait()
+ *
+ * Drives the shared connection until 'req' is answered. Returns EAGAIN
+ * right away when 'session' is non-blocking.
+ */
+static int
+agent_wait(LIBSSH2_AGENT *agent, struct agent_request *req,
+           LIBSSH2_SESSION *session)
+{
+    time_t start_time = time(NULL);
+    int done;
+    int dir;
+    int rc;
+
+    for (;;) {
+        AGENT_LOCK(agent);
+        agent_pump(agent);
+        done = req->done;
+        dir = agent->next_send ? LIBSSH2_SESSION_BLOCK_OUTBOUND : 0;
+        AGENT_UNLOCK(agent);
+
+        if (done)
+            return req->rc;
+        if (!session->api_block_mode)
+            return LIBSSH2_ERROR_EAGAIN;
+        if (session->api_timeout > 0 &&
+            1000 * difftime(time(NULL), start_time) > session->api_timeout)
+            return LIBSSH2_ERROR_TIMEOUT;
+
+#ifdef HAVE_POLL
+        {
+            struct pollfd sockets[1];
+
+            sockets[0].fd = agent->fd;
+            sockets[0].events = POLLIN;
+            sockets[0].revents = 0;
+            if (dir)
+                sockets[0].events |= POLLOUT;
+
+            rc = poll(sockets, 1, AGENT_WAIT_MS);
+        }
+#else
+        {
+            fd_set rfd;
+            fd_set wfd;
+            struct timeval tv;
+
+            tv.tv_sec = AGENT_WAIT_MS / 1000;
+            tv.tv_usec = (AGENT_WAIT_MS % 1000) * 1000;
+
+            FD_ZERO(&rfd);
+            FD_SET(agent->fd, &rfd);
+            FD_ZERO(&wfd);
+            if (dir)
+                FD_SET(agent->fd, &wfd);
+
+            rc = select(agent->fd + 1, &rfd, &wfd, NULL, &tv);
+        }
+#endif
+        if (rc < 0 && errno != EINTR)
+            return LIBSSH2_ERROR_SOCKET_RECV;
     }
-    s += method_len;
+}
+#endif  /* AGENT_PIPELINING */
 
-    /* Read the signature */
-    len -= 4;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+/*
+ * agent_queue()
+ *
+ * Makes a request of the 'len' bytes at 'data' on behalf of 'session' and
+ * queues it on the shared connection.
+ */
+static struct agent_request *
+agent_queue(LIBSSH2_AGENT *agent, LIBSSH2_SESSION *session,
+            struct agent_publickey *identity,
+            const unsigned char *data, size_t data_len)
+{
+    struct agent_request *req;
+
+    req = LIBSSH2_CALLOC(agent->session, sizeof *req);
+    if (!req)
+        return NULL;
+    req->request = LIBSSH2_ALLOC(agent->session,
+                                 4 + AGENT_SIGN_REQUEST_LEN(identity,
+                                                            data_len));
+    if (!req->request) {
+        LIBSSH2_FREE(agent->session, req);
+        return NULL;
     }
-    *sig_len = _libssh2_ntohu32(s);
-    s += 4;
-    len -= *sig_len;
-    if (len < 0) {
-        rc = LIBSSH2_ERROR_AGENT_PROTOCOL;
-        goto error;
+    req->request_len = agent_sign_request(req->request + 4, identity,
+                                          data, data_len);
+    _libssh2_htonu32(req->request, req->request_len);
+    req->request_len += 4;
+    req->agent = agent;
+    req->session = session;
+
+    AGENT_LOCK(agent);
+    if (agent->broken || agent->fd == LIBSSH2_INVALID_SOCKET) {
+        req->rc = agent->broken ? agent->broken : LIBSSH2_ERROR_BAD_USE;
+        req->done = 1;
+    }
+#ifdef AGENT_PIPELINING
+    else if (agent->ops == &agent_ops_unix) {
+        if (!agent->nonblocking) {
+            int flags = fcntl(agent->fd, F_GETFL, 0);
+            fcntl(agent->fd, F_SETFL, flags | O_NONBLOCK);
+            agent->nonblocking = 1;
+        }
+        _libssh2_list_add(&agent->queue, &req->node);
+        if (!agent->next_send)
+            agent->next_send = req;
+        agent_pump(agent);
     }
+#endif
+    else {
+        /* this backend does one transaction at a time */
+        struct agent_transaction_ctx transctx;
+
+        memset(&transctx, 0, sizeof transctx);
+        transctx.request = req->request + 4;
+        transctx.request_len = req->request_len - 4;
+        transctx.state = agent_NB_state_request_created;
+        req->rc = agent->ops->transact(agent, &transctx);
+        req->response = transctx.response;
+        req->response_len = transctx.response_len;
+        req->done = 1;
+    }
+    AGENT_UNLOCK(agent);
 
-    *sig = LIBSSH2_ALLOC(session, *sig_len);
-    if (!*sig) {
-        rc = LIBSSH2_ERROR_ALLOC;
-        goto error;
+    return req;
+}
+
+/*
+ * agent_release()
+ *
+ * The session is done with the request, answered or not.
+ */
+static void
+agent_release(LIBSSH2_AGENT *agent, struct agent_request *req)
+{
+    AGENT_LOCK(agent);
+    if (req->done)
+        agent_request_free(agent, req);
+    else if (!req->sent) {
+        /* the agent never saw it */
+        if (agent->next_send == req)
+            agent->next_send = _libssh2_list_next(&req->node);
+        _libssh2_list_remove(&req->node);
+        agent_request_free(agent, req);
     }
-    memcpy(*sig, s, *sig_len);
+    else
+        /* its answer still has to be read off the connection */
+        req->session = NULL;
+    AGENT_UNLOCK(agent);
+}
 
-  error:
-    LIBSSH2_FREE(session, transctx->request);
-    transctx->request = NULL;
+/*
+ * agent_sign_shared()
+ *
+ * The sign callback for sessions authenticating through a shared agent.
+ * The request stays queued while the session returns EAGAIN.
+ */
+static int
+agent_sign_shared(LIBSSH2_SESSION *session, unsigned char **sig,
+                  size_t *sig_len, const unsigned char *data,
+                  size_t data_len, void **abstract)
+{
+    struct agent_sign_ctx *ctx = (struct agent_sign_ctx *) (*abstract);
+    LIBSSH2_AGENT *agent = ctx->agent;
+    struct agent_request *req = session->agent_req;
+    int rc;
 
-    LIBSSH2_FREE(session, transctx->response);
-    transctx->response = NULL;
+    if (!req) {
+        req = agent_queue(agent, session, ctx->identity, data, data_len);
+        if (!req)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "out of memory");
+        session->agent_req = req;
+    }
+
+    rc = req->rc;
+#ifdef AGENT_PIPELINING
+    if (!req->done) {
+        rc = agent_wait(agent, req, session);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc,
+                                  "Would block waiting for agent");
+    }
+#endif
+
+    session->agent_req = NULL;
+    if (!rc)
+        rc = agent_sign_response(session, req->response, req->response_len,
+                                 sig, sig_len);
+    agent_release(agent, req);
 
     return _libssh2_error(session, rc, "agent sign failure");
 }
 
+/*
+ * _libssh2_agent_forget()
+ *
+ * Drops the sign request a session that goes away had pending.
+ */
+void
+_libssh2_agent_forget(LIBSSH2_SESSION *session)
+{
+    struct agent_request *req = session->agent_req;
+
+    if (req) {
+        session->agent_req = NULL;
+        agent_release(req->agent, req);
+    }
+}
+
 static int
 agent_list_identities(LIBSSH2_AGENT *agent)
 {
@@ -672,6 +1097,35 @@ libssh2_agent_init(LIBSSH2_SESSION *session)
     agent->fd = LIBSSH2_INVALID_SOCKET;
     agent->session = session;
     _libssh2_list_init(&agent->head);
+    _libssh2_list_init(&agent->queue);
+
+    return agent;
+}
+
+/*
+ * libssh2_agent_init_shared
+ *
+ * Init an ssh-agent handle that is not tied to a session. Its connection
+ * and its list of identities serve every session authenticating with it.
+ */
+LIBSSH2_API LIBSSH2_AGENT *
+libssh2_agent_init_shared(void)
+{
+    LIBSSH2_SESSION *session = libssh2_session_init();
+    LIBSSH2_AGENT *agent;
+
+    if (!session)
+        return NULL;
+
+    agent = libssh2_agent_init(session);
+    if (!agent) {
+        libssh2_session_free(session);
+        return NULL;
+    }
+    agent->shared = 1;
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_init(&agent->lock, NULL);
+#endif
 
     return agent;
 }
@@ -690,8 +1144,11 @@ libssh2_agent_connect(LIBSSH2_AGENT *agent)
     for (i = 0; supported_backends[i].name; i++) {
         agent->ops = supported_backends[i].ops;
         rc = (agent->ops->connect)(agent);
-        if (!rc)
+        if (!rc) {
+            agent->nonblocking = 0;
+            agent->broken = 0;
             return 0;
+        }
     }
     return rc;
 }
@@ -706,10 +1163,24 @@ libssh2_agent_connect(LIBSSH2_AGENT *agent)
 LIBSSH2_API int
 libssh2_agent_list_identities(LIBSSH2_AGENT *agent)
 {
+    int rc;
+
+    if (agent->shared) {
+        /* sessions may be using the identities we have */
+        if (agent->listed)
+            return 0;
+        if (agent->nonblocking)
+            return _libssh2_error(agent->session, LIBSSH2_ERROR_BAD_USE,
+                                  "agent connection is in use");
+    }
+
     memset(&agent->transctx, 0, sizeof agent->transctx);
     /* Abondon the last fetched identities */
     agent_free_identities(agent);
-    return agent_list_identities(agent);
+    rc = agent_list_identities(agent);
+    if (!rc)
+        agent->listed = 1;
+    return rc;
 }
 
 /*
@@ -764,6 +1235,11 @@ libssh2_agent_userauth(LIBSSH2_AGENT *agent,
     void *abstract = agent;
     int rc;
 
+    if (agent->shared)
+        return _libssh2_error(agent->session, LIBSSH2_ERROR_BAD_USE,
+                              "shared agent needs a session to "
+                              "authenticate");
+
     if (agent->session->userauth_pblc_state == libssh2_NB_state_idle) {
         memset(&agent->transctx, 0, sizeof agent->transctx);
         agent->identity = identity->node;
@@ -779,6 +1255,87 @@ libssh2_agent_userauth(LIBSSH2_AGENT *agent,
     return rc;
 }
 
+/*
+ * libssh2_agent_userauth_session()
+ *
+ * Do publickey user authentication of 'session' with the help of ssh-agent.
+ * With a shared agent the sign requests of all sessions are queued on the
+ * one connection, a non-blocking session returns EAGAIN while its answer is
+ * pending.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int
+libssh2_agent_userauth_session(LIBSSH2_AGENT *agent,
+                               LIBSSH2_SESSION *session,
+                               const char *username,
+                               struct libssh2_agent_publickey *identity)
+{
+    struct agent_sign_ctx ctx;
+    void *abstract = &ctx;
+    int rc;
+
+    if (!agent->shared) {
+        if (session != agent->session)
+            return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                                  "agent belongs to another session");
+        return libssh2_agent_userauth(agent, username, identity);
+    }
+
+    ctx.agent = agent;
+    ctx.identity = identity->node;
+
+    BLOCK_ADJUST(rc, session,
+                 _libssh2_userauth_publickey(session, username,
+                                             strlen(username),
+                                             identity->blob,
+                                             identity->blob_len,
+                                             agent_sign_shared,
+                                             &abstract));
+    return rc;
+}
+
+/*
+ * libssh2_agent_get_fd()
+ *
+ * Returns the socket of the agent connection, for applications that wait
+ * for it with non-blocking sessions. LIBSSH2_INVALID_SOCKET when there is
+ * nothing to wait for.
+ */
+LIBSSH2_API libssh2_socket_t
+libssh2_agent_get_fd(LIBSSH2_AGENT *agent)
+{
+#ifdef PF_UNIX
+    if (agent->ops == &agent_ops_unix)
+        return agent->fd;
+#endif
+    return LIBSSH2_INVALID_SOCKET;
+}
+
+/*
+ * libssh2_agent_block_directions()
+ *
+ * Returns the directions the agent connection waits in for the queued
+ * requests of a shared agent to go out and their answers to come in.
+ */
+LIBSSH2_API int
+libssh2_agent_block_directions(LIBSSH2_AGENT *agent)
+{
+    int dir = 0;
+
+    if (!agent->shared)
+        return 0;
+
+    AGENT_LOCK(agent);
+    if (_libssh2_list_first(&agent->queue))
+        dir |= LIBSSH2_SESSION_BLOCK_INBOUND;
+    if (agent->next_send)
+        dir |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+    AGENT_UNLOCK(agent);
+
+    return dir;
+}
+
 /*
  * libssh2_agent_disconnect()
  *
@@ -789,9 +1346,18 @@ libssh2_agent_userauth(LIBSSH2_AGENT *agent,
 LIBSSH2_API int
 libssh2_agent_disconnect(LIBSSH2_AGENT *agent)
 {
+    int rc = 0;
+
+    if (agent->shared) {
+        AGENT_LOCK(agent);
+        agent_fail(agent, LIBSSH2_ERROR_SOCKET_DISCONNECT);
+        agent->listed = 0;
+    }
     if (agent->ops && agent->fd != LIBSSH2_INVALID_SOCKET)
-        return agent->ops->disconnect(agent);
-    return 0;
+        rc = agent->ops->disconnect(agent);
+    if (agent->shared)
+        AGENT_UNLOCK(agent);
+    return rc;
 }
 
 /*
@@ -807,5 +1373,15 @@ libssh2_agent_free(LIBSSH2_AGENT *agent) {
         libssh2_agent_disconnect(agent);
     }
     agent_free_identities(agent);
+    if (agent->shared) {
+        LIBSSH2_SESSION *session = agent->session;
+
+#ifdef LIBSSH2_THREADS
+        pthread_mutex_destroy(&agent->lock);
+#endif
+        LIBSSH2_FREE(session, agent);
+        libssh2_session_free(session);
+        return;
+    }
     LIBSSH2_FREE(agent->session, agent);
 }
@@ -39,6 +39,7 @@
  */
 
 #include "libssh2_priv.h"
+#include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -47,11 +48,17 @@
 #include <inttypes.h>
 #endif
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "channel.h"
 #include "transport.h"
 #include "packet.h"
 #include "session.h"
+#include "misc.h"
 
 /*
  *  _libssh2_channel_nextid
@@ -61,29 +68,291 @@
 uint32_t
 _libssh2_channel_nextid(LIBSSH2_SESSION * session)
 {
-    uint32_t id = session->next_channel;
+    /* Every local id is handed out here, so all channels in use have an id
+     * below next_channel and there is no need to look at them.
+     *
+     * Never reusing an id is a shortcut to avoid waiting for close packets on
+     * channels we've forgotten about, This *could* be a problem if we request
+     * and close 4 billion or so channels in too rapid succession for the
+     * remote end to respond, but the worst case scenario is that some data
+     * meant for another channel Gets picked up by the new one.... Pretty
+     * unlikely all told...
+     */
+    uint32_t id = session->next_channel++;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_CONN, "Allocated new channel ID#%lu",
+                   id);
+    return id;
+}
+
+static void
+channel_hash_insert(LIBSSH2_CHANNEL **table, uint32_t size,
+                    LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_CHANNEL **bucket = &table[channel->local.id & (size - 1)];
+
+    channel->hash_next = *bucket;
+    *bucket = channel;
+}
+
+/*
+ * channel_hash_rebuild
+ *
+ * Replace the id lookup table with one of the given size, filled from the
+ * session's channel list and listener queues. Returns non-zero if the new
+ * table could not be allocated, in which case the old one is left alone.
+ */
+static int
+channel_hash_rebuild(LIBSSH2_SESSION *session, uint32_t size)
+{
+    LIBSSH2_CHANNEL **table;
     LIBSSH2_CHANNEL *channel;
+    LIBSSH2_LISTENER *l;
+    uint32_t count = 0;
+
+    table = LIBSSH2_CALLOC(session, size * sizeof(LIBSSH2_CHANNEL *));
+    if (!table)
+        return -1;
 
-    channel = _libssh2_list_first(&session->channels);
+    for(channel = _libssh2_list_first(&session->channels);
+        channel;
+        channel = _libssh2_list_next(&channel->node)) {
+        channel_hash_insert(table, size, channel);
+        count++;
+    }
 
-    while (channel) {
-        if (channel->local.id > id) {
-            id = channel->local.id;
+    for(l = _libssh2_list_first(&session->listeners); l;
+        l = _libssh2_list_next(&l->node)) {
+        for(channel = _libssh2_list_first(&l->queue);
+            channel;
+            channel = _libssh2_list_next(&channel->node)) {
+            channel_hash_insert(table, size, channel);
+            count++;
         }
-        channel = _libssh2_list_next(&channel->node);
     }
 
-    /* This is a shortcut to avoid waiting for close packets on channels we've
-     * forgotten about, This *could* be a problem if we request and close 4
-     * billion or so channels in too rapid succession for the remote end to
-     * respond, but the worst case scenario is that some data meant for
-     * another channel Gets picked up by the new one.... Pretty unlikely all
-     * told...
-     */
-    session->next_channel = id + 1;
-    _libssh2_debug(session, LIBSSH2_TRACE_CONN, "Allocated new channel ID#%lu",
-                   id);
-    return id;
+    if (session->channel_hash)
+        LIBSSH2_FREE(session, session->channel_hash);
+    session->channel_hash = table;
+    session->channel_hash_size = size;
+    session->channel_hash_count = count;
+    return 0;
+}
+
+/*
+ * listener_bucket
+ *
+ * The session->listener_hash bucket of a host and port
+ */
+static uint32_t
+listener_bucket(const unsigned char *host, size_t host_len, int port)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < host_len; i++)
+        hash = (hash ^ host[i]) * 16777619U;
+    hash ^= (uint32_t)port * 2654435761U;
+
+    return (hash ^ (hash >> 16)) & (LIBSSH2_LISTENER_HASH_SIZE - 1);
+}
+
+/*
+ * _libssh2_listener_first
+ */
+LIBSSH2_LISTENER *
+_libssh2_listener_first(LIBSSH2_SESSION *session, const unsigned char *host,
+                        size_t host_len, int port)
+{
+    return session->listener_hash[listener_bucket(host, host_len, port)];
+}
+
+/*
+ * listener_hash_remove
+ *
+ * Take a listener that goes away out of session->listener_hash
+ */
+static void
+listener_hash_remove(LIBSSH2_LISTENER *listener)
+{
+    LIBSSH2_LISTENER **l =
+        &listener->session->listener_hash[
+            listener_bucket((unsigned char *)listener->host,
+                            listener->host_len, listener->port)];
+
+    while (*l) {
+        if (*l == listener) {
+            *l = listener->hash_next;
+            return;
+        }
+        l = &(*l)->hash_next;
+    }
+}
+
+/*
+ * _libssh2_channel_hash_add
+ *
+ * Make a channel that was just linked in findable by its local id. The table
+ * grows once it holds as many channels as it has buckets. If memory runs out
+ * the old table is kept, and without any table _libssh2_channel_locate()
+ * scans the lists instead.
+ */
+void
+_libssh2_channel_hash_add(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    if (!session->channel_hash ||
+        (session->channel_hash_count >= session->channel_hash_size)) {
+        uint32_t size = session->channel_hash ?
+            session->channel_hash_size * 2 : LIBSSH2_CHANNEL_HASH_INITIAL;
+
+        /* the rebuilt table already holds the new channel */
+        if (!channel_hash_rebuild(session, size) || !session->channel_hash)
+            return;
+    }
+
+    channel_hash_insert(session->channel_hash, session->channel_hash_size,
+                        channel);
+    session->channel_hash_count++;
+}
+
+/*
+ * _libssh2_channel_hash_remove
+ *
+ * Drop a channel from the id lookup table, if it is in there
+ */
+void
+_libssh2_channel_hash_remove(LIBSSH2_SESSION *session,
+                             LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_CHANNEL **bucket;
+
+    if (!session->channel_hash)
+        return;
+
+    bucket =
+        &session->channel_hash[channel->local.id &
+                               (session->channel_hash_size - 1)];
+    while (*bucket) {
+        if (*bucket == channel) {
+            *bucket = channel->hash_next;
+            channel->hash_next = NULL;
+            session->channel_hash_count--;
+            return;
+        }
+        bucket = &(*bucket)->hash_next;
+    }
+}
+
+/*
+ * channel_ready_link
+ *
+ * The link of a channel in the readable or the writable queue
+ */
+static struct channel_ready *
+channel_ready_link(LIBSSH2_CHANNEL *channel, int writable)
+{
+    return writable ? &channel->writable : &channel->readable;
+}
+
+/*
+ * _libssh2_channel_ready
+ *
+ * Queue a channel that got data, EOF or close, or more window, for
+ * libssh2_transport_read() or libssh2_transport_write() to report
+ */
+void
+_libssh2_channel_ready(LIBSSH2_CHANNEL *channel, int writable)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    struct channel_ready_queue *queue = writable ? &session->writable :
+        &session->readable;
+    struct channel_ready *link = channel_ready_link(channel, writable);
+
+    if (channel->poll_entry)
+        _libssh2_pollset_mark(channel->poll_entry);
+
+    /* channels still on a listener queue are nothing the application
+       knows of, channel_forward_accept() queues them later */
+    if (link->queued || (channel->node.head != &session->channels))
+        return;
+
+    link->queued = 1;
+    link->next = NULL;
+    if (queue->last)
+        channel_ready_link(queue->last, writable)->next = channel;
+    else
+        queue->first = channel;
+    queue->last = channel;
+}
+
+/*
+ * _libssh2_channel_ready_pop
+ *
+ * Take the oldest channel off the readable or writable queue
+ */
+LIBSSH2_CHANNEL *
+_libssh2_channel_ready_pop(LIBSSH2_SESSION *session, int writable)
+{
+    struct channel_ready_queue *queue = writable ? &session->writable :
+        &session->readable;
+    LIBSSH2_CHANNEL *channel = queue->first;
+    struct channel_ready *link;
+
+    if (!channel)
+        return NULL;
+
+    link = channel_ready_link(channel, writable);
+    queue->first = link->next;
+    if (!queue->first)
+        queue->last = NULL;
+    link->next = NULL;
+    link->queued = 0;
+    return channel;
+}
+
+static void relay_pair_free(struct _libssh2_relay_pair *pair);
+
+/*
+ * _libssh2_channel_unready
+ *
+ * Drop a channel that goes away from both queues
+ */
+void
+_libssh2_channel_unready(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int writable;
+
+    if (channel->poll_entry)
+        _libssh2_pollset_forget(channel->poll_entry);
+    if (channel->relay_pair)
+        relay_pair_free(channel->relay_pair);
+
+    for (writable = 0; writable < 2; writable++) {
+        struct channel_ready_queue *queue = writable ? &session->writable :
+            &session->readable;
+        LIBSSH2_CHANNEL *prev = NULL;
+        LIBSSH2_CHANNEL *c;
+
+        if (!channel_ready_link(channel, writable)->queued)
+            continue;
+
+        for (c = queue->first; c; c = channel_ready_link(c, writable)->next) {
+            if (c == channel) {
+                LIBSSH2_CHANNEL *next =
+                    channel_ready_link(c, writable)->next;
+                if (prev)
+                    channel_ready_link(prev, writable)->next = next;
+                else
+                    queue->first = next;
+                if (queue->last == channel)
+                    queue->last = prev;
+                break;
+            }
+            prev = c;
+        }
+        channel_ready_link(channel, writable)->queued = 0;
+    }
 }
 
 /*
@@ -97,6 +366,17 @@ _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
     LIBSSH2_CHANNEL *channel;
     LIBSSH2_LISTENER *l;
 
+    if (session->channel_hash) {
+        for(channel = session->channel_hash[channel_id &
+                                            (session->channel_hash_size - 1)];
+            channel;
+            channel = channel->hash_next) {
+            if (channel->local.id == channel_id)
+                return channel;
+        }
+        return NULL;
+    }
+
     for(channel = _libssh2_list_first(&session->channels);
         channel;
         channel = _libssh2_list_next(&channel->node)) {
@@ -121,17 +401,166 @@ _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
 }
 
 /*
- * _libssh2_channel_open
+ * channel_free_queues
  *
- * Establish a generic session channel
+ * Drop all data packets still queued for a channel
  */
-LIBSSH2_CHANNEL *
-_libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
-                      uint32_t channel_type_len,
-                      uint32_t window_size,
-                      uint32_t packet_size,
-                      const unsigned char *message,
-                      size_t message_len)
+static void
+channel_free_queues(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_PACKET *packet;
+
+    while ((packet = _libssh2_list_first(&channel->data_queue)) ||
+           (packet = _libssh2_list_first(&channel->ext_queue))) {
+        _libssh2_list_remove(&packet->node);
+        _libssh2_packet_free(session, packet);
+    }
+
+    session->read_buffered -= channel->read_avail;
+    channel->read_avail = 0;
+    channel->ext_avail = 0;
+}
+
+/*
+ * channel_open_confirmed
+ *
+ * Take what the peer said about its end of a channel from an
+ * SSH_MSG_CHANNEL_OPEN_CONFIRMATION
+ */
+static void
+channel_open_confirmed(LIBSSH2_CHANNEL *channel, const unsigned char *data)
+{
+    channel->remote.id = _libssh2_ntohu32(data + 5);
+    channel->local.window_size = _libssh2_ntohu32(data + 9);
+    channel->local.window_size_initial = _libssh2_ntohu32(data + 9);
+    channel->local.packet_size = _libssh2_ntohu32(data + 13);
+    _libssh2_histogram_add(channel->session, LIBSSH2_HISTOGRAM_CHANNEL_OPEN,
+                           _libssh2_time_us() - channel->open_sent_us);
+    _libssh2_event(channel->session, LIBSSH2_EVENT_CHANNEL_OPEN,
+                   channel->local.id, 0, 0, channel->local.window_size);
+    _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                   "Connection Established - ID: %lu/%lu win: %lu/%lu"
+                   " pack: %lu/%lu",
+                   channel->local.id, channel->remote.id,
+                   channel->local.window_size, channel->remote.window_size,
+                   channel->local.packet_size, channel->remote.packet_size);
+}
+
+/*
+ * channel_open_error
+ *
+ * Set the error for a channel open the peer refused for 'reason_code'
+ */
+static int
+channel_open_error(LIBSSH2_SESSION *session, uint32_t reason_code)
+{
+    switch (reason_code) {
+    case SSH_OPEN_ADMINISTRATIVELY_PROHIBITED:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (admininstratively prohibited)");
+    case SSH_OPEN_CONNECT_FAILED:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (connect failed)");
+    case SSH_OPEN_UNKNOWN_CHANNELTYPE:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (unknown channel type)");
+    case SSH_OPEN_RESOURCE_SHORTAGE:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure (resource shortage)");
+    default:
+        return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                              "Channel open failure");
+    }
+}
+
+/*
+ * channel_wait_open
+ *
+ * Wait for the answer to the open of a channel that was sent without
+ * waiting for it, see LIBSSH2_FLAG_CHANNEL_PIPELINE. Returns 0 once the
+ * channel is open, or the error it failed with.
+ */
+static int
+channel_wait_open(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int rc;
+
+    while (channel->open_pending) {
+        rc = _libssh2_transport_read(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc,
+                                  "Would block waiting for channel open");
+        else if (rc < 0)
+            return _libssh2_error(session, rc,
+                                  "Failed waiting for channel open");
+    }
+
+    if (channel->reply_rc == LIBSSH2_ERROR_CHANNEL_FAILURE)
+        return channel_open_error(session, channel->open_reason);
+
+    return 0;
+}
+
+/*
+ * _libssh2_channel_reply
+ *
+ * Take an answer to an open or a request that was sent without waiting for
+ * it. Returns 1 if the packet was one, 0 if it is to be queued as usual.
+ */
+int
+_libssh2_channel_reply(LIBSSH2_CHANNEL *channel, const unsigned char *data,
+                       size_t datalen)
+{
+    switch (data[0]) {
+    case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+    case SSH_MSG_CHANNEL_OPEN_FAILURE:
+        if (!channel->open_pending)
+            return 0;
+        channel->open_pending = 0;
+
+        if ((data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) &&
+            (datalen >= 17)) {
+            channel_open_confirmed(channel, data);
+            _libssh2_channel_ready(channel, 1);
+        }
+        else {
+            /* the peer has no end of this channel to close */
+            channel->open_reason = (datalen >= 9) ?
+                _libssh2_ntohu32(data + 5) : 0;
+            channel->reply_rc = LIBSSH2_ERROR_CHANNEL_FAILURE;
+            channel->local.eof = channel->local.close = 1;
+            channel->remote.eof = channel->remote.close = 1;
+            _libssh2_channel_ready(channel, 0);
+        }
+        return 1;
+
+    case SSH_MSG_CHANNEL_SUCCESS:
+    case SSH_MSG_CHANNEL_FAILURE:
+        if (!channel->requests_pending)
+            return 0;
+        channel->requests_pending--;
+
+        if ((data[0] == SSH_MSG_CHANNEL_FAILURE) && !channel->reply_rc)
+            channel->reply_rc = LIBSSH2_ERROR_CHANNEL_REQUEST_DENIED;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * channel_open
+ *
+ * Establish a generic session channel. Unless 'wait' is set, the channel is
+ * returned as soon as the request to open it is sent, see
+ * LIBSSH2_FLAG_CHANNEL_PIPELINE.
+ */
+static LIBSSH2_CHANNEL *
+channel_open(LIBSSH2_SESSION * session, const char *channel_type,
+             uint32_t channel_type_len, uint32_t window_size,
+             uint32_t packet_size, const unsigned char *message,
+             size_t message_len, int wait)
 {
     static const unsigned char reply_codes[3] = {
         SSH_MSG_CHANNEL_OPEN_CONFIRMATION,
@@ -154,6 +583,16 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         memset(&session->open_packet_requirev_state, 0,
                sizeof(session->open_packet_requirev_state));
 
+        /* The transport accepts packets up to MAX_SSH_PACKET_LIMIT; never
+           invite a peer to send channel packets that don't fit in one */
+        if (packet_size > MAX_CHANNEL_PACKET_LEN)
+            packet_size = MAX_CHANNEL_PACKET_LEN;
+        if (packet_size + (LIBSSH2_PACKET_MAXPAYLOAD -
+                           LIBSSH2_CHANNEL_PACKET_DEFAULT) >
+            session->packet.maxpayload)
+            session->packet.maxpayload = packet_size +
+                (LIBSSH2_PACKET_MAXPAYLOAD - LIBSSH2_CHANNEL_PACKET_DEFAULT);
+
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                        "Opening Channel - win %d pack %d", window_size,
                        packet_size);
@@ -186,6 +625,9 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
 
         _libssh2_list_add(&session->channels,
                           &session->open_channel->node);
+        _libssh2_channel_hash_add(session, session->open_channel);
+        _libssh2_channel_window_granted(session->open_channel,
+                                        (long)window_size);
 
         s = session->open_packet =
             LIBSSH2_ALLOC(session, session->open_packet_len);
@@ -221,7 +663,20 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
             goto channel_error;
         }
 
+        session->open_channel->open_sent_us = _libssh2_time_us();
         session->open_state = libssh2_NB_state_sent;
+
+        if (!wait) {
+            /* the answer is picked up by _libssh2_channel_reply() */
+            LIBSSH2_CHANNEL *channel = session->open_channel;
+
+            LIBSSH2_FREE(session, session->open_packet);
+            session->open_packet = NULL;
+            channel->open_pending = 1;
+            session->open_channel = NULL;
+            session->open_state = libssh2_NB_state_idle;
+            return channel;
+        }
     }
 
     if (session->open_state == libssh2_NB_state_sent) {
@@ -239,23 +694,15 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         }
 
         if (session->open_data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) {
-            session->open_channel->remote.id =
-                _libssh2_ntohu32(session->open_data + 5);
-            session->open_channel->local.window_size =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.window_size_initial =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.packet_size =
-                _libssh2_ntohu32(session->open_data + 13);
-            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                           "Connection Established - ID: %lu/%lu win: %lu/%lu"
-                           " pack: %lu/%lu",
-                           session->open_channel->local.id,
-                           session->open_channel->remote.id,
-                           session->open_channel->local.window_size,
-                           session->open_channel->remote.window_size,
-                           session->open_channel->local.packet_size,
-                           session->open_channel->remote.packet_size);
+            /* the confirmation is a round trip sample for the window
+               tuning */
+            libssh2_uint64_t rtt = _libssh2_time_us() -
+                session->open_channel->open_sent_us;
+            session->rtt_us = session->rtt_us ?
+                (session->rtt_us * 7 + rtt) / 8 : rtt;
+
+            channel_open_confirmed(session->open_channel,
+                                   session->open_data);
             LIBSSH2_FREE(session, session->open_packet);
             session->open_packet = NULL;
             LIBSSH2_FREE(session, session->open_data);
@@ -265,30 +712,9 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
             return session->open_channel;
         }
 
-        if (session->open_data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE) {
-            unsigned int reason_code = _libssh2_ntohu32(session->open_data + 5);
-            switch (reason_code) {
-            case SSH_OPEN_ADMINISTRATIVELY_PROHIBITED:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (admininstratively prohibited)");
-                break;
-            case SSH_OPEN_CONNECT_FAILED:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (connect failed)");
-                break;
-            case SSH_OPEN_UNKNOWN_CHANNELTYPE:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (unknown channel type)");
-                break;
-            case SSH_OPEN_RESOURCE_SHORTAGE:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure (resource shortage)");
-                break;
-            default:
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Channel open failure");
-            }
-        }
+        if (session->open_data[0] == SSH_MSG_CHANNEL_OPEN_FAILURE)
+            channel_open_error(session,
+                               _libssh2_ntohu32(session->open_data + 5));
     }
 
   channel_error:
@@ -302,25 +728,15 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         session->open_packet = NULL;
     }
     if (session->open_channel) {
-        unsigned char channel_id[4];
         LIBSSH2_FREE(session, session->open_channel->channel_type);
 
         _libssh2_list_remove(&session->open_channel->node);
+        _libssh2_channel_hash_remove(session, session->open_channel);
+        _libssh2_channel_window_granted(session->open_channel,
+            -(long)session->open_channel->remote.window_size);
 
         /* Clear out packets meant for this channel */
-        _libssh2_htonu32(channel_id, session->open_channel->local.id);
-        while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)
-               ||
-               (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)) {
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
-        }
+        channel_free_queues(session, session->open_channel);
 
         LIBSSH2_FREE(session, session->open_channel);
         session->open_channel = NULL;
@@ -330,6 +746,23 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
     return NULL;
 }
 
+/*
+ * _libssh2_channel_open
+ *
+ * Establish a generic session channel
+ */
+LIBSSH2_CHANNEL *
+_libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
+                      uint32_t channel_type_len,
+                      uint32_t window_size,
+                      uint32_t packet_size,
+                      const unsigned char *message,
+                      size_t message_len)
+{
+    return channel_open(session, channel_type, channel_type_len,
+                        window_size, packet_size, message, message_len, 1);
+}
+
 /*
  * libssh2_channel_open_ex
  *
@@ -347,10 +780,10 @@ libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *type,
         return NULL;
 
     BLOCK_ADJUST_ERRNO(ptr, session,
-                       _libssh2_channel_open(session, type, type_len,
-                                             window_size, packet_size,
-                                             (unsigned char *)msg,
-                                             msg_len));
+                       channel_open(session, type, type_len,
+                                    window_size, packet_size,
+                                    (unsigned char *)msg, msg_len,
+                                    !session->flag.channel_pipeline));
     return ptr;
 }
 
@@ -391,12 +824,11 @@ channel_direct_tcpip(LIBSSH2_SESSION * session, const char *host,
     }
 
     channel =
-        _libssh2_channel_open(session, "direct-tcpip",
-                              sizeof("direct-tcpip") - 1,
-                              LIBSSH2_CHANNEL_WINDOW_DEFAULT,
-                              LIBSSH2_CHANNEL_PACKET_DEFAULT,
-                              session->direct_message,
-                              session->direct_message_len);
+        channel_open(session, "direct-tcpip", sizeof("direct-tcpip") - 1,
+                     LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                     LIBSSH2_CHANNEL_PACKET_DEFAULT,
+                     session->direct_message, session->direct_message_len,
+                     !session->flag.channel_pipeline);
 
     if (!channel &&
         libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
@@ -553,11 +985,22 @@ channel_forward_listen(LIBSSH2_SESSION * session, const char *host,
                     else
                         listener->port = port;
 
+                    listener->host_len = session->fwdLstn_host_len;
                     listener->queue_size = 0;
                     listener->queue_maxsize = queue_maxsize;
 
                     /* append this to the parent's list of listeners */
                     _libssh2_list_add(&session->listeners, &listener->node);
+                    {
+                        LIBSSH2_LISTENER **bucket =
+                            &session->listener_hash[
+                                listener_bucket((unsigned char *)
+                                                listener->host,
+                                                listener->host_len,
+                                                listener->port)];
+                        listener->hash_next = *bucket;
+                        *bucket = listener;
+                    }
 
                     if (bound_port) {
                         *bound_port = listener->port;
@@ -682,8 +1125,12 @@ int _libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
         }
         queued = next;
     }
+    listener_hash_remove(listener);
     LIBSSH2_FREE(session, listener->host);
 
+    if (listener->poll_entry)
+        _libssh2_pollset_forget(listener->poll_entry);
+
     /* remove this entry from the parent's list of listeners */
     _libssh2_list_remove(&listener->node);
 
@@ -713,33 +1160,58 @@ libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
     return rc;
 }
 
+/*
+ * listener_pop
+ *
+ * Take the oldest channel off a listener's queue and hand it over to the
+ * application, NULL if none is queued
+ */
+static LIBSSH2_CHANNEL *
+listener_pop(LIBSSH2_LISTENER *listener)
+{
+    LIBSSH2_CHANNEL *channel = _libssh2_list_first(&listener->queue);
+
+    if (!channel)
+        return NULL;
+
+    /* detach channel from listener's queue */
+    _libssh2_list_remove(&channel->node);
+
+    listener->queue_size--;
+
+    /* add channel to session's channel list */
+    _libssh2_list_add(&channel->session->channels, &channel->node);
+
+    /* report what arrived for it while it was queued */
+    if (_libssh2_list_first(&channel->data_queue) ||
+        _libssh2_list_first(&channel->ext_queue) ||
+        channel->remote.eof)
+        _libssh2_channel_ready(channel, 0);
+
+    return channel;
+}
+
 /*
  * channel_forward_accept
  *
- * Accept a connection
+ * Accept a connection. The transport is only read if none is queued yet.
  */
 static LIBSSH2_CHANNEL *
 channel_forward_accept(LIBSSH2_LISTENER *listener)
 {
+    LIBSSH2_CHANNEL *channel = listener_pop(listener);
     int rc;
 
+    if (channel)
+        return channel;
+
     do {
         rc = _libssh2_transport_read(listener->session);
     } while (rc > 0);
 
-    if (_libssh2_list_first(&listener->queue)) {
-        LIBSSH2_CHANNEL *channel = _libssh2_list_first(&listener->queue);
-
-        /* detach channel from listener's queue */
-        _libssh2_list_remove(&channel->node);
-
-        listener->queue_size--;
-
-        /* add channel to session's channel list */
-        _libssh2_list_add(&channel->session->channels, &channel->node);
-
+    channel = listener_pop(listener);
+    if (channel)
         return channel;
-    }
 
     if (rc == LIBSSH2_ERROR_EAGAIN) {
         _libssh2_error(listener->session, LIBSSH2_ERROR_EAGAIN,
@@ -771,22 +1243,97 @@ libssh2_channel_forward_accept(LIBSSH2_LISTENER *listener)
 }
 
 /*
- * channel_setenv
+ * channel_forward_accept_batch
  *
- * Set an environment variable prior to requesting a shell/program/subsystem
+ * Accept all queued connections, up to 'max'
  */
-static int channel_setenv(LIBSSH2_CHANNEL *channel,
-                          const char *varname, unsigned int varname_len,
-                          const char *value, unsigned int value_len)
+static int
+channel_forward_accept_batch(LIBSSH2_LISTENER *listener,
+                             LIBSSH2_CHANNEL **channels, unsigned int max)
 {
-    LIBSSH2_SESSION *session = channel->session;
-    unsigned char *s, *data;
-    static const unsigned char reply_codes[3] =
-        { SSH_MSG_CHANNEL_SUCCESS, SSH_MSG_CHANNEL_FAILURE, 0 };
-    size_t data_len;
+    LIBSSH2_CHANNEL *channel;
+    unsigned int n = 0;
+    int rc;
+
+    do {
+        rc = _libssh2_transport_read(listener->session);
+    } while (rc > 0);
+
+    while ((n < max) && (channel = listener_pop(listener)))
+        channels[n++] = channel;
+
+    if (n)
+        return (int)n;
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return _libssh2_error(listener->session, LIBSSH2_ERROR_EAGAIN,
+                              "Would block waiting for packet");
+    if (rc < 0)
+        return _libssh2_error(listener->session, rc,
+                              "Failure reading from transport");
+    return 0;
+}
+
+/*
+ * libssh2_channel_forward_accept_batch
+ *
+ * Accept as many connections as there are queued, up to 'max'
+ */
+LIBSSH2_API int
+libssh2_channel_forward_accept_batch(LIBSSH2_LISTENER *listener,
+                                     LIBSSH2_CHANNEL **channels,
+                                     unsigned int max)
+{
+    int rc;
+
+    if(!listener || !channels || !max)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, listener->session,
+                 channel_forward_accept_batch(listener, channels, max));
+    return rc;
+}
+
+/*
+ * libssh2_channel_forward_accept_callback
+ *
+ * Have new connections handed to a callback as they arrive, instead of
+ * queued for libssh2_channel_forward_accept()
+ */
+LIBSSH2_API void
+libssh2_channel_forward_accept_callback(LIBSSH2_LISTENER *listener,
+                                        LIBSSH2_LISTENER_ACCEPT_FUNC(
+                                            (*callback)),
+                                        void *abstract)
+{
+    if(!listener)
+        return;
+
+    listener->accept_cb = callback;
+    listener->abstract = abstract;
+}
+
+/*
+ * channel_setenv
+ *
+ * Set an environment variable prior to requesting a shell/program/subsystem
+ */
+static int channel_setenv(LIBSSH2_CHANNEL *channel,
+                          const char *varname, unsigned int varname_len,
+                          const char *value, unsigned int value_len,
+                          int wait)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    unsigned char *s, *data;
+    static const unsigned char reply_codes[3] =
+        { SSH_MSG_CHANNEL_SUCCESS, SSH_MSG_CHANNEL_FAILURE, 0 };
+    size_t data_len;
     int rc;
 
     if (channel->setenv_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         /* 21 = packet_type(1) + channel_id(4) + request_len(4) +
          * request(3)"env" + want_reply(1) + varname_len(4) + value_len(4) */
         channel->setenv_packet_len = varname_len + value_len + 21;
@@ -840,6 +1387,13 @@ static int channel_setenv(LIBSSH2_CHANNEL *channel,
 
         _libssh2_htonu32(channel->setenv_local_channel, channel->local.id);
 
+        if (!wait) {
+            /* the answer is picked up by _libssh2_channel_reply() */
+            channel->requests_pending++;
+            channel->setenv_state = libssh2_NB_state_idle;
+            return 0;
+        }
+
         channel->setenv_state = libssh2_NB_state_sent;
     }
 
@@ -887,7 +1441,8 @@ libssh2_channel_setenv_ex(LIBSSH2_CHANNEL *channel,
 
     BLOCK_ADJUST(rc, channel->session,
                  channel_setenv(channel, varname, varname_len,
-                                value, value_len));
+                                value, value_len,
+                                !channel->session->flag.channel_pipeline));
     return rc;
 }
 
@@ -899,7 +1454,7 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
                                const char *term, unsigned int term_len,
                                const char *modes, unsigned int modes_len,
                                int width, int height,
-                               int width_px, int height_px)
+                               int width_px, int height_px, int wait)
 {
     LIBSSH2_SESSION *session = channel->session;
     unsigned char *s;
@@ -908,6 +1463,10 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
     int rc;
 
     if (channel->reqPTY_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         /* 41 = packet_type(1) + channel(4) + pty_req_len(4) + "pty_req"(7) +
          * want_reply(1) + term_len(4) + width(4) + height(4) + width_px(4) +
          * height_px(4) + modes_len(4) */
@@ -959,6 +1518,13 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
         }
         _libssh2_htonu32(channel->reqPTY_local_channel, channel->local.id);
 
+        if (!wait) {
+            /* the answer is picked up by _libssh2_channel_reply() */
+            channel->requests_pending++;
+            channel->reqPTY_state = libssh2_NB_state_idle;
+            return 0;
+        }
+
         channel->reqPTY_state = libssh2_NB_state_sent;
     }
 
@@ -1008,7 +1574,8 @@ libssh2_channel_request_pty_ex(LIBSSH2_CHANNEL *channel, const char *term,
     BLOCK_ADJUST(rc, channel->session,
                  channel_request_pty(channel, term, term_len, modes,
                                      modes_len, width, height,
-                                     width_px, height_px));
+                                     width_px, height_px,
+                                     !channel->session->flag.channel_pipeline));
     return rc;
 }
 
@@ -1022,6 +1589,10 @@ channel_request_pty_size(LIBSSH2_CHANNEL * channel, int width,
     int retcode = LIBSSH2_ERROR_PROTO;
 
     if (channel->reqPTY_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         channel->reqPTY_packet_len = 39;
 
         /* Zero the whole thing out */
@@ -1107,6 +1678,10 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
     int rc;
 
     if (channel->reqX11_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         /* 30 = packet_type(1) + channel(4) + x11_req_len(4) + "x11-req"(7) +
          * want_reply(1) + single_cnx(1) + proto_len(4) + cookie_len(4) +
          * screen_num(4) */
@@ -1241,10 +1816,10 @@ libssh2_channel_x11_req_ex(LIBSSH2_CHANNEL *channel, int single_connection,
  *
  * Primitive for libssh2_channel_(shell|exec|subsystem)
  */
-int
-_libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
-                                 const char *request, size_t request_len,
-                                 const char *message, size_t message_len)
+static int
+channel_process_startup(LIBSSH2_CHANNEL *channel,
+                        const char *request, size_t request_len,
+                        const char *message, size_t message_len, int wait)
 {
     LIBSSH2_SESSION *session = channel->session;
     unsigned char *s;
@@ -1258,6 +1833,10 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
     }
 
     if (channel->process_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         /* 10 = packet_type(1) + channel(4) + request_len(4) + want_reply(1) */
         channel->process_packet_len = request_len + 10;
 
@@ -1312,6 +1891,13 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
 
         _libssh2_htonu32(channel->process_local_channel, channel->local.id);
 
+        if (!wait) {
+            /* the answer is picked up by _libssh2_channel_reply() */
+            channel->requests_pending++;
+            channel->process_state = libssh2_NB_state_end;
+            return 0;
+        }
+
         channel->process_state = libssh2_NB_state_sent;
     }
 
@@ -1343,6 +1929,20 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
                           "channel-process-startup");
 }
 
+/*
+ * _libssh2_channel_process_startup
+ *
+ * Primitive for libssh2_channel_(shell|exec|subsystem)
+ */
+int
+_libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
+                                 const char *request, size_t request_len,
+                                 const char *message, size_t message_len)
+{
+    return channel_process_startup(channel, request, request_len,
+                                   message, message_len, 1);
+}
+
 /*
  * libssh2_channel_process_startup
  *
@@ -1359,8 +1959,10 @@ libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
         return LIBSSH2_ERROR_BAD_USE;
 
     BLOCK_ADJUST(rc, channel->session,
-                 _libssh2_channel_process_startup(channel, req, req_len,
-                                                  msg, msg_len));
+                 channel_process_startup(channel, req, req_len,
+                                         msg, msg_len,
+                                         !channel->session->
+                                         flag.channel_pipeline));
     return rc;
 }
 
@@ -1378,6 +1980,195 @@ libssh2_channel_set_blocking(LIBSSH2_CHANNEL * channel, int blocking)
         (void) _libssh2_session_set_blocking(channel->session, blocking);
 }
 
+/*
+ * libssh2_channel_cork
+ *
+ * While a channel is corked, its data packets are held back to go out
+ * together with later packets of the session in one send()
+ */
+LIBSSH2_API void
+libssh2_channel_cork(LIBSSH2_CHANNEL *channel, int cork)
+{
+    if(channel)
+        channel->corked = cork;
+}
+
+/*
+ * libssh2_channel_weight
+ *
+ * Set how big a share of the outbound queue the channel gets while the
+ * socket is full, relative to the other channels of the session
+ */
+LIBSSH2_API int
+libssh2_channel_weight(LIBSSH2_CHANNEL *channel, unsigned int weight)
+{
+    if(!channel || (weight > LIBSSH2_CHANNEL_WEIGHT_MAX))
+        return LIBSSH2_ERROR_BAD_USE;
+    if(channel->tx_queued) {
+        /* it is counted in the total of the channels with queued data */
+        channel->session->packet.oweights -= CHANNEL_WEIGHT(channel);
+        channel->weight = weight;
+        channel->session->packet.oweights += CHANNEL_WEIGHT(channel);
+    }
+    else
+        channel->weight = weight;
+    return 0;
+}
+
+/*
+ * libssh2_channel_pace
+ *
+ * Limit the data sent on the channel to 'rate' bytes per second
+ */
+LIBSSH2_API int
+libssh2_channel_pace(LIBSSH2_CHANNEL *channel, libssh2_uint64_t rate,
+                     size_t burst)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+    _libssh2_pace_init(&channel->pace, rate, burst);
+    channel->pace_until = 0;
+    return 0;
+}
+
+/*
+ * pace_fill
+ *
+ * Add the credit earned since the bucket was filled last, up to its burst.
+ * A bucket starts out full.
+ */
+static void
+pace_fill(struct pace_bucket *b, libssh2_uint64_t now)
+{
+    libssh2_int64_t full = (libssh2_int64_t)b->burst * 1000000;
+
+    if (!b->last_us)
+        b->credit = full;
+    else if (now > b->last_us) {
+        libssh2_uint64_t elapsed = now - b->last_us;
+        libssh2_uint64_t need = (libssh2_uint64_t)(full - b->credit);
+
+        if (elapsed > need / b->rate)
+            b->credit = full;
+        else
+            b->credit += (libssh2_int64_t)(elapsed * b->rate);
+    }
+    b->last_us = now;
+}
+
+/*
+ * channel_pace
+ *
+ * See if the buckets of the channel and the session let a data packet go
+ * now, and take what it costs. '*len' is cut down to the burst. Otherwise
+ * returns LIBSSH2_ERROR_EAGAIN, with 'pace_until' set to when it may go.
+ */
+static int
+channel_pace(LIBSSH2_CHANNEL *channel, size_t *len)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    struct pace_bucket *buckets[2];
+    int count = 0;
+    int i;
+    libssh2_uint64_t now = _libssh2_time_us();
+    libssh2_uint64_t wait = 0;
+
+    if (channel->pace.rate)
+        buckets[count++] = &channel->pace;
+    if (session->pace.rate)
+        buckets[count++] = &session->pace;
+
+    for (i = 0; i < count; i++) {
+        struct pace_bucket *b = buckets[i];
+
+        pace_fill(b, now);
+        if ((b->credit <= 0) &&
+            ((libssh2_uint64_t)-b->credit / b->rate + 1 > wait))
+            wait = (libssh2_uint64_t)-b->credit / b->rate + 1;
+    }
+
+    if (wait) {
+        channel->pace_until = now + wait;
+        /* nothing to send before then, but incoming data may need reading
+           in the meantime */
+        session->socket_block_directions = LIBSSH2_SESSION_BLOCK_INBOUND;
+        if (session->packet.oqueued)
+            session->socket_block_directions |=
+                LIBSSH2_SESSION_BLOCK_OUTBOUND;
+        return LIBSSH2_ERROR_EAGAIN;
+    }
+
+    channel->pace_until = 0;
+    for (i = 0; i < count; i++)
+        if (*len > buckets[i]->burst)
+            *len = buckets[i]->burst;
+    for (i = 0; i < count; i++)
+        buckets[i]->credit -= (libssh2_int64_t)*len * 1000000;
+    return 0;
+}
+
+/*
+ * channel_flush_queue
+ *
+ * Drop the packets of one channel queue that belong to the given stream(s)
+ */
+static void
+channel_flush_queue(LIBSSH2_CHANNEL *channel, struct list_head *queue,
+                    int streamid)
+{
+    LIBSSH2_PACKET *packet = _libssh2_list_first(queue);
+
+    while (packet) {
+        LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
+        unsigned char packet_type = packet->data[0];
+        long packet_stream_id =
+            (packet_type == SSH_MSG_CHANNEL_DATA) ? 0 :
+            _libssh2_ntohu32(packet->data + 5);
+
+        if ((streamid == LIBSSH2_CHANNEL_FLUSH_ALL)
+            || ((packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA)
+                && ((streamid == LIBSSH2_CHANNEL_FLUSH_EXTENDED_DATA)
+                    || (streamid == packet_stream_id)))
+            || ((packet_type == SSH_MSG_CHANNEL_DATA)
+                && (streamid == 0))) {
+            int bytes_to_flush = packet->data_len - packet->data_head;
+
+            _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                           "Flushing %d bytes of data from stream "
+                           "%lu on channel %lu/%lu",
+                           bytes_to_flush, packet_stream_id,
+                           channel->local.id, channel->remote.id);
+
+            /* It's one of the streams we wanted to flush */
+            channel->flush_refund_bytes += packet->data_len - 13;
+            channel->flush_flush_bytes += bytes_to_flush;
+            if (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA)
+                channel->ext_avail -= bytes_to_flush;
+
+            /* remove this packet from the channel's queue */
+            _libssh2_list_remove(&packet->node);
+            _libssh2_packet_free(channel->session, packet);
+        }
+        packet = next;
+    }
+}
+
+/*
+ * channel_stream_avail
+ *
+ * Number of bytes queued that a flush of 'streamid' would look at. All
+ * extended streams share one counter.
+ */
+static uint32_t
+channel_stream_avail(LIBSSH2_CHANNEL *channel, int streamid)
+{
+    if (streamid == LIBSSH2_CHANNEL_FLUSH_ALL)
+        return channel->read_avail;
+    if (streamid == 0)
+        return channel->read_avail - channel->ext_avail;
+    return channel->ext_avail;
+}
+
 /*
  * _libssh2_channel_flush
  *
@@ -1388,62 +2179,32 @@ int
 _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
 {
     if (channel->flush_state == libssh2_NB_state_idle) {
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
         channel->flush_refund_bytes = 0;
         channel->flush_flush_bytes = 0;
 
-        while (packet) {
-            LIBSSH2_PACKET *next = _libssh2_list_next(&packet->node);
-            unsigned char packet_type = packet->data[0];
-
-            if (((packet_type == SSH_MSG_CHANNEL_DATA)
-                 || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-                && (_libssh2_ntohu32(packet->data + 1) == channel->local.id)) {
-                /* It's our channel at least */
-                long packet_stream_id =
-                    (packet_type == SSH_MSG_CHANNEL_DATA) ? 0 :
-                    _libssh2_ntohu32(packet->data + 5);
-                if ((streamid == LIBSSH2_CHANNEL_FLUSH_ALL)
-                    || ((packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                        && ((streamid == LIBSSH2_CHANNEL_FLUSH_EXTENDED_DATA)
-                            || (streamid == packet_stream_id)))
-                    || ((packet_type == SSH_MSG_CHANNEL_DATA)
-                        && (streamid == 0))) {
-                    int bytes_to_flush = packet->data_len - packet->data_head;
-
-                    _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
-                                   "Flushing %d bytes of data from stream "
-                                   "%lu on channel %lu/%lu",
-                                   bytes_to_flush, packet_stream_id,
-                                   channel->local.id, channel->remote.id);
-
-                    /* It's one of the streams we wanted to flush */
-                    channel->flush_refund_bytes += packet->data_len - 13;
-                    channel->flush_flush_bytes += bytes_to_flush;
-
-                    LIBSSH2_FREE(channel->session, packet->data);
-
-                    /* remove this packet from the parent's list */
-                    _libssh2_list_remove(&packet->node);
-                    LIBSSH2_FREE(channel->session, packet);
-                }
-            }
-            packet = next;
-        }
+        /* merged extended data may sit on the data queue as well, the
+           byte counters tell when there is nothing to look for */
+        if (channel_stream_avail(channel, streamid))
+            channel_flush_queue(channel, &channel->data_queue, streamid);
+        if ((streamid != 0) && channel->ext_avail)
+            channel_flush_queue(channel, &channel->ext_queue, streamid);
+
+        channel->read_avail -= channel->flush_flush_bytes;
+        channel->session->read_buffered -= channel->flush_flush_bytes;
+        channel->remote.window_size -= channel->flush_flush_bytes;
+        _libssh2_channel_window_granted(channel,
+                                        -(long)channel->flush_flush_bytes);
 
         channel->flush_state = libssh2_NB_state_created;
     }
 
-    channel->read_avail -= channel->flush_flush_bytes;
-    channel->remote.window_size -= channel->flush_flush_bytes;
-
     if (channel->flush_refund_bytes) {
         int rc;
 
+        /* small refunds wait for the next adjustment or write */
         rc = _libssh2_channel_receive_window_adjust(channel,
                                                     channel->flush_refund_bytes,
-                                                    1, NULL);
+                                                    0, NULL);
         if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
     }
@@ -1551,12 +2312,67 @@ libssh2_channel_get_exit_signal(LIBSSH2_CHANNEL *channel,
     return LIBSSH2_ERROR_NONE;
 }
 
+/*
+ * _libssh2_channel_window_granted
+ *
+ * Keeps session->window_granted at the sum of the receive windows of all
+ * channels. A channel whose window moves is busy, and what the budget lent
+ * out of its window while it was idle counts again.
+ */
+void
+_libssh2_channel_window_granted(LIBSSH2_CHANNEL *channel, long delta)
+{
+    LIBSSH2_SESSION *session = channel->session;
+
+    if (channel->budget_idle) {
+        session->window_idle -= channel->budget_idle;
+        channel->budget_idle = 0;
+    }
+    channel->budget_busy = 1;
+    if (delta < 0)
+        session->window_granted -= (size_t)-delta;
+    else
+        session->window_granted += (size_t)delta;
+}
+
+/*
+ * read_budget_granted
+ *
+ * The receive window that counts against the read budget: all that is
+ * granted, but for what idle channels have yet to use. Once a second the
+ * channels whose window didn't move since the time before become idle, so
+ * that a window handed out to a channel that went quiet doesn't hold the
+ * busy ones back. Data that came in and wasn't read always counts.
+ */
+static size_t
+read_budget_granted(LIBSSH2_SESSION *session)
+{
+    libssh2_uint64_t now = _libssh2_time_us();
+
+    if (now - session->budget_sweep_us >= LIBSSH2_READ_BUDGET_IDLE_US) {
+        LIBSSH2_CHANNEL *c = _libssh2_list_first(&session->channels);
+
+        while (c) {
+            if (!c->budget_busy && !c->budget_idle &&
+                (c->remote.window_size > c->read_avail)) {
+                c->budget_idle = c->remote.window_size - c->read_avail;
+                session->window_idle += c->budget_idle;
+            }
+            c->budget_busy = 0;
+            c = _libssh2_list_next(&c->node);
+        }
+        session->budget_sweep_us = now;
+    }
+
+    return session->window_granted - session->window_idle;
+}
+
 /*
  * _libssh2_channel_receive_window_adjust
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the session's minimum adjustment and force is
+ * 0 the adjustment amount will be queued for a later packet.
  *
  * Calls _libssh2_error() !
  */
@@ -1566,15 +2382,19 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                                        unsigned char force,
                                        unsigned int *store)
 {
+    uint32_t minadjust = CHANNEL_MINADJUST(channel->session);
     int rc;
 
     if(store)
         *store = channel->remote.window_size;
 
     if (channel->adjust_state == libssh2_NB_state_idle) {
+        rc = channel_wait_open(channel);
+        if (rc)
+            return rc;
+
         if (!force
-            && (adjustment + channel->adjust_queue <
-                LIBSSH2_CHANNEL_MINADJUST)) {
+            && (adjustment + channel->adjust_queue < minadjust)) {
             _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
                            "Queueing %lu bytes for receive window adjustment "
                            "for channel %lu/%lu",
@@ -1590,6 +2410,29 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
         adjustment += channel->adjust_queue;
         channel->adjust_queue = 0;
 
+        if (channel->session->read_budget) {
+            /* keep the windows of all channels together within the
+               budget. What does not fit is not queued: readers ask for
+               it again once data has been read off some channel. */
+            size_t granted;
+
+            /* whatever this channel has, it isn't idle */
+            _libssh2_channel_window_granted(channel, 0);
+            granted = read_budget_granted(channel->session);
+
+            if (granted + adjustment > channel->session->read_budget) {
+                adjustment = (granted < channel->session->read_budget) ?
+                    (uint32_t)(channel->session->read_budget - granted) : 0;
+                _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                               "Window adjustment for channel %lu/%lu cut "
+                               "to %lu bytes by the read budget",
+                               channel->local.id, channel->remote.id,
+                               adjustment);
+                if (!adjustment || (!force && (adjustment < minadjust)))
+                    return 0;
+            }
+        }
+
         /* Adjust the window based on the block we just freed */
         channel->adjust_adjust[0] = SSH_MSG_CHANNEL_WINDOW_ADJUST;
         _libssh2_htonu32(&channel->adjust_adjust[1], channel->remote.id);
@@ -1617,6 +2460,11 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
     }
     else {
         channel->remote.window_size += adjustment;
+        _libssh2_channel_window_granted(channel, (long)adjustment);
+        channel->stats.window_adjusts_sent++;
+        channel->session->stats.window_adjusts_sent++;
+        _libssh2_event(channel->session, LIBSSH2_EVENT_WINDOW_ADJUST_SENT,
+                       channel->local.id, 0, 0, adjustment);
     }
 
     channel->adjust_state = libssh2_NB_state_idle;
@@ -1624,6 +2472,29 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
     return 0;
 }
 
+/*
+ * _libssh2_channel_adjust_flush
+ *
+ * Send the window adjustment a channel has queued, if any. It is corked, so
+ * that it goes out along with the packet sent next instead of on its own.
+ */
+int
+_libssh2_channel_adjust_flush(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int cork = session->packet.cork;
+    int rc;
+
+    if (!channel->adjust_queue &&
+        (channel->adjust_state == libssh2_NB_state_idle))
+        return 0;
+
+    session->packet.cork = 1;
+    rc = _libssh2_channel_receive_window_adjust(channel, 0, 1, NULL);
+    session->packet.cork = cork;
+    return rc;
+}
+
 /*
  * libssh2_channel_receive_window_adjust
  *
@@ -1750,64 +2621,51 @@ libssh2_channel_handle_extended_data(LIBSSH2_CHANNEL *channel,
 
 
 /*
- * _libssh2_channel_read
- *
- * Read data from a channel
+ * channel_stream_match
  *
- * It is important to not return 0 until the currently read channel is
- * complete. If we read stuff from the wire but it was no payload data to fill
- * in the buffer with, we MUST make sure to return LIBSSH2_ERROR_EAGAIN.
+ * Tell whether a queued data packet of this channel is to be returned when
+ * reading the given stream.
+ */
+static int
+channel_stream_match(LIBSSH2_CHANNEL *channel, LIBSSH2_PACKET *packet,
+                     int stream_id)
+{
+    /*
+     * Either we asked for a specific extended data stream
+     * (and data was available),
+     * or the standard stream (and data was available),
+     * or the standard stream with extended_data_merge
+     * enabled and data was available
+     */
+    return (stream_id
+            && (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
+            && (stream_id == (int) _libssh2_ntohu32(packet->data + 5)))
+        || (!stream_id && (packet->data[0] == SSH_MSG_CHANNEL_DATA))
+        || (!stream_id
+            && (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
+            && (channel->remote.extended_data_ignore_mode ==
+                LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE));
+}
+
+/*
+ * channel_queue_read
  *
- * The receive window must be maintained (enlarged) by the user of this
- * function.
+ * Copy data for the given stream out of one of the channel's receive queues,
+ * unlinking the packets that get drained. Returns the number of bytes copied,
+ * or with a NULL 'buf', the number of bytes dropped.
  */
-ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
-                              char *buf, size_t buflen)
+static int
+channel_queue_read(LIBSSH2_CHANNEL *channel, struct list_head *queue,
+                   int stream_id, char *buf, int buflen)
 {
     LIBSSH2_SESSION *session = channel->session;
-    int rc;
     int bytes_read = 0;
     int bytes_want;
     int unlink_packet;
-    LIBSSH2_PACKET *read_packet;
+    LIBSSH2_PACKET *read_packet = _libssh2_list_first(queue);
     LIBSSH2_PACKET *read_next;
 
-    _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                   "channel_read() wants %d bytes from channel %lu/%lu "
-                   "stream #%d",
-                   (int) buflen, channel->local.id, channel->remote.id,
-                   stream_id);
-
-    /* expand the receiving window first if it has become too narrow */
-    if( (channel->read_state == libssh2_NB_state_jump1) ||
-        (channel->remote.window_size < channel->remote.window_size_initial / 4 * 3 + buflen) ) {
-
-        uint32_t adjustment = channel->remote.window_size_initial + buflen - channel->remote.window_size;
-        if (adjustment < LIBSSH2_CHANNEL_MINADJUST)
-            adjustment = LIBSSH2_CHANNEL_MINADJUST;
-
-        /* the actual window adjusting may not finish so we need to deal with
-           this special state here */
-        channel->read_state = libssh2_NB_state_jump1;
-        rc = _libssh2_channel_receive_window_adjust(channel, adjustment,
-                                                    0, NULL);
-        if (rc)
-            return rc;
-
-        channel->read_state = libssh2_NB_state_idle;
-    }
-
-    /* Process all pending incoming packets. Tests prove that this way
-       produces faster transfers. */
-    do {
-        rc = _libssh2_transport_read(session);
-    } while (rc > 0);
-
-    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
-        return _libssh2_error(session, rc, "transport read");
-
-    read_packet = _libssh2_list_first(&session->packets);
-    while (read_packet && (bytes_read < (int) buflen)) {
+    while (read_packet && (bytes_read < buflen)) {
         /* previously this loop condition also checked for
            !channel->remote.close but we cannot let it do this:
 
@@ -1821,27 +2679,7 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
         /* In case packet gets destroyed during this iteration */
         read_next = _libssh2_list_next(&readpkt->node);
 
-        channel->read_local_id =
-            _libssh2_ntohu32(readpkt->data + 1);
-
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if ((stream_id
-             && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == channel->read_local_id)
-             && (stream_id == (int) _libssh2_ntohu32(readpkt->data + 5)))
-            || (!stream_id && (readpkt->data[0] == SSH_MSG_CHANNEL_DATA)
-                && (channel->local.id == channel->read_local_id))
-            || (!stream_id
-                && (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-                && (channel->local.id == channel->read_local_id)
-                && (channel->remote.extended_data_ignore_mode ==
-                    LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))) {
+        if (channel_stream_match(channel, readpkt, stream_id)) {
 
             /* figure out much more data we want to read */
             bytes_want = buflen - bytes_read;
@@ -1861,20 +2699,21 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
                            unlink_packet?" [ul]":"");
 
             /* copy data from this struct to the target buffer */
-            memcpy(&buf[bytes_read],
-                   &readpkt->data[readpkt->data_head], bytes_want);
+            if (buf)
+                memcpy(&buf[bytes_read],
+                       &readpkt->data[readpkt->data_head], bytes_want);
 
             /* advance pointer and counter */
             readpkt->data_head += bytes_want;
             bytes_read += bytes_want;
+            if (readpkt->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
+                channel->ext_avail -= bytes_want;
 
             /* if drained, remove from list */
             if (unlink_packet) {
-                /* detach readpkt from session->packets list */
+                /* detach readpkt from the channel's queue */
                 _libssh2_list_remove(&readpkt->node);
-
-                LIBSSH2_FREE(session, readpkt->data);
-                LIBSSH2_FREE(session, readpkt);
+                _libssh2_packet_free(session, readpkt);
             }
         }
 
@@ -1882,22 +2721,250 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
         read_packet = read_next;
     }
 
-    if (!bytes_read) {
-        /* If the channel is already at EOF or even closed, we need to signal
-           that back. We may have gotten that info while draining the incoming
-           transport layer until EAGAIN so we must not be fooled by that
-           return code. */
-        if(channel->remote.eof || channel->remote.close)
-            return 0;
-        else if(rc != LIBSSH2_ERROR_EAGAIN)
-            return 0;
+    return bytes_read;
+}
 
-        /* if the transport layer said EAGAIN then we say so as well */
-        return _libssh2_error(session, rc, "would block");
+/*
+ * _libssh2_channel_window_tune
+ *
+ * In LIBSSH2_WINDOW_AUTO mode the window a channel is kept topped up to is
+ * re-sized from the rate the channel was consumed at over at least two
+ * round trips. When the bandwidth-delay product that rate gives is more
+ * than half the window, the window held the transfer back and doubles, as
+ * far as the session's budget allows. When it is less than an eighth, as
+ * for an idle channel, the window halves.
+ */
+uint32_t _libssh2_channel_window_tune(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    uint32_t target = LIBSSH2_CHANNEL_WINDOW_TARGET(channel);
+    libssh2_uint64_t now, elapsed, bdp;
+    size_t want, others, floor;
+
+    if ((session->window_mode != LIBSSH2_WINDOW_AUTO) || !session->rtt_us)
+        return target;
+
+    now = _libssh2_time_us();
+    if (!channel->window_target) {
+        /* start measuring, and from now on count against the budget */
+        channel->window_target = target;
+        channel->window_used = 0;
+        channel->window_epoch = now;
+        session->window_committed += target;
+        return target;
+    }
+
+    elapsed = now - channel->window_epoch;
+    if (elapsed < 2 * session->rtt_us)
+        return target;
+
+    bdp = (libssh2_uint64_t)channel->window_used * session->rtt_us / elapsed;
+    others = session->window_committed - target;
+    floor = 2 * channel->remote.packet_size;
+    if (floor < LIBSSH2_CHANNEL_WINDOW_AUTO_MIN)
+        floor = LIBSSH2_CHANNEL_WINDOW_AUTO_MIN;
+
+    want = target;
+    if (bdp * 2 > target) {
+        want = (size_t)target * 2;
+        if (want > LIBSSH2_CHANNEL_WINDOW_AUTO_MAX)
+            want = LIBSSH2_CHANNEL_WINDOW_AUTO_MAX;
+        if (others + want > session->window_budget)
+            want = (session->window_budget > others + target) ?
+                session->window_budget - others : target;
+    }
+    else if ((bdp * 8 < target) && (target > floor)) {
+        want = target / 2;
+        if (want < floor)
+            want = floor;
     }
 
+    if (want != target) {
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "Window of channel %lu/%lu tuned from %lu to %lu "
+                       "(%lu bytes in %lu us, rtt %lu us)",
+                       channel->local.id, channel->remote.id,
+                       (unsigned long)target, (unsigned long)want,
+                       (unsigned long)channel->window_used,
+                       (unsigned long)elapsed,
+                       (unsigned long)session->rtt_us);
+        session->window_committed = others + want;
+        channel->window_target = (uint32_t)want;
+    }
+    channel->window_used = 0;
+    channel->window_epoch = now;
+
+    return channel->window_target;
+}
+
+/*
+ * channel_read_window
+ *
+ * Widen the receive window if it has become too narrow for 'buflen' more
+ * bytes. Returns non-zero if the window adjust didn't finish.
+ */
+static int
+channel_read_window(LIBSSH2_CHANNEL *channel, size_t buflen)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int rc;
+    uint32_t target;
+
+    target = LIBSSH2_CHANNEL_WINDOW_TARGET(channel);
+    if( (channel->read_state == libssh2_NB_state_jump1) ||
+        (channel->remote.window_size < target / 4 * 3 + buflen) ) {
+
+        uint32_t adjustment;
+
+        if (channel->read_state != libssh2_NB_state_jump1)
+            target = _libssh2_channel_window_tune(channel);
+        adjustment = (target + buflen > channel->remote.window_size) ?
+            target + buflen - channel->remote.window_size : 0;
+        if (adjustment < CHANNEL_MINADJUST(session))
+            adjustment = CHANNEL_MINADJUST(session);
+
+        /* the actual window adjusting may not finish so we need to deal with
+           this special state here */
+        channel->read_state = libssh2_NB_state_jump1;
+        rc = _libssh2_channel_receive_window_adjust(channel, adjustment,
+                                                    0, NULL);
+        if (rc)
+            return rc;
+
+        channel->read_state = libssh2_NB_state_idle;
+    }
+
+    return 0;
+}
+
+/*
+ * channel_read_prepare
+ *
+ * Widen the receive window first if it has become too narrow for 'buflen'
+ * more bytes, then process all pending incoming packets. Returns non-zero if
+ * the window adjust didn't finish or the transport failed, otherwise 0 with
+ * what the last transport read said, 0 or EAGAIN, in *transport_rc.
+ */
+static int
+channel_read_prepare(LIBSSH2_CHANNEL *channel, size_t buflen,
+                     int *transport_rc)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int rc;
+
+    rc = channel_read_window(channel, buflen);
+    if (rc)
+        return rc;
+
+    /* Process all pending incoming packets. Tests prove that this way
+       produces faster transfers. */
+    do {
+        rc = _libssh2_transport_read(session);
+    } while (rc > 0);
+
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "transport read");
+
+    *transport_rc = rc;
+    return 0;
+}
+
+/*
+ * channel_read_queues
+ *
+ * Take up to 'buflen' bytes of the given stream off the receive queues, in
+ * the order a read returns them, and account for them. The bytes are copied
+ * to 'buf' unless it is NULL.
+ */
+static int
+channel_read_queues(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
+                    size_t buflen)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int bytes_read;
+
+    /* extended data arriving in merge mode is on the data queue, so a read
+       of the standard stream mostly finds everything there */
+    if (stream_id)
+        bytes_read = channel_queue_read(channel, &channel->ext_queue,
+                                        stream_id, buf, (int) buflen);
+    else
+        bytes_read = channel_queue_read(channel, &channel->data_queue,
+                                        0, buf, (int) buflen);
+
+    if ((bytes_read < (int) buflen) &&
+        (channel->remote.extended_data_ignore_mode ==
+         LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))
+        bytes_read += channel_queue_read(channel,
+                                         stream_id ? &channel->data_queue :
+                                         &channel->ext_queue, stream_id,
+                                         buf ? &buf[bytes_read] : NULL,
+                                         (int) buflen - bytes_read);
+
     channel->read_avail -= bytes_read;
+    channel->stats.bytes_read += bytes_read;
+    session->read_buffered -= bytes_read;
     channel->remote.window_size -= bytes_read;
+    channel->window_used += bytes_read;
+    _libssh2_channel_window_granted(channel, -(long)bytes_read);
+
+    return bytes_read;
+}
+
+/*
+ * channel_read_empty
+ *
+ * What a read that found nothing queued returns: 0 at EOF, otherwise EAGAIN
+ * if the transport layer said so.
+ */
+static int
+channel_read_empty(LIBSSH2_CHANNEL *channel, int rc)
+{
+    /* If the channel is already at EOF or even closed, we need to signal
+       that back. We may have gotten that info while draining the incoming
+       transport layer until EAGAIN so we must not be fooled by that
+       return code. */
+    if(channel->remote.eof || channel->remote.close)
+        return 0;
+    else if(rc != LIBSSH2_ERROR_EAGAIN)
+        return 0;
+
+    /* if the transport layer said EAGAIN then we say so as well */
+    return _libssh2_error(channel->session, rc, "would block");
+}
+
+/*
+ * _libssh2_channel_read
+ *
+ * Read data from a channel
+ *
+ * It is important to not return 0 until the currently read channel is
+ * complete. If we read stuff from the wire but it was no payload data to fill
+ * in the buffer with, we MUST make sure to return LIBSSH2_ERROR_EAGAIN.
+ *
+ * The receive window must be maintained (enlarged) by the user of this
+ * function.
+ */
+ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
+                              char *buf, size_t buflen)
+{
+    int rc;
+    int transport_rc;
+    int bytes_read;
+
+    _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                   "channel_read() wants %d bytes from channel %lu/%lu "
+                   "stream #%d",
+                   (int) buflen, channel->local.id, channel->remote.id,
+                   stream_id);
+
+    rc = channel_read_prepare(channel, buflen, &transport_rc);
+    if (rc)
+        return rc;
+
+    bytes_read = channel_read_queues(channel, stream_id, buf, buflen);
+    if (!bytes_read)
+        return channel_read_empty(channel, transport_rc);
 
     return bytes_read;
 }
@@ -1939,6 +3006,222 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
     return rc;
 }
 
+/*
+ * channel_queue_view
+ *
+ * Point views[n] onwards at the data for the given stream left in the
+ * packets of one of the channel's receive queues. Returns the number of
+ * views filled in by now.
+ */
+static int
+channel_queue_view(LIBSSH2_CHANNEL *channel, struct list_head *queue,
+                   int stream_id, LIBSSH2_CHANNEL_VIEW *views, int n,
+                   int count)
+{
+    LIBSSH2_PACKET *packet;
+
+    for (packet = _libssh2_list_first(queue); packet && (n < count);
+         packet = _libssh2_list_next(&packet->node)) {
+        if (!channel_stream_match(channel, packet, stream_id) ||
+            (packet->data_len == packet->data_head))
+            continue;
+
+        views[n].data = (const char *)&packet->data[packet->data_head];
+        views[n].length = packet->data_len - packet->data_head;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * channel_read_views
+ *
+ * Point 'views' at the queued data of a stream, in the order a read would
+ * return it. Returns the number of views filled in.
+ */
+static int
+channel_read_views(LIBSSH2_CHANNEL *channel, int stream_id,
+                   LIBSSH2_CHANNEL_VIEW *views, int count)
+{
+    int n;
+
+    n = channel_queue_view(channel, stream_id ? &channel->ext_queue :
+                           &channel->data_queue, stream_id, views, 0, count);
+    if (channel->remote.extended_data_ignore_mode ==
+        LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE)
+        n = channel_queue_view(channel, stream_id ? &channel->data_queue :
+                               &channel->ext_queue, stream_id, views, n,
+                               count);
+    return n;
+}
+
+/*
+ * channel_queue_bytes
+ *
+ * The number of bytes for the given stream left in the packets of one of
+ * the channel's receive queues
+ */
+static size_t
+channel_queue_bytes(LIBSSH2_CHANNEL *channel, struct list_head *queue,
+                    int stream_id)
+{
+    LIBSSH2_PACKET *packet;
+    size_t bytes = 0;
+
+    for (packet = _libssh2_list_first(queue); packet;
+         packet = _libssh2_list_next(&packet->node)) {
+        if (channel_stream_match(channel, packet, stream_id))
+            bytes += packet->data_len - packet->data_head;
+    }
+
+    return bytes;
+}
+
+/*
+ * channel_read_queued
+ *
+ * The number of bytes of a stream a read could take off the receive queues
+ */
+static size_t
+channel_read_queued(LIBSSH2_CHANNEL *channel, int stream_id)
+{
+    size_t bytes;
+
+    bytes = channel_queue_bytes(channel, stream_id ? &channel->ext_queue :
+                                &channel->data_queue, stream_id);
+    if (channel->remote.extended_data_ignore_mode ==
+        LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE)
+        bytes += channel_queue_bytes(channel, stream_id ?
+                                     &channel->data_queue :
+                                     &channel->ext_queue, stream_id);
+    return bytes;
+}
+
+/*
+ * channel_read_peek
+ *
+ * Like _libssh2_channel_read(), but instead of copying it out, describe the
+ * queued data in 'views' and leave it where it is.
+ */
+static int
+channel_read_peek(LIBSSH2_CHANNEL *channel, int stream_id,
+                  LIBSSH2_CHANNEL_VIEW *views, int count)
+{
+    int rc;
+    int transport_rc;
+    int n;
+
+    rc = channel_read_prepare(channel, 0, &transport_rc);
+    if (rc)
+        return rc;
+
+    n = channel_read_views(channel, stream_id, views, count);
+    if (!n)
+        return channel_read_empty(channel, transport_rc);
+
+    return n;
+}
+
+/*
+ * libssh2_channel_read_peek_ex
+ *
+ * Have 'views' point at data received on a channel, in the packet buffers
+ * it arrived in, without reading it off the channel
+ */
+LIBSSH2_API int
+libssh2_channel_read_peek_ex(LIBSSH2_CHANNEL *channel, int stream_id,
+                             LIBSSH2_CHANNEL_VIEW *views, int count)
+{
+    int rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+    if(!views || (count < 1))
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_INVAL,
+                              "No room for views");
+
+    BLOCK_ADJUST(rc, channel->session,
+                 channel_read_peek(channel, stream_id, views, count));
+    return rc;
+}
+
+/*
+ * libssh2_channel_read_consume_ex
+ *
+ * Read 'count' bytes that libssh2_channel_read_peek_ex() pointed at off the
+ * channel, freeing the packets they were in
+ */
+LIBSSH2_API int
+libssh2_channel_read_consume_ex(LIBSSH2_CHANNEL *channel, int stream_id,
+                                size_t count)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    /* check first, so that a bad count leaves the queues as they were */
+    if (channel_read_queued(channel, stream_id) < count)
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_BAD_USE,
+                              "Consumed more than was received");
+
+    channel_read_queues(channel, stream_id, NULL, count);
+    return 0;
+}
+
+/*
+ * libssh2_channel_data_callback
+ *
+ * Have incoming data handed to a callback as it arrives, instead of queued
+ * for libssh2_channel_read_ex()
+ */
+LIBSSH2_API void
+libssh2_channel_data_callback(LIBSSH2_CHANNEL *channel,
+                              LIBSSH2_CHANNEL_DATA_FUNC((*callback)),
+                              void *abstract)
+{
+    if(!channel)
+        return;
+
+    channel->data_cb = callback;
+    channel->abstract = abstract;
+}
+
+/*
+ * _libssh2_channel_line_len
+ *
+ * Scan the standard stream's queued packets for a newline, without reading
+ * anything off them
+ */
+size_t
+_libssh2_channel_line_len(LIBSSH2_CHANNEL * channel, size_t maxlen)
+{
+    LIBSSH2_PACKET *packet;
+    size_t len = 0;
+
+    for (packet = _libssh2_list_first(&channel->data_queue);
+         packet && (len < maxlen);
+         packet = _libssh2_list_next(&packet->node)) {
+        const unsigned char *data;
+        const unsigned char *nl;
+        size_t n;
+
+        if (!channel_stream_match(channel, packet, 0))
+            continue;
+
+        data = &packet->data[packet->data_head];
+        n = packet->data_len - packet->data_head;
+        if (n > maxlen - len)
+            n = maxlen - len;
+
+        nl = memchr(data, '\n', n);
+        if (nl)
+            return len + (nl - data) + 1;
+        len += n;
+    }
+
+    return len;
+}
+
 /*
  * _libssh2_channel_packet_data_len
  *
@@ -1948,64 +3231,67 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
 size_t
 _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
 {
-    LIBSSH2_SESSION *session = channel->session;
     LIBSSH2_PACKET *read_packet;
-    uint32_t read_local_id;
+    uint32_t avail = stream_id ? channel->ext_avail :
+        channel->read_avail - channel->ext_avail;
 
-    read_packet = _libssh2_list_first(&session->packets);
-    if (read_packet == NULL)
+    if (!stream_id && (channel->remote.extended_data_ignore_mode ==
+                       LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))
+        avail = channel->read_avail;
+    if (!avail)
         return 0;
 
+    read_packet = _libssh2_list_first(stream_id ? &channel->ext_queue :
+                                      &channel->data_queue);
     while (read_packet) {
-        read_local_id = _libssh2_ntohu32(read_packet->data + 1);
-
-        /*
-         * Either we asked for a specific extended data stream
-         * (and data was available),
-         * or the standard stream (and data was available),
-         * or the standard stream with extended_data_merge
-         * enabled and data was available
-         */
-        if ((stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (stream_id == (int) _libssh2_ntohu32(read_packet->data + 5)))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             && (channel->local.id == read_local_id))
-            ||
-            (!stream_id
-             && (read_packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA)
-             && (channel->local.id == read_local_id)
-             && (channel->remote.extended_data_ignore_mode
-                 == LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE)))
-        {
+        if (channel_stream_match(channel, read_packet, stream_id))
             return (read_packet->data_len - read_packet->data_head);
-        }
         read_packet = _libssh2_list_next(&read_packet->node);
     }
 
+    if (channel->remote.extended_data_ignore_mode ==
+        LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE) {
+        read_packet = _libssh2_list_first(stream_id ? &channel->data_queue :
+                                          &channel->ext_queue);
+        while (read_packet) {
+            if (channel_stream_match(channel, read_packet, stream_id))
+                return (read_packet->data_len - read_packet->data_head);
+            read_packet = _libssh2_list_next(&read_packet->node);
+        }
+    }
+
     return 0;
 }
 
 /*
- * _libssh2_channel_write
+ * _libssh2_channel_write_prefixed
  *
- * Send data to a channel. Note that if this returns EAGAIN, the caller must
- * call this function again with the SAME input arguments.
+ * Send data to a channel, 'prefix' followed by 'buf', as if they were one
+ * buffer. The prefix goes into the same SSH packet as the start of 'buf'
+ * without 'buf' first being copied next to it. Note that if this returns
+ * EAGAIN, the caller must call this function again with the SAME input
+ * arguments.
  *
- * Returns: number of bytes sent, or if it returns a negative number, that is
- * the error code!
+ * Returns: number of bytes sent, counting both the prefix and buf, or if it
+ * returns a negative number, that is the error code!
  */
 ssize_t
-_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
-                       const unsigned char *buf, size_t buflen)
+_libssh2_channel_write_prefixed(LIBSSH2_CHANNEL *channel, int stream_id,
+                                const unsigned char *prefix,
+                                size_t prefix_len,
+                                const unsigned char *buf, size_t buflen)
 {
     int rc = 0;
     LIBSSH2_SESSION *session = channel->session;
     ssize_t wrote = 0; /* counter for this specific this call */
 
+    if (prefix_len > LIBSSH2_CHANNEL_WRITE_PREFIX_MAX) {
+        /* only a part of the prefix fits, send that and nothing else */
+        prefix_len = LIBSSH2_CHANNEL_WRITE_PREFIX_MAX;
+        buflen = 0;
+    }
+    buflen += prefix_len; /* from here on, the length of both */
+
     /* In theory we could split larger buffers into several smaller packets
      * but it turns out to be really hard and nasty to do while still offering
      * the API/prototype.
@@ -2046,18 +3332,41 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                                   "Failure while draining incoming flow");
         }
 
+        /* queued window credits ride along with the data */
+        if (channel->adjust_queue ||
+            (channel->adjust_state != libssh2_NB_state_idle)) {
+            int adjust_rc = _libssh2_channel_adjust_flush(channel);
+            if (adjust_rc)
+                return adjust_rc;
+        }
+
         if(channel->local.window_size <= 0) {
             /* there's no room for data so we stop */
+            if (!channel->window_wait_start) {
+                channel->stats.window_waits++;
+                channel->window_wait_start = _libssh2_time_us();
+            }
 
             /* Waiting on the socket to be writable would be wrong because we
              * would be back here immediately, but a readable socket might
              * herald an incoming window adjustment.
              */
             session->socket_block_directions = LIBSSH2_SESSION_BLOCK_INBOUND;
+            if (session->packet.oqueued)
+                /* queued packets still have to go out, though */
+                session->socket_block_directions |=
+                    LIBSSH2_SESSION_BLOCK_OUTBOUND;
 
             return (rc==LIBSSH2_ERROR_EAGAIN?rc:0);
         }
 
+        if (channel->window_wait_start) {
+            _libssh2_histogram_add(session, LIBSSH2_HISTOGRAM_WINDOW_WAIT,
+                                   _libssh2_time_us() -
+                                   channel->window_wait_start);
+            channel->window_wait_start = 0;
+        }
+
         channel->write_bufwrite = buflen;
 
         *(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA :
@@ -2084,9 +3393,23 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                            channel->remote.id, stream_id);
             channel->write_bufwrite = channel->local.packet_size;
         }
+        if (channel->write_bufwrite > MAX_CHANNEL_PACKET_LEN)
+            /* the peer takes more than we are willing to build */
+            channel->write_bufwrite = MAX_CHANNEL_PACKET_LEN;
+        if ((channel->pace.rate || session->pace.rate) &&
+            channel_pace(channel, &channel->write_bufwrite))
+            /* the rate allows no more yet */
+            return LIBSSH2_ERROR_EAGAIN;
         /* store the size here only, the buffer is passed in as-is to
-           _libssh2_transport_send() */
+           _libssh2_transport_send(). The (small) prefix is copied in right
+           after the channel header. */
         _libssh2_store_u32(&s, channel->write_bufwrite);
+        channel->write_prefix_len = prefix_len < channel->write_bufwrite ?
+            prefix_len : channel->write_bufwrite;
+        if (channel->write_prefix_len) {
+            memcpy(s, prefix, channel->write_prefix_len);
+            s += channel->write_prefix_len;
+        }
         channel->write_packet_len = s - channel->write_packet;
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
@@ -2098,9 +3421,14 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
     }
 
     if (channel->write_state == libssh2_NB_state_created) {
+        session->packet.cork = channel->corked;
+        session->packet.ochannel = channel;
         rc = _libssh2_transport_send(session, channel->write_packet,
                                      channel->write_packet_len,
-                                     buf, channel->write_bufwrite);
+                                     buf, channel->write_bufwrite -
+                                     channel->write_prefix_len);
+        session->packet.cork = 0;
+        session->packet.ochannel = NULL;
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return _libssh2_error(session, rc,
                                   "Unable to send channel data");
@@ -2112,6 +3440,7 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
         }
         /* Shrink local window size */
         channel->local.window_size -= channel->write_bufwrite;
+        channel->stats.bytes_written += channel->write_bufwrite;
 
         wrote += channel->write_bufwrite;
 
@@ -2133,6 +3462,23 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
     return LIBSSH2_ERROR_INVAL; /* reaching this point is really bad */
 }
 
+/*
+ * _libssh2_channel_write
+ *
+ * Send data to a channel. Note that if this returns EAGAIN, the caller must
+ * call this function again with the SAME input arguments.
+ *
+ * Returns: number of bytes sent, or if it returns a negative number, that is
+ * the error code!
+ */
+ssize_t
+_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
+                       const unsigned char *buf, size_t buflen)
+{
+    return _libssh2_channel_write_prefixed(channel, stream_id, NULL, 0,
+                                           buf, buflen);
+}
+
 /*
  * libssh2_channel_write_ex
  *
@@ -2153,6 +3499,224 @@ libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id,
     return rc;
 }
 
+/*
+ * channel_sendfile_buf
+ *
+ * Send what is in 'buf' in as many packets as go out without blocking.
+ * EAGAIN is only returned if nothing was sent; the next call then starts at
+ * the same byte of the file and so hands the same data to the packet that
+ * stalled.
+ */
+static ssize_t
+channel_sendfile_buf(LIBSSH2_CHANNEL *channel, const unsigned char *buf,
+                     size_t len)
+{
+    size_t sent = 0;
+    ssize_t rc;
+
+    while (sent < len) {
+        rc = _libssh2_channel_write(channel, 0, buf + sent, len - sent);
+        if (rc < 0)
+            return sent ? (ssize_t)sent : rc;
+        if (!rc)
+            /* the window is full */
+            break;
+        sent += rc;
+    }
+
+    return sent;
+}
+
+/*
+ * channel_sendfile
+ *
+ * Send up to 'count' bytes of the regular file open as 'fd', from 'offset'
+ * on. The file is mapped and the packets are encrypted straight from its
+ * pages, or where that is not possible, read a packet at a time.
+ */
+static ssize_t
+channel_sendfile(LIBSSH2_CHANNEL *channel, int fd, libssh2_uint64_t offset,
+                 size_t count)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    unsigned char *buf;
+    ssize_t rc;
+    ssize_t got;
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to stat file to send");
+
+    if (!S_ISREG(st.st_mode))
+        /* what was read from a pipe could not be read again for a packet
+           that has to be sent over */
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Only regular files can be sent");
+
+    /* beyond the end of the file there is nothing to send, and touching a
+       mapping there would fault */
+    if (offset >= (libssh2_uint64_t)st.st_size)
+        return 0;
+    if (count > (libssh2_uint64_t)st.st_size - offset)
+        count = (size_t)((libssh2_uint64_t)st.st_size - offset);
+    if (!count)
+        return 0;
+
+#ifdef HAVE_MMAP
+    {
+        libssh2_uint64_t page = (libssh2_uint64_t)sysconf(_SC_PAGESIZE);
+        size_t skip = (size_t)(offset % page);
+        void *map;
+
+        if (count > LIBSSH2_CHANNEL_SENDFILE_MAP)
+            count = LIBSSH2_CHANNEL_SENDFILE_MAP;
+        map = mmap(NULL, skip + count, PROT_READ, MAP_SHARED, fd,
+                   (off_t)(offset - skip));
+        if (map != MAP_FAILED) {
+            rc = channel_sendfile_buf(channel, (unsigned char *)map + skip,
+                                      count);
+            munmap(map, skip + count);
+            return rc;
+        }
+        /* fall back to reading it */
+    }
+#endif
+
+    if (count > 32700)
+        /* no more than _libssh2_channel_write() sends at once */
+        count = 32700;
+    if (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1)
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to seek in file to send");
+
+    buf = _libssh2_slab_alloc(session, count);
+    if (!buf)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate file buffer");
+    got = read(fd, buf, count);
+    if (got < 0)
+        rc = _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                            "Unable to read file to send");
+    else
+        rc = channel_sendfile_buf(channel, buf, got);
+    _libssh2_slab_free(session, buf, count);
+
+    return rc;
+}
+
+/*
+ * libssh2_channel_sendfile
+ *
+ * Send data from a file descriptor on a channel without copying it to an
+ * application buffer first
+ */
+LIBSSH2_API ssize_t
+libssh2_channel_sendfile(LIBSSH2_CHANNEL *channel, int fd,
+                         libssh2_uint64_t offset, size_t count)
+{
+    ssize_t rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, channel->session,
+                 channel_sendfile(channel, fd, offset, count));
+    return rc;
+}
+
+/*
+ * channel_recvfile
+ *
+ * Store up to 'count' bytes received on a channel in the file open as 'fd',
+ * from 'offset' on, writing it from the packets it arrived in. Only what the
+ * file took is read off the channel.
+ */
+static ssize_t
+channel_recvfile(LIBSSH2_CHANNEL *channel, int fd, libssh2_uint64_t offset,
+                 size_t count)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_CHANNEL_VIEW views[LIBSSH2_CHANNEL_RECVFILE_VIEWS];
+    struct stat st;
+    size_t len = 0;
+    ssize_t wrote;
+    int n;
+    int i;
+
+    n = channel_read_peek(channel, 0, views, LIBSSH2_CHANNEL_RECVFILE_VIEWS);
+    if (n <= 0)
+        return n;
+
+    for (i = 0; (i < n) && (len < count); i++) {
+        if (views[i].length > count - len)
+            views[i].length = count - len;
+        len += views[i].length;
+    }
+    n = i;
+
+    /* anything but a regular file, like a pipe or a socket, is written to
+       as it is */
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+        (lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1))
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to seek in file to receive into");
+
+#ifdef HAVE_SYS_UIO_H
+    {
+        struct iovec iov[LIBSSH2_CHANNEL_RECVFILE_VIEWS];
+
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = (void *)views[i].data;
+            iov[i].iov_len = views[i].length;
+        }
+        wrote = writev(fd, iov, n);
+    }
+#else
+    wrote = 0;
+    for (i = 0; i < n; i++) {
+        ssize_t rc = write(fd, views[i].data, views[i].length);
+        if (rc < 0) {
+            if (!wrote)
+                wrote = rc;
+            break;
+        }
+        wrote += rc;
+        if ((size_t)rc < views[i].length)
+            break;
+    }
+#endif
+    if (wrote <= 0)
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to write received data to file");
+
+    channel_read_queues(channel, 0, NULL, wrote);
+
+    return wrote;
+}
+
+/*
+ * libssh2_channel_recvfile
+ *
+ * Write data received on a channel to a file descriptor without copying it
+ * to an application buffer first
+ */
+LIBSSH2_API ssize_t
+libssh2_channel_recvfile(LIBSSH2_CHANNEL *channel, int fd,
+                         libssh2_uint64_t offset, size_t count)
+{
+    ssize_t rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+    if(!count)
+        return 0;
+
+    BLOCK_ADJUST(rc, channel->session,
+                 channel_recvfile(channel, fd, offset, count));
+    return rc;
+}
+
 /*
  * channel_send_eof
  *
@@ -2164,6 +3728,10 @@ static int channel_send_eof(LIBSSH2_CHANNEL *channel)
     unsigned char packet[5];    /* packet_type(1) + channelno(4) */
     int rc;
 
+    rc = channel_wait_open(channel);
+    if (rc)
+        return rc;
+
     _libssh2_debug(session, LIBSSH2_TRACE_CONN, "Sending EOF on channel %lu/%lu",
                    channel->local.id, channel->remote.id);
     packet[0] = SSH_MSG_CHANNEL_EOF;
@@ -2208,26 +3776,21 @@ libssh2_channel_send_eof(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int
 libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
+    int eof;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while (packet) {
-        if (((packet->data[0] == SSH_MSG_CHANNEL_DATA)
-             || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA))
-            && (channel->local.id == _libssh2_ntohu32(packet->data + 1))) {
-            /* There's data waiting to be read yet, mask the EOF status */
-            return 0;
-        }
-        packet = _libssh2_list_next(&packet->node);
-    }
+    BLOCK_LOCK(channel->session->lock);
+    if (_libssh2_list_first(&channel->data_queue) ||
+        _libssh2_list_first(&channel->ext_queue))
+        /* There's data waiting to be read yet, mask the EOF status */
+        eof = 0;
+    else
+        eof = channel->remote.eof;
+    BLOCK_UNLOCK(channel->session->lock);
 
-    return channel->remote.eof;
+    return eof;
 }
 
 /*
@@ -2294,6 +3857,19 @@ int _libssh2_channel_close(LIBSSH2_CHANNEL * channel)
     LIBSSH2_SESSION *session = channel->session;
     int rc = 0;
 
+    if (channel->open_pending) {
+        /* only an open end can be closed, and a refused one is closed
+           already */
+        rc = channel_wait_open(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        if (channel->open_pending) {
+            /* the transport failed */
+            channel->local.close = 1;
+            return rc;
+        }
+    }
+
     if (channel->local.close) {
         /* Already closed, act like we sent another close,
          * even though we didn't... shhhhhh */
@@ -2458,9 +4034,6 @@ libssh2_channel_wait_closed(LIBSSH2_CHANNEL *channel)
 int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 {
     LIBSSH2_SESSION *session = channel->session;
-    unsigned char channel_id[4];
-    unsigned char *data;
-    size_t data_len;
     int rc;
 
     assert(session);
@@ -2498,22 +4071,26 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
      */
 
     /* Clear out packets meant for this channel */
-    _libssh2_htonu32(channel_id, channel->local.id);
-    while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)
-           ||
-           (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA, &data,
-                                &data_len, 1, channel_id, 4) >= 0)) {
-        LIBSSH2_FREE(session, data);
-    }
+    channel_free_queues(session, channel);
 
     /* free "channel_type" */
     if (channel->channel_type) {
         LIBSSH2_FREE(session, channel->channel_type);
     }
 
+    session->window_committed -= channel->window_target;
+    _libssh2_channel_window_granted(channel,
+                                    -(long)channel->remote.window_size);
+
+    _libssh2_event(session, LIBSSH2_EVENT_CHANNEL_CLOSE, channel->local.id,
+                   0, 0, channel->stats.bytes_read +
+                   channel->stats.bytes_written);
+
     /* Unlink from channel list */
+    _libssh2_channel_unready(channel);
     _libssh2_list_remove(&channel->node);
+    _libssh2_channel_hash_remove(session, channel);
+    _libssh2_transport_forget(session, channel);
 
     /*
      * Make sure all memory used in the state variables are free
@@ -2552,6 +4129,85 @@ libssh2_channel_free(LIBSSH2_CHANNEL *channel)
     BLOCK_ADJUST(rc, channel->session, _libssh2_channel_free(channel));
     return rc;
 }
+/*
+ * channel_wait_replies
+ *
+ * Wait until the open and the requests sent on a channel without waiting
+ * are all answered
+ */
+static int
+channel_wait_replies(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    int rc;
+
+    rc = channel_wait_open(channel);
+    if (rc)
+        return rc;
+
+    while (channel->requests_pending) {
+        rc = _libssh2_transport_read(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return _libssh2_error(session, rc,
+                                  "Would block waiting for channel replies");
+        else if (rc < 0)
+            return _libssh2_error(session, rc,
+                                  "Failed waiting for channel replies");
+    }
+
+    if (channel->reply_rc)
+        return _libssh2_error(session, channel->reply_rc,
+                              "Channel request denied");
+
+    return 0;
+}
+
+/*
+ * libssh2_channel_wait_replies
+ *
+ * Collect the answers to the open and requests sent for a channel with
+ * LIBSSH2_FLAG_CHANNEL_PIPELINE set
+ */
+LIBSSH2_API int
+libssh2_channel_wait_replies(LIBSSH2_CHANNEL *channel)
+{
+    int rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, channel->session, channel_wait_replies(channel));
+    return rc;
+}
+
+/*
+ * libssh2_channel_stats
+ *
+ * Copy the counters of a channel, along with how many packets are waiting
+ * to be read and how many requests to be answered
+ */
+LIBSSH2_API int
+libssh2_channel_stats(LIBSSH2_CHANNEL *channel, LIBSSH2_CHANNEL_STATS *stats)
+{
+    LIBSSH2_PACKET *packet;
+
+    if(!channel || !stats)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    *stats = channel->stats;
+    stats->packets_queued = 0;
+    for (packet = _libssh2_list_first(&channel->data_queue); packet;
+         packet = _libssh2_list_next(&packet->node))
+        stats->packets_queued++;
+    for (packet = _libssh2_list_first(&channel->ext_queue); packet;
+         packet = _libssh2_list_next(&packet->node))
+        stats->packets_queued++;
+    stats->requests_pending = channel->requests_pending +
+        (channel->open_pending ? 1 : 0);
+
+    return 0;
+}
+
 /*
  * libssh2_channel_window_read_ex
  *
@@ -2574,28 +4230,26 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
     }
 
     if (read_avail) {
-        size_t bytes_queued = 0;
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
-
-        while (packet) {
-            unsigned char packet_type = packet->data[0];
-
-            if (((packet_type == SSH_MSG_CHANNEL_DATA)
-                 || (packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA))
-                && (_libssh2_ntohu32(packet->data + 1) == channel->local.id)) {
-                bytes_queued += packet->data_len - packet->data_head;
-            }
-
-            packet = _libssh2_list_next(&packet->node);
-        }
-
-        *read_avail = bytes_queued;
+        *read_avail = channel->read_avail;
     }
 
     return channel->remote.window_size;
 }
 
+/*
+ * libssh2_channel_read_buffered
+ *
+ * Returns the number of bytes received on the channel and not read yet
+ */
+LIBSSH2_API size_t
+libssh2_channel_read_buffered(LIBSSH2_CHANNEL *channel)
+{
+    if(!channel)
+        return 0;
+
+    return channel->read_avail;
+}
+
 /*
  * libssh2_channel_window_write_ex
  *
@@ -2619,3 +4273,530 @@ libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel,
 
     return channel->local.window_size;
 }
+
+/* ******************************* *
+ * Socket and channel relay        *
+ * ******************************* */
+
+/*
+ * relay_pair_free
+ *
+ * Take a pair out of its relay. The socket and the channel are left alone.
+ */
+static void
+relay_pair_free(struct _libssh2_relay_pair *pair)
+{
+    LIBSSH2_RELAY *relay = pair->relay;
+    LIBSSH2_SESSION *session = relay->session;
+
+    if (relay->stalled == pair)
+        /* the send it left over is given up with it */
+        relay->stalled = NULL;
+    _libssh2_list_remove(&pair->node);
+    relay->npairs--;
+    pair->channel->relay_pair = NULL;
+    LIBSSH2_FREE(session, pair->buf);
+    LIBSSH2_FREE(session, pair);
+}
+
+/*
+ * relay_pair_fail
+ *
+ * Stop relaying a pair because of 'rc'
+ */
+static void
+relay_pair_fail(struct _libssh2_relay_pair *pair, int rc)
+{
+    if (!pair->rc)
+        pair->rc = rc;
+    pair->done = 1;
+}
+
+/*
+ * relay_pair_stall
+ *
+ * A send on the session returned EAGAIN. If it left a packet half sent, the
+ * same call has to be made again before any other pair sends anything.
+ */
+static void
+relay_pair_stall(struct _libssh2_relay_pair *pair, int stall)
+{
+    if (pair->channel->session->packet.olen) {
+        pair->stall = stall;
+        pair->relay->stalled = pair;
+    }
+}
+
+/*
+ * relay_to_socket
+ *
+ * Send what the channel received on to the socket, from the packets it came
+ * in. Once the channel has no more to send, the socket is shut down for
+ * sending.
+ */
+static void
+relay_to_socket(struct _libssh2_relay_pair *pair)
+{
+    LIBSSH2_CHANNEL *channel = pair->channel;
+    LIBSSH2_CHANNEL_VIEW views[LIBSSH2_CHANNEL_RECVFILE_VIEWS];
+    ssize_t rc;
+    size_t sent;
+    int rounds;
+    int n;
+    int i;
+
+    pair->sock_full = 0;
+    for (rounds = 0; rounds < LIBSSH2_RELAY_ROUNDS; rounds++) {
+        n = channel_read_views(channel, 0, views,
+                               LIBSSH2_CHANNEL_RECVFILE_VIEWS);
+        if (!n) {
+            if (channel->remote.eof || channel->remote.close) {
+#ifdef WIN32
+                shutdown(pair->sock, SD_SEND);
+#else
+                shutdown(pair->sock, SHUT_WR);
+#endif
+                pair->channel_done = 1;
+            }
+            return;
+        }
+
+        sent = 0;
+        rc = 0;
+        for (i = 0; i < n; i++) {
+            rc = _libssh2_send(pair->sock, views[i].data, views[i].length,
+                               LIBSSH2_SOCKET_SEND_FLAGS(channel->session),
+                               NULL);
+            if (rc < 0)
+                break;
+            sent += rc;
+            if ((size_t)rc < views[i].length)
+                break;
+        }
+
+        if (sent) {
+            channel_read_queues(channel, 0, NULL, sent);
+            pair->bytes_to_socket += sent;
+        }
+        if ((rc < 0) && (rc != -EAGAIN)) {
+            relay_pair_fail(pair, LIBSSH2_ERROR_SOCKET_SEND);
+            return;
+        }
+        if (i < n) {
+            pair->sock_full = 1;
+            return;
+        }
+    }
+    pair->relay->busy = 1;
+}
+
+/*
+ * relay_to_channel
+ *
+ * Send what the socket has on the channel, reading from the socket only as
+ * long as the channel's window has room. Once the socket is read to the end,
+ * the channel gets an EOF.
+ */
+static void
+relay_to_channel(struct _libssh2_relay_pair *pair)
+{
+    LIBSSH2_CHANNEL *channel = pair->channel;
+    ssize_t rc;
+    int rounds;
+    int retry_only = pair->done; /* a failed pair only finishes its send */
+
+    for (rounds = 0; rounds < LIBSSH2_RELAY_ROUNDS; rounds++) {
+        if ((pair->buf_sent == pair->buf_len) && !pair->sock_eof) {
+            if (!channel->local.window_size || retry_only)
+                return;
+
+            rc = _libssh2_recv(pair->sock, pair->buf, LIBSSH2_RELAY_BUF,
+                               LIBSSH2_SOCKET_RECV_FLAGS(channel->session),
+                               NULL);
+            if (rc == -EAGAIN)
+                return;
+            if (rc < 0) {
+                relay_pair_fail(pair, LIBSSH2_ERROR_SOCKET_RECV);
+                return;
+            }
+            if (!rc)
+                pair->sock_eof = 1;
+            pair->buf_len = rc;
+            pair->buf_sent = 0;
+        }
+
+        if (pair->buf_sent < pair->buf_len) {
+            rc = _libssh2_channel_write(channel, 0,
+                                        pair->buf + pair->buf_sent,
+                                        pair->buf_len - pair->buf_sent);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                relay_pair_stall(pair, relay_stall_write);
+                return;
+            }
+            if (rc < 0) {
+                relay_pair_fail(pair, (int)rc);
+                return;
+            }
+            if (!rc)
+                /* the window is full */
+                return;
+            pair->buf_sent += rc;
+            pair->bytes_to_channel += rc;
+            if (retry_only)
+                return;
+            continue;
+        }
+
+        if (!pair->eof_sent) {
+            rc = channel_send_eof(channel);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                relay_pair_stall(pair, relay_stall_eof);
+                return;
+            }
+            if (rc) {
+                relay_pair_fail(pair, (int)rc);
+                return;
+            }
+            pair->eof_sent = 1;
+        }
+        return;
+    }
+    pair->relay->busy = 1;
+}
+
+/*
+ * relay_pair_pump
+ *
+ * Move a pair's data along both ways as far as it goes without blocking.
+ * Nothing is sent on the session while another pair's send is left over,
+ * and a pair's own left over send is made again even if it has failed.
+ */
+static void
+relay_pair_pump(struct _libssh2_relay_pair *pair)
+{
+    LIBSSH2_RELAY *relay = pair->relay;
+    LIBSSH2_CHANNEL *channel = pair->channel;
+    int rc;
+
+    if (!pair->channel_done && !pair->done)
+        relay_to_socket(pair);
+
+    if (relay->stalled && (relay->stalled != pair))
+        return;
+
+    if ((pair->stall == relay_stall_adjust) ||
+        (!pair->done && (pair->stall == relay_stall_none))) {
+        /* open the receive window up again as the socket takes the data */
+        rc = channel_read_window(channel, 0);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            relay_pair_stall(pair, relay_stall_adjust);
+            return;
+        }
+        if (rc) {
+            relay_pair_fail(pair, rc);
+            return;
+        }
+        pair->stall = relay_stall_none;
+        relay->stalled = NULL;
+    }
+
+    if ((pair->stall != relay_stall_none) ||
+        (!pair->done && !pair->eof_sent)) {
+        pair->stall = relay_stall_none;
+        relay->stalled = NULL;
+        relay_to_channel(pair);
+    }
+
+    if (pair->channel_done &&
+        ((pair->eof_sent && (pair->buf_sent == pair->buf_len)) ||
+         channel->remote.close))
+        pair->done = 1;
+}
+
+/*
+ * relay_pump
+ *
+ * Read what the session has, move all the pairs along and report those that
+ * are done. The pair with a send left over goes first.
+ */
+static int
+relay_pump(LIBSSH2_RELAY *relay, LIBSSH2_RELAY_RESULT *done,
+           unsigned int max)
+{
+    LIBSSH2_SESSION *session = relay->session;
+    struct _libssh2_relay_pair *pair;
+    struct _libssh2_relay_pair *next;
+    unsigned int count = 0;
+    int rc;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while (rc > 0);
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "Failure reading from transport");
+
+    if (session->packet.oqueued) {
+        rc = _libssh2_transport_flush(session);
+        if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+            return _libssh2_error(session, rc, "Failure sending queued data");
+    }
+
+    relay->busy = 0;
+    if (relay->stalled)
+        relay_pair_pump(relay->stalled);
+
+    for (pair = _libssh2_list_first(&relay->pairs); pair; pair = next) {
+        next = _libssh2_list_next(&pair->node);
+
+        if (pair->stall != relay_stall_none)
+            /* it has been pumped first */
+            continue;
+        if (!pair->done)
+            relay_pair_pump(pair);
+
+        if (pair->done && (pair->stall == relay_stall_none) &&
+            (count < max)) {
+            done[count].socket = pair->sock;
+            done[count].channel = pair->channel;
+            done[count].abstract = pair->abstract;
+            done[count].rc = pair->rc;
+            done[count].bytes_to_channel = pair->bytes_to_channel;
+            done[count].bytes_to_socket = pair->bytes_to_socket;
+            count++;
+            relay_pair_free(pair);
+        }
+        else if (pair->done)
+            relay->busy = 1;
+    }
+
+    return (int)count;
+}
+
+/*
+ * relay_wait
+ *
+ * Wait up to 'timeout' milliseconds, or forever if it is negative, for the
+ * session socket or a pair's socket to get ready for what they wait for
+ */
+static int
+relay_wait(LIBSSH2_RELAY *relay, long timeout)
+{
+    LIBSSH2_SESSION *session = relay->session;
+    struct _libssh2_relay_pair *pair;
+    int session_out = (session->socket_block_directions &
+                       LIBSSH2_SESSION_BLOCK_OUTBOUND);
+    int rc;
+#ifdef HAVE_POLL
+    unsigned int n = 1;
+
+    if (relay->fds_size < relay->npairs + 1) {
+        struct pollfd *fds = LIBSSH2_REALLOC(session, relay->fds,
+                                             (relay->npairs + 1) *
+                                             sizeof(struct pollfd));
+        if (!fds)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate relay poll array");
+        relay->fds = fds;
+        relay->fds_size = relay->npairs + 1;
+    }
+
+    relay->fds[0].fd = session->socket_fd;
+    relay->fds[0].events = POLLIN | (session_out ? POLLOUT : 0);
+    relay->fds[0].revents = 0;
+    for (pair = _libssh2_list_first(&relay->pairs); pair;
+         pair = _libssh2_list_next(&pair->node)) {
+        short events = 0;
+
+        if (!pair->sock_eof && (pair->buf_sent == pair->buf_len) &&
+            pair->channel->local.window_size)
+            events |= POLLIN;
+        if (pair->sock_full)
+            events |= POLLOUT;
+        if (!events)
+            continue;
+        relay->fds[n].fd = pair->sock;
+        relay->fds[n].events = events;
+        relay->fds[n].revents = 0;
+        n++;
+    }
+
+    rc = poll(relay->fds, n, (int)timeout);
+#elif defined(HAVE_SELECT)
+    fd_set rfds;
+    fd_set wfds;
+    struct timeval tv;
+    libssh2_socket_t maxfd = session->socket_fd;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(session->socket_fd, &rfds);
+    if (session_out)
+        FD_SET(session->socket_fd, &wfds);
+    for (pair = _libssh2_list_first(&relay->pairs); pair;
+         pair = _libssh2_list_next(&pair->node)) {
+        if (!pair->sock_eof && (pair->buf_sent == pair->buf_len) &&
+            pair->channel->local.window_size)
+            FD_SET(pair->sock, &rfds);
+        else if (!pair->sock_full)
+            continue;
+        if (pair->sock_full)
+            FD_SET(pair->sock, &wfds);
+        if (pair->sock > maxfd)
+            maxfd = pair->sock;
+    }
+
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    rc = select(maxfd + 1, &rfds, &wfds, NULL, (timeout < 0) ? NULL : &tv);
+#else
+    (void)pair;
+    (void)session_out;
+    rc = 0;
+#endif
+
+    if (rc < 0)
+        return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_RECV,
+                              "Failure waiting for relay sockets");
+    return 0;
+}
+
+/*
+ * libssh2_relay_init
+ *
+ * Create a relay for the channels of a session
+ */
+LIBSSH2_API LIBSSH2_RELAY *
+libssh2_relay_init(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_RELAY *relay = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_RELAY));
+
+    if (!relay) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for relay");
+        return NULL;
+    }
+    relay->session = session;
+    _libssh2_list_init(&relay->pairs);
+    return relay;
+}
+
+/*
+ * libssh2_relay_add
+ *
+ * Have a relay copy data between a non-blocking socket and a channel, both
+ * ways
+ */
+LIBSSH2_API int
+libssh2_relay_add(LIBSSH2_RELAY *relay, libssh2_socket_t sock,
+                  LIBSSH2_CHANNEL *channel, void *abstract)
+{
+    LIBSSH2_SESSION *session;
+    struct _libssh2_relay_pair *pair;
+
+    if (!relay || !channel || (sock == LIBSSH2_INVALID_SOCKET))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    session = relay->session;
+    if (channel->session != session)
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "Channel belongs to another session");
+    if (channel->relay_pair)
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "Channel is relayed already");
+
+    pair = LIBSSH2_CALLOC(session, sizeof(struct _libssh2_relay_pair));
+    if (!pair)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for relay pair");
+    pair->buf = LIBSSH2_ALLOC(session, LIBSSH2_RELAY_BUF);
+    if (!pair->buf) {
+        LIBSSH2_FREE(session, pair);
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for relay buffer");
+    }
+
+    pair->relay = relay;
+    pair->sock = sock;
+    pair->channel = channel;
+    pair->abstract = abstract;
+    channel->relay_pair = pair;
+    _libssh2_list_add(&relay->pairs, &pair->node);
+    relay->npairs++;
+    return 0;
+}
+
+/*
+ * libssh2_relay_remove
+ *
+ * Stop relaying a channel
+ */
+LIBSSH2_API int
+libssh2_relay_remove(LIBSSH2_RELAY *relay, LIBSSH2_CHANNEL *channel)
+{
+    if (!relay || !channel)
+        return LIBSSH2_ERROR_BAD_USE;
+    if (!channel->relay_pair || (channel->relay_pair->relay != relay))
+        return _libssh2_error(relay->session, LIBSSH2_ERROR_INVAL,
+                              "Channel is not in this relay");
+
+    relay_pair_free(channel->relay_pair);
+    return 0;
+}
+
+/*
+ * libssh2_relay_run
+ *
+ * Relay what can be relayed right away. If that finishes no pair, wait up
+ * to 'timeout' milliseconds for more and relay that. Fills in 'done' with
+ * the pairs that finished and are no longer in the relay.
+ */
+LIBSSH2_API int
+libssh2_relay_run(LIBSSH2_RELAY *relay, long timeout,
+                  LIBSSH2_RELAY_RESULT *done, unsigned int max)
+{
+    struct _libssh2_lock *lock;
+    int rc;
+
+    if (!relay || (max && !done))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    lock = relay->session->lock;
+    BLOCK_LOCK(lock);
+    rc = relay_pump(relay, done, max);
+    BLOCK_UNLOCK(lock);
+    if (rc || relay->busy || !timeout)
+        return rc;
+
+    rc = relay_wait(relay, timeout);
+    if (rc)
+        return rc;
+
+    BLOCK_LOCK(lock);
+    rc = relay_pump(relay, done, max);
+    BLOCK_UNLOCK(lock);
+    return rc;
+}
+
+/*
+ * libssh2_relay_free
+ *
+ * Free a relay. The sockets and channels still in it are left alone.
+ */
+LIBSSH2_API void
+libssh2_relay_free(LIBSSH2_RELAY *relay)
+{
+    struct _libssh2_relay_pair *pair;
+    LIBSSH2_SESSION *session;
+
+    if (!relay)
+        return;
+
+    session = relay->session;
+    while ((pair = _libssh2_list_first(&relay->pairs)))
+        relay_pair_free(pair);
+#ifdef HAVE_POLL
+    if (relay->fds)
+        LIBSSH2_FREE(session, relay->fds);
+#endif
+    LIBSSH2_FREE(session, relay);
+}
@@ -42,8 +42,8 @@
  * _libssh2_channel_receive_window_adjust
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the session's minimum adjustment and force is
+ * 0 the adjustment amount will be queued for a later packet.
  *
  * Always non-blocking.
  */
@@ -52,6 +52,39 @@ int _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                                            unsigned char force,
                                            unsigned int *store);
 
+/*
+ * _libssh2_channel_adjust_flush
+ *
+ * Send the window adjustment a channel has queued, corked to go out with
+ * the next packet.
+ */
+int _libssh2_channel_adjust_flush(LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_channel_window_granted
+ *
+ * Count 'delta' bytes more (or less) receive window of a channel towards
+ * the read budget, and the channel as busy.
+ */
+void _libssh2_channel_window_granted(LIBSSH2_CHANNEL *channel, long delta);
+
+/*
+ * _libssh2_channel_window_tune
+ *
+ * Returns the size the receive window of a channel is to be topped up to,
+ * first re-sizing it from the measured rate in LIBSSH2_WINDOW_AUTO mode.
+ */
+uint32_t _libssh2_channel_window_tune(LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_channel_reply
+ *
+ * Take an answer to an open or a request sent without waiting for it, see
+ * LIBSSH2_FLAG_CHANNEL_PIPELINE. Returns 1 if the packet was one.
+ */
+int _libssh2_channel_reply(LIBSSH2_CHANNEL *channel,
+                           const unsigned char *data, size_t datalen);
+
 /*
  * _libssh2_channel_flush
  *
@@ -82,6 +115,20 @@ ssize_t
 _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                        const unsigned char *buf, size_t buflen);
 
+/*
+ * _libssh2_channel_write_prefixed
+ *
+ * Send 'prefix' followed by 'buf' to a channel, with the prefix sharing the
+ * SSH packet with the start of 'buf'. At most
+ * LIBSSH2_CHANNEL_WRITE_PREFIX_MAX bytes of prefix are taken per call. The
+ * return code counts bytes of both.
+ */
+ssize_t
+_libssh2_channel_write_prefixed(LIBSSH2_CHANNEL *channel, int stream_id,
+                                const unsigned char *prefix,
+                                size_t prefix_len,
+                                const unsigned char *buf, size_t buflen);
+
 /*
  * _libssh2_channel_open
  *
@@ -119,12 +166,56 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
 
 uint32_t _libssh2_channel_nextid(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_channel_hash_add / _libssh2_channel_hash_remove
+ *
+ * Keep the id lookup table of the session up to date. A channel is added
+ * once it has been linked into session->channels or a listener queue, and
+ * removed when it gets unlinked for good.
+ */
+void _libssh2_channel_hash_add(LIBSSH2_SESSION * session,
+                               LIBSSH2_CHANNEL * channel);
+void _libssh2_channel_hash_remove(LIBSSH2_SESSION * session,
+                                  LIBSSH2_CHANNEL * channel);
+
+/*
+ * _libssh2_channel_ready / _libssh2_channel_ready_pop
+ *
+ * Queue a channel to be reported as readable or writable, unless it is
+ * queued already or not yet handed to the application, and take the oldest
+ * one off a queue. _libssh2_channel_unready() drops a channel from both.
+ */
+void _libssh2_channel_ready(LIBSSH2_CHANNEL * channel, int writable);
+LIBSSH2_CHANNEL *_libssh2_channel_ready_pop(LIBSSH2_SESSION * session,
+                                            int writable);
+void _libssh2_channel_unready(LIBSSH2_CHANNEL * channel);
+
 LIBSSH2_CHANNEL *_libssh2_channel_locate(LIBSSH2_SESSION * session,
                                          uint32_t channel_id);
 
+/*
+ * _libssh2_listener_first
+ *
+ * The first listener of the session->listener_hash bucket that one for
+ * 'host' and 'port' would be in. The ones after it follow hash_next, and
+ * each has to be compared.
+ */
+LIBSSH2_LISTENER *_libssh2_listener_first(LIBSSH2_SESSION * session,
+                                          const unsigned char *host,
+                                          size_t host_len, int port);
+
 size_t _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel,
                                         int stream_id);
 
+/*
+ * _libssh2_channel_line_len
+ *
+ * Number of bytes already queued on the standard stream up to and including
+ * the first newline, at most 'maxlen'. When no newline is queued, that is
+ * all that is queued.
+ */
+size_t _libssh2_channel_line_len(LIBSSH2_CHANNEL * channel, size_t maxlen);
+
 int _libssh2_channel_close(LIBSSH2_CHANNEL * channel);
 
 /*
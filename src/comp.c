@@ -131,6 +131,37 @@ comp_method_zlib_free(voidpf opaque, voidpf address)
 
 
 
+/* Inflate output is collected in a buffer that belongs to the stream and
+   survives from one packet to the next, so a session settles on one
+   allocation that fits its largest packet. It only ever grows in powers of
+   two, which keeps the number of reallocs logarithmic over its lifetime. */
+#define ZLIB_OUTBUF_MIN 256
+
+/* Outgoing data that does not shrink is sent in stored deflate blocks
+   instead, which the peer inflates like any other. Each ZLIB_SAMPLE bytes
+   of input are judged together: when compressing them saved less than
+   1/32 the stream goes to level 0, and tries its real level again after
+   ZLIB_PROBE_MIN stored bytes, twice as many after each probe that does
+   not pay off, at most ZLIB_PROBE_MAX. */
+#define ZLIB_SAMPLE      (128 * 1024)
+#define ZLIB_PROBE_MIN   (256 * 1024)
+#define ZLIB_PROBE_MAX   (1024 * 1024)
+
+struct comp_zlib_stream
+{
+    z_stream strm;
+    unsigned char *out;     /* inflate output, only used when decompressing */
+    size_t out_size;
+
+    /* adaptive deflate */
+    int level;              /* level configured for the session */
+    int stored;             /* level 0 is in use */
+    int params;             /* deflateParams() is due before the next data */
+    size_t sample_in;       /* input and output since the last decision */
+    size_t sample_out;
+    size_t probe_after;     /* stored bytes before the next probe */
+};
+
 /* libssh2_comp_method_zlib_init
  * All your bandwidth are belong to us (so save some)
  */
@@ -138,34 +169,39 @@ static int
 comp_method_zlib_init(LIBSSH2_SESSION * session, int compr,
                       void **abstract)
 {
+    struct comp_zlib_stream *zs;
     z_stream *strm;
     int status;
 
-    strm = LIBSSH2_CALLOC(session, sizeof(z_stream));
-    if (!strm) {
+    zs = LIBSSH2_CALLOC(session, sizeof(struct comp_zlib_stream));
+    if (!zs) {
         return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                               "Unable to allocate memory for "
                               "zlib compression/decompression");
     }
+    strm = &zs->strm;
 
     strm->opaque = (voidpf) session;
     strm->zalloc = (alloc_func) comp_method_zlib_alloc;
     strm->zfree = (free_func) comp_method_zlib_free;
     if (compr) {
         /* deflate */
-        status = deflateInit(strm, Z_DEFAULT_COMPRESSION);
+        zs->level = session->flag.compress_level ?
+            session->flag.compress_level : Z_DEFAULT_COMPRESSION;
+        zs->probe_after = ZLIB_PROBE_MIN / 2;
+        status = deflateInit(strm, zs->level);
     } else {
         /* inflate */
         status = inflateInit(strm);
     }
 
     if (status != Z_OK) {
-        LIBSSH2_FREE(session, strm);
+        LIBSSH2_FREE(session, zs);
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "unhandled zlib error %d", status);
         return LIBSSH2_ERROR_COMPRESS;
     }
-    *abstract = strm;
+    *abstract = zs;
 
     return LIBSSH2_ERROR_NONE;
 }
@@ -186,19 +222,64 @@ comp_method_zlib_comp(LIBSSH2_SESSION *session,
                       size_t src_len,
                       void **abstract)
 {
-    z_stream *strm = *abstract;
+    struct comp_zlib_stream *zs = *abstract;
+    z_stream *strm = &zs->strm;
     int out_maxlen = *dest_len;
     int status;
 
-    strm->next_in = (unsigned char *) src;
-    strm->avail_in = src_len;
     strm->next_out = dest;
     strm->avail_out = out_maxlen;
 
+    if (zs->params) {
+        /* the previous packet was flushed completely, so nothing is left
+           for deflateParams() to compress with the old level */
+        strm->next_in = (unsigned char *) src;
+        strm->avail_in = 0;
+        status = deflateParams(strm, zs->stored ? 0 : zs->level,
+                               Z_DEFAULT_STRATEGY);
+        if (status != Z_OK) {
+            _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
+                           "unhandled zlib params error %d", status);
+            return _libssh2_error(session, LIBSSH2_ERROR_ZLIB,
+                                  "compression failure");
+        }
+        zs->params = 0;
+        _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
+                       "zlib: %s", zs->stored ?
+                       "data does not compress, sending it stored" :
+                       "probing whether data compresses again");
+    }
+
+    strm->next_in = (unsigned char *) src;
+    strm->avail_in = src_len;
+
     status = deflate(strm, Z_PARTIAL_FLUSH);
 
     if ((status == Z_OK) && (strm->avail_out > 0)) {
         *dest_len = out_maxlen - strm->avail_out;
+
+        zs->sample_in += src_len;
+        zs->sample_out += *dest_len;
+        if (zs->stored) {
+            if (zs->sample_in >= zs->probe_after) {
+                zs->stored = 0;
+                zs->params = 1;
+                zs->sample_in = zs->sample_out = 0;
+            }
+        }
+        else if (zs->sample_in >= ZLIB_SAMPLE) {
+            if (zs->sample_out >= zs->sample_in - zs->sample_in / 32) {
+                /* not worth it, and the longer it stays that way the
+                   longer the wait before the next probe */
+                zs->stored = 1;
+                zs->params = 1;
+                if (zs->probe_after < ZLIB_PROBE_MAX)
+                    zs->probe_after *= 2;
+            }
+            else
+                zs->probe_after = ZLIB_PROBE_MIN / 2;
+            zs->sample_in = zs->sample_out = 0;
+        }
         return 0;
     }
 
@@ -207,10 +288,40 @@ comp_method_zlib_comp(LIBSSH2_SESSION *session,
     return _libssh2_error(session, LIBSSH2_ERROR_ZLIB, "compression failure");
 }
 
+/*
+ * comp_zlib_outbuf
+ *
+ * Make the stream's output buffer at least 'want' bytes large, keeping what
+ * is already in it. Never shrinks.
+ */
+static int
+comp_zlib_outbuf(LIBSSH2_SESSION *session, struct comp_zlib_stream *zs,
+                 size_t want)
+{
+    size_t size = zs->out_size ? zs->out_size : ZLIB_OUTBUF_MIN;
+    unsigned char *out;
+
+    if (want <= zs->out_size)
+        return 0;
+
+    while (size < want)
+        size *= 2;
+
+    out = LIBSSH2_REALLOC(session, zs->out, size);
+    if (!out)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to expand decompression buffer");
+    zs->out = out;
+    zs->out_size = size;
+    return 0;
+}
+
 /*
  * libssh2_comp_method_zlib_decomp
  *
- * Decompresses source to destination. Allocates the output memory.
+ * Decompresses source into the stream's own output buffer. *dest points into
+ * that buffer and stays valid until the next call or the dtor; the caller
+ * copies out what it keeps.
  */
 static int
 comp_method_zlib_decomp(LIBSSH2_SESSION * session,
@@ -220,38 +331,36 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
                         const unsigned char *src,
                         size_t src_len, void **abstract)
 {
-    z_stream *strm = *abstract;
-    /* A short-term alloc of a full data chunk is better than a series of
-       reallocs */
-    char *out;
-    int out_maxlen = 4 * src_len;
-
-    /* If strm is null, then we have not yet been initialized. */
-    if (strm == NULL)
+    struct comp_zlib_stream *zs = *abstract;
+    z_stream *strm;
+    size_t out_maxlen = 4 * src_len;
+
+    /* If the stream is null, then we have not yet been initialized. */
+    if (zs == NULL)
         return _libssh2_error(session, LIBSSH2_ERROR_COMPRESS,
                               "decompression uninitialized");;
+    strm = &zs->strm;
 
-    /* In practice they never come smaller than this */
-    if (out_maxlen < 25)
-        out_maxlen = 25;
+    /* the buffer kept from earlier packets is used in full, whatever this
+       packet's guess says */
+    if (out_maxlen < zs->out_size)
+        out_maxlen = zs->out_size;
 
-    if (out_maxlen > (int) payload_limit)
+    if (out_maxlen > payload_limit)
         out_maxlen = payload_limit;
 
+    if (comp_zlib_outbuf(session, zs, out_maxlen))
+        return LIBSSH2_ERROR_ALLOC;
+
     strm->next_in = (unsigned char *) src;
     strm->avail_in = src_len;
-    strm->next_out = (unsigned char *) LIBSSH2_ALLOC(session, out_maxlen);
-    out = (char *) strm->next_out;
+    strm->next_out = zs->out;
     strm->avail_out = out_maxlen;
-    if (!strm->next_out)
-        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                              "Unable to allocate decompression buffer");
 
     /* Loop until it's all inflated or hit error */
     for (;;) {
         int status;
         size_t out_ofs;
-        char *newout;
 
         status = inflate(strm, Z_PARTIAL_FLUSH);
 
@@ -264,15 +373,13 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
             break;
         } else {
             /* error state */
-            LIBSSH2_FREE(session, out);
             _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                            "unhandled zlib error %d", status);
             return _libssh2_error(session, LIBSSH2_ERROR_ZLIB,
                                   "decompression failure");
         }
 
-        if (out_maxlen >= (int) payload_limit) {
-            LIBSSH2_FREE(session, out);
+        if (out_maxlen >= payload_limit) {
             return _libssh2_error(session, LIBSSH2_ERROR_ZLIB,
                                   "Excessive growth in decompression phase");
         }
@@ -280,18 +387,15 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
         /* If we get here we need to grow the output buffer and try again */
         out_ofs = out_maxlen - strm->avail_out;
         out_maxlen *= 2;
-        newout = LIBSSH2_REALLOC(session, out, out_maxlen);
-        if (!newout) {
-            LIBSSH2_FREE(session, out);
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to expand decompression buffer");
-        }
-        out = newout;
-        strm->next_out = (unsigned char *) out + out_ofs;
+        if (out_maxlen > payload_limit)
+            out_maxlen = payload_limit;
+        if (comp_zlib_outbuf(session, zs, out_maxlen))
+            return LIBSSH2_ERROR_ALLOC;
+        strm->next_out = zs->out + out_ofs;
         strm->avail_out = out_maxlen - out_ofs;
     }
 
-    *dest = (unsigned char *) out;
+    *dest = zs->out;
     *dest_len = out_maxlen - strm->avail_out;
 
     return 0;
@@ -304,14 +408,16 @@ comp_method_zlib_decomp(LIBSSH2_SESSION * session,
 static int
 comp_method_zlib_dtor(LIBSSH2_SESSION *session, int compr, void **abstract)
 {
-    z_stream *strm = *abstract;
+    struct comp_zlib_stream *zs = *abstract;
 
-    if (strm) {
+    if (zs) {
         if (compr)
-            deflateEnd(strm);
+            deflateEnd(&zs->strm);
         else
-            inflateEnd(strm);
-        LIBSSH2_FREE(session, strm);
+            inflateEnd(&zs->strm);
+        if (zs->out)
+            LIBSSH2_FREE(session, zs->out);
+        LIBSSH2_FREE(session, zs);
     }
 
     *abstract = NULL;
@@ -360,7 +466,50 @@ const LIBSSH2_COMP_METHOD **
 _libssh2_comp_methods(LIBSSH2_SESSION *session)
 {
     if(session->flag.compress)
-        return comp_methods;
+        return session->comp_methods ? session->comp_methods : comp_methods;
     else
         return no_comp_methods;
 }
+
+/*
+ * libssh2_session_comp_method_add
+ *
+ * Offer another compression method when compression is enabled. Added
+ * methods go ahead of the built-in ones, the last one added first, and
+ * libssh2_session_method_pref() picks among all of them by name.
+ */
+LIBSSH2_API int
+libssh2_session_comp_method_add(LIBSSH2_SESSION *session,
+                                const LIBSSH2_COMP_METHOD *method)
+{
+    const LIBSSH2_COMP_METHOD **list =
+        session->comp_methods ? session->comp_methods : comp_methods;
+    const LIBSSH2_COMP_METHOD **added;
+    size_t n;
+    size_t i;
+
+    if (!method || !method->name || !*method->name ||
+        strchr(method->name, ',') || !method->compress ||
+        !method->init || !method->comp || !method->decomp || !method->dtor)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Incomplete compression method");
+
+    for (n = 0; list[n]; n++) {
+        if (!strcmp(list[n]->name, method->name))
+            return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                                  "Compression method already known");
+    }
+
+    added = LIBSSH2_ALLOC(session, (n + 2) * sizeof(*added));
+    if (!added)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate compression method list");
+    added[0] = method;
+    for (i = 0; i <= n; i++)
+        added[i + 1] = list[i];
+
+    if (session->comp_methods)
+        LIBSSH2_FREE(session, session->comp_methods);
+    session->comp_methods = added;
+    return 0;
+}
@@ -37,6 +37,7 @@
  */
 
 #include "libssh2_priv.h"
+#include "misc.h" /* _libssh2_cpu_accel */
 
 #ifdef LIBSSH2_CRYPT_NONE
 
@@ -45,7 +46,7 @@
  */
 static int
 crypt_none_crypt(LIBSSH2_SESSION * session, unsigned char *buf,
-                         void **abstract)
+                 size_t blocksize, void **abstract)
 {
     /* Do nothing to the data! */
     return 0;
@@ -59,6 +60,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_none = {
     0,                     /* flags */
     NULL,
     crypt_none_crypt,
+    NULL,
     NULL
 };
 #endif /* LIBSSH2_CRYPT_NONE */
@@ -104,6 +106,16 @@ crypt_encrypt(LIBSSH2_SESSION * session, unsigned char *block,
                                  blocksize);
 }
 
+static int
+crypt_encrypt_to(LIBSSH2_SESSION * session, const unsigned char *src,
+                 unsigned char *dst, size_t len, void **abstract)
+{
+    struct crypt_ctx *cctx = *(struct crypt_ctx **) abstract;
+    (void) session;
+    return _libssh2_cipher_crypt_to(&cctx->h, cctx->algo, cctx->encrypt,
+                                    src, dst, len);
+}
+
 static int
 crypt_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
@@ -117,14 +129,32 @@ crypt_dtor(LIBSSH2_SESSION * session, void **abstract)
 }
 
 #if LIBSSH2_AES_CTR
+static int
+crypt_init_aes_ctr(LIBSSH2_SESSION * session,
+                   const LIBSSH2_CRYPT_METHOD * method,
+                   unsigned char *iv, int *free_iv,
+                   unsigned char *secret, int *free_secret,
+                   int encrypt, void **abstract)
+{
+    int rc = crypt_init(session, method, iv, free_iv, secret, free_secret,
+                        encrypt, abstract);
+    if (rc == 0)
+        _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
+                       "%s %s using %s", method->name,
+                       encrypt ? "encryption" : "decryption",
+                       LIBSSH2_AES_CTR_IMPL);
+    return rc;
+}
+
 static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_ctr = {
     "aes128-ctr",
     16,                         /* blocksize */
     16,                         /* initial value length */
     16,                         /* secret length -- 16*8 == 128bit */
-    0,                          /* flags */
-    &crypt_init,
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
+    &crypt_init_aes_ctr,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes128ctr
 };
@@ -134,9 +164,10 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_ctr = {
     16,                         /* blocksize */
     16,                         /* initial value length */
     24,                         /* secret length -- 24*8 == 192bit */
-    0,                          /* flags */
-    &crypt_init,
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
+    &crypt_init_aes_ctr,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes192ctr
 };
@@ -146,23 +177,290 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_ctr = {
     16,                         /* blocksize */
     16,                         /* initial value length */
     32,                         /* secret length -- 32*8 == 256bit */
-    0,                          /* flags */
-    &crypt_init,
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
+    &crypt_init_aes_ctr,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes256ctr
 };
 #endif
 
+#if LIBSSH2_AES_GCM
+/* AES-GCM as described in RFC 5647, with the changes done for
+ * aes*-gcm@openssh.com: the packet length is sent in the clear but
+ * authenticated and the MAC negotiation is ignored.
+ */
+struct crypt_gcm_ctx
+{
+    int encrypt;
+    _libssh2_cipher_ctx h;
+    /* 4 bytes fixed field and the 8 byte invocation counter */
+    unsigned char iv[12];
+};
+
+static int
+crypt_init_gcm(LIBSSH2_SESSION * session,
+               const LIBSSH2_CRYPT_METHOD * method,
+               unsigned char *iv, int *free_iv,
+               unsigned char *secret, int *free_secret,
+               int encrypt, void **abstract)
+{
+    struct crypt_gcm_ctx *ctx = LIBSSH2_ALLOC(session,
+                                              sizeof(struct crypt_gcm_ctx));
+    if (!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    ctx->encrypt = encrypt;
+    memcpy(ctx->iv, iv, sizeof(ctx->iv));
+    if (_libssh2_cipher_init(&ctx->h, method->algo, iv, secret, encrypt)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    *abstract = ctx;
+    *free_iv = 1;
+    *free_secret = 1;
+    return 0;
+}
+
+static int
+crypt_gcm_crypt(LIBSSH2_SESSION * session, uint32_t seqno,
+                unsigned char *aad, unsigned char *data, size_t len,
+                unsigned char *tag, void **abstract)
+{
+    struct crypt_gcm_ctx *ctx = *(struct crypt_gcm_ctx **) abstract;
+    int i;
+    (void) session;
+    (void) seqno;
+
+    if (_libssh2_cipher_crypt_gcm(&ctx->h, ctx->encrypt, ctx->iv,
+                                  aad, 4, data, len, tag))
+        return -1;
+
+    /* increment the invocation counter, a 64 bit big endian number */
+    for (i = 11; i >= 4; i--)
+        if (++ctx->iv[i])
+            break;
+
+    return 0;
+}
+
+static int
+crypt_gcm_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct crypt_gcm_ctx **ctx = (struct crypt_gcm_ctx **) abstract;
+    if (ctx && *ctx) {
+        _libssh2_cipher_dtor(&(*ctx)->h);
+        LIBSSH2_FREE(session, *ctx);
+        *abstract = NULL;
+    }
+    return 0;
+}
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_gcm = {
+    "aes128-gcm@openssh.com",
+    16,                         /* blocksize */
+    12,                         /* initial value length */
+    16,                         /* secret length -- 16*8 == 128bit */
+    LIBSSH2_CRYPT_FLAG_AEAD | LIBSSH2_CRYPT_FLAG_AES |
+    LIBSSH2_CRYPT_FLAG_CLMUL,   /* flags */
+    &crypt_init_gcm,
+    NULL,
+    NULL,
+    &crypt_gcm_dtor,
+    _libssh2_cipher_aes128gcm,
+    16,                         /* authentication tag length */
+    NULL,                       /* packet length is not encrypted */
+    &crypt_gcm_crypt
+};
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_gcm = {
+    "aes256-gcm@openssh.com",
+    16,                         /* blocksize */
+    12,                         /* initial value length */
+    32,                         /* secret length -- 32*8 == 256bit */
+    LIBSSH2_CRYPT_FLAG_AEAD | LIBSSH2_CRYPT_FLAG_AES |
+    LIBSSH2_CRYPT_FLAG_CLMUL,   /* flags */
+    &crypt_init_gcm,
+    NULL,
+    NULL,
+    &crypt_gcm_dtor,
+    _libssh2_cipher_aes256gcm,
+    16,                         /* authentication tag length */
+    NULL,                       /* packet length is not encrypted */
+    &crypt_gcm_crypt
+};
+#endif /* LIBSSH2_AES_GCM */
+
+#if LIBSSH2_CHACHA20_POLY1305
+/* chacha20-poly1305@openssh.com, see PROTOCOL.chacha20poly1305 in the
+ * OpenSSH sources. The 64 byte key is split in two: the second half
+ * encrypts the packet length, the first half the rest of the packet and
+ * the per-packet Poly1305 key. The sequence number is the nonce.
+ */
+struct crypt_chachapoly_ctx
+{
+    int encrypt;
+    _libssh2_chacha20_ctx main;
+    _libssh2_chacha20_ctx header;
+};
+
+/* fill in the 16 byte ChaCha20 IV: the 64 bit little endian block counter
+   followed by the sequence number as a 64 bit big endian nonce */
+static void
+chachapoly_iv(unsigned char *iv, uint32_t seqno, unsigned char counter)
+{
+    memset(iv, 0, 16);
+    iv[0] = counter;
+    _libssh2_htonu32(&iv[12], seqno);
+}
+
+/* compare two tags without leaking where they differ */
+static int
+chachapoly_tag_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+    int i;
+    for (i = 0; i < 16; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static int
+crypt_init_chachapoly(LIBSSH2_SESSION * session,
+                      const LIBSSH2_CRYPT_METHOD * method,
+                      unsigned char *iv, int *free_iv,
+                      unsigned char *secret, int *free_secret,
+                      int encrypt, void **abstract)
+{
+    struct crypt_chachapoly_ctx *ctx =
+        LIBSSH2_ALLOC(session, sizeof(struct crypt_chachapoly_ctx));
+    (void) method;
+    (void) iv;
+
+    if (!ctx)
+        return LIBSSH2_ERROR_ALLOC;
+
+    ctx->encrypt = encrypt;
+    if (_libssh2_chacha20_init(&ctx->main, secret)) {
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    if (_libssh2_chacha20_init(&ctx->header, secret + 32)) {
+        _libssh2_chacha20_dtor(&ctx->main);
+        LIBSSH2_FREE(session, ctx);
+        return -1;
+    }
+    *abstract = ctx;
+    *free_iv = 1;
+    *free_secret = 1;
+    return 0;
+}
+
+static int
+crypt_chachapoly_get_len(LIBSSH2_SESSION * session, uint32_t seqno,
+                         const unsigned char *data, uint32_t *len,
+                         void **abstract)
+{
+    struct crypt_chachapoly_ctx *ctx =
+        *(struct crypt_chachapoly_ctx **) abstract;
+    unsigned char iv[16];
+    unsigned char buf[4];
+    (void) session;
+
+    memcpy(buf, data, 4);
+    chachapoly_iv(iv, seqno, 0);
+    if (_libssh2_chacha20_crypt(&ctx->header, iv, buf, 4))
+        return -1;
+
+    *len = _libssh2_ntohu32(buf);
+    return 0;
+}
+
+static int
+crypt_chachapoly_crypt(LIBSSH2_SESSION * session, uint32_t seqno,
+                       unsigned char *aad, unsigned char *data, size_t len,
+                       unsigned char *tag, void **abstract)
+{
+    struct crypt_chachapoly_ctx *ctx =
+        *(struct crypt_chachapoly_ctx **) abstract;
+    unsigned char iv[16];
+    unsigned char polykey[32];
+    unsigned char expected[16];
+    int rc = -1;
+    (void) session;
+
+    /* the Poly1305 key is the first 32 bytes of key stream of block 0 */
+    memset(polykey, 0, sizeof(polykey));
+    chachapoly_iv(iv, seqno, 0);
+    if (_libssh2_chacha20_crypt(&ctx->main, iv, polykey, sizeof(polykey)))
+        goto out;
+
+    if (ctx->encrypt) {
+        if (_libssh2_chacha20_crypt(&ctx->header, iv, aad, 4))
+            goto out;
+        chachapoly_iv(iv, seqno, 1);
+        if (_libssh2_chacha20_crypt(&ctx->main, iv, data, len) ||
+            _libssh2_poly1305(tag, polykey, aad, 4, data, len))
+            goto out;
+    }
+    else {
+        /* verify the tag over the still encrypted data first */
+        if (_libssh2_poly1305(expected, polykey, aad, 4, data, len) ||
+            !chachapoly_tag_equal(expected, tag))
+            goto out;
+        chachapoly_iv(iv, seqno, 1);
+        if (_libssh2_chacha20_crypt(&ctx->main, iv, data, len))
+            goto out;
+    }
+    rc = 0;
+
+  out:
+    memset(polykey, 0, sizeof(polykey));
+    return rc;
+}
+
+static int
+crypt_chachapoly_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    struct crypt_chachapoly_ctx **ctx =
+        (struct crypt_chachapoly_ctx **) abstract;
+    if (ctx && *ctx) {
+        _libssh2_chacha20_dtor(&(*ctx)->main);
+        _libssh2_chacha20_dtor(&(*ctx)->header);
+        LIBSSH2_FREE(session, *ctx);
+        *abstract = NULL;
+    }
+    return 0;
+}
+
+static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_chacha20_poly1305 = {
+    "chacha20-poly1305@openssh.com",
+    8,                          /* blocksize */
+    0,                          /* initial value length */
+    64,                         /* secret length -- two 256bit keys */
+    LIBSSH2_CRYPT_FLAG_AEAD,    /* flags */
+    &crypt_init_chachapoly,
+    NULL,
+    NULL,
+    &crypt_chachapoly_dtor,
+    0,
+    16,                         /* authentication tag length */
+    &crypt_chachapoly_get_len,
+    &crypt_chachapoly_crypt
+};
+#endif /* LIBSSH2_CHACHA20_POLY1305 */
+
 #if LIBSSH2_AES
 static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes128_cbc = {
     "aes128-cbc",
     16,                         /* blocksize */
     16,                         /* initial value length */
     16,                         /* secret length -- 16*8 == 128bit */
-    0,                          /* flags */
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes128
 };
@@ -172,9 +470,10 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes192_cbc = {
     16,                         /* blocksize */
     16,                         /* initial value length */
     24,                         /* secret length -- 24*8 == 192bit */
-    0,                          /* flags */
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes192
 };
@@ -184,9 +483,10 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_aes256_cbc = {
     16,                         /* blocksize */
     16,                         /* initial value length */
     32,                         /* secret length -- 32*8 == 256bit */
-    0,                          /* flags */
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes256
 };
@@ -198,9 +498,10 @@ static const LIBSSH2_CRYPT_METHOD
     16,                         /* blocksize */
     16,                         /* initial value length */
     32,                         /* secret length -- 32*8 == 256bit */
-    0,                          /* flags */
+    LIBSSH2_CRYPT_FLAG_AES,     /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_aes256
 };
@@ -215,6 +516,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_blowfish_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_blowfish
 };
@@ -229,6 +531,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_arcfour
 };
@@ -264,6 +567,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_arcfour128 = {
     0,                          /* flags */
     &crypt_init_arcfour128,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_arcfour
 };
@@ -278,6 +582,7 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_cast128_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_cast5
 };
@@ -292,12 +597,20 @@ static const LIBSSH2_CRYPT_METHOD libssh2_crypt_method_3des_cbc = {
     0,                          /* flags */
     &crypt_init,
     &crypt_encrypt,
+    &crypt_encrypt_to,
     &crypt_dtor,
     _libssh2_cipher_3des
 };
 #endif
 
 static const LIBSSH2_CRYPT_METHOD *_libssh2_crypt_methods[] = {
+#if LIBSSH2_CHACHA20_POLY1305
+  &libssh2_crypt_method_chacha20_poly1305,
+#endif
+#if LIBSSH2_AES_GCM
+  &libssh2_crypt_method_aes128_gcm,
+  &libssh2_crypt_method_aes256_gcm,
+#endif
 #if LIBSSH2_AES_CTR
   &libssh2_crypt_method_aes128_ctr,
   &libssh2_crypt_method_aes192_ctr,
@@ -328,9 +641,76 @@ static const LIBSSH2_CRYPT_METHOD *_libssh2_crypt_methods[] = {
     NULL
 };
 
+#define CRYPT_METHODS (sizeof(_libssh2_crypt_methods) / \
+                       sizeof(_libssh2_crypt_methods[0]))
+
+/* the default order on the running CPU, filled in by libssh2_init() */
+static const LIBSSH2_CRYPT_METHOD *crypt_methods_cpu[CRYPT_METHODS];
+
 /* Expose to kex.c */
 const LIBSSH2_CRYPT_METHOD **
 libssh2_crypt_methods(void)
 {
-    return _libssh2_crypt_methods;
+    return crypt_methods_cpu[0] ? crypt_methods_cpu : _libssh2_crypt_methods;
+}
+
+/*
+ * _libssh2_crypt_accel
+ *
+ * The LIBSSH2_ACCEL_* bits a method runs on
+ */
+int
+_libssh2_crypt_accel(const LIBSSH2_CRYPT_METHOD *method)
+{
+    int accel = 0;
+
+    if (method->flags & LIBSSH2_CRYPT_FLAG_AES)
+        accel |= LIBSSH2_ACCEL_AES;
+    if (method->flags & LIBSSH2_CRYPT_FLAG_CLMUL)
+        accel |= LIBSSH2_ACCEL_CLMUL;
+    return accel;
+}
+
+/* all of what the method runs on is accelerated on this CPU */
+static int
+crypt_fast(const LIBSSH2_CRYPT_METHOD *method, int cpu)
+{
+    int accel = _libssh2_crypt_accel(method);
+
+    return accel && (accel & cpu) == accel;
+}
+
+/*
+ * _libssh2_crypt_methods_order
+ *
+ * Move the methods the running CPU accelerates ahead of the others of
+ * their kind: AEAD ones ahead of AEAD ones and plain ones ahead of plain
+ * ones. So AES-GCM goes before chacha20-poly1305 with AES-NI and
+ * PCLMULQDQ, but no CBC mode method ever goes before a counter mode one.
+ */
+void
+_libssh2_crypt_methods_order(void)
+{
+    int cpu = _libssh2_cpu_accel();
+    size_t start;
+    size_t end;
+    size_t i;
+    size_t n = 0;
+
+    for (start = 0; _libssh2_crypt_methods[start]; start = end) {
+        long kind = _libssh2_crypt_methods[start]->flags &
+            LIBSSH2_CRYPT_FLAG_AEAD;
+
+        for (end = start; _libssh2_crypt_methods[end] &&
+                 (_libssh2_crypt_methods[end]->flags &
+                  LIBSSH2_CRYPT_FLAG_AEAD) == kind; end++)
+            ;
+        for (i = start; i < end; i++)
+            if (crypt_fast(_libssh2_crypt_methods[i], cpu))
+                crypt_methods_cpu[n++] = _libssh2_crypt_methods[i];
+        for (i = start; i < end; i++)
+            if (!crypt_fast(_libssh2_crypt_methods[i], cpu))
+                crypt_methods_cpu[n++] = _libssh2_crypt_methods[i];
+    }
+    crypt_methods_cpu[n] = NULL;
 }
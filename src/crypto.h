@@ -54,6 +54,41 @@
 #include "os400qc3.h"
 #endif
 
+#ifndef LIBSSH2_ECDH
+#define LIBSSH2_ECDH 0
+#endif
+
+/* the LIBSSH2_ACCEL_* instructions the backend dispatches to at run time
+   when the CPU has them */
+#ifndef LIBSSH2_ACCEL_BACKEND
+#define LIBSSH2_ACCEL_BACKEND 0
+#endif
+
+#ifndef LIBSSH2_CURVE25519
+#define LIBSSH2_CURVE25519 0
+#endif
+
+#ifndef LIBSSH2_ECDSA
+#define LIBSSH2_ECDSA 0
+#endif
+
+#ifndef LIBSSH2_ED25519
+#define LIBSSH2_ED25519 0
+#endif
+
+/* curves for the ECDH key exchange and ECDSA keys */
+typedef enum {
+    LIBSSH2_EC_CURVE_NISTP256,
+    LIBSSH2_EC_CURVE_NISTP384,
+    LIBSSH2_EC_CURVE_NISTP521,
+    LIBSSH2_EC_CURVE_25519
+} libssh2_curve_type;
+
+#ifndef LIBSSH2_AES_CTR_IMPL
+/* description of the AES-CTR implementation, shown in the trace output */
+#define LIBSSH2_AES_CTR_IMPL "native"
+#endif
+
 int _libssh2_rsa_new(libssh2_rsa_ctx ** rsa,
                      const unsigned char *edata,
                      unsigned long elen,
@@ -125,6 +160,101 @@ int _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                           _libssh2_cipher_type(algo),
                           int encrypt, unsigned char *block, size_t blocksize);
 
+int _libssh2_cipher_crypt_to(_libssh2_cipher_ctx * ctx,
+                             _libssh2_cipher_type(algo),
+                             int encrypt, const unsigned char *src,
+                             unsigned char *dst, size_t len);
+
+#if LIBSSH2_AES_GCM
+int _libssh2_cipher_crypt_gcm(_libssh2_cipher_ctx * ctx, int encrypt,
+                              const unsigned char *iv,
+                              const unsigned char *aad, size_t aad_len,
+                              unsigned char *data, size_t data_len,
+                              unsigned char *tag);
+#endif
+
+#if LIBSSH2_CHACHA20_POLY1305
+int _libssh2_chacha20_init(_libssh2_chacha20_ctx * ctx,
+                           const unsigned char *key);
+int _libssh2_chacha20_crypt(_libssh2_chacha20_ctx * ctx,
+                            const unsigned char *iv,
+                            unsigned char *buf, size_t len);
+void _libssh2_chacha20_dtor(_libssh2_chacha20_ctx * ctx);
+int _libssh2_poly1305(unsigned char *tag, const unsigned char *key,
+                      const unsigned char *aad, size_t aad_len,
+                      const unsigned char *data, size_t data_len);
+#endif
+
+#if LIBSSH2_ECDH
+int _libssh2_ecdh_keypair(LIBSSH2_SESSION *session, libssh2_curve_type curve,
+                          _libssh2_ec_key **key,
+                          unsigned char **pub, size_t *pub_len);
+int _libssh2_ecdh_secret(LIBSSH2_SESSION *session, _libssh2_ec_key *key,
+                         const unsigned char *peer, size_t peer_len,
+                         unsigned char **secret, size_t *secret_len);
+#endif
+
+#if LIBSSH2_ECDSA
+/* q is the uncompressed point, d the private scalar as in an mpint */
+int _libssh2_ecdsa_new_public(libssh2_ecdsa_ctx ** ecdsa,
+                              LIBSSH2_SESSION * session,
+                              libssh2_curve_type curve,
+                              const unsigned char *q, size_t q_len);
+int _libssh2_ecdsa_new_private_raw(libssh2_ecdsa_ctx ** ecdsa,
+                                   LIBSSH2_SESSION * session,
+                                   libssh2_curve_type curve,
+                                   const unsigned char *q, size_t q_len,
+                                   const unsigned char *d, size_t d_len);
+int _libssh2_ecdsa_new_private(libssh2_ecdsa_ctx ** ecdsa,
+                               LIBSSH2_SESSION * session,
+                               const char *filename,
+                               unsigned const char *passphrase);
+int _libssh2_ecdsa_new_private_frommemory(libssh2_ecdsa_ctx ** ecdsa,
+                                          LIBSSH2_SESSION * session,
+                                          const char *filedata,
+                                          size_t filedata_len,
+                                          unsigned const char *passphrase);
+int _libssh2_ecdsa_curve_type(libssh2_ecdsa_ctx * ecdsa,
+                              libssh2_curve_type *curve);
+int _libssh2_ecdsa_verify(libssh2_ecdsa_ctx * ecdsa,
+                          const unsigned char *r, size_t r_len,
+                          const unsigned char *s, size_t s_len,
+                          const unsigned char *hash, size_t hash_len);
+/* r and s are returned big-endian without leading zeroes */
+int _libssh2_ecdsa_sign(LIBSSH2_SESSION * session,
+                        libssh2_ecdsa_ctx * ecdsa,
+                        const unsigned char *hash, size_t hash_len,
+                        unsigned char **r, size_t *r_len,
+                        unsigned char **s, size_t *s_len);
+#endif
+
+#if LIBSSH2_ED25519
+/* keys are the 32 byte strings of RFC 8032 */
+int _libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519,
+                                LIBSSH2_SESSION * session,
+                                const unsigned char *pub, size_t pub_len);
+int _libssh2_ed25519_new_private_raw(libssh2_ed25519_ctx ** ed25519,
+                                     LIBSSH2_SESSION * session,
+                                     const unsigned char *seed,
+                                     const unsigned char *pub);
+int _libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519,
+                                 LIBSSH2_SESSION * session,
+                                 const char *filename,
+                                 unsigned const char *passphrase);
+int _libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519,
+                                            LIBSSH2_SESSION * session,
+                                            const char *filedata,
+                                            size_t filedata_len,
+                                            unsigned const char *passphrase);
+int _libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519,
+                            const unsigned char *sig, size_t sig_len,
+                            const unsigned char *m, size_t m_len);
+int _libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                          libssh2_ed25519_ctx * ed25519,
+                          const unsigned char *m, size_t m_len,
+                          unsigned char **sig, size_t *sig_len);
+#endif
+
 int _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
                               unsigned char **method,
                               size_t *method_len,
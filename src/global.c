@@ -37,6 +37,7 @@
  */
 
 #include "libssh2_priv.h"
+#include "mac.h" /* _libssh2_mac_methods_order */
 
 static int _libssh2_initialized = 0;
 static int _libssh2_init_flags = 0;
@@ -48,6 +49,11 @@ libssh2_init(int flags)
         libssh2_crypto_init();
         _libssh2_init_aes_ctr();
     }
+    if (_libssh2_initialized == 0) {
+        /* the default method order for this CPU */
+        _libssh2_crypt_methods_order();
+        _libssh2_mac_methods_order();
+    }
 
     _libssh2_initialized++;
     _libssh2_init_flags |= flags;
@@ -63,6 +69,11 @@ libssh2_exit(void)
 
     _libssh2_initialized--;
 
+    if (_libssh2_initialized == 0) {
+        /* stop the ephemeral refill before the crypto library goes away */
+        (void)libssh2_dh_precompute(0);
+    }
+
     if (!(_libssh2_init_flags & LIBSSH2_INIT_NO_CRYPTO)) {
         libssh2_crypto_exit();
     }
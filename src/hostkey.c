@@ -38,6 +38,7 @@
 
 #include "libssh2_priv.h"
 #include "misc.h"
+#include "session.h" /* BLOCK_LOCK */
 
 /* Needed for struct iovec on some platforms */
 #ifdef HAVE_SYS_UIO_H
@@ -483,7 +484,721 @@ static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ssh_dss = {
 };
 #endif /* LIBSSH2_DSA */
 
+#if LIBSSH2_ECDSA || LIBSSH2_ED25519
+/*
+ * hostkey_openssh_key
+ *
+ * Read an "openssh-key-v1" private key from a file or from memory, and keep
+ * it only when its type starts with 'type'. Returns -1 for keys in other
+ * formats, the caller then tries the crypto backend's PEM reader.
+ */
+static int
+hostkey_openssh_key(LIBSSH2_SESSION * session, const char *privkeyfile,
+                    const char *filedata, size_t filedata_len,
+                    const char *type, struct _libssh2_openssh_key *key)
+{
+    size_t type_len = strlen(type);
+    int ret;
+
+    if (privkeyfile) {
+        FILE *fp = fopen(privkeyfile, "r");
+        if (!fp) {
+            return -1;
+        }
+        ret = _libssh2_openssh_pem_parse(session, fp, key);
+        fclose(fp);
+    }
+    else {
+        ret = _libssh2_openssh_pem_parse_memory(session, filedata,
+                                                filedata_len, key);
+    }
+    if (ret) {
+        return -1;
+    }
+
+    if (key->type_len < type_len || memcmp(key->type, type, type_len)) {
+        _libssh2_openssh_key_free(session, key);
+        return -1;
+    }
+    return 0;
+}
+#endif /* LIBSSH2_ECDSA || LIBSSH2_ED25519 */
+
+#if LIBSSH2_ECDSA
+/* *******************************
+ * ecdsa-sha2-nistp{256,384,521} *
+ ******************************* */
+
+static int hostkey_method_ssh_ecdsa_dtor(LIBSSH2_SESSION * session,
+                                         void **abstract);
+
+/*
+ * hostkey_method_ssh_ecdsa_curve
+ *
+ * Map the curve name in a key, "nistp256" and so on, to its type
+ */
+static int
+hostkey_method_ssh_ecdsa_curve(const unsigned char *name, size_t name_len,
+                               libssh2_curve_type *curve)
+{
+    if (name_len != 8) {
+        return -1;
+    }
+    if (!memcmp(name, "nistp256", 8)) {
+        *curve = LIBSSH2_EC_CURVE_NISTP256;
+    }
+    else if (!memcmp(name, "nistp384", 8)) {
+        *curve = LIBSSH2_EC_CURVE_NISTP384;
+    }
+    else if (!memcmp(name, "nistp521", 8)) {
+        *curve = LIBSSH2_EC_CURVE_NISTP521;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_hash
+ *
+ * Hash an array of vectors with the SHA-2 function RFC 5656 pairs with the
+ * curve of the key
+ */
+static int
+hostkey_method_ssh_ecdsa_hash(libssh2_ecdsa_ctx * ecdsactx,
+                              int veccount, const struct iovec datavec[],
+                              unsigned char *hash, size_t *hash_len)
+{
+    libssh2_curve_type curve;
+    int i;
+
+    if (_libssh2_ecdsa_curve_type(ecdsactx, &curve)) {
+        return -1;
+    }
+
+    switch (curve) {
+    case LIBSSH2_EC_CURVE_NISTP256: {
+        libssh2_sha256_ctx ctx;
+
+        if (!libssh2_sha256_init(&ctx)) {
+            return -1;
+        }
+        for (i = 0; i < veccount; i++) {
+            libssh2_sha256_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha256_final(ctx, hash);
+        *hash_len = SHA256_DIGEST_LENGTH;
+        break;
+    }
+    case LIBSSH2_EC_CURVE_NISTP384: {
+        libssh2_sha384_ctx ctx;
+
+        if (!libssh2_sha384_init(&ctx)) {
+            return -1;
+        }
+        for (i = 0; i < veccount; i++) {
+            libssh2_sha384_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha384_final(ctx, hash);
+        *hash_len = SHA384_DIGEST_LENGTH;
+        break;
+    }
+    case LIBSSH2_EC_CURVE_NISTP521: {
+        libssh2_sha512_ctx ctx;
+
+        if (!libssh2_sha512_init(&ctx)) {
+            return -1;
+        }
+        for (i = 0; i < veccount; i++) {
+            libssh2_sha512_update(ctx, datavec[i].iov_base,
+                                  datavec[i].iov_len);
+        }
+        libssh2_sha512_final(ctx, hash);
+        *hash_len = SHA512_DIGEST_LENGTH;
+        break;
+    }
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_init
+ *
+ * Initialize the server hostkey working area with the curve and point Q
+ */
+static int
+hostkey_method_ssh_ecdsa_init(LIBSSH2_SESSION * session,
+                              const unsigned char *hostkey_data,
+                              size_t hostkey_data_len,
+                              void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    libssh2_curve_type curve;
+    unsigned char *s = (unsigned char *) hostkey_data;
+    const unsigned char *end = hostkey_data + hostkey_data_len;
+    unsigned char *type, *name, *q;
+    size_t type_len, name_len, q_len;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    /* "ecdsa-sha2-" + curve name, the curve name again, then Q */
+    if (_libssh2_get_string(&s, end, &type, &type_len) ||
+        _libssh2_get_string(&s, end, &name, &name_len) ||
+        _libssh2_get_string(&s, end, &q, &q_len)) {
+        return -1;
+    }
+    if (type_len != 19 || memcmp(type, "ecdsa-sha2-", 11) ||
+        memcmp(type + 11, name, name_len) ||
+        hostkey_method_ssh_ecdsa_curve(name, name_len, &curve)) {
+        return -1;
+    }
+
+    if (_libssh2_ecdsa_new_public(&ecdsactx, session, curve, q, q_len)) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_openssh
+ *
+ * Turn the private fields of an OpenSSH key into a key: the curve name, Q
+ * and the mpint d
+ */
+static int
+hostkey_method_ssh_ecdsa_openssh(LIBSSH2_SESSION * session,
+                                 struct _libssh2_openssh_key *key,
+                                 libssh2_ecdsa_ctx **ecdsactx)
+{
+    libssh2_curve_type curve;
+    unsigned char *s = key->fields;
+    const unsigned char *end = key->fields + key->fields_len;
+    unsigned char *name, *q, *d;
+    size_t name_len, q_len, d_len;
+    int ret;
+
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        _libssh2_get_string(&s, end, &q, &q_len) ||
+        _libssh2_get_string(&s, end, &d, &d_len) ||
+        hostkey_method_ssh_ecdsa_curve(name, name_len, &curve)) {
+        ret = -1;
+    }
+    else {
+        ret = _libssh2_ecdsa_new_private_raw(ecdsactx, session, curve,
+                                             q, q_len, d, d_len);
+    }
+
+    _libssh2_openssh_key_free(session, key);
+    return ret;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_initPEM
+ *
+ * Load a Private Key from an OpenSSH or PEM file
+ */
+static int
+hostkey_method_ssh_ecdsa_initPEM(LIBSSH2_SESSION * session,
+                                 const char *privkeyfile,
+                                 unsigned const char *passphrase,
+                                 void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    struct _libssh2_openssh_key key;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    if (!hostkey_openssh_key(session, privkeyfile, NULL, 0, "ecdsa-sha2-",
+                             &key)) {
+        ret = hostkey_method_ssh_ecdsa_openssh(session, &key, &ecdsactx);
+    }
+    else {
+        ret = _libssh2_ecdsa_new_private(&ecdsactx, session, privkeyfile,
+                                         passphrase);
+    }
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_initPEMFromMemory
+ *
+ * Load a Private Key from memory
+ */
+static int
+hostkey_method_ssh_ecdsa_initPEMFromMemory(LIBSSH2_SESSION * session,
+                                           const char *privkeyfiledata,
+                                           size_t privkeyfiledata_len,
+                                           unsigned const char *passphrase,
+                                           void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx;
+    struct _libssh2_openssh_key key;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ecdsa_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    if (!hostkey_openssh_key(session, NULL, privkeyfiledata,
+                             privkeyfiledata_len, "ecdsa-sha2-", &key)) {
+        ret = hostkey_method_ssh_ecdsa_openssh(session, &key, &ecdsactx);
+    }
+    else {
+        ret = _libssh2_ecdsa_new_private_frommemory(&ecdsactx, session,
+                                                    privkeyfiledata,
+                                                    privkeyfiledata_len,
+                                                    passphrase);
+    }
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ecdsactx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_sig_verify
+ *
+ * Verify signature created by remote
+ */
+static int
+hostkey_method_ssh_ecdsa_sig_verify(LIBSSH2_SESSION * session,
+                                    const unsigned char *sig,
+                                    size_t sig_len,
+                                    const unsigned char *m,
+                                    size_t m_len, void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    size_t hash_len;
+    unsigned char *s = (unsigned char *) sig;
+    const unsigned char *end = sig + sig_len;
+    unsigned char *name, *blob, *r, *ss;
+    size_t name_len, blob_len, r_len, s_len;
+    struct iovec datavec;
+
+    /* keyname, then a string holding mpint r and mpint s */
+    if (_libssh2_get_string(&s, end, &name, &name_len) ||
+        _libssh2_get_string(&s, end, &blob, &blob_len)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ECDSA signature");
+    }
+    s = blob;
+    end = blob + blob_len;
+    if (_libssh2_get_string(&s, end, &r, &r_len) ||
+        _libssh2_get_string(&s, end, &ss, &s_len)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ECDSA signature");
+    }
+
+    datavec.iov_base = (void *) m;
+    datavec.iov_len = m_len;
+    if (hostkey_method_ssh_ecdsa_hash(ecdsactx, 1, &datavec,
+                                      hash, &hash_len)) {
+        return -1;
+    }
+
+    return _libssh2_ecdsa_verify(ecdsactx, r, r_len, ss, s_len,
+                                 hash, hash_len);
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_signv
+ *
+ * Construct a signature from an array of vectors
+ */
+static int
+hostkey_method_ssh_ecdsa_signv(LIBSSH2_SESSION * session,
+                               unsigned char **signature,
+                               size_t *signature_len,
+                               int veccount,
+                               const struct iovec datavec[],
+                               void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    unsigned char hash[SHA512_DIGEST_LENGTH];
+    size_t hash_len;
+    unsigned char *r, *s, *p;
+    size_t r_len, s_len;
+    int r_pad, s_pad;
+
+    if (hostkey_method_ssh_ecdsa_hash(ecdsactx, veccount, datavec,
+                                      hash, &hash_len)) {
+        return -1;
+    }
+
+    if (_libssh2_ecdsa_sign(session, ecdsactx, hash, hash_len,
+                            &r, &r_len, &s, &s_len)) {
+        return -1;
+    }
+
+    /* mpint r, mpint s: positive numbers with the top bit set get a
+       leading zero */
+    r_pad = (r[0] & 0x80) ? 1 : 0;
+    s_pad = (s[0] & 0x80) ? 1 : 0;
+    *signature_len = 4 + r_pad + r_len + 4 + s_pad + s_len;
+    *signature = LIBSSH2_ALLOC(session, *signature_len);
+    if (*signature) {
+        p = *signature;
+        _libssh2_store_u32(&p, r_pad + r_len);
+        if (r_pad) {
+            *p++ = 0;
+        }
+        memcpy(p, r, r_len);
+        p += r_len;
+        _libssh2_store_u32(&p, s_pad + s_len);
+        if (s_pad) {
+            *p++ = 0;
+        }
+        memcpy(p, s, s_len);
+    }
+
+    LIBSSH2_FREE(session, r);
+    LIBSSH2_FREE(session, s);
+
+    return *signature ? 0 : -1;
+}
+
+/*
+ * hostkey_method_ssh_ecdsa_dtor
+ *
+ * Shutdown the hostkey
+ */
+static int
+hostkey_method_ssh_ecdsa_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    libssh2_ecdsa_ctx *ecdsactx = (libssh2_ecdsa_ctx *) (*abstract);
+    (void) session;
+
+    _libssh2_ecdsa_free(ecdsactx);
+
+    *abstract = NULL;
+
+    return 0;
+}
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp256 = {
+    "ecdsa-sha2-nistp256",
+    MD5_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp384 = {
+    "ecdsa-sha2-nistp384",
+    MD5_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ecdsa_ssh_nistp521 = {
+    "ecdsa-sha2-nistp521",
+    MD5_DIGEST_LENGTH,
+    hostkey_method_ssh_ecdsa_init,
+    hostkey_method_ssh_ecdsa_initPEM,
+    hostkey_method_ssh_ecdsa_initPEMFromMemory,
+    hostkey_method_ssh_ecdsa_sig_verify,
+    hostkey_method_ssh_ecdsa_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ecdsa_dtor,
+};
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+/* ***************
+ * ssh-ed25519 *
+ *************** */
+
+static int hostkey_method_ssh_ed25519_dtor(LIBSSH2_SESSION * session,
+                                           void **abstract);
+
+/*
+ * hostkey_method_ssh_ed25519_init
+ *
+ * Initialize the server hostkey working area with the 32 byte public key
+ */
+static int
+hostkey_method_ssh_ed25519_init(LIBSSH2_SESSION * session,
+                                const unsigned char *hostkey_data,
+                                size_t hostkey_data_len,
+                                void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    unsigned char *s = (unsigned char *) hostkey_data;
+    const unsigned char *end = hostkey_data + hostkey_data_len;
+    unsigned char *type, *pub;
+    size_t type_len, pub_len;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    if (_libssh2_get_string(&s, end, &type, &type_len) ||
+        _libssh2_get_string(&s, end, &pub, &pub_len)) {
+        return -1;
+    }
+    if (type_len != 11 || memcmp(type, "ssh-ed25519", 11) || pub_len != 32) {
+        return -1;
+    }
+
+    if (_libssh2_ed25519_new_public(&ed25519ctx, session, pub, pub_len)) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_openssh
+ *
+ * Turn the private fields of an OpenSSH key into a key: the public key and
+ * the seed followed by the public key again
+ */
+static int
+hostkey_method_ssh_ed25519_openssh(LIBSSH2_SESSION * session,
+                                   struct _libssh2_openssh_key *key,
+                                   libssh2_ed25519_ctx **ed25519ctx)
+{
+    unsigned char *s = key->fields;
+    const unsigned char *end = key->fields + key->fields_len;
+    unsigned char *pub, *priv;
+    size_t pub_len, priv_len;
+    int ret;
+
+    if (_libssh2_get_string(&s, end, &pub, &pub_len) ||
+        _libssh2_get_string(&s, end, &priv, &priv_len) ||
+        pub_len != 32 || priv_len != 64 || memcmp(pub, priv + 32, 32)) {
+        ret = -1;
+    }
+    else {
+        ret = _libssh2_ed25519_new_private_raw(ed25519ctx, session,
+                                               priv, pub);
+    }
+
+    _libssh2_openssh_key_free(session, key);
+    return ret;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_initPEM
+ *
+ * Load a Private Key from an OpenSSH or PEM file
+ */
+static int
+hostkey_method_ssh_ed25519_initPEM(LIBSSH2_SESSION * session,
+                                   const char *privkeyfile,
+                                   unsigned const char *passphrase,
+                                   void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    struct _libssh2_openssh_key key;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    if (!hostkey_openssh_key(session, privkeyfile, NULL, 0, "ssh-ed25519",
+                             &key)) {
+        ret = hostkey_method_ssh_ed25519_openssh(session, &key, &ed25519ctx);
+    }
+    else {
+        ret = _libssh2_ed25519_new_private(&ed25519ctx, session, privkeyfile,
+                                           passphrase);
+    }
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_initPEMFromMemory
+ *
+ * Load a Private Key from memory
+ */
+static int
+hostkey_method_ssh_ed25519_initPEMFromMemory(LIBSSH2_SESSION * session,
+                                             const char *privkeyfiledata,
+                                             size_t privkeyfiledata_len,
+                                             unsigned const char *passphrase,
+                                             void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx;
+    struct _libssh2_openssh_key key;
+    int ret;
+
+    if (*abstract) {
+        hostkey_method_ssh_ed25519_dtor(session, abstract);
+        *abstract = NULL;
+    }
+
+    if (!hostkey_openssh_key(session, NULL, privkeyfiledata,
+                             privkeyfiledata_len, "ssh-ed25519", &key)) {
+        ret = hostkey_method_ssh_ed25519_openssh(session, &key, &ed25519ctx);
+    }
+    else {
+        ret = _libssh2_ed25519_new_private_frommemory(&ed25519ctx, session,
+                                                      privkeyfiledata,
+                                                      privkeyfiledata_len,
+                                                      passphrase);
+    }
+    if (ret) {
+        return -1;
+    }
+
+    *abstract = ed25519ctx;
+
+    return 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_sig_verify
+ *
+ * Verify signature created by remote
+ */
+static int
+hostkey_method_ssh_ed25519_sig_verify(LIBSSH2_SESSION * session,
+                                      const unsigned char *sig,
+                                      size_t sig_len,
+                                      const unsigned char *m,
+                                      size_t m_len, void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    unsigned char *s = (unsigned char *) sig;
+    unsigned char *name, *blob;
+    size_t name_len, blob_len;
+
+    /* keyname, then the 64 byte signature */
+    if (_libssh2_get_string(&s, sig + sig_len, &name, &name_len) ||
+        _libssh2_get_string(&s, sig + sig_len, &blob, &blob_len) ||
+        blob_len != 64) {
+        return _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                              "Invalid ED25519 signature");
+    }
+
+    return _libssh2_ed25519_verify(ed25519ctx, blob, blob_len, m, m_len);
+}
+
+/*
+ * hostkey_method_ssh_ed25519_signv
+ *
+ * Construct a signature from an array of vectors. Ed25519 hashes the
+ * message itself, so the vectors are joined first.
+ */
+static int
+hostkey_method_ssh_ed25519_signv(LIBSSH2_SESSION * session,
+                                 unsigned char **signature,
+                                 size_t *signature_len,
+                                 int veccount,
+                                 const struct iovec datavec[],
+                                 void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    unsigned char *m, *p;
+    size_t m_len = 0;
+    int i, ret;
+
+    for (i = 0; i < veccount; i++) {
+        m_len += datavec[i].iov_len;
+    }
+    m = LIBSSH2_ALLOC(session, m_len ? m_len : 1);
+    if (!m) {
+        return -1;
+    }
+    for (p = m, i = 0; i < veccount; i++) {
+        memcpy(p, datavec[i].iov_base, datavec[i].iov_len);
+        p += datavec[i].iov_len;
+    }
+
+    ret = _libssh2_ed25519_sign(session, ed25519ctx, m, m_len,
+                                signature, signature_len);
+    LIBSSH2_FREE(session, m);
+
+    return ret ? -1 : 0;
+}
+
+/*
+ * hostkey_method_ssh_ed25519_dtor
+ *
+ * Shutdown the hostkey
+ */
+static int
+hostkey_method_ssh_ed25519_dtor(LIBSSH2_SESSION * session, void **abstract)
+{
+    libssh2_ed25519_ctx *ed25519ctx = (libssh2_ed25519_ctx *) (*abstract);
+    (void) session;
+
+    _libssh2_ed25519_free(ed25519ctx);
+
+    *abstract = NULL;
+
+    return 0;
+}
+
+static const LIBSSH2_HOSTKEY_METHOD hostkey_method_ssh_ed25519 = {
+    "ssh-ed25519",
+    MD5_DIGEST_LENGTH,
+    hostkey_method_ssh_ed25519_init,
+    hostkey_method_ssh_ed25519_initPEM,
+    hostkey_method_ssh_ed25519_initPEMFromMemory,
+    hostkey_method_ssh_ed25519_sig_verify,
+    hostkey_method_ssh_ed25519_signv,
+    NULL,                       /* encrypt */
+    hostkey_method_ssh_ed25519_dtor,
+};
+#endif /* LIBSSH2_ED25519 */
+
 static const LIBSSH2_HOSTKEY_METHOD *hostkey_methods[] = {
+#if LIBSSH2_ED25519
+    &hostkey_method_ssh_ed25519,
+#endif /* LIBSSH2_ED25519 */
+#if LIBSSH2_ECDSA
+    &hostkey_method_ecdsa_ssh_nistp256,
+    &hostkey_method_ecdsa_ssh_nistp384,
+    &hostkey_method_ecdsa_ssh_nistp521,
+#endif /* LIBSSH2_ECDSA */
 #if LIBSSH2_RSA
     &hostkey_method_ssh_rsa,
 #endif /* LIBSSH2_RSA */
@@ -500,34 +1215,80 @@ libssh2_hostkey_methods(void)
 }
 
 /*
- * libssh2_hostkey_hash
+ * hostkey_hash
  *
- * Returns hash signature
- * Returned buffer should NOT be freed
- * Length of buffer is determined by hash type
- * i.e. MD5 == 16, SHA1 == 20
+ * Take a fingerprint of the server's host key unless it was taken already
  */
-LIBSSH2_API const char *
-libssh2_hostkey_hash(LIBSSH2_SESSION * session, int hash_type)
+static const char *
+hostkey_hash(LIBSSH2_SESSION * session, int hash_type)
 {
+    if (!session->server_hostkey)
+        return NULL;
+
     switch (hash_type) {
 #if LIBSSH2_MD5
     case LIBSSH2_HOSTKEY_HASH_MD5:
-        return (session->server_hostkey_md5_valid)
-          ? (char *) session->server_hostkey_md5
-          : NULL;
-        break;
+        if (!session->server_hostkey_md5_valid) {
+            libssh2_md5_ctx fingerprint_ctx;
+
+            if (!libssh2_md5_init(&fingerprint_ctx))
+                return NULL;
+            libssh2_md5_update(fingerprint_ctx, session->server_hostkey,
+                               session->server_hostkey_len);
+            libssh2_md5_final(fingerprint_ctx, session->server_hostkey_md5);
+            session->server_hostkey_md5_valid = TRUE;
+        }
+        return (char *) session->server_hostkey_md5;
 #endif /* LIBSSH2_MD5 */
     case LIBSSH2_HOSTKEY_HASH_SHA1:
-        return (session->server_hostkey_sha1_valid)
-          ? (char *) session->server_hostkey_sha1
-          : NULL;
-        break;
+        if (!session->server_hostkey_sha1_valid) {
+            libssh2_sha1_ctx fingerprint_ctx;
+
+            if (!libssh2_sha1_init(&fingerprint_ctx))
+                return NULL;
+            libssh2_sha1_update(fingerprint_ctx, session->server_hostkey,
+                                session->server_hostkey_len);
+            libssh2_sha1_final(fingerprint_ctx, session->server_hostkey_sha1);
+            session->server_hostkey_sha1_valid = TRUE;
+        }
+        return (char *) session->server_hostkey_sha1;
+    case LIBSSH2_HOSTKEY_HASH_SHA256:
+        if (!session->server_hostkey_sha256_valid) {
+            libssh2_sha256_ctx fingerprint_ctx;
+
+            if (!libssh2_sha256_init(&fingerprint_ctx))
+                return NULL;
+            libssh2_sha256_update(fingerprint_ctx, session->server_hostkey,
+                                  session->server_hostkey_len);
+            libssh2_sha256_final(fingerprint_ctx,
+                                 session->server_hostkey_sha256);
+            session->server_hostkey_sha256_valid = TRUE;
+        }
+        return (char *) session->server_hostkey_sha256;
     default:
         return NULL;
     }
 }
 
+/*
+ * libssh2_hostkey_hash
+ *
+ * Returns hash signature
+ * Returned buffer should NOT be freed
+ * Length of buffer is determined by hash type
+ * i.e. MD5 == 16, SHA1 == 20, SHA256 == 32
+ */
+LIBSSH2_API const char *
+libssh2_hostkey_hash(LIBSSH2_SESSION * session, int hash_type)
+{
+    const char *hash;
+
+    BLOCK_LOCK(session->lock);
+    hash = hostkey_hash(session, hash_type);
+    BLOCK_UNLOCK(session->lock);
+    return hash;
+}
+
 static int hostkey_type(const unsigned char *hostkey, size_t len)
 {
     const unsigned char rsa[] = {
@@ -536,6 +1297,21 @@ static int hostkey_type(const unsigned char *hostkey, size_t len)
     const unsigned char dss[] = {
         0, 0, 0, 0x07, 's', 's', 'h', '-', 'd', 's', 's'
     };
+    const unsigned char ecdsa_256[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '2', '5', '6'
+    };
+    const unsigned char ecdsa_384[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '3', '8', '4'
+    };
+    const unsigned char ecdsa_521[] = {
+        0, 0, 0, 0x13, 'e', 'c', 'd', 's', 'a', '-', 's', 'h', 'a', '2', '-',
+        'n', 'i', 's', 't', 'p', '5', '2', '1'
+    };
+    const unsigned char ed25519[] = {
+        0, 0, 0, 0x0b, 's', 's', 'h', '-', 'e', 'd', '2', '5', '5', '1', '9'
+    };
 
     if (len < 11)
         return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
@@ -546,6 +1322,24 @@ static int hostkey_type(const unsigned char *hostkey, size_t len)
     if (!memcmp(dss, hostkey, 11))
         return LIBSSH2_HOSTKEY_TYPE_DSS;
 
+    if (len < 15)
+        return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
+
+    if (!memcmp(ed25519, hostkey, 15))
+        return LIBSSH2_HOSTKEY_TYPE_ED25519;
+
+    if (len < 23)
+        return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
+
+    if (!memcmp(ecdsa_256, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_256;
+
+    if (!memcmp(ecdsa_384, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_384;
+
+    if (!memcmp(ecdsa_521, hostkey, 23))
+        return LIBSSH2_HOSTKEY_TYPE_ECDSA_521;
+
     return LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
 }
 
@@ -38,6 +38,10 @@
 
 #include "libssh2_priv.h"
 #include "transport.h" /* _libssh2_transport_write */
+#include "session.h" /* BLOCK_LOCK */
+#include "misc.h" /* _libssh2_list_*, _libssh2_time_ns */
+
+#include <stdlib.h>
 
 /* Keep-alive stuff. */
 
@@ -51,6 +55,42 @@ libssh2_keepalive_config (LIBSSH2_SESSION *session,
     else
         session->keepalive_interval = interval;
     session->keepalive_want_reply = want_reply ? 1 : 0;
+    _libssh2_group_update(session);
+}
+
+/*
+ * keepalive_send
+ *
+ * Send a keepalive message now
+ */
+static int
+keepalive_send(LIBSSH2_SESSION *session)
+{
+    /* Format is
+       "SSH_MSG_GLOBAL_REQUEST || 4-byte len || str || want-reply". */
+    unsigned char keepalive_data[]
+        = "\x50\x00\x00\x00\x15keepalive@libssh2.orgW";
+    size_t len = sizeof (keepalive_data) - 1;
+    int rc;
+
+    keepalive_data[len - 1] =
+        (unsigned char)session->keepalive_want_reply;
+
+    BLOCK_LOCK(session->lock);
+    rc = _libssh2_transport_send(session, keepalive_data, len, NULL, 0);
+    BLOCK_UNLOCK(session->lock);
+    /* Silently ignore PACKET_EAGAIN here: if the write buffer is
+       already full, sending another keepalive is not useful. */
+    if (rc && rc != LIBSSH2_ERROR_EAGAIN) {
+        _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                       "Unable to send keepalive message");
+        return rc;
+    }
+
+    session->keepalive_last_sent = time (NULL);
+    if (session->group_entry)
+        session->group_entry->keepalive_ms = _libssh2_time_ns() / 1000000;
+    return 0;
 }
 
 LIBSSH2_API int
@@ -68,26 +108,10 @@ libssh2_keepalive_send (LIBSSH2_SESSION *session,
     now = time (NULL);
 
     if (session->keepalive_last_sent + session->keepalive_interval <= now) {
-        /* Format is
-           "SSH_MSG_GLOBAL_REQUEST || 4-byte len || str || want-reply". */
-        unsigned char keepalive_data[]
-            = "\x50\x00\x00\x00\x15keepalive@libssh2.orgW";
-        size_t len = sizeof (keepalive_data) - 1;
-        int rc;
-
-        keepalive_data[len - 1] =
-            (unsigned char)session->keepalive_want_reply;
-
-        rc = _libssh2_transport_send(session, keepalive_data, len, NULL, 0);
-        /* Silently ignore PACKET_EAGAIN here: if the write buffer is
-           already full, sending another keepalive is not useful. */
-        if (rc && rc != LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                           "Unable to send keepalive message");
+        int rc = keepalive_send(session);
+        if (rc)
             return rc;
-        }
 
-        session->keepalive_last_sent = now;
         if (seconds_to_next)
             *seconds_to_next = session->keepalive_interval;
     } else if (seconds_to_next) {
@@ -97,3 +121,319 @@ libssh2_keepalive_send (LIBSSH2_SESSION *session,
 
     return 0;
 }
+
+/* Session groups: the keepalive and timeout deadlines of many sessions on
+   one timer wheel, so that an event loop only looks at the due ones. */
+
+static libssh2_uint64_t
+group_now(void)
+{
+    return _libssh2_time_ns() / 1000000;
+}
+
+/*
+ * group_deadline
+ *
+ * The millisecond of the next keepalive or timeout of a session in a
+ * group, 0 if it has neither. A timeout is api_timeout milliseconds
+ * without anything received.
+ */
+static libssh2_uint64_t
+group_deadline(struct _libssh2_group_entry *entry)
+{
+    LIBSSH2_SESSION *session = entry->session;
+    libssh2_uint64_t deadline = 0;
+
+    if (session->keepalive_interval)
+        deadline = entry->keepalive_ms +
+            (libssh2_uint64_t)session->keepalive_interval * 1000;
+    if ((session->api_timeout > 0) &&
+        (!deadline ||
+         (entry->recv_ms + session->api_timeout < deadline)))
+        deadline = entry->recv_ms + session->api_timeout;
+    return deadline;
+}
+
+/*
+ * group_file
+ *
+ * (Re)file a session in the wheel slot of its next deadline, or on the idle
+ * list if it has none
+ */
+static void
+group_file(struct _libssh2_group_entry *entry)
+{
+    LIBSSH2_SESSION_GROUP *group = entry->group;
+    libssh2_uint64_t deadline = group_deadline(entry);
+
+    _libssh2_list_remove(&entry->node);
+    if (entry->filed) {
+        entry->filed = 0;
+        group->filed--;
+    }
+    if (!deadline) {
+        _libssh2_list_add(&group->idle, &entry->node);
+        return;
+    }
+
+    /* the first tick that starts at or after the deadline, never one that
+       has fired already */
+    entry->tick = (deadline + LIBSSH2_GROUP_TICK_MS - 1) /
+        LIBSSH2_GROUP_TICK_MS;
+    if (entry->tick < group->tick)
+        entry->tick = group->tick;
+    _libssh2_list_add(&group->slots[entry->tick % LIBSSH2_GROUP_SLOTS],
+                      &entry->node);
+    entry->filed = 1;
+    group->filed++;
+}
+
+/*
+ * _libssh2_group_update
+ *
+ * The keepalive interval or the timeout of a session changed, file it
+ * again if it is in a group
+ */
+void
+_libssh2_group_update(LIBSSH2_SESSION *session)
+{
+    if (session->group_entry)
+        group_file(session->group_entry);
+}
+
+/*
+ * libssh2_session_group_init
+ *
+ * Create an empty session group, it belongs to no session
+ */
+LIBSSH2_API LIBSSH2_SESSION_GROUP *
+libssh2_session_group_init(void)
+{
+    LIBSSH2_SESSION_GROUP *group = malloc(sizeof(*group));
+    int i;
+
+    if (!group)
+        return NULL;
+
+    for (i = 0; i < LIBSSH2_GROUP_SLOTS; i++)
+        _libssh2_list_init(&group->slots[i]);
+    _libssh2_list_init(&group->idle);
+    group->tick = group_now() / LIBSSH2_GROUP_TICK_MS;
+    group->filed = 0;
+    return group;
+}
+
+/*
+ * libssh2_session_group_add
+ *
+ * Put a session in a group, its keepalive and timeout count from now
+ */
+LIBSSH2_API int
+libssh2_session_group_add(LIBSSH2_SESSION_GROUP *group,
+                          LIBSSH2_SESSION *session)
+{
+    struct _libssh2_group_entry *entry;
+
+    if (!group || !session)
+        return LIBSSH2_ERROR_BAD_USE;
+    if (session->group_entry)
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "Already in a session group");
+
+    entry = LIBSSH2_CALLOC(session, sizeof(struct _libssh2_group_entry));
+    if (!entry)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for session group "
+                              "entry");
+    entry->group = group;
+    entry->session = session;
+    entry->keepalive_ms = entry->recv_ms = group_now();
+    _libssh2_list_add(&group->idle, &entry->node);
+    session->group_entry = entry;
+    group_file(entry);
+    return 0;
+}
+
+/*
+ * libssh2_session_group_remove
+ *
+ * Take a session out of its group
+ */
+LIBSSH2_API int
+libssh2_session_group_remove(LIBSSH2_SESSION *session)
+{
+    struct _libssh2_group_entry *entry;
+
+    if (!session || !session->group_entry)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    entry = session->group_entry;
+    _libssh2_list_remove(&entry->node);
+    if (entry->filed)
+        entry->group->filed--;
+    session->group_entry = NULL;
+    LIBSSH2_FREE(session, entry);
+    return 0;
+}
+
+/*
+ * libssh2_session_group_next
+ *
+ * How many milliseconds until the first tick that has a session filed for
+ * it. One turn of the wheel at the most, the sessions filed beyond that
+ * are looked at again when it has passed.
+ */
+LIBSSH2_API long
+libssh2_session_group_next(LIBSSH2_SESSION_GROUP *group)
+{
+    libssh2_uint64_t now;
+    libssh2_uint64_t tick;
+
+    if (!group)
+        return LIBSSH2_ERROR_BAD_USE;
+    if (!group->filed)
+        return -1;
+
+    now = group_now();
+    for (tick = group->tick; tick < group->tick + LIBSSH2_GROUP_SLOTS;
+         tick++) {
+        struct _libssh2_group_entry *entry =
+            _libssh2_list_first(&group->slots[tick % LIBSSH2_GROUP_SLOTS]);
+
+        for (; entry; entry = _libssh2_list_next(&entry->node)) {
+            if (entry->tick == tick)
+                return (tick * LIBSSH2_GROUP_TICK_MS > now) ?
+                    (long)(tick * LIBSSH2_GROUP_TICK_MS - now) : 0;
+        }
+    }
+    return (long)LIBSSH2_GROUP_SLOTS * LIBSSH2_GROUP_TICK_MS;
+}
+
+/*
+ * group_fire
+ *
+ * A session's tick came, send its keepalive and report its timeout if they
+ * are due and file it for the next deadline. Returns non-zero if it timed
+ * out but there is no room left to report it, it is then left as it is.
+ */
+static int
+group_fire(struct _libssh2_group_entry *entry, libssh2_uint64_t now,
+           LIBSSH2_SESSION **timed_out, unsigned int max, unsigned int *count)
+{
+    LIBSSH2_SESSION *session = entry->session;
+    int report = 0;
+
+    if ((session->api_timeout > 0) &&
+        (entry->recv_ms + session->api_timeout <= now)) {
+        if (*count >= max)
+            return 1;
+        _libssh2_error(session, LIBSSH2_ERROR_TIMEOUT,
+                       "Nothing received within the session timeout");
+        /* report it again after another timeout */
+        entry->recv_ms = now;
+        report = 1;
+    }
+
+    if (session->keepalive_interval &&
+        (entry->keepalive_ms +
+         (libssh2_uint64_t)session->keepalive_interval * 1000 <= now)) {
+        if (keepalive_send(session)) {
+            /* a session that cannot send is as good as timed out */
+            if (!report && (*count >= max))
+                return 1;
+            report = 1;
+        }
+        entry->keepalive_ms = now;
+    }
+
+    if (report)
+        timed_out[(*count)++] = session;
+    group_file(entry);
+    return 0;
+}
+
+/*
+ * libssh2_session_group_run
+ *
+ * Fire the ticks that passed, at most one turn of the wheel of them
+ */
+LIBSSH2_API int
+libssh2_session_group_run(LIBSSH2_SESSION_GROUP *group,
+                          LIBSSH2_SESSION **timed_out, unsigned int max)
+{
+    libssh2_uint64_t now;
+    libssh2_uint64_t now_tick;
+    unsigned int count = 0;
+    int turn;
+
+    if (!group || (max && !timed_out))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    now = group_now();
+    now_tick = now / LIBSSH2_GROUP_TICK_MS;
+
+    for (turn = 0; (turn < LIBSSH2_GROUP_SLOTS) && group->filed &&
+             (group->tick <= now_tick); turn++) {
+        struct list_head *slot =
+            &group->slots[group->tick % LIBSSH2_GROUP_SLOTS];
+        struct list_head due;
+        struct _libssh2_group_entry *entry;
+
+        /* take the slot's entries off first, those filed again may land
+           on it */
+        _libssh2_list_init(&due);
+        while ((entry = _libssh2_list_first(slot))) {
+            _libssh2_list_remove(&entry->node);
+            _libssh2_list_add(&due, &entry->node);
+        }
+
+        while ((entry = _libssh2_list_first(&due))) {
+            if (entry->tick > now_tick) {
+                /* filed for a later turn of the wheel */
+                _libssh2_list_remove(&entry->node);
+                _libssh2_list_add(slot, &entry->node);
+            }
+            else if (group_deadline(entry) > now)
+                /* its deadline moved on since it was filed */
+                group_file(entry);
+            else if (group_fire(entry, now, timed_out, max, &count)) {
+                /* out of room, leave the rest of the slot for next time */
+                while ((entry = _libssh2_list_first(&due))) {
+                    _libssh2_list_remove(&entry->node);
+                    _libssh2_list_add(slot, &entry->node);
+                }
+                return (int)count;
+            }
+        }
+        group->tick++;
+    }
+
+    if (!group->filed || (group->tick <= now_tick))
+        /* nothing to wait for, or a whole turn went by: every session has
+           been looked at */
+        group->tick = now_tick + 1;
+    return (int)count;
+}
+
+/*
+ * libssh2_session_group_free
+ *
+ * Free a session group, the sessions in it leave it
+ */
+LIBSSH2_API void
+libssh2_session_group_free(LIBSSH2_SESSION_GROUP *group)
+{
+    struct _libssh2_group_entry *entry;
+    int i;
+
+    if (!group)
+        return;
+
+    for (i = 0; i < LIBSSH2_GROUP_SLOTS; i++) {
+        while ((entry = _libssh2_list_first(&group->slots[i])))
+            libssh2_session_group_remove(entry->session);
+    }
+    while ((entry = _libssh2_list_first(&group->idle)))
+        libssh2_session_group_remove(entry->session);
+    free(group);
+}
@@ -41,6 +41,11 @@
 #include "transport.h"
 #include "comp.h"
 #include "mac.h"
+#include "thread.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 /* TODO: Switch this to an inline and handle alloc() failures */
 /* Helper macro called from kex_method_diffie_hellman_group1_sha1_key_exchange */
@@ -99,6 +104,512 @@
     }
 
 
+/*
+ * kex_server_hostkey
+ *
+ * Store the server's host key K_S found at *sp and hand it to the
+ * negotiated hostkey method. *sp is moved past the key.
+ */
+static int
+kex_server_hostkey(LIBSSH2_SESSION *session, unsigned char **sp)
+{
+    session->server_hostkey_len = _libssh2_ntohu32(*sp);
+    *sp += 4;
+
+    if (session->server_hostkey)
+        LIBSSH2_FREE(session, session->server_hostkey);
+
+    session->server_hostkey =
+        LIBSSH2_ALLOC(session, session->server_hostkey_len);
+    if (!session->server_hostkey) {
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for a copy "
+                              "of the host key");
+    }
+    memcpy(session->server_hostkey, *sp,
+           session->server_hostkey_len);
+    *sp += session->server_hostkey_len;
+
+    /* the fingerprints are taken when libssh2_hostkey_hash() asks */
+#if LIBSSH2_MD5
+    session->server_hostkey_md5_valid = FALSE;
+#endif
+    session->server_hostkey_sha1_valid = FALSE;
+    session->server_hostkey_sha256_valid = FALSE;
+#ifdef LIBSSH2DEBUG
+    if (session->showmask & LIBSSH2_TRACE_KEX) {
+        const unsigned char *sha1 = (const unsigned char *)
+            libssh2_hostkey_hash(session, LIBSSH2_HOSTKEY_HASH_SHA1);
+        char fingerprint[64], *fprint = fingerprint;
+        int i;
+
+        if (sha1) {
+            for(i = 0; i < 20; i++, fprint += 3) {
+                snprintf(fprint, 4, "%02x:", sha1[i]);
+            }
+            *(--fprint) = '\0';
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Server's SHA1 Fingerprint: %s", fingerprint);
+        }
+    }
+#endif /* LIBSSH2DEBUG */
+
+    if (session->hostkey->init(session, session->server_hostkey,
+                               session->server_hostkey_len,
+                               &session->server_hostkey_abstract)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_INIT,
+                              "Unable to initialize hostkey importer");
+    }
+
+    return 0;
+}
+
+
+/* The fixed groups of RFC 4253 and RFC 3526, generator 2 */
+static const unsigned char group1_p[128] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xC9, 0x0F, 0xDA, 0xA2, 0x21, 0x68, 0xC2, 0x34,
+    0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1,
+    0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74,
+    0x02, 0x0B, 0xBE, 0xA6, 0x3B, 0x13, 0x9B, 0x22,
+    0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
+    0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B,
+    0x30, 0x2B, 0x0A, 0x6D, 0xF2, 0x5F, 0x14, 0x37,
+    0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45,
+    0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6,
+    0xF4, 0x4C, 0x42, 0xE9, 0xA6, 0x37, 0xED, 0x6B,
+    0x0B, 0xFF, 0x5C, 0xB6, 0xF4, 0x06, 0xB7, 0xED,
+    0xEE, 0x38, 0x6B, 0xFB, 0x5A, 0x89, 0x9F, 0xA5,
+    0xAE, 0x9F, 0x24, 0x11, 0x7C, 0x4B, 0x1F, 0xE6,
+    0x49, 0x28, 0x66, 0x51, 0xEC, 0xE6, 0x53, 0x81,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char group14_p[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xC9, 0x0F, 0xDA, 0xA2, 0x21, 0x68, 0xC2, 0x34,
+    0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1,
+    0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74,
+    0x02, 0x0B, 0xBE, 0xA6, 0x3B, 0x13, 0x9B, 0x22,
+    0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
+    0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B,
+    0x30, 0x2B, 0x0A, 0x6D, 0xF2, 0x5F, 0x14, 0x37,
+    0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45,
+    0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6,
+    0xF4, 0x4C, 0x42, 0xE9, 0xA6, 0x37, 0xED, 0x6B,
+    0x0B, 0xFF, 0x5C, 0xB6, 0xF4, 0x06, 0xB7, 0xED,
+    0xEE, 0x38, 0x6B, 0xFB, 0x5A, 0x89, 0x9F, 0xA5,
+    0xAE, 0x9F, 0x24, 0x11, 0x7C, 0x4B, 0x1F, 0xE6,
+    0x49, 0x28, 0x66, 0x51, 0xEC, 0xE4, 0x5B, 0x3D,
+    0xC2, 0x00, 0x7C, 0xB8, 0xA1, 0x63, 0xBF, 0x05,
+    0x98, 0xDA, 0x48, 0x36, 0x1C, 0x55, 0xD3, 0x9A,
+    0x69, 0x16, 0x3F, 0xA8, 0xFD, 0x24, 0xCF, 0x5F,
+    0x83, 0x65, 0x5D, 0x23, 0xDC, 0xA3, 0xAD, 0x96,
+    0x1C, 0x62, 0xF3, 0x56, 0x20, 0x85, 0x52, 0xBB,
+    0x9E, 0xD5, 0x29, 0x07, 0x70, 0x96, 0x96, 0x6D,
+    0x67, 0x0C, 0x35, 0x4E, 0x4A, 0xBC, 0x98, 0x04,
+    0xF1, 0x74, 0x6C, 0x08, 0xCA, 0x18, 0x21, 0x7C,
+    0x32, 0x90, 0x5E, 0x46, 0x2E, 0x36, 0xCE, 0x3B,
+    0xE3, 0x9E, 0x77, 0x2C, 0x18, 0x0E, 0x86, 0x03,
+    0x9B, 0x27, 0x83, 0xA2, 0xEC, 0x07, 0xA2, 0x8F,
+    0xB5, 0xC5, 0x5D, 0xF0, 0x6F, 0x4C, 0x52, 0xC9,
+    0xDE, 0x2B, 0xCB, 0xF6, 0x95, 0x58, 0x17, 0x18,
+    0x39, 0x95, 0x49, 0x7C, 0xEA, 0x95, 0x6A, 0xE5,
+    0x15, 0xD2, 0x26, 0x18, 0x98, 0xFA, 0x05, 0x10,
+    0x15, 0x72, 0x8E, 0x5A, 0x8A, 0xAC, 0xAA, 0x68,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/*
+ * Precomputed Diffie-Hellman ephemerals, see libssh2_dh_precompute()
+ *
+ * The pool is shared by all sessions, so it is allocated with plain
+ * malloc() and not with any session's allocator. Every ephemeral is handed
+ * to exactly one exchange and freed there, none is ever used twice.
+ */
+
+struct dh_ephemeral
+{
+    _libssh2_bn *x;                 /* random exponent */
+    _libssh2_bn *e;                 /* g^x mod p */
+    struct dh_ephemeral *next;
+};
+
+static const struct dh_group
+{
+    const unsigned char *p;
+    int p_len;
+    int order;                      /* bits in x */
+} dh_groups[] = {
+    { group1_p, sizeof(group1_p), 128 },
+    { group14_p, sizeof(group14_p), 256 }
+};
+
+#define DH_GROUPS (int)(sizeof(dh_groups) / sizeof(dh_groups[0]))
+
+static struct dh_ephemeral *dh_pool[DH_GROUPS];
+static int dh_pool_count[DH_GROUPS];
+static int dh_pool_want;            /* ephemerals kept for each group */
+static long dh_pool_pid;            /* the process the pool belongs to */
+
+#ifdef HAVE_UNISTD_H
+#define DH_POOL_PID() ((long)getpid())
+#else
+#define DH_POOL_PID() 0L            /* no fork() to guard against */
+#endif
+
+#ifdef LIBSSH2_THREADS
+static pthread_mutex_t dh_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dh_pool_refill = PTHREAD_COND_INITIALIZER;
+static pthread_t dh_pool_thread;
+static int dh_pool_running;
+static int dh_pool_quit;
+#define DH_POOL_LOCK() pthread_mutex_lock(&dh_pool_lock)
+#define DH_POOL_UNLOCK() pthread_mutex_unlock(&dh_pool_lock)
+#else
+#define DH_POOL_LOCK() do {} while(0)
+#define DH_POOL_UNLOCK() do {} while(0)
+#endif
+
+/*
+ * dh_ephemeral_new
+ *
+ * Compute a new ephemeral for a group. Returns NULL on failure.
+ */
+static struct dh_ephemeral *
+dh_ephemeral_new(const struct dh_group *group)
+{
+    struct dh_ephemeral *eph = malloc(sizeof(*eph));
+    _libssh2_bn_ctx *ctx;
+    _libssh2_bn *g;
+    _libssh2_bn *p;
+
+    if (!eph)
+        return NULL;
+
+    ctx = _libssh2_bn_ctx_new();
+    g = _libssh2_bn_init();
+    p = _libssh2_bn_init_from_bin();
+    eph->x = _libssh2_bn_init();
+    eph->e = _libssh2_bn_init();
+    eph->next = NULL;
+
+    if (!g || !p || !eph->x || !eph->e) {
+        if (g)
+            _libssh2_bn_free(g);
+        if (p)
+            _libssh2_bn_free(p);
+        if (eph->x)
+            _libssh2_bn_free(eph->x);
+        if (eph->e)
+            _libssh2_bn_free(eph->e);
+        _libssh2_bn_ctx_free(ctx);
+        free(eph);
+        return NULL;
+    }
+
+    _libssh2_bn_set_word(g, 2);
+    _libssh2_bn_from_bin(p, group->p_len, group->p);
+    _libssh2_bn_rand(eph->x, group->order, 0, -1);
+    _libssh2_bn_mod_exp(eph->e, g, eph->x, p, ctx);
+
+    _libssh2_bn_free(g);
+    _libssh2_bn_free(p);
+    _libssh2_bn_ctx_free(ctx);
+    return eph;
+}
+
+static void
+dh_ephemeral_free(struct dh_ephemeral *eph)
+{
+    _libssh2_bn_free(eph->x);
+    _libssh2_bn_free(eph->e);
+    free(eph);
+}
+
+/*
+ * dh_pool_forked
+ *
+ * A child of fork() inherits the pool of its parent, and using the same
+ * ephemerals in both would reuse the secret x. Drop them when the pool was
+ * filled by another process, along with the refill thread that fork() did
+ * not copy. Called with the pool locked.
+ */
+static void
+dh_pool_forked(void)
+{
+    struct dh_ephemeral *eph;
+    long pid = DH_POOL_PID();
+    int i;
+
+    if (dh_pool_pid == pid)
+        return;
+
+    for (i = 0; i < DH_GROUPS; i++) {
+        while (dh_pool[i]) {
+            eph = dh_pool[i];
+            dh_pool[i] = eph->next;
+            dh_ephemeral_free(eph);
+        }
+        dh_pool_count[i] = 0;
+    }
+#ifdef LIBSSH2_THREADS
+    dh_pool_running = 0;
+#endif
+    dh_pool_pid = pid;
+}
+
+/*
+ * dh_pool_short
+ *
+ * The group with the fewest ephemerals, or -1 if all have enough. Called with
+ * the pool locked.
+ */
+static int
+dh_pool_short(void)
+{
+    int shortest = -1;
+    int i;
+
+    for (i = 0; i < DH_GROUPS; i++) {
+        if (dh_pool_count[i] < dh_pool_want &&
+            (shortest < 0 || dh_pool_count[i] < dh_pool_count[shortest]))
+            shortest = i;
+    }
+    return shortest;
+}
+
+/*
+ * dh_pool_add
+ *
+ * Compute one ephemeral for the group that is the furthest from full.
+ * Returns 1 if one was added, 0 if the pool is full and -1 on failure.
+ */
+static int
+dh_pool_add(void)
+{
+    struct dh_ephemeral *eph;
+    int group;
+
+    DH_POOL_LOCK();
+    group = dh_pool_short();
+    DH_POOL_UNLOCK();
+    if (group < 0)
+        return 0;
+
+    /* the slow part runs without the lock */
+    eph = dh_ephemeral_new(&dh_groups[group]);
+    if (!eph)
+        return -1;
+
+    DH_POOL_LOCK();
+    dh_pool_forked();
+    if (dh_pool_count[group] < dh_pool_want) {
+        eph->next = dh_pool[group];
+        dh_pool[group] = eph;
+        dh_pool_count[group]++;
+        eph = NULL;
+    }
+    DH_POOL_UNLOCK();
+
+    if (eph)
+        /* the pool shrunk meanwhile */
+        dh_ephemeral_free(eph);
+    return 1;
+}
+
+/*
+ * dh_pool_trim
+ *
+ * Free what is beyond dh_pool_want. Called with the pool locked.
+ */
+static void
+dh_pool_trim(void)
+{
+    struct dh_ephemeral *eph;
+    int i;
+
+    for (i = 0; i < DH_GROUPS; i++) {
+        while (dh_pool_count[i] > dh_pool_want) {
+            eph = dh_pool[i];
+            dh_pool[i] = eph->next;
+            dh_pool_count[i]--;
+            dh_ephemeral_free(eph);
+        }
+    }
+}
+
+#ifdef LIBSSH2_THREADS
+static void *
+dh_pool_refiller(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&dh_pool_lock);
+    while (!dh_pool_quit) {
+        if (dh_pool_short() < 0) {
+            pthread_cond_wait(&dh_pool_refill, &dh_pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&dh_pool_lock);
+        if (dh_pool_add() < 0) {
+            /* out of memory, try again when an ephemeral is taken */
+            pthread_mutex_lock(&dh_pool_lock);
+            if (!dh_pool_quit)
+                pthread_cond_wait(&dh_pool_refill, &dh_pool_lock);
+            continue;
+        }
+        pthread_mutex_lock(&dh_pool_lock);
+    }
+    pthread_mutex_unlock(&dh_pool_lock);
+    return NULL;
+}
+#endif
+
+/*
+ * dh_pool_take
+ *
+ * Take a precomputed x and e for the exchange if g and p are one of the
+ * fixed groups and its pool is not empty. Returns 1 if it did, 0 if the
+ * exchange has to compute its own.
+ */
+static int
+dh_pool_take(_libssh2_bn *g, _libssh2_bn *p,
+             _libssh2_bn **x, _libssh2_bn **e)
+{
+    unsigned char buf[256];
+    struct dh_ephemeral *eph = NULL;
+    int p_len;
+    int i;
+
+    DH_POOL_LOCK();
+    i = dh_pool_want;
+    DH_POOL_UNLOCK();
+    if (!i)
+        return 0;
+
+    if (_libssh2_bn_bytes(g) != 1)
+        return 0;
+    _libssh2_bn_to_bin(g, buf);
+    if (buf[0] != 2)
+        return 0;
+
+    p_len = _libssh2_bn_bytes(p);
+    if (p_len > (int)sizeof(buf))
+        return 0;
+    _libssh2_bn_to_bin(p, buf);
+
+    for (i = 0; i < DH_GROUPS; i++) {
+        if (p_len == dh_groups[i].p_len &&
+            !memcmp(buf, dh_groups[i].p, p_len))
+            break;
+    }
+    if (i == DH_GROUPS)
+        return 0;
+
+    DH_POOL_LOCK();
+    dh_pool_forked();
+    if (dh_pool[i]) {
+        eph = dh_pool[i];
+        dh_pool[i] = eph->next;
+        dh_pool_count[i]--;
+#ifdef LIBSSH2_THREADS
+        pthread_cond_signal(&dh_pool_refill);
+#endif
+    }
+    DH_POOL_UNLOCK();
+
+    if (!eph)
+        return 0;
+
+    *x = eph->x;
+    *e = eph->e;
+    free(eph);
+    return 1;
+}
+
+/*
+ * libssh2_dh_precompute
+ *
+ * Keep 'count' Diffie-Hellman ephemerals ready for each of the fixed groups
+ */
+LIBSSH2_API int
+libssh2_dh_precompute(int count)
+{
+    int rc = 0;
+
+    if (count < 0)
+        return LIBSSH2_ERROR_INVAL;
+
+    if (count)
+        _libssh2_init_if_needed();
+
+    DH_POOL_LOCK();
+    dh_pool_forked();
+    dh_pool_want = count;
+    dh_pool_trim();
+#ifdef LIBSSH2_THREADS
+    if (count && !dh_pool_running) {
+        dh_pool_quit = 0;
+        if (!pthread_create(&dh_pool_thread, NULL, dh_pool_refiller, NULL)) {
+            dh_pool_running = 1;
+        }
+    }
+    else if (!count && dh_pool_running) {
+        dh_pool_quit = 1;
+        pthread_cond_signal(&dh_pool_refill);
+        pthread_mutex_unlock(&dh_pool_lock);
+        pthread_join(dh_pool_thread, NULL);
+        pthread_mutex_lock(&dh_pool_lock);
+        dh_pool_running = 0;
+    }
+    else {
+        pthread_cond_signal(&dh_pool_refill);
+    }
+    if (dh_pool_running) {
+        pthread_mutex_unlock(&dh_pool_lock);
+        return 0;
+    }
+#endif
+    DH_POOL_UNLOCK();
+
+    /* no thread to do it, fill the pool right away */
+    while ((rc = dh_pool_add()) > 0);
+
+    return rc ? LIBSSH2_ERROR_ALLOC : 0;
+}
+
+/*
+ * Our guess of the key exchange method, see _libssh2_kex_begin() and
+ * session->kex_guess
+ */
+#define LIBSSH2_KEX_GUESS_NONE  0   /* no guess, or the guess was right */
+#define LIBSSH2_KEX_GUESS_SEND  1   /* the guessed first packet goes out */
+#define LIBSSH2_KEX_GUESS_SENT  2   /* it did, the server's KEXINIT is due */
+#define LIBSSH2_KEX_GUESS_WRONG 3   /* the server ignores it, drop it */
+
+/*
+ * kex_guess_wait
+ *
+ * Called by the key exchange methods once their first packet is sent,
+ * before they wait for the server's answer. Returns LIBSSH2_ERROR_EAGAIN to
+ * stop there while that packet is only a guess, LIBSSH2_ERROR_KEX_FAILURE to
+ * drop the exchange when the guess was wrong and 0 to go on.
+ */
+static int kex_guess_wait(LIBSSH2_SESSION *session)
+{
+    switch (session->kex_guess) {
+    case LIBSSH2_KEX_GUESS_SEND:
+        session->kex_guess = LIBSSH2_KEX_GUESS_SENT;
+        return LIBSSH2_ERROR_EAGAIN;
+    case LIBSSH2_KEX_GUESS_SENT:
+        return LIBSSH2_ERROR_EAGAIN;
+    case LIBSSH2_KEX_GUESS_WRONG:
+        return LIBSSH2_ERROR_KEX_FAILURE;
+    }
+    return 0;
+}
+
 /*
  * diffie_hellman_sha1
  *
@@ -123,19 +634,27 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
         exchange_state->e_packet = NULL;
         exchange_state->s_packet = NULL;
         exchange_state->k_value = NULL;
-        exchange_state->ctx = _libssh2_bn_ctx_new();
-        exchange_state->x = _libssh2_bn_init(); /* Random from client */
-        exchange_state->e = _libssh2_bn_init(); /* g^x mod p */
+        if (!session->bn_ctx)
+            session->bn_ctx = _libssh2_bn_ctx_new();
+        exchange_state->ctx = session->bn_ctx;
         exchange_state->f = _libssh2_bn_init_from_bin(); /* g^(Random from server) mod p */
         exchange_state->k = _libssh2_bn_init(); /* The shared secret: f^x mod p */
 
         /* Zero the whole thing out */
         memset(&exchange_state->req_state, 0, sizeof(packet_require_state_t));
 
-        /* Generate x and e */
-        _libssh2_bn_rand(exchange_state->x, group_order, 0, -1);
-        _libssh2_bn_mod_exp(exchange_state->e, g, exchange_state->x, p,
-                            exchange_state->ctx);
+        /* Generate x and e, unless they were computed ahead of time */
+        if (dh_pool_take(g, p, &exchange_state->x, &exchange_state->e)) {
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Using a precomputed Diffie-Hellman ephemeral");
+        }
+        else {
+            exchange_state->x = _libssh2_bn_init(); /* Random from client */
+            exchange_state->e = _libssh2_bn_init(); /* g^x mod p */
+            _libssh2_bn_rand(exchange_state->x, group_order, 0, -1);
+            _libssh2_bn_mod_exp(exchange_state->e, g, exchange_state->x, p,
+                                exchange_state->ctx);
+        }
 
         /* Send KEX init */
         /* packet_type(1) + String Length(4) + leading 0(1) */
@@ -185,6 +704,14 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
     }
 
     if (exchange_state->state == libssh2_NB_state_sent) {
+        rc = kex_guess_wait(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = rc;
+            goto clean_exit;
+        }
+
         if (session->burn_optimistic_kexinit) {
             /* The first KEX packet to come along will be the guess initially
              * sent by the server.  That guess turned out to be wrong so we
@@ -229,89 +756,9 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
 
         /* Parse KEXDH_REPLY */
         exchange_state->s = exchange_state->s_packet + 1;
-
-        session->server_hostkey_len = _libssh2_ntohu32(exchange_state->s);
-        exchange_state->s += 4;
-
-        if (session->server_hostkey)
-            LIBSSH2_FREE(session, session->server_hostkey);
-
-        session->server_hostkey =
-            LIBSSH2_ALLOC(session, session->server_hostkey_len);
-        if (!session->server_hostkey) {
-            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                 "Unable to allocate memory for a copy "
-                                 "of the host key");
-            goto clean_exit;
-        }
-        memcpy(session->server_hostkey, exchange_state->s,
-               session->server_hostkey_len);
-        exchange_state->s += session->server_hostkey_len;
-
-#if LIBSSH2_MD5
-        {
-            libssh2_md5_ctx fingerprint_ctx;
-
-            if (libssh2_md5_init(&fingerprint_ctx)) {
-                libssh2_md5_update(fingerprint_ctx, session->server_hostkey,
-                                   session->server_hostkey_len);
-                libssh2_md5_final(fingerprint_ctx,
-                                  session->server_hostkey_md5);
-                session->server_hostkey_md5_valid = TRUE;
-            }
-            else {
-                session->server_hostkey_md5_valid = FALSE;
-            }
-        }
-#ifdef LIBSSH2DEBUG
-        {
-            char fingerprint[50], *fprint = fingerprint;
-            int i;
-            for(i = 0; i < 16; i++, fprint += 3) {
-                snprintf(fprint, 4, "%02x:", session->server_hostkey_md5[i]);
-            }
-            *(--fprint) = '\0';
-            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
-                           "Server's MD5 Fingerprint: %s", fingerprint);
-        }
-#endif /* LIBSSH2DEBUG */
-#endif /* ! LIBSSH2_MD5 */
-
-        {
-            libssh2_sha1_ctx fingerprint_ctx;
-
-            if (libssh2_sha1_init(&fingerprint_ctx)) {
-                libssh2_sha1_update(fingerprint_ctx, session->server_hostkey,
-                                    session->server_hostkey_len);
-                libssh2_sha1_final(fingerprint_ctx,
-                                   session->server_hostkey_sha1);
-                session->server_hostkey_sha1_valid = TRUE;
-            }
-            else {
-                session->server_hostkey_sha1_valid = FALSE;
-            }
-        }
-#ifdef LIBSSH2DEBUG
-        {
-            char fingerprint[64], *fprint = fingerprint;
-            int i;
-
-            for(i = 0; i < 20; i++, fprint += 3) {
-                snprintf(fprint, 4, "%02x:", session->server_hostkey_sha1[i]);
-            }
-            *(--fprint) = '\0';
-            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
-                           "Server's SHA1 Fingerprint: %s", fingerprint);
-        }
-#endif /* LIBSSH2DEBUG */
-
-        if (session->hostkey->init(session, session->server_hostkey,
-                                   session->server_hostkey_len,
-                                   &session->server_hostkey_abstract)) {
-            ret = _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_INIT,
-                                 "Unable to initialize hostkey importer");
+        ret = kex_server_hostkey(session, &exchange_state->s);
+        if (ret)
             goto clean_exit;
-        }
 
         exchange_state->f_value_len = _libssh2_ntohu32(exchange_state->s);
         exchange_state->s += 4;
@@ -614,8 +1061,12 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->local.mac->init(session, key, &free_key,
-                                     &session->local.mac_abstract);
+            if (session->local.mac->init(session, key, &free_key,
+                                         &session->local.mac_abstract)) {
+                LIBSSH2_FREE(session, key);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
 
             if (free_key) {
                 memset(key, 0, session->local.mac->key_len);
@@ -628,6 +1079,7 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
         if (session->remote.mac->dtor) {
             session->remote.mac->dtor(session, &session->remote.mac_abstract);
         }
+        session->remote.mac_gen++;
 
         if (session->remote.mac->init) {
             unsigned char *key = NULL;
@@ -640,8 +1092,12 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->remote.mac->init(session, key, &free_key,
-                                      &session->remote.mac_abstract);
+            if (session->remote.mac->init(session, key, &free_key,
+                                          &session->remote.mac_abstract)) {
+                LIBSSH2_FREE(session, key);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
 
             if (free_key) {
                 memset(key, 0, session->remote.mac->key_len);
@@ -684,6 +1140,7 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Server to Client compression initialized");
 
+        _libssh2_transport_kernels(session);
     }
 
   clean_exit:
@@ -695,7 +1152,7 @@ static int diffie_hellman_sha1(LIBSSH2_SESSION *session,
     exchange_state->f = NULL;
     _libssh2_bn_free(exchange_state->k);
     exchange_state->k = NULL;
-    _libssh2_bn_ctx_free(exchange_state->ctx);
+    /* the context stays with the session */
     exchange_state->ctx = NULL;
 
     if (exchange_state->e_packet) {
@@ -743,19 +1200,27 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
         exchange_state->e_packet = NULL;
         exchange_state->s_packet = NULL;
         exchange_state->k_value = NULL;
-        exchange_state->ctx = _libssh2_bn_ctx_new();
-        exchange_state->x = _libssh2_bn_init(); /* Random from client */
-        exchange_state->e = _libssh2_bn_init(); /* g^x mod p */
+        if (!session->bn_ctx)
+            session->bn_ctx = _libssh2_bn_ctx_new();
+        exchange_state->ctx = session->bn_ctx;
         exchange_state->f = _libssh2_bn_init_from_bin(); /* g^(Random from server) mod p */
         exchange_state->k = _libssh2_bn_init(); /* The shared secret: f^x mod p */
 
         /* Zero the whole thing out */
         memset(&exchange_state->req_state, 0, sizeof(packet_require_state_t));
 
-        /* Generate x and e */
-        _libssh2_bn_rand(exchange_state->x, group_order, 0, -1);
-        _libssh2_bn_mod_exp(exchange_state->e, g, exchange_state->x, p,
-                            exchange_state->ctx);
+        /* Generate x and e, unless they were computed ahead of time */
+        if (dh_pool_take(g, p, &exchange_state->x, &exchange_state->e)) {
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Using a precomputed Diffie-Hellman ephemeral");
+        }
+        else {
+            exchange_state->x = _libssh2_bn_init(); /* Random from client */
+            exchange_state->e = _libssh2_bn_init(); /* g^x mod p */
+            _libssh2_bn_rand(exchange_state->x, group_order, 0, -1);
+            _libssh2_bn_mod_exp(exchange_state->e, g, exchange_state->x, p,
+                                exchange_state->ctx);
+        }
 
         /* Send KEX init */
         /* packet_type(1) + String Length(4) + leading 0(1) */
@@ -805,6 +1270,14 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
     }
 
     if (exchange_state->state == libssh2_NB_state_sent) {
+        rc = kex_guess_wait(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = rc;
+            goto clean_exit;
+        }
+
         if (session->burn_optimistic_kexinit) {
             /* The first KEX packet to come along will be the guess initially
              * sent by the server.  That guess turned out to be wrong so we
@@ -849,114 +1322,34 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
 
         /* Parse KEXDH_REPLY */
         exchange_state->s = exchange_state->s_packet + 1;
+        ret = kex_server_hostkey(session, &exchange_state->s);
+        if (ret)
+            goto clean_exit;
 
-        session->server_hostkey_len = _libssh2_ntohu32(exchange_state->s);
+        exchange_state->f_value_len = _libssh2_ntohu32(exchange_state->s);
         exchange_state->s += 4;
+        exchange_state->f_value = exchange_state->s;
+        exchange_state->s += exchange_state->f_value_len;
+        _libssh2_bn_from_bin(exchange_state->f, exchange_state->f_value_len,
+                             exchange_state->f_value);
 
-        if (session->server_hostkey)
-            LIBSSH2_FREE(session, session->server_hostkey);
+        exchange_state->h_sig_len = _libssh2_ntohu32(exchange_state->s);
+        exchange_state->s += 4;
+        exchange_state->h_sig = exchange_state->s;
 
-        session->server_hostkey =
-            LIBSSH2_ALLOC(session, session->server_hostkey_len);
-        if (!session->server_hostkey) {
+        /* Compute the shared secret */
+        _libssh2_bn_mod_exp(exchange_state->k, exchange_state->f,
+                            exchange_state->x, p, exchange_state->ctx);
+        exchange_state->k_value_len = _libssh2_bn_bytes(exchange_state->k) + 5;
+        if (_libssh2_bn_bits(exchange_state->k) % 8) {
+            /* don't need leading 00 */
+            exchange_state->k_value_len--;
+        }
+        exchange_state->k_value =
+            LIBSSH2_ALLOC(session, exchange_state->k_value_len);
+        if (!exchange_state->k_value) {
             ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                 "Unable to allocate memory for a copy "
-                                 "of the host key");
-            goto clean_exit;
-        }
-        memcpy(session->server_hostkey, exchange_state->s,
-               session->server_hostkey_len);
-        exchange_state->s += session->server_hostkey_len;
-
-#if LIBSSH2_MD5
-        {
-            libssh2_md5_ctx fingerprint_ctx;
-
-            if (libssh2_md5_init(&fingerprint_ctx)) {
-                libssh2_md5_update(fingerprint_ctx, session->server_hostkey,
-                                   session->server_hostkey_len);
-                libssh2_md5_final(fingerprint_ctx,
-                                  session->server_hostkey_md5);
-                session->server_hostkey_md5_valid = TRUE;
-            }
-            else {
-                session->server_hostkey_md5_valid = FALSE;
-            }
-        }
-#ifdef LIBSSH2DEBUG
-        {
-            char fingerprint[50], *fprint = fingerprint;
-            int i;
-            for(i = 0; i < 16; i++, fprint += 3) {
-                snprintf(fprint, 4, "%02x:", session->server_hostkey_md5[i]);
-            }
-            *(--fprint) = '\0';
-            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
-                           "Server's MD5 Fingerprint: %s", fingerprint);
-        }
-#endif /* LIBSSH2DEBUG */
-#endif /* ! LIBSSH2_MD5 */
-
-        {
-            libssh2_sha1_ctx fingerprint_ctx;
-
-            if (libssh2_sha1_init(&fingerprint_ctx)) {
-                libssh2_sha1_update(fingerprint_ctx, session->server_hostkey,
-                                    session->server_hostkey_len);
-                libssh2_sha1_final(fingerprint_ctx,
-                                   session->server_hostkey_sha1);
-                session->server_hostkey_sha1_valid = TRUE;
-            }
-            else {
-                session->server_hostkey_sha1_valid = FALSE;
-            }
-        }
-#ifdef LIBSSH2DEBUG
-        {
-            char fingerprint[64], *fprint = fingerprint;
-            int i;
-
-            for(i = 0; i < 20; i++, fprint += 3) {
-                snprintf(fprint, 4, "%02x:", session->server_hostkey_sha1[i]);
-            }
-            *(--fprint) = '\0';
-            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
-                           "Server's SHA1 Fingerprint: %s", fingerprint);
-        }
-#endif /* LIBSSH2DEBUG */
-
-        if (session->hostkey->init(session, session->server_hostkey,
-                                   session->server_hostkey_len,
-                                   &session->server_hostkey_abstract)) {
-            ret = _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_INIT,
-                                 "Unable to initialize hostkey importer");
-            goto clean_exit;
-        }
-
-        exchange_state->f_value_len = _libssh2_ntohu32(exchange_state->s);
-        exchange_state->s += 4;
-        exchange_state->f_value = exchange_state->s;
-        exchange_state->s += exchange_state->f_value_len;
-        _libssh2_bn_from_bin(exchange_state->f, exchange_state->f_value_len,
-                             exchange_state->f_value);
-
-        exchange_state->h_sig_len = _libssh2_ntohu32(exchange_state->s);
-        exchange_state->s += 4;
-        exchange_state->h_sig = exchange_state->s;
-
-        /* Compute the shared secret */
-        _libssh2_bn_mod_exp(exchange_state->k, exchange_state->f,
-                            exchange_state->x, p, exchange_state->ctx);
-        exchange_state->k_value_len = _libssh2_bn_bytes(exchange_state->k) + 5;
-        if (_libssh2_bn_bits(exchange_state->k) % 8) {
-            /* don't need leading 00 */
-            exchange_state->k_value_len--;
-        }
-        exchange_state->k_value =
-            LIBSSH2_ALLOC(session, exchange_state->k_value_len);
-        if (!exchange_state->k_value) {
-            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                 "Unable to allocate buffer for K");
+                                 "Unable to allocate buffer for K");
             goto clean_exit;
         }
         _libssh2_htonu32(exchange_state->k_value,
@@ -1236,8 +1629,12 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->local.mac->init(session, key, &free_key,
-                                     &session->local.mac_abstract);
+            if (session->local.mac->init(session, key, &free_key,
+                                         &session->local.mac_abstract)) {
+                LIBSSH2_FREE(session, key);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
 
             if (free_key) {
                 memset(key, 0, session->local.mac->key_len);
@@ -1250,6 +1647,7 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
         if (session->remote.mac->dtor) {
             session->remote.mac->dtor(session, &session->remote.mac_abstract);
         }
+        session->remote.mac_gen++;
 
         if (session->remote.mac->init) {
             unsigned char *key = NULL;
@@ -1262,8 +1660,12 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
                 ret = LIBSSH2_ERROR_KEX_FAILURE;
                 goto clean_exit;
             }
-            session->remote.mac->init(session, key, &free_key,
-                                      &session->remote.mac_abstract);
+            if (session->remote.mac->init(session, key, &free_key,
+                                          &session->remote.mac_abstract)) {
+                LIBSSH2_FREE(session, key);
+                ret = LIBSSH2_ERROR_KEX_FAILURE;
+                goto clean_exit;
+            }
 
             if (free_key) {
                 memset(key, 0, session->remote.mac->key_len);
@@ -1306,6 +1708,7 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Server to Client compression initialized");
 
+        _libssh2_transport_kernels(session);
     }
 
   clean_exit:
@@ -1317,7 +1720,7 @@ static int diffie_hellman_sha256(LIBSSH2_SESSION *session,
     exchange_state->f = NULL;
     _libssh2_bn_free(exchange_state->k);
     exchange_state->k = NULL;
-    _libssh2_bn_ctx_free(exchange_state->ctx);
+    /* the context stays with the session */
     exchange_state->ctx = NULL;
 
     if (exchange_state->e_packet) {
@@ -1350,35 +1753,16 @@ kex_method_diffie_hellman_group1_sha1_key_exchange(LIBSSH2_SESSION *session,
                                                    key_exchange_state_low_t
                                                    * key_state)
 {
-    static const unsigned char p_value[128] = {
-        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-        0xC9, 0x0F, 0xDA, 0xA2, 0x21, 0x68, 0xC2, 0x34,
-        0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1,
-        0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74,
-        0x02, 0x0B, 0xBE, 0xA6, 0x3B, 0x13, 0x9B, 0x22,
-        0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
-        0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B,
-        0x30, 0x2B, 0x0A, 0x6D, 0xF2, 0x5F, 0x14, 0x37,
-        0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45,
-        0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6,
-        0xF4, 0x4C, 0x42, 0xE9, 0xA6, 0x37, 0xED, 0x6B,
-        0x0B, 0xFF, 0x5C, 0xB6, 0xF4, 0x06, 0xB7, 0xED,
-        0xEE, 0x38, 0x6B, 0xFB, 0x5A, 0x89, 0x9F, 0xA5,
-        0xAE, 0x9F, 0x24, 0x11, 0x7C, 0x4B, 0x1F, 0xE6,
-        0x49, 0x28, 0x66, 0x51, 0xEC, 0xE6, 0x53, 0x81,
-        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
-    };
-
     int ret;
 
     if (key_state->state == libssh2_NB_state_idle) {
         /* g == 2 */
-        key_state->p = _libssh2_bn_init_from_bin();      /* SSH2 defined value (p_value) */
+        key_state->p = _libssh2_bn_init_from_bin();      /* SSH2 defined value (group1_p) */
         key_state->g = _libssh2_bn_init();      /* SSH2 defined value (2) */
 
         /* Initialize P and G */
         _libssh2_bn_set_word(key_state->g, 2);
-        _libssh2_bn_from_bin(key_state->p, 128, p_value);
+        _libssh2_bn_from_bin(key_state->p, 128, group1_p);
 
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Initiating Diffie-Hellman Group1 Key Exchange");
@@ -1411,50 +1795,16 @@ kex_method_diffie_hellman_group14_sha1_key_exchange(LIBSSH2_SESSION *session,
                                                     key_exchange_state_low_t
                                                     * key_state)
 {
-    static const unsigned char p_value[256] = {
-        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-        0xC9, 0x0F, 0xDA, 0xA2, 0x21, 0x68, 0xC2, 0x34,
-        0xC4, 0xC6, 0x62, 0x8B, 0x80, 0xDC, 0x1C, 0xD1,
-        0x29, 0x02, 0x4E, 0x08, 0x8A, 0x67, 0xCC, 0x74,
-        0x02, 0x0B, 0xBE, 0xA6, 0x3B, 0x13, 0x9B, 0x22,
-        0x51, 0x4A, 0x08, 0x79, 0x8E, 0x34, 0x04, 0xDD,
-        0xEF, 0x95, 0x19, 0xB3, 0xCD, 0x3A, 0x43, 0x1B,
-        0x30, 0x2B, 0x0A, 0x6D, 0xF2, 0x5F, 0x14, 0x37,
-        0x4F, 0xE1, 0x35, 0x6D, 0x6D, 0x51, 0xC2, 0x45,
-        0xE4, 0x85, 0xB5, 0x76, 0x62, 0x5E, 0x7E, 0xC6,
-        0xF4, 0x4C, 0x42, 0xE9, 0xA6, 0x37, 0xED, 0x6B,
-        0x0B, 0xFF, 0x5C, 0xB6, 0xF4, 0x06, 0xB7, 0xED,
-        0xEE, 0x38, 0x6B, 0xFB, 0x5A, 0x89, 0x9F, 0xA5,
-        0xAE, 0x9F, 0x24, 0x11, 0x7C, 0x4B, 0x1F, 0xE6,
-        0x49, 0x28, 0x66, 0x51, 0xEC, 0xE4, 0x5B, 0x3D,
-        0xC2, 0x00, 0x7C, 0xB8, 0xA1, 0x63, 0xBF, 0x05,
-        0x98, 0xDA, 0x48, 0x36, 0x1C, 0x55, 0xD3, 0x9A,
-        0x69, 0x16, 0x3F, 0xA8, 0xFD, 0x24, 0xCF, 0x5F,
-        0x83, 0x65, 0x5D, 0x23, 0xDC, 0xA3, 0xAD, 0x96,
-        0x1C, 0x62, 0xF3, 0x56, 0x20, 0x85, 0x52, 0xBB,
-        0x9E, 0xD5, 0x29, 0x07, 0x70, 0x96, 0x96, 0x6D,
-        0x67, 0x0C, 0x35, 0x4E, 0x4A, 0xBC, 0x98, 0x04,
-        0xF1, 0x74, 0x6C, 0x08, 0xCA, 0x18, 0x21, 0x7C,
-        0x32, 0x90, 0x5E, 0x46, 0x2E, 0x36, 0xCE, 0x3B,
-        0xE3, 0x9E, 0x77, 0x2C, 0x18, 0x0E, 0x86, 0x03,
-        0x9B, 0x27, 0x83, 0xA2, 0xEC, 0x07, 0xA2, 0x8F,
-        0xB5, 0xC5, 0x5D, 0xF0, 0x6F, 0x4C, 0x52, 0xC9,
-        0xDE, 0x2B, 0xCB, 0xF6, 0x95, 0x58, 0x17, 0x18,
-        0x39, 0x95, 0x49, 0x7C, 0xEA, 0x95, 0x6A, 0xE5,
-        0x15, 0xD2, 0x26, 0x18, 0x98, 0xFA, 0x05, 0x10,
-        0x15, 0x72, 0x8E, 0x5A, 0x8A, 0xAC, 0xAA, 0x68,
-        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
-    };
     int ret;
 
     if (key_state->state == libssh2_NB_state_idle) {
-        key_state->p = _libssh2_bn_init_from_bin();      /* SSH2 defined value (p_value) */
+        key_state->p = _libssh2_bn_init_from_bin();      /* SSH2 defined value (group14_p) */
         key_state->g = _libssh2_bn_init();      /* SSH2 defined value (2) */
 
         /* g == 2 */
         /* Initialize P and G */
         _libssh2_bn_set_word(key_state->g, 2);
-        _libssh2_bn_from_bin(key_state->p, 256, p_value);
+        _libssh2_bn_from_bin(key_state->p, 256, group14_p);
 
         _libssh2_debug(session, LIBSSH2_TRACE_KEX,
                        "Initiating Diffie-Hellman Group14 Key Exchange");
@@ -1529,6 +1879,14 @@ kex_method_diffie_hellman_group_exchange_sha1_key_exchange
     }
 
     if (key_state->state == libssh2_NB_state_sent) {
+        rc = kex_guess_wait(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = rc;
+            goto dh_gex_clean_exit;
+        }
+
         rc = _libssh2_packet_require(session, SSH_MSG_KEX_DH_GEX_GROUP,
                                      &key_state->data, &key_state->data_len,
                                      0, NULL, 0, &key_state->req_state);
@@ -1620,63 +1978,716 @@ kex_method_diffie_hellman_group_exchange_sha256_key_exchange
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         } else if (rc) {
-            ret = _libssh2_error(session, rc,
-                                 "Unable to send Group Exchange Request SHA256");
-            goto dh_gex_clean_exit;
+            ret = _libssh2_error(session, rc,
+                                 "Unable to send Group Exchange Request SHA256");
+            goto dh_gex_clean_exit;
+        }
+
+        key_state->state = libssh2_NB_state_sent;
+    }
+
+    if (key_state->state == libssh2_NB_state_sent) {
+        rc = kex_guess_wait(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = rc;
+            goto dh_gex_clean_exit;
+        }
+
+        rc = _libssh2_packet_require(session, SSH_MSG_KEX_DH_GEX_GROUP,
+                                     &key_state->data, &key_state->data_len,
+                                     0, NULL, 0, &key_state->req_state);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc,
+                                 "Timeout waiting for GEX_GROUP reply SHA256");
+            goto dh_gex_clean_exit;
+        }
+
+        key_state->state = libssh2_NB_state_sent1;
+    }
+
+    if (key_state->state == libssh2_NB_state_sent1) {
+        unsigned char *s = key_state->data + 1;
+        p_len = _libssh2_ntohu32(s);
+        s += 4;
+        _libssh2_bn_from_bin(key_state->p, p_len, s);
+        s += p_len;
+
+        g_len = _libssh2_ntohu32(s);
+        s += 4;
+        _libssh2_bn_from_bin(key_state->g, g_len, s);
+
+        ret = diffie_hellman_sha256(session, key_state->g, key_state->p, p_len,
+                                    SSH_MSG_KEX_DH_GEX_INIT,
+                                    SSH_MSG_KEX_DH_GEX_REPLY,
+                                    key_state->data + 1,
+                                    key_state->data_len - 1,
+                                    &key_state->exchange_state);
+        if (ret == LIBSSH2_ERROR_EAGAIN) {
+            return ret;
+        }
+
+        LIBSSH2_FREE(session, key_state->data);
+    }
+
+  dh_gex_clean_exit:
+    key_state->state = libssh2_NB_state_idle;
+    _libssh2_bn_free(key_state->g);
+    key_state->g = NULL;
+    _libssh2_bn_free(key_state->p);
+    key_state->p = NULL;
+
+    return ret;
+}
+
+
+#if LIBSSH2_ECDH
+
+/*
+ * The ECDH methods hash with SHA-256, SHA-384 or SHA-512 depending on the
+ * curve (RFC 5656 section 6.2.1). kex_hash_* pick the digest by its length.
+ */
+typedef struct kex_hash_ctx
+{
+    size_t len;
+    libssh2_sha256_ctx sha256;
+    libssh2_sha384_ctx sha384;
+    libssh2_sha512_ctx sha512;
+} kex_hash_ctx;
+
+static int
+kex_hash_init(kex_hash_ctx *ctx, size_t len)
+{
+    ctx->len = len;
+    switch(len) {
+    case SHA512_DIGEST_LENGTH:
+        return libssh2_sha512_init(&ctx->sha512);
+    case SHA384_DIGEST_LENGTH:
+        return libssh2_sha384_init(&ctx->sha384);
+    default:
+        return libssh2_sha256_init(&ctx->sha256);
+    }
+}
+
+static void
+kex_hash_update(kex_hash_ctx *ctx, const void *data, size_t len)
+{
+    switch(ctx->len) {
+    case SHA512_DIGEST_LENGTH:
+        libssh2_sha512_update(ctx->sha512, data, len);
+        break;
+    case SHA384_DIGEST_LENGTH:
+        libssh2_sha384_update(ctx->sha384, data, len);
+        break;
+    default:
+        libssh2_sha256_update(ctx->sha256, data, len);
+        break;
+    }
+}
+
+static void
+kex_hash_final(kex_hash_ctx *ctx, unsigned char *out)
+{
+    switch(ctx->len) {
+    case SHA512_DIGEST_LENGTH:
+        libssh2_sha512_final(ctx->sha512, out);
+        break;
+    case SHA384_DIGEST_LENGTH:
+        libssh2_sha384_final(ctx->sha384, out);
+        break;
+    default:
+        libssh2_sha256_final(ctx->sha256, out);
+        break;
+    }
+}
+
+/* hash a uint32 length followed by that many bytes, an SSH string */
+static void
+kex_hash_string(kex_hash_ctx *ctx, const void *data, size_t len)
+{
+    unsigned char buf[4];
+
+    _libssh2_htonu32(buf, len);
+    kex_hash_update(ctx, buf, 4);
+    kex_hash_update(ctx, data, len);
+}
+
+/*
+ * kex_derive
+ *
+ * Key derivation of RFC 4253 section 7.2 with the exchange hash of the
+ * ECDH methods: HASH(K || H || letter || session_id) extended by
+ * HASH(K || H || key so far) up to reqlen bytes.
+ */
+static unsigned char *
+kex_derive(LIBSSH2_SESSION *session, kmdhgGPshakex_state_t *exchange_state,
+           size_t hash_len, size_t reqlen, const char *letter)
+{
+    unsigned char *value = LIBSSH2_ALLOC(session, reqlen + hash_len);
+    kex_hash_ctx hash;
+    size_t len = 0;
+
+    if (!value)
+        return NULL;
+
+    while (len < reqlen) {
+        kex_hash_init(&hash, hash_len);
+        kex_hash_update(&hash, exchange_state->k_value,
+                        exchange_state->k_value_len);
+        kex_hash_update(&hash, exchange_state->h_sig_comp, hash_len);
+        if (len > 0) {
+            kex_hash_update(&hash, value, len);
+        } else {
+            kex_hash_update(&hash, letter, 1);
+            kex_hash_update(&hash, session->session_id,
+                            session->session_id_len);
+        }
+        kex_hash_final(&hash, value + len);
+        len += hash_len;
+    }
+    return value;
+}
+
+/*
+ * kex_ecdh_newkeys
+ *
+ * Set up the ciphers, MACs and compression negotiated for both directions
+ * from the keys kex_derive() hands out. Called once NEWKEYS arrived.
+ */
+static int
+kex_ecdh_newkeys(LIBSSH2_SESSION *session,
+                 kmdhgGPshakex_state_t *exchange_state, size_t hash_len)
+{
+    if (!session->session_id) {
+        session->session_id = LIBSSH2_ALLOC(session, hash_len);
+        if (!session->session_id)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate buffer for SHA digest");
+        memcpy(session->session_id, exchange_state->h_sig_comp, hash_len);
+        session->session_id_len = hash_len;
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "session_id calculated");
+    }
+
+    /* Cleanup any existing cipher */
+    if (session->local.crypt->dtor) {
+        session->local.crypt->dtor(session, &session->local.crypt_abstract);
+    }
+
+    /* Calculate IV/Secret/Key for each direction */
+    if (session->local.crypt->init) {
+        unsigned char *iv, *secret;
+        int free_iv = 0, free_secret = 0;
+
+        iv = kex_derive(session, exchange_state, hash_len,
+                        session->local.crypt->iv_len, "A");
+        secret = kex_derive(session, exchange_state, hash_len,
+                            session->local.crypt->secret_len, "C");
+        if (!iv || !secret ||
+            session->local.crypt->init(session, session->local.crypt, iv,
+                                       &free_iv, secret, &free_secret, 1,
+                                       &session->local.crypt_abstract)) {
+            if (iv)
+                LIBSSH2_FREE(session, iv);
+            if (secret)
+                LIBSSH2_FREE(session, secret);
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        }
+
+        if (free_iv) {
+            memset(iv, 0, session->local.crypt->iv_len);
+            LIBSSH2_FREE(session, iv);
+        }
+
+        if (free_secret) {
+            memset(secret, 0, session->local.crypt->secret_len);
+            LIBSSH2_FREE(session, secret);
+        }
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Client to Server IV and Key calculated");
+
+    if (session->remote.crypt->dtor) {
+        /* Cleanup any existing cipher */
+        session->remote.crypt->dtor(session, &session->remote.crypt_abstract);
+    }
+
+    if (session->remote.crypt->init) {
+        unsigned char *iv, *secret;
+        int free_iv = 0, free_secret = 0;
+
+        iv = kex_derive(session, exchange_state, hash_len,
+                        session->remote.crypt->iv_len, "B");
+        secret = kex_derive(session, exchange_state, hash_len,
+                            session->remote.crypt->secret_len, "D");
+        if (!iv || !secret ||
+            session->remote.crypt->init(session, session->remote.crypt, iv,
+                                        &free_iv, secret, &free_secret, 0,
+                                        &session->remote.crypt_abstract)) {
+            if (iv)
+                LIBSSH2_FREE(session, iv);
+            if (secret)
+                LIBSSH2_FREE(session, secret);
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        }
+
+        if (free_iv) {
+            memset(iv, 0, session->remote.crypt->iv_len);
+            LIBSSH2_FREE(session, iv);
+        }
+
+        if (free_secret) {
+            memset(secret, 0, session->remote.crypt->secret_len);
+            LIBSSH2_FREE(session, secret);
+        }
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Server to Client IV and Key calculated");
+
+    if (session->local.mac->dtor) {
+        session->local.mac->dtor(session, &session->local.mac_abstract);
+    }
+
+    if (session->local.mac->init) {
+        unsigned char *key;
+        int free_key = 0;
+
+        key = kex_derive(session, exchange_state, hash_len,
+                         session->local.mac->key_len, "E");
+        if (!key)
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        if (session->local.mac->init(session, key, &free_key,
+                                     &session->local.mac_abstract)) {
+            LIBSSH2_FREE(session, key);
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        }
+
+        if (free_key) {
+            memset(key, 0, session->local.mac->key_len);
+            LIBSSH2_FREE(session, key);
+        }
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Client to Server HMAC Key calculated");
+
+    if (session->remote.mac->dtor) {
+        session->remote.mac->dtor(session, &session->remote.mac_abstract);
+    }
+    session->remote.mac_gen++;
+
+    if (session->remote.mac->init) {
+        unsigned char *key;
+        int free_key = 0;
+
+        key = kex_derive(session, exchange_state, hash_len,
+                         session->remote.mac->key_len, "F");
+        if (!key)
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        if (session->remote.mac->init(session, key, &free_key,
+                                      &session->remote.mac_abstract)) {
+            LIBSSH2_FREE(session, key);
+            return LIBSSH2_ERROR_KEX_FAILURE;
+        }
+
+        if (free_key) {
+            memset(key, 0, session->remote.mac->key_len);
+            LIBSSH2_FREE(session, key);
+        }
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Server to Client HMAC Key calculated");
+
+    /* Initialize compression for each direction */
+
+    /* Cleanup any existing compression */
+    if (session->local.comp && session->local.comp->dtor) {
+        session->local.comp->dtor(session, 1, &session->local.comp_abstract);
+    }
+
+    if (session->local.comp && session->local.comp->init) {
+        if (session->local.comp->init(session, 1,
+                                      &session->local.comp_abstract))
+            return LIBSSH2_ERROR_KEX_FAILURE;
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Client to Server compression initialized");
+
+    if (session->remote.comp && session->remote.comp->dtor) {
+        session->remote.comp->dtor(session, 0,
+                                   &session->remote.comp_abstract);
+    }
+
+    if (session->remote.comp && session->remote.comp->init) {
+        if (session->remote.comp->init(session, 0,
+                                       &session->remote.comp_abstract))
+            return LIBSSH2_ERROR_KEX_FAILURE;
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                   "Server to Client compression initialized");
+
+    _libssh2_transport_kernels(session);
+
+    return 0;
+}
+
+/*
+ * ecdh_sha2
+ *
+ * Elliptic curve Diffie-Hellman key exchange (RFC 5656, and RFC 8731 for
+ * curve25519). The client sends its ephemeral public key Q_C, the server
+ * answers with K_S, Q_S and the signature of
+ *
+ *   H = HASH(V_C || V_S || I_C || I_S || K_S || Q_C || Q_S || K)
+ */
+static int ecdh_sha2(LIBSSH2_SESSION *session, libssh2_curve_type curve,
+                     size_t hash_len, kmdhgGPshakex_state_t *exchange_state)
+{
+    int ret = 0;
+    int rc;
+
+    if (exchange_state->state == libssh2_NB_state_idle) {
+        unsigned char *pub;
+        size_t pub_len;
+
+        /* Setup initial values */
+        exchange_state->e_packet = NULL;
+        exchange_state->s_packet = NULL;
+        exchange_state->k_value = NULL;
+        exchange_state->ec_key = NULL;
+
+        /* Zero the whole thing out */
+        memset(&exchange_state->req_state, 0, sizeof(packet_require_state_t));
+
+        if (_libssh2_ecdh_keypair(session, curve, &exchange_state->ec_key,
+                                  &pub, &pub_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to create ECDH key");
+            goto clean_exit;
+        }
+
+        /* packet_type(1) + String Length(4) + Q_C */
+        exchange_state->e_packet_len = pub_len + 5;
+        exchange_state->e_packet =
+            LIBSSH2_ALLOC(session, exchange_state->e_packet_len);
+        if (!exchange_state->e_packet) {
+            LIBSSH2_FREE(session, pub);
+            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                 "Out of memory error");
+            goto clean_exit;
+        }
+        exchange_state->e_packet[0] = SSH_MSG_KEX_ECDH_INIT;
+        _libssh2_htonu32(exchange_state->e_packet + 1, pub_len);
+        memcpy(exchange_state->e_packet + 5, pub, pub_len);
+        LIBSSH2_FREE(session, pub);
+
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Sending KEX packet %d",
+                       (int) SSH_MSG_KEX_ECDH_INIT);
+        exchange_state->state = libssh2_NB_state_created;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_created) {
+        rc = _libssh2_transport_send(session, exchange_state->e_packet,
+                                     exchange_state->e_packet_len,
+                                     NULL, 0);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc,
+                                 "Unable to send KEX init message");
+            goto clean_exit;
+        }
+        exchange_state->state = libssh2_NB_state_sent;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent) {
+        rc = kex_guess_wait(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = rc;
+            goto clean_exit;
+        }
+
+        if (session->burn_optimistic_kexinit) {
+            /* The first KEX packet to come along will be the guess initially
+             * sent by the server.  That guess turned out to be wrong so we
+             * need to silently ignore it */
+            int burn_type;
+
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Waiting for badly guessed KEX packet (to be ignored)");
+            burn_type =
+                _libssh2_packet_burn(session, &exchange_state->burn_state);
+            if (burn_type == LIBSSH2_ERROR_EAGAIN) {
+                return burn_type;
+            } else if (burn_type <= 0) {
+                /* Failed to receive a packet */
+                ret = burn_type;
+                goto clean_exit;
+            }
+            session->burn_optimistic_kexinit = 0;
+
+            _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                           "Burnt packet of type: %02x",
+                           (unsigned int) burn_type);
+        }
+
+        exchange_state->state = libssh2_NB_state_sent1;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent1) {
+        unsigned char *end, *q_s, *secret;
+        size_t q_s_len, secret_len, skip;
+        kex_hash_ctx hash;
+
+        /* Wait for KEX reply */
+        rc = _libssh2_packet_require(session, SSH_MSG_KEX_ECDH_REPLY,
+                                     &exchange_state->s_packet,
+                                     &exchange_state->s_packet_len, 0, NULL,
+                                     0, &exchange_state->req_state);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+        if (rc) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_TIMEOUT,
+                                 "Timed out waiting for KEX reply");
+            goto clean_exit;
+        }
+
+        /* Parse KEX_ECDH_REPLY: string K_S, string Q_S, string signature */
+        end = exchange_state->s_packet + exchange_state->s_packet_len;
+        exchange_state->s = exchange_state->s_packet + 1;
+        if (end - exchange_state->s < 4 ||
+            (size_t)(end - exchange_state->s - 4) <
+            _libssh2_ntohu32(exchange_state->s)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                                 "Short KEX_ECDH_REPLY");
+            goto clean_exit;
+        }
+        ret = kex_server_hostkey(session, &exchange_state->s);
+        if (ret)
+            goto clean_exit;
+
+        if (end - exchange_state->s < 4 ||
+            (size_t)(end - exchange_state->s - 4) <
+            (q_s_len = _libssh2_ntohu32(exchange_state->s))) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                                 "Short KEX_ECDH_REPLY");
+            goto clean_exit;
+        }
+        q_s = exchange_state->s + 4;
+        exchange_state->s = q_s + q_s_len;
+
+        if (end - exchange_state->s < 4 ||
+            (size_t)(end - exchange_state->s - 4) <
+            (exchange_state->h_sig_len = _libssh2_ntohu32(exchange_state->s))) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_PROTO,
+                                 "Short KEX_ECDH_REPLY");
+            goto clean_exit;
+        }
+        exchange_state->h_sig = exchange_state->s + 4;
+
+        /* Compute the shared secret */
+        if (_libssh2_ecdh_secret(session, exchange_state->ec_key,
+                                 q_s, q_s_len, &secret, &secret_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to compute the ECDH shared secret");
+            goto clean_exit;
+        }
+
+        /* K is the secret as an mpint: no leading zeroes, but a zero in
+           front of a set high bit */
+        for (skip = 0; skip < secret_len && !secret[skip]; skip++)
+            ;
+        exchange_state->k_value_len = secret_len - skip + 4;
+        if (skip < secret_len && (secret[skip] & 0x80))
+            exchange_state->k_value_len++;
+        exchange_state->k_value =
+            LIBSSH2_ALLOC(session, exchange_state->k_value_len);
+        if (!exchange_state->k_value) {
+            memset(secret, 0, secret_len);
+            LIBSSH2_FREE(session, secret);
+            ret = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                 "Unable to allocate buffer for K");
+            goto clean_exit;
+        }
+        _libssh2_htonu32(exchange_state->k_value,
+                         exchange_state->k_value_len - 4);
+        exchange_state->k_value[4] = 0;
+        memcpy(exchange_state->k_value + exchange_state->k_value_len -
+               (secret_len - skip), secret + skip, secret_len - skip);
+        memset(secret, 0, secret_len);
+        LIBSSH2_FREE(session, secret);
+
+        if (!kex_hash_init(&hash, hash_len)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_KEX_FAILURE,
+                                 "Unable to initialize the exchange hash");
+            goto clean_exit;
+        }
+
+        if (session->local.banner) {
+            kex_hash_string(&hash, session->local.banner,
+                            strlen((char *) session->local.banner) - 2);
+        } else {
+            kex_hash_string(&hash, LIBSSH2_SSH_DEFAULT_BANNER,
+                            sizeof(LIBSSH2_SSH_DEFAULT_BANNER) - 1);
+        }
+        kex_hash_string(&hash, session->remote.banner,
+                        strlen((char *) session->remote.banner));
+        kex_hash_string(&hash, session->local.kexinit,
+                        session->local.kexinit_len);
+        kex_hash_string(&hash, session->remote.kexinit,
+                        session->remote.kexinit_len);
+        kex_hash_string(&hash, session->server_hostkey,
+                        session->server_hostkey_len);
+        kex_hash_update(&hash, exchange_state->e_packet + 1,
+                        exchange_state->e_packet_len - 1);
+        kex_hash_string(&hash, q_s, q_s_len);
+        kex_hash_update(&hash, exchange_state->k_value,
+                        exchange_state->k_value_len);
+        kex_hash_final(&hash, exchange_state->h_sig_comp);
+
+        if (session->hostkey->
+            sig_verify(session, exchange_state->h_sig,
+                       exchange_state->h_sig_len, exchange_state->h_sig_comp,
+                       hash_len, &session->server_hostkey_abstract)) {
+            ret = _libssh2_error(session, LIBSSH2_ERROR_HOSTKEY_SIGN,
+                                 "Unable to verify hostkey signature");
+            goto clean_exit;
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Sending NEWKEYS message");
+        exchange_state->c = SSH_MSG_NEWKEYS;
+
+        exchange_state->state = libssh2_NB_state_sent2;
+    }
+
+    if (exchange_state->state == libssh2_NB_state_sent2) {
+        rc = _libssh2_transport_send(session, &exchange_state->c, 1, NULL, 0);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            ret = _libssh2_error(session, rc, "Unable to send NEWKEYS message");
+            goto clean_exit;
         }
 
-        key_state->state = libssh2_NB_state_sent;
+        exchange_state->state = libssh2_NB_state_sent3;
     }
 
-    if (key_state->state == libssh2_NB_state_sent) {
-        rc = _libssh2_packet_require(session, SSH_MSG_KEX_DH_GEX_GROUP,
-                                     &key_state->data, &key_state->data_len,
-                                     0, NULL, 0, &key_state->req_state);
+    if (exchange_state->state == libssh2_NB_state_sent3) {
+        rc = _libssh2_packet_require(session, SSH_MSG_NEWKEYS,
+                                     &exchange_state->tmp,
+                                     &exchange_state->tmp_len, 0, NULL, 0,
+                                     &exchange_state->req_state);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
         } else if (rc) {
-            ret = _libssh2_error(session, rc,
-                                 "Timeout waiting for GEX_GROUP reply SHA256");
-            goto dh_gex_clean_exit;
+            ret = _libssh2_error(session, rc, "Timed out waiting for NEWKEYS");
+            goto clean_exit;
         }
+        /* The first key exchange has been performed,
+           switch to active crypt/comp/mac mode */
+        session->state |= LIBSSH2_STATE_NEWKEYS;
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX, "Received NEWKEYS message");
 
-        key_state->state = libssh2_NB_state_sent1;
+        LIBSSH2_FREE(session, exchange_state->tmp);
+
+        ret = kex_ecdh_newkeys(session, exchange_state, hash_len);
     }
 
-    if (key_state->state == libssh2_NB_state_sent1) {
-        unsigned char *s = key_state->data + 1;
-        p_len = _libssh2_ntohu32(s);
-        s += 4;
-        _libssh2_bn_from_bin(key_state->p, p_len, s);
-        s += p_len;
+  clean_exit:
+    if (exchange_state->ec_key) {
+        _libssh2_ecdh_free(session, exchange_state->ec_key);
+        exchange_state->ec_key = NULL;
+    }
 
-        g_len = _libssh2_ntohu32(s);
-        s += 4;
-        _libssh2_bn_from_bin(key_state->g, g_len, s);
+    if (exchange_state->e_packet) {
+        LIBSSH2_FREE(session, exchange_state->e_packet);
+        exchange_state->e_packet = NULL;
+    }
 
-        ret = diffie_hellman_sha256(session, key_state->g, key_state->p, p_len,
-                                    SSH_MSG_KEX_DH_GEX_INIT,
-                                    SSH_MSG_KEX_DH_GEX_REPLY,
-                                    key_state->data + 1,
-                                    key_state->data_len - 1,
-                                    &key_state->exchange_state);
-        if (ret == LIBSSH2_ERROR_EAGAIN) {
-            return ret;
-        }
+    if (exchange_state->s_packet) {
+        LIBSSH2_FREE(session, exchange_state->s_packet);
+        exchange_state->s_packet = NULL;
+    }
 
-        LIBSSH2_FREE(session, key_state->data);
+    if (exchange_state->k_value) {
+        memset(exchange_state->k_value, 0, exchange_state->k_value_len);
+        LIBSSH2_FREE(session, exchange_state->k_value);
+        exchange_state->k_value = NULL;
     }
 
-  dh_gex_clean_exit:
-    key_state->state = libssh2_NB_state_idle;
-    _libssh2_bn_free(key_state->g);
-    key_state->g = NULL;
-    _libssh2_bn_free(key_state->p);
-    key_state->p = NULL;
+    exchange_state->state = libssh2_NB_state_idle;
 
     return ret;
 }
 
+/* kex_method_ecdh_sha2_nistp*_key_exchange and
+ * kex_method_curve25519_sha256_key_exchange
+ * ECDH key exchange on the named curve
+ */
+static int
+kex_method_ecdh_sha2_nistp256_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    if (key_state->state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Initiating ECDH nistp256 Key Exchange");
+        key_state->state = libssh2_NB_state_created;
+    }
+    return ecdh_sha2(session, LIBSSH2_EC_CURVE_NISTP256,
+                     SHA256_DIGEST_LENGTH, &key_state->exchange_state);
+}
+
+static int
+kex_method_ecdh_sha2_nistp384_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    if (key_state->state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Initiating ECDH nistp384 Key Exchange");
+        key_state->state = libssh2_NB_state_created;
+    }
+    return ecdh_sha2(session, LIBSSH2_EC_CURVE_NISTP384,
+                     SHA384_DIGEST_LENGTH, &key_state->exchange_state);
+}
+
+static int
+kex_method_ecdh_sha2_nistp521_key_exchange(LIBSSH2_SESSION *session,
+                                           key_exchange_state_low_t
+                                           * key_state)
+{
+    if (key_state->state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Initiating ECDH nistp521 Key Exchange");
+        key_state->state = libssh2_NB_state_created;
+    }
+    return ecdh_sha2(session, LIBSSH2_EC_CURVE_NISTP521,
+                     SHA512_DIGEST_LENGTH, &key_state->exchange_state);
+}
+
+#if LIBSSH2_CURVE25519
+static int
+kex_method_curve25519_sha256_key_exchange(LIBSSH2_SESSION *session,
+                                          key_exchange_state_low_t
+                                          * key_state)
+{
+    if (key_state->state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Initiating curve25519 Key Exchange");
+        key_state->state = libssh2_NB_state_created;
+    }
+    return ecdh_sha2(session, LIBSSH2_EC_CURVE_25519,
+                     SHA256_DIGEST_LENGTH, &key_state->exchange_state);
+}
+#endif /* LIBSSH2_CURVE25519 */
+
+#endif /* LIBSSH2_ECDH */
+
 
 #define LIBSSH2_KEX_METHOD_FLAG_REQ_ENC_HOSTKEY     0x0001
 #define LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY    0x0002
@@ -1707,7 +2718,53 @@ kex_method_diffie_helman_group_exchange_sha256 = {
     LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
 };
 
+#if LIBSSH2_ECDH
+#if LIBSSH2_CURVE25519
+static const LIBSSH2_KEX_METHOD kex_method_curve25519_sha256 = {
+    "curve25519-sha256",
+    kex_method_curve25519_sha256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+/* the name curve25519-sha256 had before RFC 8731 */
+static const LIBSSH2_KEX_METHOD kex_method_curve25519_sha256_libssh = {
+    "curve25519-sha256@libssh.org",
+    kex_method_curve25519_sha256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+#endif
+
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp256 = {
+    "ecdh-sha2-nistp256",
+    kex_method_ecdh_sha2_nistp256_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp384 = {
+    "ecdh-sha2-nistp384",
+    kex_method_ecdh_sha2_nistp384_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+
+static const LIBSSH2_KEX_METHOD kex_method_ecdh_sha2_nistp521 = {
+    "ecdh-sha2-nistp521",
+    kex_method_ecdh_sha2_nistp521_key_exchange,
+    LIBSSH2_KEX_METHOD_FLAG_REQ_SIGN_HOSTKEY,
+};
+#endif /* LIBSSH2_ECDH */
+
+/* The elliptic curve methods come first: one scalar multiplication each
+   way is far cheaper than the modular exponentiations of the DH groups */
 static const LIBSSH2_KEX_METHOD *libssh2_kex_methods[] = {
+#if LIBSSH2_CURVE25519
+    &kex_method_curve25519_sha256,
+    &kex_method_curve25519_sha256_libssh,
+#endif
+#if LIBSSH2_ECDH
+    &kex_method_ecdh_sha2_nistp256,
+    &kex_method_ecdh_sha2_nistp384,
+    &kex_method_ecdh_sha2_nistp521,
+#endif
     &kex_method_diffie_helman_group_exchange_sha256,
     &kex_method_diffie_helman_group_exchange_sha1,
     &kex_method_diffie_helman_group14_sha1,
@@ -1870,12 +2927,8 @@ static int kexinit(LIBSSH2_SESSION * session)
         LIBSSH2_METHOD_PREFS_STR(s, lang_sc_len, session->remote.lang_prefs,
                                  NULL);
 
-        /* No optimistic KEX packet follows */
-        /* Deal with optimistic packets
-         * session->flags |= KEXINIT_OPTIMISTIC
-         * session->flags |= KEXINIT_METHODSMATCH
-         */
-        *(s++) = 0;
+        /* first_kex_packet_follows: our guess, see _libssh2_kex_begin() */
+        *(s++) = (session->kex_guess == LIBSSH2_KEX_GUESS_SEND) ? 1 : 0;
 
         /* Reserved == 0 */
         _libssh2_htonu32(s, 0);
@@ -2221,6 +3274,13 @@ static int kex_agree_mac(LIBSSH2_SESSION * session,
     unsigned char *s;
     (void) session;
 
+    if (endpoint->crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD) {
+        /* the cipher authenticates the packets itself, the MAC list is
+           not used for this direction */
+        endpoint->mac = _libssh2_mac_implicit();
+        return 0;
+    }
+
     if (endpoint->mac_prefs) {
         s = (unsigned char *) endpoint->mac_prefs;
 
@@ -2439,6 +3499,185 @@ static int kex_agree_methods(LIBSSH2_SESSION * session, unsigned char *data,
 
 
 
+/* kex_send_kexinit
+ * Send our KEXINIT, keeping the previous one in case that fails. Leaves
+ * key_state in libssh2_NB_state_sent1 once it is out.
+ */
+static int
+kex_send_kexinit(LIBSSH2_SESSION * session, key_exchange_state_t * key_state)
+{
+    int retcode;
+
+    if (key_state->state == libssh2_NB_state_created) {
+        /* Preserve in case of failure */
+        key_state->oldlocal = session->local.kexinit;
+        key_state->oldlocal_len = session->local.kexinit_len;
+
+        session->local.kexinit = NULL;
+
+        key_state->state = libssh2_NB_state_sent;
+    }
+
+    if (key_state->state == libssh2_NB_state_sent) {
+        retcode = kexinit(session);
+        if (retcode == LIBSSH2_ERROR_EAGAIN) {
+            session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+            return retcode;
+        } else if (retcode) {
+            session->local.kexinit = key_state->oldlocal;
+            session->local.kexinit_len = key_state->oldlocal_len;
+            key_state->state = libssh2_NB_state_idle;
+            session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+            session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
+            return -1;
+        }
+
+        key_state->state = libssh2_NB_state_sent1;
+    }
+
+    return 0;
+}
+
+/* kex_guess_method
+ * The key exchange method we prefer, which is the one we guess the server
+ * agrees to
+ */
+static const LIBSSH2_KEX_METHOD *
+kex_guess_method(LIBSSH2_SESSION * session)
+{
+    const char *s = session->kex_prefs;
+    const char *p;
+
+    if (!s)
+        return libssh2_kex_methods[0];
+
+    p = strchr(s, ',');
+    return (const LIBSSH2_KEX_METHOD *)
+        kex_get_method_by_name(s, p ? (size_t)(p - s) : strlen(s),
+                               (const LIBSSH2_COMMON_METHOD **)
+                               libssh2_kex_methods);
+}
+
+/* kex_first_matches
+ * Whether the first entry of the name-list at 'list' is the same as the first
+ * one of 'prefs'
+ */
+static int
+kex_first_matches(const unsigned char *list, size_t list_len,
+                  const char *prefs)
+{
+    const unsigned char *comma = memchr(list, ',', list_len);
+    const char *p = strchr(prefs, ',');
+    size_t len = comma ? (size_t)(comma - list) : list_len;
+
+    return len == (p ? (size_t)(p - prefs) : strlen(prefs)) &&
+        !memcmp(list, prefs, len);
+}
+
+/* kex_guess_right
+ * RFC 4253 section 7.1: the guess is right when the server lists the same
+ * key exchange and host key methods first as we do. Otherwise the server
+ * ignores our first key exchange packet.
+ */
+static int
+kex_guess_right(LIBSSH2_SESSION * session, key_exchange_state_t * key_state)
+{
+    unsigned char *data = key_state->data;
+    unsigned char *s = data + 17;   /* packet_type(1) + cookie(16) */
+    unsigned char *kex, *hostkey;
+    size_t kex_len, hostkey_len;
+    const char *hostkey_pref = session->hostkey_prefs ?
+        session->hostkey_prefs : libssh2_hostkey_methods()[0]->name;
+
+    if (key_state->data_len < 17 ||
+        kex_string_pair(&s, data, key_state->data_len, &kex_len, &kex) ||
+        kex_string_pair(&s, data, key_state->data_len, &hostkey_len,
+                        &hostkey))
+        return 0;
+
+    return kex_first_matches(kex, kex_len, key_state->guess->name) &&
+        kex_first_matches(hostkey, hostkey_len, hostkey_pref) &&
+        session->kex == key_state->guess;
+}
+
+/* kex_guess_drop
+ * Have the guessed method free what it has so far
+ */
+static void
+kex_guess_drop(LIBSSH2_SESSION * session, key_exchange_state_t * key_state)
+{
+    session->kex_guess = LIBSSH2_KEX_GUESS_WRONG;
+    key_state->guess->exchange_keys(session, &key_state->key_state_low);
+    session->kex_guess = LIBSSH2_KEX_GUESS_NONE;
+}
+
+/* _libssh2_kex_begin
+ * Start the first key exchange before the server's banner is in: send our
+ * KEXINIT and, unless LIBSSH2_FLAG_KEX_GUESS is off, the first packet of the
+ * key exchange method we prefer right behind it (first_kex_packet_follows)
+ * instead of waiting a round trip for the server's KEXINIT.
+ * _libssh2_kex_exchange() carries on from there.
+ *
+ * Returns 0 on success, non-zero on failure
+ */
+int
+_libssh2_kex_begin(LIBSSH2_SESSION * session, key_exchange_state_t * key_state)
+{
+    int retcode;
+
+    session->state |= LIBSSH2_STATE_KEX_ACTIVE;
+
+    if (key_state->state == libssh2_NB_state_idle) {
+        /* Prevent loop in packet_add() */
+        session->state |= LIBSSH2_STATE_EXCHANGING_KEYS;
+
+        _libssh2_event(session, LIBSSH2_EVENT_KEX_START, 0, 0, 0, 0);
+
+        key_state->start_us = _libssh2_time_us();
+        key_state->rekey = 0;
+        key_state->guess = session->flag.kex_guess ?
+            kex_guess_method(session) : NULL;
+        session->kex_guess = key_state->guess ?
+            LIBSSH2_KEX_GUESS_SEND : LIBSSH2_KEX_GUESS_NONE;
+
+        key_state->state = libssh2_NB_state_created;
+    }
+
+    retcode = kex_send_kexinit(session, key_state);
+    if (retcode) {
+        if (retcode != LIBSSH2_ERROR_EAGAIN) {
+            session->kex_guess = LIBSSH2_KEX_GUESS_NONE;
+            key_state->guess = NULL;
+        }
+        return retcode;
+    }
+
+    if (session->kex_guess == LIBSSH2_KEX_GUESS_SEND) {
+        /* the method stops once its first packet is out, see
+           kex_guess_wait() */
+        retcode = key_state->guess->exchange_keys(session,
+                                                  &key_state->key_state_low);
+        if (session->kex_guess == LIBSSH2_KEX_GUESS_SEND) {
+            session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+            if (retcode == LIBSSH2_ERROR_EAGAIN)
+                return retcode;
+
+            /* the server now waits for a packet that will never come */
+            session->kex_guess = LIBSSH2_KEX_GUESS_NONE;
+            key_state->guess = NULL;
+            key_state->state = libssh2_NB_state_idle;
+            session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
+            return retcode ? retcode : LIBSSH2_ERROR_KEX_FAILURE;
+        }
+        _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                       "Sent a guess for %s along with KEXINIT",
+                       key_state->guess->name);
+    }
+
+    session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
+    return 0;
+}
+
 /* _libssh2_kex_exchange
  * Exchange keys
  * Returns 0 on success, non-zero on failure
@@ -2458,6 +3697,10 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
         /* Prevent loop in packet_add() */
         session->state |= LIBSSH2_STATE_EXCHANGING_KEYS;
 
+        _libssh2_event(session, LIBSSH2_EVENT_KEX_START, 0, 0, 0, 0);
+
+        key_state->start_us = _libssh2_time_us();
+        key_state->rekey = reexchange;
         if (reexchange) {
             session->kex = NULL;
 
@@ -2472,32 +3715,9 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
     }
 
     if (!session->kex || !session->hostkey) {
-        if (key_state->state == libssh2_NB_state_created) {
-            /* Preserve in case of failure */
-            key_state->oldlocal = session->local.kexinit;
-            key_state->oldlocal_len = session->local.kexinit_len;
-
-            session->local.kexinit = NULL;
-
-            key_state->state = libssh2_NB_state_sent;
-        }
-
-        if (key_state->state == libssh2_NB_state_sent) {
-            retcode = kexinit(session);
-            if (retcode == LIBSSH2_ERROR_EAGAIN) {
-                session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
-                return retcode;
-            } else if (retcode) {
-                session->local.kexinit = key_state->oldlocal;
-                session->local.kexinit_len = key_state->oldlocal_len;
-                key_state->state = libssh2_NB_state_idle;
-                session->state &= ~LIBSSH2_STATE_KEX_ACTIVE;
-                session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
-                return -1;
-            }
-
-            key_state->state = libssh2_NB_state_sent1;
-        }
+        retcode = kex_send_kexinit(session, key_state);
+        if (retcode)
+            return retcode;
 
         if (key_state->state == libssh2_NB_state_sent1) {
             retcode =
@@ -2510,6 +3730,10 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                 return retcode;
             }
             else if (retcode) {
+                if (key_state->guess) {
+                    kex_guess_drop(session, key_state);
+                    key_state->guess = NULL;
+                }
                 if (session->local.kexinit) {
                     LIBSSH2_FREE(session, session->local.kexinit);
                 }
@@ -2531,6 +3755,22 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                                   key_state->data_len))
                 rc = LIBSSH2_ERROR_KEX_FAILURE;
 
+            if (key_state->guess) {
+                if (!rc && kex_guess_right(session, key_state)) {
+                    /* the guessed exchange goes on where it stopped */
+                    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                                   "Key exchange guess was right");
+                    session->kex_guess = LIBSSH2_KEX_GUESS_NONE;
+                }
+                else {
+                    /* the server ignores the guessed packet, start over */
+                    _libssh2_debug(session, LIBSSH2_TRACE_KEX,
+                                   "Key exchange guess was wrong");
+                    kex_guess_drop(session, key_state);
+                }
+                key_state->guess = NULL;
+            }
+
             key_state->state = libssh2_NB_state_sent2;
         }
     } else {
@@ -2551,6 +3791,23 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
         }
     }
 
+    if (rc == 0) {
+        libssh2_uint64_t took = _libssh2_time_us() - key_state->start_us;
+
+        /* the new keys start from scratch */
+        session->local.rekey_bytes = 0;
+        session->local.rekey_packets = 0;
+        session->remote.rekey_bytes = 0;
+        session->remote.rekey_packets = 0;
+        session->rekey_due = 0;
+
+        _libssh2_histogram_add(session, LIBSSH2_HISTOGRAM_KEX, took);
+        if (key_state->rekey) {
+            session->stats.rekeys++;
+            session->stats.rekey_us += took;
+        }
+    }
+
     /* Done with kexinit buffers */
     if (session->local.kexinit) {
         LIBSSH2_FREE(session, session->local.kexinit);
@@ -2565,6 +3822,8 @@ _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
     session->state &= ~LIBSSH2_STATE_EXCHANGING_KEYS;
 
     key_state->state = libssh2_NB_state_idle;
+    _libssh2_event(session, LIBSSH2_EVENT_KEX_DONE, 0, 0,
+                   (unsigned int)-rc, 0);
 
     return rc;
 }
@@ -2792,3 +4051,47 @@ LIBSSH2_API int libssh2_session_supported_algs(LIBSSH2_SESSION* session,
 
     return ialg;
 }
+
+/*
+ * libssh2_method_accel()
+ *
+ * The CPU acceleration a cipher or MAC gets, or all there is
+ */
+LIBSSH2_API int
+libssh2_method_accel(int method_type, const char *method)
+{
+    const LIBSSH2_COMMON_METHOD **mlist;
+    const LIBSSH2_COMMON_METHOD *found;
+    int cpu;
+
+    _libssh2_init_if_needed();
+    cpu = _libssh2_cpu_accel();
+
+    switch (method_type) {
+    case LIBSSH2_METHOD_CRYPT_CS:
+    case LIBSSH2_METHOD_CRYPT_SC:
+        mlist = (const LIBSSH2_COMMON_METHOD **) libssh2_crypt_methods();
+        break;
+
+    case LIBSSH2_METHOD_MAC_CS:
+    case LIBSSH2_METHOD_MAC_SC:
+        mlist = (const LIBSSH2_COMMON_METHOD **) _libssh2_mac_methods();
+        break;
+
+    default:
+        return LIBSSH2_ERROR_INVAL;
+    }
+
+    if (!method)
+        return cpu;
+
+    found = kex_get_method_by_name(method, strlen(method), mlist);
+    if (!found)
+        return LIBSSH2_ERROR_METHOD_NOT_SUPPORTED;
+
+    if (method_type == LIBSSH2_METHOD_CRYPT_CS ||
+        method_type == LIBSSH2_METHOD_CRYPT_SC)
+        return _libssh2_crypt_accel((const LIBSSH2_CRYPT_METHOD *)found) &
+            cpu;
+    return ((const LIBSSH2_MAC_METHOD *)found)->accel & cpu;
+}
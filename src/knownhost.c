@@ -38,6 +38,17 @@
 
 #include "libssh2_priv.h"
 #include "misc.h"
+#include "thread.h"
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#endif
 
 struct known_host {
     struct list_node node;
@@ -50,25 +61,110 @@ struct known_host {
     size_t salt_len; /* size of salt */
     char *key;       /* the (allocated) associated key. This is kept base64
                         encoded in memory. */
+    unsigned char *raw_key; /* the decoded key once it has been compared with
+                               a raw one, or once the collection got shared
+                               (allocated) */
+    size_t raw_key_len;
     char *key_type_name; /* the (allocated) key type name */
     size_t key_type_len; /* size of key_type_name */
     char *comment;       /* the (allocated) optional comment text, may be
                             NULL */
     size_t comment_len;  /* the size of comment */
+    int flags;           /* KNOWNHOST_BORROWED, KNOWNHOST_ENCODED,
+                            KNOWNHOST_FROZEN */
+
+    unsigned long seq;   /* position in the list, for merging the indexes */
+    size_t hash;         /* hash of a plain/custom name */
+    struct known_host *next_index; /* next plain/custom entry in the same
+                                      bucket, or next hashed entry */
 
     /* this is the struct we expose externally */
     struct libssh2_knownhost external;
 };
 
+/* the strings point into a file loaded by libssh2_knownhost_readfile() */
+#define KNOWNHOST_BORROWED 1
+/* the name and salt of a hashed entry are still base64 text */
+#define KNOWNHOST_ENCODED  2
+/* part of a shared collection, 'external' is filled in once and for all */
+#define KNOWNHOST_FROZEN   4
+
+/* A known_hosts file loaded whole. The entries read from it borrow their
+   strings from 'data', so it stays around until the collection is freed. */
+struct knownhost_file {
+    struct knownhost_file *next;
+    char *data;
+    size_t len;
+    int mapped; /* munmap() rather than free */
+};
+
+/* Number of queried host names whose hashed entry matches are remembered */
+#define KNOWNHOST_MEMO 16
+
+struct knownhost_memo {
+    char *host;                 /* the queried name, NULL if unused */
+    struct known_host **nodes;  /* hashed entries it matches, in list order */
+    size_t count;
+};
+
 struct _LIBSSH2_KNOWNHOSTS
 {
     LIBSSH2_SESSION *session;  /* the session this "belongs to" */
     struct list_head head;
+
+    /* plain and custom entries are chained in buckets picked by their
+       name, each chain kept in list order. The bucket heads are followed by
+       as many chain tails. */
+    struct known_host **buckets;
+    size_t num_buckets;
+    size_t num_named;
+    unsigned long seq;
+
+    /* hashed entries can only be found by running the HMAC of every one of
+       them, so those are chained separately and the outcome is remembered
+       per queried host until a hashed entry is added or removed */
+    struct known_host *hashed_first;
+    struct known_host *hashed_last;
+    struct knownhost_memo memo[KNOWNHOST_MEMO];
+    int memo_next;
+
+    struct knownhost_file *files;
+
+    /* Set for a collection frozen for a LIBSSH2_KNOWNHOST_STORE. Such a
+       collection is read-only, owns its session and is freed once the last
+       of its 'refs' references is given back. */
+    int shared;
+    int refs;
 };
 
+struct _LIBSSH2_KNOWNHOST_STORE
+{
+    LIBSSH2_KNOWNHOSTS *current; /* the collection handed out now */
+};
+
+/*
+ * References to shared collections and the collection of every store are
+ * only ever touched with this held. Checking against a shared collection
+ * needs no lock since nothing in it changes.
+ */
+#ifdef LIBSSH2_THREADS
+static pthread_mutex_t knownhost_share_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SHARE_LOCK() pthread_mutex_lock(&knownhost_share_lock)
+#define SHARE_UNLOCK() pthread_mutex_unlock(&knownhost_share_lock)
+#else
+#define SHARE_LOCK() do {} while(0)
+#define SHARE_UNLOCK() do {} while(0)
+#endif
+
+#define KNOWNHOST_BUCKETS 64
+
 static void free_host(LIBSSH2_SESSION *session, struct known_host *entry)
 {
-    if(entry) {
+    if(entry && entry->raw_key)
+        LIBSSH2_FREE(session, entry->raw_key);
+    if(entry && (entry->flags & KNOWNHOST_BORROWED))
+        LIBSSH2_FREE(session, entry);
+    else if(entry) {
         if(entry->comment)
             LIBSSH2_FREE(session, entry->comment);
         if (entry->key_type_name)
@@ -83,6 +179,289 @@ static void free_host(LIBSSH2_SESSION *session, struct known_host *entry)
     }
 }
 
+static size_t knownhost_hash(const char *name)
+{
+    /* FNV-1a */
+    size_t h = 2166136261U;
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void knownhost_memo_flush(LIBSSH2_KNOWNHOSTS *hosts)
+{
+    int i;
+    for(i = 0; i < KNOWNHOST_MEMO; i++) {
+        struct knownhost_memo *m = &hosts->memo[i];
+        if(m->host)
+            LIBSSH2_FREE(hosts->session, m->host);
+        if(m->nodes)
+            LIBSSH2_FREE(hosts->session, m->nodes);
+        m->host = NULL;
+        m->nodes = NULL;
+        m->count = 0;
+    }
+    hosts->memo_next = 0;
+}
+
+/*
+ * knownhost_rehash
+ *
+ * Double the bucket array. Each chain splits into two and keeps its order.
+ * Failing to grow only makes the chains longer.
+ */
+static void knownhost_rehash(LIBSSH2_KNOWNHOSTS *hosts)
+{
+    size_t num = hosts->num_buckets * 2;
+    struct known_host **buckets;
+    struct known_host **tails;
+    struct known_host *node;
+    struct known_host *next;
+    size_t i;
+    size_t j;
+
+    buckets = LIBSSH2_ALLOC(hosts->session, 2 * num * sizeof(*buckets));
+    if(!buckets)
+        return;
+    tails = buckets + num;
+    for(i = 0; i < num; i++)
+        buckets[i] = tails[i] = NULL;
+
+    for(i = 0; i < hosts->num_buckets; i++) {
+        for(node = hosts->buckets[i]; node; node = next) {
+            next = node->next_index;
+            j = node->hash % num;
+            node->next_index = NULL;
+            if(tails[j])
+                tails[j]->next_index = node;
+            else
+                buckets[j] = node;
+            tails[j] = node;
+        }
+    }
+
+    LIBSSH2_FREE(hosts->session, hosts->buckets);
+    hosts->buckets = buckets;
+    hosts->num_buckets = num;
+}
+
+/*
+ * knownhost_index
+ *
+ * Put a freshly listed entry into the index that finds it.
+ */
+static void knownhost_index(LIBSSH2_KNOWNHOSTS *hosts,
+                            struct known_host *entry)
+{
+    struct known_host **tailp;
+    size_t i;
+
+    entry->seq = hosts->seq++;
+    entry->next_index = NULL;
+
+    switch(entry->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) {
+    case LIBSSH2_KNOWNHOST_TYPE_PLAIN:
+    case LIBSSH2_KNOWNHOST_TYPE_CUSTOM:
+        entry->hash = knownhost_hash(entry->name);
+        i = entry->hash % hosts->num_buckets;
+        tailp = &hosts->buckets[hosts->num_buckets + i];
+        if(*tailp)
+            (*tailp)->next_index = entry;
+        else
+            hosts->buckets[i] = entry;
+        *tailp = entry;
+        if(++hosts->num_named > hosts->num_buckets)
+            knownhost_rehash(hosts);
+        break;
+    case LIBSSH2_KNOWNHOST_TYPE_SHA1:
+        if(hosts->hashed_last)
+            hosts->hashed_last->next_index = entry;
+        else
+            hosts->hashed_first = entry;
+        hosts->hashed_last = entry;
+        knownhost_memo_flush(hosts);
+        break;
+    }
+}
+
+/*
+ * knownhost_unindex
+ *
+ * Take an entry that is about to be removed out of its index.
+ */
+static void knownhost_unindex(LIBSSH2_KNOWNHOSTS *hosts,
+                              struct known_host *entry)
+{
+    struct known_host **nodep;
+    struct known_host *prev = NULL;
+    size_t i;
+
+    switch(entry->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) {
+    case LIBSSH2_KNOWNHOST_TYPE_PLAIN:
+    case LIBSSH2_KNOWNHOST_TYPE_CUSTOM:
+        i = entry->hash % hosts->num_buckets;
+        nodep = &hosts->buckets[i];
+        while(*nodep && (*nodep != entry)) {
+            prev = *nodep;
+            nodep = &(*nodep)->next_index;
+        }
+        if(*nodep) {
+            *nodep = entry->next_index;
+            if(hosts->buckets[hosts->num_buckets + i] == entry)
+                hosts->buckets[hosts->num_buckets + i] = prev;
+            hosts->num_named--;
+        }
+        break;
+    case LIBSSH2_KNOWNHOST_TYPE_SHA1:
+        nodep = &hosts->hashed_first;
+        while(*nodep && (*nodep != entry)) {
+            prev = *nodep;
+            nodep = &(*nodep)->next_index;
+        }
+        if(*nodep) {
+            *nodep = entry->next_index;
+            if(hosts->hashed_last == entry)
+                hosts->hashed_last = prev;
+        }
+        knownhost_memo_flush(hosts);
+        break;
+    }
+}
+
+/*
+ * knownhost_named
+ *
+ * Return the first plain or custom entry from 'node' onwards in its bucket
+ * chain that has the given name and type.
+ */
+static struct known_host *knownhost_named(struct known_host *node,
+                                          const char *host, int type)
+{
+    for(; node; node = node->next_index) {
+        if(((node->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) == type) &&
+           !strcmp(host, node->name))
+            break;
+    }
+    return node;
+}
+
+/*
+ * knownhost_decode
+ *
+ * Entries read from a file keep the base64 text of their salt and hash
+ * until they are first needed, and then get decoded in place. An entry that
+ * doesn't decode is left with an empty hash and never matches.
+ */
+static void knownhost_decode(struct known_host *node)
+{
+    int len;
+
+    if(!(node->flags & KNOWNHOST_ENCODED))
+        return;
+    node->flags &= ~KNOWNHOST_ENCODED;
+
+    len = _libssh2_base64_decode_into((unsigned char *)node->name,
+                                      node->name, node->name_len);
+    node->name_len = (len < 0) ? 0 : len;
+
+    len = _libssh2_base64_decode_into((unsigned char *)node->salt,
+                                      node->salt, node->salt_len);
+    node->salt_len = (len < 0) ? 0 : len;
+}
+
+/*
+ * knownhost_hashed_scan
+ *
+ * Run the HMAC of every hashed entry with a plain 'host' and collect the
+ * entries it matches in list order into 'm'. Returns non-zero on allocation
+ * failure.
+ */
+static int knownhost_hashed_scan(LIBSSH2_KNOWNHOSTS *hosts, const char *host,
+                                 struct knownhost_memo *m)
+{
+    struct known_host *node;
+    size_t hostlen = strlen(host);
+    size_t alloc = 0;
+
+    for(node = hosts->hashed_first; node; node = node->next_index) {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        libssh2_hmac_ctx ctx;
+
+        knownhost_decode(node);
+        if(SHA_DIGEST_LENGTH != node->name_len) {
+            /* the name hash length must be the sha1 size or we can't match
+               it */
+            continue;
+        }
+        libssh2_hmac_ctx_init(ctx);
+        libssh2_hmac_sha1_init(&ctx, (unsigned char *)node->salt,
+                               node->salt_len);
+        libssh2_hmac_update(ctx, (unsigned char *)host, hostlen);
+        libssh2_hmac_final(ctx, hash);
+        libssh2_hmac_cleanup(&ctx);
+
+        if(memcmp(hash, node->name, SHA_DIGEST_LENGTH))
+            continue;
+
+        /* this is a node we're interested in */
+        if(m->count == alloc) {
+            struct known_host **nodes = m->nodes ?
+                LIBSSH2_REALLOC(hosts->session, m->nodes,
+                                (alloc + 4) * sizeof(*nodes)) :
+                LIBSSH2_ALLOC(hosts->session, 4 * sizeof(*nodes));
+            if(!nodes)
+                return -1;
+            m->nodes = nodes;
+            alloc += 4;
+        }
+        m->nodes[m->count++] = node;
+    }
+    return 0;
+}
+
+/*
+ * knownhost_hashed
+ *
+ * Return the memo of the hashed entries that a plain 'host' matches,
+ * scanning them all unless this host was asked for recently. Returns NULL
+ * on allocation failure.
+ */
+static struct knownhost_memo *knownhost_hashed(LIBSSH2_KNOWNHOSTS *hosts,
+                                               const char *host)
+{
+    struct knownhost_memo *m;
+    size_t hostlen = strlen(host);
+    int i;
+
+    for(i = 0; i < KNOWNHOST_MEMO; i++) {
+        m = &hosts->memo[i];
+        if(m->host && !strcmp(m->host, host))
+            return m;
+    }
+
+    /* reuse the oldest slot */
+    m = &hosts->memo[hosts->memo_next];
+    hosts->memo_next = (hosts->memo_next + 1) % KNOWNHOST_MEMO;
+    if(m->host)
+        LIBSSH2_FREE(hosts->session, m->host);
+    if(m->nodes)
+        LIBSSH2_FREE(hosts->session, m->nodes);
+    m->host = NULL;
+    m->nodes = NULL;
+    m->count = 0;
+
+    if(knownhost_hashed_scan(hosts, host, m))
+        return NULL;
+
+    m->host = LIBSSH2_ALLOC(hosts->session, hostlen + 1);
+    if(!m->host)
+        return NULL;
+    memcpy(m->host, host, hostlen + 1);
+    return m;
+}
+
 /*
  * libssh2_knownhost_init
  *
@@ -102,10 +481,24 @@ libssh2_knownhost_init(LIBSSH2_SESSION *session)
         return NULL;
     }
 
+    memset(knh, 0, sizeof(struct _LIBSSH2_KNOWNHOSTS));
     knh->session = session;
 
     _libssh2_list_init(&knh->head);
 
+    knh->buckets = LIBSSH2_ALLOC(session, 2 * KNOWNHOST_BUCKETS *
+                                 sizeof(struct known_host *));
+    if(!knh->buckets) {
+        LIBSSH2_FREE(session, knh);
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for known-hosts "
+                       "collection");
+        return NULL;
+    }
+    memset(knh->buckets, 0,
+           2 * KNOWNHOST_BUCKETS * sizeof(struct known_host *));
+    knh->num_buckets = KNOWNHOST_BUCKETS;
+
     return knh;
 }
 
@@ -120,6 +513,10 @@ static struct libssh2_knownhost *knownhost_to_external(struct known_host *node)
 {
     struct libssh2_knownhost *ext = &node->external;
 
+    if(node->flags & KNOWNHOST_FROZEN)
+        /* shared, and already filled in */
+        return ext;
+
     ext->magic = KNOWNHOST_MAGIC;
     ext->node = node;
     ext->name = ((node->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) ==
@@ -144,6 +541,10 @@ knownhost_add(LIBSSH2_KNOWNHOSTS *hosts,
     char *ptr;
     unsigned int ptrlen;
 
+    if(hosts->shared)
+        /* shared through a store and read-only */
+        return LIBSSH2_ERROR_INVAL;
+
     /* make sure we have a key type set */
     if(!(typemask & LIBSSH2_KNOWNHOST_KEY_MASK))
         return _libssh2_error(hosts->session, LIBSSH2_ERROR_INVAL,
@@ -246,6 +647,7 @@ knownhost_add(LIBSSH2_KNOWNHOSTS *hosts,
 
     /* add this new host to the big list of known hosts */
     _libssh2_list_add(&hosts->head, &entry->node);
+    knownhost_index(hosts, entry);
 
     if(store)
         *store = knownhost_to_external(entry);
@@ -256,6 +658,66 @@ knownhost_add(LIBSSH2_KNOWNHOSTS *hosts,
     return rc;
 }
 
+/*
+ * knownhost_add_borrowed
+ *
+ * Add an entry whose strings all live in the writable buffer of a loaded
+ * file. Each one is zero terminated where it stands instead of copied, which
+ * is safe as long as the terminating byte isn't needed by the rest of the
+ * line any longer.
+ */
+static int
+knownhost_add_borrowed(LIBSSH2_KNOWNHOSTS *hosts,
+                       char *host, size_t hostlen,
+                       char *salt, size_t saltlen,
+                       char *key_type_name, size_t key_type_len,
+                       char *key, size_t keylen,
+                       char *comment, size_t commentlen,
+                       int typemask)
+{
+    struct known_host *entry;
+
+    if(!(entry = LIBSSH2_CALLOC(hosts->session, sizeof(struct known_host))))
+        return _libssh2_error(hosts->session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for known host "
+                              "entry");
+
+    entry->typemask = typemask;
+    entry->flags = KNOWNHOST_BORROWED;
+
+    host[hostlen] = 0;
+    entry->name = host;
+    entry->name_len = hostlen;
+
+    if(salt) {
+        salt[saltlen] = 0;
+        entry->salt = salt;
+        entry->salt_len = saltlen;
+        entry->flags |= KNOWNHOST_ENCODED;
+    }
+
+    key[keylen] = 0;
+    entry->key = key;
+
+    if (key_type_name && ((typemask & LIBSSH2_KNOWNHOST_KEY_MASK) ==
+                          LIBSSH2_KNOWNHOST_KEY_UNKNOWN)) {
+        key_type_name[key_type_len] = 0;
+        entry->key_type_name = key_type_name;
+        entry->key_type_len = key_type_len;
+    }
+
+    if (comment) {
+        comment[commentlen] = 0;
+        entry->comment = comment;
+        entry->comment_len = commentlen;
+    }
+
+    _libssh2_list_add(&hosts->head, &entry->node);
+    knownhost_index(hosts, entry);
+
+    return LIBSSH2_ERROR_NONE;
+}
+
 /*
  * libssh2_knownhost_add
  *
@@ -327,6 +789,69 @@ libssh2_knownhost_addc(LIBSSH2_KNOWNHOSTS *hosts,
                          comment, commentlen, typemask, store);
 }
 
+/*
+ * knownhost_raw_decode
+ *
+ * Decode the key of an entry into its raw_key blob, unless that was done
+ * already. A key that isn't base64 gets an empty blob, which never matches
+ * a raw key.
+ *
+ * Returns 0 on success and -1 on allocation failure.
+ */
+static int knownhost_raw_decode(LIBSSH2_KNOWNHOSTS *hosts,
+                                struct known_host *node)
+{
+    size_t len;
+    int rawlen;
+
+    if(node->raw_key)
+        return 0;
+
+    len = strlen(node->key);
+    node->raw_key = LIBSSH2_ALLOC(hosts->session, 3 * len / 4 + 1);
+    if(!node->raw_key)
+        return -1;
+    rawlen = _libssh2_base64_decode_into(node->raw_key, node->key, len);
+    node->raw_key_len = (rawlen < 0) ? 0 : rawlen;
+    return 0;
+}
+
+/*
+ * knownhost_key_matches
+ *
+ * Compare a raw key with the key of an entry by memcmp() of the decoded
+ * blob, rather than base64 encoding the raw key for every check. A private
+ * collection decodes the blob of an entry on its first check and keeps it,
+ * knownhost_share() has decoded all of them before a collection is shared.
+ *
+ * Returns 1 for a match, 0 for none and -1 on allocation failure.
+ */
+static int knownhost_key_matches(LIBSSH2_KNOWNHOSTS *hosts,
+                                 struct known_host *node,
+                                 const unsigned char *key, size_t keylen)
+{
+    if(knownhost_raw_decode(hosts, node))
+        return -1;
+
+    return node->raw_key_len && (node->raw_key_len == keylen) &&
+        !memcmp(node->raw_key, key, keylen);
+}
+
+/*
+ * knownhost_check_error
+ *
+ * Like _libssh2_error(), except that the session of a shared collection
+ * belongs to no caller and is left alone, since other threads may be checking
+ * against that collection at the same time.
+ */
+static int knownhost_check_error(LIBSSH2_KNOWNHOSTS *hosts, int errcode,
+                                 const char *errmsg)
+{
+    if(hosts->shared)
+        return errcode;
+    return _libssh2_error(hosts->session, errcode, errmsg);
+}
+
 /*
  * knownhost_check
  *
@@ -355,12 +880,16 @@ knownhost_check(LIBSSH2_KNOWNHOSTS *hosts,
     struct known_host *node;
     struct known_host *badkey = NULL;
     int type = typemask & LIBSSH2_KNOWNHOST_TYPE_MASK;
-    char *keyalloc = NULL;
+    int raw = !(typemask & LIBSSH2_KNOWNHOST_KEYENC_BASE64);
+    int same;
     int rc = LIBSSH2_KNOWNHOST_CHECK_NOTFOUND;
     char hostbuff[270]; /* most host names can't be longer than like 256 */
     const char *host;
     int numcheck; /* number of host combos to check */
     int match = 0;
+    int host_key_type = typemask & LIBSSH2_KNOWNHOST_KEY_MASK;
+    int known_key_type;
+    struct knownhost_memo scan;
 
     if(type == LIBSSH2_KNOWNHOST_TYPE_SHA1)
         /* we can't work with a sha1 as given input */
@@ -371,9 +900,8 @@ knownhost_check(LIBSSH2_KNOWNHOSTS *hosts,
     if(port >= 0) {
         int len = snprintf(hostbuff, sizeof(hostbuff), "[%s]:%d", hostp, port);
         if (len < 0 || len >= (int)sizeof(hostbuff)) {
-            _libssh2_error(hosts->session,
-                           LIBSSH2_ERROR_BUFFER_TOO_SMALL,
-                           "Known-host write buffer too small");
+            knownhost_check_error(hosts, LIBSSH2_ERROR_BUFFER_TOO_SMALL,
+                                  "Known-host write buffer too small");
             return LIBSSH2_KNOWNHOST_CHECK_FAILURE;
         }
         host = hostbuff;
@@ -384,96 +912,89 @@ knownhost_check(LIBSSH2_KNOWNHOSTS *hosts,
         numcheck = 1; /* only check this host version */
     }
 
-    if(!(typemask & LIBSSH2_KNOWNHOST_KEYENC_BASE64)) {
-        /* we got a raw key input, convert it to base64 for the checks below */
-        size_t nlen = _libssh2_base64_encode(hosts->session, key, keylen,
-                                             &keyalloc);
-        if(!nlen) {
-            _libssh2_error(hosts->session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate memory for base64-encoded "
-                           "key");
-            return LIBSSH2_KNOWNHOST_CHECK_FAILURE;
-        }
-
-        /* make the key point to this */
-        key = keyalloc;
-    }
-
     do {
-        node = _libssh2_list_first(&hosts->head);
-        while (node) {
-            switch(node->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) {
-            case LIBSSH2_KNOWNHOST_TYPE_PLAIN:
-                if(type == LIBSSH2_KNOWNHOST_TYPE_PLAIN)
-                    match = !strcmp(host, node->name);
-                break;
-            case LIBSSH2_KNOWNHOST_TYPE_CUSTOM:
-                if(type == LIBSSH2_KNOWNHOST_TYPE_CUSTOM)
-                    match = !strcmp(host, node->name);
-                break;
-            case LIBSSH2_KNOWNHOST_TYPE_SHA1:
-                if(type == LIBSSH2_KNOWNHOST_TYPE_PLAIN) {
-                    /* when we have the sha1 version stored, we can use a
-                       plain input to produce a hash to compare with the
-                       stored hash.
-                    */
-                    unsigned char hash[SHA_DIGEST_LENGTH];
-                    libssh2_hmac_ctx ctx;
-                    libssh2_hmac_ctx_init(ctx);
-
-                    if(SHA_DIGEST_LENGTH != node->name_len) {
-                        /* the name hash length must be the sha1 size or
-                           we can't match it */
-                        break;
-                    }
-                    libssh2_hmac_sha1_init(&ctx, (unsigned char *)node->salt,
-                                           node->salt_len);
-                    libssh2_hmac_update(ctx, (unsigned char *)host,
-                                        strlen(host));
-                    libssh2_hmac_final(ctx, hash);
-                    libssh2_hmac_cleanup(&ctx);
-
-                    if(!memcmp(hash, node->name, SHA_DIGEST_LENGTH))
-                        /* this is a node we're interested in */
-                        match = 1;
-                }
-                break;
-            default: /* unsupported type */
+        /* the plain or custom entries with this name and the hashed entries
+           it matches, visited in list order */
+        struct known_host *named =
+            knownhost_named(hosts->buckets[knownhost_hash(host) %
+                                           hosts->num_buckets], host, type);
+        struct knownhost_memo *hashed = NULL;
+        size_t i = 0;
+
+        scan.nodes = NULL;
+        scan.count = 0;
+        if((type == LIBSSH2_KNOWNHOST_TYPE_PLAIN) && hosts->hashed_first) {
+            if(hosts->shared)
+                /* nothing gets remembered in a shared collection */
+                hashed = knownhost_hashed_scan(hosts, host, &scan) ?
+                    NULL : &scan;
+            else
+                hashed = knownhost_hashed(hosts, host);
+            if(!hashed) {
+                if(scan.nodes)
+                    LIBSSH2_FREE(hosts->session, scan.nodes);
+                knownhost_check_error(hosts, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate memory for hashed "
+                                      "host matches");
+                rc = LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+                badkey = NULL;
                 break;
             }
-            if(match) {
-                int host_key_type = typemask & LIBSSH2_KNOWNHOST_KEY_MASK;
-                int known_key_type =
-                    node->typemask & LIBSSH2_KNOWNHOST_KEY_MASK;
-                /* match on key type as follows:
-                   - never match on an unknown key type
-                   - if key_type is set to zero, ignore it an match always
-                   - otherwise match when both key types are equal
-                */
-                if ( (host_key_type != LIBSSH2_KNOWNHOST_KEY_UNKNOWN ) &&
-                     ( (host_key_type == 0) ||
-                       (host_key_type == known_key_type) ) ) {
-                    /* host name and key type match, now compare the keys */
-                    if(!strcmp(key, node->key)) {
-                        /* they match! */
-                        if (ext)
-                            *ext = knownhost_to_external(node);
-                        badkey = NULL;
-                        rc = LIBSSH2_KNOWNHOST_CHECK_MATCH;
-                        break;
-                    }
-                    else {
-                        /* remember the first node that had a host match but a
-                           failed key match since we continue our search from
-                           here */
-                        if(!badkey)
-                            badkey = node;
-                    }
+        }
+
+        while(named || (hashed && (i < hashed->count))) {
+            if(named && (!hashed || (i == hashed->count) ||
+                         (named->seq < hashed->nodes[i]->seq))) {
+                node = named;
+                named = knownhost_named(named->next_index, host, type);
+            }
+            else
+                node = hashed->nodes[i++];
+
+            known_key_type = node->typemask & LIBSSH2_KNOWNHOST_KEY_MASK;
+            /* match on key type as follows:
+               - never match on an unknown key type
+               - if key_type is set to zero, ignore it an match always
+               - otherwise match when both key types are equal
+            */
+            if ( (host_key_type != LIBSSH2_KNOWNHOST_KEY_UNKNOWN ) &&
+                 ( (host_key_type == 0) ||
+                   (host_key_type == known_key_type) ) ) {
+                /* host name and key type match, now compare the keys */
+                same = raw ?
+                    knownhost_key_matches(hosts, node,
+                                          (const unsigned char *)key,
+                                          keylen) :
+                    !strcmp(key, node->key);
+                if(same < 0) {
+                    knownhost_check_error(hosts, LIBSSH2_ERROR_ALLOC,
+                                          "Unable to allocate memory for "
+                                          "decoded key");
+                    rc = LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+                    badkey = NULL;
+                    match = 1; /* stop here */
+                    break;
+                }
+                if(same) {
+                    /* they match! */
+                    if (ext)
+                        *ext = knownhost_to_external(node);
+                    badkey = NULL;
+                    rc = LIBSSH2_KNOWNHOST_CHECK_MATCH;
+                    match = 1;
+                    break;
+                }
+                else {
+                    /* remember the first node that had a host match but a
+                       failed key match since we continue our search from
+                       here */
+                    if(!badkey)
+                        badkey = node;
                 }
-                match = 0; /* don't count this as a match anymore */
             }
-            node= _libssh2_list_next(&node->node);
         }
+        if(scan.nodes)
+            LIBSSH2_FREE(hosts->session, scan.nodes);
         host = hostp;
     } while(!match && --numcheck);
 
@@ -484,9 +1005,6 @@ knownhost_check(LIBSSH2_KNOWNHOSTS *hosts,
         rc = LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
     }
 
-    if(keyalloc)
-        LIBSSH2_FREE(hosts->session, keyalloc);
-
     return rc;
 }
 
@@ -565,6 +1083,10 @@ libssh2_knownhost_del(LIBSSH2_KNOWNHOSTS *hosts,
 {
     struct known_host *node;
 
+    if(hosts->shared)
+        /* shared through a store and read-only */
+        return LIBSSH2_ERROR_INVAL;
+
     /* check that this was retrieved the right way or get out */
     if(!entry || (entry->magic != KNOWNHOST_MAGIC))
         return _libssh2_error(hosts->session, LIBSSH2_ERROR_INVAL,
@@ -575,6 +1097,7 @@ libssh2_knownhost_del(LIBSSH2_KNOWNHOSTS *hosts,
 
     /* unlink from the list of all hosts */
     _libssh2_list_remove(&node->node);
+    knownhost_unindex(hosts, node);
 
     /* clear the struct now since the memory in which it is allocated is
        about to be freed! */
@@ -597,12 +1120,40 @@ libssh2_knownhost_free(LIBSSH2_KNOWNHOSTS *hosts)
 {
     struct known_host *node;
     struct known_host *next;
+    LIBSSH2_SESSION *session = hosts->session;
+    int shared = hosts->shared;
+
+    if(shared) {
+        /* give back a reference to a shared collection */
+        int refs;
+        SHARE_LOCK();
+        refs = --hosts->refs;
+        SHARE_UNLOCK();
+        if(refs)
+            return;
+    }
 
     for(node = _libssh2_list_first(&hosts->head); node; node = next) {
         next = _libssh2_list_next(&node->node);
         free_host(hosts->session, node);
     }
+    knownhost_memo_flush(hosts);
+    while(hosts->files) {
+        struct knownhost_file *file = hosts->files;
+        hosts->files = file->next;
+#ifdef HAVE_MMAP
+        if(file->mapped)
+            munmap(file->data, file->len);
+        else
+#endif
+            LIBSSH2_FREE(hosts->session, file->data);
+        LIBSSH2_FREE(hosts->session, file);
+    }
+    LIBSSH2_FREE(hosts->session, hosts->buckets);
     LIBSSH2_FREE(hosts->session, hosts);
+
+    if(shared)
+        libssh2_session_free(session);
 }
 
 
@@ -615,7 +1166,8 @@ static int oldstyle_hostline(LIBSSH2_KNOWNHOSTS *hosts,
                              const char *host, size_t hostlen,
                              const char *key_type_name, size_t key_type_len,
                              const char *key, size_t keylen, int key_type,
-                             const char *comment, size_t commentlen)
+                             const char *comment, size_t commentlen,
+                             int borrow)
 {
     int rc = 0;
     size_t namelen = 0;
@@ -644,16 +1196,28 @@ static int oldstyle_hostline(LIBSSH2_KNOWNHOSTS *hosts,
                                       "Failed to parse known_hosts line "
                                       "(unexpected length)");
 
-            /* copy host name to the temp buffer and zero terminate */
-            memcpy(hostbuf, name, namelen);
-            hostbuf[namelen]=0;
-
-            rc = knownhost_add(hosts, hostbuf, NULL,
-                               key_type_name, key_type_len,
-                               key, keylen,
-                               comment, commentlen,
-                               key_type | LIBSSH2_KNOWNHOST_TYPE_PLAIN |
-                               LIBSSH2_KNOWNHOST_KEYENC_BASE64, NULL);
+            if(borrow)
+                rc = knownhost_add_borrowed(hosts, (char *)name, namelen,
+                                            NULL, 0,
+                                            (char *)key_type_name,
+                                            key_type_len,
+                                            (char *)key, keylen,
+                                            (char *)comment, commentlen,
+                                            key_type |
+                                            LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                            LIBSSH2_KNOWNHOST_KEYENC_BASE64);
+            else {
+                /* copy host name to the temp buffer and zero terminate */
+                memcpy(hostbuf, name, namelen);
+                hostbuf[namelen]=0;
+
+                rc = knownhost_add(hosts, hostbuf, NULL,
+                                   key_type_name, key_type_len,
+                                   key, keylen,
+                                   comment, commentlen,
+                                   key_type | LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                   LIBSSH2_KNOWNHOST_KEYENC_BASE64, NULL);
+            }
             if(rc)
                 return rc;
 
@@ -672,7 +1236,8 @@ static int hashed_hostline(LIBSSH2_KNOWNHOSTS *hosts,
                            const char *host, size_t hostlen,
                            const char *key_type_name, size_t key_type_len,
                            const char *key, size_t keylen, int key_type,
-                           const char *comment, size_t commentlen)
+                           const char *comment, size_t commentlen,
+                           int borrow)
 {
     const char *p;
     char saltbuf[32];
@@ -694,10 +1259,6 @@ static int hashed_hostline(LIBSSH2_KNOWNHOSTS *hosts,
                                   "Failed to parse known_hosts line "
                                   "(unexpectedly long salt)");
 
-        memcpy(saltbuf, salt, saltlen);
-        saltbuf[saltlen] = 0; /* zero terminate */
-        salt = saltbuf; /* point to the stack based buffer */
-
         hash = p+1; /* the host hash is after the separator */
 
         /* now make the host point to the hash */
@@ -711,6 +1272,22 @@ static int hashed_hostline(LIBSSH2_KNOWNHOSTS *hosts,
                                   "Failed to parse known_hosts line "
                                   "(unexpected length)");
 
+        if(borrow)
+            /* decoding the salt and hash waits until they are needed */
+            return knownhost_add_borrowed(hosts, (char *)host, hostlen,
+                                          (char *)salt, saltlen,
+                                          (char *)key_type_name,
+                                          key_type_len,
+                                          (char *)key, keylen,
+                                          (char *)comment, commentlen,
+                                          key_type |
+                                          LIBSSH2_KNOWNHOST_TYPE_SHA1 |
+                                          LIBSSH2_KNOWNHOST_KEYENC_BASE64);
+
+        memcpy(saltbuf, salt, saltlen);
+        saltbuf[saltlen] = 0; /* zero terminate */
+        salt = saltbuf; /* point to the stack based buffer */
+
         memcpy(hostbuf, host, hostlen);
         hostbuf[hostlen]=0;
 
@@ -737,7 +1314,7 @@ static int hashed_hostline(LIBSSH2_KNOWNHOSTS *hosts,
  */
 static int hostline(LIBSSH2_KNOWNHOSTS *hosts,
                     const char *host, size_t hostlen,
-                    const char *key, size_t keylen)
+                    const char *key, size_t keylen, int borrow)
 {
     const char *comment = NULL;
     const char *key_type_name = NULL;
@@ -777,6 +1354,18 @@ static int hostline(LIBSSH2_KNOWNHOSTS *hosts,
             key_type = LIBSSH2_KNOWNHOST_KEY_SSHDSS;
         else if (!strncmp(key_type_name, "ssh-rsa", key_type_len))
             key_type = LIBSSH2_KNOWNHOST_KEY_SSHRSA;
+        else if (key_type_len == 19 &&
+                 !strncmp(key_type_name, "ecdsa-sha2-nistp256", 19))
+            key_type = LIBSSH2_KNOWNHOST_KEY_ECDSA_256;
+        else if (key_type_len == 19 &&
+                 !strncmp(key_type_name, "ecdsa-sha2-nistp384", 19))
+            key_type = LIBSSH2_KNOWNHOST_KEY_ECDSA_384;
+        else if (key_type_len == 19 &&
+                 !strncmp(key_type_name, "ecdsa-sha2-nistp521", 19))
+            key_type = LIBSSH2_KNOWNHOST_KEY_ECDSA_521;
+        else if (key_type_len == 11 &&
+                 !strncmp(key_type_name, "ssh-ed25519", 11))
+            key_type = LIBSSH2_KNOWNHOST_KEY_ED25519;
         else
             key_type = LIBSSH2_KNOWNHOST_KEY_UNKNOWN;
 
@@ -821,13 +1410,13 @@ static int hostline(LIBSSH2_KNOWNHOSTS *hosts,
         */
         return oldstyle_hostline(hosts, host, hostlen, key_type_name,
                                  key_type_len, key, keylen, key_type,
-                                 comment, commentlen);
+                                 comment, commentlen, borrow);
     }
     else {
         /* |1|[salt]|[hash] */
         return hashed_hostline(hosts, host, hostlen, key_type_name,
                                key_type_len, key, keylen, key_type,
-                               comment, commentlen);
+                               comment, commentlen, borrow);
     }
 }
 
@@ -857,11 +1446,13 @@ static int hostline(LIBSSH2_KNOWNHOSTS *hosts,
  * [RSA bits] [e] [n as a decimal number]
  * 'ssh-dss' [base64-encoded-key]
  * 'ssh-rsa' [base64-encoded-key]
+ * 'ecdsa-sha2-nistp256' [base64-encoded-key] (and nistp384, nistp521)
+ * 'ssh-ed25519' [base64-encoded-key]
  *
  */
-LIBSSH2_API int
-libssh2_knownhost_readline(LIBSSH2_KNOWNHOSTS *hosts,
-                           const char *line, size_t len, int type)
+static int
+knownhost_readline(LIBSSH2_KNOWNHOSTS *hosts,
+                   const char *line, size_t len, int type, int borrow)
 {
     const char *cp;
     const char *hostp;
@@ -924,13 +1515,100 @@ libssh2_knownhost_readline(LIBSSH2_KNOWNHOSTS *hosts,
         keylen--; /* don't include this in the count */
 
     /* deal with this one host+key line */
-    rc = hostline(hosts, hostp, hostlen, keyp, keylen);
+    rc = hostline(hosts, hostp, hostlen, keyp, keylen, borrow);
     if(rc)
         return rc; /* failed */
 
     return LIBSSH2_ERROR_NONE; /* success */
 }
 
+LIBSSH2_API int
+libssh2_knownhost_readline(LIBSSH2_KNOWNHOSTS *hosts,
+                           const char *line, size_t len, int type)
+{
+    return knownhost_readline(hosts, line, len, type, 0);
+}
+
+/*
+ * knownhost_load
+ *
+ * Get the entire file into a writable buffer that ends with a newline,
+ * preferably by mapping it privately so that pages are only copied once
+ * they are written to. Returns NULL if the file can't be opened or read.
+ */
+static struct knownhost_file *
+knownhost_load(LIBSSH2_KNOWNHOSTS *hosts, const char *filename)
+{
+    struct knownhost_file *file;
+    FILE *fp;
+    size_t alloc = 0;
+
+    file = LIBSSH2_CALLOC(hosts->session, sizeof(struct knownhost_file));
+    if(!file)
+        return NULL;
+
+#ifdef HAVE_MMAP
+    {
+        int fd = open(filename, O_RDONLY);
+        struct stat st;
+        if(fd < 0) {
+            LIBSSH2_FREE(hosts->session, file);
+            return NULL;
+        }
+        if(!fstat(fd, &st) && (st.st_size > 0)) {
+            void *map = mmap(NULL, (size_t)st.st_size,
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED) {
+                /* without a final newline there is no room to zero
+                   terminate the last line in place, read it instead */
+                if(((char *)map)[st.st_size - 1] == '\n') {
+                    close(fd);
+                    file->data = map;
+                    file->len = (size_t)st.st_size;
+                    file->mapped = 1;
+                    return file;
+                }
+                munmap(map, (size_t)st.st_size);
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    fp = fopen(filename, "r");
+    if(!fp) {
+        LIBSSH2_FREE(hosts->session, file);
+        return NULL;
+    }
+    for(;;) {
+        size_t got;
+        if(alloc - file->len < 2) {
+            char *data = file->data ?
+                LIBSSH2_REALLOC(hosts->session, file->data, alloc * 2) :
+                LIBSSH2_ALLOC(hosts->session, 4096);
+            if(!data)
+                break;
+            file->data = data;
+            alloc = alloc ? alloc * 2 : 4096;
+        }
+        got = fread(file->data + file->len, 1, alloc - file->len - 1, fp);
+        if(!got)
+            break;
+        file->len += got;
+    }
+    if(file->data && feof(fp) && !ferror(fp)) {
+        fclose(fp);
+        if(file->len && (file->data[file->len - 1] != '\n'))
+            file->data[file->len++] = '\n';
+        return file;
+    }
+    fclose(fp);
+    if(file->data)
+        LIBSSH2_FREE(hosts->session, file->data);
+    LIBSSH2_FREE(hosts->session, file);
+    return NULL;
+}
+
 /*
  * libssh2_knownhost_readfile
  *
@@ -944,9 +1622,14 @@ LIBSSH2_API int
 libssh2_knownhost_readfile(LIBSSH2_KNOWNHOSTS *hosts,
                            const char *filename, int type)
 {
-    FILE *file;
+    struct knownhost_file *file;
+    char *line;
+    char *end;
     int num = 0;
-    char buf[2048];
+
+    if(hosts->shared)
+        /* shared through a store and read-only */
+        return LIBSSH2_ERROR_INVAL;
 
     if(type != LIBSSH2_KNOWNHOST_FILE_OPENSSH)
         return _libssh2_error(hosts->session,
@@ -954,22 +1637,29 @@ libssh2_knownhost_readfile(LIBSSH2_KNOWNHOSTS *hosts,
                               "Unsupported type of known-host information "
                               "store");
 
-    file = fopen(filename, "r");
-    if(file) {
-        while(fgets(buf, sizeof(buf), file)) {
-            if(libssh2_knownhost_readline(hosts, buf, strlen(buf), type)) {
-                num = _libssh2_error(hosts->session, LIBSSH2_ERROR_KNOWN_HOSTS,
-                                     "Failed to parse known hosts file");
-                break;
-            }
-            num++;
-        }
-        fclose(file);
-    }
-    else
+    file = knownhost_load(hosts, filename);
+    if(!file)
         return _libssh2_error(hosts->session, LIBSSH2_ERROR_FILE,
                               "Failed to open file");
 
+    /* the entries point into the file data from now on */
+    file->next = hosts->files;
+    hosts->files = file;
+
+    end = file->data + file->len;
+    for(line = file->data; line < end; ) {
+        char *eol = memchr(line, '\n', end - line);
+        size_t len = eol - line + 1;
+
+        if(knownhost_readline(hosts, line, len, type, 1)) {
+            num = _libssh2_error(hosts->session, LIBSSH2_ERROR_KNOWN_HOSTS,
+                                 "Failed to parse known hosts file");
+            break;
+        }
+        num++;
+        line += len;
+    }
+
     return num;
 }
 
@@ -1016,6 +1706,22 @@ knownhost_writeline(LIBSSH2_KNOWNHOSTS *hosts,
         key_type_name = "ssh-dss";
         key_type_len = 7;
         break;
+    case LIBSSH2_KNOWNHOST_KEY_ECDSA_256:
+        key_type_name = "ecdsa-sha2-nistp256";
+        key_type_len = 19;
+        break;
+    case LIBSSH2_KNOWNHOST_KEY_ECDSA_384:
+        key_type_name = "ecdsa-sha2-nistp384";
+        key_type_len = 19;
+        break;
+    case LIBSSH2_KNOWNHOST_KEY_ECDSA_521:
+        key_type_name = "ecdsa-sha2-nistp521";
+        key_type_len = 19;
+        break;
+    case LIBSSH2_KNOWNHOST_KEY_ED25519:
+        key_type_name = "ssh-ed25519";
+        key_type_len = 11;
+        break;
     case LIBSSH2_KNOWNHOST_KEY_UNKNOWN:
         key_type_name = node->key_type_name;
         if (key_type_name) {
@@ -1058,48 +1764,57 @@ knownhost_writeline(LIBSSH2_KNOWNHOSTS *hosts,
 
     if((node->typemask & LIBSSH2_KNOWNHOST_TYPE_MASK) ==
        LIBSSH2_KNOWNHOST_TYPE_SHA1) {
-        char *namealloc;
         size_t name_base64_len;
-        char *saltalloc;
         size_t salt_base64_len;
-
-        name_base64_len = _libssh2_base64_encode(hosts->session, node->name,
-                                                 node->name_len, &namealloc);
-        if(!name_base64_len)
-            return _libssh2_error(hosts->session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "base64-encoded host name");
-
-        salt_base64_len = _libssh2_base64_encode(hosts->session,
-                                                 node->salt, node->salt_len,
-                                                 &saltalloc);
-        if(!salt_base64_len) {
-            LIBSSH2_FREE(hosts->session, namealloc);
-            return _libssh2_error(hosts->session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "base64-encoded salt");
+        int encoded = (node->flags & KNOWNHOST_ENCODED) ? 1 : 0;
+
+        /* An entry read from a file that was never decoded still has the
+           base64 text, which is written back as it is. Otherwise the
+           base64 goes straight into the line. */
+        if(encoded) {
+            name_base64_len = node->name_len;
+            salt_base64_len = node->salt_len;
+        }
+        else {
+            name_base64_len = LIBSSH2_BASE64_LEN(node->name_len) - 1;
+            salt_base64_len = LIBSSH2_BASE64_LEN(node->salt_len) - 1;
         }
 
         required_size += salt_base64_len + name_base64_len + 7;
         /* |1| + | + ' ' + \n + \0 = 7 */
 
         if(required_size <= buflen) {
+            char *ptr = buf;
+
+            memcpy(ptr, "|1|", 3);
+            ptr += 3;
+            if(encoded)
+                memcpy(ptr, node->salt, salt_base64_len);
+            else
+                _libssh2_base64_encode_into(ptr,
+                                            (unsigned char *)node->salt,
+                                            node->salt_len);
+            ptr += salt_base64_len;
+            *ptr++ = '|';
+            if(encoded)
+                memcpy(ptr, node->name, name_base64_len);
+            else
+                _libssh2_base64_encode_into(ptr,
+                                            (unsigned char *)node->name,
+                                            node->name_len);
+            ptr += name_base64_len;
+
+            buflen -= ptr - buf;
             if(node->comment && key_type_len)
-                snprintf(buf, buflen, "|1|%s|%s %s %s %s\n", saltalloc,
-                         namealloc, key_type_name, node->key, node->comment);
-            else if (node->comment)
-                snprintf(buf, buflen, "|1|%s|%s %s %s\n", saltalloc, namealloc,
+                snprintf(ptr, buflen, " %s %s %s\n", key_type_name,
                          node->key, node->comment);
+            else if (node->comment)
+                snprintf(ptr, buflen, " %s %s\n", node->key, node->comment);
             else if (key_type_len)
-                snprintf(buf, buflen, "|1|%s|%s %s %s\n", saltalloc, namealloc,
-                         key_type_name, node->key);
+                snprintf(ptr, buflen, " %s %s\n", key_type_name, node->key);
             else
-                snprintf(buf, buflen, "|1|%s|%s %s\n", saltalloc, namealloc,
-                         node->key);
+                snprintf(ptr, buflen, " %s\n", node->key);
         }
-
-        LIBSSH2_FREE(hosts->session, namealloc);
-        LIBSSH2_FREE(hosts->session, saltalloc);
     }
     else {
         required_size += node->name_len + 3;
@@ -1243,3 +1958,164 @@ libssh2_knownhost_get(LIBSSH2_KNOWNHOSTS *hosts,
 
     return 0;
 }
+
+/*
+ * knownhost_share
+ *
+ * Make a collection of its own session ready to be handed out by a store:
+ * decode and fill in everything a check or a traversal would otherwise
+ * fill in lazily, and take the store's reference.
+ *
+ * Returns NULL on allocation failure, the collection is left to the caller
+ * to free then.
+ */
+static LIBSSH2_KNOWNHOSTS *knownhost_share(LIBSSH2_KNOWNHOSTS *hosts)
+{
+    struct known_host *node;
+
+    for(node = _libssh2_list_first(&hosts->head); node;
+        node = _libssh2_list_next(&node->node)) {
+        knownhost_decode(node);
+        if(knownhost_raw_decode(hosts, node))
+            return NULL;
+    }
+    for(node = _libssh2_list_first(&hosts->head); node;
+        node = _libssh2_list_next(&node->node)) {
+        knownhost_to_external(node);
+        node->flags |= KNOWNHOST_FROZEN;
+    }
+    knownhost_memo_flush(hosts);
+    hosts->shared = 1;
+    hosts->refs = 1;
+    return hosts;
+}
+
+/*
+ * knownhost_store_collection
+ *
+ * A new collection with a session of its own, optionally read from a file.
+ * Returns NULL and sets 'rc' on failure, otherwise 'rc' is what reading the
+ * file returned.
+ */
+static LIBSSH2_KNOWNHOSTS *knownhost_store_collection(const char *filename,
+                                                      int type, int *rc)
+{
+    LIBSSH2_SESSION *session = libssh2_session_init();
+    LIBSSH2_KNOWNHOSTS *hosts;
+
+    *rc = LIBSSH2_ERROR_ALLOC;
+    if(!session)
+        return NULL;
+    hosts = libssh2_knownhost_init(session);
+    if(!hosts) {
+        libssh2_session_free(session);
+        return NULL;
+    }
+
+    *rc = 0;
+    if(filename) {
+        *rc = libssh2_knownhost_readfile(hosts, filename, type);
+        if(*rc < 0) {
+            libssh2_knownhost_free(hosts);
+            libssh2_session_free(session);
+            return NULL;
+        }
+    }
+
+    if(!knownhost_share(hosts)) {
+        *rc = LIBSSH2_ERROR_ALLOC;
+        libssh2_knownhost_free(hosts);
+        libssh2_session_free(session);
+        return NULL;
+    }
+    return hosts;
+}
+
+/*
+ * libssh2_knownhost_store_init
+ *
+ * Create a store of known hosts that belongs to no session, starting out
+ * with an empty collection.
+ */
+LIBSSH2_API LIBSSH2_KNOWNHOST_STORE *
+libssh2_knownhost_store_init(void)
+{
+    LIBSSH2_KNOWNHOST_STORE *store = malloc(sizeof(*store));
+    int rc;
+
+    if(!store)
+        return NULL;
+
+    store->current = knownhost_store_collection(NULL, 0, &rc);
+    if(!store->current) {
+        free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+/*
+ * libssh2_knownhost_store_readfile
+ *
+ * Read a file into a new collection and make the store hand that one out
+ * from now on. References to the previous collection stay valid until they
+ * are given back. On failure the store keeps the collection it had.
+ *
+ * Returns a negative value for error or number of successfully added hosts.
+ */
+LIBSSH2_API int
+libssh2_knownhost_store_readfile(LIBSSH2_KNOWNHOST_STORE *store,
+                                 const char *filename, int type)
+{
+    LIBSSH2_KNOWNHOSTS *hosts;
+    LIBSSH2_KNOWNHOSTS *old;
+    int rc;
+
+    hosts = knownhost_store_collection(filename, type, &rc);
+    if(!hosts)
+        return rc;
+
+    SHARE_LOCK();
+    old = store->current;
+    store->current = hosts;
+    SHARE_UNLOCK();
+
+    /* give back the store's reference */
+    libssh2_knownhost_free(old);
+
+    return rc;
+}
+
+/*
+ * libssh2_knownhost_store_get
+ *
+ * Take a reference to the collection a store hands out now. It is
+ * read-only, may be checked against from any thread without locking and is
+ * given back with libssh2_knownhost_free().
+ */
+LIBSSH2_API LIBSSH2_KNOWNHOSTS *
+libssh2_knownhost_store_get(LIBSSH2_KNOWNHOST_STORE *store)
+{
+    LIBSSH2_KNOWNHOSTS *hosts;
+
+    SHARE_LOCK();
+    hosts = store->current;
+    hosts->refs++;
+    SHARE_UNLOCK();
+
+    return hosts;
+}
+
+/*
+ * libssh2_knownhost_store_free
+ *
+ * Free a store. Collections still referenced live on until they are given
+ * back.
+ */
+LIBSSH2_API void
+libssh2_knownhost_store_free(LIBSSH2_KNOWNHOST_STORE *store)
+{
+    libssh2_knownhost_free(store->current);
+    free(store);
+}
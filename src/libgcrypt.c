@@ -557,7 +557,9 @@ _libssh2_cipher_init(_libssh2_cipher_ctx * h,
         return -1;
     }
 
-    if (mode != GCRY_CIPHER_MODE_STREAM) {
+    /* GCM gets a new nonce for every packet, see
+       _libssh2_cipher_crypt_gcm() */
+    if (mode != GCRY_CIPHER_MODE_STREAM && mode != GCRY_CIPHER_MODE_GCM) {
         int blklen = gcry_cipher_get_algo_blklen(cipher);
         if (mode == GCRY_CIPHER_MODE_CTR)
             ret = gcry_cipher_setctr(*h, iv, blklen);
@@ -588,6 +590,106 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
     return ret;
 }
 
+int
+_libssh2_cipher_crypt_to(_libssh2_cipher_ctx * ctx,
+                         _libssh2_cipher_type(algo),
+                         int encrypt, const unsigned char *src,
+                         unsigned char *dst, size_t len)
+{
+    int ret;
+    (void) algo;
+
+    if (encrypt) {
+        ret = gcry_cipher_encrypt(*ctx, dst, len, src, len);
+    } else {
+        ret = gcry_cipher_decrypt(*ctx, dst, len, src, len);
+    }
+    return ret;
+}
+
+#if LIBSSH2_AES_GCM
+int
+_libssh2_cipher_crypt_gcm(_libssh2_cipher_ctx * ctx, int encrypt,
+                          const unsigned char *iv,
+                          const unsigned char *aad, size_t aad_len,
+                          unsigned char *data, size_t data_len,
+                          unsigned char *tag)
+{
+    if (gcry_cipher_setiv(*ctx, iv, 12) ||
+        gcry_cipher_authenticate(*ctx, aad, aad_len))
+        return -1;
+
+    if (encrypt) {
+        if (gcry_cipher_encrypt(*ctx, data, data_len, NULL, 0) ||
+            gcry_cipher_gettag(*ctx, tag, 16))
+            return -1;
+    } else {
+        if (gcry_cipher_decrypt(*ctx, data, data_len, NULL, 0) ||
+            gcry_cipher_checktag(*ctx, tag, 16))
+            return -1;
+    }
+    return 0;
+}
+#endif /* LIBSSH2_AES_GCM */
+
+#if LIBSSH2_CHACHA20_POLY1305
+int
+_libssh2_chacha20_init(_libssh2_chacha20_ctx * ctx,
+                       const unsigned char *key)
+{
+    if (gcry_cipher_open(ctx, GCRY_CIPHER_CHACHA20,
+                         GCRY_CIPHER_MODE_STREAM, 0))
+        return -1;
+
+    if (gcry_cipher_setkey(*ctx, key, 32)) {
+        gcry_cipher_close(*ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_chacha20_crypt(_libssh2_chacha20_ctx * ctx,
+                        const unsigned char *iv,
+                        unsigned char *buf, size_t len)
+{
+    /* a 16 byte IV is taken as the 64 bit block counter followed by the
+       64 bit nonce */
+    if (gcry_cipher_setiv(*ctx, iv, 16))
+        return -1;
+
+    return gcry_cipher_encrypt(*ctx, buf, len, NULL, 0) ? -1 : 0;
+}
+
+void
+_libssh2_chacha20_dtor(_libssh2_chacha20_ctx * ctx)
+{
+    gcry_cipher_close(*ctx);
+}
+
+int
+_libssh2_poly1305(unsigned char *tag, const unsigned char *key,
+                  const unsigned char *aad, size_t aad_len,
+                  const unsigned char *data, size_t data_len)
+{
+    gcry_mac_hd_t h;
+    size_t tag_len = 16;
+    int ret = -1;
+
+    if (gcry_mac_open(&h, GCRY_MAC_POLY1305, 0, NULL))
+        return -1;
+
+    if (!gcry_mac_setkey(h, key, 32) &&
+        !gcry_mac_write(h, aad, aad_len) &&
+        !gcry_mac_write(h, data, data_len) &&
+        !gcry_mac_read(h, tag, &tag_len))
+        ret = 0;
+
+    gcry_mac_close(h);
+    return ret;
+}
+#endif /* LIBSSH2_CHACHA20_POLY1305 */
+
 int
 _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
                                 unsigned char **method,
@@ -621,4 +723,548 @@ void _libssh2_init_aes_ctr(void)
 {
     /* no implementation */
 }
+#if LIBSSH2_ECDH
+
+struct _libssh2_gcry_ec_key
+{
+    libssh2_curve_type curve;
+    gcry_sexp_t key;            /* NIST curves */
+    unsigned char scalar[32];   /* curve25519 */
+};
+
+static const char *
+ecdh_curve_name(libssh2_curve_type curve)
+{
+    switch(curve) {
+    case LIBSSH2_EC_CURVE_NISTP256:
+        return "NIST P-256";
+    case LIBSSH2_EC_CURVE_NISTP384:
+        return "NIST P-384";
+    case LIBSSH2_EC_CURVE_NISTP521:
+        return "NIST P-521";
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * _libssh2_ecdh_keypair
+ *
+ * Generate an ephemeral key on the given curve. The public value is
+ * returned in its SSH wire form: the uncompressed point for the NIST
+ * curves, the 32 raw bytes for curve25519.
+ */
+int
+_libssh2_ecdh_keypair(LIBSSH2_SESSION *session, libssh2_curve_type curve,
+                      _libssh2_ec_key **key,
+                      unsigned char **pub, size_t *pub_len)
+{
+    _libssh2_ec_key *k;
+    gcry_sexp_t parms, q;
+    const char *data;
+    size_t len;
+
+    *pub = NULL;
+    *key = k = LIBSSH2_CALLOC(session, sizeof(*k));
+    if(!k)
+        return -1;
+    k->curve = curve;
+
+#if LIBSSH2_CURVE25519
+    if(curve == LIBSSH2_EC_CURVE_25519) {
+        *pub = LIBSSH2_ALLOC(session, 32);
+        if(!*pub)
+            goto fail;
+        gcry_randomize(k->scalar, sizeof(k->scalar), GCRY_STRONG_RANDOM);
+        if(gcry_ecc_mul_point(GCRY_ECC_CURVE25519, *pub, k->scalar, NULL))
+            goto fail;
+        *pub_len = 32;
+        return 0;
+    }
+#endif
+
+    if(!ecdh_curve_name(curve) ||
+       gcry_sexp_build(&parms, NULL, "(genkey(ecc(curve %s)))",
+                       ecdh_curve_name(curve)))
+        goto fail;
+    if(gcry_pk_genkey(&k->key, parms)) {
+        gcry_sexp_release(parms);
+        goto fail;
+    }
+    gcry_sexp_release(parms);
+
+    q = gcry_sexp_find_token(k->key, "q", 0);
+    if(!q)
+        goto fail;
+    data = gcry_sexp_nth_data(q, 1, &len);
+    if(!data || !(*pub = LIBSSH2_ALLOC(session, len))) {
+        gcry_sexp_release(q);
+        goto fail;
+    }
+    memcpy(*pub, data, len);
+    *pub_len = len;
+    gcry_sexp_release(q);
+    return 0;
+
+  fail:
+    if(*pub) {
+        LIBSSH2_FREE(session, *pub);
+        *pub = NULL;
+    }
+    _libssh2_ecdh_free(session, k);
+    *key = NULL;
+    return -1;
+}
+
+/* gcry_pk_encrypt() and gcry_pk_verify() take any point, refuse one that is
+   not on the curve */
+static int
+ec_check_point(gcry_sexp_t key)
+{
+    gcry_ctx_t ec;
+    gcry_mpi_point_t q;
+    int ok;
+
+    if(gcry_mpi_ec_new(&ec, key, NULL))
+        return -1;
+    q = gcry_mpi_ec_get_point("q", ec, 1);
+    ok = q && gcry_mpi_ec_curve_point(q, ec);
+    if(q)
+        gcry_mpi_point_release(q);
+    gcry_ctx_release(ec);
+    return ok ? 0 : -1;
+}
+
+/*
+ * _libssh2_ecdh_secret
+ *
+ * Derive the shared secret from our key and the peer's public value. The
+ * secret is returned as the big-endian bytes that get mpint encoded into K.
+ */
+int
+_libssh2_ecdh_secret(LIBSSH2_SESSION *session, _libssh2_ec_key *key,
+                     const unsigned char *peer, size_t peer_len,
+                     unsigned char **secret, size_t *secret_len)
+{
+    gcry_sexp_t d = NULL, peerkey = NULL, plain = NULL, enc = NULL, s;
+    gcry_mpi_t scalar = NULL;
+    const char *point;
+    size_t len;
+    int rc = -1;
+
+    *secret = NULL;
+
+#if LIBSSH2_CURVE25519
+    if(key->curve == LIBSSH2_EC_CURVE_25519) {
+        unsigned char zero = 0;
+        size_t i;
+
+        if(peer_len != 32)
+            return -1;
+        *secret = LIBSSH2_ALLOC(session, 32);
+        if(!*secret)
+            return -1;
+        if(gcry_ecc_mul_point(GCRY_ECC_CURVE25519, *secret, key->scalar,
+                              peer)) {
+            LIBSSH2_FREE(session, *secret);
+            *secret = NULL;
+            return -1;
+        }
+        /* refuse the all-zero secret of a small order peer point */
+        for(i = 0; i < 32; i++)
+            zero |= (*secret)[i];
+        if(!zero) {
+            LIBSSH2_FREE(session, *secret);
+            *secret = NULL;
+            return -1;
+        }
+        *secret_len = 32;
+        return 0;
+    }
+#endif
+
+    /* the scalar multiplication d * Q is an ECDH "encryption" of d to the
+       peer's public key, the x coordinate of the result is the secret */
+    d = gcry_sexp_find_token(key->key, "d", 0);
+    if(!d)
+        goto out;
+    scalar = gcry_sexp_nth_mpi(d, 1, GCRYMPI_FMT_USG);
+    if(!scalar)
+        goto out;
+    if(gcry_sexp_build(&peerkey, NULL, "(public-key(ecc(curve %s)(q %b)))",
+                       ecdh_curve_name(key->curve), (int)peer_len, peer))
+        goto out;
+
+    if(ec_check_point(peerkey))
+        goto out;
+
+    if(gcry_sexp_build(&plain, NULL, "(data(flags raw)(value %m))", scalar) ||
+       gcry_pk_encrypt(&enc, plain, peerkey))
+        goto out;
+
+    s = gcry_sexp_find_token(enc, "s", 0);
+    if(!s)
+        goto out;
+    point = gcry_sexp_nth_data(s, 1, &len);
+    if(point && len > 1 && point[0] == 0x04 && (len - 1) % 2 == 0) {
+        len = (len - 1) / 2;
+        *secret = LIBSSH2_ALLOC(session, len);
+        if(*secret) {
+            memcpy(*secret, point + 1, len);
+            *secret_len = len;
+            rc = 0;
+        }
+    }
+    gcry_sexp_release(s);
+
+  out:
+    if(scalar)
+        gcry_mpi_release(scalar);
+    if(d)
+        gcry_sexp_release(d);
+    if(peerkey)
+        gcry_sexp_release(peerkey);
+    if(plain)
+        gcry_sexp_release(plain);
+    if(enc)
+        gcry_sexp_release(enc);
+    return rc;
+}
+
+void
+_libssh2_ecdh_free(LIBSSH2_SESSION *session, _libssh2_ec_key *key)
+{
+    if(!key)
+        return;
+    if(key->key)
+        gcry_sexp_release(key->key);
+    memset(key->scalar, 0, sizeof(key->scalar));
+    LIBSSH2_FREE(session, key);
+}
+
+
+int
+_libssh2_ecdsa_new_public(libssh2_ecdsa_ctx ** ecdsa,
+                          LIBSSH2_SESSION * session,
+                          libssh2_curve_type curve,
+                          const unsigned char *q, size_t q_len)
+{
+    (void) session;
+
+    *ecdsa = NULL;
+    if(!ecdh_curve_name(curve) ||
+       gcry_sexp_build(ecdsa, NULL, "(public-key(ecc(curve %s)(q %b)))",
+                       ecdh_curve_name(curve), (int)q_len, q))
+        return -1;
+    if(ec_check_point(*ecdsa)) {
+        gcry_sexp_release(*ecdsa);
+        *ecdsa = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_ecdsa_new_private_raw(libssh2_ecdsa_ctx ** ecdsa,
+                               LIBSSH2_SESSION * session,
+                               libssh2_curve_type curve,
+                               const unsigned char *q, size_t q_len,
+                               const unsigned char *d, size_t d_len)
+{
+    (void) session;
+
+    *ecdsa = NULL;
+    if(!ecdh_curve_name(curve) ||
+       gcry_sexp_build(ecdsa, NULL,
+                       "(private-key(ecc(curve %s)(q %b)(d %b)))",
+                       ecdh_curve_name(curve), (int)q_len, q,
+                       (int)d_len, d))
+        return -1;
+    /* checks that q is d times the generator */
+    if(gcry_pk_testkey(*ecdsa)) {
+        gcry_sexp_release(*ecdsa);
+        *ecdsa = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_ecdsa_new_private_frommemory(libssh2_ecdsa_ctx ** ecdsa,
+                                      LIBSSH2_SESSION * session,
+                                      const char *filedata,
+                                      size_t filedata_len,
+                                      unsigned const char *passphrase)
+{
+    (void) ecdsa;
+    (void) filedata;
+    (void) filedata_len;
+    (void) passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "Unable to read PEM EC private key: "
+                          "Method unimplemented in libgcrypt backend");
+}
+
+int
+_libssh2_ecdsa_new_private(libssh2_ecdsa_ctx ** ecdsa,
+                           LIBSSH2_SESSION * session,
+                           const char *filename,
+                           unsigned const char *passphrase)
+{
+    (void) ecdsa;
+    (void) filename;
+    (void) passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "Unable to read PEM EC private key: "
+                          "Method unimplemented in libgcrypt backend");
+}
+
+int
+_libssh2_ecdsa_curve_type(libssh2_ecdsa_ctx * ecdsa,
+                          libssh2_curve_type *curve)
+{
+    const char *name = gcry_pk_get_curve(ecdsa, 0, NULL);
+
+    if(!name)
+        return -1;
+    if(!strcmp(name, "NIST P-256"))
+        *curve = LIBSSH2_EC_CURVE_NISTP256;
+    else if(!strcmp(name, "NIST P-384"))
+        *curve = LIBSSH2_EC_CURVE_NISTP384;
+    else if(!strcmp(name, "NIST P-521"))
+        *curve = LIBSSH2_EC_CURVE_NISTP521;
+    else
+        return -1;
+    return 0;
+}
+
+int
+_libssh2_ecdsa_verify(libssh2_ecdsa_ctx * ecdsa,
+                      const unsigned char *r, size_t r_len,
+                      const unsigned char *s, size_t s_len,
+                      const unsigned char *hash, size_t hash_len)
+{
+    gcry_sexp_t s_sig, s_hash;
+    int rc;
+
+    if(gcry_sexp_build(&s_hash, NULL, "(data(flags raw)(value %b))",
+                       (int)hash_len, hash))
+        return -1;
+    if(gcry_sexp_build(&s_sig, NULL, "(sig-val(ecdsa(r %b)(s %b)))",
+                       (int)r_len, r, (int)s_len, s)) {
+        gcry_sexp_release(s_hash);
+        return -1;
+    }
+
+    rc = gcry_pk_verify(s_sig, s_hash, ecdsa);
+    gcry_sexp_release(s_sig);
+    gcry_sexp_release(s_hash);
+
+    return (rc == 0) ? 0 : -1;
+}
+
+/* copy the value of token 'name' out of a signature, without the leading
+   zeroes of a positive number */
+static unsigned char *
+sig_token(LIBSSH2_SESSION * session, gcry_sexp_t sig, const char *name,
+          int strip, size_t *len)
+{
+    gcry_sexp_t token;
+    const char *data;
+    unsigned char *out = NULL;
+
+    token = gcry_sexp_find_token(sig, name, 0);
+    if(!token)
+        return NULL;
+    data = gcry_sexp_nth_data(token, 1, len);
+    if(data) {
+        while(strip && *len > 1 && !data[0]) {
+            data++;
+            (*len)--;
+        }
+        out = LIBSSH2_ALLOC(session, *len ? *len : 1);
+        if(out)
+            memcpy(out, data, *len);
+    }
+    gcry_sexp_release(token);
+    return out;
+}
+
+int
+_libssh2_ecdsa_sign(LIBSSH2_SESSION * session,
+                    libssh2_ecdsa_ctx * ecdsa,
+                    const unsigned char *hash, size_t hash_len,
+                    unsigned char **r, size_t *r_len,
+                    unsigned char **s, size_t *s_len)
+{
+    gcry_sexp_t sig, data;
+
+    if(gcry_sexp_build(&data, NULL, "(data(flags raw)(value %b))",
+                       (int)hash_len, hash))
+        return -1;
+    if(gcry_pk_sign(&sig, data, ecdsa)) {
+        gcry_sexp_release(data);
+        return -1;
+    }
+    gcry_sexp_release(data);
+
+    *r = sig_token(session, sig, "r", 1, r_len);
+    *s = sig_token(session, sig, "s", 1, s_len);
+    gcry_sexp_release(sig);
+    if(!*r || !*s) {
+        if(*r)
+            LIBSSH2_FREE(session, *r);
+        if(*s)
+            LIBSSH2_FREE(session, *s);
+        return -1;
+    }
+    return 0;
+}
+
+#if LIBSSH2_ED25519
+
+int
+_libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519,
+                            LIBSSH2_SESSION * session,
+                            const unsigned char *pub, size_t pub_len)
+{
+    (void) session;
+
+    *ed25519 = NULL;
+    if(pub_len != 32 ||
+       gcry_sexp_build(ed25519, NULL,
+                       "(public-key(ecc(curve Ed25519)(flags eddsa)"
+                       "(q %b)))", 32, pub))
+        return -1;
+    return 0;
+}
+
+int
+_libssh2_ed25519_new_private_raw(libssh2_ed25519_ctx ** ed25519,
+                                 LIBSSH2_SESSION * session,
+                                 const unsigned char *seed,
+                                 const unsigned char *pub)
+{
+    (void) session;
+
+    *ed25519 = NULL;
+    if(gcry_sexp_build(ed25519, NULL,
+                       "(private-key(ecc(curve Ed25519)(flags eddsa)"
+                       "(q %b)(d %b)))", 32, pub, 32, seed))
+        return -1;
+    /* checks that the public half belongs to the seed */
+    if(gcry_pk_testkey(*ed25519)) {
+        gcry_sexp_release(*ed25519);
+        *ed25519 = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+_libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519,
+                                        LIBSSH2_SESSION * session,
+                                        const char *filedata,
+                                        size_t filedata_len,
+                                        unsigned const char *passphrase)
+{
+    (void) ed25519;
+    (void) filedata;
+    (void) filedata_len;
+    (void) passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "Unable to read PEM ED25519 private key: "
+                          "Method unimplemented in libgcrypt backend");
+}
+
+int
+_libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519,
+                             LIBSSH2_SESSION * session,
+                             const char *filename,
+                             unsigned const char *passphrase)
+{
+    (void) ed25519;
+    (void) filename;
+    (void) passphrase;
+
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "Unable to read PEM ED25519 private key: "
+                          "Method unimplemented in libgcrypt backend");
+}
+
+int
+_libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519,
+                        const unsigned char *sig, size_t sig_len,
+                        const unsigned char *m, size_t m_len)
+{
+    gcry_sexp_t s_sig, s_data;
+    int rc;
+
+    if(sig_len != 64)
+        return -1;
+    if(gcry_sexp_build(&s_data, NULL,
+                       "(data(flags eddsa)(hash-algo sha512)(value %b))",
+                       (int)m_len, m))
+        return -1;
+    if(gcry_sexp_build(&s_sig, NULL, "(sig-val(eddsa(r %b)(s %b)))",
+                       32, sig, 32, sig + 32)) {
+        gcry_sexp_release(s_data);
+        return -1;
+    }
+
+    rc = gcry_pk_verify(s_sig, s_data, ed25519);
+    gcry_sexp_release(s_sig);
+    gcry_sexp_release(s_data);
+
+    return (rc == 0) ? 0 : -1;
+}
+
+int
+_libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                      libssh2_ed25519_ctx * ed25519,
+                      const unsigned char *m, size_t m_len,
+                      unsigned char **sig, size_t *sig_len)
+{
+    gcry_sexp_t s_sig, data;
+    unsigned char *r, *s;
+    size_t r_len, s_len;
+
+    if(gcry_sexp_build(&data, NULL,
+                       "(data(flags eddsa)(hash-algo sha512)(value %b))",
+                       (int)m_len, m))
+        return -1;
+    if(gcry_pk_sign(&s_sig, data, ed25519)) {
+        gcry_sexp_release(data);
+        return -1;
+    }
+    gcry_sexp_release(data);
+
+    /* r and s are little-endian strings, keep them as they are */
+    r = sig_token(session, s_sig, "r", 0, &r_len);
+    s = sig_token(session, s_sig, "s", 0, &s_len);
+    gcry_sexp_release(s_sig);
+
+    *sig = NULL;
+    if(r && s && r_len == 32 && s_len == 32) {
+        *sig = LIBSSH2_ALLOC(session, 64);
+        if(*sig) {
+            memcpy(*sig, r, 32);
+            memcpy(*sig + 32, s, 32);
+            *sig_len = 64;
+        }
+    }
+    if(r)
+        LIBSSH2_FREE(session, r);
+    if(s)
+        LIBSSH2_FREE(session, s);
+    return *sig ? 0 : -1;
+}
+
+#endif /* LIBSSH2_ED25519 */
+
+#endif /* LIBSSH2_ECDH */
+
 #endif /* LIBSSH2_LIBGCRYPT */
@@ -47,6 +47,43 @@
 
 #define LIBSSH2_AES 1
 #define LIBSSH2_AES_CTR 1
+#define LIBSSH2_AES_CTR_IMPL "libgcrypt GCRY_CIPHER_MODE_CTR"
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+/* GCM mode appeared in libgcrypt 1.6.0 */
+# define LIBSSH2_AES_GCM 1
+#else
+# define LIBSSH2_AES_GCM 0
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700
+/* ChaCha20 and Poly1305 appeared in libgcrypt 1.7.0 */
+# define LIBSSH2_CHACHA20_POLY1305 1
+#else
+# define LIBSSH2_CHACHA20_POLY1305 0
+#endif
+/* ECDH goes through the ecc public key functions,
+   gcry_ecc_mul_point() for curve25519 appeared in libgcrypt 1.9.0 */
+#define LIBSSH2_ECDH 1
+#if GCRYPT_VERSION_NUMBER >= 0x010900
+# define LIBSSH2_CURVE25519 1
+#else
+# define LIBSSH2_CURVE25519 0
+#endif
+/* ECDSA keys are ecc key S-expressions, Ed25519 signatures need the
+   eddsa flag of libgcrypt 1.6.0 */
+#define LIBSSH2_ECDSA 1
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+# define LIBSSH2_ED25519 1
+#else
+# define LIBSSH2_ED25519 0
+#endif
+/* AES-NI and PCLMULQDQ are used at run time, the SHA extensions and the
+   ARMv8 crypto extensions since libgcrypt 1.8.0 */
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+# define LIBSSH2_ACCEL_BACKEND (LIBSSH2_ACCEL_AES | LIBSSH2_ACCEL_CLMUL | \
+                                LIBSSH2_ACCEL_SHA1 | LIBSSH2_ACCEL_SHA256)
+#else
+# define LIBSSH2_ACCEL_BACKEND (LIBSSH2_ACCEL_AES | LIBSSH2_ACCEL_CLMUL)
+#endif
 #define LIBSSH2_BLOWFISH 1
 #define LIBSSH2_RC4 1
 #define LIBSSH2_CAST 1
@@ -58,6 +95,8 @@
 #define MD5_DIGEST_LENGTH 16
 #define SHA_DIGEST_LENGTH 20
 #define SHA256_DIGEST_LENGTH 32
+#define SHA384_DIGEST_LENGTH 48
+#define SHA512_DIGEST_LENGTH 64
 
 #define _libssh2_random(buf, len)                \
   (gcry_randomize ((buf), (len), GCRY_STRONG_RANDOM), 1)
@@ -87,6 +126,24 @@
 #define libssh2_sha256(message, len, out) \
   gcry_md_hash_buffer (GCRY_MD_SHA256, out, message, len)
 
+#define libssh2_sha384_ctx gcry_md_hd_t
+
+#define libssh2_sha384_init(ctx) \
+  (GPG_ERR_NO_ERROR == gcry_md_open (ctx,  GCRY_MD_SHA384, 0))
+#define libssh2_sha384_update(ctx, data, len) \
+  gcry_md_write (ctx, (unsigned char *) data, len)
+#define libssh2_sha384_final(ctx, out) \
+  memcpy (out, gcry_md_read (ctx, 0), SHA384_DIGEST_LENGTH), gcry_md_close (ctx)
+
+#define libssh2_sha512_ctx gcry_md_hd_t
+
+#define libssh2_sha512_init(ctx) \
+  (GPG_ERR_NO_ERROR == gcry_md_open (ctx,  GCRY_MD_SHA512, 0))
+#define libssh2_sha512_update(ctx, data, len) \
+  gcry_md_write (ctx, (unsigned char *) data, len)
+#define libssh2_sha512_final(ctx, out) \
+  memcpy (out, gcry_md_read (ctx, 0), SHA512_DIGEST_LENGTH), gcry_md_close (ctx)
+
 #define libssh2_md5_ctx gcry_md_hd_t
 
 /* returns 0 in case of failure */
@@ -122,6 +179,7 @@
 #define libssh2_hmac_final(ctx, data) \
   memcpy (data, gcry_md_read (ctx, 0), \
       gcry_md_get_algo_dlen (gcry_md_get_algo (ctx)))
+#define libssh2_hmac_reset(ctx) (gcry_md_reset (ctx), 0)
 #define libssh2_hmac_cleanup(ctx) gcry_md_close (*ctx);
 
 #define libssh2_crypto_init() gcry_control (GCRYCTL_DISABLE_SECMEM)
@@ -135,6 +193,14 @@
 
 #define _libssh2_dsa_free(dsactx)  gcry_sexp_release (dsactx)
 
+#define libssh2_ecdsa_ctx struct gcry_sexp
+
+#define _libssh2_ecdsa_free(ecdsactx)  gcry_sexp_release (ecdsactx)
+
+#define libssh2_ed25519_ctx struct gcry_sexp
+
+#define _libssh2_ed25519_free(ed25519ctx)  gcry_sexp_release (ed25519ctx)
+
 #define _libssh2_cipher_type(name) int name
 #define _libssh2_cipher_ctx gcry_cipher_hd_t
 
@@ -154,6 +220,10 @@
   _libssh2_gcry_ciphermode(GCRY_CIPHER_AES192, GCRY_CIPHER_MODE_CBC)
 #define _libssh2_cipher_aes128 \
   _libssh2_gcry_ciphermode(GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CBC)
+#define _libssh2_cipher_aes256gcm \
+  _libssh2_gcry_ciphermode(GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM)
+#define _libssh2_cipher_aes128gcm \
+  _libssh2_gcry_ciphermode(GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_GCM)
 #define _libssh2_cipher_blowfish \
   _libssh2_gcry_ciphermode(GCRY_CIPHER_BLOWFISH, GCRY_CIPHER_MODE_CBC)
 #define _libssh2_cipher_arcfour \
@@ -166,10 +236,16 @@
 
 #define _libssh2_cipher_dtor(ctx) gcry_cipher_close(*(ctx))
 
+#define _libssh2_chacha20_ctx gcry_cipher_hd_t
+
+struct _libssh2_gcry_ec_key;
+#define _libssh2_ec_key struct _libssh2_gcry_ec_key
+void _libssh2_ecdh_free(LIBSSH2_SESSION *session, _libssh2_ec_key *key);
+
 #define _libssh2_bn struct gcry_mpi
 #define _libssh2_bn_ctx int
 #define _libssh2_bn_ctx_new() 0
-#define _libssh2_bn_ctx_free(bnctx) ((void)0)
+#define _libssh2_bn_ctx_free(bnctx) ((void)(bnctx))
 #define _libssh2_bn_init() gcry_mpi_new(0)
 #define _libssh2_bn_init_from_bin() NULL /* because gcry_mpi_scan() creates a new bignum */
 #define _libssh2_bn_rand(bn, bits, top, bottom) gcry_mpi_randomize (bn, bits, GCRY_WEAK_RANDOM)
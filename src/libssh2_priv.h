@@ -154,14 +154,28 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
  * padding length, payload, padding, and MAC.)."
  */
 #define MAX_SSH_PACKET_LEN 35000
-#define MAX_SHA_DIGEST_LEN SHA256_DIGEST_LENGTH
+
+/*
+ * Packets larger than that are only built or accepted once a channel has
+ * negotiated a larger packet size. OpenSSH takes packets of up to 256 KiB,
+ * which serves as our upper bound too. MAX_CHANNEL_PACKET_LEN leaves room
+ * for the message header, padding and MAC within that.
+ */
+#define MAX_SSH_PACKET_LIMIT (256*1024)
+#define MAX_CHANNEL_PACKET_LEN (MAX_SSH_PACKET_LIMIT - \
+                                (LIBSSH2_PACKET_MAXPAYLOAD - \
+                                 LIBSSH2_CHANNEL_PACKET_DEFAULT))
+/* SHA-512, the largest exchange hash (ecdh-sha2-nistp521) */
+#define MAX_SHA_DIGEST_LEN 64
 
 #define LIBSSH2_ALLOC(session, count) \
-  session->alloc((count), &(session)->abstract)
+  ((session)->stats.allocs++, \
+   session->alloc((count), &(session)->abstract))
 #define LIBSSH2_CALLOC(session, count) _libssh2_calloc(session, count)
 #define LIBSSH2_REALLOC(session, ptr, count) \
- ((ptr) ? session->realloc((ptr), (count), &(session)->abstract) : \
- session->alloc((count), &(session)->abstract))
+ ((session)->stats.allocs++, \
+  (ptr) ? session->realloc((ptr), (count), &(session)->abstract) : \
+  session->alloc((count), &(session)->abstract))
 #define LIBSSH2_FREE(session, ptr) \
  session->free((ptr), &(session)->abstract)
 #define LIBSSH2_IGNORE(session, data, datalen) \
@@ -187,20 +201,40 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
     channel->close_cb((session), &(session)->abstract, \
                       (channel), &(channel)->abstract)
 
+#define LIBSSH2_CHANNEL_DATA(channel, stream_id, data, datalen)         \
+    channel->data_cb((channel)->session, (channel), (stream_id),        \
+                     (data), (datalen), &(channel)->abstract)
+
+#define LIBSSH2_LISTENER_ACCEPT(listener, channel)                       \
+    listener->accept_cb((listener)->session, (listener), (channel),     \
+                        &(listener)->abstract)
+
 #define LIBSSH2_SEND_FD(session, fd, buffer, length, flags) \
     (session->send)(fd, buffer, length, flags, &session->abstract)
 #define LIBSSH2_RECV_FD(session, fd, buffer, length, flags) \
     (session->recv)(fd, buffer, length, flags, &session->abstract)
 
-#define LIBSSH2_SEND(session, buffer, length, flags)  \
-    LIBSSH2_SEND_FD(session, session->socket_fd, buffer, length, flags)
+/* record a trace event if anyone is listening, see _libssh2_event_add() */
+#define _libssh2_event(session, event, channel, request_id, info, bytes) \
+    do {                                                                \
+        if ((session)->trace_event_cb)                                  \
+            _libssh2_event_add((session), (event), (channel),           \
+                               (request_id), (info), (bytes));          \
+    } while(0)
+
+/* the session's own socket, or the buffers of LIBSSH2_FLAG_FEED */
+#define LIBSSH2_SEND(session, buffer, length, flags)                    \
+    ((session)->flag.feed ?                                             \
+     _libssh2_feed_send((session), (buffer), (length)) :               \
+     LIBSSH2_SEND_FD(session, session->socket_fd, buffer, length, flags))
 #define LIBSSH2_RECV(session, buffer, length, flags)                    \
-    LIBSSH2_RECV_FD(session, session->socket_fd, buffer, length, flags)
+    ((session)->flag.feed ?                                             \
+     _libssh2_feed_recv((session), (buffer), (length)) :               \
+     LIBSSH2_RECV_FD(session, session->socket_fd, buffer, length, flags))
 
 typedef struct _LIBSSH2_KEX_METHOD LIBSSH2_KEX_METHOD;
 typedef struct _LIBSSH2_HOSTKEY_METHOD LIBSSH2_HOSTKEY_METHOD;
 typedef struct _LIBSSH2_CRYPT_METHOD LIBSSH2_CRYPT_METHOD;
-typedef struct _LIBSSH2_COMP_METHOD LIBSSH2_COMP_METHOD;
 
 typedef struct _LIBSSH2_PACKET LIBSSH2_PACKET;
 
@@ -222,6 +256,7 @@ typedef enum
     libssh2_NB_state_jump3,
     libssh2_NB_state_jump4,
     libssh2_NB_state_jump5,
+    libssh2_NB_state_jump6,
     libssh2_NB_state_end
 } libssh2_nonblocking_states;
 
@@ -262,6 +297,9 @@ typedef struct kmdhgGPshakex_state_t
     void *exchange_hash;
     packet_require_state_t req_state;
     libssh2_nonblocking_states burn_state;
+#if LIBSSH2_ECDH
+    _libssh2_ec_key *ec_key;    /* ephemeral ECDH key */
+#endif
 } kmdhgGPshakex_state_t;
 
 typedef struct key_exchange_state_low_t
@@ -286,6 +324,11 @@ typedef struct key_exchange_state_t
     size_t data_len;
     unsigned char *oldlocal;
     size_t oldlocal_len;
+    /* method whose first packet was sent along with KEXINIT */
+    const LIBSSH2_KEX_METHOD *guess;
+    /* when the exchange started, and if it is not the first one */
+    libssh2_uint64_t start_us;
+    int rekey;
 } key_exchange_state_t;
 
 #define FwdNotReq "Forward not requested"
@@ -332,6 +375,9 @@ struct _LIBSSH2_PACKET
     /* Where to start reading data from,
      * used for channel data that's been partially consumed */
     size_t data_head;
+
+    /* the size 'data' was asked for from the slab */
+    size_t data_size;
 };
 
 typedef struct _libssh2_channel_data
@@ -346,10 +392,92 @@ typedef struct _libssh2_channel_data
     char close, eof, extended_data_ignore_mode;
 } libssh2_channel_data;
 
+/* A link in one of the queues of channels that libssh2_transport_read()
+   and libssh2_transport_write() report */
+struct channel_ready
+{
+    LIBSSH2_CHANNEL *next;
+    char queued;
+};
+
+struct channel_ready_queue
+{
+    LIBSSH2_CHANNEL *first;
+    LIBSSH2_CHANNEL *last;
+};
+
+/* initial number of buckets in session->channel_hash */
+#define LIBSSH2_CHANNEL_HASH_INITIAL 64
+
+/* number of buckets in session->listener_hash */
+#define LIBSSH2_LISTENER_HASH_SIZE 64
+
+/* bounds of an auto-tuned receive window, see
+   _libssh2_channel_window_tune() */
+#define LIBSSH2_CHANNEL_WINDOW_AUTO_MIN (128*1024)
+#define LIBSSH2_CHANNEL_WINDOW_AUTO_MAX (1024*1024*1024)
+
+/* how long the receive window of a channel stays untouched before the
+   read budget lends what it has yet to use to the other channels */
+#define LIBSSH2_READ_BUDGET_IDLE_US 1000000
+
+/* the smallest window adjustment sent on its own, see
+   LIBSSH2_FLAG_WINDOW_MINADJUST */
+#define CHANNEL_MINADJUST(session)                                      \
+    ((session)->flag.window_minadjust ?                                 \
+     (uint32_t)(session)->flag.window_minadjust : LIBSSH2_CHANNEL_MINADJUST)
+
+/* the receive window a channel is kept topped up to */
+#define LIBSSH2_CHANNEL_WINDOW_TARGET(channel)                  \
+    ((channel)->window_target ? (channel)->window_target :      \
+     (channel)->remote.window_size_initial)
+
+/* the weight a channel's share of the outbound queue is figured with, see
+   libssh2_channel_weight() */
+#define CHANNEL_WEIGHT(channel)                                         \
+    ((channel)->weight ? (channel)->weight : LIBSSH2_CHANNEL_WEIGHT_DEFAULT)
+
+/* A token bucket for libssh2_session_pace() and libssh2_channel_pace().
+   'credit' is in bytes times a million so that it fills up by 'rate' every
+   microsecond. It may go below zero by one packet, which then has to be
+   paid off before the next one goes */
+struct pace_bucket
+{
+    libssh2_uint64_t rate;    /* bytes per second, 0 for no pacing */
+    size_t burst;             /* most bytes sent at once */
+    libssh2_int64_t credit;
+    libssh2_uint64_t last_us; /* when 'credit' was last filled up */
+};
+
+/* the burst of a bucket made without one: 10 ms worth of data, and at
+   least this much */
+#define LIBSSH2_PACE_BURST_MIN 4096
+
+/* largest prefix _libssh2_channel_write_prefixed() copies into one packet,
+   room for an SFTP write request header with the longest handle */
+#define LIBSSH2_CHANNEL_WRITE_PREFIX_MAX 288
+
+/* most of a file libssh2_channel_sendfile() maps per call, and most packets
+   libssh2_channel_recvfile() writes out of per call */
+#define LIBSSH2_CHANNEL_SENDFILE_MAP (4 * 1024 * 1024)
+#define LIBSSH2_CHANNEL_RECVFILE_VIEWS 16
+
 struct _LIBSSH2_CHANNEL
 {
     struct list_node node;
 
+    /* next channel in the same session->channel_hash bucket */
+    LIBSSH2_CHANNEL *hash_next;
+
+    /* place in the session's readable and writable queues, see
+       _libssh2_channel_ready() */
+    struct channel_ready readable, writable;
+
+    /* registration in a LIBSSH2_POLLSET, NULL if none */
+    struct _libssh2_pollset_entry *poll_entry;
+    /* pairing with a socket in a LIBSSH2_RELAY, NULL if none */
+    struct _libssh2_relay_pair *relay_pair;
+
     unsigned char *channel_type;
     unsigned channel_type_len;
 
@@ -362,13 +490,57 @@ struct _LIBSSH2_CHANNEL
     libssh2_channel_data local, remote;
     /* Amount of bytes to be refunded to receive window (but not yet sent) */
     uint32_t adjust_queue;
-    /* Data immediately available for reading */
+    /* Data immediately available for reading, and how much of it is
+       extended data, so that the queues need not be walked to tell */
     uint32_t read_avail;
+    uint32_t ext_avail;
+
+    /* Receive window libssh2 tops up to once auto-tuned, 0 while it is
+       still remote.window_size_initial. window_used counts the bytes
+       consumed since window_epoch (in microseconds), see
+       _libssh2_channel_window_tune(). */
+    uint32_t window_target;
+    uint32_t window_used;
+    libssh2_uint64_t window_epoch;
+
+    /* For the read budget: budget_busy is set whenever the window moves,
+       budget_idle is the unused window the budget doesn't count while the
+       channel is idle, see _libssh2_channel_window_granted() */
+    int budget_busy;
+    uint32_t budget_idle;
+
+    /* Incoming SSH_MSG_CHANNEL_DATA and SSH_MSG_CHANNEL_EXTENDED_DATA
+       packets for this channel, kept apart from session->packets. Extended
+       data is queued on data_queue while the channel merges it into the
+       standard stream so that the arrival order is kept. */
+    struct list_head data_queue;
+    struct list_head ext_queue;
 
     LIBSSH2_SESSION *session;
 
+    /* Set while the open of this channel is not answered, and counting the
+       channel requests that are not, when they were sent without waiting
+       for the answer, see LIBSSH2_FLAG_CHANNEL_PIPELINE. reply_rc is the
+       first failure among the answers, open_reason the reason code of a
+       refused open. */
+    int open_pending;
+    unsigned int requests_pending;
+    int reply_rc;
+    uint32_t open_reason;
+    libssh2_uint64_t open_sent_us; /* when the open went out */
+
+    /* when a write found the window closed, 0 while it is open */
+    libssh2_uint64_t window_wait_start;
+
+    /* counters for libssh2_channel_stats(), the queue lengths are counted
+       when asked */
+    LIBSSH2_CHANNEL_STATS stats;
+
     void *abstract;
       LIBSSH2_CHANNEL_CLOSE_FUNC((*close_cb));
+    /* hands incoming data to the application as it arrives, see
+       libssh2_channel_data_callback() */
+      LIBSSH2_CHANNEL_DATA_FUNC((*data_cb));
 
     /* State variables used in libssh2_channel_setenv_ex() */
     libssh2_nonblocking_states setenv_state;
@@ -411,13 +583,27 @@ struct _LIBSSH2_CHANNEL
     /* State variables used in libssh2_channel_read_ex() */
     libssh2_nonblocking_states read_state;
 
-    uint32_t read_local_id;
+    /* set by libssh2_channel_cork() */
+    int corked;
+
+    /* set by libssh2_channel_weight(), 0 for LIBSSH2_CHANNEL_WEIGHT_DEFAULT.
+       'tx_queued' is how many bytes of its packets wait in the outbound
+       queue of the session */
+    unsigned int weight;
+    size_t tx_queued;
+
+    /* libssh2_channel_pace(). 'pace_until' is when a data packet held back
+       by it or the session's may go, 0 if none is */
+    struct pace_bucket pace;
+    libssh2_uint64_t pace_until;
 
     /* State variables used in libssh2_channel_write_ex() */
     libssh2_nonblocking_states write_state;
-    unsigned char write_packet[13];
+    /* packet_type(1) + channel(4) + stream(4) + length(4) + prefix */
+    unsigned char write_packet[13 + LIBSSH2_CHANNEL_WRITE_PREFIX_MAX];
     size_t write_packet_len;
     size_t write_bufwrite;
+    size_t write_prefix_len;
 
     /* State variables used in libssh2_channel_close() */
     libssh2_nonblocking_states close_state;
@@ -444,20 +630,161 @@ struct _LIBSSH2_LISTENER
     LIBSSH2_SESSION *session;
 
     char *host;
+    size_t host_len;
     int port;
 
+    /* next listener in the same session->listener_hash bucket */
+    LIBSSH2_LISTENER *hash_next;
+
+    /* hands new channels to the application instead of queueing them */
+    LIBSSH2_LISTENER_ACCEPT_FUNC((*accept_cb));
+    void *abstract;
+
     /* a list of CHANNELs for this listener */
     struct list_head queue;
 
     int queue_size;
     int queue_maxsize;
 
+    /* registration in a LIBSSH2_POLLSET, NULL if none */
+    struct _libssh2_pollset_entry *poll_entry;
+
     /* State variables used in libssh2_channel_forward_cancel() */
     libssh2_nonblocking_states chanFwdCncl_state;
     unsigned char *chanFwdCncl_data;
     size_t chanFwdCncl_data_len;
 };
 
+/* A channel or listener in a LIBSSH2_POLLSET. It sits on the set's ready
+   list from the moment something happens to it until a scan finds it has
+   nothing to report, and on the idle list otherwise. */
+struct _libssh2_pollset_entry
+{
+    struct list_node node; /* on the set's ready or idle list */
+    LIBSSH2_POLLSET *set;
+    LIBSSH2_POLLFD fd;     /* type, channel or listener and events */
+};
+
+struct _LIBSSH2_POLLSET
+{
+    LIBSSH2_SESSION *session;
+    struct list_head ready;
+    struct list_head idle;
+    unsigned int nready;   /* entries on the ready list */
+};
+
+/* bytes a relay pair reads from its socket at once, and the most rounds of
+   reading and writing a pair gets each time a relay runs */
+#define LIBSSH2_RELAY_BUF       32768
+#define LIBSSH2_RELAY_ROUNDS    8
+
+/* A socket and channel pair in a LIBSSH2_RELAY. Data read from the socket
+   waits in 'buf' until the channel took it, data received on the channel is
+   sent to the socket straight from the packets it arrived in. */
+struct _libssh2_relay_pair
+{
+    struct list_node node; /* on the relay's pairs */
+    LIBSSH2_RELAY *relay;
+    libssh2_socket_t sock;
+    LIBSSH2_CHANNEL *channel;
+    void *abstract;
+
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_sent;
+
+    /* the send on the session that returned EAGAIN and has to be made again
+       before anything else goes out */
+    enum {
+        relay_stall_none,
+        relay_stall_adjust,
+        relay_stall_write,
+        relay_stall_eof
+    } stall;
+
+    char sock_eof;     /* nothing more to read from the socket */
+    char eof_sent;     /* and the channel has been told */
+    char sock_full;    /* the socket didn't take all it was given */
+    char channel_done; /* all the channel had is on the socket, which had its
+                          sending side shut down */
+    char done;         /* to be reported */
+    int rc;
+
+    libssh2_uint64_t bytes_to_channel;
+    libssh2_uint64_t bytes_to_socket;
+};
+
+struct _LIBSSH2_RELAY
+{
+    LIBSSH2_SESSION *session;
+    struct list_head pairs;
+    unsigned int npairs;
+    struct _libssh2_relay_pair *stalled; /* its send is left over */
+    int busy; /* a pair ran out of rounds, don't wait */
+#ifdef HAVE_POLL
+    struct pollfd *fds;
+    unsigned int fds_size;
+#endif
+};
+
+/* the timer wheel of a LIBSSH2_SESSION_GROUP, LIBSSH2_GROUP_SLOTS slots of
+   LIBSSH2_GROUP_TICK_MS each */
+#define LIBSSH2_GROUP_SLOTS     1024
+#define LIBSSH2_GROUP_TICK_MS   16
+
+/* A session in a LIBSSH2_SESSION_GROUP. It is filed in the wheel slot of
+   the tick its next deadline falls in, deadlines that move later only get
+   it filed again once that tick comes. */
+struct _libssh2_group_entry
+{
+    struct list_node node;  /* on a slot of the wheel or the idle list */
+    LIBSSH2_SESSION_GROUP *group;
+    LIBSSH2_SESSION *session;
+    int filed;              /* set while it is on the wheel */
+    libssh2_uint64_t tick;  /* the tick it is filed for */
+    libssh2_uint64_t keepalive_ms; /* when the last keepalive went out */
+    libssh2_uint64_t recv_ms;      /* when data last came in */
+};
+
+/* A session of a LIBSSH2_SESSION_POOL and the key it was set up for */
+struct _libssh2_pool_entry
+{
+    struct list_node node;  /* in the pool's list */
+    LIBSSH2_SESSION_POOL *pool;
+    LIBSSH2_SESSION *session; /* NULL once the session got freed */
+    char *host;
+    int port;
+    char *user;
+    char *identity;         /* NULL for none */
+    unsigned int channels;  /* handed out and not released */
+    int opening;            /* a channel open on it returned EAGAIN */
+    int broken;             /* a channel open failed, no more channels */
+    unsigned int full;      /* channels the server took at most, or 0 */
+    libssh2_uint64_t idle_ms;      /* when its last channel got released */
+    libssh2_uint64_t sample_ms;    /* when the byte counts were sampled */
+    libssh2_uint64_t sample_bytes; /* ...and what they were */
+    unsigned long rate;     /* bytes a second between the last samples */
+};
+
+struct _LIBSSH2_SESSION_POOL
+{
+    struct list_head sessions;
+    LIBSSH2_POOL_CONNECT_FUNC((*connect_func));
+    LIBSSH2_POOL_CLOSE_FUNC((*close_func));
+    void *abstract;
+    unsigned int max_channels;
+    unsigned long max_rate; /* bytes a second, 0 for no limit */
+    long idle_ms;           /* 0 to only evict failed sessions */
+};
+
+struct _LIBSSH2_SESSION_GROUP
+{
+    struct list_head slots[LIBSSH2_GROUP_SLOTS];
+    struct list_head idle;  /* the entries with no deadline */
+    libssh2_uint64_t tick;  /* the next tick to fire */
+    unsigned int filed;     /* entries on the wheel */
+};
+
 typedef struct _libssh2_endpoint_data
 {
     unsigned char *banner;
@@ -471,10 +798,19 @@ typedef struct _libssh2_endpoint_data
     const struct _LIBSSH2_MAC_METHOD *mac;
     uint32_t seqno;
     void *mac_abstract;
+    unsigned int mac_gen;   /* bumped every time mac_abstract is replaced */
 
     const LIBSSH2_COMP_METHOD *comp;
     void *comp_abstract;
 
+    /* how packets are sealed or opened with the crypt and mac above, see
+       _libssh2_transport_kernels() */
+    const struct _libssh2_transport_kernel *kernel;
+
+    /* carried by the current keys, see libssh2_session_rekey_limit() */
+    libssh2_uint64_t rekey_bytes;
+    uint32_t rekey_packets;
+
     /* Method Preferences -- NULL yields "load order" */
     char *crypt_prefs;
     char *mac_prefs;
@@ -482,12 +818,27 @@ typedef struct _libssh2_endpoint_data
     char *lang_prefs;
 } libssh2_endpoint_data;
 
+/* default size of the receive buffer, and the bounds of what
+   libssh2_session_recv_buffer() accepts */
 #define PACKETBUFSIZE (1024*16)
+#define PACKETBUFSIZE_MIN 1024
+#define PACKETBUFSIZE_MAX (16*1024*1024)
+
+/* A channel data packet in the outbound queue, see transport_share() */
+struct transport_oseg
+{
+    LIBSSH2_CHANNEL *channel; /* NULL once the channel is gone */
+    libssh2_uint64_t end;     /* where the packet ends, counted like
+                                 'obytes_in' */
+    size_t len;
+};
 
 struct transportpacket
 {
     /* ------------- for incoming data --------------- */
-    unsigned char buf[PACKETBUFSIZE];
+    unsigned char *buf;     /* raw data as read from the socket */
+    size_t buf_size;        /* allocated size of buf */
+    size_t buf_want;        /* size buf gets at its next refill */
     unsigned char init[5];  /* first 5 bytes of the incoming data stream,
                                still encrypted */
     size_t writeidx;        /* at what array index we do the next write into
@@ -509,16 +860,47 @@ struct transportpacket
     unsigned char *wptr;    /* write pointer into the payload to where we
                                are currently writing decrypted data */
 
+    size_t maxpayload;      /* largest incoming packet we accept, grows
+                               with the packet size channels advertise */
+
     /* ------------- for outgoing data --------------- */
-    unsigned char outbuf[MAX_SSH_PACKET_LEN]; /* area for the outgoing data */
+    unsigned char *outbuf;  /* area for the outgoing data, grown on demand */
+    size_t outbuf_size;     /* allocated size of outbuf */
 
-    int ototal_num;         /* size of outbuf in number of bytes */
+    int ototal_num;         /* bytes of encrypted packets in outbuf */
     const unsigned char *odata; /* original pointer to the data */
     size_t olen;            /* original size of the data we stored in
                                outbuf */
     size_t osent;           /* number of bytes already sent */
+    int cork;               /* set while a corked channel writes: the
+                               packet may wait in outbuf for the next */
+    int oqueued;            /* set when outbuf holds packets the socket
+                               did not take, not just corked ones */
+    LIBSSH2_CHANNEL *ochannel; /* set while a channel sends data, whose
+                                  share of the queue it counts against */
+    libssh2_uint64_t obytes_in;  /* bytes ever put in outbuf */
+    libssh2_uint64_t obytes_out; /* bytes of those sent */
+    struct transport_oseg *osegs; /* ring of 'oseg_size' with 'oseg_count'
+                                     data packets from 'oseg_first' on,
+                                     oldest first */
+    size_t oseg_size;
+    size_t oseg_first;
+    size_t oseg_count;
+    libssh2_uint64_t oweights; /* CHANNEL_WEIGHT() of the channels with
+                                  tx_queued, added up */
 };
 
+/* most bytes of corked packets held back before they are sent anyway */
+#define LIBSSH2_CORK_MAX (64*1024)
+
+/* most bytes of encrypted packets queued while the socket is full, before
+   _libssh2_transport_send() returns LIBSSH2_ERROR_EAGAIN */
+#define LIBSSH2_OUTQUEUE_MAX (256*1024)
+
+/* most received bytes libssh2_session_feed_in() holds before the session
+   read them */
+#define LIBSSH2_FEED_IN_MAX (256*1024)
+
 struct _LIBSSH2_PUBLICKEY
 {
     LIBSSH2_CHANNEL *channel;
@@ -545,13 +927,67 @@ struct _LIBSSH2_PUBLICKEY
     unsigned char listFetch_buffer[12];
     unsigned char *listFetch_data;
     size_t listFetch_data_len;
+
+    /* State variables used in libssh2_publickey_list_next() */
+    libssh2_nonblocking_states listNext_state;
+    unsigned char *listNext_buf; /* responses as read, parsed in place */
+    size_t listNext_size;
+    size_t listNext_len;         /* bytes in listNext_buf */
+    size_t listNext_off;         /* where the next response starts */
+    libssh2_publickey_attribute *listNext_attrs; /* reused for every key */
+    unsigned long listNext_attrs_size;
 };
 
 #define LIBSSH2_SCP_RESPONSE_BUFLEN     256
 
+/* State variables used in libssh2_scp_recv(), libssh2_scp_recv2() and
+   libssh2_scp_send_ex(). Kept apart from the session since its response
+   buffers are only needed during these calls. */
+struct scp_state
+{
+    libssh2_nonblocking_states recv_state;
+    unsigned char *recv_command;
+    size_t recv_command_len;
+    unsigned char recv_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
+    size_t recv_response_len;
+    long recv_mode;
+#if defined(HAVE_LONGLONG) && defined(HAVE_STRTOLL)
+    /* we have the type and we can parse such numbers */
+    long long recv_size;
+#define scpsize_strtol strtoll
+#elif defined(HAVE_STRTOI64)
+    __int64 recv_size;
+#define scpsize_strtol _strtoi64
+#else
+    long recv_size;
+#define scpsize_strtol strtol
+#endif
+    long recv_mtime;
+    long recv_atime;
+    LIBSSH2_CHANNEL *recv_channel;
+
+    libssh2_nonblocking_states send_state;
+    unsigned char *send_command;
+    size_t send_command_len;
+    unsigned char send_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
+    size_t send_response_len;
+    LIBSSH2_CHANNEL *send_channel;
+};
+
 struct flags {
     int sigpipe;  /* LIBSSH2_FLAG_SIGPIPE */
     int compress; /* LIBSSH2_FLAG_COMPRESS */
+    int kex_guess; /* LIBSSH2_FLAG_KEX_GUESS */
+    int compress_level; /* LIBSSH2_FLAG_COMPRESS_LEVEL, 0 for the default */
+    int channel_pipeline; /* LIBSSH2_FLAG_CHANNEL_PIPELINE */
+    int stats_timing; /* LIBSSH2_FLAG_STATS_TIMING */
+    int release_buffers; /* LIBSSH2_FLAG_RELEASE_BUFFERS */
+    int window_minadjust; /* LIBSSH2_FLAG_WINDOW_MINADJUST, 0 for the
+                             default */
+    int feed; /* LIBSSH2_FLAG_FEED */
+    int publickey_direct; /* LIBSSH2_FLAG_PUBLICKEY_DIRECT */
+    int send_queue; /* LIBSSH2_FLAG_SEND_QUEUE */
+    /* LIBSSH2_FLAG_HISTOGRAMS is set while session->histograms is not NULL */
 };
 
 struct _LIBSSH2_SESSION
@@ -561,6 +997,12 @@ struct _LIBSSH2_SESSION
       LIBSSH2_ALLOC_FUNC((*alloc));
       LIBSSH2_REALLOC_FUNC((*realloc));
       LIBSSH2_FREE_FUNC((*free));
+    /* freed packet buffers kept for reuse */
+    struct _libssh2_slab slab;
+    /* counters for libssh2_session_stats() */
+    LIBSSH2_SESSION_STATS stats;
+    /* LIBSSH2_HISTOGRAM_COUNT of them with LIBSSH2_FLAG_HISTOGRAMS set */
+    LIBSSH2_HISTOGRAM *histograms;
 
     /* Other callbacks */
       LIBSSH2_IGNORE_FUNC((*ssh_msg_ignore));
@@ -571,9 +1013,23 @@ struct _LIBSSH2_SESSION
       LIBSSH2_SEND_FUNC((*send));
       LIBSSH2_RECV_FUNC((*recv));
 
+    /* With LIBSSH2_FLAG_FEED: the bytes handed in with
+       libssh2_session_feed_in() that were not read yet, and what was sent
+       besides the packets of the output buffer, that is the banner */
+    unsigned char *feed_in;
+    size_t feed_in_off;
+    size_t feed_in_len;
+    size_t feed_in_size;
+    int feed_in_eof;
+    unsigned char *feed_out;
+    size_t feed_out_len;
+
     /* Method preferences -- NULL yields "load order" */
     char *kex_prefs;
     char *hostkey_prefs;
+    /* compression methods added with libssh2_session_comp_method_add()
+       followed by the built-in ones, NULL until one is added */
+    const LIBSSH2_COMP_METHOD **comp_methods;
 
     int state;
 
@@ -583,6 +1039,11 @@ struct _LIBSSH2_SESSION
     /* Agreed Key Exchange Method */
     const LIBSSH2_KEX_METHOD *kex;
     unsigned int burn_optimistic_kexinit:1;
+    /* where our own first key exchange packet guess stands, see
+       _libssh2_kex_begin() */
+    int kex_guess;
+    /* big number scratch space kept for all the key exchanges */
+    _libssh2_bn_ctx *bn_ctx;
 
     unsigned char *session_id;
     uint32_t session_id_len;
@@ -602,12 +1063,15 @@ struct _LIBSSH2_SESSION
      */
     unsigned char *server_hostkey;
     uint32_t server_hostkey_len;
+    /* the fingerprints of server_hostkey, taken on first request */
 #if LIBSSH2_MD5
     unsigned char server_hostkey_md5[MD5_DIGEST_LENGTH];
     int server_hostkey_md5_valid;
 #endif                          /* ! LIBSSH2_MD5 */
     unsigned char server_hostkey_sha1[SHA_DIGEST_LENGTH];
     int server_hostkey_sha1_valid;
+    unsigned char server_hostkey_sha256[SHA256_DIGEST_LENGTH];
+    int server_hostkey_sha256_valid;
 
     /* (remote as source of data -- packet_read ) */
     libssh2_endpoint_data remote;
@@ -622,9 +1086,52 @@ struct _LIBSSH2_SESSION
     /* Active connection channels */
     struct list_head channels;
 
+    /* Channels (including those queued on listeners) hashed on their local
+       id, see _libssh2_channel_locate(). The size is a power of two. */
+    LIBSSH2_CHANNEL **channel_hash;
+    uint32_t channel_hash_size;
+    uint32_t channel_hash_count;
+
+    /* Channels that got data, EOF or close, and channels whose window
+       opened, since libssh2_transport_read() and libssh2_transport_write()
+       last reported them. Oldest first. */
+    struct channel_ready_queue readable;
+    struct channel_ready_queue writable;
+
+    /* Receive window sizing, see libssh2_session_window_mode().
+       window_committed is the sum of the window_target of the channels
+       that have been auto-tuned, rtt_us the smoothed time channel opens
+       take to be confirmed. */
+    int window_mode;
+    size_t window_budget;
+    size_t window_committed;
+    libssh2_uint64_t rtt_us;
+
+    /* Received channel data not read yet, the sum of the channels'
+       read_avail, and the most receive window all channels together get
+       granted (0 for no limit), see libssh2_session_read_budget() */
+    size_t read_buffered;
+    size_t read_budget;
+
+    /* The sum of the receive windows of all channels, how much of it goes
+       unused on idle channels, and when idle channels were last looked
+       for */
+    size_t window_granted;
+    size_t window_idle;
+    libssh2_uint64_t budget_sweep_us;
+
+    /* Key re-exchange of our own, see libssh2_session_rekey_limit(). 0
+       limits use the defaults. rekey_due is set once a limit is hit. */
+    libssh2_uint64_t rekey_limit_bytes;
+    uint32_t rekey_limit_packets;
+    int rekey_due;
+
     uint32_t next_channel;
 
     struct list_head listeners; /* list of LIBSSH2_LISTENER structs */
+    /* the listeners hashed on their host and port, see
+       _libssh2_listener_first() */
+    LIBSSH2_LISTENER *listener_hash[LIBSSH2_LISTENER_HASH_SIZE];
 
     /* Actual I/O socket */
     libssh2_socket_t socket_fd;
@@ -633,6 +1140,9 @@ struct _LIBSSH2_SESSION
     int socket_prev_blockstate; /* stores the state of the socket blockiness
                                    when libssh2_session_startup() is called */
 
+    /* libssh2_session_pace(), shared by all channels */
+    struct pace_bucket pace;
+
     /* Error tracking */
     const char *err_msg;
     int err_code;
@@ -640,6 +1150,21 @@ struct _LIBSSH2_SESSION
 
     /* struct members for packet-level reading */
     struct transportpacket packet;
+    /* MAC checks handed to worker threads, see
+       libssh2_session_crypto_threads() */
+    struct transport_ahead *crypto_ahead;
+
+    /* held by the thread using the session, NULL unless
+       libssh2_session_thread_safe() was called */
+    struct _libssh2_lock *lock;
+    /* binary trace events, see libssh2_trace_events(). Up to
+       'trace_events_size' of them are collected in 'trace_events' before
+       they are handed over, one at a time without the buffer */
+    libssh2_trace_event_func trace_event_cb;
+    void *trace_event_context;
+    LIBSSH2_TRACE_EVENT *trace_events;
+    size_t trace_events_used;
+    size_t trace_events_size;
 #ifdef LIBSSH2DEBUG
     int showmask;               /* what debug/trace messages to display */
     libssh2_trace_handler_func tracehandler; /* callback to display trace messages */
@@ -681,6 +1206,9 @@ struct _LIBSSH2_SESSION
     libssh2_nonblocking_states userauth_list_state;
     unsigned char *userauth_list_data;
     size_t userauth_list_data_len;
+    /* methods given with libssh2_userauth_list_set(), returned instead of
+       asking the server */
+    char *userauth_list_known;
     packet_requirev_state_t userauth_list_packet_requirev_state;
 
     /* State variables used in libssh2_userauth_password_ex() */
@@ -713,7 +1241,12 @@ struct _LIBSSH2_SESSION
     size_t userauth_pblc_method_len;
     unsigned char *userauth_pblc_s;
     unsigned char *userauth_pblc_b;
+    /* the data the sign callback signs, kept while it returns EAGAIN */
+    unsigned char *userauth_pblc_sign;
+    size_t userauth_pblc_sign_len;
     packet_requirev_state_t userauth_pblc_packet_requirev_state;
+    /* sign request pending on a shared agent */
+    struct agent_request *agent_req;
 
     /* State variables used in libssh2_userauth_keyboard_interactive_ex() */
     libssh2_nonblocking_states userauth_kybd_state;
@@ -787,40 +1320,18 @@ struct _LIBSSH2_SESSION
     int sftpInit_sent; /* number of bytes from the buffer that have been
                           sent */
 
-    /* State variables used in libssh2_scp_recv() / libssh_scp_recv2() */
-    libssh2_nonblocking_states scpRecv_state;
-    unsigned char *scpRecv_command;
-    size_t scpRecv_command_len;
-    unsigned char scpRecv_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
-    size_t scpRecv_response_len;
-    long scpRecv_mode;
-#if defined(HAVE_LONGLONG) && defined(HAVE_STRTOLL)
-    /* we have the type and we can parse such numbers */
-    long long scpRecv_size;
-#define scpsize_strtol strtoll
-#elif defined(HAVE_STRTOI64)
-    __int64 scpRecv_size;
-#define scpsize_strtol _strtoi64
-#else
-    long scpRecv_size;
-#define scpsize_strtol strtol
-#endif
-    long scpRecv_mtime;
-    long scpRecv_atime;
-    LIBSSH2_CHANNEL *scpRecv_channel;
-
-    /* State variables used in libssh2_scp_send_ex() */
-    libssh2_nonblocking_states scpSend_state;
-    unsigned char *scpSend_command;
-    size_t scpSend_command_len;
-    unsigned char scpSend_response[LIBSSH2_SCP_RESPONSE_BUFLEN];
-    size_t scpSend_response_len;
-    LIBSSH2_CHANNEL *scpSend_channel;
+    /* State of libssh2_scp_recv() and libssh2_scp_send_ex(), allocated
+       while one of them is in progress */
+    struct scp_state *scp;
 
     /* Keepalive variables used by keepalive.c. */
     int keepalive_interval;
     int keepalive_want_reply;
     time_t keepalive_last_sent;
+    /* membership in a LIBSSH2_SESSION_GROUP, NULL if none */
+    struct _libssh2_group_entry *group_entry;
+    /* membership in a LIBSSH2_SESSION_POOL, NULL if none */
+    struct _libssh2_pool_entry *pool_entry;
 };
 
 /* session.state bits */
@@ -897,35 +1408,46 @@ struct _LIBSSH2_CRYPT_METHOD
                  const LIBSSH2_CRYPT_METHOD * method, unsigned char *iv,
                  int *free_iv, unsigned char *secret, int *free_secret,
                  int encrypt, void **abstract);
+    /* en/decrypt 'blocksize' bytes in place. The length can be any multiple
+       of the method's block size so that a whole packet can be handled in
+       a single call */
     int (*crypt) (LIBSSH2_SESSION * session, unsigned char *block,
                   size_t blocksize, void **abstract);
+    /* like crypt, but reads the 'len' bytes to en/decrypt from 'src' and
+       writes the result to 'dst'. NULL if the method only works in place */
+    int (*crypt_to) (LIBSSH2_SESSION * session, const unsigned char *src,
+                     unsigned char *dst, size_t len, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
 
       _libssh2_cipher_type(algo);
-};
 
-struct _LIBSSH2_COMP_METHOD
-{
-    const char *name;
-    int compress; /* 1 if it does compress, 0 if it doesn't */
-    int use_in_auth; /* 1 if compression should be used in userauth */
-    int (*init) (LIBSSH2_SESSION *session, int compress, void **abstract);
-    int (*comp) (LIBSSH2_SESSION *session,
-                 unsigned char *dest,
-                 size_t *dest_len,
-                 const unsigned char *src,
-                 size_t src_len,
-                 void **abstract);
-    int (*decomp) (LIBSSH2_SESSION *session,
-                   unsigned char **dest,
-                   size_t *dest_len,
-                   size_t payload_limit,
-                   const unsigned char *src,
-                   size_t src_len,
-                   void **abstract);
-    int (*dtor) (LIBSSH2_SESSION * session, int compress, void **abstract);
+    /* The rest is only used by LIBSSH2_CRYPT_FLAG_AEAD methods */
+
+    /* length of the authentication tag appended to each packet */
+    int auth_len;
+    /* get the packet length out of the first four bytes of a packet. NULL
+       when the length is sent in the clear */
+    int (*get_len) (LIBSSH2_SESSION * session, uint32_t seqno,
+                    const unsigned char *data, uint32_t *len,
+                    void **abstract);
+    /* en/decrypt and authenticate a whole packet in place. 'aad' is the
+       four byte packet length field, 'data' the 'len' bytes following it
+       and 'tag' where the authentication tag is stored or checked */
+    int (*aead_crypt) (LIBSSH2_SESSION * session, uint32_t seqno,
+                       unsigned char *aad, unsigned char *data, size_t len,
+                       unsigned char *tag, void **abstract);
 };
 
+/* The cipher authenticates the packets itself and no separate MAC is
+   used. The packet length field is kept outside of the block aligned
+   encrypted area. */
+#define LIBSSH2_CRYPT_FLAG_AEAD 0x0001
+/* The method runs on the AES and the carry-less multiply instructions of
+   CPUs that have them, methods the running CPU accelerates are put first
+   in the default preference order */
+#define LIBSSH2_CRYPT_FLAG_AES 0x0100
+#define LIBSSH2_CRYPT_FLAG_CLMUL 0x0200
+
 #ifdef LIBSSH2DEBUG
 void _libssh2_debug(LIBSSH2_SESSION * session, int context, const char *format,
                     ...);
@@ -976,6 +1498,10 @@ _libssh2_debug(LIBSSH2_SESSION * session, int context, const char *format, ...)
 #define SSH_MSG_KEXDH_INIT                          30
 #define SSH_MSG_KEXDH_REPLY                         31
 
+/* ecdh-sha2-* and curve25519-sha256 */
+#define SSH_MSG_KEX_ECDH_INIT                       30
+#define SSH_MSG_KEX_ECDH_REPLY                      31
+
 /* diffie-hellman-group-exchange-sha1 and diffie-hellman-group-exchange-sha256 */
 #define SSH_MSG_KEX_DH_GEX_REQUEST_OLD              30
 #define SSH_MSG_KEX_DH_GEX_REQUEST                  34
@@ -1032,9 +1558,13 @@ ssize_t _libssh2_send(libssh2_socket_t socket, const void *buffer,
 
 int _libssh2_kex_exchange(LIBSSH2_SESSION * session, int reexchange,
                           key_exchange_state_t * state);
+int _libssh2_kex_begin(LIBSSH2_SESSION * session,
+                       key_exchange_state_t * state);
 
 /* Let crypt.c/hostkey.c expose their method structs */
 const LIBSSH2_CRYPT_METHOD **libssh2_crypt_methods(void);
+void _libssh2_crypt_methods_order(void);
+int _libssh2_crypt_accel(const LIBSSH2_CRYPT_METHOD *method);
 const LIBSSH2_HOSTKEY_METHOD **libssh2_hostkey_methods(void);
 
 /* pem.c */
@@ -1051,9 +1581,40 @@ int _libssh2_pem_decode_sequence(unsigned char **data, unsigned int *datalen);
 int _libssh2_pem_decode_integer(unsigned char **data, unsigned int *datalen,
                                 unsigned char **i, unsigned int *ilen);
 
+/* An "openssh-key-v1" private key as ssh-keygen writes it. All pointers
+   point into 'data', which _libssh2_openssh_key_free() releases. */
+struct _libssh2_openssh_key
+{
+    unsigned char *data;
+    unsigned int data_len;
+    unsigned char *pubkey;      /* public key blob */
+    size_t pubkey_len;
+    unsigned char *type;        /* key type name of the private key */
+    size_t type_len;
+    unsigned char *fields;      /* the private key fields after the name */
+    size_t fields_len;
+};
+int _libssh2_openssh_pem_parse(LIBSSH2_SESSION * session, FILE * fp,
+                               struct _libssh2_openssh_key *key);
+int _libssh2_openssh_pem_parse_memory(LIBSSH2_SESSION * session,
+                                      const char *filedata,
+                                      size_t filedata_len,
+                                      struct _libssh2_openssh_key *key);
+void _libssh2_openssh_key_free(LIBSSH2_SESSION * session,
+                               struct _libssh2_openssh_key *key);
+
 /* global.c */
 void _libssh2_init_if_needed (void);
 
+/* agent.c */
+void _libssh2_agent_forget(LIBSSH2_SESSION *session);
+
+/* scp.c */
+void _libssh2_scp_free(LIBSSH2_SESSION *session);
+
+/* keepalive.c */
+void _libssh2_group_update(LIBSSH2_SESSION *session);
+
 
 #define ARRAY_SIZE(a) (sizeof ((a)) / sizeof ((a)[0]))
 
@@ -37,6 +37,7 @@
 
 #include "libssh2_priv.h"
 #include "mac.h"
+#include "misc.h" /* _libssh2_cpu_accel */
 
 #ifdef LIBSSH2_MAC_NONE
 /* mac_none_MAC
@@ -46,7 +47,8 @@ static int
 mac_none_MAC(LIBSSH2_SESSION * session, unsigned char *buf,
              uint32_t seqno, const unsigned char *packet,
              uint32_t packet_len, const unsigned char *addtl,
-             uint32_t addtl_len, void **abstract)
+             uint32_t addtl_len, const unsigned char *addtl2,
+             uint32_t addtl2_len, void **abstract)
 {
     return 0;
 }
@@ -64,6 +66,18 @@ static LIBSSH2_MAC_METHOD mac_method_none = {
 };
 #endif /* LIBSSH2_MAC_NONE */
 
+/* The abstract of the HMAC methods. The context is keyed with the first
+ * packet and put back to that keyed state after every packet, so the
+ * ipad/opad setup is only done once per key instead of once per packet.
+ */
+struct mac_hmac_ctx
+{
+    unsigned char *key;
+    int keyed;
+    int streaming;  /* a packet is being fed by _libssh2_mac_stream_update */
+    libssh2_hmac_ctx ctx;
+};
+
 /* mac_method_common_init
  * Initialize simple mac methods
  */
@@ -71,9 +85,16 @@ static int
 mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
                        int *free_key, void **abstract)
 {
-    *abstract = key;
+    struct mac_hmac_ctx *m = LIBSSH2_ALLOC(session,
+                                           sizeof(struct mac_hmac_ctx));
+    if (!m)
+        return LIBSSH2_ERROR_ALLOC;
+
+    m->key = key;
+    m->keyed = 0;
+    m->streaming = 0;
+    *abstract = m;
     *free_key = 0;
-    (void) session;
 
     return 0;
 }
@@ -86,8 +107,13 @@ mac_method_common_init(LIBSSH2_SESSION * session, unsigned char *key,
 static int
 mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
 {
-    if (*abstract) {
-        LIBSSH2_FREE(session, *abstract);
+    struct mac_hmac_ctx *m = *abstract;
+
+    if (m) {
+        if (m->keyed)
+            libssh2_hmac_cleanup(&m->ctx);
+        LIBSSH2_FREE(session, m->key);
+        LIBSSH2_FREE(session, m);
     }
     *abstract = NULL;
 
@@ -96,6 +122,76 @@ mac_method_common_dtor(LIBSSH2_SESSION * session, void **abstract)
 
 
 
+/*
+ * _libssh2_mac_dup
+ *
+ * Make a second abstract for the same key, so that two threads can compute
+ * MACs with one method at once. Only the HMAC methods support it.
+ */
+int
+_libssh2_mac_dup(LIBSSH2_SESSION * session,
+                 const LIBSSH2_MAC_METHOD *method, void *abstract,
+                 void **dup)
+{
+    struct mac_hmac_ctx *m = abstract;
+    struct mac_hmac_ctx *d;
+
+    if (method->init != mac_method_common_init || !m)
+        return LIBSSH2_ERROR_METHOD_NOT_SUPPORTED;
+
+    d = LIBSSH2_ALLOC(session, sizeof(struct mac_hmac_ctx));
+    if (!d)
+        return LIBSSH2_ERROR_ALLOC;
+    d->key = LIBSSH2_ALLOC(session, method->key_len);
+    if (!d->key) {
+        LIBSSH2_FREE(session, d);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+    memcpy(d->key, m->key, method->key_len);
+    d->keyed = 0;
+    d->streaming = 0;
+    *dup = d;
+
+    return 0;
+}
+
+
+
+/* mac_method_common_update
+ * Feed the sequence number and the packet data to a keyed context, get
+ * the MAC and get ready for the next packet
+ */
+static void
+mac_method_common_update(struct mac_hmac_ctx *m, unsigned char *buf,
+                         uint32_t seqno, const unsigned char *packet,
+                         uint32_t packet_len, const unsigned char *addtl,
+                         uint32_t addtl_len, const unsigned char *addtl2,
+                         uint32_t addtl2_len)
+{
+    unsigned char seqno_buf[4];
+
+    _libssh2_htonu32(seqno_buf, seqno);
+
+    libssh2_hmac_update(m->ctx, seqno_buf, 4);
+    libssh2_hmac_update(m->ctx, packet, packet_len);
+    if (addtl && addtl_len) {
+        libssh2_hmac_update(m->ctx, addtl, addtl_len);
+    }
+    if (addtl2 && addtl2_len) {
+        libssh2_hmac_update(m->ctx, addtl2, addtl2_len);
+    }
+    libssh2_hmac_final(m->ctx, buf);
+
+    /* back to the keyed state. A backend that can't do that gets the key
+       set up again with the next packet */
+    if (libssh2_hmac_reset(m->ctx)) {
+        libssh2_hmac_cleanup(&m->ctx);
+        m->keyed = 0;
+    }
+}
+
+
+
 #if LIBSSH2_HMAC_SHA512
 /* mac_method_hmac_sha512_hash
  * Calculate hash using full sha512 value
@@ -106,23 +202,20 @@ mac_method_hmac_sha2_512_hash(LIBSSH2_SESSION * session,
                           const unsigned char *packet,
                           uint32_t packet_len,
                           const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+                          uint32_t addtl_len,
+                          const unsigned char *addtl2,
+                          uint32_t addtl2_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
+    struct mac_hmac_ctx *m = *abstract;
     (void) session;
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha512_init(&ctx, *abstract, 64);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+        libssh2_hmac_sha512_init(&m->ctx, m->key, 64);
+        m->keyed = 1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    mac_method_common_update(m, buf, seqno, packet, packet_len,
+                             addtl, addtl_len, addtl2, addtl2_len);
 
     return 0;
 }
@@ -136,6 +229,19 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512 = {
     mac_method_common_init,
     mac_method_hmac_sha2_512_hash,
     mac_method_common_dtor,
+    0,                          /* not encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA512
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_512_etm = {
+    "hmac-sha2-512-etm@openssh.com",
+    64,
+    64,
+    mac_method_common_init,
+    mac_method_hmac_sha2_512_hash,
+    mac_method_common_dtor,
+    1,                          /* encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA512
 };
 #endif
 
@@ -151,23 +257,20 @@ mac_method_hmac_sha2_256_hash(LIBSSH2_SESSION * session,
                           const unsigned char *packet,
                           uint32_t packet_len,
                           const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+                          uint32_t addtl_len,
+                          const unsigned char *addtl2,
+                          uint32_t addtl2_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
+    struct mac_hmac_ctx *m = *abstract;
     (void) session;
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha256_init(&ctx, *abstract, 32);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+        libssh2_hmac_sha256_init(&m->ctx, m->key, 32);
+        m->keyed = 1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    mac_method_common_update(m, buf, seqno, packet, packet_len,
+                             addtl, addtl_len, addtl2, addtl2_len);
 
     return 0;
 }
@@ -181,6 +284,19 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256 = {
     mac_method_common_init,
     mac_method_hmac_sha2_256_hash,
     mac_method_common_dtor,
+    0,                          /* not encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA256
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha2_256_etm = {
+    "hmac-sha2-256-etm@openssh.com",
+    32,
+    32,
+    mac_method_common_init,
+    mac_method_hmac_sha2_256_hash,
+    mac_method_common_dtor,
+    1,                          /* encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA256
 };
 #endif
 
@@ -196,23 +312,20 @@ mac_method_hmac_sha1_hash(LIBSSH2_SESSION * session,
                           const unsigned char *packet,
                           uint32_t packet_len,
                           const unsigned char *addtl,
-                          uint32_t addtl_len, void **abstract)
+                          uint32_t addtl_len,
+                          const unsigned char *addtl2,
+                          uint32_t addtl2_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
+    struct mac_hmac_ctx *m = *abstract;
     (void) session;
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_sha1_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+        libssh2_hmac_sha1_init(&m->ctx, m->key, 20);
+        m->keyed = 1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    mac_method_common_update(m, buf, seqno, packet, packet_len,
+                             addtl, addtl_len, addtl2, addtl2_len);
 
     return 0;
 }
@@ -226,6 +339,19 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1 = {
     mac_method_common_init,
     mac_method_hmac_sha1_hash,
     mac_method_common_dtor,
+    0,                          /* not encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA1
+};
+
+static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_etm = {
+    "hmac-sha1-etm@openssh.com",
+    20,
+    20,
+    mac_method_common_init,
+    mac_method_hmac_sha1_hash,
+    mac_method_common_dtor,
+    1,                          /* encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA1
 };
 
 /* mac_method_hmac_sha1_96_hash
@@ -237,12 +363,14 @@ mac_method_hmac_sha1_96_hash(LIBSSH2_SESSION * session,
                              const unsigned char *packet,
                              uint32_t packet_len,
                              const unsigned char *addtl,
-                             uint32_t addtl_len, void **abstract)
+                             uint32_t addtl_len,
+                             const unsigned char *addtl2,
+                             uint32_t addtl2_len, void **abstract)
 {
     unsigned char temp[SHA_DIGEST_LENGTH];
 
     mac_method_hmac_sha1_hash(session, temp, seqno, packet, packet_len,
-                              addtl, addtl_len, abstract);
+                              addtl, addtl_len, addtl2, addtl2_len, abstract);
     memcpy(buf, (char *) temp, 96 / 8);
 
     return 0;
@@ -257,6 +385,8 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_sha1_96 = {
     mac_method_common_init,
     mac_method_hmac_sha1_96_hash,
     mac_method_common_dtor,
+    0,                          /* not encrypt-then-MAC */
+    LIBSSH2_ACCEL_SHA1
 };
 
 #if LIBSSH2_MD5
@@ -269,23 +399,20 @@ mac_method_hmac_md5_hash(LIBSSH2_SESSION * session, unsigned char *buf,
                          const unsigned char *packet,
                          uint32_t packet_len,
                          const unsigned char *addtl,
-                         uint32_t addtl_len, void **abstract)
+                         uint32_t addtl_len,
+                         const unsigned char *addtl2,
+                         uint32_t addtl2_len, void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
+    struct mac_hmac_ctx *m = *abstract;
     (void) session;
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_md5_init(&ctx, *abstract, 16);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+        libssh2_hmac_md5_init(&m->ctx, m->key, 16);
+        m->keyed = 1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    mac_method_common_update(m, buf, seqno, packet, packet_len,
+                             addtl, addtl_len, addtl2, addtl2_len);
 
     return 0;
 }
@@ -310,11 +437,13 @@ mac_method_hmac_md5_96_hash(LIBSSH2_SESSION * session,
                             const unsigned char *packet,
                             uint32_t packet_len,
                             const unsigned char *addtl,
-                            uint32_t addtl_len, void **abstract)
+                            uint32_t addtl_len,
+                            const unsigned char *addtl2,
+                            uint32_t addtl2_len, void **abstract)
 {
     unsigned char temp[MD5_DIGEST_LENGTH];
     mac_method_hmac_md5_hash(session, temp, seqno, packet, packet_len,
-                             addtl, addtl_len, abstract);
+                             addtl, addtl_len, addtl2, addtl2_len, abstract);
     memcpy(buf, (char *) temp, 96 / 8);
     return 0;
 }
@@ -342,23 +471,20 @@ mac_method_hmac_ripemd160_hash(LIBSSH2_SESSION * session,
                                uint32_t packet_len,
                                const unsigned char *addtl,
                                uint32_t addtl_len,
+                               const unsigned char *addtl2,
+                               uint32_t addtl2_len,
                                void **abstract)
 {
-    libssh2_hmac_ctx ctx;
-    unsigned char seqno_buf[4];
+    struct mac_hmac_ctx *m = *abstract;
     (void) session;
 
-    _libssh2_htonu32(seqno_buf, seqno);
-
-    libssh2_hmac_ctx_init(ctx);
-    libssh2_hmac_ripemd160_init(&ctx, *abstract, 20);
-    libssh2_hmac_update(ctx, seqno_buf, 4);
-    libssh2_hmac_update(ctx, packet, packet_len);
-    if (addtl && addtl_len) {
-        libssh2_hmac_update(ctx, addtl, addtl_len);
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+        libssh2_hmac_ripemd160_init(&m->ctx, m->key, 20);
+        m->keyed = 1;
     }
-    libssh2_hmac_final(ctx, buf);
-    libssh2_hmac_cleanup(&ctx);
+    mac_method_common_update(m, buf, seqno, packet, packet_len,
+                             addtl, addtl_len, addtl2, addtl2_len);
 
     return 0;
 }
@@ -385,6 +511,13 @@ static const LIBSSH2_MAC_METHOD mac_method_hmac_ripemd160_openssh_com = {
 #endif /* LIBSSH2_HMAC_RIPEMD */
 
 static const LIBSSH2_MAC_METHOD *mac_methods[] = {
+#if LIBSSH2_HMAC_SHA256
+    &mac_method_hmac_sha2_256_etm,
+#endif
+#if LIBSSH2_HMAC_SHA512
+    &mac_method_hmac_sha2_512_etm,
+#endif
+    &mac_method_hmac_sha1_etm,
 #if LIBSSH2_HMAC_SHA256
     &mac_method_hmac_sha2_256,
 #endif
@@ -407,8 +540,177 @@ static const LIBSSH2_MAC_METHOD *mac_methods[] = {
     NULL
 };
 
+/*
+ * _libssh2_mac_stream
+ *
+ * Whether the packets of a method can be fed to it piece by piece
+ */
+int
+_libssh2_mac_stream(const LIBSSH2_MAC_METHOD *method)
+{
+#if LIBSSH2_HMAC_SHA256
+    if (method == &mac_method_hmac_sha2_256)
+        return 1;
+#endif
+#if LIBSSH2_HMAC_SHA512
+    if (method == &mac_method_hmac_sha2_512)
+        return 1;
+#endif
+    (void)method;
+    return 0;
+}
+
+/*
+ * _libssh2_mac_stream_start
+ *
+ * Start the MAC of the packet with sequence number 'seqno'. Whatever was
+ * fed for a packet that never got to _libssh2_mac_stream_final() is
+ * dropped.
+ */
+void
+_libssh2_mac_stream_start(const LIBSSH2_MAC_METHOD *method, void *abstract,
+                          uint32_t seqno)
+{
+    struct mac_hmac_ctx *m = abstract;
+    unsigned char seqno_buf[4];
+
+    if (m->keyed && m->streaming && libssh2_hmac_reset(m->ctx)) {
+        libssh2_hmac_cleanup(&m->ctx);
+        m->keyed = 0;
+    }
+    if (!m->keyed) {
+        libssh2_hmac_ctx_init(m->ctx);
+#if LIBSSH2_HMAC_SHA512
+        if (method == &mac_method_hmac_sha2_512)
+            libssh2_hmac_sha512_init(&m->ctx, m->key, 64);
+#endif
+#if LIBSSH2_HMAC_SHA256
+        if (method == &mac_method_hmac_sha2_256)
+            libssh2_hmac_sha256_init(&m->ctx, m->key, 32);
+#endif
+        m->keyed = 1;
+    }
+    (void)method;
+
+    _libssh2_htonu32(seqno_buf, seqno);
+    libssh2_hmac_update(m->ctx, seqno_buf, 4);
+    m->streaming = 1;
+}
+
+/*
+ * _libssh2_mac_stream_update
+ *
+ * Feed the next 'len' bytes of the packet
+ */
+void
+_libssh2_mac_stream_update(void *abstract, const unsigned char *data,
+                           size_t len)
+{
+    struct mac_hmac_ctx *m = abstract;
+
+    libssh2_hmac_update(m->ctx, data, len);
+}
+
+/*
+ * _libssh2_mac_stream_final
+ *
+ * Get the MAC of the packet and get ready for the next one
+ */
+void
+_libssh2_mac_stream_final(void *abstract, unsigned char *buf)
+{
+    struct mac_hmac_ctx *m = abstract;
+
+    libssh2_hmac_final(m->ctx, buf);
+    m->streaming = 0;
+
+    if (libssh2_hmac_reset(m->ctx)) {
+        libssh2_hmac_cleanup(&m->ctx);
+        m->keyed = 0;
+    }
+}
+
+#define MAC_METHODS (sizeof(mac_methods) / sizeof(mac_methods[0]))
+
+/* the default order on the running CPU, filled in by libssh2_init() */
+static const LIBSSH2_MAC_METHOD *mac_methods_cpu[MAC_METHODS];
+
 const LIBSSH2_MAC_METHOD **
 _libssh2_mac_methods(void)
 {
-    return mac_methods;
+    return mac_methods_cpu[0] ? mac_methods_cpu : mac_methods;
+}
+
+/* methods of one kind: both encrypt-then-MAC or not, with SHA-2 sized
+   MACs or both with shorter ones */
+static int
+mac_kind(const LIBSSH2_MAC_METHOD *method)
+{
+    return (method->etm ? 2 : 0) | (method->mac_len >= 32);
+}
+
+/*
+ * mac_rank
+ *
+ * How fast a method is on the running CPU, lower is faster: accelerated
+ * hashes first, then SHA-512 on 64 bit CPUs, where it does more per round
+ * in software than SHA-256 does
+ */
+static int
+mac_rank(const LIBSSH2_MAC_METHOD *method, int cpu)
+{
+    if (method->accel && (method->accel & cpu) == method->accel)
+        return 0;
+    if ((method->accel & LIBSSH2_ACCEL_SHA512) && sizeof(void *) >= 8)
+        return 1;
+    return 2;
+}
+
+/*
+ * _libssh2_mac_methods_order
+ *
+ * Order the methods of each kind by how fast they are on the running CPU,
+ * keeping the default order among equally fast ones
+ */
+void
+_libssh2_mac_methods_order(void)
+{
+    int cpu = _libssh2_cpu_accel();
+    size_t start;
+    size_t end;
+    size_t i;
+    size_t n = 0;
+    int rank;
+
+    for (start = 0; mac_methods[start]; start = end) {
+        int kind = mac_kind(mac_methods[start]);
+
+        for (end = start; mac_methods[end] &&
+                 mac_kind(mac_methods[end]) == kind; end++)
+            ;
+        for (rank = 0; rank < 3; rank++)
+            for (i = start; i < end; i++)
+                if (mac_rank(mac_methods[i], cpu) == rank)
+                    mac_methods_cpu[n++] = mac_methods[i];
+    }
+    mac_methods_cpu[n] = NULL;
+}
+
+/* Used in place of a negotiated MAC when the cipher authenticates the
+ * packets itself (LIBSSH2_CRYPT_FLAG_AEAD). It is never asked to hash
+ * anything.
+ */
+static const LIBSSH2_MAC_METHOD mac_method_implicit = {
+    "<implicit>",
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL
+};
+
+const LIBSSH2_MAC_METHOD *
+_libssh2_mac_implicit(void)
+{
+    return &mac_method_implicit;
 }
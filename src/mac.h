@@ -53,15 +53,40 @@ struct _LIBSSH2_MAC_METHOD
     /* Message Authentication Code Hashing algo */
     int (*init) (LIBSSH2_SESSION * session, unsigned char *key, int *free_key,
                  void **abstract);
+    /* The MAC covers the concatenation of 'packet' and the optional
+       'addtl' and 'addtl2' pieces */
     int (*hash) (LIBSSH2_SESSION * session, unsigned char *buf,
                  uint32_t seqno, const unsigned char *packet,
                  uint32_t packet_len, const unsigned char *addtl,
-                 uint32_t addtl_len, void **abstract);
+                 uint32_t addtl_len, const unsigned char *addtl2,
+                 uint32_t addtl2_len, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
+
+    /* Encrypt-then-MAC: the MAC is computed over the encrypted packet and
+       the packet_length field is sent unencrypted */
+    int etm;
+
+    /* the LIBSSH2_ACCEL_* bits of the hash it runs on */
+    int accel;
 };
 
 typedef struct _LIBSSH2_MAC_METHOD LIBSSH2_MAC_METHOD;
 
 const LIBSSH2_MAC_METHOD **_libssh2_mac_methods(void);
+void _libssh2_mac_methods_order(void);
+const LIBSSH2_MAC_METHOD *_libssh2_mac_implicit(void);
+int _libssh2_mac_dup(LIBSSH2_SESSION * session,
+                     const LIBSSH2_MAC_METHOD *method, void *abstract,
+                     void **dup);
+
+/* Feeding the MAC of one packet to a method piece by piece, for the fused
+   transport kernels. _libssh2_mac_stream() tells if the method can do it,
+   only the HMAC-SHA2 ones can. */
+int _libssh2_mac_stream(const LIBSSH2_MAC_METHOD *method);
+void _libssh2_mac_stream_start(const LIBSSH2_MAC_METHOD *method,
+                               void *abstract, uint32_t seqno);
+void _libssh2_mac_stream_update(void *abstract, const unsigned char *data,
+                                size_t len);
+void _libssh2_mac_stream_final(void *abstract, unsigned char *buf);
 
 #endif /* __LIBSSH2_MAC_H */
@@ -48,6 +48,22 @@
 #include <sys/time.h>
 #endif
 
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define LIBSSH2_CPUID_GNUC
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define LIBSSH2_CPUID_MSC
+#endif
+
+#if defined(HAVE_SYS_AUXV_H) && defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
 #include <stdio.h>
 #include <errno.h>
 
@@ -233,6 +249,28 @@ void _libssh2_store_str(unsigned char **buf, const char *str, size_t len)
     }
 }
 
+/* _libssh2_get_string
+ *
+ * Read an SSH string at *buf, which must end before 'end'. *str points into
+ * the buffer and *buf is moved past the string. Returns -1 when the string
+ * does not fit.
+ */
+int _libssh2_get_string(unsigned char **buf, const unsigned char *end,
+                        unsigned char **str, size_t *len)
+{
+    size_t n;
+
+    if(end - *buf < 4)
+        return -1;
+    n = _libssh2_ntohu32(*buf);
+    if((size_t)(end - *buf - 4) < n)
+        return -1;
+    *str = *buf + 4;
+    *len = n;
+    *buf += 4 + n;
+    return 0;
+}
+
 /* Base64 Conversion */
 
 static const char base64_table[] =
@@ -265,28 +303,46 @@ static const short base64_reverse_table[256] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
 };
 
-/* libssh2_base64_decode
+/* _libssh2_base64_decode_into
  *
- * Decode a base64 chunk and store it into a newly alloc'd buffer
+ * Decode a base64 chunk into 'dest', which needs room for 3/4 of 'src_len'
+ * bytes. Since the output never overtakes the input, 'dest' may be 'src' to
+ * decode in place. Returns the decoded length or -1 for invalid base64.
+ *
+ * Runs of four valid characters are decoded a group at a time. Anything
+ * else, such as line breaks and the padding, goes through the character
+ * loop, which skips what isn't base64.
  */
-LIBSSH2_API int
-libssh2_base64_decode(LIBSSH2_SESSION *session, char **data,
-                      unsigned int *datalen, const char *src,
-                      unsigned int src_len)
+int _libssh2_base64_decode_into(unsigned char *dest, const char *src,
+                                size_t src_len)
 {
-    unsigned char *s, *d;
+    const unsigned char *s = (const unsigned char *) src;
+    const unsigned char *end = s + src_len;
+    unsigned char *d = dest;
     short v;
     int i = 0, len = 0;
 
-    *data = LIBSSH2_ALLOC(session, (3 * src_len / 4) + 1);
-    d = (unsigned char *) *data;
-    if (!d) {
-        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                              "Unable to allocate memory for base64 decoding");
-    }
-
-    for(s = (unsigned char *) src; ((char *) s) < (src + src_len); s++) {
-        if ((v = base64_reverse_table[*s]) < 0)
+    while(s < end) {
+        if(!(i % 4) && (end - s) >= 4) {
+            short a = base64_reverse_table[s[0]];
+            short b = base64_reverse_table[s[1]];
+            short c = base64_reverse_table[s[2]];
+            short e = base64_reverse_table[s[3]];
+
+            if((a | b | c | e) >= 0) {
+                long w = ((long)a << 18) | ((long)b << 12) | (c << 6) | e;
+
+                /* all four are read before anything is written, so
+                   decoding in place still works */
+                d[len++] = (unsigned char)(w >> 16);
+                d[len++] = (unsigned char)(w >> 8);
+                d[len++] = (unsigned char)w;
+                s += 4;
+                continue;
+            }
+        }
+        v = base64_reverse_table[*s++];
+        if (v < 0)
             continue;
         switch (i % 4) {
         case 0:
@@ -306,9 +362,33 @@ libssh2_base64_decode(LIBSSH2_SESSION *session, char **data,
         }
         i++;
     }
-    if ((i % 4) == 1) {
+    if ((i % 4) == 1)
         /* Invalid -- We have a byte which belongs exclusively to a partial
            octet */
+        return -1;
+
+    return len;
+}
+
+/* libssh2_base64_decode
+ *
+ * Decode a base64 chunk and store it into a newly alloc'd buffer
+ */
+LIBSSH2_API int
+libssh2_base64_decode(LIBSSH2_SESSION *session, char **data,
+                      unsigned int *datalen, const char *src,
+                      unsigned int src_len)
+{
+    int len;
+
+    *data = LIBSSH2_ALLOC(session, (3 * src_len / 4) + 1);
+    if (!*data) {
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for base64 decoding");
+    }
+
+    len = _libssh2_base64_decode_into((unsigned char *) *data, src, src_len);
+    if (len < 0) {
         LIBSSH2_FREE(session, *data);
         return _libssh2_error(session, LIBSSH2_ERROR_INVAL, "Invalid base64");
     }
@@ -321,6 +401,47 @@ libssh2_base64_decode(LIBSSH2_SESSION *session, char **data,
 static const char table64[]=
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/*
+ * _libssh2_base64_encode_into()
+ *
+ * Encode 'insize' bytes into 'dest', which needs room for
+ * LIBSSH2_BASE64_LEN(insize) bytes. The result is zero terminated. Returns
+ * the length of the base64 string.
+ */
+size_t _libssh2_base64_encode_into(char *dest, const unsigned char *inp,
+                                   size_t insize)
+{
+  char *output = dest;
+  unsigned long w;
+
+  /* whole groups of three bytes, no padding needed */
+  while(insize >= 3) {
+    w = ((unsigned long)inp[0] << 16) | ((unsigned long)inp[1] << 8) |
+      inp[2];
+    output[0] = table64[(w >> 18) & 0x3F];
+    output[1] = table64[(w >> 12) & 0x3F];
+    output[2] = table64[(w >> 6) & 0x3F];
+    output[3] = table64[w & 0x3F];
+    output += 4;
+    inp += 3;
+    insize -= 3;
+  }
+
+  if(insize) {
+    w = (unsigned long)inp[0] << 16;
+    if(insize == 2)
+      w |= (unsigned long)inp[1] << 8;
+    output[0] = table64[(w >> 18) & 0x3F];
+    output[1] = table64[(w >> 12) & 0x3F];
+    output[2] = (char)((insize == 2) ? table64[(w >> 6) & 0x3F] : '=');
+    output[3] = '=';
+    output += 4;
+  }
+  *output = 0;
+
+  return output - dest;
+}
+
 /*
  * _libssh2_base64_encode()
  *
@@ -332,68 +453,22 @@ static const char table64[]=
 size_t _libssh2_base64_encode(LIBSSH2_SESSION *session,
                               const char *inp, size_t insize, char **outptr)
 {
-  unsigned char ibuf[3];
-  unsigned char obuf[4];
-  int i;
-  int inputparts;
-  char *output;
   char *base64data;
-  const char *indata = inp;
 
   *outptr = NULL; /* set to NULL in case of failure before we reach the end */
 
   if(0 == insize)
-    insize = strlen(indata);
+    insize = strlen(inp);
 
-  base64data = output = LIBSSH2_ALLOC(session, insize*4/3+4);
-  if(NULL == output)
+  base64data = LIBSSH2_ALLOC(session, LIBSSH2_BASE64_LEN(insize));
+  if(NULL == base64data)
     return 0;
 
-  while(insize > 0) {
-    for (i = inputparts = 0; i < 3; i++) {
-      if(insize > 0) {
-        inputparts++;
-        ibuf[i] = *indata;
-        indata++;
-        insize--;
-      }
-      else
-        ibuf[i] = 0;
-    }
-
-    obuf[0] = (unsigned char)  ((ibuf[0] & 0xFC) >> 2);
-    obuf[1] = (unsigned char) (((ibuf[0] & 0x03) << 4) | \
-                               ((ibuf[1] & 0xF0) >> 4));
-    obuf[2] = (unsigned char) (((ibuf[1] & 0x0F) << 2) | \
-                               ((ibuf[2] & 0xC0) >> 6));
-    obuf[3] = (unsigned char)   (ibuf[2] & 0x3F);
-
-    switch(inputparts) {
-    case 1: /* only one byte read */
-      snprintf(output, 5, "%c%c==",
-               table64[obuf[0]],
-               table64[obuf[1]]);
-      break;
-    case 2: /* two bytes read */
-      snprintf(output, 5, "%c%c%c=",
-               table64[obuf[0]],
-               table64[obuf[1]],
-               table64[obuf[2]]);
-      break;
-    default:
-      snprintf(output, 5, "%c%c%c%c",
-               table64[obuf[0]],
-               table64[obuf[1]],
-               table64[obuf[2]],
-               table64[obuf[3]] );
-      break;
-    }
-    output += 4;
-  }
-  *output=0;
   *outptr = base64data; /* make it return the actual data memory */
 
-  return strlen(base64data); /* return the length of the new data */
+  /* return the length of the new data */
+  return _libssh2_base64_encode_into(base64data, (const unsigned char *)inp,
+                                     insize);
 }
 /* ---- End of Base64 Encoding ---- */
 
@@ -646,6 +721,246 @@ int __cdecl _libssh2_gettimeofday(struct timeval *tp, void *tzp)
 
 #endif
 
+/*
+ * _libssh2_time_us
+ *
+ * Current time in microseconds, for timing transfers. Only whole seconds on
+ * platforms without gettimeofday().
+ */
+libssh2_uint64_t _libssh2_time_us(void)
+{
+#ifdef HAVE_LIBSSH2_GETTIMEOFDAY
+    struct timeval tv;
+    _libssh2_gettimeofday(&tv, NULL);
+    return (libssh2_uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    return (libssh2_uint64_t)time(NULL) * 1000000;
+#endif
+}
+
+/*
+ * _libssh2_stats_io
+ *
+ * Count a call of the send (outbound) or recv callback that returned 'rc'
+ * in the session stats
+ */
+void _libssh2_stats_io(LIBSSH2_SESSION *session, int outbound, ssize_t rc)
+{
+    LIBSSH2_SESSION_STATS *stats = &session->stats;
+
+    _libssh2_event(session, outbound ? LIBSSH2_EVENT_SOCKET_SEND :
+                   LIBSSH2_EVENT_SOCKET_RECV, 0, 0,
+                   (rc < 0) ? (unsigned int)-rc : 0, (rc > 0) ? rc : 0);
+
+    if (outbound) {
+        stats->send_calls++;
+        if (rc > 0)
+            stats->bytes_sent += rc;
+        else if (rc == -EAGAIN)
+            stats->send_eagain++;
+    }
+    else {
+        stats->recv_calls++;
+        if (rc > 0)
+            stats->bytes_received += rc;
+        else if (rc == -EAGAIN)
+            stats->recv_eagain++;
+    }
+}
+
+/*
+ * _libssh2_time_ns
+ *
+ * Monotonic time in nanoseconds, for trace events. Falls back to the wall
+ * clock of _libssh2_time_us() without clock_gettime().
+ */
+libssh2_uint64_t _libssh2_time_ns(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (libssh2_uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    return _libssh2_time_us() * 1000;
+}
+
+/*
+ * _libssh2_event_add
+ *
+ * Record a trace event: into the batch, which is handed to the callback
+ * once it is full, or straight to the callback without one. Use the
+ * _libssh2_event() macro, which skips all this when nobody listens.
+ */
+void _libssh2_event_add(LIBSSH2_SESSION *session, unsigned int event,
+                        uint32_t channel, uint32_t request_id,
+                        unsigned int info, libssh2_uint64_t bytes)
+{
+    LIBSSH2_TRACE_EVENT one;
+    LIBSSH2_TRACE_EVENT *ev = session->trace_events ?
+        &session->trace_events[session->trace_events_used++] : &one;
+
+    ev->time_ns = _libssh2_time_ns();
+    ev->bytes = bytes;
+    ev->event = event;
+    ev->channel = channel;
+    ev->request_id = request_id;
+    ev->info = info;
+
+    if (!session->trace_events)
+        session->trace_event_cb(session, session->trace_event_context,
+                                &one, 1);
+    else if (session->trace_events_used == session->trace_events_size)
+        _libssh2_event_flush(session);
+}
+
+/*
+ * _libssh2_event_flush
+ *
+ * Hand the trace events collected so far to the callback
+ */
+void _libssh2_event_flush(LIBSSH2_SESSION *session)
+{
+    size_t count = session->trace_events_used;
+
+    if (!count)
+        return;
+
+    /* cleared first, in case the callback records more */
+    session->trace_events_used = 0;
+    session->trace_event_cb(session, session->trace_event_context,
+                            session->trace_events, count);
+}
+
+/*
+ * libssh2_trace_events
+ *
+ * Have binary trace events handed to 'callback', 'batch' of them at a time.
+ * A NULL callback stops them, after the ones collected are handed over.
+ */
+LIBSSH2_API int
+libssh2_trace_events(LIBSSH2_SESSION *session, void *context, size_t batch,
+                     libssh2_trace_event_func callback)
+{
+    LIBSSH2_TRACE_EVENT *events = NULL;
+
+    if (!session)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if (callback && (batch > 1)) {
+        events = LIBSSH2_ALLOC(session, batch * sizeof(LIBSSH2_TRACE_EVENT));
+        if (!events)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate trace events");
+    }
+
+    if (session->trace_event_cb)
+        _libssh2_event_flush(session);
+    if (session->trace_events)
+        LIBSSH2_FREE(session, session->trace_events);
+
+    session->trace_event_cb = callback;
+    session->trace_event_context = context;
+    session->trace_events = events;
+    session->trace_events_used = 0;
+    session->trace_events_size = events ? batch : 0;
+    return 0;
+}
+
+/*
+ * libssh2_trace_events_flush
+ *
+ * Hand the trace events collected so far to the callback without waiting
+ * for the batch to fill up
+ */
+LIBSSH2_API int
+libssh2_trace_events_flush(LIBSSH2_SESSION *session)
+{
+    if (!session)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if (session->trace_event_cb)
+        _libssh2_event_flush(session);
+    return 0;
+}
+
+/*
+ * _libssh2_histogram_add
+ *
+ * Count a latency of 'us' microseconds in histogram 'which', if the
+ * session keeps them
+ */
+void _libssh2_histogram_add(LIBSSH2_SESSION *session, int which,
+                            libssh2_uint64_t us)
+{
+    LIBSSH2_HISTOGRAM *h;
+    unsigned int bucket;
+
+    if (!session->histograms)
+        return;
+    h = &session->histograms[which];
+
+    if (us < 4)
+        bucket = (unsigned int)us;
+    else {
+        /* e is the position of the highest bit, the next two pick the
+           quarter of the power of two */
+        unsigned int e = 2;
+        while ((us >> (e + 1)) && (e < 63))
+            e++;
+        bucket = 4 * (e - 1) + (unsigned int)((us >> (e - 2)) & 3);
+        if (bucket >= LIBSSH2_HISTOGRAM_BUCKETS)
+            bucket = LIBSSH2_HISTOGRAM_BUCKETS - 1;
+    }
+    h->buckets[bucket]++;
+
+    if (!h->count || (us < h->min_us))
+        h->min_us = us;
+    if (us > h->max_us)
+        h->max_us = us;
+    h->count++;
+    h->sum_us += us;
+}
+
+/*
+ * libssh2_histogram_percentile
+ *
+ * The latency below which 'percentile' percent of the ones counted in a
+ * histogram are, as the upper end of the bucket that it falls in
+ */
+LIBSSH2_API libssh2_uint64_t
+libssh2_histogram_percentile(const LIBSSH2_HISTOGRAM *histogram,
+                             double percentile)
+{
+    libssh2_uint64_t want;
+    libssh2_uint64_t seen = 0;
+    unsigned int i;
+
+    if (!histogram || !histogram->count)
+        return 0;
+
+    if (percentile <= 0)
+        return histogram->min_us;
+    /* the rank of the latency wanted, rounded up */
+    want = (libssh2_uint64_t)(percentile * histogram->count / 100);
+    if ((double)want < percentile * histogram->count / 100)
+        want++;
+    if (want < 1)
+        want = 1;
+
+    for (i = 0; i < LIBSSH2_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= want) {
+            /* the next bucket starts right after this one */
+            unsigned int e = (i + 1) / 4 + 1;
+            libssh2_uint64_t end = (i + 1 < 4) ? i + 1 :
+                (libssh2_uint64_t)(4 + (i + 1) % 4) << (e - 2);
+            return (end - 1 < histogram->max_us) ? end - 1 :
+                histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
 void *_libssh2_calloc(LIBSSH2_SESSION* session, size_t size)
 {
     void *p = LIBSSH2_ALLOC(session, size);
@@ -654,3 +969,145 @@ void *_libssh2_calloc(LIBSSH2_SESSION* session, size_t size)
     }
     return p;
 }
+
+/* block size of slab class 'c': 64, 80, 96, 112, 128, 160, ... */
+#define slab_size(c) ((size_t)(4 + ((c) & 3)) << (4 + ((c) >> 2)))
+
+/* size class of a slab block, LIBSSH2_SLAB_CLASSES if it is too large */
+static int slab_class(size_t size)
+{
+    int c = 0;
+
+    /* whole octaves first, then the quarter steps within one */
+    while ((c + 4 < LIBSSH2_SLAB_CLASSES) && (slab_size(c + 3) < size))
+        c += 4;
+    while ((c < LIBSSH2_SLAB_CLASSES) && (slab_size(c) < size))
+        c++;
+    return c;
+}
+
+void *_libssh2_slab_alloc(LIBSSH2_SESSION *session, size_t size)
+{
+    struct _libssh2_slab *slab = &session->slab;
+    int c = slab_class(size);
+    void *ptr;
+
+    if (c == LIBSSH2_SLAB_CLASSES)
+        return LIBSSH2_ALLOC(session, size);
+
+    ptr = slab->free[c];
+    if (ptr) {
+        slab->free[c] = *(void **)ptr;
+        slab->bytes -= slab_size(c);
+        return ptr;
+    }
+    return LIBSSH2_ALLOC(session, slab_size(c));
+}
+
+void _libssh2_slab_free(LIBSSH2_SESSION *session, void *ptr, size_t size)
+{
+    struct _libssh2_slab *slab = &session->slab;
+    int c = slab_class(size);
+
+    if (!ptr)
+        return;
+    if ((c == LIBSSH2_SLAB_CLASSES) ||
+        (slab->bytes + (slab_size(c)) > LIBSSH2_SLAB_KEEP)) {
+        LIBSSH2_FREE(session, ptr);
+        return;
+    }
+    *(void **)ptr = slab->free[c];
+    slab->free[c] = ptr;
+    slab->bytes += slab_size(c);
+}
+
+void _libssh2_slab_clear(LIBSSH2_SESSION *session)
+{
+    struct _libssh2_slab *slab = &session->slab;
+    int c;
+
+    for (c = 0; c < LIBSSH2_SLAB_CLASSES; c++) {
+        while (slab->free[c]) {
+            void *ptr = slab->free[c];
+            slab->free[c] = *(void **)ptr;
+            LIBSSH2_FREE(session, ptr);
+        }
+    }
+    slab->bytes = 0;
+}
+
+/*
+ * cpu_probe
+ *
+ * The LIBSSH2_ACCEL_* bits of the instructions the running CPU has
+ */
+static int
+cpu_probe(void)
+{
+    int accel = 0;
+#if defined(LIBSSH2_CPUID_GNUC) || defined(LIBSSH2_CPUID_MSC)
+    unsigned int regs[4]; /* eax, ebx, ecx, edx */
+    unsigned int max;
+
+#ifdef LIBSSH2_CPUID_GNUC
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 1)
+        __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#else
+    __cpuid((int *)regs, 0);
+    max = regs[0];
+    if (max >= 1)
+        __cpuid((int *)regs, 1);
+#endif
+    if (max >= 1) {
+        if (regs[2] & (1 << 25))
+            accel |= LIBSSH2_ACCEL_AES;
+        if (regs[2] & (1 << 1))
+            accel |= LIBSSH2_ACCEL_CLMUL;
+    }
+    if (max >= 7) {
+#ifdef LIBSSH2_CPUID_GNUC
+        __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#else
+        __cpuidex((int *)regs, 7, 0);
+#endif
+        /* the SHA extensions do SHA-1 and SHA-256 */
+        if (regs[1] & (1 << 29))
+            accel |= LIBSSH2_ACCEL_SHA1 | LIBSSH2_ACCEL_SHA256;
+    }
+#elif defined(HAVE_SYS_AUXV_H) && defined(__linux__) && defined(__aarch64__)
+    /* the HWCAP_* bits of the arm64 kernel ABI */
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+    if (hwcap & (1 << 3))
+        accel |= LIBSSH2_ACCEL_AES;
+    if (hwcap & (1 << 4))
+        accel |= LIBSSH2_ACCEL_CLMUL;
+    if (hwcap & (1 << 5))
+        accel |= LIBSSH2_ACCEL_SHA1;
+    if (hwcap & (1 << 6))
+        accel |= LIBSSH2_ACCEL_SHA256;
+    if (hwcap & (1 << 21))
+        accel |= LIBSSH2_ACCEL_SHA512;
+#elif defined(__APPLE__) && defined(__aarch64__)
+    /* every Apple arm64 CPU has the ARMv8 crypto extensions */
+    accel = LIBSSH2_ACCEL_AES | LIBSSH2_ACCEL_CLMUL | LIBSSH2_ACCEL_SHA1 |
+        LIBSSH2_ACCEL_SHA256;
+#endif
+    return accel;
+}
+
+/*
+ * _libssh2_cpu_accel
+ *
+ * The LIBSSH2_ACCEL_* bits of the running CPU that the crypto backend
+ * makes use of. The CPU is only asked once.
+ */
+int _libssh2_cpu_accel(void)
+{
+    static int accel = -1;
+
+    if (accel < 0)
+        accel = cpu_probe() & LIBSSH2_ACCEL_BACKEND;
+    return accel;
+}
@@ -70,15 +70,62 @@ void *_libssh2_list_prev(struct list_node *node);
 /* remove this node from the list */
 void _libssh2_list_remove(struct list_node *entry);
 
+/* room for the base64 of 'n' bytes, the terminating zero included */
+#define LIBSSH2_BASE64_LEN(n) ((((n) + 2) / 3) * 4 + 1)
+
 size_t _libssh2_base64_encode(struct _LIBSSH2_SESSION *session,
                               const char *inp, size_t insize, char **outptr);
+size_t _libssh2_base64_encode_into(char *dest, const unsigned char *inp,
+                                   size_t insize);
+int _libssh2_base64_decode_into(unsigned char *dest, const char *src,
+                                size_t src_len);
 
 unsigned int _libssh2_ntohu32(const unsigned char *buf);
 libssh2_uint64_t _libssh2_ntohu64(const unsigned char *buf);
 void _libssh2_htonu32(unsigned char *buf, uint32_t val);
 void _libssh2_store_u32(unsigned char **buf, uint32_t value);
 void _libssh2_store_str(unsigned char **buf, const char *str, size_t len);
+int _libssh2_get_string(unsigned char **buf, const unsigned char *end,
+                        unsigned char **str, size_t *len);
 void *_libssh2_calloc(LIBSSH2_SESSION* session, size_t size);
+libssh2_uint64_t _libssh2_time_us(void);
+void _libssh2_stats_io(LIBSSH2_SESSION *session, int outbound, ssize_t rc);
+libssh2_uint64_t _libssh2_time_ns(void);
+int _libssh2_cpu_accel(void);
+void _libssh2_event_add(LIBSSH2_SESSION *session, unsigned int event,
+                        uint32_t channel, uint32_t request_id,
+                        unsigned int info, libssh2_uint64_t bytes);
+void _libssh2_event_flush(LIBSSH2_SESSION *session);
+void _libssh2_histogram_add(LIBSSH2_SESSION *session, int which,
+                            libssh2_uint64_t us);
+
+/* A per session cache of freed blocks for what comes and goes with every
+   packet: payload buffers, packet nodes and SFTP request chunks. Blocks are
+   rounded up to size classes of 64 bytes times a power of two in quarter
+   steps (64, 80, 96, 112, 128, 160, ...), so that a full 32 KB channel
+   packet takes a 40 KB block rather than 64 KB, and are kept on a list per
+   class when freed, up to LIBSSH2_SLAB_KEEP bytes in all, so
+   a session that has reached its steady state stops calling the
+   application's allocator.
+
+   A slab block is an ordinary LIBSSH2_ALLOC allocation and can always be
+   freed with LIBSSH2_FREE. Only code that knows the size it was asked for
+   returns it to the slab. */
+#define LIBSSH2_SLAB_CLASSES 49          /* 64 bytes .. 256 KB */
+#define LIBSSH2_SLAB_KEEP    (2 * 1024 * 1024)
+
+struct _libssh2_slab
+{
+    void *free[LIBSSH2_SLAB_CLASSES]; /* first word links to the next */
+    size_t bytes; /* kept on all the lists */
+};
+
+/* a block of at least 'size' bytes */
+void *_libssh2_slab_alloc(LIBSSH2_SESSION *session, size_t size);
+/* give back a block _libssh2_slab_alloc() returned for the same 'size' */
+void _libssh2_slab_free(LIBSSH2_SESSION *session, void *ptr, size_t size);
+/* free all cached blocks */
+void _libssh2_slab_clear(LIBSSH2_SESSION *session);
 
 #if defined(LIBSSH2_WIN32) && !defined(__MINGW32__) && !defined(__CYGWIN__)
 /* provide a private one */
@@ -44,10 +44,6 @@
 
 #include <string.h>
 
-#ifndef EVP_MAX_BLOCK_LENGTH
-#define EVP_MAX_BLOCK_LENGTH 32
-#endif
-
 int
 _libssh2_rsa_new(libssh2_rsa_ctx ** rsa,
                  const unsigned char *edata,
@@ -191,27 +187,86 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                       _libssh2_cipher_type(algo),
                       int encrypt, unsigned char *block, size_t blocksize)
 {
-    unsigned char buf[EVP_MAX_BLOCK_LENGTH];
     int ret;
     (void) algo;
     (void) encrypt;
 
+    /* EVP_Cipher() handles any number of whole blocks and allows the input
+       and output to overlap exactly, so the data is processed in place */
 #ifdef HAVE_OPAQUE_STRUCTS
-    ret = EVP_Cipher(*ctx, buf, block, blocksize);
+    ret = EVP_Cipher(*ctx, block, block, blocksize);
 #else
-    ret = EVP_Cipher(ctx, buf, block, blocksize);
+    ret = EVP_Cipher(ctx, block, block, blocksize);
+#endif
+    return ret == 1 ? 0 : 1;
+}
+
+int
+_libssh2_cipher_crypt_to(_libssh2_cipher_ctx * ctx,
+                         _libssh2_cipher_type(algo),
+                         int encrypt, const unsigned char *src,
+                         unsigned char *dst, size_t len)
+{
+    int ret;
+    (void) algo;
+    (void) encrypt;
+
+#ifdef HAVE_OPAQUE_STRUCTS
+    ret = EVP_Cipher(*ctx, dst, src, len);
+#else
+    ret = EVP_Cipher(ctx, dst, src, len);
 #endif
-    if (ret == 1) {
-        memcpy(block, buf, blocksize);
-    }
     return ret == 1 ? 0 : 1;
 }
 
-#if LIBSSH2_AES_CTR
+#if LIBSSH2_AES_GCM
+int
+_libssh2_cipher_crypt_gcm(_libssh2_cipher_ctx * ctx, int encrypt,
+                          const unsigned char *iv,
+                          const unsigned char *aad, size_t aad_len,
+                          unsigned char *data, size_t data_len,
+                          unsigned char *tag)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    EVP_CIPHER_CTX *h = *ctx;
+#else
+    EVP_CIPHER_CTX *h = ctx;
+#endif
+    unsigned char final[16];
+    int outl;
+
+    /* the key stays, only the nonce changes */
+    if (!EVP_CipherInit_ex(h, NULL, NULL, NULL, iv, -1))
+        return 1;
+
+    if (!encrypt &&
+        !EVP_CIPHER_CTX_ctrl(h, EVP_CTRL_GCM_SET_TAG, 16, tag))
+        return 1;
+
+    if (!EVP_CipherUpdate(h, NULL, &outl, aad, aad_len) ||
+        !EVP_CipherUpdate(h, data, &outl, data, data_len) ||
+        EVP_CipherFinal_ex(h, final, &outl) <= 0)
+        return 1;       /* for decryption this is the tag check failing */
+
+    if (encrypt &&
+        !EVP_CIPHER_CTX_ctrl(h, EVP_CTRL_GCM_GET_TAG, 16, tag))
+        return 1;
+
+    return 0;
+}
+#endif /* LIBSSH2_AES_GCM */
+
+#if LIBSSH2_AES_CTR && !defined(HAVE_EVP_AES_128_CTR)
+
+/* OpenSSL before 1.0.1 has no AES-CTR EVP cipher so we provide our own,
+   built on top of AES-ECB. */
 
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 
+/* number of counter blocks turned into key stream per EVP call */
+#define AES_CTR_BATCH 32
+
 typedef struct
 {
     AES_KEY       key;
@@ -284,11 +339,17 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
                   size_t inl) /* encrypt/decrypt data */
 {
     aes_ctr_ctx *c = EVP_CIPHER_CTX_get_app_data(ctx);
-    unsigned char b1[AES_BLOCK_SIZE];
-    size_t i = 0;
+    unsigned char counters[AES_BLOCK_SIZE * AES_CTR_BATCH];
+    unsigned char stream[AES_BLOCK_SIZE * AES_CTR_BATCH];
+    size_t blocks;
+    size_t len;
+    size_t b;
+    size_t i;
     int outlen = 0;
 
-    if (inl != 16) /* libssh2 only ever encrypt one block */
+    /* libssh2 passes whole packets, but always a multiple of the block
+       size */
+    if (inl % AES_BLOCK_SIZE)
         return 0;
 
     if (c == NULL) {
@@ -302,18 +363,36 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
   the ciphertext block C1.  The counter X is then incremented
 */
 
-    if (EVP_EncryptUpdate(c->aes_ctx, b1, &outlen, c->ctr, AES_BLOCK_SIZE) != 1) {
-        return 0;
-    }
-
-    for (i = 0; i < 16; i++)
-        *out++ = *in++ ^ b1[i];
-
-    i = 15;
-    while (c->ctr[i]++ == 0xFF) {
-        if (i == 0)
-            break;
-        i--;
+    while (inl) {
+        blocks = inl / AES_BLOCK_SIZE;
+        if (blocks > AES_CTR_BATCH)
+            blocks = AES_CTR_BATCH;
+        len = blocks * AES_BLOCK_SIZE;
+
+        /* lay out the successive counter values and encrypt them all with
+           a single ECB call */
+        for (b = 0; b < blocks; b++) {
+            memcpy(&counters[b * AES_BLOCK_SIZE], c->ctr, AES_BLOCK_SIZE);
+
+            i = AES_BLOCK_SIZE - 1;
+            while (c->ctr[i]++ == 0xFF) {
+                if (i == 0)
+                    break;
+                i--;
+            }
+        }
+
+        if (EVP_EncryptUpdate(c->aes_ctx, stream, &outlen, counters,
+                              (int)len) != 1) {
+            return 0;
+        }
+
+        for (i = 0; i < len; i++)
+            out[i] = in[i] ^ stream[i];
+
+        out += len;
+        in += len;
+        inl -= len;
     }
 
     return 1;
@@ -417,7 +496,7 @@ void _libssh2_init_aes_ctr(void)
 
 #else
 void _libssh2_init_aes_ctr(void) {}
-#endif /* LIBSSH2_AES_CTR */
+#endif /* LIBSSH2_AES_CTR && !HAVE_EVP_AES_128_CTR */
 
 /* TODO: Optionally call a passphrase callback specified by the
  * calling program
@@ -720,6 +799,50 @@ _libssh2_sha256(const unsigned char *message, unsigned long len,
     return 1; /* error */
 }
 
+int
+_libssh2_sha384_init(libssh2_sha384_ctx *ctx)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    *ctx = EVP_MD_CTX_new();
+
+    if (*ctx == NULL)
+        return 0;
+
+    if (EVP_DigestInit(*ctx, EVP_sha384()))
+        return 1;
+
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+
+    return 0;
+#else
+    EVP_MD_CTX_init(ctx);
+    return EVP_DigestInit(ctx, EVP_sha384());
+#endif
+}
+
+int
+_libssh2_sha512_init(libssh2_sha512_ctx *ctx)
+{
+#ifdef HAVE_OPAQUE_STRUCTS
+    *ctx = EVP_MD_CTX_new();
+
+    if (*ctx == NULL)
+        return 0;
+
+    if (EVP_DigestInit(*ctx, EVP_sha512()))
+        return 1;
+
+    EVP_MD_CTX_free(*ctx);
+    *ctx = NULL;
+
+    return 0;
+#else
+    EVP_MD_CTX_init(ctx);
+    return EVP_DigestInit(ctx, EVP_sha512());
+#endif
+}
+
 int
 _libssh2_md5_init(libssh2_md5_ctx *ctx)
 {
@@ -946,6 +1069,158 @@ gen_publickey_from_dsa_evp(LIBSSH2_SESSION *session,
 }
 #endif /* LIBSSH_DSA */
 
+#if LIBSSH2_ECDSA
+/* SSH names of the curves, in libssh2_curve_type order */
+static const char *const ecdsa_curve_names[] = {
+    "nistp256", "nistp384", "nistp521"
+};
+
+static int
+ecdsa_curve_type(const EC_KEY *ec, libssh2_curve_type *curve)
+{
+    switch(EC_GROUP_get_curve_name(EC_KEY_get0_group(ec))) {
+    case NID_X9_62_prime256v1:
+        *curve = LIBSSH2_EC_CURVE_NISTP256;
+        return 0;
+    case NID_secp384r1:
+        *curve = LIBSSH2_EC_CURVE_NISTP384;
+        return 0;
+    case NID_secp521r1:
+        *curve = LIBSSH2_EC_CURVE_NISTP521;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int
+gen_publickey_from_ec_evp(LIBSSH2_SESSION *session,
+                          unsigned char **method,
+                          size_t *method_len,
+                          unsigned char **pubkeydata,
+                          size_t *pubkeydata_len,
+                          EVP_PKEY *pk)
+{
+    EC_KEY*        ec;
+    libssh2_curve_type curve;
+    unsigned char* key = NULL;
+    unsigned char* method_buf = NULL;
+    unsigned char* p;
+    size_t         q_len, key_len;
+
+    _libssh2_debug(session,
+                   LIBSSH2_TRACE_AUTH,
+                   "Computing public key from EC private key envelop");
+
+    ec = EVP_PKEY_get1_EC_KEY(pk);
+    if (ec == NULL) {
+        goto __alloc_error;
+    }
+    if (ecdsa_curve_type(ec, &curve)) {
+        EC_KEY_free(ec);
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to extract public key "
+                              "from private key file: "
+                              "Unsupported EC curve");
+    }
+
+    q_len = EC_POINT_point2oct(EC_KEY_get0_group(ec),
+                               EC_KEY_get0_public_key(ec),
+                               POINT_CONVERSION_UNCOMPRESSED, NULL, 0, NULL);
+
+    /* Key form is "ecdsa-sha2-nistpN" + "nistpN" + Q. */
+    key_len = 4 + 19 + 4 + 8 + 4 + q_len;
+    method_buf = LIBSSH2_ALLOC(session, 19);
+    key = LIBSSH2_ALLOC(session, key_len);
+    if (method_buf == NULL || key == NULL) {
+        goto __alloc_error;
+    }
+    memcpy(method_buf, "ecdsa-sha2-", 11);
+    memcpy(method_buf + 11, ecdsa_curve_names[curve], 8);
+
+    p = key;
+    _libssh2_store_str(&p, (const char *)method_buf, 19);
+    _libssh2_store_str(&p, ecdsa_curve_names[curve], 8);
+    _libssh2_store_u32(&p, q_len);
+    EC_POINT_point2oct(EC_KEY_get0_group(ec), EC_KEY_get0_public_key(ec),
+                       POINT_CONVERSION_UNCOMPRESSED, p, q_len, NULL);
+    EC_KEY_free(ec);
+
+    *method         = method_buf;
+    *method_len     = 19;
+    *pubkeydata     = key;
+    *pubkeydata_len = key_len;
+    return 0;
+
+  __alloc_error:
+    if (ec != NULL) {
+        EC_KEY_free(ec);
+    }
+    if (method_buf != NULL) {
+        LIBSSH2_FREE(session, method_buf);
+    }
+    if (key != NULL) {
+        LIBSSH2_FREE(session, key);
+    }
+
+    return _libssh2_error(session,
+                          LIBSSH2_ERROR_ALLOC,
+                          "Unable to allocate memory for private key data");
+}
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+static int
+gen_publickey_from_ed25519_evp(LIBSSH2_SESSION *session,
+                               unsigned char **method,
+                               size_t *method_len,
+                               unsigned char **pubkeydata,
+                               size_t *pubkeydata_len,
+                               EVP_PKEY *pk)
+{
+    unsigned char* key;
+    unsigned char* method_buf;
+    unsigned char* p;
+    size_t         len = 32;
+
+    _libssh2_debug(session,
+                   LIBSSH2_TRACE_AUTH,
+                   "Computing public key from ED25519 private key envelop");
+
+    /* Key form is "ssh-ed25519" + 32 byte key. */
+    method_buf = LIBSSH2_ALLOC(session, 11);
+    key = LIBSSH2_ALLOC(session, 4 + 11 + 4 + 32);
+    if (method_buf == NULL || key == NULL) {
+        if (method_buf != NULL)
+            LIBSSH2_FREE(session, method_buf);
+        if (key != NULL)
+            LIBSSH2_FREE(session, key);
+        return _libssh2_error(session,
+                              LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for private key "
+                              "data");
+    }
+    memcpy(method_buf, "ssh-ed25519", 11);
+
+    p = key;
+    _libssh2_store_str(&p, "ssh-ed25519", 11);
+    _libssh2_store_u32(&p, 32);
+    if (EVP_PKEY_get_raw_public_key(pk, p, &len) != 1 || len != 32) {
+        LIBSSH2_FREE(session, method_buf);
+        LIBSSH2_FREE(session, key);
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to extract public key "
+                              "from private key file");
+    }
+
+    *method         = method_buf;
+    *method_len     = 11;
+    *pubkeydata     = key;
+    *pubkeydata_len = 4 + 11 + 4 + 32;
+    return 0;
+}
+#endif /* LIBSSH2_ED25519 */
+
 int
 _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
                           unsigned char **method,
@@ -1012,6 +1287,20 @@ _libssh2_pub_priv_keyfile(LIBSSH2_SESSION *session,
         break;
 #endif /* LIBSSH_DSA */
 
+#if LIBSSH2_ECDSA
+    case EVP_PKEY_EC :
+        st = gen_publickey_from_ec_evp(
+            session, method, method_len, pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+    case EVP_PKEY_ED25519 :
+        st = gen_publickey_from_ed25519_evp(
+            session, method, method_len, pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ED25519 */
+
     default :
         st = _libssh2_error(session,
                             LIBSSH2_ERROR_FILE,
@@ -1086,6 +1375,18 @@ _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
                                         pubkeydata, pubkeydata_len, pk);
         break;
 #endif /* LIBSSH_DSA */
+#if LIBSSH2_ECDSA
+    case EVP_PKEY_EC :
+        st = gen_publickey_from_ec_evp(session, method, method_len,
+                                       pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ECDSA */
+#if LIBSSH2_ED25519
+    case EVP_PKEY_ED25519 :
+        st = gen_publickey_from_ed25519_evp(session, method, method_len,
+                                            pubkeydata, pubkeydata_len, pk);
+        break;
+#endif /* LIBSSH2_ED25519 */
     default :
         st = _libssh2_error(session,
                             LIBSSH2_ERROR_FILE,
@@ -1099,4 +1400,519 @@ _libssh2_pub_priv_keyfilememory(LIBSSH2_SESSION *session,
     return st;
 }
 
+#if LIBSSH2_ECDH
+
+static int
+ecdh_curve_nid(libssh2_curve_type curve)
+{
+    switch(curve) {
+    case LIBSSH2_EC_CURVE_NISTP256:
+        return NID_X9_62_prime256v1;
+    case LIBSSH2_EC_CURVE_NISTP384:
+        return NID_secp384r1;
+    case LIBSSH2_EC_CURVE_NISTP521:
+        return NID_secp521r1;
+    default:
+        return NID_undef;
+    }
+}
+
+/*
+ * _libssh2_ecdh_keypair
+ *
+ * Generate an ephemeral key on the given curve. The public value is
+ * returned in its SSH wire form: the uncompressed point for the NIST
+ * curves, the 32 raw bytes for curve25519.
+ */
+int
+_libssh2_ecdh_keypair(LIBSSH2_SESSION *session, libssh2_curve_type curve,
+                      _libssh2_ec_key **key,
+                      unsigned char **pub, size_t *pub_len)
+{
+    EC_KEY *ec;
+    const EC_GROUP *group;
+    const EC_POINT *point;
+    size_t len;
+
+    *key = NULL;
+    *pub = NULL;
+
+#if LIBSSH2_CURVE25519
+    if(curve == LIBSSH2_EC_CURVE_25519) {
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+
+        if(!pctx)
+            return -1;
+        if(EVP_PKEY_keygen_init(pctx) != 1 ||
+           EVP_PKEY_keygen(pctx, key) != 1) {
+            EVP_PKEY_CTX_free(pctx);
+            return -1;
+        }
+        EVP_PKEY_CTX_free(pctx);
+
+        len = 32;
+        *pub = LIBSSH2_ALLOC(session, len);
+        if(!*pub ||
+           EVP_PKEY_get_raw_public_key(*key, *pub, &len) != 1) {
+            goto fail;
+        }
+        *pub_len = len;
+        return 0;
+    }
+#endif
+
+    if(ecdh_curve_nid(curve) == NID_undef)
+        return -1;
+
+    ec = EC_KEY_new_by_curve_name(ecdh_curve_nid(curve));
+    if(!ec)
+        return -1;
+    if(EC_KEY_generate_key(ec) != 1) {
+        EC_KEY_free(ec);
+        return -1;
+    }
+
+    group = EC_KEY_get0_group(ec);
+    point = EC_KEY_get0_public_key(ec);
+    len = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+                             NULL, 0, NULL);
+    *pub = LIBSSH2_ALLOC(session, len);
+    if(!*pub) {
+        EC_KEY_free(ec);
+        return -1;
+    }
+    EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+                       *pub, len, NULL);
+    *pub_len = len;
+
+    *key = EVP_PKEY_new();
+    if(!*key || EVP_PKEY_assign_EC_KEY(*key, ec) != 1) {
+        EC_KEY_free(ec);
+        goto fail;
+    }
+    return 0;
+
+  fail:
+    if(*pub) {
+        LIBSSH2_FREE(session, *pub);
+        *pub = NULL;
+    }
+    if(*key) {
+        EVP_PKEY_free(*key);
+        *key = NULL;
+    }
+    return -1;
+}
+
+/*
+ * ecdh_peer
+ *
+ * Turn the peer's public value into a key of the same type as ours. A
+ * point that is not on the curve is refused here.
+ */
+static EVP_PKEY *
+ecdh_peer(EVP_PKEY *key, const unsigned char *peer, size_t peer_len)
+{
+    EVP_PKEY *peerkey;
+    EC_KEY *ours, *ec;
+    EC_POINT *point;
+
+#if LIBSSH2_CURVE25519
+    if(EVP_PKEY_id(key) == EVP_PKEY_X25519)
+        return EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL,
+                                           peer, peer_len);
+#endif
+
+    ours = EVP_PKEY_get1_EC_KEY(key);
+    if(!ours)
+        return NULL;
+    ec = EC_KEY_new_by_curve_name(EC_GROUP_get_curve_name(
+                                      EC_KEY_get0_group(ours)));
+    EC_KEY_free(ours);
+    if(!ec)
+        return NULL;
+
+    point = EC_POINT_new(EC_KEY_get0_group(ec));
+    if(!point ||
+       EC_POINT_oct2point(EC_KEY_get0_group(ec), point, peer, peer_len,
+                          NULL) != 1 ||
+       EC_KEY_set_public_key(ec, point) != 1 ||
+       EC_KEY_check_key(ec) != 1) {
+        if(point)
+            EC_POINT_free(point);
+        EC_KEY_free(ec);
+        return NULL;
+    }
+    EC_POINT_free(point);
+
+    peerkey = EVP_PKEY_new();
+    if(!peerkey || EVP_PKEY_assign_EC_KEY(peerkey, ec) != 1) {
+        if(peerkey)
+            EVP_PKEY_free(peerkey);
+        EC_KEY_free(ec);
+        return NULL;
+    }
+    return peerkey;
+}
+
+/*
+ * _libssh2_ecdh_secret
+ *
+ * Derive the shared secret from our key and the peer's public value. The
+ * secret is returned as the big-endian bytes that get mpint encoded into K.
+ */
+int
+_libssh2_ecdh_secret(LIBSSH2_SESSION *session, _libssh2_ec_key *key,
+                     const unsigned char *peer, size_t peer_len,
+                     unsigned char **secret, size_t *secret_len)
+{
+    EVP_PKEY *peerkey;
+    EVP_PKEY_CTX *ctx;
+    size_t len;
+    int rc = -1;
+
+    *secret = NULL;
+
+    peerkey = ecdh_peer(key, peer, peer_len);
+    if(!peerkey)
+        return -1;
+
+    ctx = EVP_PKEY_CTX_new(key, NULL);
+    if(ctx &&
+       EVP_PKEY_derive_init(ctx) == 1 &&
+       EVP_PKEY_derive_set_peer(ctx, peerkey) == 1 &&
+       EVP_PKEY_derive(ctx, NULL, &len) == 1) {
+        *secret = LIBSSH2_ALLOC(session, len);
+        if(*secret && EVP_PKEY_derive(ctx, *secret, &len) == 1) {
+            *secret_len = len;
+            rc = 0;
+        }
+        else if(*secret) {
+            LIBSSH2_FREE(session, *secret);
+            *secret = NULL;
+        }
+    }
+
+    if(ctx)
+        EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peerkey);
+    return rc;
+}
+
+#endif /* LIBSSH2_ECDH */
+
+#if LIBSSH2_ECDSA
+
+int
+_libssh2_ecdsa_new_public(libssh2_ecdsa_ctx ** ecdsa,
+                          LIBSSH2_SESSION * session,
+                          libssh2_curve_type curve,
+                          const unsigned char *q, size_t q_len)
+{
+    return _libssh2_ecdsa_new_private_raw(ecdsa, session, curve, q, q_len,
+                                          NULL, 0);
+}
+
+int
+_libssh2_ecdsa_new_private_raw(libssh2_ecdsa_ctx ** ecdsa,
+                               LIBSSH2_SESSION * session,
+                               libssh2_curve_type curve,
+                               const unsigned char *q, size_t q_len,
+                               const unsigned char *d, size_t d_len)
+{
+    EC_KEY *ec;
+    EC_POINT *point;
+    BIGNUM *bn = NULL;
+    int ok;
+    (void) session;
+
+    *ecdsa = NULL;
+    if(ecdh_curve_nid(curve) == NID_undef)
+        return -1;
+
+    ec = EC_KEY_new_by_curve_name(ecdh_curve_nid(curve));
+    if(!ec)
+        return -1;
+
+    point = EC_POINT_new(EC_KEY_get0_group(ec));
+    ok = point &&
+        EC_POINT_oct2point(EC_KEY_get0_group(ec), point, q, q_len,
+                           NULL) == 1 &&
+        EC_KEY_set_public_key(ec, point) == 1;
+    if(ok && d) {
+        bn = BN_bin2bn(d, d_len, NULL);
+        ok = bn && EC_KEY_set_private_key(ec, bn) == 1;
+    }
+    /* refuses points off the curve, and private keys not matching q */
+    ok = ok && EC_KEY_check_key(ec) == 1;
+
+    if(bn)
+        BN_clear_free(bn);
+    if(point)
+        EC_POINT_free(point);
+    if(!ok) {
+        EC_KEY_free(ec);
+        return -1;
+    }
+    *ecdsa = ec;
+    return 0;
+}
+
+int
+_libssh2_ecdsa_new_private_frommemory(libssh2_ecdsa_ctx ** ecdsa,
+                                      LIBSSH2_SESSION * session,
+                                      const char *filedata,
+                                      size_t filedata_len,
+                                      unsigned const char *passphrase)
+{
+    pem_read_bio_func read_ec =
+        (pem_read_bio_func) &PEM_read_bio_ECPrivateKey;
+    (void) session;
+
+    _libssh2_init_if_needed();
+
+    return read_private_key_from_memory((void **) ecdsa, read_ec,
+                                        filedata, filedata_len, passphrase);
+}
+
+int
+_libssh2_ecdsa_new_private(libssh2_ecdsa_ctx ** ecdsa,
+                           LIBSSH2_SESSION * session,
+                           const char *filename,
+                           unsigned const char *passphrase)
+{
+    pem_read_bio_func read_ec =
+        (pem_read_bio_func) &PEM_read_bio_ECPrivateKey;
+    (void) session;
+
+    _libssh2_init_if_needed();
+
+    return read_private_key_from_file((void **) ecdsa, read_ec,
+                                      filename, passphrase);
+}
+
+int
+_libssh2_ecdsa_curve_type(libssh2_ecdsa_ctx * ecdsa,
+                          libssh2_curve_type *curve)
+{
+    return ecdsa_curve_type(ecdsa, curve);
+}
+
+int
+_libssh2_ecdsa_verify(libssh2_ecdsa_ctx * ecdsa,
+                      const unsigned char *r, size_t r_len,
+                      const unsigned char *s, size_t s_len,
+                      const unsigned char *hash, size_t hash_len)
+{
+    ECDSA_SIG *sig;
+    BIGNUM *br, *bs;
+    int ret;
+
+    sig = ECDSA_SIG_new();
+    br = BN_bin2bn(r, r_len, NULL);
+    bs = BN_bin2bn(s, s_len, NULL);
+    if(!sig || !br || !bs) {
+        if(sig)
+            ECDSA_SIG_free(sig);
+        if(br)
+            BN_free(br);
+        if(bs)
+            BN_free(bs);
+        return -1;
+    }
+#ifdef HAVE_OPAQUE_STRUCTS
+    ECDSA_SIG_set0(sig, br, bs);
+#else
+    BN_free(sig->r);
+    BN_free(sig->s);
+    sig->r = br;
+    sig->s = bs;
+#endif
+
+    ret = ECDSA_do_verify(hash, hash_len, sig, ecdsa);
+    ECDSA_SIG_free(sig);
+    return (ret == 1) ? 0 : -1;
+}
+
+static unsigned char *
+ecdsa_bn(LIBSSH2_SESSION * session, const BIGNUM *bn, size_t *len)
+{
+    unsigned char *buf;
+
+    *len = BN_num_bytes(bn);
+    buf = LIBSSH2_ALLOC(session, *len ? *len : 1);
+    if(buf)
+        BN_bn2bin(bn, buf);
+    return buf;
+}
+
+int
+_libssh2_ecdsa_sign(LIBSSH2_SESSION * session,
+                    libssh2_ecdsa_ctx * ecdsa,
+                    const unsigned char *hash, size_t hash_len,
+                    unsigned char **r, size_t *r_len,
+                    unsigned char **s, size_t *s_len)
+{
+    ECDSA_SIG *sig;
+    const BIGNUM *br, *bs;
+
+    sig = ECDSA_do_sign(hash, hash_len, ecdsa);
+    if(!sig)
+        return -1;
+#ifdef HAVE_OPAQUE_STRUCTS
+    ECDSA_SIG_get0(sig, &br, &bs);
+#else
+    br = sig->r;
+    bs = sig->s;
+#endif
+
+    *r = ecdsa_bn(session, br, r_len);
+    *s = ecdsa_bn(session, bs, s_len);
+    ECDSA_SIG_free(sig);
+    if(!*r || !*s) {
+        if(*r)
+            LIBSSH2_FREE(session, *r);
+        if(*s)
+            LIBSSH2_FREE(session, *s);
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* LIBSSH2_ECDSA */
+
+#if LIBSSH2_ED25519
+
+int
+_libssh2_ed25519_new_public(libssh2_ed25519_ctx ** ed25519,
+                            LIBSSH2_SESSION * session,
+                            const unsigned char *pub, size_t pub_len)
+{
+    (void) session;
+
+    *ed25519 = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL,
+                                           pub, pub_len);
+    return *ed25519 ? 0 : -1;
+}
+
+int
+_libssh2_ed25519_new_private_raw(libssh2_ed25519_ctx ** ed25519,
+                                 LIBSSH2_SESSION * session,
+                                 const unsigned char *seed,
+                                 const unsigned char *pub)
+{
+    unsigned char derived[32];
+    size_t len = sizeof(derived);
+    (void) session;
+
+    *ed25519 = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL,
+                                            seed, 32);
+    if(!*ed25519)
+        return -1;
+
+    /* the stored public half must belong to the seed */
+    if(EVP_PKEY_get_raw_public_key(*ed25519, derived, &len) != 1 ||
+       len != 32 || memcmp(derived, pub, 32)) {
+        EVP_PKEY_free(*ed25519);
+        *ed25519 = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ed25519_check(libssh2_ed25519_ctx ** ed25519)
+{
+    if(*ed25519 && EVP_PKEY_id(*ed25519) != EVP_PKEY_ED25519) {
+        EVP_PKEY_free(*ed25519);
+        *ed25519 = NULL;
+    }
+    return *ed25519 ? 0 : -1;
+}
+
+int
+_libssh2_ed25519_new_private_frommemory(libssh2_ed25519_ctx ** ed25519,
+                                        LIBSSH2_SESSION * session,
+                                        const char *filedata,
+                                        size_t filedata_len,
+                                        unsigned const char *passphrase)
+{
+    pem_read_bio_func read_pkey =
+        (pem_read_bio_func) &PEM_read_bio_PrivateKey;
+    (void) session;
+
+    _libssh2_init_if_needed();
+
+    read_private_key_from_memory((void **) ed25519, read_pkey,
+                                 filedata, filedata_len, passphrase);
+    return ed25519_check(ed25519);
+}
+
+int
+_libssh2_ed25519_new_private(libssh2_ed25519_ctx ** ed25519,
+                             LIBSSH2_SESSION * session,
+                             const char *filename,
+                             unsigned const char *passphrase)
+{
+    pem_read_bio_func read_pkey =
+        (pem_read_bio_func) &PEM_read_bio_PrivateKey;
+    (void) session;
+
+    _libssh2_init_if_needed();
+
+    read_private_key_from_file((void **) ed25519, read_pkey,
+                               filename, passphrase);
+    return ed25519_check(ed25519);
+}
+
+int
+_libssh2_ed25519_verify(libssh2_ed25519_ctx * ed25519,
+                        const unsigned char *sig, size_t sig_len,
+                        const unsigned char *m, size_t m_len)
+{
+    EVP_MD_CTX *ctx;
+    int ret = -1;
+
+    ctx = EVP_MD_CTX_new();
+    if(!ctx)
+        return -1;
+    if(EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, ed25519) == 1 &&
+       EVP_DigestVerify(ctx, sig, sig_len, m, m_len) == 1)
+        ret = 0;
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+int
+_libssh2_ed25519_sign(LIBSSH2_SESSION * session,
+                      libssh2_ed25519_ctx * ed25519,
+                      const unsigned char *m, size_t m_len,
+                      unsigned char **sig, size_t *sig_len)
+{
+    EVP_MD_CTX *ctx;
+    size_t len = 64;
+    int ret = -1;
+
+    *sig = LIBSSH2_ALLOC(session, len);
+    if(!*sig)
+        return -1;
+
+    ctx = EVP_MD_CTX_new();
+    if(ctx &&
+       EVP_DigestSignInit(ctx, NULL, NULL, NULL, ed25519) == 1 &&
+       EVP_DigestSign(ctx, *sig, &len, m, m_len) == 1) {
+        *sig_len = len;
+        ret = 0;
+    }
+    if(ctx)
+        EVP_MD_CTX_free(ctx);
+    if(ret) {
+        LIBSSH2_FREE(session, *sig);
+        *sig = NULL;
+    }
+    return ret;
+}
+
+#endif /* LIBSSH2_ED25519 */
+
 #endif /* LIBSSH2_OPENSSL */
@@ -52,6 +52,9 @@
 #include <openssl/bn.h>
 #include <openssl/pem.h>
 #include <openssl/rand.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#endif
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && \
     !defined(LIBRESSL_VERSION_NUMBER)
@@ -93,6 +96,65 @@
 # define LIBSSH2_AES 0
 #endif
 
+/* EVP_aes_*_ctr() appeared in OpenSSL 1.0.1. Use them directly even when
+   the build system did not probe for them, the home-made EVP wrapper in
+   openssl.c is only a fallback for older versions. */
+#if LIBSSH2_AES_CTR && !defined(HAVE_EVP_AES_128_CTR) && \
+    OPENSSL_VERSION_NUMBER >= 0x10001000L
+# define HAVE_EVP_AES_128_CTR 1
+#endif
+
+#ifdef HAVE_EVP_AES_128_CTR
+# define LIBSSH2_AES_CTR_IMPL "OpenSSL EVP_aes_*_ctr"
+#else
+# define LIBSSH2_AES_CTR_IMPL "libssh2 AES-ECB counter wrapper"
+#endif
+
+#if LIBSSH2_AES && OPENSSL_VERSION_NUMBER >= 0x10001000L
+# define LIBSSH2_AES_GCM 1
+#else
+# define LIBSSH2_AES_GCM 0
+#endif
+
+/* OpenSSL has no raw ChaCha20/Poly1305 API matching the
+   chacha20-poly1305@openssh.com construction in the versions supported
+   here */
+#define LIBSSH2_CHACHA20_POLY1305 0
+
+/* libcrypto picks AES-NI, PCLMULQDQ, the SHA extensions and their ARMv8
+   counterparts at run time, the ARMv8.2 SHA512 ones since 1.1.1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+# define LIBSSH2_ACCEL_BACKEND (LIBSSH2_ACCEL_AES | LIBSSH2_ACCEL_CLMUL | \
+                                LIBSSH2_ACCEL_SHA1 | LIBSSH2_ACCEL_SHA256 | \
+                                LIBSSH2_ACCEL_SHA512)
+#else
+# define LIBSSH2_ACCEL_BACKEND (LIBSSH2_ACCEL_AES | LIBSSH2_ACCEL_CLMUL | \
+                                LIBSSH2_ACCEL_SHA1 | LIBSSH2_ACCEL_SHA256)
+#endif
+
+/* ECDH over the NIST curves goes through EC_KEY and EVP_PKEY_derive(),
+   X25519 needs the raw key functions added in OpenSSL 1.1.1 */
+#ifdef OPENSSL_NO_EC
+# define LIBSSH2_ECDH 0
+#else
+# define LIBSSH2_ECDH 1
+#endif
+#if LIBSSH2_ECDH && OPENSSL_VERSION_NUMBER >= 0x10101000L
+# define LIBSSH2_CURVE25519 1
+#else
+# define LIBSSH2_CURVE25519 0
+#endif
+
+/* ECDSA keys are EC_KEYs, Ed25519 needs the EVP_PKEY raw key and one-shot
+   digest sign functions of OpenSSL 1.1.1 */
+#define LIBSSH2_ECDSA LIBSSH2_ECDH
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && \
+    !defined(LIBRESSL_VERSION_NUMBER)
+# define LIBSSH2_ED25519 1
+#else
+# define LIBSSH2_ED25519 0
+#endif
+
 #ifdef OPENSSL_NO_BF
 # define LIBSSH2_BLOWFISH 0
 #else
@@ -167,6 +229,32 @@ int _libssh2_sha256(const unsigned char *message, unsigned long len,
                   unsigned char *out);
 #define libssh2_sha256(x,y,z) _libssh2_sha256(x,y,z)
 
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha384_ctx EVP_MD_CTX *
+#else
+#define libssh2_sha384_ctx EVP_MD_CTX
+#endif
+
+/* returns 0 in case of failure */
+int _libssh2_sha384_init(libssh2_sha384_ctx *ctx);
+#define libssh2_sha384_init(x) _libssh2_sha384_init(x)
+#define libssh2_sha384_update(ctx, data, len) \
+  libssh2_sha256_update(ctx, data, len)
+#define libssh2_sha384_final(ctx, out) libssh2_sha256_final(ctx, out)
+
+#ifdef HAVE_OPAQUE_STRUCTS
+#define libssh2_sha512_ctx EVP_MD_CTX *
+#else
+#define libssh2_sha512_ctx EVP_MD_CTX
+#endif
+
+/* returns 0 in case of failure */
+int _libssh2_sha512_init(libssh2_sha512_ctx *ctx);
+#define libssh2_sha512_init(x) _libssh2_sha512_init(x)
+#define libssh2_sha512_update(ctx, data, len) \
+  libssh2_sha256_update(ctx, data, len)
+#define libssh2_sha512_final(ctx, out) libssh2_sha256_final(ctx, out)
+
 #ifdef HAVE_OPAQUE_STRUCTS
 #define libssh2_md5_ctx EVP_MD_CTX *
 #else
@@ -204,6 +292,8 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define libssh2_hmac_update(ctx, data, datalen) \
   HMAC_Update(ctx, data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(ctx, data, NULL)
+#define libssh2_hmac_reset(ctx) \
+  (HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) ? 0 : -1)
 #define libssh2_hmac_cleanup(ctx) HMAC_CTX_free(*(ctx))
 #else
 #define libssh2_hmac_ctx HMAC_CTX
@@ -223,6 +313,8 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define libssh2_hmac_update(ctx, data, datalen) \
   HMAC_Update(&(ctx), data, datalen)
 #define libssh2_hmac_final(ctx, data) HMAC_Final(&(ctx), data, NULL)
+#define libssh2_hmac_reset(ctx) \
+  (HMAC_Init_ex(&(ctx), NULL, 0, NULL, NULL) ? 0 : -1)
 #define libssh2_hmac_cleanup(ctx) HMAC_cleanup(ctx)
 #endif
 
@@ -252,6 +344,10 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define _libssh2_cipher_aes256 EVP_aes_256_cbc
 #define _libssh2_cipher_aes192 EVP_aes_192_cbc
 #define _libssh2_cipher_aes128 EVP_aes_128_cbc
+#if LIBSSH2_AES_GCM
+#define _libssh2_cipher_aes128gcm EVP_aes_128_gcm
+#define _libssh2_cipher_aes256gcm EVP_aes_256_gcm
+#endif
 #ifdef HAVE_EVP_AES_128_CTR
 #define _libssh2_cipher_aes128ctr EVP_aes_128_ctr
 #define _libssh2_cipher_aes192ctr EVP_aes_192_ctr
@@ -272,6 +368,21 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define _libssh2_cipher_dtor(ctx) EVP_CIPHER_CTX_cleanup(ctx)
 #endif
 
+#if LIBSSH2_ECDH
+#define _libssh2_ec_key EVP_PKEY
+#define _libssh2_ecdh_free(session, key) EVP_PKEY_free(key)
+#endif
+
+#if LIBSSH2_ECDSA
+#define libssh2_ecdsa_ctx EC_KEY
+#define _libssh2_ecdsa_free(ecdsactx) EC_KEY_free(ecdsactx)
+#endif
+
+#if LIBSSH2_ED25519
+#define libssh2_ed25519_ctx EVP_PKEY
+#define _libssh2_ed25519_free(ed25519ctx) EVP_PKEY_free(ed25519ctx)
+#endif
+
 #define _libssh2_bn BIGNUM
 #define _libssh2_bn_ctx BN_CTX
 #define _libssh2_bn_ctx_new() BN_CTX_new()
@@ -287,7 +398,9 @@ int _libssh2_md5_init(libssh2_md5_ctx *ctx);
 #define _libssh2_bn_bits(bn) BN_num_bits(bn)
 #define _libssh2_bn_free(bn) BN_clear_free(bn)
 
+#ifndef HAVE_EVP_AES_128_CTR
 const EVP_CIPHER *_libssh2_EVP_aes_128_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_192_ctr(void);
 const EVP_CIPHER *_libssh2_EVP_aes_256_ctr(void);
+#endif
 
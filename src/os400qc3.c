@@ -1324,6 +1324,33 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx *ctx,
     return errcode.Bytes_Available? -1: 0;
 }
 
+int
+_libssh2_cipher_crypt_to(_libssh2_cipher_ctx *ctx,
+                         _libssh2_cipher_type(algo),
+                         int encrypt, const unsigned char *src,
+                         unsigned char *dst, size_t len)
+{
+    Qus_EC_t errcode;
+    int outlen;
+    int blksize = len;
+
+    (void) algo;
+
+    set_EC_length(errcode, sizeof errcode);
+    if (encrypt)
+        Qc3EncryptData((char *) src, &blksize, Qc3_Data,
+                       ctx->hash.Alg_Context_Token, Qc3_Alg_Token,
+                       ctx->key.Key_Context_Token, Qc3_Key_Token, anycsp, NULL,
+                       (char *) dst, &blksize, &outlen, (char *) &errcode);
+    else
+        Qc3DecryptData((char *) src, &blksize,
+                       ctx->hash.Alg_Context_Token, Qc3_Alg_Token,
+                       ctx->key.Key_Context_Token, Qc3_Key_Token, anycsp, NULL,
+                       (char *) dst, &blksize, &outlen, (char *) &errcode);
+
+    return errcode.Bytes_Available? -1: 0;
+}
+
 
 /*******************************************************************
  *
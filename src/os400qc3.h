@@ -169,6 +169,9 @@
 
 #define LIBSSH2_AES             1
 #define LIBSSH2_AES_CTR         1
+#define LIBSSH2_AES_CTR_IMPL    "OS/400 Qc3 CTR mode"
+#define LIBSSH2_AES_GCM         0
+#define LIBSSH2_CHACHA20_POLY1305 0
 #define LIBSSH2_BLOWFISH        0
 #define LIBSSH2_RC4             1
 #define LIBSSH2_CAST            0
@@ -267,6 +270,7 @@ typedef struct {        /* Algorithm description. */
                                                              data, datalen)
 #define libssh2_hmac_final(ctx, data)                                       \
                                 libssh2_os400qc3_hmac_final(&(ctx), data)
+#define libssh2_hmac_reset(ctx)         0   /* final leaves it keyed */
 #define libssh2_hmac_cleanup(ctx)                                           \
                                 _libssh2_os400qc3_crypto_dtor(ctx)
 
@@ -274,7 +278,7 @@ typedef struct {        /* Algorithm description. */
 #define _libssh2_bn_ctx         int                 /* Not used. */
 
 #define _libssh2_bn_ctx_new()           0
-#define _libssh2_bn_ctx_free(bnctx)     ((void) 0)
+#define _libssh2_bn_ctx_free(bnctx)     ((void) (bnctx))
 
 #define _libssh2_bn_init_from_bin() _libssh2_bn_init()
 #define _libssh2_bn_mod_exp(r, a, p, m, ctx)                                \
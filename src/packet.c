@@ -64,6 +64,7 @@
 #include "transport.h"
 #include "channel.h"
 #include "packet.h"
+#include "session.h"
 
 /*
  * libssh2_packet_queue_listener
@@ -81,7 +82,7 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
     /* 17 = packet_type(1) + channel(4) + reason(4) + descr(4) + lang(4) */
     unsigned long packet_len = 17 + (sizeof(FwdNotReq) - 1);
     unsigned char *p;
-    LIBSSH2_LISTENER *listn = _libssh2_list_first(&session->listeners);
+    LIBSSH2_LISTENER *listn;
     char failure_code = SSH_OPEN_ADMINISTRATIVELY_PROHIBITED;
     int rc;
 
@@ -119,9 +120,13 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
     }
 
     if (listen_state->state != libssh2_NB_state_sent) {
+        /* only the listeners of one hash bucket are compared */
+        listn = _libssh2_listener_first(session, listen_state->host,
+                                        listen_state->host_len,
+                                        (int) listen_state->port);
         while (listn) {
             if ((listn->port == (int) listen_state->port) &&
-                (strlen(listn->host) == listen_state->host_len) &&
+                (listn->host_len == listen_state->host_len) &&
                 (memcmp (listn->host, listen_state->host,
                          listen_state->host_len) == 0)) {
                 /* This is our listener */
@@ -215,11 +220,31 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                                               "open confirmation");
                     }
 
-                    /* Link the channel into the end of the queue list */
+                    /* Link the channel into the end of the queue list, or
+                       with an accept callback, hand it over right away */
+                    if (listen_state->channel && listn->accept_cb) {
+                        _libssh2_list_add(&session->channels,
+                                          &listen_state->channel->node);
+                        _libssh2_channel_hash_add(session,
+                                                  listen_state->channel);
+                        _libssh2_channel_window_granted(
+                            listen_state->channel,
+                            (long)listen_state->channel->remote.window_size);
+                        listen_state->state = libssh2_NB_state_idle;
+                        LIBSSH2_LISTENER_ACCEPT(listn, listen_state->channel);
+                        return 0;
+                    }
                     if (listen_state->channel) {
                         _libssh2_list_add(&listn->queue,
                                           &listen_state->channel->node);
+                        _libssh2_channel_hash_add(session,
+                                                  listen_state->channel);
+                        _libssh2_channel_window_granted(
+                            listen_state->channel,
+                            (long)listen_state->channel->remote.window_size);
                         listn->queue_size++;
+                        if (listn->poll_entry)
+                            _libssh2_pollset_mark(listn->poll_entry);
                     }
 
                     listen_state->state = libssh2_NB_state_idle;
@@ -364,6 +389,9 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
 
             /* Link the channel into the session */
             _libssh2_list_add(&session->channels, &channel->node);
+            _libssh2_channel_hash_add(session, channel);
+            _libssh2_channel_window_granted(channel,
+                                            (long)channel->remote.window_size);
 
             /*
              * Pass control to the callback, they may turn right around and
@@ -408,12 +436,13 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
  * The input pointer 'data' is pointing to allocated data that this function
  * is asked to deal with so on failure OR success, it must be freed fine.
  * The only exception is when the return code is LIBSSH2_ERROR_EAGAIN.
+ * 'datasize' is what it was asked for from the slab.
  *
  * This function will always be called with 'datalen' greater than zero.
  */
 int
 _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
-                    size_t datalen, int macstate)
+                    size_t datalen, size_t datasize, int macstate)
 {
     int rc = 0;
     char *message=NULL;
@@ -436,7 +465,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             /* Bad MAC input, but no callback set or non-zero return from the
                callback */
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             return _libssh2_error(session, LIBSSH2_ERROR_INVALID_MAC,
                                   "Invalid MAC received");
         }
@@ -452,6 +481,8 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
         goto libssh2_packet_add_jump_point4;
     case libssh2_NB_state_jump5:
         goto libssh2_packet_add_jump_point5;
+    case libssh2_NB_state_jump6:
+        goto libssh2_packet_add_jump_point6;
     default: /* nothing to do */
         break;
     }
@@ -500,7 +531,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                message, language);
             }
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->socket_state = LIBSSH2_SOCKET_DISCONNECTED;
             session->packAdd_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
@@ -518,7 +549,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             } else if (session->ssh_msg_ignore) {
                 LIBSSH2_IGNORE(session, "", 0);
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -557,7 +588,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
              */
             _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                            "Debug Packet: %s", message);
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -592,7 +623,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -627,7 +658,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             if (!channelp) {
                 _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_UNKNOWN,
                                "Packet received for unknown channel");
-                LIBSSH2_FREE(session, data);
+                _libssh2_slab_free(session, data, datasize);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -649,7 +680,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                  LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE) &&
                 (msg == SSH_MSG_CHANNEL_EXTENDED_DATA)) {
                 /* Pretend we didn't receive this */
-                LIBSSH2_FREE(session, data);
+                _libssh2_slab_free(session, data, datasize);
 
                 _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                "Ignoring extended data and refunding %d bytes",
@@ -660,6 +691,8 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         channelp->read_avail + data_head;
 
                 channelp->remote.window_size -= datalen - data_head;
+                _libssh2_channel_window_granted(channelp,
+                                                -(long)(datalen - data_head));
                 _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                "shrinking window size by %lu bytes to %lu, read_avail %lu",
                                datalen - data_head,
@@ -668,13 +701,14 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
                 session->packAdd_channelp = channelp;
 
-                /* Adjust the window based on the block we just freed */
+                /* Adjust the window based on the block we just freed, small
+                   refunds are queued up for a later adjustment */
               libssh2_packet_add_jump_point1:
                 session->packAdd_state = libssh2_NB_state_jump1;
                 rc = _libssh2_channel_receive_window_adjust(session->
                                                             packAdd_channelp,
                                                             datalen - 13,
-                                                            1, NULL);
+                                                            0, NULL);
                 if (rc == LIBSSH2_ERROR_EAGAIN)
                     return rc;
 
@@ -706,13 +740,77 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                LIBSSH2_ERROR_CHANNEL_WINDOW_EXCEEDED,
                                "The current receive window is full,"
                                " data ignored");
-                LIBSSH2_FREE(session, data);
+                _libssh2_slab_free(session, data, datasize);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
             /* Reset EOF status */
             channelp->remote.eof = 0;
 
+            if (channelp->data_cb) {
+                /* hand the data straight from the payload to the
+                   application, unless earlier data still waits in the
+                   queue this would go to */
+                int ext = (msg == SSH_MSG_CHANNEL_EXTENDED_DATA) &&
+                    (channelp->remote.extended_data_ignore_mode !=
+                     LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE);
+
+                if (!_libssh2_list_first(ext ? &channelp->ext_queue :
+                                         &channelp->data_queue)) {
+                    size_t len = datalen - data_head;
+                    size_t used;
+
+                    if (channelp->read_avail + len >
+                        channelp->remote.window_size)
+                        len = channelp->remote.window_size -
+                            channelp->read_avail;
+
+                    used = LIBSSH2_CHANNEL_DATA(channelp,
+                                                (msg ==
+                                                 SSH_MSG_CHANNEL_DATA) ? 0 :
+                                                (int)_libssh2_ntohu32(data +
+                                                                      5),
+                                                (const char *)data +
+                                                data_head, len);
+                    if (used > len)
+                        used = len;
+                    channelp->remote.window_size -= (uint32_t)used;
+                    channelp->window_used += (uint32_t)used;
+                    _libssh2_channel_window_granted(channelp, -(long)used);
+
+                    if (used < len) {
+                        /* the rest is queued for libssh2_channel_read() */
+                        data_head += used;
+                        datalen = data_head + (len - used);
+                    }
+                    else {
+                        _libssh2_slab_free(session, data, datasize);
+
+                        if ((channelp->remote.window_size <
+                             LIBSSH2_CHANNEL_WINDOW_TARGET(channelp) / 4 * 3) &&
+                            (_libssh2_channel_window_tune(channelp) >
+                             channelp->remote.window_size)) {
+                            session->packAdd_channelp = channelp;
+
+                            /* open the window up again, like reading it
+                               from the queue would */
+                          libssh2_packet_add_jump_point6:
+                            session->packAdd_state = libssh2_NB_state_jump6;
+                            rc = _libssh2_channel_receive_window_adjust(
+                                session->packAdd_channelp,
+                                LIBSSH2_CHANNEL_WINDOW_TARGET(
+                                    session->packAdd_channelp) -
+                                session->packAdd_channelp->
+                                remote.window_size, 1, NULL);
+                            if (rc == LIBSSH2_ERROR_EAGAIN)
+                                return rc;
+                        }
+                        session->packAdd_state = libssh2_NB_state_idle;
+                        return 0;
+                    }
+                }
+            }
+
             if (channelp->read_avail + datalen - data_head >
                 channelp->remote.window_size) {
                 _libssh2_error(session,
@@ -727,6 +825,11 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
              * updated once the data is actually read from the queue
              * from an upper layer */
             channelp->read_avail += datalen - data_head;
+            /* data coming in makes the channel busy */
+            _libssh2_channel_window_granted(channelp, 0);
+            if (msg == SSH_MSG_CHANNEL_EXTENDED_DATA)
+                channelp->ext_avail += datalen - data_head;
+            session->read_buffered += datalen - data_head;
 
             _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                            "increasing read_avail by %lu bytes to %lu/%lu",
@@ -756,8 +859,9 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                channelp->local.id,
                                channelp->remote.id);
                 channelp->remote.eof = 1;
+                _libssh2_channel_ready(channelp, 0);
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -847,7 +951,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                         return rc;
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -863,7 +967,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                             _libssh2_ntohu32(data + 1));
             if (!channelp) {
                 /* We may have freed already, just quietly ignore this... */
-                LIBSSH2_FREE(session, data);
+                _libssh2_slab_free(session, data, datasize);
                 session->packAdd_state = libssh2_NB_state_idle;
                 return 0;
             }
@@ -874,8 +978,9 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
             channelp->remote.close = 1;
             channelp->remote.eof = 1;
+            _libssh2_channel_ready(channelp, 0);
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
 
@@ -922,7 +1027,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
             if (rc == LIBSSH2_ERROR_EAGAIN)
                 return rc;
 
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return rc;
 
@@ -941,6 +1046,12 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                             _libssh2_ntohu32(data + 1));
                 if(channelp) {
                     channelp->local.window_size += bytestoadd;
+                    channelp->stats.window_adjusts_received++;
+                    _libssh2_event(session,
+                                   LIBSSH2_EVENT_WINDOW_ADJUST_RECEIVED,
+                                   channelp->local.id, 0, 0, bytestoadd);
+                    if (bytestoadd)
+                        _libssh2_channel_ready(channelp, 1);
 
                     _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                                    "Window adjust for channel %lu/%lu, "
@@ -951,9 +1062,30 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                    channelp->local.window_size);
                 }
             }
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return 0;
+
+            /*
+              Answers to an open or a request of a channel, which are only
+              taken here if they were sent without waiting for them
+            */
+        case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+        case SSH_MSG_CHANNEL_OPEN_FAILURE:
+        case SSH_MSG_CHANNEL_SUCCESS:
+        case SSH_MSG_CHANNEL_FAILURE:
+            if(datalen >= 5) {
+                channelp =
+                    _libssh2_channel_locate(session,
+                                            _libssh2_ntohu32(data + 1));
+                if(channelp &&
+                   _libssh2_channel_reply(channelp, data, datalen)) {
+                    _libssh2_slab_free(session, data, datasize);
+                    session->packAdd_state = libssh2_NB_state_idle;
+                    return 0;
+                }
+            }
+            break;
         default:
             break;
         }
@@ -963,19 +1095,36 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
     if (session->packAdd_state == libssh2_NB_state_sent) {
         LIBSSH2_PACKET *packetp =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_PACKET));
+            _libssh2_slab_alloc(session, sizeof(LIBSSH2_PACKET));
         if (!packetp) {
             _libssh2_debug(session, LIBSSH2_ERROR_ALLOC,
                            "memory for packet");
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, datasize);
             session->packAdd_state = libssh2_NB_state_idle;
             return LIBSSH2_ERROR_ALLOC;
         }
         packetp->data = data;
         packetp->data_len = datalen;
         packetp->data_head = data_head;
+        packetp->data_size = datasize;
 
-        _libssh2_list_add(&session->packets, &packetp->node);
+        if ((msg == SSH_MSG_CHANNEL_DATA) && channelp) {
+            _libssh2_list_add(&channelp->data_queue, &packetp->node);
+            _libssh2_channel_ready(channelp, 0);
+        }
+        else if ((msg == SSH_MSG_CHANNEL_EXTENDED_DATA) && channelp) {
+            _libssh2_list_add((channelp->remote.extended_data_ignore_mode ==
+                               LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE) ?
+                              &channelp->data_queue : &channelp->ext_queue,
+                              &packetp->node);
+            _libssh2_channel_ready(channelp, 0);
+        }
+        else
+            _libssh2_list_add(&session->packets, &packetp->node);
+
+        if (++session->stats.packets_queued >
+            session->stats.packets_queued_max)
+            session->stats.packets_queued_max = session->stats.packets_queued;
 
         session->packAdd_state = libssh2_NB_state_sent1;
     }
@@ -1020,6 +1169,19 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
     return 0;
 }
 
+/*
+ * _libssh2_packet_free
+ *
+ * Free a packet node and its data once it has been unlinked
+ */
+void
+_libssh2_packet_free(LIBSSH2_SESSION * session, LIBSSH2_PACKET *packet)
+{
+    _libssh2_slab_free(session, packet->data, packet->data_size);
+    _libssh2_slab_free(session, packet, sizeof(LIBSSH2_PACKET));
+    session->stats.packets_queued--;
+}
+
 /*
  * _libssh2_packet_ask
  *
@@ -1049,7 +1211,8 @@ _libssh2_packet_ask(LIBSSH2_SESSION * session, unsigned char packet_type,
             /* unlink struct from session->packets */
             _libssh2_list_remove(&packet->node);
 
-            LIBSSH2_FREE(session, packet);
+            _libssh2_slab_free(session, packet, sizeof(LIBSSH2_PACKET));
+            session->stats.packets_queued--;
 
             return 0;
         }
@@ -1254,9 +1417,15 @@ _libssh2_packet_requirev(LIBSSH2_SESSION *session,
 
         if (strchr((char *) packet_types, ret)) {
             /* Be lazy, let packet_ask pull it out of the brigade */
-            return _libssh2_packet_askv(session, packet_types, data,
-                                        data_len, match_ofs, match_buf,
-                                        match_len);
+            int rc = _libssh2_packet_askv(session, packet_types, data,
+                                          data_len, match_ofs, match_buf,
+                                          match_len);
+            if (!rc)
+                state->start = 0;
+            if (!rc || !ret)
+                return rc;
+            /* the right type but not our match, another caller sharing
+               the session (or an earlier request) is waiting for it */
         }
     }
 
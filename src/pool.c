@@ -0,0 +1,387 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#include "libssh2_priv.h"
+#include "misc.h" /* _libssh2_list_*, _libssh2_time_ns */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Session pools: authenticated sessions kept around by what they were
+   set up for, and the channels opened on them, so that a program talking
+   to the same host as the same user pays for TCP, key exchange and
+   authentication once. */
+
+/* sshd's MaxSessions defaults to 10 */
+#define POOL_MAX_CHANNELS   10
+#define POOL_IDLE_MS        60000
+/* how often the byte counts of a session are sampled for its rate */
+#define POOL_SAMPLE_MS      1000
+
+static libssh2_uint64_t
+pool_now(void)
+{
+    return _libssh2_time_ns() / 1000000;
+}
+
+static char *
+pool_strdup(const char *str)
+{
+    size_t len;
+    char *copy;
+
+    if (!str)
+        return NULL;
+    len = strlen(str) + 1;
+    copy = malloc(len);
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+static int
+pool_match(const struct _libssh2_pool_entry *entry, const char *host,
+           int port, const char *user, const char *identity)
+{
+    if (entry->port != port || strcmp(entry->host, host) ||
+        strcmp(entry->user, user))
+        return 0;
+    if (!entry->identity || !identity)
+        return !entry->identity && !identity;
+    return !strcmp(entry->identity, identity);
+}
+
+static libssh2_uint64_t
+pool_bytes(LIBSSH2_SESSION *session)
+{
+    return session->stats.bytes_sent + session->stats.bytes_received;
+}
+
+/*
+ * pool_sample
+ *
+ * Update the rate of a session once a sample period has passed since the
+ * last one
+ */
+static void
+pool_sample(struct _libssh2_pool_entry *entry, libssh2_uint64_t now)
+{
+    libssh2_uint64_t bytes;
+    libssh2_uint64_t elapsed = now - entry->sample_ms;
+
+    if (elapsed < POOL_SAMPLE_MS)
+        return;
+    bytes = pool_bytes(entry->session);
+    entry->rate = (unsigned long)((bytes - entry->sample_bytes) * 1000 /
+                                  elapsed);
+    entry->sample_ms = now;
+    entry->sample_bytes = bytes;
+}
+
+static void
+pool_entry_free(struct _libssh2_pool_entry *entry)
+{
+    free(entry->host);
+    free(entry->user);
+    free(entry->identity);
+    free(entry);
+}
+
+/*
+ * pool_close
+ *
+ * Take a session out of its pool and have it torn down
+ */
+static void
+pool_close(struct _libssh2_pool_entry *entry)
+{
+    LIBSSH2_SESSION_POOL *pool = entry->pool;
+    LIBSSH2_SESSION *session = entry->session;
+
+    _libssh2_list_remove(&entry->node);
+    pool_entry_free(entry);
+    if (!session)
+        return;
+
+    session->pool_entry = NULL;
+    if (pool->close_func)
+        pool->close_func(pool, session, &pool->abstract);
+    else {
+        libssh2_session_disconnect(session, "Idle");
+        libssh2_session_free(session);
+    }
+}
+
+/*
+ * pool_connect
+ *
+ * Have a new session set up for a key and add it to the pool
+ */
+static int
+pool_connect(LIBSSH2_SESSION_POOL *pool, const char *host, int port,
+             const char *user, const char *identity,
+             struct _libssh2_pool_entry **entryp)
+{
+    struct _libssh2_pool_entry *entry;
+    LIBSSH2_SESSION *session;
+    libssh2_uint64_t now;
+
+    session = pool->connect_func(pool, host, port, user, identity,
+                            &pool->abstract);
+    if (!session)
+        return LIBSSH2_ERROR_SOCKET_NONE;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry) {
+        entry->host = pool_strdup(host);
+        entry->user = pool_strdup(user);
+        entry->identity = pool_strdup(identity);
+    }
+    if (!entry || !entry->host || !entry->user ||
+        (identity && !entry->identity)) {
+        if (entry)
+            pool_entry_free(entry);
+        if (pool->close_func)
+            pool->close_func(pool, session, &pool->abstract);
+        else
+            libssh2_session_free(session);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+
+    now = pool_now();
+    entry->pool = pool;
+    entry->session = session;
+    entry->port = port;
+    entry->idle_ms = now;
+    entry->sample_ms = now;
+    entry->sample_bytes = pool_bytes(session);
+    session->pool_entry = entry;
+    _libssh2_list_add(&pool->sessions, &entry->node);
+    *entryp = entry;
+    return 0;
+}
+
+/*
+ * libssh2_session_pool_init
+ *
+ * Create an empty session pool, it belongs to no session
+ */
+LIBSSH2_API LIBSSH2_SESSION_POOL *
+libssh2_session_pool_init(LIBSSH2_POOL_CONNECT_FUNC((*connect_func)),
+                          LIBSSH2_POOL_CLOSE_FUNC((*close_func)),
+                          void *abstract)
+{
+    LIBSSH2_SESSION_POOL *pool;
+
+    if (!connect_func)
+        return NULL;
+
+    pool = malloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    _libssh2_list_init(&pool->sessions);
+    pool->connect_func = connect_func;
+    pool->close_func = close_func;
+    pool->abstract = abstract;
+    pool->max_channels = POOL_MAX_CHANNELS;
+    pool->max_rate = 0;
+    pool->idle_ms = POOL_IDLE_MS;
+    return pool;
+}
+
+/*
+ * libssh2_session_pool_limits
+ *
+ * Set when a pool sets up another session and when it lets one go
+ */
+LIBSSH2_API int
+libssh2_session_pool_limits(LIBSSH2_SESSION_POOL *pool,
+                            unsigned int max_channels,
+                            unsigned long max_rate,
+                            long idle_ms)
+{
+    if (!max_channels || idle_ms < 0)
+        return LIBSSH2_ERROR_INVAL;
+
+    pool->max_channels = max_channels;
+    pool->max_rate = max_rate;
+    pool->idle_ms = idle_ms;
+    return 0;
+}
+
+/*
+ * libssh2_session_pool_channel
+ *
+ * Open a channel on the session of a key with the fewest channels that is
+ * below the limits, or on a new one. A session whose open returned EAGAIN
+ * is picked again until the open is through.
+ */
+LIBSSH2_API int
+libssh2_session_pool_channel(LIBSSH2_SESSION_POOL *pool,
+                             const char *host, int port,
+                             const char *user, const char *identity,
+                             LIBSSH2_CHANNEL **channel)
+{
+    struct _libssh2_pool_entry *entry;
+    struct _libssh2_pool_entry *best;
+    libssh2_uint64_t now;
+    int rc;
+
+    *channel = NULL;
+    if (!host || !user)
+        return LIBSSH2_ERROR_INVAL;
+
+  again:
+    now = pool_now();
+    best = NULL;
+    for (entry = _libssh2_list_first(&pool->sessions); entry;
+         entry = _libssh2_list_next(&entry->node)) {
+        if (!entry->session || entry->broken ||
+            !pool_match(entry, host, port, user, identity))
+            continue;
+        if (entry->opening) {
+            best = entry;
+            break;
+        }
+        if (entry->channels >= pool->max_channels ||
+            (entry->full && entry->channels >= entry->full))
+            continue;
+        pool_sample(entry, now);
+        if (pool->max_rate && entry->rate >= pool->max_rate)
+            continue;
+        if (!best || entry->channels < best->channels)
+            best = entry;
+    }
+
+    if (!best) {
+        rc = pool_connect(pool, host, port, user, identity, &best);
+        if (rc)
+            return rc;
+    }
+
+    *channel = libssh2_channel_open_session(best->session);
+    if (*channel) {
+        best->opening = 0;
+        best->channels++;
+        return 0;
+    }
+
+    rc = libssh2_session_last_errno(best->session);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        best->opening = 1;
+        return rc;
+    }
+    best->opening = 0;
+    if (rc == LIBSSH2_ERROR_CHANNEL_FAILURE && best->channels) {
+        /* the server allows fewer channels than the pool limit, this
+           session is full but fine, try the next one */
+        best->full = best->channels;
+        goto again;
+    }
+    best->broken = 1;
+    return rc;
+}
+
+/*
+ * libssh2_session_pool_release
+ *
+ * Free a channel of a pooled session. The session becomes idle with its
+ * last channel gone.
+ */
+LIBSSH2_API int
+libssh2_session_pool_release(LIBSSH2_CHANNEL *channel)
+{
+    struct _libssh2_pool_entry *entry = channel->session->pool_entry;
+    int rc;
+
+    rc = libssh2_channel_free(channel);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    if (entry && entry->channels) {
+        entry->channels--;
+        if (!entry->channels)
+            entry->idle_ms = pool_now();
+    }
+    return rc;
+}
+
+/*
+ * libssh2_session_pool_evict
+ *
+ * Close the sessions without channels that are idle for too long or
+ * broken, and forget the ones that got freed
+ */
+LIBSSH2_API int
+libssh2_session_pool_evict(LIBSSH2_SESSION_POOL *pool)
+{
+    struct _libssh2_pool_entry *entry;
+    struct _libssh2_pool_entry *next;
+    libssh2_uint64_t now = pool_now();
+    int count = 0;
+
+    for (entry = _libssh2_list_first(&pool->sessions); entry; entry = next) {
+        next = _libssh2_list_next(&entry->node);
+        if (entry->session && (entry->channels || entry->opening))
+            continue;
+        if (entry->session && !entry->broken &&
+            (!pool->idle_ms ||
+             now - entry->idle_ms < (libssh2_uint64_t)pool->idle_ms))
+            continue;
+        pool_close(entry);
+        count++;
+    }
+    return count;
+}
+
+/*
+ * libssh2_session_pool_free
+ *
+ * Close every session of a pool, channels and all, and free it
+ */
+LIBSSH2_API void
+libssh2_session_pool_free(LIBSSH2_SESSION_POOL *pool)
+{
+    struct _libssh2_pool_entry *entry;
+
+    if (!pool)
+        return;
+
+    while ((entry = _libssh2_list_first(&pool->sessions)))
+        pool_close(entry);
+    free(pool);
+}
@@ -174,8 +174,10 @@ publickey_packet_receive(LIBSSH2_PUBLICKEY * pkey,
                                   "response packet");
         }
 
+        /* the caller frees it from here on */
         *data = pkey->receive_packet;
         *data_len = pkey->receive_packet_len;
+        pkey->receive_packet = NULL;
     }
 
     pkey->receive_state = libssh2_NB_state_idle;
@@ -1016,6 +1018,289 @@ libssh2_publickey_list_free(LIBSSH2_PUBLICKEY * pkey,
     LIBSSH2_FREE(session, pkey_list);
 }
 
+/* a response of the list being read at once in libssh2_publickey_list_next()
+   can't be bigger than this */
+#define PUBLICKEY_LIST_CHUNK    16384
+#define PUBLICKEY_LIST_MAX      (256*1024)
+
+static int
+publickey_get_u32(unsigned char **buf, const unsigned char *end,
+                  unsigned long *value)
+{
+    if (end - *buf < 4)
+        return -1;
+    *value = _libssh2_ntohu32(*buf);
+    *buf += 4;
+    return 0;
+}
+
+/*
+ * publickey_list_parse
+ *
+ * Fill in a key from a publickey response, pointing into it. The
+ * attributes go in the array of the pkey, grown when a key has more than
+ * any before it.
+ */
+static int
+publickey_list_parse(LIBSSH2_PUBLICKEY *pkey, unsigned char *s,
+                     const unsigned char *end, libssh2_publickey_list *key)
+{
+    LIBSSH2_SESSION *session = pkey->channel->session;
+    unsigned char *str;
+    size_t len;
+    unsigned long i;
+
+    key->packet = NULL;
+    key->num_attrs = 0;
+    key->attrs = NULL;
+
+    if (pkey->version == 1) {
+        unsigned char *comment;
+        size_t comment_len;
+
+        if (_libssh2_get_string(&s, end, &comment, &comment_len))
+            return -1;
+        if (comment_len) {
+            if (!pkey->listNext_attrs_size) {
+                pkey->listNext_attrs =
+                    LIBSSH2_ALLOC(session,
+                                  sizeof(libssh2_publickey_attribute));
+                if (!pkey->listNext_attrs)
+                    return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                          "Unable to allocate memory for "
+                                          "publickey attributes");
+                pkey->listNext_attrs_size = 1;
+            }
+            key->num_attrs = 1;
+            key->attrs = pkey->listNext_attrs;
+            key->attrs[0].name = "comment";
+            key->attrs[0].name_len = sizeof("comment") - 1;
+            key->attrs[0].value = (char *) comment;
+            key->attrs[0].value_len = comment_len;
+            key->attrs[0].mandatory = 0;
+        }
+    }
+
+    if (_libssh2_get_string(&s, end, &str, &len))
+        return -1;
+    key->name = str;
+    key->name_len = len;
+    if (_libssh2_get_string(&s, end, &str, &len))
+        return -1;
+    key->blob = str;
+    key->blob_len = len;
+
+    if (pkey->version == 1)
+        return 0;
+
+    /* Version == 2 */
+    if (publickey_get_u32(&s, end, &key->num_attrs))
+        return -1;
+    /* each attribute takes at least 8 bytes */
+    if (key->num_attrs > (unsigned long)(end - s) / 8)
+        return -1;
+    if (!key->num_attrs)
+        return 0;
+
+    if (key->num_attrs > pkey->listNext_attrs_size) {
+        libssh2_publickey_attribute *attrs =
+            LIBSSH2_REALLOC(session, pkey->listNext_attrs,
+                            key->num_attrs *
+                            sizeof(libssh2_publickey_attribute));
+        if (!attrs)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "publickey attributes");
+        pkey->listNext_attrs = attrs;
+        pkey->listNext_attrs_size = key->num_attrs;
+    }
+    key->attrs = pkey->listNext_attrs;
+
+    for (i = 0; i < key->num_attrs; i++) {
+        if (_libssh2_get_string(&s, end, &str, &len))
+            return -1;
+        key->attrs[i].name = (char *) str;
+        key->attrs[i].name_len = len;
+        if (_libssh2_get_string(&s, end, &str, &len))
+            return -1;
+        key->attrs[i].value = (char *) str;
+        key->attrs[i].value_len = len;
+
+        /* actually an ignored value */
+        key->attrs[i].mandatory = 0;
+    }
+    return 0;
+}
+
+/*
+ * publickey_list_next
+ *
+ * Send the list request on the first call, then read the responses a
+ * buffer full at a time and take the next one out of the buffer in place
+ */
+static int
+publickey_list_next(LIBSSH2_PUBLICKEY *pkey, libssh2_publickey_list *key)
+{
+    static const unsigned char request[] = {
+        /* packet_len(4) + list_len(4) + "list"(4) */
+        0, 0, 0, 8, 0, 0, 0, 4, 'l', 'i', 's', 't'
+    };
+    LIBSSH2_CHANNEL *channel = pkey->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    unsigned char *data;
+    unsigned char *s;
+    size_t avail;
+    size_t need;
+    size_t len = 0;
+    ssize_t nread;
+    int response;
+    int rc;
+
+    if (pkey->listNext_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_PUBLICKEY,
+                       "Sending publickey \"list\" packet");
+        pkey->listNext_len = 0;
+        pkey->listNext_off = 0;
+        pkey->listNext_state = libssh2_NB_state_created;
+    }
+
+    if (pkey->listNext_state == libssh2_NB_state_created) {
+        rc = _libssh2_channel_write(channel, 0, request, sizeof(request));
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        else if (rc != (int)sizeof(request)) {
+            pkey->listNext_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "Unable to send publickey list packet");
+        }
+        pkey->listNext_state = libssh2_NB_state_sent;
+    }
+
+    while (1) {
+        avail = pkey->listNext_len - pkey->listNext_off;
+        if (avail >= 4) {
+            len = _libssh2_ntohu32(pkey->listNext_buf + pkey->listNext_off);
+            if (len > PUBLICKEY_LIST_MAX) {
+                rc = _libssh2_error(session, LIBSSH2_ERROR_PUBLICKEY_PROTOCOL,
+                                    "Publickey subsystem response too "
+                                    "large");
+                goto err_exit;
+            }
+        }
+        if (avail >= 4 && avail - 4 >= len) {
+            data = pkey->listNext_buf + pkey->listNext_off + 4;
+            pkey->listNext_off += 4 + len;
+
+            s = data;
+            response = publickey_response_id(&s, len);
+            switch (response) {
+            case LIBSSH2_PUBLICKEY_RESPONSE_STATUS:
+                /* Error, or processing complete */
+            {
+                unsigned long status;
+                unsigned char *str;
+                size_t str_len;
+
+                if (publickey_get_u32(&s, data + len, &status) ||
+                    _libssh2_get_string(&s, data + len, &str, &str_len) ||
+                    _libssh2_get_string(&s, data + len, &str, &str_len)) {
+                    rc = _libssh2_error(session,
+                                        LIBSSH2_ERROR_PUBLICKEY_PROTOCOL,
+                                        "Malformed publickey subsystem "
+                                        "packet");
+                    goto err_exit;
+                }
+                pkey->listNext_state = libssh2_NB_state_idle;
+                if (status == LIBSSH2_PUBLICKEY_SUCCESS)
+                    return 0;
+                publickey_status_error(pkey, session, status);
+                return LIBSSH2_ERROR_PUBLICKEY_PROTOCOL;
+            }
+            case LIBSSH2_PUBLICKEY_RESPONSE_PUBLICKEY:
+                /* What we want */
+                rc = publickey_list_parse(pkey, s, data + len, key);
+                if (rc) {
+                    if (rc != LIBSSH2_ERROR_ALLOC)
+                        rc = _libssh2_error(session,
+                                            LIBSSH2_ERROR_PUBLICKEY_PROTOCOL,
+                                            "Malformed publickey subsystem "
+                                            "packet");
+                    goto err_exit;
+                }
+                return 1;
+            default:
+                /* Unknown/Unexpected */
+                _libssh2_error(session, LIBSSH2_ERROR_PUBLICKEY_PROTOCOL,
+                               "Unexpected publickey subsystem response");
+            }
+            continue;
+        }
+
+        /* keep the partial response at the start and make room for the
+           rest of it, or for a buffer full of the ones to come */
+        if (pkey->listNext_off) {
+            memmove(pkey->listNext_buf,
+                    pkey->listNext_buf + pkey->listNext_off, avail);
+            pkey->listNext_len = avail;
+            pkey->listNext_off = 0;
+        }
+        need = avail >= 4 ? 4 + len : 4;
+        if (need < PUBLICKEY_LIST_CHUNK)
+            need = PUBLICKEY_LIST_CHUNK;
+        if (need > pkey->listNext_size) {
+            unsigned char *buf = LIBSSH2_REALLOC(session, pkey->listNext_buf,
+                                                 need);
+            if (!buf) {
+                rc = _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                    "Unable to allocate publickey response "
+                                    "buffer");
+                goto err_exit;
+            }
+            pkey->listNext_buf = buf;
+            pkey->listNext_size = need;
+        }
+
+        nread = _libssh2_channel_read(channel, 0,
+                                      (char *) pkey->listNext_buf +
+                                      pkey->listNext_len,
+                                      pkey->listNext_size -
+                                      pkey->listNext_len);
+        if (nread == LIBSSH2_ERROR_EAGAIN)
+            return (int)nread;
+        else if (nread < 0) {
+            rc = (int)nread;
+            goto err_exit;
+        }
+        else if (!nread) {
+            rc = _libssh2_error(session, LIBSSH2_ERROR_PUBLICKEY_PROTOCOL,
+                                "Publickey subsystem closed during list");
+            goto err_exit;
+        }
+        pkey->listNext_len += nread;
+    }
+
+  err_exit:
+    pkey->listNext_state = libssh2_NB_state_idle;
+    return rc;
+}
+
+/* libssh2_publickey_list_next
+ * Get the next key of the server's list, parsed in place
+ */
+LIBSSH2_API int
+libssh2_publickey_list_next(LIBSSH2_PUBLICKEY *pkey,
+                            libssh2_publickey_list *key)
+{
+    int rc;
+
+    if(!pkey || !key)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, pkey->channel->session,
+                 publickey_list_next(pkey, key));
+    return rc;
+}
+
 /* libssh2_publickey_shutdown
  * Shutdown the publickey subsystem
  */
@@ -1049,6 +1334,14 @@ libssh2_publickey_shutdown(LIBSSH2_PUBLICKEY *pkey)
         LIBSSH2_FREE(session, pkey->listFetch_data);
         pkey->listFetch_data = NULL;
     }
+    if (pkey->listNext_buf) {
+        LIBSSH2_FREE(session, pkey->listNext_buf);
+        pkey->listNext_buf = NULL;
+    }
+    if (pkey->listNext_attrs) {
+        LIBSSH2_FREE(session, pkey->listNext_attrs);
+        pkey->listNext_attrs = NULL;
+    }
 
     rc = _libssh2_channel_free(pkey->channel);
     if (rc == LIBSSH2_ERROR_EAGAIN)
@@ -262,70 +262,145 @@ shell_quotearg(const char *path, unsigned char *buf,
 }
 
 /*
- * scp_recv
+ * scp_response_want
+ *
+ * How much of the server's response line to read next. The first byte is
+ * read alone since it tells whether an error message follows, the rest of
+ * the line is then taken in one go as far as the channel has it queued.
+ */
+static size_t
+scp_response_want(LIBSSH2_SESSION * session)
+{
+    size_t want;
+
+    if (!session->scp->recv_response_len)
+        return 1;
+
+    want = _libssh2_channel_line_len(session->scp->recv_channel,
+                                     LIBSSH2_SCP_RESPONSE_BUFLEN -
+                                     session->scp->recv_response_len);
+    return want ? want : 1;
+}
+
+/*
+ * scp_state_get
+ *
+ * Allocate the state of the SCP calls unless one of them is already in
+ * progress. Returns non-zero on failure.
+ */
+static int
+scp_state_get(LIBSSH2_SESSION * session)
+{
+    if (session->scp)
+        return 0;
+
+    session->scp = LIBSSH2_CALLOC(session, sizeof(struct scp_state));
+    if (!session->scp)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate SCP state");
+    return 0;
+}
+
+/*
+ * scp_state_put
+ *
+ * Free the state of the SCP calls once none of them is in progress
+ */
+static void
+scp_state_put(LIBSSH2_SESSION * session)
+{
+    if ((session->scp->recv_state != libssh2_NB_state_idle) ||
+        (session->scp->send_state != libssh2_NB_state_idle))
+        return;
+
+    _libssh2_scp_free(session);
+}
+
+/*
+ * _libssh2_scp_free
+ *
+ * Free the state of the SCP calls, along with what an interrupted one left
+ */
+void
+_libssh2_scp_free(LIBSSH2_SESSION * session)
+{
+    if (!session->scp)
+        return;
+
+    if (session->scp->recv_command)
+        LIBSSH2_FREE(session, session->scp->recv_command);
+    if (session->scp->send_command)
+        LIBSSH2_FREE(session, session->scp->send_command);
+    LIBSSH2_FREE(session, session->scp);
+    session->scp = NULL;
+}
+
+/*
+ * scp_recv_state
  *
  * Open a channel and request a remote file via SCP
  *
  */
 static LIBSSH2_CHANNEL *
-scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
+scp_recv_state(LIBSSH2_SESSION * session, const char *path,
+               libssh2_struct_stat * sb)
 {
     int cmd_len;
     int rc;
     int tmp_err_code;
     const char *tmp_err_msg;
 
-    if (session->scpRecv_state == libssh2_NB_state_idle) {
-        session->scpRecv_mode = 0;
-        session->scpRecv_size = 0;
-        session->scpRecv_mtime = 0;
-        session->scpRecv_atime = 0;
+    if (session->scp->recv_state == libssh2_NB_state_idle) {
+        session->scp->recv_mode = 0;
+        session->scp->recv_size = 0;
+        session->scp->recv_mtime = 0;
+        session->scp->recv_atime = 0;
 
-        session->scpRecv_command_len =
+        session->scp->recv_command_len =
             _libssh2_shell_quotedsize(path) + sizeof("scp -f ") + (sb?1:0);
 
-        session->scpRecv_command =
-            LIBSSH2_ALLOC(session, session->scpRecv_command_len);
+        session->scp->recv_command =
+            LIBSSH2_ALLOC(session, session->scp->recv_command_len);
 
-        if (!session->scpRecv_command) {
+        if (!session->scp->recv_command) {
             _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                            "Unable to allocate a command buffer for "
                            "SCP session");
             return NULL;
         }
 
-        snprintf((char *)session->scpRecv_command,
-                 session->scpRecv_command_len,
+        snprintf((char *)session->scp->recv_command,
+                 session->scp->recv_command_len,
                  "scp -%sf ", sb?"p":"");
 
-        cmd_len = strlen((char *)session->scpRecv_command);
+        cmd_len = strlen((char *)session->scp->recv_command);
         cmd_len += shell_quotearg(path,
-                                  &session->scpRecv_command[cmd_len],
-                                  session->scpRecv_command_len - cmd_len);
+                                  &session->scp->recv_command[cmd_len],
+                                  session->scp->recv_command_len - cmd_len);
 
-        session->scpRecv_command[cmd_len] = '\0';
-        session->scpRecv_command_len = cmd_len + 1;
+        session->scp->recv_command[cmd_len] = '\0';
+        session->scp->recv_command_len = cmd_len + 1;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                        "Opening channel for SCP receive");
 
-        session->scpRecv_state = libssh2_NB_state_created;
+        session->scp->recv_state = libssh2_NB_state_created;
     }
 
-    if (session->scpRecv_state == libssh2_NB_state_created) {
+    if (session->scp->recv_state == libssh2_NB_state_created) {
         /* Allocate a channel */
-        session->scpRecv_channel =
+        session->scp->recv_channel =
             _libssh2_channel_open(session, "session",
                                   sizeof("session") - 1,
                                   LIBSSH2_CHANNEL_WINDOW_DEFAULT,
                                   LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL,
                                   0);
-        if (!session->scpRecv_channel) {
+        if (!session->scp->recv_channel) {
             if (libssh2_session_last_errno(session) !=
                 LIBSSH2_ERROR_EAGAIN) {
-                LIBSSH2_FREE(session, session->scpRecv_command);
-                session->scpRecv_command = NULL;
-                session->scpRecv_state = libssh2_NB_state_idle;
+                LIBSSH2_FREE(session, session->scp->recv_command);
+                session->scp->recv_command = NULL;
+                session->scp->recv_state = libssh2_NB_state_idle;
             }
             else {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
@@ -334,37 +409,38 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
             return NULL;
         }
 
-        session->scpRecv_state = libssh2_NB_state_sent;
+        session->scp->recv_state = libssh2_NB_state_sent;
     }
 
-    if (session->scpRecv_state == libssh2_NB_state_sent) {
+    if (session->scp->recv_state == libssh2_NB_state_sent) {
         /* Request SCP for the desired file */
-        rc = _libssh2_channel_process_startup(session->scpRecv_channel, "exec",
-                                              sizeof("exec") - 1,
-                                              (char *) session->scpRecv_command,
-                                              session->scpRecv_command_len);
+        rc = _libssh2_channel_process_startup(session->scp->recv_channel,
+                                              "exec", sizeof("exec") - 1,
+                                              (char *)
+                                              session->scp->recv_command,
+                                              session->scp->recv_command_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block requesting SCP startup");
             return NULL;
         } else if (rc) {
-            LIBSSH2_FREE(session, session->scpRecv_command);
-            session->scpRecv_command = NULL;
+            LIBSSH2_FREE(session, session->scp->recv_command);
+            session->scp->recv_command = NULL;
             goto scp_recv_error;
         }
-        LIBSSH2_FREE(session, session->scpRecv_command);
-        session->scpRecv_command = NULL;
+        LIBSSH2_FREE(session, session->scp->recv_command);
+        session->scp->recv_command = NULL;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sending initial wakeup");
         /* SCP ACK */
-        session->scpRecv_response[0] = '\0';
+        session->scp->recv_response[0] = '\0';
 
-        session->scpRecv_state = libssh2_NB_state_sent1;
+        session->scp->recv_state = libssh2_NB_state_sent1;
     }
 
-    if (session->scpRecv_state == libssh2_NB_state_sent1) {
-        rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                    session->scpRecv_response, 1);
+    if (session->scp->recv_state == libssh2_NB_state_sent1) {
+        rc = _libssh2_channel_write(session->scp->recv_channel, 0,
+                                    session->scp->recv_response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block sending initial wakeup");
@@ -374,22 +450,26 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
         }
 
         /* Parse SCP response */
-        session->scpRecv_response_len = 0;
+        session->scp->recv_response_len = 0;
 
-        session->scpRecv_state = libssh2_NB_state_sent2;
+        session->scp->recv_state = libssh2_NB_state_sent2;
     }
 
-    if ((session->scpRecv_state == libssh2_NB_state_sent2)
-        || (session->scpRecv_state == libssh2_NB_state_sent3)) {
-        while (sb && (session->scpRecv_response_len <
+    if ((session->scp->recv_state == libssh2_NB_state_sent2)
+        || (session->scp->recv_state == libssh2_NB_state_sent3)) {
+        while (sb && (session->scp->recv_response_len <
                       LIBSSH2_SCP_RESPONSE_BUFLEN)) {
             unsigned char *s, *p;
 
-            if (session->scpRecv_state == libssh2_NB_state_sent2) {
-                rc = _libssh2_channel_read(session->scpRecv_channel, 0,
-                                           (char *) session->
-                                           scpRecv_response +
-                                           session->scpRecv_response_len, 1);
+            if (session->scp->recv_state == libssh2_NB_state_sent2) {
+                size_t old_len = session->scp->recv_response_len;
+                size_t i;
+
+                rc = _libssh2_channel_read(session->scp->recv_channel, 0,
+                                           (char *) session->scp->
+                                           recv_response +
+                                           session->scp->recv_response_len,
+                                           scp_response_want(session));
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting for SCP response");
@@ -403,9 +483,9 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 else if(rc == 0)
                     goto scp_recv_empty_channel;
 
-                session->scpRecv_response_len++;
+                session->scp->recv_response_len += rc;
 
-                if (session->scpRecv_response[0] != 'T') {
+                if (session->scp->recv_response[0] != 'T') {
                     size_t err_len;
                     char *err_msg;
 
@@ -416,8 +496,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                        The following string MUST be newline terminated
                     */
                     err_len =
-                        _libssh2_channel_packet_data_len(session->
-                                                         scpRecv_channel, 0);
+                        _libssh2_channel_packet_data_len(session->scp->
+                                                         recv_channel, 0);
                     err_msg = LIBSSH2_ALLOC(session, err_len + 1);
                     if (!err_msg) {
                         _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -426,7 +506,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     }
 
                     /* Read the remote error message */
-                    (void)_libssh2_channel_read(session->scpRecv_channel, 0,
+                    (void)_libssh2_channel_read(session->scp->recv_channel, 0,
                                                 err_msg, err_len);
                     /* If it failed for any reason, we ignore it anyway. */
 
@@ -434,7 +514,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     err_msg[err_len]=0;
 
                     _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                                   "got %02x %s", session->scpRecv_response[0],
+                                   "got %02x %s",
+                                   session->scp->recv_response[0],
                                    err_msg);
 
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
@@ -444,32 +525,23 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len > 1) &&
-                    ((session->
-                      scpRecv_response[session->scpRecv_response_len - 1] <
-                      '0')
-                     || (session->
-                         scpRecv_response[session->scpRecv_response_len - 1] >
-                         '9'))
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
-                        ' ')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
-                        '\r')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
-                        '\n')) {
-                    _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
-                                   "Invalid data in SCP response");
-                    goto scp_recv_error;
+                for (i = old_len ? old_len : 1;
+                     i < session->scp->recv_response_len; i++) {
+                    unsigned char c = session->scp->recv_response[i];
+
+                    if (((c < '0') || (c > '9')) && (c != ' ') &&
+                        (c != '\r') && (c != '\n')) {
+                        _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
+                                       "Invalid data in SCP response");
+                        goto scp_recv_error;
+                    }
                 }
 
-                if ((session->scpRecv_response_len < 9)
-                    || (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                if ((session->scp->recv_response_len < 9)
+                    || (session->scp->
+                        recv_response[session->scp->recv_response_len - 1] !=
                         '\n')) {
-                    if (session->scpRecv_response_len ==
+                    if (session->scp->recv_response_len ==
                         LIBSSH2_SCP_RESPONSE_BUFLEN) {
                         /* You had your chance */
                         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
@@ -483,17 +555,17 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 /* We're guaranteed not to go under response_len == 0 by the
                    logic above */
-                while ((session->
-                        scpRecv_response[session->scpRecv_response_len - 1] ==
+                while ((session->scp->
+                        recv_response[session->scp->recv_response_len - 1] ==
                         '\r')
-                       || (session->
-                           scpRecv_response[session->scpRecv_response_len -
+                       || (session->scp->
+                           recv_response[session->scp->recv_response_len -
                                             1] == '\n'))
-                    session->scpRecv_response_len--;
-                session->scpRecv_response[session->scpRecv_response_len] =
+                    session->scp->recv_response_len--;
+                session->scp->recv_response[session->scp->recv_response_len] =
                     '\0';
 
-                if (session->scpRecv_response_len < 8) {
+                if (session->scp->recv_response_len < 8) {
                     /* EOL came too soon */
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, "
@@ -501,7 +573,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
 
-                s = session->scpRecv_response + 1;
+                s = session->scp->recv_response + 1;
 
                 p = (unsigned char *) strchr((char *) s, ' ');
                 if (!p || ((p - s) <= 0)) {
@@ -514,7 +586,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *(p++) = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_mtime = strtol((char *) s, NULL, 10);
+                session->scp->recv_mtime = strtol((char *) s, NULL, 10);
 
                 s = (unsigned char *) strchr((char *) p, ' ');
                 if (!s || ((s - p) <= 0)) {
@@ -536,17 +608,17 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *p = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_atime = strtol((char *) s, NULL, 10);
+                session->scp->recv_atime = strtol((char *) s, NULL, 10);
 
                 /* SCP ACK */
-                session->scpRecv_response[0] = '\0';
+                session->scp->recv_response[0] = '\0';
 
-                session->scpRecv_state = libssh2_NB_state_sent3;
+                session->scp->recv_state = libssh2_NB_state_sent3;
             }
 
-            if (session->scpRecv_state == libssh2_NB_state_sent3) {
-                rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                            session->scpRecv_response, 1);
+            if (session->scp->recv_state == libssh2_NB_state_sent3) {
+                rc = _libssh2_channel_write(session->scp->recv_channel, 0,
+                                            session->scp->recv_response, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting to send SCP ACK");
@@ -557,7 +629,8 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                                "mtime = %ld, atime = %ld",
-                               session->scpRecv_mtime, session->scpRecv_atime);
+                               session->scp->recv_mtime,
+                               session->scp->recv_atime);
 
                 /* We *should* check that atime.usec is valid, but why let
                    that stop use? */
@@ -565,25 +638,29 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
             }
         }
 
-        session->scpRecv_state = libssh2_NB_state_sent4;
+        session->scp->recv_state = libssh2_NB_state_sent4;
     }
 
-    if (session->scpRecv_state == libssh2_NB_state_sent4) {
-        session->scpRecv_response_len = 0;
+    if (session->scp->recv_state == libssh2_NB_state_sent4) {
+        session->scp->recv_response_len = 0;
 
-        session->scpRecv_state = libssh2_NB_state_sent5;
+        session->scp->recv_state = libssh2_NB_state_sent5;
     }
 
-    if ((session->scpRecv_state == libssh2_NB_state_sent5)
-        || (session->scpRecv_state == libssh2_NB_state_sent6)) {
-        while (session->scpRecv_response_len < LIBSSH2_SCP_RESPONSE_BUFLEN) {
+    if ((session->scp->recv_state == libssh2_NB_state_sent5)
+        || (session->scp->recv_state == libssh2_NB_state_sent6)) {
+        while (session->scp->recv_response_len < LIBSSH2_SCP_RESPONSE_BUFLEN) {
             char *s, *p, *e = NULL;
 
-            if (session->scpRecv_state == libssh2_NB_state_sent5) {
-                rc = _libssh2_channel_read(session->scpRecv_channel, 0,
-                                           (char *) session->
-                                           scpRecv_response +
-                                           session->scpRecv_response_len, 1);
+            if (session->scp->recv_state == libssh2_NB_state_sent5) {
+                size_t old_len = session->scp->recv_response_len;
+                size_t i;
+
+                rc = _libssh2_channel_read(session->scp->recv_channel, 0,
+                                           (char *) session->scp->
+                                           recv_response +
+                                           session->scp->recv_response_len,
+                                           scp_response_want(session));
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block waiting for SCP response");
@@ -597,35 +674,30 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 else if(rc == 0)
                     goto scp_recv_empty_channel;
 
-                session->scpRecv_response_len++;
+                session->scp->recv_response_len += rc;
 
-                if (session->scpRecv_response[0] != 'C') {
+                if (session->scp->recv_response[0] != 'C') {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server");
                     goto scp_recv_error;
                 }
 
-                if ((session->scpRecv_response_len > 1) &&
-                    (session->
-                     scpRecv_response[session->scpRecv_response_len - 1] !=
-                     '\r')
-                    && (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
-                        '\n')
-                    &&
-                    (session->
-                     scpRecv_response[session->scpRecv_response_len - 1]
-                     < 32)) {
-                    _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
-                                   "Invalid data in SCP response");
-                    goto scp_recv_error;
+                for (i = old_len ? old_len : 1;
+                     i < session->scp->recv_response_len; i++) {
+                    unsigned char c = session->scp->recv_response[i];
+
+                    if ((c != '\r') && (c != '\n') && (c < 32)) {
+                        _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
+                                       "Invalid data in SCP response");
+                        goto scp_recv_error;
+                    }
                 }
 
-                if ((session->scpRecv_response_len < 7)
-                    || (session->
-                        scpRecv_response[session->scpRecv_response_len - 1] !=
+                if ((session->scp->recv_response_len < 7)
+                    || (session->scp->
+                        recv_response[session->scp->recv_response_len - 1] !=
                         '\n')) {
-                    if (session->scpRecv_response_len ==
+                    if (session->scp->recv_response_len ==
                         LIBSSH2_SCP_RESPONSE_BUFLEN) {
                         /* You had your chance */
                         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
@@ -639,25 +711,25 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 /* We're guaranteed not to go under response_len == 0 by the
                    logic above */
-                while ((session->
-                        scpRecv_response[session->scpRecv_response_len - 1] ==
+                while ((session->scp->
+                        recv_response[session->scp->recv_response_len - 1] ==
                         '\r')
-                       || (session->
-                           scpRecv_response[session->scpRecv_response_len -
+                       || (session->scp->
+                           recv_response[session->scp->recv_response_len -
                                             1] == '\n')) {
-                    session->scpRecv_response_len--;
+                    session->scp->recv_response_len--;
                 }
-                session->scpRecv_response[session->scpRecv_response_len] =
+                session->scp->recv_response[session->scp->recv_response_len] =
                     '\0';
 
-                if (session->scpRecv_response_len < 6) {
+                if (session->scp->recv_response_len < 6) {
                     /* EOL came too soon */
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, too short");
                     goto scp_recv_error;
                 }
 
-                s = (char *) session->scpRecv_response + 1;
+                s = (char *) session->scp->recv_response + 1;
 
                 p = strchr(s, ' ');
                 if (!p || ((p - s) <= 0)) {
@@ -670,7 +742,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 *(p++) = '\0';
                 /* Make sure we don't get fooled by leftover values */
 
-                session->scpRecv_mode = strtol(s, &e, 8);
+                session->scp->recv_mode = strtol(s, &e, 8);
                 if (e && *e) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, invalid mode");
@@ -687,7 +759,7 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
 
                 *s = '\0';
                 /* Make sure we don't get fooled by leftover values */
-                session->scpRecv_size = scpsize_strtol(p, &e, 10);
+                session->scp->recv_size = scpsize_strtol(p, &e, 10);
                 if (e && *e) {
                     _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                    "Invalid response from SCP server, invalid size");
@@ -695,14 +767,14 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                 }
 
                 /* SCP ACK */
-                session->scpRecv_response[0] = '\0';
+                session->scp->recv_response[0] = '\0';
 
-                session->scpRecv_state = libssh2_NB_state_sent6;
+                session->scp->recv_state = libssh2_NB_state_sent6;
             }
 
-            if (session->scpRecv_state == libssh2_NB_state_sent6) {
-                rc = _libssh2_channel_write(session->scpRecv_channel, 0,
-                                            session->scpRecv_response, 1);
+            if (session->scp->recv_state == libssh2_NB_state_sent6) {
+                rc = _libssh2_channel_write(session->scp->recv_channel, 0,
+                                            session->scp->recv_response, 1);
                 if (rc == LIBSSH2_ERROR_EAGAIN) {
                     _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                    "Would block sending SCP ACK");
@@ -711,8 +783,9 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
                     goto scp_recv_error;
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                               "mode = 0%lo size = %ld", session->scpRecv_mode,
-                               session->scpRecv_size);
+                               "mode = 0%lo size = %ld",
+                               session->scp->recv_mode,
+                               session->scp->recv_size);
 
                 /* We *should* check that basename is valid, but why let that
                    stop us? */
@@ -720,42 +793,60 @@ scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
             }
         }
 
-        session->scpRecv_state = libssh2_NB_state_sent7;
+        session->scp->recv_state = libssh2_NB_state_sent7;
     }
 
     if (sb) {
         memset(sb, 0, sizeof(libssh2_struct_stat));
 
-        sb->st_mtime = session->scpRecv_mtime;
-        sb->st_atime = session->scpRecv_atime;
-        sb->st_size = session->scpRecv_size;
-        sb->st_mode = (unsigned short)session->scpRecv_mode;
+        sb->st_mtime = session->scp->recv_mtime;
+        sb->st_atime = session->scp->recv_atime;
+        sb->st_size = session->scp->recv_size;
+        sb->st_mode = (unsigned short)session->scp->recv_mode;
     }
 
-    session->scpRecv_state = libssh2_NB_state_idle;
-    return session->scpRecv_channel;
+    session->scp->recv_state = libssh2_NB_state_idle;
+    return session->scp->recv_channel;
 
   scp_recv_empty_channel:
     /* the code only jumps here as a result of a zero read from channel_read()
        so we check EOF status to avoid getting stuck in a loop */
-    if(libssh2_channel_eof(session->scpRecv_channel))
+    if(libssh2_channel_eof(session->scp->recv_channel))
         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                        "Unexpected channel close");
     else
-        return session->scpRecv_channel;
+        return session->scp->recv_channel;
     /* fall-through */
   scp_recv_error:
     tmp_err_code = session->err_code;
     tmp_err_msg = session->err_msg;
-    while (libssh2_channel_free(session->scpRecv_channel) ==
+    while (libssh2_channel_free(session->scp->recv_channel) ==
            LIBSSH2_ERROR_EAGAIN);
     session->err_code = tmp_err_code;
     session->err_msg = tmp_err_msg;
-    session->scpRecv_channel = NULL;
-    session->scpRecv_state = libssh2_NB_state_idle;
+    session->scp->recv_channel = NULL;
+    session->scp->recv_state = libssh2_NB_state_idle;
     return NULL;
 }
 
+/*
+ * scp_recv
+ *
+ * Run scp_recv_state() with the SCP state allocated for as long as it takes
+ */
+static LIBSSH2_CHANNEL *
+scp_recv(LIBSSH2_SESSION * session, const char *path, libssh2_struct_stat * sb)
+{
+    LIBSSH2_CHANNEL *channel;
+
+    if (scp_state_get(session))
+        return NULL;
+
+    channel = scp_recv_state(session, path, sb);
+    scp_state_put(session);
+    return channel;
+}
+
 /*
  * libssh2_scp_recv
  *
@@ -807,66 +898,66 @@ libssh2_scp_recv2(LIBSSH2_SESSION *session, const char *path, libssh2_struct_sta
 }
 
 /*
- * scp_send()
+ * scp_send_state()
  *
  * Send a file using SCP
  *
  */
 static LIBSSH2_CHANNEL *
-scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
-         libssh2_int64_t size, time_t mtime, time_t atime)
+scp_send_state(LIBSSH2_SESSION * session, const char *path, int mode,
+               libssh2_int64_t size, time_t mtime, time_t atime)
 {
     int cmd_len;
     int rc;
     int tmp_err_code;
     const char *tmp_err_msg;
 
-    if (session->scpSend_state == libssh2_NB_state_idle) {
-        session->scpSend_command_len =
+    if (session->scp->send_state == libssh2_NB_state_idle) {
+        session->scp->send_command_len =
             _libssh2_shell_quotedsize(path) + sizeof("scp -t ") +
             ((mtime || atime)?1:0);
 
-        session->scpSend_command =
-            LIBSSH2_ALLOC(session, session->scpSend_command_len);
+        session->scp->send_command =
+            LIBSSH2_ALLOC(session, session->scp->send_command_len);
 
-        if (!session->scpSend_command) {
+        if (!session->scp->send_command) {
             _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                            "Unable to allocate a command buffer for "
                            "SCP session");
             return NULL;
         }
 
-        snprintf((char *)session->scpSend_command,
-                 session->scpSend_command_len,
+        snprintf((char *)session->scp->send_command,
+                 session->scp->send_command_len,
                  "scp -%st ", (mtime || atime)?"p":"");
 
-        cmd_len = strlen((char *)session->scpSend_command);
+        cmd_len = strlen((char *)session->scp->send_command);
         cmd_len += shell_quotearg(path,
-                                  &session->scpSend_command[cmd_len],
-                                  session->scpSend_command_len - cmd_len);
+                                  &session->scp->send_command[cmd_len],
+                                  session->scp->send_command_len - cmd_len);
 
-        session->scpSend_command[cmd_len] = '\0';
-        session->scpSend_command_len = cmd_len + 1;
+        session->scp->send_command[cmd_len] = '\0';
+        session->scp->send_command_len = cmd_len + 1;
 
         _libssh2_debug(session, LIBSSH2_TRACE_SCP,
                        "Opening channel for SCP send");
         /* Allocate a channel */
 
-        session->scpSend_state = libssh2_NB_state_created;
+        session->scp->send_state = libssh2_NB_state_created;
     }
 
-    if (session->scpSend_state == libssh2_NB_state_created) {
-        session->scpSend_channel =
+    if (session->scp->send_state == libssh2_NB_state_created) {
+        session->scp->send_channel =
             _libssh2_channel_open(session, "session", sizeof("session") - 1,
                                   LIBSSH2_CHANNEL_WINDOW_DEFAULT,
                                   LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0);
-        if (!session->scpSend_channel) {
+        if (!session->scp->send_channel) {
             if (libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN) {
                 /* previous call set libssh2_session_last_error(), pass it
                    through */
-                LIBSSH2_FREE(session, session->scpSend_command);
-                session->scpSend_command = NULL;
-                session->scpSend_state = libssh2_NB_state_idle;
+                LIBSSH2_FREE(session, session->scp->send_command);
+                session->scp->send_command = NULL;
+                session->scp->send_state = libssh2_NB_state_idle;
             }
             else {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
@@ -875,15 +966,16 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
             return NULL;
         }
 
-        session->scpSend_state = libssh2_NB_state_sent;
+        session->scp->send_state = libssh2_NB_state_sent;
     }
 
-    if (session->scpSend_state == libssh2_NB_state_sent) {
+    if (session->scp->send_state == libssh2_NB_state_sent) {
         /* Request SCP for the desired file */
-        rc = _libssh2_channel_process_startup(session->scpSend_channel, "exec",
-                                              sizeof("exec") - 1,
-                                              (char *) session->scpSend_command,
-                                              session->scpSend_command_len);
+        rc = _libssh2_channel_process_startup(session->scp->send_channel,
+                                              "exec", sizeof("exec") - 1,
+                                              (char *)
+                                              session->scp->send_command,
+                                              session->scp->send_command_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block requesting SCP startup");
@@ -892,22 +984,22 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if (rc) {
             /* previous call set libssh2_session_last_error(), pass it
                through */
-            LIBSSH2_FREE(session, session->scpSend_command);
-            session->scpSend_command = NULL;
+            LIBSSH2_FREE(session, session->scp->send_command);
+            session->scp->send_command = NULL;
             _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                            "Unknown error while getting error string");
             goto scp_send_error;
         }
-        LIBSSH2_FREE(session, session->scpSend_command);
-        session->scpSend_command = NULL;
+        LIBSSH2_FREE(session, session->scp->send_command);
+        session->scp->send_command = NULL;
 
-        session->scpSend_state = libssh2_NB_state_sent1;
+        session->scp->send_state = libssh2_NB_state_sent1;
     }
 
-    if (session->scpSend_state == libssh2_NB_state_sent1) {
+    if (session->scp->send_state == libssh2_NB_state_sent1) {
         /* Wait for ACK */
-        rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                   (char *) session->scpSend_response, 1);
+        rc = _libssh2_channel_read(session->scp->send_channel, 0,
+                                   (char *)session->scp->send_response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block waiting for response from remote");
@@ -920,47 +1012,48 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if(!rc)
             /* remain in the same state */
             goto scp_send_empty_channel;
-        else if (session->scpSend_response[0] != 0) {
+        else if (session->scp->send_response[0] != 0) {
             _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                            "Invalid ACK response from remote");
             goto scp_send_error;
         }
         if (mtime || atime) {
             /* Send mtime and atime to be used for file */
-            session->scpSend_response_len =
-                snprintf((char *) session->scpSend_response,
+            session->scp->send_response_len =
+                snprintf((char *) session->scp->send_response,
                          LIBSSH2_SCP_RESPONSE_BUFLEN, "T%ld 0 %ld 0\n",
                          (long)mtime, (long)atime);
             _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sent %s",
-                           session->scpSend_response);
+                           session->scp->send_response);
         }
 
-        session->scpSend_state = libssh2_NB_state_sent2;
+        session->scp->send_state = libssh2_NB_state_sent2;
     }
 
     /* Send mtime and atime to be used for file */
     if (mtime || atime) {
-        if (session->scpSend_state == libssh2_NB_state_sent2) {
-            rc = _libssh2_channel_write(session->scpSend_channel, 0,
-                                        session->scpSend_response,
-                                        session->scpSend_response_len);
+        if (session->scp->send_state == libssh2_NB_state_sent2) {
+            rc = _libssh2_channel_write(session->scp->send_channel, 0,
+                                        session->scp->send_response,
+                                        session->scp->send_response_len);
             if (rc == LIBSSH2_ERROR_EAGAIN) {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                "Would block sending time data for SCP file");
                 return NULL;
-            } else if (rc != (int)session->scpSend_response_len) {
+            } else if (rc != (int)session->scp->send_response_len) {
                 _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                "Unable to send time data for SCP file");
                 goto scp_send_error;
             }
 
-            session->scpSend_state = libssh2_NB_state_sent3;
+            session->scp->send_state = libssh2_NB_state_sent3;
         }
 
-        if (session->scpSend_state == libssh2_NB_state_sent3) {
+        if (session->scp->send_state == libssh2_NB_state_sent3) {
             /* Wait for ACK */
-            rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                       (char *) session->scpSend_response, 1);
+            rc = _libssh2_channel_read(session->scp->send_channel, 0,
+                                       (char *)session->scp->send_response,
+                                       1);
             if (rc == LIBSSH2_ERROR_EAGAIN) {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                                "Would block waiting for response");
@@ -973,21 +1066,21 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
             else if(!rc)
                 /* remain in the same state */
                 goto scp_send_empty_channel;
-            else if (session->scpSend_response[0] != 0) {
+            else if (session->scp->send_response[0] != 0) {
                 _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                                "Invalid SCP ACK response");
                 goto scp_send_error;
             }
 
-            session->scpSend_state = libssh2_NB_state_sent4;
+            session->scp->send_state = libssh2_NB_state_sent4;
         }
     } else {
-        if (session->scpSend_state == libssh2_NB_state_sent2) {
-            session->scpSend_state = libssh2_NB_state_sent4;
+        if (session->scp->send_state == libssh2_NB_state_sent2) {
+            session->scp->send_state = libssh2_NB_state_sent4;
         }
     }
 
-    if (session->scpSend_state == libssh2_NB_state_sent4) {
+    if (session->scp->send_state == libssh2_NB_state_sent4) {
         /* Send mode, size, and basename */
         const char *base = strrchr(path, '/');
         if (base)
@@ -995,38 +1088,38 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else
             base = path;
 
-        session->scpSend_response_len =
-            snprintf((char *) session->scpSend_response,
+        session->scp->send_response_len =
+            snprintf((char *) session->scp->send_response,
                      LIBSSH2_SCP_RESPONSE_BUFLEN, "C0%o %"
                      LIBSSH2_INT64_T_FORMAT " %s\n", mode,
                      size, base);
         _libssh2_debug(session, LIBSSH2_TRACE_SCP, "Sent %s",
-                       session->scpSend_response);
+                       session->scp->send_response);
 
-        session->scpSend_state = libssh2_NB_state_sent5;
+        session->scp->send_state = libssh2_NB_state_sent5;
     }
 
-    if (session->scpSend_state == libssh2_NB_state_sent5) {
-        rc = _libssh2_channel_write(session->scpSend_channel, 0,
-                                    session->scpSend_response,
-                                    session->scpSend_response_len);
+    if (session->scp->send_state == libssh2_NB_state_sent5) {
+        rc = _libssh2_channel_write(session->scp->send_channel, 0,
+                                    session->scp->send_response,
+                                    session->scp->send_response_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block send core file data for SCP file");
             return NULL;
-        } else if (rc != (int)session->scpSend_response_len) {
+        } else if (rc != (int)session->scp->send_response_len) {
             _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                            "Unable to send core file data for SCP file");
             goto scp_send_error;
         }
 
-        session->scpSend_state = libssh2_NB_state_sent6;
+        session->scp->send_state = libssh2_NB_state_sent6;
     }
 
-    if (session->scpSend_state == libssh2_NB_state_sent6) {
+    if (session->scp->send_state == libssh2_NB_state_sent6) {
         /* Wait for ACK */
-        rc = _libssh2_channel_read(session->scpSend_channel, 0,
-                                   (char *) session->scpSend_response, 1);
+        rc = _libssh2_channel_read(session->scp->send_channel, 0,
+                                   (char *)session->scp->send_response, 1);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
                            "Would block waiting for response");
@@ -1040,12 +1133,13 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         else if (rc == 0)
             goto scp_send_empty_channel;
 
-        else if (session->scpSend_response[0] != 0) {
+        else if (session->scp->send_response[0] != 0) {
             size_t err_len;
             char *err_msg;
 
             err_len =
-                _libssh2_channel_packet_data_len(session->scpSend_channel, 0);
+                _libssh2_channel_packet_data_len(session->scp->send_channel,
+                                                 0);
             err_msg = LIBSSH2_ALLOC(session, err_len + 1);
             if (!err_msg) {
                 _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -1054,12 +1148,13 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
             }
 
             /* Read the remote error message */
-            rc = _libssh2_channel_read(session->scpSend_channel, 0,
+            rc = _libssh2_channel_read(session->scp->send_channel, 0,
                                        err_msg, err_len);
             if (rc > 0) {
                 err_msg[err_len]=0;
                 _libssh2_debug(session, LIBSSH2_TRACE_SCP,
-                               "got %02x %s", session->scpSend_response[0],
+                               "got %02x %s",
+                               session->scp->send_response[0],
                                err_msg);
             }
             LIBSSH2_FREE(session, err_msg);
@@ -1069,31 +1164,50 @@ scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
         }
     }
 
-    session->scpSend_state = libssh2_NB_state_idle;
-    return session->scpSend_channel;
+    session->scp->send_state = libssh2_NB_state_idle;
+    return session->scp->send_channel;
 
   scp_send_empty_channel:
     /* the code only jumps here as a result of a zero read from channel_read()
        so we check EOF status to avoid getting stuck in a loop */
-    if(libssh2_channel_eof(session->scpSend_channel)) {
+    if(libssh2_channel_eof(session->scp->send_channel)) {
         _libssh2_error(session, LIBSSH2_ERROR_SCP_PROTOCOL,
                        "Unexpected channel close");
     }
     else
-        return session->scpSend_channel;
+        return session->scp->send_channel;
     /* fall-through */
   scp_send_error:
     tmp_err_code = session->err_code;
     tmp_err_msg = session->err_msg;
-    while (libssh2_channel_free(session->scpSend_channel) ==
+    while (libssh2_channel_free(session->scp->send_channel) ==
            LIBSSH2_ERROR_EAGAIN);
     session->err_code = tmp_err_code;
     session->err_msg = tmp_err_msg;
-    session->scpSend_channel = NULL;
-    session->scpSend_state = libssh2_NB_state_idle;
+    session->scp->send_channel = NULL;
+    session->scp->send_state = libssh2_NB_state_idle;
     return NULL;
 }
 
+/*
+ * scp_send()
+ *
+ * Run scp_send_state() with the SCP state allocated for as long as it takes
+ */
+static LIBSSH2_CHANNEL *
+scp_send(LIBSSH2_SESSION * session, const char *path, int mode,
+         libssh2_int64_t size, time_t mtime, time_t atime)
+{
+    LIBSSH2_CHANNEL *channel;
+
+    if (scp_state_get(session))
+        return NULL;
+
+    channel = scp_send_state(session, path, mode, size, mtime, atime);
+    scp_state_put(session);
+    return channel;
+}
+
 /*
  * libssh2_scp_send_ex
  *
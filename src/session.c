@@ -44,6 +44,7 @@
 #endif
 #include <stdlib.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #ifdef HAVE_GETTIMEOFDAY
 #include <sys/time.h>
@@ -117,6 +118,7 @@ banner_receive(LIBSSH2_SESSION * session)
 
         ret = LIBSSH2_RECV(session, &c, 1,
                             LIBSSH2_SOCKET_RECV_FLAGS(session));
+        _libssh2_stats_io(session, 0, ret);
         if (ret < 0) {
             if(session->api_block_mode || (ret != -EAGAIN))
                 /* ignore EAGAIN when non-blocking */
@@ -231,6 +233,7 @@ banner_send(LIBSSH2_SESSION * session)
                         banner + session->banner_TxRx_total_send,
                         banner_len - session->banner_TxRx_total_send,
                         LIBSSH2_SOCKET_SEND_FLAGS(session));
+    _libssh2_stats_io(session, 1, ret);
     if (ret < 0)
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                        "Error sending %d bytes: %d",
@@ -495,6 +498,10 @@ libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
         session->abstract = abstract;
         session->api_timeout = 0; /* timeout-free API by default */
         session->api_block_mode = 1; /* blocking API by default */
+        session->flag.kex_guess = 1; /* guess the key exchange method */
+        session->packet.maxpayload = LIBSSH2_PACKET_MAXPAYLOAD;
+        session->packet.buf_want = PACKETBUFSIZE;
+        session->window_budget = LIBSSH2_WINDOW_BUDGET_DEFAULT;
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "New session resource allocated");
         _libssh2_init_if_needed ();
@@ -564,6 +571,41 @@ libssh2_session_callback_set(LIBSSH2_SESSION * session,
  * Utility function that waits for action on the socket. Returns 0 when ready
  * to run again or error on timeout.
  */
+static long pace_delay(LIBSSH2_SESSION *session, int ahead);
+
+#ifdef LIBSSH2_THREADS
+/*
+ * lock_shareable
+ *
+ * Whether other threads may have the session while this one waits on the
+ * socket. Not while a packet this thread made is partly sent, as it must
+ * be finished before any other goes out, nor in the middle of one of the
+ * calls that keep their state in the session instead of in a channel:
+ * another thread making the same call would pick up this one's state.
+ */
+static int lock_shareable(LIBSSH2_SESSION *session)
+{
+    if (session->packet.olen ||
+        (session->state & LIBSSH2_STATE_EXCHANGING_KEYS) || session->scp)
+        return 0;
+
+    return (session->open_state == libssh2_NB_state_idle) &&
+        (session->direct_state == libssh2_NB_state_idle) &&
+        (session->fwdLstn_state == libssh2_NB_state_idle) &&
+        (session->pkeyInit_state == libssh2_NB_state_idle) &&
+        (session->sftpInit_state == libssh2_NB_state_idle) &&
+        (session->packAdd_state == libssh2_NB_state_idle) &&
+        (session->userauth_list_state == libssh2_NB_state_idle) &&
+        (session->userauth_pswd_state == libssh2_NB_state_idle) &&
+        (session->userauth_host_state == libssh2_NB_state_idle) &&
+        (session->userauth_pblc_state == libssh2_NB_state_idle) &&
+        (session->userauth_kybd_state == libssh2_NB_state_idle) &&
+        (session->startup_state == libssh2_NB_state_idle) &&
+        (session->disconnect_state == libssh2_NB_state_idle) &&
+        (session->free_state == libssh2_NB_state_idle);
+}
+#endif
+
 int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
 {
     int rc;
@@ -572,6 +614,13 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
     int has_timeout;
     long ms_to_next = 0;
     long elapsed_ms;
+    long pace_us;
+    int paced = 0;
+#ifdef LIBSSH2_THREADS
+    int depth = 0;
+    int shared = 0;
+    int released = 0;
+#endif
 
     /* since libssh2 often sets EAGAIN internally before this function is
        called, we can decrease some amount of confusion in user programs by
@@ -579,6 +628,11 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
        being stored as error when a blocking function has returned */
     session->err_code = LIBSSH2_ERROR_NONE;
 
+    /* corked packets may be what the peer waits for before it answers */
+    rc = _libssh2_transport_flush(session);
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return rc;
+
     rc = libssh2_keepalive_send (session, &seconds_to_next);
     if (rc < 0)
         return rc;
@@ -615,6 +669,32 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
     else
         has_timeout = 0;
 
+    /* a paced write goes on when its time comes, not on socket activity */
+    pace_us = pace_delay(session, 1);
+    if ((pace_us >= 0) &&
+        (!has_timeout || ((pace_us + 999) / 1000 < ms_to_next))) {
+        ms_to_next = (pace_us + 999) / 1000;
+        has_timeout = 1;
+        paced = 1;
+    }
+
+#ifdef LIBSSH2_THREADS
+    if (session->lock && lock_shareable(session)) {
+        /* other threads may read what this one waits for, so it never
+           waits long before it looks again */
+        if (!has_timeout || (ms_to_next > LIBSSH2_LOCK_WAIT_MS)) {
+            ms_to_next = LIBSSH2_LOCK_WAIT_MS;
+            has_timeout = 1;
+            shared = 1;
+        }
+        depth = _libssh2_lock_wait_begin(session->lock);
+        if (depth < 0)
+            /* another thread waited on the socket meanwhile */
+            return 0;
+        released = 1;
+    }
+#endif
+
 #ifdef HAVE_POLL
     {
         struct pollfd sockets[1];
@@ -658,6 +738,16 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
                     has_timeout ? &tv : NULL);
     }
 #endif
+#ifdef LIBSSH2_THREADS
+    if (released) {
+        _libssh2_lock_wait_end(session->lock, depth);
+        if (!rc && shared)
+            return 0;
+    }
+#endif
+    if (!rc && paced)
+        /* time for the paced write */
+        return 0;
     if(rc <= 0) {
         /* timeout (or error), bail out with a timeout error */
         session->err_code = LIBSSH2_ERROR_TIMEOUT;
@@ -675,14 +765,17 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
     if (session->startup_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "session_startup for socket %d", sock);
-        if (LIBSSH2_INVALID_SOCKET == sock) {
+        if (session->flag.feed)
+            /* the socket, if any, is not touched */
+            sock = LIBSSH2_INVALID_SOCKET;
+        else if (LIBSSH2_INVALID_SOCKET == sock) {
             /* Did we forget something? */
             return _libssh2_error(session, LIBSSH2_ERROR_BAD_SOCKET,
                                   "Bad socket provided");
         }
         session->socket_fd = sock;
 
-        session->socket_prev_blockstate =
+        session->socket_prev_blockstate = !session->flag.feed &&
             !get_socket_nonblocking(session->socket_fd);
 
         if (session->socket_prev_blockstate) {
@@ -709,6 +802,17 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
     }
 
     if (session->startup_state == libssh2_NB_state_sent) {
+        /* KEXINIT, and a guess of the first key exchange packet, need not
+           wait for the server's banner */
+        rc = _libssh2_kex_begin(session, &session->startup_key_state);
+        if (rc)
+            return _libssh2_error(session, rc,
+                                  "Unable to exchange encryption keys");
+
+        session->startup_state = libssh2_NB_state_sent1;
+    }
+
+    if (session->startup_state == libssh2_NB_state_sent1) {
         do {
             rc = banner_receive(session);
             if (rc)
@@ -716,19 +820,19 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
                                       "Failed getting banner");
         } while(strncmp("SSH-", (char *)session->remote.banner, 4));
 
-        session->startup_state = libssh2_NB_state_sent1;
+        session->startup_state = libssh2_NB_state_sent2;
     }
 
-    if (session->startup_state == libssh2_NB_state_sent1) {
+    if (session->startup_state == libssh2_NB_state_sent2) {
         rc = _libssh2_kex_exchange(session, 0, &session->startup_key_state);
         if (rc)
             return _libssh2_error(session, rc,
                                   "Unable to exchange encryption keys");
 
-        session->startup_state = libssh2_NB_state_sent2;
+        session->startup_state = libssh2_NB_state_sent3;
     }
 
-    if (session->startup_state == libssh2_NB_state_sent2) {
+    if (session->startup_state == libssh2_NB_state_sent3) {
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "Requesting userauth service");
 
@@ -739,10 +843,10 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
         memcpy(session->startup_service + 5, "ssh-userauth",
                sizeof("ssh-userauth") - 1);
 
-        session->startup_state = libssh2_NB_state_sent3;
+        session->startup_state = libssh2_NB_state_sent4;
     }
 
-    if (session->startup_state == libssh2_NB_state_sent3) {
+    if (session->startup_state == libssh2_NB_state_sent4) {
         rc = _libssh2_transport_send(session, session->startup_service,
                                      sizeof("ssh-userauth") + 5 - 1,
                                      NULL, 0);
@@ -751,10 +855,10 @@ session_startup(LIBSSH2_SESSION *session, libssh2_socket_t sock)
                                   "Unable to ask for ssh-userauth service");
         }
 
-        session->startup_state = libssh2_NB_state_sent4;
+        session->startup_state = libssh2_NB_state_sent5;
     }
 
-    if (session->startup_state == libssh2_NB_state_sent4) {
+    if (session->startup_state == libssh2_NB_state_sent5) {
         rc = _libssh2_packet_require(session, SSH_MSG_SERVICE_ACCEPT,
                                      &session->startup_data,
                                      &session->startup_data_len, 0, NULL, 0,
@@ -863,6 +967,13 @@ session_free(LIBSSH2_SESSION *session)
         session->free_state = libssh2_NB_state_sent1;
     }
 
+    if (session->channel_hash) {
+        LIBSSH2_FREE(session, session->channel_hash);
+    }
+
+    /* stop the MAC workers before their keys and buffers go away */
+    _libssh2_transport_threads(session, 0);
+
     if (session->state & LIBSSH2_STATE_NEWKEYS) {
         /* hostkey */
         if (session->hostkey && session->hostkey->dtor) {
@@ -907,6 +1018,10 @@ session_free(LIBSSH2_SESSION *session)
         }
     }
 
+    if (session->bn_ctx) {
+        _libssh2_bn_ctx_free(session->bn_ctx);
+    }
+
     /* Free banner(s) */
     if (session->remote.banner) {
         LIBSSH2_FREE(session, session->remote.banner);
@@ -922,6 +1037,9 @@ session_free(LIBSSH2_SESSION *session)
     if (session->hostkey_prefs) {
         LIBSSH2_FREE(session, session->hostkey_prefs);
     }
+    if (session->comp_methods) {
+        LIBSSH2_FREE(session, session->comp_methods);
+    }
 
     if (session->local.kexinit) {
         LIBSSH2_FREE(session, session->local.kexinit);
@@ -967,6 +1085,9 @@ session_free(LIBSSH2_SESSION *session)
     if (session->userauth_list_data) {
         LIBSSH2_FREE(session, session->userauth_list_data);
     }
+    if (session->userauth_list_known) {
+        LIBSSH2_FREE(session, session->userauth_list_known);
+    }
     if (session->userauth_pswd_data) {
         LIBSSH2_FREE(session, session->userauth_pswd_data);
     }
@@ -991,6 +1112,9 @@ session_free(LIBSSH2_SESSION *session)
     if (session->userauth_pblc_method) {
         LIBSSH2_FREE(session, session->userauth_pblc_method);
     }
+    if (session->userauth_pblc_sign) {
+        LIBSSH2_FREE(session, session->userauth_pblc_sign);
+    }
     if (session->userauth_kybd_data) {
         LIBSSH2_FREE(session, session->userauth_kybd_data);
     }
@@ -1015,12 +1139,7 @@ session_free(LIBSSH2_SESSION *session)
     if (session->pkeyInit_data) {
         LIBSSH2_FREE(session, session->pkeyInit_data);
     }
-    if (session->scpRecv_command) {
-        LIBSSH2_FREE(session, session->scpRecv_command);
-    }
-    if (session->scpSend_command) {
-        LIBSSH2_FREE(session, session->scpSend_command);
-    }
+    _libssh2_scp_free(session);
     if (session->sftpInit_sftp) {
         LIBSSH2_FREE(session, session->sftpInit_sftp);
     }
@@ -1029,6 +1148,21 @@ session_free(LIBSSH2_SESSION *session)
     if (session->packet.total_num) {
         LIBSSH2_FREE(session, session->packet.payload);
     }
+    if (session->packet.outbuf) {
+        LIBSSH2_FREE(session, session->packet.outbuf);
+    }
+    if (session->packet.osegs) {
+        LIBSSH2_FREE(session, session->packet.osegs);
+    }
+    if (session->packet.buf) {
+        LIBSSH2_FREE(session, session->packet.buf);
+    }
+    if (session->feed_in) {
+        LIBSSH2_FREE(session, session->feed_in);
+    }
+    if (session->feed_out) {
+        LIBSSH2_FREE(session, session->feed_out);
+    }
 
     /* Cleanup all remaining packets */
     while ((pkg = _libssh2_list_first(&session->packets))) {
@@ -1039,8 +1173,7 @@ session_free(LIBSSH2_SESSION *session)
         _libssh2_list_remove(&pkg->node);
 
         /* free */
-        LIBSSH2_FREE(session, pkg->data);
-        LIBSSH2_FREE(session, pkg);
+        _libssh2_packet_free(session, pkg);
     }
     _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
          "Extra packets left %d", packets_left);
@@ -1063,6 +1196,15 @@ session_free(LIBSSH2_SESSION *session)
         LIBSSH2_FREE(session, (char *)session->err_msg);
     }
 
+    /* the last trace events */
+    if (session->trace_event_cb)
+        _libssh2_event_flush(session);
+    if (session->trace_events)
+        LIBSSH2_FREE(session, session->trace_events);
+    if (session->histograms)
+        LIBSSH2_FREE(session, session->histograms);
+
+    _libssh2_slab_clear(session);
     LIBSSH2_FREE(session, session);
 
     return 0;
@@ -1079,6 +1221,18 @@ libssh2_session_free(LIBSSH2_SESSION * session)
 {
     int rc;
 
+    /* a session on its way out is not shared anymore */
+#ifdef LIBSSH2_THREADS
+    _libssh2_lock_free(session);
+#endif
+    _libssh2_agent_forget(session);
+    if (session->group_entry)
+        libssh2_session_group_remove(session);
+    if (session->pool_entry) {
+        session->pool_entry->session = NULL;
+        session->pool_entry = NULL;
+    }
+
     BLOCK_ADJUST(rc, session, session_free(session) );
 
     return rc;
@@ -1124,9 +1278,19 @@ session_disconnect(LIBSSH2_SESSION *session, int reason,
         session->disconnect_state = libssh2_NB_state_created;
     }
 
-    rc = _libssh2_transport_send(session, session->disconnect_data,
-                                 session->disconnect_data_len,
-                                 (unsigned char *)lang, lang_len);
+    if (session->disconnect_state == libssh2_NB_state_created) {
+        rc = _libssh2_transport_send(session, session->disconnect_data,
+                                     session->disconnect_data_len,
+                                     (unsigned char *)lang, lang_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+
+        session->disconnect_state = libssh2_NB_state_sent;
+    }
+
+    /* the message may be queued, and must be out before the socket gets
+       closed */
+    rc = _libssh2_transport_flush(session);
     if (rc == LIBSSH2_ERROR_EAGAIN)
         return rc;
 
@@ -1323,6 +1487,59 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     case LIBSSH2_FLAG_COMPRESS:
         session->flag.compress = value;
         break;
+    case LIBSSH2_FLAG_KEX_GUESS:
+        session->flag.kex_guess = value;
+        break;
+    case LIBSSH2_FLAG_COMPRESS_LEVEL:
+        if (value < 0 || value > 9)
+            return LIBSSH2_ERROR_INVAL;
+        session->flag.compress_level = value;
+        break;
+    case LIBSSH2_FLAG_CHANNEL_PIPELINE:
+        session->flag.channel_pipeline = value;
+        break;
+    case LIBSSH2_FLAG_STATS_TIMING:
+        session->flag.stats_timing = value;
+        break;
+    case LIBSSH2_FLAG_HISTOGRAMS:
+        /* setting it again starts them over */
+        if (session->histograms) {
+            LIBSSH2_FREE(session, session->histograms);
+            session->histograms = NULL;
+        }
+        if (value) {
+            session->histograms =
+                LIBSSH2_CALLOC(session, LIBSSH2_HISTOGRAM_COUNT *
+                               sizeof(LIBSSH2_HISTOGRAM));
+            if (!session->histograms)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate histograms");
+        }
+        break;
+    case LIBSSH2_FLAG_RELEASE_BUFFERS:
+        session->flag.release_buffers = value;
+        break;
+    case LIBSSH2_FLAG_WINDOW_MINADJUST:
+        if (value < 0)
+            return LIBSSH2_ERROR_INVAL;
+        session->flag.window_minadjust = value;
+        break;
+    case LIBSSH2_FLAG_FEED:
+        /* the transport can't switch over once it got going */
+        if ((session->startup_state != libssh2_NB_state_idle) ||
+            (session->state & LIBSSH2_STATE_NEWKEYS))
+            return LIBSSH2_ERROR_BAD_USE;
+        session->flag.feed = value;
+        if (value)
+            /* there is no socket to wait for */
+            session->api_block_mode = 0;
+        break;
+    case LIBSSH2_FLAG_PUBLICKEY_DIRECT:
+        session->flag.publickey_direct = value;
+        break;
+    case LIBSSH2_FLAG_SEND_QUEUE:
+        session->flag.send_queue = value;
+        break;
     default:
         /* unknown flag */
         return LIBSSH2_ERROR_INVAL;
@@ -1331,6 +1548,175 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     return LIBSSH2_ERROR_NONE;
 }
 
+/*
+ * _libssh2_feed_send
+ *
+ * The send of a session with LIBSSH2_FLAG_FEED. What is sent like this
+ * waits for libssh2_session_feed_out() ahead of the packets in the output
+ * buffer, which don't go through here.
+ */
+ssize_t
+_libssh2_feed_send(LIBSSH2_SESSION *session, const void *buffer,
+                   size_t length)
+{
+    unsigned char *out = LIBSSH2_REALLOC(session, session->feed_out,
+                                         session->feed_out_len + length);
+    if (!out)
+        return -ENOMEM;
+
+    memcpy(out + session->feed_out_len, buffer, length);
+    session->feed_out = out;
+    session->feed_out_len += length;
+    return (ssize_t)length;
+}
+
+/*
+ * _libssh2_feed_recv
+ *
+ * The recv of a session with LIBSSH2_FLAG_FEED, out of what
+ * libssh2_session_feed_in() got
+ */
+ssize_t
+_libssh2_feed_recv(LIBSSH2_SESSION *session, void *buffer, size_t length)
+{
+    size_t n = session->feed_in_len - session->feed_in_off;
+
+    if (!n)
+        return session->feed_in_eof ? 0 : -EAGAIN;
+
+    if (n > length)
+        n = length;
+    memcpy(buffer, session->feed_in + session->feed_in_off, n);
+    session->feed_in_off += n;
+    if (session->feed_in_off == session->feed_in_len)
+        session->feed_in_off = session->feed_in_len = 0;
+    return (ssize_t)n;
+}
+
+/* libssh2_session_feed_in
+ *
+ * Hand received bytes to a session with LIBSSH2_FLAG_FEED set. Takes up to
+ * LIBSSH2_FEED_IN_MAX bytes that were not read yet and returns how many of
+ * them it took. A NULL 'buffer' tells that the peer closed the connection.
+ */
+LIBSSH2_API ssize_t
+libssh2_session_feed_in(LIBSSH2_SESSION *session, const char *buffer,
+                        size_t length)
+{
+    size_t held;
+
+    if (!session || !session->flag.feed)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_LOCK(session->lock);
+    if (!buffer) {
+        session->feed_in_eof = 1;
+        BLOCK_UNLOCK(session->lock);
+        return 0;
+    }
+
+    held = session->feed_in_len - session->feed_in_off;
+    if (length > LIBSSH2_FEED_IN_MAX - held)
+        length = LIBSSH2_FEED_IN_MAX - held;
+
+    if (session->feed_in_len + length > session->feed_in_size) {
+        /* make room at the end, first by moving what is left to the
+           front */
+        if (session->feed_in_off) {
+            memmove(session->feed_in,
+                    session->feed_in + session->feed_in_off, held);
+            session->feed_in_off = 0;
+            session->feed_in_len = held;
+        }
+        if (held + length > session->feed_in_size) {
+            unsigned char *in = LIBSSH2_REALLOC(session, session->feed_in,
+                                                held + length);
+            if (!in) {
+                BLOCK_UNLOCK(session->lock);
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate feed buffer");
+            }
+            session->feed_in = in;
+            session->feed_in_size = held + length;
+        }
+    }
+
+    memcpy(session->feed_in + session->feed_in_len, buffer, length);
+    session->feed_in_len += length;
+    BLOCK_UNLOCK(session->lock);
+    return (ssize_t)length;
+}
+
+/* libssh2_session_feed_out
+ *
+ * Copy up to 'length' bytes that a session with LIBSSH2_FLAG_FEED set has
+ * to send into 'buffer'. Returns how many it copied, 0 when there are none.
+ */
+LIBSSH2_API ssize_t
+libssh2_session_feed_out(LIBSSH2_SESSION *session, char *buffer,
+                         size_t length)
+{
+    size_t n = 0;
+    size_t taken;
+
+    if (!session || !buffer || !session->flag.feed)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_LOCK(session->lock);
+    if (session->feed_out_len) {
+        /* the banner goes ahead of any packet */
+        n = session->feed_out_len < length ? session->feed_out_len : length;
+        memcpy(buffer, session->feed_out, n);
+        session->feed_out_len -= n;
+        memmove(session->feed_out, session->feed_out + n,
+                session->feed_out_len);
+    }
+    if (!session->feed_out_len) {
+        taken = _libssh2_transport_take(session, (unsigned char *)buffer + n,
+                                        length - n);
+        if (taken)
+            /* counted like a send that took this much */
+            _libssh2_stats_io(session, 1, (ssize_t)taken);
+        n += taken;
+    }
+    BLOCK_UNLOCK(session->lock);
+    return (ssize_t)n;
+}
+
+/* libssh2_session_stats
+ *
+ * Copy the counters the session kept since it was created
+ */
+LIBSSH2_API int
+libssh2_session_stats(LIBSSH2_SESSION *session, LIBSSH2_SESSION_STATS *stats)
+{
+    if (!session || !stats)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    *stats = session->stats;
+    return 0;
+}
+
+/* libssh2_session_histogram
+ *
+ * Copy one of the latency histograms, all zero unless LIBSSH2_FLAG_HISTOGRAMS
+ * is set
+ */
+LIBSSH2_API int
+libssh2_session_histogram(LIBSSH2_SESSION *session, int which,
+                          LIBSSH2_HISTOGRAM *histogram)
+{
+    if (!session || !histogram || (which < 0) ||
+        (which >= LIBSSH2_HISTOGRAM_COUNT))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if (session->histograms)
+        *histogram = session->histograms[which];
+    else
+        memset(histogram, 0, sizeof(*histogram));
+    return 0;
+}
+
 /* _libssh2_session_set_blocking
  *
  * Set a session's blocking mode on or off, return the previous status when
@@ -1341,6 +1727,9 @@ int
 _libssh2_session_set_blocking(LIBSSH2_SESSION *session, int blocking)
 {
     int bl = session->api_block_mode;
+    if (session->flag.feed)
+        /* nothing to block on, the application feeds the session */
+        blocking = 0;
     _libssh2_debug(session, LIBSSH2_TRACE_CONN,
                    "Setting blocking mode %s", blocking?"ON":"OFF");
     session->api_block_mode = blocking;
@@ -1379,6 +1768,7 @@ LIBSSH2_API void
 libssh2_session_set_timeout(LIBSSH2_SESSION * session, long timeout)
 {
     session->api_timeout = timeout;
+    _libssh2_group_update(session);
 }
 
 /* libssh2_session_get_timeout
@@ -1391,6 +1781,115 @@ libssh2_session_get_timeout(LIBSSH2_SESSION * session)
     return session->api_timeout;
 }
 
+/* libssh2_session_recv_buffer
+ *
+ * Set how many bytes the session asks the socket for at a time, 0 for the
+ * default. Takes effect the next time the receive buffer is empty enough to
+ * be resized.
+ */
+LIBSSH2_API void
+libssh2_session_recv_buffer(LIBSSH2_SESSION * session, size_t bytes)
+{
+    if (!bytes)
+        bytes = PACKETBUFSIZE;
+    else if (bytes < PACKETBUFSIZE_MIN)
+        bytes = PACKETBUFSIZE_MIN;
+    else if (bytes > PACKETBUFSIZE_MAX)
+        bytes = PACKETBUFSIZE_MAX;
+    session->packet.buf_want = bytes;
+}
+
+/* libssh2_session_rekey_limit
+ *
+ * Set after how many bytes or packets in either direction the session starts
+ * a key re-exchange by itself, 0 for the defaults
+ */
+LIBSSH2_API void
+libssh2_session_rekey_limit(LIBSSH2_SESSION * session, libssh2_uint64_t bytes,
+                            unsigned int packets)
+{
+    session->rekey_limit_bytes = bytes;
+    session->rekey_limit_packets = packets;
+}
+
+/* libssh2_session_thread_safe
+ *
+ * Allow the session's channels to be used from several threads at once
+ */
+LIBSSH2_API int
+libssh2_session_thread_safe(LIBSSH2_SESSION * session, int enable)
+{
+#ifdef LIBSSH2_THREADS
+    if (!enable) {
+        _libssh2_lock_free(session);
+        return 0;
+    }
+    if (_libssh2_lock_init(session))
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate the session lock");
+    return 0;
+#else
+    if (!enable)
+        return 0;
+    return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                          "libssh2 was built without thread support");
+#endif
+}
+
+/* libssh2_session_crypto_threads
+ *
+ * Set how many worker threads check the MACs of incoming packets ahead of
+ * time, 0 for none
+ */
+LIBSSH2_API int
+libssh2_session_crypto_threads(LIBSSH2_SESSION * session, int threads)
+{
+    int rc = _libssh2_transport_threads(session, threads);
+
+    if (rc == LIBSSH2_ERROR_METHOD_NOT_SUPPORTED)
+        return _libssh2_error(session, rc,
+                              "libssh2 was built without thread support");
+    if (rc)
+        return _libssh2_error(session, rc,
+                              "Unable to start crypto worker threads");
+    return 0;
+}
+
+/* libssh2_session_read_budget
+ *
+ * Limit the receive window granted to the session's channels together, and
+ * with it the channel data that can pile up unread. 0 removes the limit.
+ */
+LIBSSH2_API void
+libssh2_session_read_budget(LIBSSH2_SESSION * session, size_t bytes)
+{
+    session->read_budget = bytes;
+}
+
+/* libssh2_session_read_buffered
+ *
+ * Returns the number of bytes of channel data received but not read yet
+ */
+LIBSSH2_API size_t
+libssh2_session_read_buffered(LIBSSH2_SESSION * session)
+{
+    return session->read_buffered;
+}
+
+/* libssh2_session_window_mode
+ *
+ * Set how the receive windows of the session's channels are sized, and how
+ * many bytes of window LIBSSH2_WINDOW_AUTO may hand out in total (0 for the
+ * default).
+ */
+LIBSSH2_API void
+libssh2_session_window_mode(LIBSSH2_SESSION * session, int mode,
+                            size_t budget)
+{
+    session->window_mode = mode;
+    session->window_budget = budget ? budget : LIBSSH2_WINDOW_BUDGET_DEFAULT;
+}
+
 /*
  * libssh2_poll_channel_read
  *
@@ -1400,30 +1899,19 @@ libssh2_session_get_timeout(LIBSSH2_SESSION * session)
 LIBSSH2_API int
 libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
-    LIBSSH2_SESSION *session;
-    LIBSSH2_PACKET *packet;
-
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    session = channel->session;
-    packet = _libssh2_list_first(&session->packets);
-
-    while (packet) {
-        if ( channel->local.id == _libssh2_ntohu32(packet->data + 1)) {
-            if ( extended == 1 &&
-                 (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA
-                  || packet->data[0] == SSH_MSG_CHANNEL_DATA )) {
-                return 1;
-            } else if ( extended == 0 &&
-                        packet->data[0] == SSH_MSG_CHANNEL_DATA) {
-                return 1;
-            }
-            /* else - no data of any type is ready to be read */
-        }
-        packet = _libssh2_list_next(&packet->node);
-    }
+    if ( extended == 1 )
+        return (_libssh2_list_first(&channel->data_queue) ||
+                _libssh2_list_first(&channel->ext_queue)) ? 1 : 0;
 
+    /* merged extended data shares the data queue, so count the bytes of the
+       standard stream instead of looking for its packets */
+    if ( extended == 0 )
+        return (channel->read_avail > channel->ext_avail) ? 1 : 0;
+
+    /* else - no data of any type is ready to be read */
     return 0;
 }
 
@@ -1760,6 +2248,471 @@ libssh2_poll(LIBSSH2_POLLFD * fds, unsigned int nfds, long timeout)
     return active_fds;
 }
 
+/*
+ * transport_ready
+ *
+ * Read whatever the socket has for us without blocking, then report the
+ * channels queued as readable or writable
+ */
+static int
+transport_ready(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL **channels,
+                unsigned int max, int writable)
+{
+    unsigned int count = 0;
+    int rc;
+
+    if (!session || (max && !channels))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while (rc > 0);
+
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(session, rc, "Failure reading from transport");
+
+    while (count < max) {
+        LIBSSH2_CHANNEL *channel = _libssh2_channel_ready_pop(session,
+                                                              writable);
+        if (!channel)
+            break;
+        channels[count++] = channel;
+    }
+
+    return (int)count;
+}
+
+/*
+ * libssh2_transport_read
+ *
+ * Return the channels that got data, EOF or close since the last call
+ */
+LIBSSH2_API int
+libssh2_transport_read(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL **channels,
+                       unsigned int max)
+{
+    return transport_ready(session, channels, max, 0);
+}
+
+/*
+ * libssh2_transport_write
+ *
+ * Return the channels whose window opened since the last call
+ */
+LIBSSH2_API int
+libssh2_transport_write(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL **channels,
+                        unsigned int max)
+{
+    return transport_ready(session, channels, max, 1);
+}
+
+/*
+ * libssh2_pollset_init
+ *
+ * Create an empty poll set for the channels and listeners of a session
+ */
+LIBSSH2_API LIBSSH2_POLLSET *
+libssh2_pollset_init(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POLLSET *set = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_POLLSET));
+
+    if (!set) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for poll set");
+        return NULL;
+    }
+    set->session = session;
+    _libssh2_list_init(&set->ready);
+    _libssh2_list_init(&set->idle);
+    return set;
+}
+
+/*
+ * pollset_entry_of
+ *
+ * Where the channel or listener a LIBSSH2_POLLFD names keeps its poll set
+ * registration
+ */
+static struct _libssh2_pollset_entry **
+pollset_entry_of(const LIBSSH2_POLLFD *fd)
+{
+    switch (fd->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        return fd->fd.channel ? &fd->fd.channel->poll_entry : NULL;
+    case LIBSSH2_POLLFD_LISTENER:
+        return fd->fd.listener ? &fd->fd.listener->poll_entry : NULL;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * _libssh2_pollset_mark
+ *
+ * Something happened to a registered channel or listener, have the next
+ * libssh2_pollset_ready() look at it
+ */
+void
+_libssh2_pollset_mark(struct _libssh2_pollset_entry *entry)
+{
+    LIBSSH2_POLLSET *set = entry->set;
+
+    if (entry->node.head == &set->ready)
+        return;
+
+    _libssh2_list_remove(&entry->node);
+    _libssh2_list_add(&set->ready, &entry->node);
+    set->nready++;
+}
+
+/*
+ * _libssh2_pollset_forget
+ *
+ * A registered channel or listener goes away
+ */
+void
+_libssh2_pollset_forget(struct _libssh2_pollset_entry *entry)
+{
+    LIBSSH2_POLLSET *set = entry->set;
+
+    if (entry->node.head == &set->ready)
+        set->nready--;
+    _libssh2_list_remove(&entry->node);
+    *pollset_entry_of(&entry->fd) = NULL;
+    LIBSSH2_FREE(set->session, entry);
+}
+
+/*
+ * libssh2_pollset_add
+ *
+ * Register a channel or listener, or change the events it is watched for
+ */
+LIBSSH2_API int
+libssh2_pollset_add(LIBSSH2_POLLSET *set, const LIBSSH2_POLLFD *fd)
+{
+    struct _libssh2_pollset_entry **where;
+    struct _libssh2_pollset_entry *entry;
+
+    if (!set || !fd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    where = pollset_entry_of(fd);
+    if (!where)
+        return _libssh2_error(set->session, LIBSSH2_ERROR_INVAL,
+                              "Only channels and listeners go in a poll set");
+
+    entry = *where;
+    if (entry && (entry->set != set))
+        return _libssh2_error(set->session, LIBSSH2_ERROR_BAD_USE,
+                              "Already registered in another poll set");
+
+    if (!entry) {
+        if (((fd->type == LIBSSH2_POLLFD_CHANNEL) ?
+             fd->fd.channel->session : fd->fd.listener->session) !=
+            set->session)
+            return _libssh2_error(set->session, LIBSSH2_ERROR_BAD_USE,
+                                  "Belongs to another session");
+
+        entry = LIBSSH2_CALLOC(set->session,
+                               sizeof(struct _libssh2_pollset_entry));
+        if (!entry)
+            return _libssh2_error(set->session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for poll set "
+                                  "entry");
+        entry->set = set;
+        entry->fd.type = fd->type;
+        entry->fd.fd = fd->fd;
+        _libssh2_list_add(&set->idle, &entry->node);
+        *where = entry;
+    }
+    entry->fd.events = fd->events;
+
+    /* it may be ready already */
+    _libssh2_pollset_mark(entry);
+    return 0;
+}
+
+/*
+ * libssh2_pollset_remove
+ *
+ * Stop watching a channel or listener
+ */
+LIBSSH2_API int
+libssh2_pollset_remove(LIBSSH2_POLLSET *set, const LIBSSH2_POLLFD *fd)
+{
+    struct _libssh2_pollset_entry **where;
+
+    if (!set || !fd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    where = pollset_entry_of(fd);
+    if (!where || !*where || ((*where)->set != set))
+        return _libssh2_error(set->session, LIBSSH2_ERROR_INVAL,
+                              "Not registered in this poll set");
+
+    _libssh2_pollset_forget(*where);
+    return 0;
+}
+
+/*
+ * libssh2_pollset_fd
+ *
+ * The socket to watch with poll(), epoll or kqueue in place of the poll set
+ */
+LIBSSH2_API libssh2_socket_t
+libssh2_pollset_fd(LIBSSH2_POLLSET *set)
+{
+    return set->session->socket_fd;
+}
+
+/*
+ * pollset_revents
+ *
+ * What a registered channel or listener has to report right now
+ */
+static unsigned long
+pollset_revents(struct _libssh2_pollset_entry *entry)
+{
+    const LIBSSH2_POLLFD *fd = &entry->fd;
+    unsigned long revents = 0;
+    int closed = (entry->set->session->socket_state ==
+                  LIBSSH2_SOCKET_DISCONNECTED);
+
+    if (fd->type == LIBSSH2_POLLFD_CHANNEL) {
+        LIBSSH2_CHANNEL *channel = fd->fd.channel;
+
+        if ((fd->events & LIBSSH2_POLLFD_POLLIN) &&
+            libssh2_poll_channel_read(channel, 0))
+            revents |= LIBSSH2_POLLFD_POLLIN;
+        if ((fd->events & LIBSSH2_POLLFD_POLLEXT) &&
+            libssh2_poll_channel_read(channel, 1))
+            revents |= LIBSSH2_POLLFD_POLLEXT;
+        if ((fd->events & LIBSSH2_POLLFD_POLLOUT) &&
+            poll_channel_write(channel))
+            revents |= LIBSSH2_POLLFD_POLLOUT;
+        if (channel->remote.close || channel->local.close)
+            revents |= LIBSSH2_POLLFD_CHANNEL_CLOSED;
+        if (closed)
+            revents |= LIBSSH2_POLLFD_CHANNEL_CLOSED |
+                LIBSSH2_POLLFD_SESSION_CLOSED;
+    }
+    else {
+        if ((fd->events & LIBSSH2_POLLFD_POLLIN) &&
+            poll_listener_queued(fd->fd.listener))
+            revents |= LIBSSH2_POLLFD_POLLIN;
+        if (closed)
+            revents |= LIBSSH2_POLLFD_LISTENER_CLOSED |
+                LIBSSH2_POLLFD_SESSION_CLOSED;
+    }
+    return revents;
+}
+
+/*
+ * pollset_ready
+ *
+ * Read whatever the socket has for us without blocking, then report the
+ * entries on the ready list that have something to report. Those that do
+ * go to the back of the list and are looked at again next time, the others
+ * go to the idle list until something happens to them.
+ */
+static int
+pollset_ready(LIBSSH2_POLLSET *set, LIBSSH2_POLLFD *fds, unsigned int max)
+{
+    LIBSSH2_SESSION *session = set->session;
+    unsigned int count = 0;
+    unsigned int scan;
+    int rc;
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while (rc > 0);
+
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN) &&
+        (session->socket_state != LIBSSH2_SOCKET_DISCONNECTED))
+        return _libssh2_error(session, rc, "Failure reading from transport");
+
+    if (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED) {
+        /* everything has that to report */
+        struct _libssh2_pollset_entry *entry;
+        while ((entry = _libssh2_list_first(&set->idle)))
+            _libssh2_pollset_mark(entry);
+    }
+
+    for (scan = set->nready; scan && (count < max); scan--) {
+        struct _libssh2_pollset_entry *entry =
+            _libssh2_list_first(&set->ready);
+        unsigned long revents = pollset_revents(entry);
+
+        _libssh2_list_remove(&entry->node);
+        if (revents) {
+            fds[count] = entry->fd;
+            fds[count].revents = revents;
+            count++;
+            _libssh2_list_add(&set->ready, &entry->node);
+        }
+        else {
+            _libssh2_list_add(&set->idle, &entry->node);
+            set->nready--;
+        }
+    }
+
+    return (int)count;
+}
+
+/*
+ * libssh2_pollset_ready
+ *
+ * Fill in 'fds' with the registered channels and listeners that are ready,
+ * never blocks
+ */
+LIBSSH2_API int
+libssh2_pollset_ready(LIBSSH2_POLLSET *set, LIBSSH2_POLLFD *fds,
+                      unsigned int max)
+{
+    struct _libssh2_lock *lock;
+    int rc;
+
+    if (!set || (max && !fds))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    lock = set->session->lock;
+    BLOCK_LOCK(lock);
+    rc = pollset_ready(set, fds, max);
+    BLOCK_UNLOCK(lock);
+    return rc;
+}
+
+/*
+ * libssh2_pollset_free
+ *
+ * Free a poll set, the channels and listeners in it are left alone
+ */
+LIBSSH2_API void
+libssh2_pollset_free(LIBSSH2_POLLSET *set)
+{
+    struct _libssh2_pollset_entry *entry;
+
+    if (!set)
+        return;
+
+    while ((entry = _libssh2_list_first(&set->ready)))
+        _libssh2_pollset_forget(entry);
+    while ((entry = _libssh2_list_first(&set->idle)))
+        _libssh2_pollset_forget(entry);
+    LIBSSH2_FREE(set->session, set);
+}
+
+/*
+ * libssh2_session_flush
+ *
+ * Send the packets corked channels left waiting, along with the window
+ * adjustments channels have queued
+ */
+static int
+session_flush(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel;
+    int rc;
+
+    /* the window adjustments channels queued go out in the same send */
+    for (channel = _libssh2_list_first(&session->channels); channel;
+         channel = _libssh2_list_next(&channel->node)) {
+        rc = _libssh2_channel_adjust_flush(channel);
+        if (rc)
+            return rc;
+    }
+
+    return _libssh2_transport_flush(session);
+}
+
+LIBSSH2_API int
+libssh2_session_flush(LIBSSH2_SESSION *session)
+{
+    int rc;
+
+    BLOCK_ADJUST(rc, session, session_flush(session));
+    return rc;
+}
+
+/*
+ * _libssh2_pace_init
+ *
+ * Set up a token bucket, which starts out full once it is first used
+ */
+void
+_libssh2_pace_init(struct pace_bucket *bucket, libssh2_uint64_t rate,
+                   size_t burst)
+{
+    if (!burst) {
+        burst = (size_t)(rate / 100);
+        if (burst < LIBSSH2_PACE_BURST_MIN)
+            burst = LIBSSH2_PACE_BURST_MIN;
+    }
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->credit = 0;
+    bucket->last_us = 0;
+}
+
+/*
+ * libssh2_session_pace
+ *
+ * Limit the data sent on all channels together to 'rate' bytes per second
+ */
+LIBSSH2_API int
+libssh2_session_pace(LIBSSH2_SESSION *session, libssh2_uint64_t rate,
+                     size_t burst)
+{
+    if(!session)
+        return LIBSSH2_ERROR_BAD_USE;
+    _libssh2_pace_init(&session->pace, rate, burst);
+    return 0;
+}
+
+/*
+ * pace_delay
+ *
+ * Microseconds until the first channel write held back by pacing may go, 0
+ * if one may go now, or -1 if none is held back. With 'ahead' set, only
+ * those that have to wait count.
+ */
+static long
+pace_delay(LIBSSH2_SESSION *session, int ahead)
+{
+    LIBSSH2_CHANNEL *channel;
+    libssh2_uint64_t now = _libssh2_time_us();
+    long delay = -1;
+
+    for (channel = _libssh2_list_first(&session->channels); channel;
+         channel = _libssh2_list_next(&channel->node)) {
+        long wait;
+
+        if (!channel->pace_until || (ahead && (channel->pace_until <= now)))
+            continue;
+        if (channel->pace_until <= now)
+            return 0;
+        wait = (channel->pace_until - now > LONG_MAX) ? LONG_MAX :
+            (long)(channel->pace_until - now);
+        if ((delay < 0) || (wait < delay))
+            delay = wait;
+    }
+    return delay;
+}
+
+/*
+ * libssh2_session_pace_delay
+ *
+ * How long until a write held back by pacing can go on, for event loops to
+ * wait on along with libssh2_session_block_directions()
+ */
+LIBSSH2_API long
+libssh2_session_pace_delay(LIBSSH2_SESSION *session)
+{
+    if(!session)
+        return -1;
+    return pace_delay(session, 0);
+}
+
 /*
  * libssh2_session_block_directions
  *
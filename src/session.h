@@ -39,6 +39,27 @@
  * OF SUCH DAMAGE.
  */
 
+#include "thread.h"
+
+/* Sessions made thread safe with libssh2_session_thread_safe() are locked
+   for the duration of each call. The lock is looked up before the call as
+   that may free what 'sess' is reached through. */
+#ifdef LIBSSH2_THREADS
+#define BLOCK_LOCK(lock) \
+    do { \
+       if(lock) \
+           _libssh2_lock_enter(lock); \
+    } while(0)
+#define BLOCK_UNLOCK(lock) \
+    do { \
+       if(lock) \
+           _libssh2_lock_leave(lock); \
+    } while(0)
+#else
+#define BLOCK_LOCK(lock) do { (void)lock; } while(0)
+#define BLOCK_UNLOCK(lock) do { } while(0)
+#endif
+
 /* Conveniance-macros to allow code like this;
 
    int rc = BLOCK_ADJUST(rc, session, session_startup(session, sock) );
@@ -54,6 +75,8 @@
 #define BLOCK_ADJUST(rc,sess,x) \
     do { \
        time_t entry_time = time (NULL); \
+       struct _libssh2_lock *block_lock = sess->lock; \
+       BLOCK_LOCK(block_lock); \
        do { \
           rc = x; \
           /* the order of the check below is important to properly deal with \
@@ -62,6 +85,7 @@
               break; \
           rc = _libssh2_wait_socket(sess, entry_time);  \
        } while(!rc);   \
+       BLOCK_UNLOCK(block_lock); \
     } while(0)
 
 /*
@@ -73,7 +97,9 @@
 #define BLOCK_ADJUST_ERRNO(ptr,sess,x) \
     do { \
        time_t entry_time = time (NULL); \
+       struct _libssh2_lock *block_lock = sess->lock; \
        int rc; \
+       BLOCK_LOCK(block_lock); \
        do { \
            ptr = x; \
            if(!sess->api_block_mode || \
@@ -82,11 +108,28 @@
                break; \
            rc = _libssh2_wait_socket(sess, entry_time); \
         } while(!rc); \
+       BLOCK_UNLOCK(block_lock); \
     } while(0)
 
 
 int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t entry_time);
 
+/* the send and recv of sessions with LIBSSH2_FLAG_FEED, see LIBSSH2_SEND */
+ssize_t _libssh2_feed_send(LIBSSH2_SESSION *session, const void *buffer,
+                           size_t length);
+ssize_t _libssh2_feed_recv(LIBSSH2_SESSION *session, void *buffer,
+                           size_t length);
+
+/* a channel or listener in a poll set got something to report, or goes
+   away */
+void _libssh2_pollset_mark(struct _libssh2_pollset_entry *entry);
+void _libssh2_pollset_forget(struct _libssh2_pollset_entry *entry);
+
+/* set up the token bucket of libssh2_session_pace() or
+   libssh2_channel_pace() */
+void _libssh2_pace_init(struct pace_bucket *bucket, libssh2_uint64_t rate,
+                        size_t burst);
+
 /* this is the lib-internal set blocking function */
 int _libssh2_session_set_blocking(LIBSSH2_SESSION * session, int blocking);
 
@@ -38,12 +38,22 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 
 #include "libssh2_priv.h"
 #include "libssh2_sftp.h"
 #include "channel.h"
 #include "session.h"
 #include "sftp.h"
+#include "misc.h"
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 /* Note: Version 6 was documented at the time of writing
  * However it was marked as "DO NOT IMPLEMENT" due to pending changes
@@ -90,13 +100,18 @@
 #define SSH_FXE_STATVFS_ST_NOSUID               0x00000002
 
 /* This is the maximum packet length to accept, as larger than this indicate
-   some kind of server problem. */
-#define LIBSSH2_SFTP_PACKET_MAXLEN  80000
+   some kind of server problem. It fits the largest FXP_DATA asked for. */
+#define LIBSSH2_SFTP_PACKET_MAXLEN  (LIBSSH2_SFTP_MAX_RW_SIZE + 1024)
 
 static int sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
                            uint32_t request_id, unsigned char **data,
                            size_t *data_len);
 static void sftp_packet_flush(LIBSSH2_SFTP *sftp);
+static LIBSSH2_SFTP_OP *sftp_op_new(LIBSSH2_SFTP *sftp, unsigned char type,
+                                    size_t packet_len, unsigned char **s);
+static void sftp_op_destroy(LIBSSH2_SFTP_OP *op);
+static int sftp_op_wait(LIBSSH2_SFTP_OP *op, const unsigned char *responses,
+                        unsigned char **data, size_t *data_len);
 
 /* sftp_attrsize
  * Size that attr with this flagset will occupy when turned into a bin struct
@@ -131,25 +146,385 @@ static void _libssh2_store_u64(unsigned char **ptr, libssh2_uint64_t value)
     *ptr += 8;
 }
 
+static void
+sftp_id_hash_insert(struct sftp_id_entry **table, uint32_t size,
+                    struct sftp_id_entry *entry)
+{
+    /* request ids are handed out in sequence, so the low bits spread the
+       outstanding ones evenly over the buckets */
+    struct sftp_id_entry **bucket = &table[entry->request_id & (size - 1)];
+
+    /* append, so that entries with the same id are found in the order they
+       were added */
+    while(*bucket)
+        bucket = &(*bucket)->hash_next;
+    entry->hash_next = NULL;
+    *bucket = entry;
+}
+
 /*
- * Search list of zombied FXP_READ request IDs.
+ * sftp_id_hash_rebuild
  *
- * Returns NULL if ID not in list.
+ * Replace the table with one of the given size, filled from the list.
+ * Returns non-zero if the new table could not be allocated, in which case
+ * the old one is left alone.
  */
-static struct sftp_zombie_requests *
-find_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
+static int
+sftp_id_hash_rebuild(LIBSSH2_SESSION *session, struct sftp_id_hash *hash,
+                     struct list_head *list, uint32_t size)
 {
-    struct sftp_zombie_requests *zombie =
-        _libssh2_list_first(&sftp->zombie_requests);
+    struct sftp_id_entry **table;
+    struct sftp_id_entry *entry;
+    uint32_t count = 0;
 
-    while(zombie) {
-        if(zombie->request_id == request_id)
+    table = LIBSSH2_CALLOC(session, size * sizeof(struct sftp_id_entry *));
+    if (!table)
+        return -1;
+
+    for(entry = _libssh2_list_first(list); entry;
+        entry = _libssh2_list_next(&entry->node)) {
+        sftp_id_hash_insert(table, size, entry);
+        count++;
+    }
+
+    if (hash->table)
+        LIBSSH2_FREE(session, hash->table);
+    hash->table = table;
+    hash->size = size;
+    hash->count = count;
+    return 0;
+}
+
+/*
+ * sftp_id_add
+ *
+ * Add an entry last in the list and to the table. The table grows once it
+ * holds as many entries as it has buckets.
+ */
+static void
+sftp_id_add(LIBSSH2_SESSION *session, struct sftp_id_hash *hash,
+            struct list_head *list, struct sftp_id_entry *entry)
+{
+    _libssh2_list_add(list, &entry->node);
+
+    if (!hash->table || (hash->count >= hash->size)) {
+        uint32_t size = hash->table ? hash->size * 2 :
+            LIBSSH2_SFTP_ID_HASH_INITIAL;
+
+        /* the rebuilt table already holds the new entry */
+        if (!sftp_id_hash_rebuild(session, hash, list, size) || !hash->table)
+            return;
+    }
+
+    sftp_id_hash_insert(hash->table, hash->size, entry);
+    hash->count++;
+}
+
+/*
+ * sftp_id_remove
+ *
+ * Unlink an entry from the list and the table
+ */
+static void
+sftp_id_remove(struct sftp_id_hash *hash, struct sftp_id_entry *entry)
+{
+    _libssh2_list_remove(&entry->node);
+
+    if (hash->table) {
+        struct sftp_id_entry **bucket =
+            &hash->table[entry->request_id & (hash->size - 1)];
+
+        while (*bucket) {
+            if (*bucket == entry) {
+                *bucket = entry->hash_next;
+                hash->count--;
+                break;
+            }
+            bucket = &(*bucket)->hash_next;
+        }
+    }
+}
+
+/*
+ * sftp_id_find
+ *
+ * Returns the first entry with the given request id that comes after
+ * 'after', or the first one of all if 'after' is NULL. NULL if there is none.
+ */
+static struct sftp_id_entry *
+sftp_id_find(struct sftp_id_hash *hash, struct list_head *list,
+             uint32_t request_id, struct sftp_id_entry *after)
+{
+    struct sftp_id_entry *entry;
+
+    if (hash->table) {
+        entry = after ? after->hash_next :
+            hash->table[request_id & (hash->size - 1)];
+        while(entry && (entry->request_id != request_id))
+            entry = entry->hash_next;
+    }
+    else {
+        entry = after ? _libssh2_list_next(&after->node) :
+            _libssh2_list_first(list);
+        while(entry && (entry->request_id != request_id))
+            entry = _libssh2_list_next(&entry->node);
+    }
+
+    return entry;
+}
+
+static void
+sftp_id_hash_free(LIBSSH2_SESSION *session, struct sftp_id_hash *hash)
+{
+    if (hash->table) {
+        LIBSSH2_FREE(session, hash->table);
+        hash->table = NULL;
+        hash->size = hash->count = 0;
+    }
+}
+
+/*
+ * sftp_attr_hash
+ *
+ * FNV-1a of a path and the kind of entry
+ */
+static uint32_t
+sftp_attr_hash(const char *path, size_t path_len, int type)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < path_len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619U;
+    }
+    return (hash ^ (uint32_t)type) * 16777619U;
+}
+
+/*
+ * sftp_attr_cache_remove
+ *
+ * Take an entry out of the attribute cache and free it
+ */
+static void
+sftp_attr_cache_remove(LIBSSH2_SFTP *sftp, struct sftp_attr_entry *entry)
+{
+    struct sftp_attr_cache *cache = &sftp->attr_cache;
+    struct sftp_attr_entry **bucket =
+        &cache->table[entry->hash & (cache->size - 1)];
+
+    while (*bucket) {
+        if (*bucket == entry) {
+            *bucket = entry->hash_next;
             break;
-        else
-            zombie = _libssh2_list_next(&zombie->node);
+        }
+        bucket = &(*bucket)->hash_next;
+    }
+    _libssh2_list_remove(&entry->node);
+    cache->count--;
+    LIBSSH2_FREE(sftp->channel->session, entry);
+}
+
+/*
+ * sftp_attr_cache_flush
+ *
+ * Empty the attribute cache and free its table
+ */
+static void
+sftp_attr_cache_flush(LIBSSH2_SFTP *sftp)
+{
+    struct sftp_attr_cache *cache = &sftp->attr_cache;
+    struct sftp_attr_entry *entry;
+
+    while ((entry = _libssh2_list_first(&cache->lru)))
+        sftp_attr_cache_remove(sftp, entry);
+    if (cache->table) {
+        LIBSSH2_FREE(sftp->channel->session, cache->table);
+        cache->table = NULL;
+        cache->size = 0;
+    }
+}
+
+/*
+ * sftp_attr_cache_find
+ *
+ * Returns the entry of a path that has not expired yet, or NULL. An expired
+ * one is dropped on the way.
+ */
+static struct sftp_attr_entry *
+sftp_attr_cache_find(LIBSSH2_SFTP *sftp, const char *path, size_t path_len,
+                     int type)
+{
+    struct sftp_attr_cache *cache = &sftp->attr_cache;
+    struct sftp_attr_entry *entry;
+    uint32_t hash;
+
+    if (!cache->table)
+        return NULL;
+
+    hash = sftp_attr_hash(path, path_len, type);
+    for (entry = cache->table[hash & (cache->size - 1)]; entry;
+         entry = entry->hash_next) {
+        if ((entry->hash == hash) && (entry->type == type) &&
+            (entry->path_len == path_len) &&
+            !memcmp(entry->path, path, path_len))
+            break;
+    }
+    if (!entry)
+        return NULL;
+
+    if (entry->expires <= _libssh2_time_ns() / 1000000) {
+        sftp_attr_cache_remove(sftp, entry);
+        return NULL;
+    }
+
+    /* the most recently used last */
+    _libssh2_list_remove(&entry->node);
+    _libssh2_list_add(&cache->lru, &entry->node);
+    return entry;
+}
+
+/*
+ * sftp_attr_cache_put
+ *
+ * Remember the attributes of 'dir' joined with 'name', or of 'name' alone
+ * without a 'dir', or for a SFTP_ATTR_CACHE_REALPATH what it resolved to.
+ * The least recently used path makes room once the cache is full. Running
+ * out of memory only means the path is not cached.
+ */
+static void
+sftp_attr_cache_put(LIBSSH2_SFTP *sftp, const char *dir, size_t dir_len,
+                    const char *name, size_t name_len, int type,
+                    const LIBSSH2_SFTP_ATTRIBUTES *attrs,
+                    const char *target, size_t target_len)
+{
+    struct sftp_attr_cache *cache = &sftp->attr_cache;
+    struct sftp_attr_entry *entry, *old;
+    size_t sep = (dir && dir_len && (dir[dir_len - 1] != '/')) ? 1 : 0;
+    size_t path_len = (dir ? dir_len : 0) + sep + name_len;
+    char *p;
+
+    if (!cache->table)
+        return;
+
+    entry = LIBSSH2_ALLOC(sftp->channel->session,
+                          sizeof(struct sftp_attr_entry) + path_len +
+                          target_len + 2);
+    if (!entry)
+        return;
+
+    p = entry->path = (char *)(entry + 1);
+    if (dir) {
+        memcpy(p, dir, dir_len);
+        p += dir_len;
+        if (sep)
+            *p++ = '/';
+    }
+    memcpy(p, name, name_len);
+    p[name_len] = '\0';
+    entry->path_len = path_len;
+
+    entry->target = entry->path + path_len + 1;
+    if (target_len)
+        memcpy(entry->target, target, target_len);
+    entry->target[target_len] = '\0';
+    entry->target_len = target_len;
+
+    if (attrs)
+        entry->attrs = *attrs;
+    else
+        memset(&entry->attrs, 0, sizeof(entry->attrs));
+    entry->type = type;
+    entry->expires = _libssh2_time_ns() / 1000000 + cache->ttl_ms;
+    entry->hash = sftp_attr_hash(entry->path, path_len, type);
+
+    old = sftp_attr_cache_find(sftp, entry->path, path_len, type);
+    if (old)
+        sftp_attr_cache_remove(sftp, old);
+    if (cache->count >= cache->max_entries)
+        sftp_attr_cache_remove(sftp, _libssh2_list_first(&cache->lru));
+
+    entry->hash_next = cache->table[entry->hash & (cache->size - 1)];
+    cache->table[entry->hash & (cache->size - 1)] = entry;
+    _libssh2_list_add(&cache->lru, &entry->node);
+    cache->count++;
+}
+
+/*
+ * sftp_attr_cache_dirent
+ *
+ * Remember the attributes an entry of directory 'dir' was listed with. They
+ * are the ones of an LSTAT, and of a STAT too for anything but a symlink.
+ */
+static void
+sftp_attr_cache_dirent(LIBSSH2_SFTP *sftp, const char *dir, size_t dir_len,
+                       const LIBSSH2_SFTP_DIRENT *entry)
+{
+    if (!sftp->attr_cache.table || !dir ||
+        ((entry->name_len == 1) && (entry->name[0] == '.')) ||
+        ((entry->name_len == 2) && !memcmp(entry->name, "..", 2)))
+        return;
+
+    sftp_attr_cache_put(sftp, dir, dir_len, entry->name, entry->name_len,
+                        LIBSSH2_SFTP_LSTAT, &entry->attrs, NULL, 0);
+    if ((entry->attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+        !LIBSSH2_SFTP_S_ISLNK(entry->attrs.permissions))
+        sftp_attr_cache_put(sftp, dir, dir_len, entry->name,
+                            entry->name_len, LIBSSH2_SFTP_STAT,
+                            &entry->attrs, NULL, 0);
+}
+
+/*
+ * sftp_attr_cache_drop
+ *
+ * Forget what the cache knows about a path that is being changed: its own
+ * attributes, those of everything below it and of the directory it is in.
+ * Any path may resolve through it, so all REALPATH results go too.
+ */
+static void
+sftp_attr_cache_drop(LIBSSH2_SFTP *sftp, const char *path, size_t path_len)
+{
+    struct sftp_attr_entry *entry, *next;
+    size_t parent_len = path_len;
+
+    if (!sftp->attr_cache.table)
+        return;
+
+    while (parent_len && (path[parent_len - 1] == '/'))
+        parent_len--;
+    path_len = parent_len;
+    while (parent_len && (path[parent_len - 1] != '/'))
+        parent_len--;
+    if (parent_len > 1)
+        /* without the slash, unless it is the root */
+        parent_len--;
+
+    for (entry = _libssh2_list_first(&sftp->attr_cache.lru); entry;
+         entry = next) {
+        next = _libssh2_list_next(&entry->node);
+
+        if ((entry->type == SFTP_ATTR_CACHE_REALPATH) ||
+            ((entry->path_len >= path_len) &&
+             !memcmp(entry->path, path, path_len) &&
+             ((entry->path_len == path_len) ||
+              (entry->path[path_len] == '/'))) ||
+            (parent_len && (entry->path_len == parent_len) &&
+             !memcmp(entry->path, path, parent_len)))
+            sftp_attr_cache_remove(sftp, entry);
     }
+}
 
-    return zombie;
+/*
+ * Search list of zombied FXP_READ request IDs.
+ *
+ * Returns NULL if ID not in list.
+ */
+static struct sftp_zombie_requests *
+find_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
+{
+    return (struct sftp_zombie_requests *)
+        sftp_id_find(&sftp->zombie_hash, &sftp->zombie_requests, request_id,
+                     NULL);
 }
 
 static void
@@ -164,7 +539,7 @@ remove_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
                        "Removing request ID %ld from the list of zombie requests",
                        request_id);
 
-        _libssh2_list_remove(&zombie->node);
+        sftp_id_remove(&sftp->zombie_hash, &zombie->entry);
         LIBSSH2_FREE(session, zombie);
     }
 }
@@ -185,12 +560,82 @@ add_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
         return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                               "malloc fail for zombie request  ID");
     else {
-        zombie->request_id = request_id;
-        _libssh2_list_add(&sftp->zombie_requests, &zombie->node);
+        zombie->entry.request_id = request_id;
+        sftp_id_add(session, &sftp->zombie_hash, &sftp->zombie_requests,
+                    &zombie->entry);
         return LIBSSH2_ERROR_NONE;
     }
 }
 
+/*
+ * sftp_packet_free
+ *
+ * Free a packet and its data once it has been unlinked
+ */
+static void
+sftp_packet_free(LIBSSH2_SESSION *session, LIBSSH2_SFTP_PACKET *packet)
+{
+    _libssh2_slab_free(session, packet->data, packet->data_len);
+    _libssh2_slab_free(session, packet, sizeof(LIBSSH2_SFTP_PACKET));
+}
+
+static void sftp_latency_done(LIBSSH2_SFTP *sftp, uint32_t request_id);
+
+/*
+ * sftp_async_add
+ *
+ * Make an operation one of 'type' whose answer nobody waits for
+ */
+static void
+sftp_async_add(LIBSSH2_SFTP_OP *op, int type)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+
+    op->async.entry.request_id = op->request_id;
+    op->async.op = op;
+    op->async.type = type;
+    sftp_id_add(sftp->channel->session, &sftp->async_hash, &sftp->async_ops,
+                &op->async.entry);
+}
+
+/*
+ * sftp_async_done
+ *
+ * Hand the answer to an asynchronous operation to the callback, or keep it
+ * if it is the first failure, and free the operation
+ */
+static void
+sftp_async_done(struct sftp_async *async, unsigned char *data,
+                size_t data_len)
+{
+    LIBSSH2_SFTP_OP *op = async->op;
+    LIBSSH2_SFTP *sftp = op->sftp;
+    int type = async->type;
+    int rc = 0;
+    uint32_t sftp_errno = LIBSSH2_FX_OK;
+
+    if ((data[0] != SSH_FXP_STATUS) || (data_len < 9))
+        rc = LIBSSH2_ERROR_SFTP_PROTOCOL;
+    else {
+        sftp_errno = _libssh2_ntohu32(data + 5);
+        if (sftp_errno != LIBSSH2_FX_OK)
+            rc = LIBSSH2_ERROR_SFTP_PROTOCOL;
+    }
+    _libssh2_slab_free(sftp->channel->session, data, data_len);
+
+    /* answered, so there is nothing to ignore later */
+    op->state = libssh2_NB_state_end;
+    sftp_op_destroy(op);
+
+    if (sftp->async_callback)
+        sftp->async_callback(sftp, type, rc, sftp_errno,
+                             sftp->async_abstract);
+    else if (rc && !sftp->async_rc) {
+        sftp->async_rc = rc;
+        sftp->async_errno = sftp_errno;
+    }
+}
+
 /*
  * sftp_packet_add
  *
@@ -253,21 +698,36 @@ sftp_packet_add(LIBSSH2_SFTP *sftp, unsigned char *data,
 
     _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Received packet id %d",
                    request_id);
+    _libssh2_event(session, LIBSSH2_EVENT_SFTP_RESPONSE,
+                   sftp->channel->local.id, request_id, data[0], data_len);
+    if (sftp->latency)
+        sftp_latency_done(sftp, request_id);
+
+    if((data[0] != SSH_FXP_VERSION) && _libssh2_list_first(&sftp->async_ops)) {
+        struct sftp_async *async = (struct sftp_async *)
+            sftp_id_find(&sftp->async_hash, &sftp->async_ops, request_id,
+                         NULL);
+        if (async) {
+            sftp_async_done(async, data, data_len);
+            return LIBSSH2_ERROR_NONE;
+        }
+    }
 
     /* Don't add the packet if it answers a request we've given up on. */
-    if((data[0] == SSH_FXP_STATUS || data[0] == SSH_FXP_DATA)
+    if((data[0] != SSH_FXP_VERSION)
        && find_zombie_request(sftp, request_id)) {
 
-        /* If we get here, the file ended before the response arrived. We
-           are no longer interested in the request so we discard it */
+        /* If we get here, the file ended or the operation was freed before
+           the response arrived. We are no longer interested in the request
+           so we discard it */
 
-        LIBSSH2_FREE(session, data);
+        _libssh2_slab_free(session, data, data_len);
 
         remove_zombie_request(sftp, request_id);
         return LIBSSH2_ERROR_NONE;
     }
 
-    packet = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_PACKET));
+    packet = _libssh2_slab_alloc(session, sizeof(LIBSSH2_SFTP_PACKET));
     if (!packet) {
         return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                               "Unable to allocate datablock for SFTP packet");
@@ -275,13 +735,144 @@ sftp_packet_add(LIBSSH2_SFTP *sftp, unsigned char *data,
 
     packet->data = data;
     packet->data_len = data_len;
-    packet->request_id = request_id;
+    packet->entry.request_id = request_id;
 
-    _libssh2_list_add(&sftp->packets, &packet->node);
+    sftp_id_add(session, &sftp->packet_hash, &sftp->packets, &packet->entry);
 
     return LIBSSH2_ERROR_NONE;
 }
 
+/*
+ * sftp_request_id
+ *
+ * Hand out the id for a new request of 'type', 'packet_len' bytes long
+ */
+static uint32_t
+sftp_request_id(LIBSSH2_SFTP *sftp, unsigned char type, size_t packet_len)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    uint32_t request_id = sftp->request_id++;
+
+    _libssh2_event(session, LIBSSH2_EVENT_SFTP_REQUEST,
+                   sftp->channel->local.id, request_id, type, packet_len);
+
+    if (session->histograms) {
+        struct sftp_latency *slot;
+
+        if (!sftp->latency)
+            sftp->latency =
+                LIBSSH2_CALLOC(session, LIBSSH2_SFTP_LATENCY_SLOTS *
+                               sizeof(struct sftp_latency));
+        if (sftp->latency) {
+            slot = &sftp->latency[request_id %
+                                  LIBSSH2_SFTP_LATENCY_SLOTS];
+            slot->request_id = request_id;
+            slot->type = type;
+            slot->sent_us = _libssh2_time_us();
+        }
+    }
+    return request_id;
+}
+
+/*
+ * sftp_latency_done
+ *
+ * Count how long the request answered by a response took
+ */
+static void
+sftp_latency_done(LIBSSH2_SFTP *sftp, uint32_t request_id)
+{
+    struct sftp_latency *slot =
+        &sftp->latency[request_id % LIBSSH2_SFTP_LATENCY_SLOTS];
+    int which;
+
+    if (!slot->sent_us || (slot->request_id != request_id))
+        return;
+
+    switch (slot->type) {
+    case SSH_FXP_READ:
+        which = LIBSSH2_HISTOGRAM_SFTP_READ;
+        break;
+    case SSH_FXP_WRITE:
+        which = LIBSSH2_HISTOGRAM_SFTP_WRITE;
+        break;
+    case SSH_FXP_OPEN:
+    case SSH_FXP_OPENDIR:
+        which = LIBSSH2_HISTOGRAM_SFTP_OPEN;
+        break;
+    case SSH_FXP_CLOSE:
+        which = LIBSSH2_HISTOGRAM_SFTP_CLOSE;
+        break;
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_FSTAT:
+    case SSH_FXP_SETSTAT:
+    case SSH_FXP_FSETSTAT:
+        which = LIBSSH2_HISTOGRAM_SFTP_STAT;
+        break;
+    case SSH_FXP_READDIR:
+        which = LIBSSH2_HISTOGRAM_SFTP_READDIR;
+        break;
+    default:
+        which = LIBSSH2_HISTOGRAM_SFTP_OTHER;
+    }
+    _libssh2_histogram_add(sftp->channel->session, which,
+                           _libssh2_time_us() - slot->sent_us);
+    slot->sent_us = 0;
+}
+
+/*
+ * sftp_direct_add
+ *
+ * Have the data of the FXP_DATA answering a READ go straight to 'buffer'
+ */
+static void
+sftp_direct_add(LIBSSH2_SFTP_OP *op, unsigned char *buffer, size_t len)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+
+    op->direct.entry.request_id = op->request_id;
+    op->direct.buffer = buffer;
+    op->direct.len = len;
+    op->direct.listed = 1;
+    sftp_id_add(sftp->channel->session, &sftp->direct_hash,
+                &sftp->direct_reads, &op->direct.entry);
+}
+
+/*
+ * sftp_direct_find
+ *
+ * The READ whose data can go straight to its buffer, if the packet with the
+ * header in 'partial_head' answers one. It is taken out of the list.
+ */
+static struct sftp_direct *
+sftp_direct_find(LIBSSH2_SFTP *sftp)
+{
+    const unsigned char *head = sftp->partial_head;
+    struct sftp_direct *direct;
+    uint32_t len;
+
+    if (head[0] != SSH_FXP_DATA)
+        return NULL;
+
+    direct = (struct sftp_direct *)
+        sftp_id_find(&sftp->direct_hash, &sftp->direct_reads,
+                     _libssh2_ntohu32(head + 1), NULL);
+    if (!direct)
+        return NULL;
+
+    /* a response that is not what was asked for is left for the READ to
+       find out about */
+    len = _libssh2_ntohu32(head + 5);
+    if ((len > direct->len) ||
+        (sftp->partial_len != SFTP_DATA_HEADER_LEN + len))
+        return NULL;
+
+    sftp_id_remove(&sftp->direct_hash, &direct->entry);
+    direct->listed = 0;
+    return direct;
+}
+
 /*
  * sftp_packet_read
  *
@@ -316,107 +907,185 @@ sftp_packet_read(LIBSSH2_SFTP *sftp)
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
                        "partial read cont, already recvd: %lu",
                        sftp->partial_received);
-        /* fall-through */
-    default:
-        if(!packet) {
-            /* only do this if there's not already a packet buffer allocated
-               to use */
+        break;
 
-            /* each packet starts with a 32 bit length field */
-            rc = _libssh2_channel_read(channel, 0,
-                                       (char *)&sftp->partial_size[
-                                           sftp->partial_size_len],
-                                       4 - sftp->partial_size_len);
-            if (rc == LIBSSH2_ERROR_EAGAIN)
-                return rc;
-            else if (rc < 0)
-                return _libssh2_error(session, rc, "channel read");
+    default:
+        /* each packet starts with a 32 bit length field */
+        rc = _libssh2_channel_read(channel, 0,
+                                   (char *)&sftp->partial_size[
+                                       sftp->partial_size_len],
+                                   4 - sftp->partial_size_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        else if (rc < 0)
+            return _libssh2_error(session, rc, "channel read");
 
-            sftp->partial_size_len += rc;
+        sftp->partial_size_len += rc;
 
-            if(4 != sftp->partial_size_len)
-                /* we got a short read for the length part */
-                return LIBSSH2_ERROR_EAGAIN;
+        if(4 != sftp->partial_size_len)
+            /* we got a short read for the length part */
+            return LIBSSH2_ERROR_EAGAIN;
 
-            sftp->partial_len = _libssh2_ntohu32(sftp->partial_size);
-            /* make sure we don't proceed if the packet size is unreasonably
-               large */
-            if (sftp->partial_len > LIBSSH2_SFTP_PACKET_MAXLEN)
-                return _libssh2_error(session,
-                                      LIBSSH2_ERROR_CHANNEL_PACKET_EXCEEDED,
-                                      "SFTP packet too large");
+        sftp->partial_len = _libssh2_ntohu32(sftp->partial_size);
+        /* make sure we don't proceed if the packet size is unreasonably
+           large */
+        if (sftp->partial_len > LIBSSH2_SFTP_PACKET_MAXLEN)
+            return _libssh2_error(session,
+                                  LIBSSH2_ERROR_CHANNEL_PACKET_EXCEEDED,
+                                  "SFTP packet too large");
 
-            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                           "Data begin - Packet Length: %lu",
-                           sftp->partial_len);
-            packet = LIBSSH2_ALLOC(session, sftp->partial_len);
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Data begin - Packet Length: %lu",
+                       sftp->partial_len);
+        sftp->partial_size_len = 0;
+        sftp->partial_received = 0; /* how much of the packet already
+                                       received */
+
+        if (_libssh2_list_first(&sftp->direct_reads) &&
+            (sftp->partial_len >= SFTP_DATA_HEADER_LEN))
+            /* it may be the FXP_DATA of one of them, the header tells */
+            sftp->partial_mode = SFTP_PARTIAL_HEADER;
+        else {
+            packet = _libssh2_slab_alloc(session, sftp->partial_len);
             if (!packet)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "Unable to allocate SFTP packet");
-            sftp->partial_size_len = 0;
-            sftp->partial_received = 0; /* how much of the packet already
-                                           received */
             sftp->partial_packet = packet;
-
-          window_adjust:
-            recv_window = libssh2_channel_window_read_ex(channel, NULL, NULL);
-
-            if(sftp->partial_len > recv_window) {
-                /* ask for twice the data amount we need at once */
-                rc = _libssh2_channel_receive_window_adjust(channel,
-                                                            sftp->partial_len*2,
-                                                            1, NULL);
-                /* store the state so that we continue with the correct
-                   operation at next invoke */
-                sftp->packet_state = (rc == LIBSSH2_ERROR_EAGAIN)?
-                    libssh2_NB_state_sent:
-                    libssh2_NB_state_idle;
-
-                if(rc == LIBSSH2_ERROR_EAGAIN)
-                    return rc;
-            }
+            sftp->partial_mode = SFTP_PARTIAL_PACKET;
         }
 
-        /* Read as much of the packet as we can */
-        while (sftp->partial_len > sftp->partial_received) {
+      window_adjust:
+        recv_window = libssh2_channel_window_read_ex(channel, NULL, NULL);
+
+        if(sftp->partial_len > recv_window) {
+            /* ask for twice the data amount we need at once */
+            rc = _libssh2_channel_receive_window_adjust(channel,
+                                                        sftp->partial_len*2,
+                                                        1, NULL);
+            /* store the state so that we continue with the correct
+               operation at next invoke */
+            sftp->packet_state = (rc == LIBSSH2_ERROR_EAGAIN)?
+                libssh2_NB_state_sent:
+                libssh2_NB_state_idle;
+
+            if(rc == LIBSSH2_ERROR_EAGAIN)
+                return rc;
+        }
+    }
+
+    if (sftp->partial_mode == SFTP_PARTIAL_HEADER) {
+        while (sftp->partial_received < SFTP_DATA_HEADER_LEN) {
             rc = _libssh2_channel_read(channel, 0,
-                                       (char *)&packet[sftp->partial_received],
-                                       sftp->partial_len -
+                                       (char *)&sftp->partial_head[
+                                           sftp->partial_received],
+                                       SFTP_DATA_HEADER_LEN -
                                        sftp->partial_received);
-
             if (rc == LIBSSH2_ERROR_EAGAIN) {
-                /*
-                 * We received EAGAIN, save what we have and return EAGAIN to
-                 * the caller. Set 'partial_packet' so that this function
-                 * knows how to continue on the next invoke.
-                 */
                 sftp->packet_state = libssh2_NB_state_sent1;
                 return rc;
             }
-            else if (rc < 0) {
-                LIBSSH2_FREE(session, packet);
-                sftp->partial_packet = NULL;
+            else if (rc < 0)
                 return _libssh2_error(session, rc,
                                       "Error waiting for SFTP packet");
+            sftp->partial_received += rc;
+        }
+
+        sftp->partial_direct = sftp_direct_find(sftp);
+        if (sftp->partial_direct)
+            sftp->partial_mode = SFTP_PARTIAL_DIRECT;
+        else {
+            packet = _libssh2_slab_alloc(session, sftp->partial_len);
+            if (!packet)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate SFTP packet");
+            memcpy(packet, sftp->partial_head, SFTP_DATA_HEADER_LEN);
+            sftp->partial_packet = packet;
+            sftp->partial_mode = SFTP_PARTIAL_PACKET;
+        }
+    }
+
+    if (sftp->partial_mode == SFTP_PARTIAL_DIRECT) {
+        /* the data goes to where the READ wants it, or is thrown away if
+           the READ was given up on meanwhile */
+        while (sftp->partial_len > sftp->partial_received) {
+            size_t left = sftp->partial_len - sftp->partial_received;
+            char discard[512];
+            char *to = discard;
+
+            if (sftp->partial_direct)
+                to = (char *)sftp->partial_direct->buffer +
+                    (sftp->partial_received - SFTP_DATA_HEADER_LEN);
+            else if (left > sizeof(discard))
+                left = sizeof(discard);
+
+            rc = _libssh2_channel_read(channel, 0, to, left);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                sftp->packet_state = libssh2_NB_state_sent1;
+                return rc;
             }
+            else if (rc < 0)
+                return _libssh2_error(session, rc,
+                                      "Error waiting for SFTP packet");
             sftp->partial_received += rc;
         }
 
-        sftp->partial_packet = NULL;
+        if (sftp->partial_direct)
+            sftp->partial_direct->done = 1;
+        sftp->partial_direct = NULL;
+        sftp->partial_mode = SFTP_PARTIAL_PACKET;
 
-        /* sftp_packet_add takes ownership of the packet and might free it
-           so we take a copy of the packet type before we call it. */
-        packet_type = packet[0];
-        rc = sftp_packet_add(sftp, packet, sftp->partial_len);
+        /* the header is what the READ waits for */
+        packet = _libssh2_slab_alloc(session, SFTP_DATA_HEADER_LEN);
+        if (!packet)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate SFTP packet");
+        memcpy(packet, sftp->partial_head, SFTP_DATA_HEADER_LEN);
+        rc = sftp_packet_add(sftp, packet, SFTP_DATA_HEADER_LEN);
         if (rc) {
-            LIBSSH2_FREE(session, packet);
+            _libssh2_slab_free(session, packet, SFTP_DATA_HEADER_LEN);
             return rc;
         }
-        else {
-            return packet_type;
+        return SSH_FXP_DATA;
+    }
+
+    /* Read as much of the packet as we can */
+    while (sftp->partial_len > sftp->partial_received) {
+        rc = _libssh2_channel_read(channel, 0,
+                                   (char *)&packet[sftp->partial_received],
+                                   sftp->partial_len -
+                                   sftp->partial_received);
+
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            /*
+             * We received EAGAIN, save what we have and return EAGAIN to
+             * the caller. Set 'partial_packet' so that this function
+             * knows how to continue on the next invoke.
+             */
+            sftp->packet_state = libssh2_NB_state_sent1;
+            return rc;
         }
+        else if (rc < 0) {
+            LIBSSH2_FREE(session, packet);
+            sftp->partial_packet = NULL;
+            return _libssh2_error(session, rc,
+                                  "Error waiting for SFTP packet");
+        }
+        sftp->partial_received += rc;
+    }
+
+    sftp->partial_packet = NULL;
+
+    /* sftp_packet_add takes ownership of the packet and might free it
+       so we take a copy of the packet type before we call it. */
+    packet_type = packet[0];
+    rc = sftp_packet_add(sftp, packet, sftp->partial_len);
+    if (rc) {
+        LIBSSH2_FREE(session, packet);
+        return rc;
+    }
+    else {
+        return packet_type;
     }
-    /* WON'T REACH */
 }
 /*
  * sftp_packetlist_flush
@@ -446,14 +1115,14 @@ static void sftp_packetlist_flush(LIBSSH2_SFTP_HANDLE *handle)
 
         if(!rc)
             /* we found a packet, free it */
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, data_len);
         else if(chunk->sent)
             /* there was no incoming packet for this request, mark this
                request as a zombie if it ever sent the request */
             add_zombie_request(sftp, chunk->request_id);
 
         _libssh2_list_remove(&chunk->node);
-        LIBSSH2_FREE(session, chunk);
+        _libssh2_slab_free(session, chunk, SFTP_CHUNK_SIZE(handle));
         chunk = next;
     }
 }
@@ -475,27 +1144,33 @@ sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
     if(!packet)
         return -1;
 
-    /* Special consideration when getting VERSION packet */
+    if(packet_type == SSH_FXP_VERSION) {
+        /* Special consideration when getting VERSION packet, as it carries
+           no request id */
+        while(packet && (packet->data[0] != SSH_FXP_VERSION))
+            packet = _libssh2_list_next(&packet->entry.node);
+    }
+    else {
+        packet = (LIBSSH2_SFTP_PACKET *)
+            sftp_id_find(&sftp->packet_hash, &sftp->packets, request_id, NULL);
+        while(packet && (packet->data[0] != packet_type))
+            packet = (LIBSSH2_SFTP_PACKET *)
+                sftp_id_find(&sftp->packet_hash, &sftp->packets, request_id,
+                             &packet->entry);
+    }
 
-    while (packet) {
-        if((packet->data[0] == packet_type) &&
-           ((packet_type == SSH_FXP_VERSION) ||
-            (packet->request_id == request_id))) {
+    if(!packet)
+        return -1;
 
-            /* Match! Fetch the data */
-            *data = packet->data;
-            *data_len = packet->data_len;
+    /* Match! Fetch the data */
+    *data = packet->data;
+    *data_len = packet->data_len;
 
-            /* unlink and free this struct */
-            _libssh2_list_remove(&packet->node);
-            LIBSSH2_FREE(session, packet);
+    /* unlink and free this struct */
+    sftp_id_remove(&sftp->packet_hash, &packet->entry);
+    _libssh2_slab_free(session, packet, sizeof(LIBSSH2_SFTP_PACKET));
 
-            return 0;
-        }
-        /* check next struct in the list */
-        packet = _libssh2_list_next(&packet->node);
-    }
-    return -1;
+    return 0;
 }
 
 /* sftp_packet_require
@@ -692,14 +1367,133 @@ LIBSSH2_CHANNEL_CLOSE_FUNC(libssh2_sftp_dtor)
         LIBSSH2_FREE(session, sftp->partial_packet);
     }
 
-    /* Free the packet storage for _libssh2_sftp_packet_readdir */
-    if (sftp->readdir_packet) {
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-    }
+    sftp_id_hash_free(session, &sftp->packet_hash);
+    sftp_id_hash_free(session, &sftp->zombie_hash);
+    sftp_id_hash_free(session, &sftp->direct_hash);
+    sftp_id_hash_free(session, &sftp->async_hash);
+
+    if (sftp->extensions)
+        LIBSSH2_FREE(session, sftp->extensions);
+    if (sftp->latency)
+        LIBSSH2_FREE(session, sftp->latency);
+    sftp_attr_cache_flush(sftp);
 
     LIBSSH2_FREE(session, sftp);
 }
 
+/*
+ * sftp_extension
+ *
+ * Find an extension the server announced in its FXP_VERSION. Returns 1 and
+ * points at its data if it did, 0 if not.
+ */
+static int
+sftp_extension(LIBSSH2_SFTP *sftp, const char *name,
+               const unsigned char **data, size_t *data_len)
+{
+    unsigned char *s = sftp->extensions;
+    unsigned char *end = s + sftp->extensions_len;
+    size_t name_len = strlen(name);
+
+    /* the pairs were checked to be complete when they were stored */
+    while (s < end) {
+        size_t extname_len = _libssh2_ntohu32(s);
+        unsigned char *extname = s + 4;
+        size_t extdata_len = _libssh2_ntohu32(extname + extname_len);
+
+        s = extname + extname_len + 4;
+        if ((extname_len == name_len) && !memcmp(extname, name, name_len)) {
+            if (data)
+                *data = s;
+            if (data_len)
+                *data_len = extdata_len;
+            return 1;
+        }
+        s += extdata_len;
+    }
+    return 0;
+}
+
+/* the FXP_VERSION extensions that have a LIBSSH2_SFTP_EXT_* bit */
+static const struct {
+    const char *name;
+    unsigned long flag;
+} sftp_known_extensions[] = {
+    { "posix-rename@openssh.com", LIBSSH2_SFTP_EXT_POSIX_RENAME },
+    { "statvfs@openssh.com", LIBSSH2_SFTP_EXT_STATVFS },
+    { "fstatvfs@openssh.com", LIBSSH2_SFTP_EXT_FSTATVFS },
+    { "hardlink@openssh.com", LIBSSH2_SFTP_EXT_HARDLINK },
+    { "fsync@openssh.com", LIBSSH2_SFTP_EXT_FSYNC },
+    { "limits@openssh.com", LIBSSH2_SFTP_EXT_LIMITS },
+    { "copy-data", LIBSSH2_SFTP_EXT_COPY_DATA },
+    { "check-file", LIBSSH2_SFTP_EXT_CHECK_FILE },
+    { NULL, 0 }
+};
+
+/*
+ * sftp_limits
+ *
+ * Ask the server for its limits@openssh.com and raise or lower the size of
+ * reads and writes to them
+ */
+static int
+sftp_limits(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *data, *s;
+    size_t data_len;
+    static const unsigned char limits_responses[2] =
+        { SSH_FXP_EXTENDED_REPLY, SSH_FXP_STATUS };
+    libssh2_uint64_t max_packet, max_read, max_write;
+    int rc;
+
+    if (!sftp->limits_op) {
+        /* 31 = packet_len(4) + packet_type(1) + request_id(4) +
+           string "limits@openssh.com"(22) */
+        sftp->limits_op = sftp_op_new(sftp, SSH_FXP_EXTENDED, 31, &s);
+        if (!sftp->limits_op)
+            return LIBSSH2_ERROR_ALLOC;
+        _libssh2_store_str(&s, "limits@openssh.com", 18);
+    }
+
+    rc = sftp_op_wait(sftp->limits_op, limits_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    sftp->limits_op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(sftp->limits_op);
+    sftp->limits_op = NULL;
+    if (rc)
+        return rc;
+
+    if ((data[0] != SSH_FXP_EXTENDED_REPLY) || (data_len < 5 + 32)) {
+        LIBSSH2_FREE(session, data);
+        return LIBSSH2_ERROR_SFTP_PROTOCOL;
+    }
+
+    /* max-packet-length, max-read-length and max-write-length, then
+       max-open-handles which isn't of use. Zero means no limit */
+    max_packet = _libssh2_ntohu64(data + 5);
+    max_read = _libssh2_ntohu64(data + 13);
+    max_write = _libssh2_ntohu64(data + 21);
+    LIBSSH2_FREE(session, data);
+
+    if (max_read)
+        sftp->max_read_len = (size_t)MIN(max_read, LIBSSH2_SFTP_MAX_RW_SIZE);
+    if (max_write)
+        sftp->max_write_len = (size_t)MIN(max_write,
+                                          LIBSSH2_SFTP_MAX_RW_SIZE);
+    /* room for the header of a FXP_WRITE with the longest handle */
+    if (max_packet && (max_packet < sftp->max_write_len + 1024))
+        sftp->max_write_len = (max_packet > 2048) ?
+            (size_t)(max_packet - 1024) : 1024;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                   "Reads of %lu and writes of %lu bytes", sftp->max_read_len,
+                   sftp->max_write_len);
+    return 0;
+}
+
 /*
  * sftp_init
  *
@@ -711,6 +1505,7 @@ static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
     size_t data_len;
     ssize_t rc;
     LIBSSH2_SFTP *sftp_handle;
+    int i;
 
     if (session->sftpInit_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
@@ -739,7 +1534,7 @@ static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
         session->sftpInit_channel =
             _libssh2_channel_open(session, "session", sizeof("session") - 1,
                                   LIBSSH2_CHANNEL_WINDOW_DEFAULT,
-                                  LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0);
+                                  LIBSSH2_SFTP_CHANNEL_PACKET, NULL, 0);
         if (!session->sftpInit_channel) {
             if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
                 _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
@@ -793,6 +1588,16 @@ static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
         }
         sftp_handle->channel = session->sftpInit_channel;
         sftp_handle->request_id = 0;
+        sftp_handle->max_read_len = MAX_SFTP_READ_SIZE;
+        sftp_handle->max_write_len = MAX_SFTP_OUTGOING_SIZE;
+        /* let a FXP_WRITE fill a whole channel packet of the server's size,
+           limits@openssh.com gets the final say further down */
+        /* REMEMBER local means local as the SOURCE of the data */
+        if (sftp_handle->channel->local.packet_size >
+            MAX_SFTP_OUTGOING_SIZE + 1024)
+            sftp_handle->max_write_len =
+                MIN(sftp_handle->channel->local.packet_size - 1024,
+                    LIBSSH2_SFTP_MAX_RW_SIZE);
 
         _libssh2_htonu32(session->sftpInit_buffer, 5);
         session->sftpInit_buffer[4] = SSH_FXP_INIT;
@@ -834,50 +1639,79 @@ static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
         }
     }
 
-    rc = sftp_packet_require(sftp_handle, SSH_FXP_VERSION,
-                             0, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN)
-        return NULL;
-    else if (rc) {
-        _libssh2_error(session, rc,
-                       "Timeout waiting for response from SFTP subsystem");
-        goto sftp_init_error;
-    }
-    if (data_len < 5) {
-        _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                       "Invalid SSH_FXP_VERSION response");
-        LIBSSH2_FREE(session, data);
-        goto sftp_init_error;
-    }
+    if (session->sftpInit_state == libssh2_NB_state_sent3) {
+        rc = sftp_packet_require(sftp_handle, SSH_FXP_VERSION,
+                                 0, &data, &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return NULL;
+        else if (rc) {
+            _libssh2_error(session, rc,
+                           "Timeout waiting for response from SFTP subsystem");
+            goto sftp_init_error;
+        }
+        if (data_len < 5) {
+            _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                           "Invalid SSH_FXP_VERSION response");
+            LIBSSH2_FREE(session, data);
+            goto sftp_init_error;
+        }
 
-    s = data + 1;
-    sftp_handle->version = _libssh2_ntohu32(s);
-    s += 4;
-    if (sftp_handle->version > LIBSSH2_SFTP_VERSION) {
+        s = data + 1;
+        sftp_handle->version = _libssh2_ntohu32(s);
+        s += 4;
+        if (sftp_handle->version > LIBSSH2_SFTP_VERSION) {
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                           "Truncating remote SFTP version from %lu",
+                           sftp_handle->version);
+            sftp_handle->version = LIBSSH2_SFTP_VERSION;
+        }
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Truncating remote SFTP version from %lu",
+                       "Enabling SFTP version %lu compatibility",
                        sftp_handle->version);
-        sftp_handle->version = LIBSSH2_SFTP_VERSION;
-    }
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                   "Enabling SFTP version %lu compatibility",
-                   sftp_handle->version);
-    while (s < (data + data_len)) {
-        size_t extname_len, extdata_len;
+        while ((data + data_len - s) >= 8) {
+            size_t extname_len, extdata_len;
 
-        extname_len = _libssh2_ntohu32(s);
-        s += 4;
-        /* the extension name starts here */
-        s += extname_len;
+            extname_len = _libssh2_ntohu32(s);
+            if ((size_t)(data + data_len - s) < extname_len + 8)
+                break;
+            extdata_len = _libssh2_ntohu32(s + 4 + extname_len);
+            if ((size_t)(data + data_len - s) < extname_len + 8 + extdata_len)
+                break;
 
-        extdata_len = _libssh2_ntohu32(s);
-        s += 4;
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                           "Server supports extension %.*s", (int)extname_len,
+                           s + 4);
+            for (i = 0; sftp_known_extensions[i].name; i++)
+                if ((extname_len == strlen(sftp_known_extensions[i].name)) &&
+                    !memcmp(s + 4, sftp_known_extensions[i].name, extname_len))
+                    sftp_handle->extension_flags |= sftp_known_extensions[i].flag;
+            s += extname_len + 8 + extdata_len;
+        }
 
-        /* TODO: Actually process extensions */
-        s += extdata_len;
+        /* keep the ones that were complete for sftp_extension() */
+        if (s > data + 5) {
+            sftp_handle->extensions = LIBSSH2_ALLOC(session, s - (data + 5));
+            if (sftp_handle->extensions) {
+                sftp_handle->extensions_len = s - (data + 5);
+                memcpy(sftp_handle->extensions, data + 5,
+                       sftp_handle->extensions_len);
+            }
+        }
+        LIBSSH2_FREE(session, data);
 
+        session->sftpInit_state = libssh2_NB_state_sent4;
+    }
+
+    if ((session->sftpInit_state == libssh2_NB_state_sent4) &&
+        (sftp_handle->extension_flags & LIBSSH2_SFTP_EXT_LIMITS)) {
+        /* a server that can't tell its limits still works with the default
+           ones */
+        if (sftp_limits(sftp_handle) == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block waiting for SFTP limits");
+            return NULL;
+        }
     }
-    LIBSSH2_FREE(session, data);
 
     /* Make sure that when the channel gets closed, the SFTP service is shut
        down too */
@@ -899,6 +1733,12 @@ static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
            LIBSSH2_ERROR_EAGAIN);
     session->sftpInit_channel = NULL;
     if (session->sftpInit_sftp) {
+        sftp_id_hash_free(session, &session->sftpInit_sftp->packet_hash);
+        sftp_id_hash_free(session, &session->sftpInit_sftp->zombie_hash);
+        sftp_id_hash_free(session, &session->sftpInit_sftp->direct_hash);
+        sftp_id_hash_free(session, &session->sftpInit_sftp->async_hash);
+        if (session->sftpInit_sftp->latency)
+            LIBSSH2_FREE(session, session->sftpInit_sftp->latency);
         LIBSSH2_FREE(session, session->sftpInit_sftp);
         session->sftpInit_sftp = NULL;
     }
@@ -937,6 +1777,7 @@ static int
 sftp_shutdown(LIBSSH2_SFTP *sftp)
 {
     int rc;
+    LIBSSH2_SFTP_OP *op;
     LIBSSH2_SESSION *session = sftp->channel->session;
     /*
      * Make sure all memory used in the state variables are free
@@ -945,14 +1786,6 @@ sftp_shutdown(LIBSSH2_SFTP *sftp)
         LIBSSH2_FREE(session, sftp->partial_packet);
         sftp->partial_packet = NULL;
     }
-    if (sftp->open_packet) {
-        LIBSSH2_FREE(session, sftp->open_packet);
-        sftp->open_packet = NULL;
-    }
-    if (sftp->readdir_packet) {
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-        sftp->readdir_packet = NULL;
-    }
     if (sftp->fstat_packet) {
         LIBSSH2_FREE(session, sftp->fstat_packet);
         sftp->fstat_packet = NULL;
@@ -981,10 +1814,6 @@ sftp_shutdown(LIBSSH2_SFTP *sftp)
         LIBSSH2_FREE(session, sftp->rmdir_packet);
         sftp->rmdir_packet = NULL;
     }
-    if (sftp->stat_packet) {
-        LIBSSH2_FREE(session, sftp->stat_packet);
-        sftp->stat_packet = NULL;
-    }
     if (sftp->symlink_packet) {
         LIBSSH2_FREE(session, sftp->symlink_packet);
         sftp->symlink_packet = NULL;
@@ -994,6 +1823,15 @@ sftp_shutdown(LIBSSH2_SFTP *sftp)
         sftp->fsync_packet = NULL;
     }
 
+    /* operations not finished yet can't be anymore */
+    while ((op = _libssh2_list_first(&sftp->ops))) {
+        _libssh2_list_remove(&op->node);
+        _libssh2_slab_free(session, op, op->size);
+    }
+    sftp->open_op = sftp->stat_op = NULL;
+    sftp->copy_data_op = sftp->check_file_op = NULL;
+    sftp->ops_unsent = 0;
+
     sftp_packet_flush(sftp);
 
     /* TODO: We should consider walking over the sftp_handles list and kill
@@ -1021,201 +1859,535 @@ libssh2_sftp_shutdown(LIBSSH2_SFTP *sftp)
  * SFTP File and Directory Ops *
  ******************************* */
 
-/* sftp_open
+/*
+ * sftp_op_new
+ *
+ * Make an operation with room for a request of 'packet_len' bytes. The
+ * length, type and request id are stored, and '*s' is left pointing at where
+ * the caller stores the rest. The request goes out with sftp_op_send(), after
+ * the ones of all operations made before it.
  */
-static LIBSSH2_SFTP_HANDLE *
-sftp_open(LIBSSH2_SFTP *sftp, const char *filename,
-          size_t filename_len, uint32_t flags, long mode,
-          int open_type)
+static LIBSSH2_SFTP_OP *
+sftp_op_new(LIBSSH2_SFTP *sftp, unsigned char type, size_t packet_len,
+            unsigned char **s)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_SFTP_HANDLE *fp;
-    LIBSSH2_SFTP_ATTRIBUTES attrs = {
-        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
-    };
-    unsigned char *s;
-    ssize_t rc;
-    int open_file = (open_type == LIBSSH2_SFTP_OPENFILE)?1:0;
-
-    if (sftp->open_state == libssh2_NB_state_idle) {
-        /* packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) +
-           flags(4) */
-        sftp->open_packet_len = filename_len + 13 +
-            (open_file? (4 + sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS)) : 0);
-
-        /* surprise! this starts out with nothing sent */
-        sftp->open_packet_sent = 0;
-        s = sftp->open_packet = LIBSSH2_ALLOC(session, sftp->open_packet_len);
-        if (!sftp->open_packet) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate memory for FXP_OPEN or "
-                           "FXP_OPENDIR packet");
-            return NULL;
-        }
-        /* Filetype in SFTP 3 and earlier */
-        attrs.permissions = mode |
-            (open_file ? LIBSSH2_SFTP_ATTR_PFILETYPE_FILE :
-             LIBSSH2_SFTP_ATTR_PFILETYPE_DIR);
-
-        _libssh2_store_u32(&s, sftp->open_packet_len - 4);
-        *(s++) = open_file? SSH_FXP_OPEN : SSH_FXP_OPENDIR;
-        sftp->open_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->open_request_id);
-        _libssh2_store_str(&s, filename, filename_len);
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    size_t size = packet_len + sizeof(LIBSSH2_SFTP_OP);
+    LIBSSH2_SFTP_OP *op = _libssh2_slab_alloc(session, size);
 
-        if (open_file) {
-            _libssh2_store_u32(&s, flags);
-            s += sftp_attr2bin(s, &attrs);
-        }
+    if (!op) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for SFTP request");
+        return NULL;
+    }
+    memset(op, 0, size);
+    op->size = size;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Sending %s open request",
-                       open_file? "file" : "directory");
+    op->sftp = sftp;
+    op->type = type;
+    op->request_id = sftp_request_id(sftp, type, packet_len);
+    op->state = libssh2_NB_state_created;
+    op->packet_len = packet_len;
 
-        sftp->open_state = libssh2_NB_state_created;
-    }
+    *s = op->packet;
+    _libssh2_store_u32(s, (uint32_t)(packet_len - 4));
+    *((*s)++) = type;
+    _libssh2_store_u32(s, op->request_id);
 
-    if (sftp->open_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->open_packet+
-                                    sftp->open_packet_sent,
-                                    sftp->open_packet_len -
-                                    sftp->open_packet_sent);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block sending FXP_OPEN or FXP_OPENDIR command");
-            return NULL;
-        }
-        else if(rc < 0) {
-            _libssh2_error(session, rc, "Unable to send FXP_OPEN*");
-            LIBSSH2_FREE(session, sftp->open_packet);
-            sftp->open_packet = NULL;
-            sftp->open_state = libssh2_NB_state_idle;
-            return NULL;
-        }
+    _libssh2_list_add(&sftp->ops, &op->node);
+    sftp->ops_unsent++;
 
-        /* bump the sent counter and remain in this state until the whole
-           data is off */
-        sftp->open_packet_sent += rc;
+    return op;
+}
 
-        if(sftp->open_packet_len == sftp->open_packet_sent) {
-            LIBSSH2_FREE(session, sftp->open_packet);
-            sftp->open_packet = NULL;
+/*
+ * sftp_op_destroy
+ *
+ * Unlink and free an operation. If its request went out, whatever the server
+ * says to it is thrown away.
+ */
+static void
+sftp_op_destroy(LIBSSH2_SFTP_OP *op)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
 
-            sftp->open_state = libssh2_NB_state_sent;
+    if (op->state == libssh2_NB_state_created)
+        sftp->ops_unsent--;
+    else if ((op->state == libssh2_NB_state_sent) ||
+             (op->state == libssh2_NB_state_sent1)) {
+        /* drop the response if it is here already, or ignore it later */
+        LIBSSH2_SFTP_PACKET *packet = (LIBSSH2_SFTP_PACKET *)
+            sftp_id_find(&sftp->packet_hash, &sftp->packets, op->request_id,
+                         NULL);
+        if (packet) {
+            sftp_id_remove(&sftp->packet_hash, &packet->entry);
+            sftp_packet_free(session, packet);
         }
+        else
+            add_zombie_request(sftp, op->request_id);
     }
 
-    if (sftp->open_state == libssh2_NB_state_sent) {
-        size_t data_len;
-        unsigned char *data;
-        static const unsigned char fopen_responses[2] =
-            { SSH_FXP_HANDLE, SSH_FXP_STATUS };
-        rc = sftp_packet_requirev(sftp, 2, fopen_responses,
-                                  sftp->open_request_id, &data,
-                                  &data_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block waiting for status message");
-            return NULL;
-        }
-        sftp->open_state = libssh2_NB_state_idle;
-        if (rc) {
-            _libssh2_error(session, rc, "Timeout waiting for status message");
-            return NULL;
-        }
+    if (op->direct.listed)
+        sftp_id_remove(&sftp->direct_hash, &op->direct.entry);
+    if (op->async.type)
+        sftp_id_remove(&sftp->async_hash, &op->async.entry);
+    if (sftp->partial_direct == &op->direct)
+        /* its data is coming in, there is nowhere to put it now */
+        sftp->partial_direct = NULL;
 
-        /* OPEN can basically get STATUS or HANDLE back, where HANDLE implies
-           a fine response while STATUS means error. It seems though that at
-           times we get an SSH_FX_OK back in a STATUS, followed the "real"
-           HANDLE so we need to properly deal with that. */
-        if (data[0] == SSH_FXP_STATUS) {
-            int badness = 1;
+    _libssh2_list_remove(&op->node);
+    _libssh2_slab_free(session, op, op->size);
+}
 
-            if(data_len < 9) {
-                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                               "Too small FXP_STATUS");
-                LIBSSH2_FREE(session, data);
-                return NULL;
-            }
+/*
+ * sftp_op_abandon
+ *
+ * Give up on an operation. One with its request partly sent is freed by
+ * sftp_op_send() once the rest went out, as nothing else can be sent before.
+ */
+static void
+sftp_op_abandon(LIBSSH2_SFTP_OP *op)
+{
+    if((op->state == libssh2_NB_state_created) && op->packet_sent)
+        op->abandoned = 1;
+    else
+        sftp_op_destroy(op);
+}
 
-            sftp->last_errno = _libssh2_ntohu32(data + 5);
+/*
+ * sftp_op_send
+ *
+ * Send the requests of the operations that haven't been sent yet, in the
+ * order they were made, as a partly sent request must be completed before
+ * the next one can start. Returns LIBSSH2_ERROR_EAGAIN if not all of them
+ * could be sent. A failure to send is kept in the operation it happened to.
+ */
+static int
+sftp_op_send(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SFTP_OP *op = _libssh2_list_first(&sftp->ops);
 
-            if(LIBSSH2_FX_OK == sftp->last_errno) {
-                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got HANDLE FXOK!");
+    while (sftp->ops_unsent && op) {
+        LIBSSH2_SFTP_OP *next = _libssh2_list_next(&op->node);
+        ssize_t rc;
 
-                LIBSSH2_FREE(session, data);
+        if (op->state != libssh2_NB_state_created) {
+            op = next;
+            continue;
+        }
 
-                /* silly situation, but check for a HANDLE */
-                rc = sftp_packet_require(sftp, SSH_FXP_HANDLE,
-                                         sftp->open_request_id, &data,
-                                         &data_len);
-                if(rc == LIBSSH2_ERROR_EAGAIN) {
-                    /* go back to sent state and wait for something else */
-                    sftp->open_state = libssh2_NB_state_sent;
-                    return NULL;
-                }
-                else if(!rc)
-                    /* we got the handle so this is not a bad situation */
-                    badness = 0;
-            }
+        rc = _libssh2_channel_write(sftp->channel, 0,
+                                    &op->packet[op->packet_sent],
+                                    op->packet_len - op->packet_sent);
+        if ((rc == LIBSSH2_ERROR_EAGAIN) || !rc)
+            return LIBSSH2_ERROR_EAGAIN;
 
-            if(badness) {
-                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                               "Failed opening remote file");
-                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got FXP_STATUS %d",
-                               sftp->last_errno);
-                LIBSSH2_FREE(session, data);
-                return NULL;
-            }
+        if (rc < 0) {
+            sftp->ops_unsent--;
+            op->state = libssh2_NB_state_end;
+            op->error = (int)rc;
         }
+        else {
+            op->packet_sent += rc;
+            if (op->packet_sent < op->packet_len)
+                /* the channel window is full */
+                return LIBSSH2_ERROR_EAGAIN;
 
-        if(data_len < 10) {
-            _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                           "Too small FXP_HANDLE");
-            LIBSSH2_FREE(session, data);
-            return NULL;
+            sftp->ops_unsent--;
+            op->state = libssh2_NB_state_sent;
+            _libssh2_debug(sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                           "Sent request id %lu", op->request_id);
         }
 
-        fp = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_SFTP_HANDLE));
-        if (!fp) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate new SFTP handle structure");
-            LIBSSH2_FREE(session, data);
-            return NULL;
-        }
-        fp->handle_type = open_file ? LIBSSH2_SFTP_HANDLE_FILE :
-            LIBSSH2_SFTP_HANDLE_DIR;
+        if (op->abandoned)
+            sftp_op_destroy(op);
+        op = next;
+    }
 
-        fp->handle_len = _libssh2_ntohu32(data + 5);
-        if (fp->handle_len > SFTP_HANDLE_MAXLEN)
-            /* SFTP doesn't allow handles longer than 256 characters */
-            fp->handle_len = SFTP_HANDLE_MAXLEN;
+    return 0;
+}
 
-        if(fp->handle_len > (data_len - 9))
-            /* do not reach beyond the end of the data we got */
-            fp->handle_len = data_len - 9;
+/*
+ * sftp_op_wait
+ *
+ * Wait for the response to an operation's request, which is one of two
+ * packet types.
+ */
+static int
+sftp_op_wait(LIBSSH2_SFTP_OP *op, const unsigned char *responses,
+             unsigned char **data, size_t *data_len)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+    int rc = sftp_op_send(sftp);
 
-        memcpy(fp->handle, data + 9, fp->handle_len);
+    if (op->state == libssh2_NB_state_end)
+        return _libssh2_error(sftp->channel->session, op->error,
+                              "Unable to send SFTP request");
+    if (op->state == libssh2_NB_state_created)
+        return rc;
 
-        LIBSSH2_FREE(session, data);
+    rc = sftp_packet_requirev(sftp, 2, responses, op->request_id, data,
+                              data_len);
+    if (rc && (rc != LIBSSH2_ERROR_EAGAIN))
+        return _libssh2_error(sftp->channel->session, rc,
+                              "Timeout waiting for status message");
+    return rc;
+}
 
-        /* add this file handle to the list kept in the sftp session */
-        _libssh2_list_add(&sftp->sftp_handles, &fp->node);
+/*
+ * sftp_op_stat
+ *
+ * Make a STAT, LSTAT or SETSTAT operation
+ */
+static LIBSSH2_SFTP_OP *
+sftp_op_stat(LIBSSH2_SFTP *sftp, const char *path, unsigned int path_len,
+             int stat_type, const LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP_OP *op;
+    unsigned char *s;
+    unsigned char type;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
+    size_t packet_len = path_len + 13;
 
-        fp->sftp = sftp; /* point to the parent struct */
+    switch (stat_type) {
+    case LIBSSH2_SFTP_SETSTAT:
+        type = SSH_FXP_SETSTAT;
+        packet_len += sftp_attrsize(attrs->flags);
+        break;
 
-        fp->u.file.offset = 0;
-        fp->u.file.offset_sent = 0;
+    case LIBSSH2_SFTP_LSTAT:
+        type = SSH_FXP_LSTAT;
+        break;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Open command successful");
-        return fp;
+    case LIBSSH2_SFTP_STAT:
+    default:
+        type = SSH_FXP_STAT;
     }
-    return NULL;
-}
 
-/* libssh2_sftp_open_ex
- */
-LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+    _libssh2_debug(sftp->channel->session, LIBSSH2_TRACE_SFTP, "%s %s",
+                   (stat_type == LIBSSH2_SFTP_SETSTAT) ? "Set-statting" :
+                   (stat_type ==
+                    LIBSSH2_SFTP_LSTAT ? "LStatting" : "Statting"), path);
+
+    op = sftp_op_new(sftp, type, packet_len, &s);
+    if (!op)
+        return NULL;
+
+    _libssh2_store_str(&s, path, path_len);
+    if (type == SSH_FXP_SETSTAT) {
+        s += sftp_attr2bin(s, attrs);
+        sftp_attr_cache_drop(sftp, path, path_len);
+    }
+
+    return op;
+}
+
+/*
+ * sftp_op_stat_result
+ *
+ * Get the attributes a STAT or LSTAT operation got back, or the outcome of
+ * a SETSTAT. The operation is freed unless this returns EAGAIN.
+ */
+static int
+sftp_op_stat_result(LIBSSH2_SFTP_OP *op, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *data;
+    size_t data_len;
+    static const unsigned char stat_responses[2] =
+        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
+    int rc = sftp_op_wait(op, stat_responses, &data, &data_len);
+
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    /* the response is here, or there won't be one */
+    op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(op);
+    if (rc)
+        return rc;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        int retcode;
+
+        retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_OK) {
+            return 0;
+        } else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
+    }
+
+    if (attrs) {
+        memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+        sftp_bin2attr(attrs, data + 5);
+    }
+    LIBSSH2_FREE(session, data);
+
+    return 0;
+}
+
+/*
+ * sftp_op_open
+ *
+ * Make an OPEN or OPENDIR operation
+ */
+static LIBSSH2_SFTP_OP *
+sftp_op_open(LIBSSH2_SFTP *sftp, const char *filename, size_t filename_len,
+             uint32_t flags, long mode, int open_type)
+{
+    LIBSSH2_SFTP_OP *op;
+    LIBSSH2_SFTP_ATTRIBUTES attrs = {
+        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
+    };
+    unsigned char *s;
+    int open_file = (open_type == LIBSSH2_SFTP_OPENFILE)?1:0;
+
+    /* packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) +
+       flags(4) */
+    size_t packet_len = filename_len + 13 +
+        (open_file? (4 + sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS)) : 0);
+
+    _libssh2_debug(sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                   "Sending %s open request", open_file? "file" : "directory");
+
+    op = sftp_op_new(sftp, open_file? SSH_FXP_OPEN : SSH_FXP_OPENDIR,
+                     packet_len, &s);
+    if (!op)
+        return NULL;
+
+    _libssh2_store_str(&s, filename, filename_len);
+
+    if (open_file) {
+        /* Filetype in SFTP 3 and earlier */
+        attrs.permissions = mode | LIBSSH2_SFTP_ATTR_PFILETYPE_FILE;
+
+        _libssh2_store_u32(&s, flags);
+        s += sftp_attr2bin(s, &attrs);
+    }
+
+    return op;
+}
+
+/*
+ * sftp_attr_cache_opened
+ *
+ * Copy the path out of an OPEN or OPENDIR that got its handle, for the
+ * attribute cache. A file opened to be changed is dropped from the cache
+ * now, and once more when it is closed. Returns NULL if out of memory.
+ */
+static char *
+sftp_attr_cache_opened(LIBSSH2_SFTP_OP *op, size_t *path_len, char *write)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+    /* the path is at 9 = packet_len(4) + packet_type(1) + request_id(4) */
+    unsigned char *s = op->packet + 9;
+    size_t len = _libssh2_ntohu32(s);
+    char *path = LIBSSH2_ALLOC(sftp->channel->session, len + 1);
+
+    if (!path)
+        return NULL;
+    memcpy(path, s + 4, len);
+    path[len] = '\0';
+    *path_len = len;
+
+    *write = (op->type == SSH_FXP_OPEN) &&
+        (_libssh2_ntohu32(s + 4 + len) &
+         (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_APPEND | LIBSSH2_FXF_CREAT |
+          LIBSSH2_FXF_TRUNC));
+    if (*write)
+        sftp_attr_cache_drop(sftp, path, len);
+    return path;
+}
+
+/*
+ * sftp_op_open_result
+ *
+ * Get the handle an OPEN or OPENDIR operation got back. The operation is
+ * freed unless this fails with EAGAIN.
+ */
+static LIBSSH2_SFTP_HANDLE *
+sftp_op_open_result(LIBSSH2_SFTP_OP *op)
+{
+    LIBSSH2_SFTP *sftp = op->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    LIBSSH2_SFTP_HANDLE *fp;
+    size_t data_len;
+    unsigned char *data;
+    static const unsigned char fopen_responses[2] =
+        { SSH_FXP_HANDLE, SSH_FXP_STATUS };
+    static const unsigned char fopen_handle[2] =
+        { SSH_FXP_HANDLE, SSH_FXP_HANDLE };
+    int open_file = (op->type == SSH_FXP_OPEN);
+    char *cache_path = NULL;
+    size_t cache_path_len = 0;
+    char cache_write = 0;
+    int rc;
+
+    /* OPEN can basically get STATUS or HANDLE back, where HANDLE implies
+       a fine response while STATUS means error. It seems though that at
+       times we get an SSH_FX_OK back in a STATUS, followed the "real"
+       HANDLE so we need to properly deal with that. */
+    rc = sftp_op_wait(op, (op->state == libssh2_NB_state_sent1) ?
+                      fopen_handle : fopen_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                       "Would block waiting for status message");
+        return NULL;
+    }
+    if (rc) {
+        op->state = libssh2_NB_state_idle;
+        sftp_op_destroy(op);
+        return NULL;
+    }
+
+    if (data[0] == SSH_FXP_STATUS) {
+        if(data_len < 9) {
+            _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                           "Too small FXP_STATUS");
+            LIBSSH2_FREE(session, data);
+            op->state = libssh2_NB_state_idle;
+            sftp_op_destroy(op);
+            return NULL;
+        }
+
+        sftp->last_errno = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+
+        if(LIBSSH2_FX_OK == sftp->last_errno) {
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got HANDLE FXOK!");
+
+            /* silly situation, but check for a HANDLE */
+            op->state = libssh2_NB_state_sent1;
+            return sftp_op_open_result(op);
+        }
+
+        _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                       "Failed opening remote file");
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got FXP_STATUS %d",
+                       sftp->last_errno);
+        op->state = libssh2_NB_state_idle;
+        sftp_op_destroy(op);
+        return NULL;
+    }
+
+    if (sftp->attr_cache.table)
+        cache_path = sftp_attr_cache_opened(op, &cache_path_len,
+                                            &cache_write);
+
+    op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(op);
+
+    if(data_len < 10) {
+        _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                       "Too small FXP_HANDLE");
+        LIBSSH2_FREE(session, data);
+        if (cache_path)
+            LIBSSH2_FREE(session, cache_path);
+        return NULL;
+    }
+
+    fp = LIBSSH2_CALLOC(session, sizeof(LIBSSH2_SFTP_HANDLE));
+    if (!fp) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate new SFTP handle structure");
+        LIBSSH2_FREE(session, data);
+        if (cache_path)
+            LIBSSH2_FREE(session, cache_path);
+        return NULL;
+    }
+    fp->cache_path = cache_path;
+    fp->cache_path_len = cache_path_len;
+    fp->cache_write = cache_write;
+    fp->handle_type = open_file ? LIBSSH2_SFTP_HANDLE_FILE :
+        LIBSSH2_SFTP_HANDLE_DIR;
+
+    fp->handle_len = _libssh2_ntohu32(data + 5);
+    if (fp->handle_len > SFTP_HANDLE_MAXLEN)
+        /* SFTP doesn't allow handles longer than 256 characters */
+        fp->handle_len = SFTP_HANDLE_MAXLEN;
+
+    if(fp->handle_len > (data_len - 9))
+        /* do not reach beyond the end of the data we got */
+        fp->handle_len = data_len - 9;
+
+    memcpy(fp->handle, data + 9, fp->handle_len);
+
+    LIBSSH2_FREE(session, data);
+
+    /* add this file handle to the list kept in the sftp session */
+    _libssh2_list_add(&sftp->sftp_handles, &fp->node);
+
+    fp->sftp = sftp; /* point to the parent struct */
+
+    fp->u.file.offset = 0;
+    fp->u.file.offset_sent = 0;
+    fp->u.file.read_ahead = sftp->read_ahead;
+    fp->u.file.read_ahead_requests = sftp->read_ahead_requests;
+    fp->u.file.read_ahead_flags = sftp->read_ahead_flags;
+    fp->u.file.write_behind = sftp->write_behind;
+    fp->u.file.write_behind_requests = sftp->write_behind_requests;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Open command successful");
+    return fp;
+}
+
+/*
+ * sftp_op_open_handle
+ *
+ * Get the server's handle an OPEN or OPENDIR operation got back, for the
+ * engines that keep it themselves instead of in a handle struct. Returns 0
+ * or the error of sftp_op_open_result().
+ */
+static int
+sftp_op_open_handle(LIBSSH2_SFTP_OP *op, char *handle, size_t *handle_len)
+{
+    LIBSSH2_SESSION *session = op->sftp->channel->session;
+    LIBSSH2_SFTP_HANDLE *fp = sftp_op_open_result(op);
+
+    if (!fp)
+        return libssh2_session_last_errno(session);
+
+    *handle_len = fp->handle_len;
+    memcpy(handle, fp->handle, fp->handle_len);
+    _libssh2_list_remove(&fp->node);
+    if (fp->cache_path)
+        LIBSSH2_FREE(session, fp->cache_path);
+    LIBSSH2_FREE(session, fp);
+    return 0;
+}
+
+/* sftp_open
+ */
+static LIBSSH2_SFTP_HANDLE *
+sftp_open(LIBSSH2_SFTP *sftp, const char *filename,
+          size_t filename_len, uint32_t flags, long mode,
+          int open_type)
+{
+    LIBSSH2_SFTP_HANDLE *fp;
+
+    if (!sftp->open_op) {
+        sftp->open_op = sftp_op_open(sftp, filename, filename_len, flags,
+                                     mode, open_type);
+        if (!sftp->open_op)
+            return NULL;
+    }
+
+    fp = sftp_op_open_result(sftp->open_op);
+    if (fp || (libssh2_session_last_errno(sftp->channel->session) !=
+               LIBSSH2_ERROR_EAGAIN))
+        sftp->open_op = NULL;
+    return fp;
+}
+
+/* libssh2_sftp_open_ex
+ */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
 libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp, const char *filename,
                      unsigned int filename_len, unsigned long flags, long mode,
                      int open_type)
@@ -1231,6 +2403,84 @@ libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp, const char *filename,
     return hnd;
 }
 
+/*
+ * sftp_read_ahead_size
+ *
+ * Returns how many bytes sftp_read() should keep asked for without having
+ * got them back yet.
+ */
+static size_t sftp_read_ahead_size(struct _libssh2_sftp_handle_file_data
+                                   *filep, size_t buffer_size)
+{
+    size_t max_read_ahead;
+
+    if(filep->read_ahead_flags & LIBSSH2_SFTP_READ_AHEAD_ADAPTIVE) {
+        if(!filep->ra_window) {
+            filep->ra_window = LIBSSH2_SFTP_READ_AHEAD_INITIAL;
+            if(filep->read_ahead && filep->ra_window > filep->read_ahead)
+                filep->ra_window = filep->read_ahead;
+        }
+        return filep->ra_window;
+    }
+
+    if(filep->read_ahead)
+        return filep->read_ahead;
+
+    /* buffer_size*4 is just picked more or less out of the air. The idea is
+       that when reading SFTP from a remote server, we send away multiple
+       read requests guessing that the client will read more than only this
+       'buffer_size' amount of memory. So we ask for maximum buffer_size*4
+       amount of data so that we can return them very fast in subsequent
+       calls. */
+    max_read_ahead = buffer_size*4;
+    if(max_read_ahead > LIBSSH2_CHANNEL_WINDOW_DEFAULT*4)
+        max_read_ahead = LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
+
+    return max_read_ahead;
+}
+
+/*
+ * sftp_read_ahead_ack
+ *
+ * Feeds 'bytes' of returned FXP_DATA to the adaptive read-ahead. Like TCP
+ * slow start the window grows by what got acked, which doubles it every
+ * round trip, until the rate measured over a round stops improving.
+ */
+static void sftp_read_ahead_ack(struct _libssh2_sftp_handle_file_data *filep,
+                                size_t bytes)
+{
+    size_t max_window = filep->read_ahead ? filep->read_ahead :
+        LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
+
+    if(!(filep->read_ahead_flags & LIBSSH2_SFTP_READ_AHEAD_ADAPTIVE))
+        return;
+
+    if(filep->ra_stalls < LIBSSH2_SFTP_READ_AHEAD_STALLS) {
+        filep->ra_window += bytes;
+        if(filep->ra_window > max_window)
+            filep->ra_window = max_window;
+    }
+
+    if(filep->ra_round_start && filep->offset >= filep->ra_round_end) {
+        libssh2_uint64_t elapsed = _libssh2_time_us() - filep->ra_round_start;
+        libssh2_uint64_t rate;
+
+        if(!elapsed)
+            elapsed = 1;
+        rate = (filep->offset - filep->ra_round_begin) * 1000000 / elapsed;
+
+        if(rate > filep->ra_best_rate + filep->ra_best_rate/4) {
+            /* still getting faster, so the pipe isn't full yet */
+            filep->ra_best_rate = rate;
+            filep->ra_stalls = 0;
+        }
+        else if(filep->ra_stalls < LIBSSH2_SFTP_READ_AHEAD_STALLS)
+            filep->ra_stalls++;
+
+        filep->ra_round_start = 0; /* the next requests start a new round */
+    }
+}
+
 /*
  * sftp_read
  *
@@ -1300,7 +2550,7 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             filep->offset += copy;
 
             if(!filep->data_left) {
-                LIBSSH2_FREE(session, filep->data);
+                _libssh2_slab_free(session, filep->data, filep->data_len);
                 filep->data = NULL;
             }
 
@@ -1316,12 +2566,9 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             /* Number of bytes asked for that haven't been acked yet */
             size_t already = (size_t)(filep->offset_sent - filep->offset);
 
-            size_t max_read_ahead = buffer_size*4;
+            size_t max_read_ahead = sftp_read_ahead_size(filep, buffer_size);
             unsigned long recv_window;
 
-            if(max_read_ahead > LIBSSH2_CHANNEL_WINDOW_DEFAULT*4)
-                max_read_ahead = LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
-
             /* if the buffer_size passed in now is smaller than what has
                already been sent, we risk getting count become a very large
                number */
@@ -1338,15 +2585,24 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                If 'already' is very large it should be perfectly fine to have
                count set to 0 as then we don't have to ask for more data
                (right now).
-
-               buffer_size*4 is just picked more or less out of the air. The
-               idea is that when reading SFTP from a remote server, we send
-               away multiple read requests guessing that the client will read
-               more than only this 'buffer_size' amount of memory. So we ask
-               for maximum buffer_size*4 amount of data so that we can return
-               them very fast in subsequent calls.
             */
 
+            if(filep->read_ahead_requests) {
+                /* don't have more than this many requests outstanding */
+                unsigned int requests = 0;
+
+                for(chunk = _libssh2_list_first(&handle->packet_list); chunk;
+                    chunk = _libssh2_list_next(&chunk->node))
+                    requests++;
+
+                if(requests >= filep->read_ahead_requests)
+                    count = 0;
+                else if(count > (size_t)(filep->read_ahead_requests -
+                                         requests) * sftp->max_read_len)
+                    count = (size_t)(filep->read_ahead_requests - requests) *
+                        sftp->max_read_len;
+            }
+
             recv_window = libssh2_channel_window_read_ex(sftp->channel,
                                                          NULL, NULL);
             if(max_read_ahead > recv_window) {
@@ -1376,11 +2632,10 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             uint32_t size = count;
             if (size < buffer_size)
                 size = buffer_size;
-            if (size > MAX_SFTP_READ_SIZE)
-                size = MAX_SFTP_READ_SIZE;
+            if (size > sftp->max_read_len)
+                size = (uint32_t)sftp->max_read_len;
 
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
+            chunk = _libssh2_slab_alloc(session, SFTP_CHUNK_SIZE(handle));
             if (!chunk)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "malloc fail for FXP_WRITE");
@@ -1389,12 +2644,14 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             chunk->len = size;
             chunk->lefttosend = packet_len;
             chunk->sent = 0;
+            chunk->waited = 0;
+            handle->stats.read_requests++;
 
             s = chunk->packet;
 
             _libssh2_store_u32(&s, packet_len - 4);
             *s++ = SSH_FXP_READ;
-            request_id = sftp->request_id++;
+            request_id = sftp_request_id(sftp, SSH_FXP_READ, packet_len);
             chunk->request_id = request_id;
             _libssh2_store_u32(&s, request_id);
             _libssh2_store_str(&s, handle->handle, handle->handle_len);
@@ -1411,6 +2668,14 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                            request_id, (int)chunk->offset, (int)chunk->len);
         }
 
+        if((filep->read_ahead_flags & LIBSSH2_SFTP_READ_AHEAD_ADAPTIVE) &&
+           !filep->ra_round_start) {
+            /* time how long it takes to get back what is asked for now */
+            filep->ra_round_start = _libssh2_time_us();
+            filep->ra_round_begin = filep->offset;
+            filep->ra_round_end = filep->offset_sent;
+        }
+
     case libssh2_NB_state_sent:
 
         sftp->read_state = libssh2_NB_state_idle;
@@ -1482,6 +2747,10 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
             rc = sftp_packet_requirev(sftp, 2, read_responses,
                                       chunk->request_id, &data, &data_len);
 
+            if ((rc == LIBSSH2_ERROR_EAGAIN) && !bytes_in_buffer)
+                /* the caller has to wait for this one */
+                chunk->waited = 1;
+
             if (rc==LIBSSH2_ERROR_EAGAIN && bytes_in_buffer != 0) {
                 /* do not return EAGAIN if we have already
                  * written data into the buffer */
@@ -1503,14 +2772,14 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                 /* remove the chunk we just processed */
 
                 _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
+                _libssh2_slab_free(session, chunk, SFTP_CHUNK_SIZE(handle));
 
                 /* we must remove all outstanding READ requests, as either we
                    got an error or we're at end of file */
                 sftp_packetlist_flush(handle);
 
                 rc32 = _libssh2_ntohu32(data + 5);
-                LIBSSH2_FREE(session, data);
+                _libssh2_slab_free(session, data, data_len);
 
                 if (rc32 == LIBSSH2_FX_EOF) {
                     filep->eof = TRUE;
@@ -1576,15 +2845,21 @@ static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
                 bytes_in_buffer += rc32;
                 sliding_bufferp += rc32;
 
+                sftp_read_ahead_ack(filep, chunk->len);
+                if (chunk->waited)
+                    handle->stats.read_ahead_misses++;
+                else
+                    handle->stats.read_ahead_hits++;
+
                 if(filep->data_len == 0)
                     /* free the allocated data if not stored to keep */
-                    LIBSSH2_FREE(session, data);
+                    _libssh2_slab_free(session, data, data_len);
 
                 /* remove the chunk we just processed keeping track of the
                  * next one in case we need it */
                 next = _libssh2_list_next(&chunk->node);
                 _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
+                _libssh2_slab_free(session, chunk, SFTP_CHUNK_SIZE(handle));
 
                 /* check if we have space left in the buffer
                  * and either continue to the next chunk or stop
@@ -1629,171 +2904,269 @@ libssh2_sftp_read(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, hnd->sftp->channel->session,
                  sftp_read(hnd, buffer, buffer_maxlen));
+    if (rc > 0)
+        hnd->stats.bytes_read += rc;
     return rc;
 }
 
-/* sftp_readdir
- * Read from an SFTP directory handle
+/*
+ * sftp_op_readdir
+ *
+ * Make an operation asking for the next batch of names in a directory
  */
-static ssize_t sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
-                            size_t buffer_maxlen, char *longentry,
-                            size_t longentry_maxlen,
-                            LIBSSH2_SFTP_ATTRIBUTES *attrs)
+static LIBSSH2_SFTP_OP *
+sftp_op_readdir(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP_OP *op;
+    unsigned char *s;
+
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    op = sftp_op_new(handle->sftp, SSH_FXP_READDIR, handle->handle_len + 13,
+                     &s);
+    if (op)
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+    return op;
+}
+
+/*
+ * sftp_readdir_fetch
+ *
+ * Make sure there are names left in the FXP_NAME packet of a directory
+ * handle, getting the next one if needed. Returns 0 with no names left at
+ * the end of the directory.
+ */
+static int
+sftp_readdir_fetch(LIBSSH2_SFTP_HANDLE *handle)
 {
     LIBSSH2_SFTP *sftp = handle->sftp;
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct _libssh2_sftp_handle_dir_data *dir = &handle->u.dir;
     size_t data_len;
-    uint32_t num_names;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
-    uint32_t packet_len = handle->handle_len + 13;
-    unsigned char *s, *data;
+    unsigned char *data;
     static const unsigned char read_responses[2] = {
         SSH_FXP_NAME, SSH_FXP_STATUS };
-    ssize_t retcode;
+    int rc;
 
-    if (sftp->readdir_state == libssh2_NB_state_idle) {
-        if (handle->u.dir.names_left) {
-            /*
-             * A prior request returned more than one directory entry,
-             * feed it back from the buffer
-             */
-            LIBSSH2_SFTP_ATTRIBUTES attrs_dummy;
-            size_t real_longentry_len;
-            size_t real_filename_len;
-            size_t filename_len;
-            size_t longentry_len;
+    if (dir->names_left)
+        return 0;
 
-            s = (unsigned char *) handle->u.dir.next_name;
-            real_filename_len = _libssh2_ntohu32(s);
+    if (dir->names_packet) {
+        LIBSSH2_FREE(session, dir->names_packet);
+        dir->names_packet = NULL;
+    }
 
-            s += 4;
+    if (!dir->readdir_op) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Reading entries from directory handle");
+        dir->readdir_op = sftp_op_readdir(handle);
+        if (!dir->readdir_op)
+            return LIBSSH2_ERROR_ALLOC;
+    }
 
-            filename_len = real_filename_len;
-            if (filename_len >= buffer_maxlen) {
-                filename_len = (size_t)LIBSSH2_ERROR_BUFFER_TOO_SMALL;
-                goto end;
-            }
+    rc = sftp_op_wait(dir->readdir_op, read_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
 
-            memcpy(buffer, s, filename_len);
-            buffer[filename_len] = '\0';           /* zero terminate */
-            s += real_filename_len;
+    dir->readdir_op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(dir->readdir_op);
+    dir->readdir_op = NULL;
+    if (rc)
+        return rc;
 
-            real_longentry_len = _libssh2_ntohu32(s);
-            s += 4;
+    if (data[0] == SSH_FXP_STATUS) {
+        uint32_t retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_EOF)
+            return 0;
 
-            if (longentry && (longentry_maxlen>1)) {
-                longentry_len = real_longentry_len;
+        sftp->last_errno = retcode;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
+    }
 
-                if (longentry_len >= longentry_maxlen) {
-                    filename_len = (size_t)LIBSSH2_ERROR_BUFFER_TOO_SMALL;
-                    goto end;
-                }
+    if (data_len < 9) {
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Too small FXP_NAME");
+    }
 
-                memcpy(longentry, s, longentry_len);
-                longentry[longentry_len] = '\0'; /* zero terminate */
-            }
-            s += real_longentry_len;
+    dir->names_left = _libssh2_ntohu32(data + 5);
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%lu entries returned",
+                   dir->names_left);
+    if (!dir->names_left) {
+        LIBSSH2_FREE(session, data);
+        return 0;
+    }
 
-            if (attrs)
-                memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    dir->names_packet = data;
+    dir->next_name = (char *) data + 9;
+    dir->names_end = (char *) data + data_len;
 
-            s += sftp_bin2attr(attrs ? attrs : &attrs_dummy, s);
+    /* ask for the next batch while this one is being consumed. If that
+       fails it is asked for again once it is needed */
+    dir->readdir_op = sftp_op_readdir(handle);
+    if (dir->readdir_op)
+        sftp_op_send(sftp);
 
-            handle->u.dir.next_name = (char *) s;
-          end:
+    return 0;
+}
 
-            if ((--handle->u.dir.names_left) == 0)
-                LIBSSH2_FREE(session, handle->u.dir.names_packet);
+/*
+ * sftp_name_parse
+ *
+ * Point 'entry' at the name at 's' in an FXP_NAME packet ending at 'end',
+ * without moving past it. Returns the size of the name in the packet, or a
+ * negative error.
+ */
+static ssize_t
+sftp_name_parse(LIBSSH2_SESSION *session, unsigned char *s,
+                unsigned char *end, LIBSSH2_SFTP_DIRENT *entry)
+{
+    unsigned char *start = s;
+    uint32_t flags;
 
-            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                           "libssh2_sftp_readdir_ex() return %d",
-                           filename_len);
-            return (ssize_t)filename_len;
-        }
+    if ((end - s) < 4)
+        goto toosmall;
+    entry->name_len = _libssh2_ntohu32(s);
+    s += 4;
+    if ((size_t)(end - s) < entry->name_len + 4)
+        goto toosmall;
+    entry->name = (const char *) s;
+    s += entry->name_len;
 
-        /* Request another entry(entries?) */
+    entry->longentry_len = _libssh2_ntohu32(s);
+    s += 4;
+    if ((size_t)(end - s) < entry->longentry_len + 4)
+        goto toosmall;
+    entry->longentry = (const char *) s;
+    s += entry->longentry_len;
 
-        s = sftp->readdir_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->readdir_packet)
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "FXP_READDIR packet");
+    flags = _libssh2_ntohu32(s);
+    if ((end - s) < sftp_attrsize(flags))
+        goto toosmall;
+    s += sftp_bin2attr(&entry->attrs, s);
 
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_READDIR;
-        sftp->readdir_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->readdir_request_id);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+    return (ssize_t)(s - start);
 
-        sftp->readdir_state = libssh2_NB_state_created;
-    }
+  toosmall:
+    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                          "FXP_NAME packet too short");
+}
 
-    if (sftp->readdir_state == libssh2_NB_state_created) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Reading entries from directory handle");
-        retcode = _libssh2_channel_write(channel, 0, sftp->readdir_packet,
-                                         packet_len);
-        if (retcode == LIBSSH2_ERROR_EAGAIN) {
-            return retcode;
-        }
-        else if ((ssize_t)packet_len != retcode) {
-            LIBSSH2_FREE(session, sftp->readdir_packet);
-            sftp->readdir_packet = NULL;
-            sftp->readdir_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "_libssh2_channel_write() failed");
-        }
+/*
+ * sftp_readdir_parse
+ *
+ * Point 'entry' at the next name in the FXP_NAME packet of a directory
+ * handle, without moving past it
+ */
+static ssize_t
+sftp_readdir_parse(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_DIRENT *entry)
+{
+    return sftp_name_parse(handle->sftp->channel->session,
+                           (unsigned char *) handle->u.dir.next_name,
+                           (unsigned char *) handle->u.dir.names_end, entry);
+}
 
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-        sftp->readdir_packet = NULL;
+/*
+ * sftp_readdir_consume
+ *
+ * Move past the name 'entry' was parsed from. Both its strings end where the
+ * next field started, which has been decoded already, so they are zero
+ * terminated in place.
+ */
+static void
+sftp_readdir_consume(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_DIRENT *entry,
+                     size_t len)
+{
+    ((char *) entry->name)[entry->name_len] = '\0';
+    ((char *) entry->longentry)[entry->longentry_len] = '\0';
 
-        sftp->readdir_state = libssh2_NB_state_sent;
-    }
+    handle->u.dir.next_name += len;
+    handle->u.dir.names_left--;
+}
 
-    retcode = sftp_packet_requirev(sftp, 2, read_responses,
-                                   sftp->readdir_request_id, &data,
-                                   &data_len);
-    if (retcode == LIBSSH2_ERROR_EAGAIN)
-        return retcode;
-    else if (retcode) {
-        sftp->readdir_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, retcode,
-                              "Timeout waiting for status message");
-    }
+/* sftp_readdir_batch
+ * Read a number of entries from an SFTP directory handle
+ */
+static int sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *handle,
+                              LIBSSH2_SFTP_DIRENT *entries,
+                              unsigned int max_entries)
+{
+    unsigned int count = 0;
+    ssize_t len;
+    int rc;
 
-    if (data[0] == SSH_FXP_STATUS) {
-        retcode = _libssh2_ntohu32(data + 5);
-        LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_EOF) {
-            sftp->readdir_state = libssh2_NB_state_idle;
-            return 0;
-        }
-        else {
-            sftp->last_errno = retcode;
-            sftp->readdir_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
+    rc = sftp_readdir_fetch(handle);
+    if (rc)
+        return rc;
+
+    while ((count < max_entries) && handle->u.dir.names_left) {
+        len = sftp_readdir_parse(handle, &entries[count]);
+        if (len < 0) {
+            /* nothing more can be trusted in this packet */
+            handle->u.dir.names_left = 0;
+            return count ? (int)count : (int)len;
         }
+        sftp_readdir_consume(handle, &entries[count], len);
+        sftp_attr_cache_dirent(handle->sftp, handle->cache_path,
+                               handle->cache_path_len, &entries[count]);
+        count++;
     }
 
-    sftp->readdir_state = libssh2_NB_state_idle;
+    _libssh2_debug(handle->sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                   "libssh2_sftp_readdir_batch() return %d", count);
+    return (int)count;
+}
+
+/* sftp_readdir
+ * Read from an SFTP directory handle
+ */
+static ssize_t sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
+                            size_t buffer_maxlen, char *longentry,
+                            size_t longentry_maxlen,
+                            LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP_DIRENT entry;
+    ssize_t len;
+    int rc;
 
-    num_names = _libssh2_ntohu32(data + 5);
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%lu entries returned",
-                   num_names);
-    if (!num_names) {
-        LIBSSH2_FREE(session, data);
+    rc = sftp_readdir_fetch(handle);
+    if (rc)
+        return rc;
+    if (!handle->u.dir.names_left)
         return 0;
+
+    len = sftp_readdir_parse(handle, &entry);
+    if (len < 0) {
+        handle->u.dir.names_left = 0;
+        return len;
+    }
+
+    /* the entry is left for the next call if it doesn't fit */
+    if (entry.name_len >= buffer_maxlen)
+        return LIBSSH2_ERROR_BUFFER_TOO_SMALL;
+    if (longentry && (longentry_maxlen>1) &&
+        (entry.longentry_len >= longentry_maxlen))
+        return LIBSSH2_ERROR_BUFFER_TOO_SMALL;
+
+    memcpy(buffer, entry.name, entry.name_len);
+    buffer[entry.name_len] = '\0';           /* zero terminate */
+
+    if (longentry && (longentry_maxlen>1)) {
+        memcpy(longentry, entry.longentry, entry.longentry_len);
+        longentry[entry.longentry_len] = '\0'; /* zero terminate */
     }
 
-    handle->u.dir.names_left = num_names;
-    handle->u.dir.names_packet = data;
-    handle->u.dir.next_name = (char *) data + 9;
+    if (attrs)
+        *attrs = entry.attrs;
 
-    /* use the name popping mechanism from the start of the function */
-    return sftp_readdir(handle, buffer, buffer_maxlen, longentry,
-                        longentry_maxlen, attrs);
+    sftp_readdir_consume(handle, &entry, len);
+    sftp_attr_cache_dirent(handle->sftp, handle->cache_path,
+                           handle->cache_path_len, &entry);
+
+    _libssh2_debug(handle->sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                   "libssh2_sftp_readdir_ex() return %d", entry.name_len);
+    return (ssize_t)entry.name_len;
 }
 
 /* libssh2_sftp_readdir_ex
@@ -1814,6 +3187,22 @@ libssh2_sftp_readdir_ex(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
     return rc;
 }
 
+/* libssh2_sftp_readdir_batch
+ * Read a number of entries from an SFTP directory handle
+ */
+LIBSSH2_API int
+libssh2_sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *hnd,
+                           LIBSSH2_SFTP_DIRENT *entries,
+                           unsigned int max_entries)
+{
+    int rc;
+    if(!hnd || (hnd->handle_type != LIBSSH2_SFTP_HANDLE_DIR) || !entries)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_readdir_batch(hnd, entries, max_entries));
+    return rc;
+}
+
 /*
  * sftp_write
  *
@@ -1868,6 +3257,10 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
     size_t acked = 0;
     size_t org_count = count;
     size_t already;
+    libssh2_uint64_t buffer_offset;
+    size_t in_flight;
+    size_t max_in_flight;
+    unsigned int requests = 0;
 
     switch(sftp->write_state) {
     default:
@@ -1883,6 +3276,19 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
         already = (size_t) (handle->u.file.offset_sent - handle->u.file.offset)+
             handle->u.file.acked;
 
+        /* The WRITE packets refer to the application's data instead of
+           holding a copy. It is passed in again until it is acked, so point
+           the pending packets at this call's buffer in case it moved. */
+        buffer_offset = handle->u.file.offset - handle->u.file.acked;
+        for(chunk = _libssh2_list_first(&handle->packet_list); chunk;
+            chunk = _libssh2_list_next(&chunk->node)) {
+            if((chunk->offset >= buffer_offset) &&
+               (chunk->offset + chunk->len <= buffer_offset + count))
+                chunk->data = (const unsigned char *)buffer +
+                    (chunk->offset - buffer_offset);
+            requests++;
+        }
+
         if(count >= already) {
             /* skip the part already made into packets */
             buffer += already;
@@ -1892,38 +3298,56 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
             /* there is more data already fine than what we got in this call */
             count = 0;
 
+        /* Only keep so much data and so many requests waiting for their
+           ack. What doesn't fit is left for a later call, after acks have
+           made room, so the caller gets a partial count back meanwhile. */
+        in_flight = (size_t)(handle->u.file.offset_sent -
+                             handle->u.file.offset);
+        max_in_flight = handle->u.file.write_behind ?
+            handle->u.file.write_behind : LIBSSH2_SFTP_WRITE_BEHIND_DEFAULT;
+
         sftp->write_state = libssh2_NB_state_idle;
         while(count) {
             /* TODO: Possibly this should have some logic to prevent a very
                very small fraction to be left but lets ignore that for now */
-            uint32_t size = MIN(MAX_SFTP_OUTGOING_SIZE, count);
+            uint32_t size = (uint32_t)MIN(sftp->max_write_len, count);
             uint32_t request_id;
 
+            if(in_flight && (in_flight + size > max_in_flight))
+                break;
+            if(handle->u.file.write_behind_requests &&
+               (requests >= handle->u.file.write_behind_requests))
+                break;
+
             /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
                handle_len(4) + offset(8) + count(4) */
             packet_len = handle->handle_len + size + 25;
 
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
+            /* only the header is stored, the data is sent from 'buffer' */
+            chunk = _libssh2_slab_alloc(session, SFTP_CHUNK_SIZE(handle));
             if (!chunk)
                 return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                                       "malloc fail for FXP_WRITE");
 
+            chunk->offset = handle->u.file.offset_sent;
             chunk->len = size;
             chunk->sent = 0;
             chunk->lefttosend = packet_len;
+            chunk->data = (const unsigned char *)buffer;
+            chunk->waited = 0;
+            handle->stats.write_requests++;
 
             s = chunk->packet;
             _libssh2_store_u32(&s, packet_len - 4);
 
             *(s++) = SSH_FXP_WRITE;
-            request_id = sftp->request_id++;
+            request_id = sftp_request_id(sftp, SSH_FXP_WRITE, packet_len);
             chunk->request_id = request_id;
             _libssh2_store_u32(&s, request_id);
             _libssh2_store_str(&s, handle->handle, handle->handle_len);
             _libssh2_store_u64(&s, handle->u.file.offset_sent);
             handle->u.file.offset_sent += size; /* advance offset at once */
-            _libssh2_store_str(&s, buffer, size);
+            _libssh2_store_u32(&s, size);
 
             /* add this new entry LAST in the list */
             _libssh2_list_add(&handle->packet_list, &chunk->node);
@@ -1931,6 +3355,8 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
             buffer += size;
             count -= size; /* deduct the size we used, as we might have
                               to create more packets */
+            in_flight += size;
+            requests++;
         }
 
         /* move through the WRITE packets that haven't been sent and send as many
@@ -1939,9 +3365,21 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
 
         while(chunk) {
             if(chunk->lefttosend) {
-                rc = _libssh2_channel_write(channel, 0,
-                                            &chunk->packet[chunk->sent],
-                                            chunk->lefttosend);
+                /* the request header first, then the data */
+                size_t header_len = handle->handle_len + 25;
+                size_t sent = chunk->sent;
+
+                if(sent < header_len)
+                    rc = _libssh2_channel_write_prefixed(channel, 0,
+                                                         &chunk->packet[sent],
+                                                         header_len - sent,
+                                                         chunk->data,
+                                                         chunk->len);
+                else
+                    rc = _libssh2_channel_write(channel, 0,
+                                                &chunk->data[sent -
+                                                             header_len],
+                                                chunk->lefttosend);
                 if(rc < 0)
                     /* remain in idle state */
                     return rc;
@@ -1989,7 +3427,7 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
             }
 
             retcode = _libssh2_ntohu32(data + 5);
-            LIBSSH2_FREE(session, data);
+            _libssh2_slab_free(session, data, data_len);
 
             sftp->last_errno = retcode;
             if (retcode == LIBSSH2_FX_OK) {
@@ -2002,7 +3440,7 @@ static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
                 next = _libssh2_list_next(&chunk->node);
 
                 _libssh2_list_remove(&chunk->node); /* remove from list */
-                LIBSSH2_FREE(session, chunk); /* free memory */
+                _libssh2_slab_free(session, chunk, SFTP_CHUNK_SIZE(handle)); /* free memory */
 
                 chunk = next;
             }
@@ -2065,8 +3503,326 @@ libssh2_sftp_write(LIBSSH2_SFTP_HANDLE *hnd, const char *buffer,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, hnd->sftp->channel->session,
                  sftp_write(hnd, buffer, count));
+    if (rc > 0)
+        hnd->stats.bytes_written += rc;
+    return rc;
+
+}
+
+/*
+ * sftp_vec_issue
+ *
+ * Make a READ or WRITE for 'len' bytes of range 'index' from 'offset' on.
+ * Writes copy the data into the request.
+ */
+static int
+sftp_vec_issue(LIBSSH2_SFTP_HANDLE *handle, unsigned int index,
+               size_t offset, size_t len)
+{
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    LIBSSH2_SFTP_IOVEC *iov = &filep->vec[index];
+    struct sftp_vec_chunk *chunk;
+    unsigned char *s;
+
+    chunk = _libssh2_slab_alloc(session, sizeof(struct sftp_vec_chunk));
+    if (!chunk)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate vector chunk");
+
+    /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+       handle_len (4) + offset(8) + count(4) */
+    chunk->op = sftp_op_new(sftp, filep->vec_write ? SSH_FXP_WRITE :
+                            SSH_FXP_READ, handle->handle_len + 25 +
+                            (filep->vec_write ? len : 0), &s);
+    if (!chunk->op) {
+        _libssh2_slab_free(session, chunk, sizeof(struct sftp_vec_chunk));
+        return LIBSSH2_ERROR_ALLOC;
+    }
+    _libssh2_store_str(&s, handle->handle, handle->handle_len);
+    _libssh2_store_u64(&s, iov->offset + offset);
+    _libssh2_store_u32(&s, (uint32_t)len);
+    if (filep->vec_write)
+        memcpy(s, iov->buffer + offset, len);
+    else
+        sftp_direct_add(chunk->op, (unsigned char *)iov->buffer + offset,
+                        len);
+
+    chunk->index = index;
+    chunk->offset = offset;
+    chunk->len = len;
+    if (filep->vec_write)
+        handle->stats.write_requests++;
+    else
+        handle->stats.read_requests++;
+    _libssh2_list_add(&filep->vec_chunks, &chunk->node);
+    filep->vec_in_flight += len;
+    filep->vec_requests++;
+    return 0;
+}
+
+/*
+ * sftp_vec_chunk_free
+ *
+ * Forget a READ or WRITE of a vector, giving up on it if it is still out
+ */
+static void
+sftp_vec_chunk_free(LIBSSH2_SFTP_HANDLE *handle, struct sftp_vec_chunk *chunk)
+{
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+
+    if (chunk->op)
+        sftp_op_abandon(chunk->op);
+    filep->vec_in_flight -= chunk->len;
+    filep->vec_requests--;
+    _libssh2_list_remove(&chunk->node);
+    _libssh2_slab_free(handle->sftp->channel->session, chunk,
+                       sizeof(struct sftp_vec_chunk));
+}
+
+/*
+ * sftp_vec_reset
+ *
+ * Forget the vector in progress on a handle
+ */
+static void
+sftp_vec_reset(LIBSSH2_SFTP_HANDLE *handle)
+{
+    struct sftp_vec_chunk *chunk;
+
+    while ((chunk = _libssh2_list_first(&handle->u.file.vec_chunks)))
+        sftp_vec_chunk_free(handle, chunk);
+    handle->u.file.vec = NULL;
+}
+
+/*
+ * sftp_vec_result
+ *
+ * Handle the response to a READ or WRITE of a vector if it is here. A range
+ * that the server fails or that reaches the end of the file gets its result
+ * lowered, other errors are returned.
+ */
+static int
+sftp_vec_result(LIBSSH2_SFTP_HANDLE *handle, struct sftp_vec_chunk *chunk)
+{
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    LIBSSH2_SFTP_IOVEC *iov = &filep->vec[chunk->index];
+    static const unsigned char read_responses[2] =
+        { SSH_FXP_DATA, SSH_FXP_STATUS };
+    static const unsigned char write_responses[2] =
+        { SSH_FXP_STATUS, SSH_FXP_STATUS };
+    unsigned char *data;
+    size_t data_len;
+    uint32_t len;
+    int direct;
+    int rc;
+
+    rc = sftp_op_wait(chunk->op, filep->vec_write ? write_responses :
+                      read_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    /* the data of an FXP_DATA may be in the range's buffer already */
+    direct = chunk->op->direct.done;
+    chunk->op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(chunk->op);
+    chunk->op = NULL;
+    if (rc)
+        return rc;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        uint32_t retcode = _libssh2_ntohu32(data + 5);
+        _libssh2_slab_free(session, data, data_len);
+
+        if ((retcode == LIBSSH2_FX_EOF) && !filep->vec_write) {
+            /* the range ends before this chunk */
+            if (iov->result > (ssize_t)chunk->offset)
+                iov->result = (ssize_t)chunk->offset;
+        }
+        else if ((retcode != LIBSSH2_FX_OK) && (iov->result >= 0)) {
+            sftp->last_errno = retcode;
+            iov->result = LIBSSH2_ERROR_SFTP_PROTOCOL;
+        }
+        sftp_vec_chunk_free(handle, chunk);
+        return 0;
+    }
+
+    len = _libssh2_ntohu32(data + 5);
+    if ((len > chunk->len) || (!direct && (len > data_len - 9))) {
+        _libssh2_slab_free(session, data, data_len);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Read Packet too large");
+    }
+
+    if (iov->result >= 0) {
+        if (!direct)
+            memcpy(iov->buffer + chunk->offset, data + 9, len);
+
+        if (!len) {
+            if (iov->result > (ssize_t)chunk->offset)
+                iov->result = (ssize_t)chunk->offset;
+        }
+        else if (len < chunk->len) {
+            /* a short read, ask for the rest right away */
+            rc = sftp_vec_issue(handle, chunk->index, chunk->offset + len,
+                                chunk->len - len);
+            if (rc) {
+                _libssh2_slab_free(session, data, data_len);
+                return rc;
+            }
+        }
+    }
+    _libssh2_slab_free(session, data, data_len);
+    sftp_vec_chunk_free(handle, chunk);
+    return 0;
+}
+
+/*
+ * sftp_vec
+ *
+ * Read or write all the ranges of a vector with the requests pipelined, and
+ * handle the responses in whatever order they arrive
+ */
+static ssize_t
+sftp_vec(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_IOVEC *iov,
+         unsigned int iovcnt, int writing)
+{
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_vec_chunk *chunk;
+    struct sftp_vec_chunk *next;
+    size_t max_in_flight;
+    unsigned int max_requests;
+    size_t max_len;
+    ssize_t total = 0;
+    unsigned int i;
+    int progress;
+    int rc;
+
+    if (!filep->vec) {
+        if (!iovcnt)
+            return 0;
+        if (!iov)
+            return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                                  "No vector given");
+
+        filep->vec = iov;
+        filep->vec_count = iovcnt;
+        filep->vec_write = writing;
+        filep->vec_next = 0;
+        filep->vec_next_off = 0;
+        for (i = 0; i < iovcnt; i++)
+            iov[i].result = (ssize_t)iov[i].length;
+    }
+    else if ((filep->vec != iov) || (filep->vec_count != iovcnt) ||
+             (filep->vec_write != writing))
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "Another vector is in progress on the handle");
+
+    if (writing) {
+        max_in_flight = filep->write_behind ? filep->write_behind :
+            LIBSSH2_SFTP_WRITE_BEHIND_DEFAULT;
+        max_requests = filep->write_behind_requests;
+        max_len = sftp->max_write_len;
+    }
+    else {
+        max_in_flight = filep->read_ahead ? filep->read_ahead :
+            LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
+        max_requests = filep->read_ahead_requests;
+        max_len = sftp->max_read_len;
+    }
+
+    for (;;) {
+        /* make requests for the next ranges while the limits allow */
+        while (filep->vec_next < iovcnt) {
+            LIBSSH2_SFTP_IOVEC *range = &iov[filep->vec_next];
+            size_t len = MIN(max_len, range->length - filep->vec_next_off);
+
+            if ((range->result < 0) || !len) {
+                /* failed or done with */
+                filep->vec_next++;
+                filep->vec_next_off = 0;
+                continue;
+            }
+            if (filep->vec_in_flight &&
+                (filep->vec_in_flight + len > max_in_flight))
+                break;
+            if (max_requests && (filep->vec_requests >= max_requests))
+                break;
+
+            rc = sftp_vec_issue(handle, filep->vec_next,
+                                filep->vec_next_off, len);
+            if (rc)
+                goto fail;
+            filep->vec_next_off += len;
+        }
+
+        progress = 0;
+        for (chunk = _libssh2_list_first(&filep->vec_chunks); chunk;
+             chunk = next) {
+            next = _libssh2_list_next(&chunk->node);
+            rc = sftp_vec_result(handle, chunk);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                continue;
+            if (rc)
+                goto fail;
+            progress = 1;
+        }
+
+        if (!_libssh2_list_first(&filep->vec_chunks) &&
+            (filep->vec_next == iovcnt))
+            break;
+        if (!progress)
+            return LIBSSH2_ERROR_EAGAIN;
+    }
+
+    filep->vec = NULL;
+    for (i = 0; i < iovcnt; i++)
+        if (iov[i].result > 0)
+            total += iov[i].result;
+    return total;
+
+  fail:
+    sftp_vec_reset(handle);
+    return rc;
+}
+
+/* libssh2_sftp_readv
+ * Read several ranges of a file at once
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_readv(LIBSSH2_SFTP_HANDLE *hnd, LIBSSH2_SFTP_IOVEC *iov,
+                   unsigned int iovcnt)
+{
+    ssize_t rc;
+    if(!hnd || hnd->handle_type != LIBSSH2_SFTP_HANDLE_FILE)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_vec(hnd, iov, iovcnt, 0));
+    if (rc > 0)
+        hnd->stats.bytes_read += rc;
     return rc;
+}
 
+/* libssh2_sftp_writev
+ * Write several ranges of a file at once
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_writev(LIBSSH2_SFTP_HANDLE *hnd, LIBSSH2_SFTP_IOVEC *iov,
+                    unsigned int iovcnt)
+{
+    ssize_t rc;
+    if(!hnd || hnd->handle_type != LIBSSH2_SFTP_HANDLE_FILE)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_vec(hnd, iov, iovcnt, 1));
+    if (rc > 0)
+        hnd->stats.bytes_written += rc;
+    return rc;
 }
 
 static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
@@ -2082,6 +3838,38 @@ static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
     ssize_t rc;
     uint32_t retcode;
 
+    if ((sftp->fsync_state == libssh2_NB_state_idle) &&
+        (sftp->async_flags & LIBSSH2_SFTP_ASYNC_FSYNC)) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Issuing asynchronous fsync command");
+        sftp->fsync_op = sftp_op_new(sftp, SSH_FXP_EXTENDED, packet_len, &s);
+        if (!sftp->fsync_op)
+            return LIBSSH2_ERROR_ALLOC;
+        _libssh2_store_str(&s, "fsync@openssh.com", 17);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+        sftp_async_add(sftp->fsync_op, LIBSSH2_SFTP_ASYNC_FSYNC);
+        sftp->fsync_state = libssh2_NB_state_jump1;
+    }
+
+    if (sftp->fsync_state == libssh2_NB_state_jump1) {
+        /* done once the request is out, the answer is seen to later */
+        LIBSSH2_SFTP_OP *op = sftp->fsync_op;
+
+        sftp_op_send(sftp);
+        if (op->state == libssh2_NB_state_created)
+            return LIBSSH2_ERROR_EAGAIN;
+
+        sftp->fsync_op = NULL;
+        sftp->fsync_state = libssh2_NB_state_idle;
+        if (op->state == libssh2_NB_state_end) {
+            rc = op->error;
+            sftp_op_destroy(op);
+            return _libssh2_error(session, (int)rc,
+                                  "Unable to send FXP_EXTENDED command");
+        }
+        return 0;
+    }
+
     if (sftp->fsync_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
                        "Issuing fsync command");
@@ -2094,7 +3882,8 @@ static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_EXTENDED;
-        sftp->fsync_request_id = sftp->request_id++;
+        sftp->fsync_request_id = sftp_request_id(sftp, SSH_FXP_EXTENDED,
+                                                 packet_len);
         _libssh2_store_u32(&s, sftp->fsync_request_id);
         _libssh2_store_str(&s, "fsync@openssh.com", 17);
         _libssh2_store_str(&s, handle->handle, handle->handle_len);
@@ -2194,7 +3983,9 @@ static int sftp_fstat(LIBSSH2_SFTP_HANDLE *handle,
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = setstat ? SSH_FXP_FSETSTAT : SSH_FXP_FSTAT;
-        sftp->fstat_request_id = sftp->request_id++;
+        sftp->fstat_request_id =
+            sftp_request_id(sftp, setstat ? SSH_FXP_FSETSTAT : SSH_FXP_FSTAT,
+                            packet_len);
         _libssh2_store_u32(&s, sftp->fstat_request_id);
         _libssh2_store_str(&s, handle->handle, handle->handle_len);
 
@@ -2270,6 +4061,9 @@ libssh2_sftp_fstat_ex(LIBSSH2_SFTP_HANDLE *hnd,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, hnd->sftp->channel->session,
                  sftp_fstat(hnd, attrs, setstat));
+    if (setstat && hnd->cache_path && (rc != LIBSSH2_ERROR_EAGAIN))
+        sftp_attr_cache_drop(hnd->sftp, hnd->cache_path,
+                             hnd->cache_path_len);
     return rc;
 }
 
@@ -2298,6 +4092,9 @@ libssh2_sftp_seek64(LIBSSH2_SFTP_HANDLE *handle, libssh2_uint64_t offset)
 
     /* reset EOF to False */
     handle->u.file.eof = FALSE;
+
+    /* a round being timed can't end where it was meant to anymore */
+    handle->u.file.ra_round_start = 0;
 }
 
 /* libssh2_sftp_seek
@@ -2309,66 +4106,180 @@ libssh2_sftp_seek(LIBSSH2_SFTP_HANDLE *handle, size_t offset)
     libssh2_sftp_seek64(handle, (libssh2_uint64_t)offset);
 }
 
-/* libssh2_sftp_tell
- * Return the current read/write pointer's offset
+/* libssh2_sftp_read_ahead
+ * Set the read-ahead used by file handles opened from now on
  */
-LIBSSH2_API size_t
-libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle)
+LIBSSH2_API int
+libssh2_sftp_read_ahead(LIBSSH2_SFTP *sftp, size_t bytes,
+                        unsigned int requests, unsigned long flags)
 {
-    if(!handle)
-        return 0; /* no handle, no size */
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
 
-    /* NOTE: this may very well truncate the size if it is larger than what
-       size_t can hold, so libssh2_sftp_tell64() is really the function you
-       should use */
-    return (size_t)(handle->u.file.offset);
+    if(bytes > LIBSSH2_SFTP_READ_AHEAD_MAX)
+        bytes = LIBSSH2_SFTP_READ_AHEAD_MAX;
+
+    sftp->read_ahead = bytes;
+    sftp->read_ahead_requests = requests;
+    sftp->read_ahead_flags = flags;
+    return 0;
 }
 
-/* libssh2_sftp_tell64
- * Return the current read/write pointer's offset
+/* libssh2_sftp_handle_read_ahead
+ * Set the read-ahead of a single file handle
  */
-LIBSSH2_API libssh2_uint64_t
-libssh2_sftp_tell64(LIBSSH2_SFTP_HANDLE *handle)
+LIBSSH2_API int
+libssh2_sftp_handle_read_ahead(LIBSSH2_SFTP_HANDLE *handle, size_t bytes,
+                               unsigned int requests, unsigned long flags)
 {
-    if(!handle)
-        return 0; /* no handle, no size */
+    struct _libssh2_sftp_handle_file_data *filep;
 
-    return handle->u.file.offset;
+    if(!handle || handle->handle_type != LIBSSH2_SFTP_HANDLE_FILE)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(bytes > LIBSSH2_SFTP_READ_AHEAD_MAX)
+        bytes = LIBSSH2_SFTP_READ_AHEAD_MAX;
+
+    filep = &handle->u.file;
+    filep->read_ahead = bytes;
+    filep->read_ahead_requests = requests;
+    filep->read_ahead_flags = flags;
+
+    /* start the adaptive read-ahead over */
+    filep->ra_window = 0;
+    filep->ra_round_start = 0;
+    filep->ra_best_rate = 0;
+    filep->ra_stalls = 0;
+    return 0;
 }
 
-/*
- * Flush all remaining incoming SFTP packets and zombies.
+/* libssh2_sftp_write_behind
+ * Set the write-behind used by file handles opened from now on
  */
-static void sftp_packet_flush(LIBSSH2_SFTP *sftp)
+LIBSSH2_API int
+libssh2_sftp_write_behind(LIBSSH2_SFTP *sftp, size_t bytes,
+                          unsigned int requests)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
-    struct sftp_zombie_requests *zombie =
-        _libssh2_list_first(&sftp->zombie_requests);
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(bytes > LIBSSH2_SFTP_WRITE_BEHIND_MAX)
+        bytes = LIBSSH2_SFTP_WRITE_BEHIND_MAX;
+
+    sftp->write_behind = bytes;
+    sftp->write_behind_requests = requests;
+    return 0;
+}
+
+/* libssh2_sftp_handle_write_behind
+ * Set the write-behind of a single file handle
+ */
+LIBSSH2_API int
+libssh2_sftp_handle_write_behind(LIBSSH2_SFTP_HANDLE *handle, size_t bytes,
+                                 unsigned int requests)
+{
+    if(!handle || handle->handle_type != LIBSSH2_SFTP_HANDLE_FILE)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(bytes > LIBSSH2_SFTP_WRITE_BEHIND_MAX)
+        bytes = LIBSSH2_SFTP_WRITE_BEHIND_MAX;
+
+    handle->u.file.write_behind = bytes;
+    handle->u.file.write_behind_requests = requests;
+    return 0;
+}
+
+/* libssh2_sftp_handle_stats
+ * Copy the counters of a handle, along with how many of its requests are
+ * still waiting for an answer
+ */
+LIBSSH2_API int
+libssh2_sftp_handle_stats(LIBSSH2_SFTP_HANDLE *handle,
+                          LIBSSH2_SFTP_HANDLE_STATS *stats)
+{
+    struct sftp_pipeline_chunk *chunk;
+    struct sftp_vec_chunk *vchunk;
+
+    if(!handle || !stats)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    *stats = handle->stats;
+    stats->requests_outstanding = 0;
+    for(chunk = _libssh2_list_first(&handle->packet_list); chunk;
+        chunk = _libssh2_list_next(&chunk->node))
+        stats->requests_outstanding++;
+    if(handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE)
+        for(vchunk = _libssh2_list_first(&handle->u.file.vec_chunks); vchunk;
+            vchunk = _libssh2_list_next(&vchunk->node))
+            stats->requests_outstanding++;
+
+    return 0;
+}
+
+/* libssh2_sftp_tell
+ * Return the current read/write pointer's offset
+ */
+LIBSSH2_API size_t
+libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle)
+{
+    if(!handle)
+        return 0; /* no handle, no size */
+
+    /* NOTE: this may very well truncate the size if it is larger than what
+       size_t can hold, so libssh2_sftp_tell64() is really the function you
+       should use */
+    return (size_t)(handle->u.file.offset);
+}
+
+/* libssh2_sftp_tell64
+ * Return the current read/write pointer's offset
+ */
+LIBSSH2_API libssh2_uint64_t
+libssh2_sftp_tell64(LIBSSH2_SFTP_HANDLE *handle)
+{
+    if(!handle)
+        return 0; /* no handle, no size */
+
+    return handle->u.file.offset;
+}
+
+/*
+ * Flush all remaining incoming SFTP packets and zombies.
+ */
+static void sftp_packet_flush(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
+    struct sftp_zombie_requests *zombie =
+        _libssh2_list_first(&sftp->zombie_requests);
 
     while(packet) {
         LIBSSH2_SFTP_PACKET *next;
 
         /* check next struct in the list */
-        next =  _libssh2_list_next(&packet->node);
-        _libssh2_list_remove(&packet->node);
-        LIBSSH2_FREE(session, packet->data);
-        LIBSSH2_FREE(session, packet);
+        next =  _libssh2_list_next(&packet->entry.node);
+        _libssh2_list_remove(&packet->entry.node);
+        sftp_packet_free(session, packet);
 
         packet = next;
     }
 
     while(zombie) {
         /* figure out the next node */
-        struct sftp_zombie_requests *next = _libssh2_list_next(&zombie->node);
+        struct sftp_zombie_requests *next =
+            _libssh2_list_next(&zombie->entry.node);
         /* unlink the current one */
-        _libssh2_list_remove(&zombie->node);
+        _libssh2_list_remove(&zombie->entry.node);
         /* free the memory */
         LIBSSH2_FREE(session, zombie);
         zombie = next;
     }
 
+    sftp_id_hash_free(session, &sftp->packet_hash);
+    sftp_id_hash_free(session, &sftp->zombie_hash);
+    sftp_id_hash_free(session, &sftp->direct_hash);
+    sftp_id_hash_free(session, &sftp->async_hash);
 }
 
 /* sftp_close_handle
@@ -2393,6 +4304,21 @@ sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
 
     if (handle->close_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Closing handle");
+        if (handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE)
+            /* a vector given up on must not be read into any more, its
+               buffers may be gone */
+            sftp_vec_reset(handle);
+        if (sftp->async_flags & LIBSSH2_SFTP_ASYNC_CLOSE)
+            handle->close_op = sftp_op_new(sftp, SSH_FXP_CLOSE, packet_len,
+                                           &s);
+        if (handle->close_op) {
+            _libssh2_store_str(&s, handle->handle, handle->handle_len);
+            sftp_async_add(handle->close_op, LIBSSH2_SFTP_ASYNC_CLOSE);
+            handle->close_state = libssh2_NB_state_jump1;
+        }
+    }
+
+    if (handle->close_state == libssh2_NB_state_idle) {
         s = handle->close_packet = LIBSSH2_ALLOC(session, packet_len);
         if (!handle->close_packet) {
             handle->close_state = libssh2_NB_state_idle;
@@ -2403,7 +4329,8 @@ sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
 
             _libssh2_store_u32(&s, packet_len - 4);
             *(s++) = SSH_FXP_CLOSE;
-            handle->close_request_id = sftp->request_id++;
+            handle->close_request_id = sftp_request_id(sftp, SSH_FXP_CLOSE,
+                                                       packet_len);
             _libssh2_store_u32(&s, handle->close_request_id);
             _libssh2_store_str(&s, handle->handle, handle->handle_len);
             handle->close_state = libssh2_NB_state_created;
@@ -2441,7 +4368,23 @@ sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
         handle->close_state = libssh2_NB_state_sent1;
     }
 
-    if(!data) {
+    if (handle->close_state == libssh2_NB_state_jump1) {
+        /* the handle goes as soon as the request is out, the answer is seen
+           to later */
+        LIBSSH2_SFTP_OP *op = handle->close_op;
+
+        sftp_op_send(sftp);
+        if (op->state == libssh2_NB_state_created)
+            return LIBSSH2_ERROR_EAGAIN;
+
+        if (op->state == libssh2_NB_state_end) {
+            rc = _libssh2_error(session, op->error,
+                                "Unable to send FXP_CLOSE command");
+            sftp_op_destroy(op);
+        }
+        handle->close_op = NULL;
+
+    } else if(!data) {
         /* if it reaches this point with data unset, something unwanted
            happened for which we should have set an error code */
         assert(rc);
@@ -2461,13 +4404,23 @@ sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
     /* remove this handle from the parent's list */
     _libssh2_list_remove(&handle->node);
 
-    if ((handle->handle_type == LIBSSH2_SFTP_HANDLE_DIR)
-        && handle->u.dir.names_left) {
-        LIBSSH2_FREE(session, handle->u.dir.names_packet);
+    if (handle->cache_path) {
+        if (handle->cache_write)
+            sftp_attr_cache_drop(sftp, handle->cache_path,
+                                 handle->cache_path_len);
+        LIBSSH2_FREE(session, handle->cache_path);
+    }
+
+    if (handle->handle_type == LIBSSH2_SFTP_HANDLE_DIR) {
+        if (handle->u.dir.names_packet)
+            LIBSSH2_FREE(session, handle->u.dir.names_packet);
+        if (handle->u.dir.readdir_op)
+            sftp_op_abandon(handle->u.dir.readdir_op);
     }
     else {
         if(handle->u.file.data)
             LIBSSH2_FREE(session, handle->u.file.data);
+        sftp_vec_reset(handle);
     }
 
     sftp_packetlist_flush(handle);
@@ -2495,6 +4448,76 @@ libssh2_sftp_close_handle(LIBSSH2_SFTP_HANDLE *hnd)
     return rc;
 }
 
+/* libssh2_sftp_async_mode
+ * Have CLOSEs and fsyncs go off without waiting for their answers
+ */
+LIBSSH2_API int
+libssh2_sftp_async_mode(LIBSSH2_SFTP *sftp, unsigned long flags,
+                        LIBSSH2_SFTP_ASYNC_FUNC((*callback)), void *abstract)
+{
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    sftp->async_flags = flags &
+        (LIBSSH2_SFTP_ASYNC_CLOSE | LIBSSH2_SFTP_ASYNC_FSYNC);
+    sftp->async_callback = callback;
+    sftp->async_abstract = abstract;
+    return 0;
+}
+
+/*
+ * sftp_async_wait
+ *
+ * Wait until all asynchronous requests are answered, and return the first
+ * failure kept since the last time
+ */
+static int
+sftp_async_wait(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    int rc;
+
+    /* their requests may be stuck behind one not sent to the end */
+    if (sftp_op_send(sftp) == LIBSSH2_ERROR_EAGAIN)
+        return LIBSSH2_ERROR_EAGAIN;
+
+    while (_libssh2_list_first(&sftp->async_ops)) {
+        if (session->socket_state != LIBSSH2_SOCKET_CONNECTED)
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_DISCONNECT,
+                                  "Socket died waiting for SFTP status "
+                                  "messages");
+        rc = sftp_packet_read(sftp);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        else if (rc < 0)
+            return _libssh2_error(session, rc,
+                                  "Error waiting for SFTP status messages");
+    }
+
+    rc = sftp->async_rc;
+    if (rc) {
+        sftp->last_errno = sftp->async_errno;
+        sftp->async_rc = 0;
+        sftp->async_errno = 0;
+        return _libssh2_error(session, rc,
+                              "Asynchronous SFTP request failed");
+    }
+    return 0;
+}
+
+/* libssh2_sftp_async_wait
+ * Wait for the answers to the asynchronous CLOSEs and fsyncs
+ */
+LIBSSH2_API int
+libssh2_sftp_async_wait(LIBSSH2_SFTP *sftp)
+{
+    int rc;
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, sftp->channel->session, sftp_async_wait(sftp));
+    return rc;
+}
+
 /* sftp_unlink
  * Delete a file from the remote server
  */
@@ -2521,7 +4544,8 @@ static int sftp_unlink(LIBSSH2_SFTP *sftp, const char *filename,
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_REMOVE;
-        sftp->unlink_request_id = sftp->request_id++;
+        sftp->unlink_request_id = sftp_request_id(sftp, SSH_FXP_REMOVE,
+                                                  packet_len);
         _libssh2_store_u32(&s, sftp->unlink_request_id);
         _libssh2_store_str(&s, filename, filename_len);
         sftp->unlink_state = libssh2_NB_state_created;
@@ -2583,6 +4607,8 @@ libssh2_sftp_unlink_ex(LIBSSH2_SFTP *sftp, const char *filename,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, sftp->channel->session,
                  sftp_unlink(sftp, filename, filename_len));
+    if (rc != LIBSSH2_ERROR_EAGAIN)
+        sftp_attr_cache_drop(sftp, filename, filename_len);
     return rc;
 }
 
@@ -2600,11 +4626,18 @@ static int sftp_rename(LIBSSH2_SFTP *sftp, const char *source_filename,
     LIBSSH2_SESSION *session = channel->session;
     size_t data_len;
     int retcode;
+    /* before SFTP5 a RENAME never overwrites, posix-rename@openssh.com does
+       what was asked for */
+    int posix = (sftp->version < 5) &&
+        (flags & LIBSSH2_SFTP_RENAME_OVERWRITE) &&
+        (sftp->extension_flags & LIBSSH2_SFTP_EXT_POSIX_RENAME);
     uint32_t packet_len =
         source_filename_len + dest_filename_len + 17 + (sftp->version >=
-                                                        5 ? 4 : 0);
+                                                        5 ? 4 : 0) +
+        (posix ? 28 : 0);
     /* packet_len(4) + packet_type(1) + request_id(4) +
-       source_filename_len(4) + dest_filename_len(4) + flags(4){SFTP5+) */
+       source_filename_len(4) + dest_filename_len(4) + flags(4){SFTP5+) +
+       string "posix-rename@openssh.com"(28){posix} */
     unsigned char *data;
     ssize_t rc;
 
@@ -2625,9 +4658,14 @@ static int sftp_rename(LIBSSH2_SFTP *sftp, const char *source_filename,
         }
 
         _libssh2_store_u32(&sftp->rename_s, packet_len - 4);
-        *(sftp->rename_s++) = SSH_FXP_RENAME;
-        sftp->rename_request_id = sftp->request_id++;
+        *(sftp->rename_s++) = posix ? SSH_FXP_EXTENDED : SSH_FXP_RENAME;
+        sftp->rename_request_id =
+            sftp_request_id(sftp, posix ? SSH_FXP_EXTENDED : SSH_FXP_RENAME,
+                            packet_len);
         _libssh2_store_u32(&sftp->rename_s, sftp->rename_request_id);
+        if (posix)
+            _libssh2_store_str(&sftp->rename_s, "posix-rename@openssh.com",
+                               24);
         _libssh2_store_str(&sftp->rename_s, source_filename,
                            source_filename_len);
         _libssh2_store_str(&sftp->rename_s, dest_filename, dest_filename_len);
@@ -2716,6 +4754,10 @@ libssh2_sftp_rename_ex(LIBSSH2_SFTP *sftp, const char *source_filename,
     BLOCK_ADJUST(rc, sftp->channel->session,
                  sftp_rename(sftp, source_filename, source_filename_len,
                              dest_filename, dest_filename_len, flags));
+    if (rc != LIBSSH2_ERROR_EAGAIN) {
+        sftp_attr_cache_drop(sftp, source_filename, source_filename_len);
+        sftp_attr_cache_drop(sftp, dest_filename, dest_filename_len);
+    }
     return rc;
 }
 
@@ -2752,7 +4794,8 @@ static int sftp_fstatvfs(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_STATVFS *st)
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_EXTENDED;
-        sftp->fstatvfs_request_id = sftp->request_id++;
+        sftp->fstatvfs_request_id = sftp_request_id(sftp, SSH_FXP_EXTENDED,
+                                                    packet_len);
         _libssh2_store_u32(&s, sftp->fstatvfs_request_id);
         _libssh2_store_str(&s, "fstatvfs@openssh.com", 20);
         _libssh2_store_str(&s, handle->handle, handle->handle_len);
@@ -2879,7 +4922,8 @@ static int sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_EXTENDED;
-        sftp->statvfs_request_id = sftp->request_id++;
+        sftp->statvfs_request_id = sftp_request_id(sftp, SSH_FXP_EXTENDED,
+                                                   packet_len);
         _libssh2_store_u32(&s, sftp->statvfs_request_id);
         _libssh2_store_str(&s, "statvfs@openssh.com", 19);
         _libssh2_store_str(&s, path, path_len);
@@ -2975,6 +5019,237 @@ libssh2_sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
 }
 
 
+/* libssh2_sftp_extension
+ * Tell if the server announced an extension
+ */
+LIBSSH2_API int
+libssh2_sftp_extension(LIBSSH2_SFTP *sftp, const char *name,
+                       const char **data, size_t *data_len)
+{
+    if(!sftp || !name)
+        return LIBSSH2_ERROR_BAD_USE;
+    return sftp_extension(sftp, name, (const unsigned char **)data,
+                          data_len);
+}
+
+/* sftp_copy_data
+ * Have the server copy data from one handle to another
+ */
+static int sftp_copy_data(LIBSSH2_SFTP_HANDLE *src,
+                          libssh2_uint64_t src_offset,
+                          libssh2_uint64_t length,
+                          LIBSSH2_SFTP_HANDLE *dst,
+                          libssh2_uint64_t dst_offset)
+{
+    LIBSSH2_SFTP *sftp = src->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *s, *data;
+    size_t data_len;
+    static const unsigned char copy_responses[2] =
+        { SSH_FXP_STATUS, SSH_FXP_STATUS };
+    uint32_t retcode;
+    int rc;
+
+    if (!sftp->copy_data_op) {
+        if (!(sftp->extension_flags & LIBSSH2_SFTP_EXT_COPY_DATA))
+            return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                                  "Server doesn't support copy-data");
+
+        /* 54 = packet_len(4) + packet_type(1) + request_id(4) +
+           string "copy-data"(13) + handle_len(4) + offset(8) + length(8) +
+           handle_len(4) + offset(8) */
+        sftp->copy_data_op =
+            sftp_op_new(sftp, SSH_FXP_EXTENDED,
+                        src->handle_len + dst->handle_len + 54, &s);
+        if (!sftp->copy_data_op)
+            return LIBSSH2_ERROR_ALLOC;
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Copying data");
+        _libssh2_store_str(&s, "copy-data", 9);
+        _libssh2_store_str(&s, src->handle, src->handle_len);
+        _libssh2_store_u64(&s, src_offset);
+        _libssh2_store_u64(&s, length);
+        _libssh2_store_str(&s, dst->handle, dst->handle_len);
+        _libssh2_store_u64(&s, dst_offset);
+    }
+
+    rc = sftp_op_wait(sftp->copy_data_op, copy_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    sftp->copy_data_op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(sftp->copy_data_op);
+    sftp->copy_data_op = NULL;
+    if (rc)
+        return rc;
+
+    retcode = _libssh2_ntohu32(data + 5);
+    LIBSSH2_FREE(session, data);
+
+    if (retcode != LIBSSH2_FX_OK) {
+        sftp->last_errno = retcode;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
+    }
+    return 0;
+}
+
+/* libssh2_sftp_copy_data
+ * Copy data between two remote files without it passing through the client
+ */
+LIBSSH2_API int
+libssh2_sftp_copy_data(LIBSSH2_SFTP_HANDLE *src, libssh2_uint64_t src_offset,
+                       libssh2_uint64_t length, LIBSSH2_SFTP_HANDLE *dst,
+                       libssh2_uint64_t dst_offset)
+{
+    int rc;
+    if(!src || !dst || (src->sftp != dst->sftp))
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, src->sftp->channel->session,
+                 sftp_copy_data(src, src_offset, length, dst, dst_offset));
+    return rc;
+}
+
+/* sftp_check_file
+ * Have the server hash a file, given by handle or by name
+ */
+static ssize_t sftp_check_file(LIBSSH2_SFTP *sftp,
+                               LIBSSH2_SFTP_HANDLE *handle,
+                               const char *path, size_t path_len,
+                               const char *algorithms,
+                               libssh2_uint64_t offset,
+                               libssh2_uint64_t length, size_t block_size,
+                               char *algorithm, size_t algorithm_maxlen,
+                               unsigned char *hash, size_t hash_maxlen)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *s, *data;
+    size_t data_len, name_len, algo_len;
+    static const unsigned char check_responses[2] =
+        { SSH_FXP_EXTENDED_REPLY, SSH_FXP_STATUS };
+    const char *request = handle ? "check-file-handle" : "check-file-name";
+    int rc;
+
+    if (!sftp->check_file_op) {
+        size_t algorithms_len = strlen(algorithms);
+
+        if (!(sftp->extension_flags & LIBSSH2_SFTP_EXT_CHECK_FILE) &&
+            !sftp_extension(sftp, request, NULL, NULL))
+            return _libssh2_error(session, LIBSSH2_ERROR_METHOD_NOT_SUPPORTED,
+                                  "Server doesn't support check-file");
+        if (handle) {
+            path = handle->handle;
+            path_len = handle->handle_len;
+        }
+
+        /* 41 = packet_len(4) + packet_type(1) + request_id(4) +
+           request_len(4) + path_len(4) + algorithms_len(4) + offset(8) +
+           length(8) + block_size(4) */
+        sftp->check_file_op =
+            sftp_op_new(sftp, SSH_FXP_EXTENDED,
+                        strlen(request) + path_len + algorithms_len + 41, &s);
+        if (!sftp->check_file_op)
+            return LIBSSH2_ERROR_ALLOC;
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Checking file with %s",
+                       algorithms);
+        _libssh2_store_str(&s, request, strlen(request));
+        _libssh2_store_str(&s, path, path_len);
+        _libssh2_store_str(&s, algorithms, algorithms_len);
+        _libssh2_store_u64(&s, offset);
+        _libssh2_store_u64(&s, length);
+        _libssh2_store_u32(&s, (uint32_t)block_size);
+    }
+
+    rc = sftp_op_wait(sftp->check_file_op, check_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    sftp->check_file_op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(sftp->check_file_op);
+    sftp->check_file_op = NULL;
+    if (rc)
+        return rc;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        sftp->last_errno = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
+    }
+
+    /* the reply is string "check-file", string hash-algo-used and the
+       hashes up to the end of the packet */
+    s = data + 5;
+    if ((data_len < 13) ||
+        ((name_len = _libssh2_ntohu32(s)) > data_len - 13) ||
+        ((algo_len = _libssh2_ntohu32(s + 4 + name_len)) >
+         data_len - 13 - name_len)) {
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Invalid check-file reply");
+    }
+    s += 8 + name_len;
+    data_len -= (s - data) + algo_len;
+
+    if ((algorithm && (algo_len >= algorithm_maxlen)) ||
+        (data_len > hash_maxlen)) {
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_BUFFER_TOO_SMALL,
+                              "check-file reply doesn't fit");
+    }
+
+    if (algorithm) {
+        memcpy(algorithm, s, algo_len);
+        algorithm[algo_len] = '\0';
+    }
+    memcpy(hash, s + algo_len, data_len);
+    LIBSSH2_FREE(session, data);
+
+    return (ssize_t)data_len;
+}
+
+/* libssh2_sftp_check_file
+ * Get hashes of an open file from the server
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_check_file(LIBSSH2_SFTP_HANDLE *handle, const char *algorithms,
+                        libssh2_uint64_t offset, libssh2_uint64_t length,
+                        size_t block_size, char *algorithm,
+                        size_t algorithm_maxlen, unsigned char *hash,
+                        size_t hash_maxlen)
+{
+    ssize_t rc;
+    if(!handle || !algorithms || !hash)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, handle->sftp->channel->session,
+                 sftp_check_file(handle->sftp, handle, NULL, 0, algorithms,
+                                 offset, length, block_size, algorithm,
+                                 algorithm_maxlen, hash, hash_maxlen));
+    return rc;
+}
+
+/* libssh2_sftp_check_file_name
+ * Get hashes of a file, given by name, from the server
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_check_file_name(LIBSSH2_SFTP *sftp, const char *path,
+                             unsigned int path_len, const char *algorithms,
+                             libssh2_uint64_t offset, libssh2_uint64_t length,
+                             size_t block_size, char *algorithm,
+                             size_t algorithm_maxlen, unsigned char *hash,
+                             size_t hash_maxlen)
+{
+    ssize_t rc;
+    if(!sftp || !path || !algorithms || !hash)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_check_file(sftp, NULL, path, path_len, algorithms,
+                                 offset, length, block_size, algorithm,
+                                 algorithm_maxlen, hash, hash_maxlen));
+    return rc;
+}
+
 /*
  * sftp_mkdir
  *
@@ -3010,7 +5285,8 @@ static int sftp_mkdir(LIBSSH2_SFTP *sftp, const char *path,
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_MKDIR;
-        sftp->mkdir_request_id = sftp->request_id++;
+        sftp->mkdir_request_id = sftp_request_id(sftp, SSH_FXP_MKDIR,
+                                                 packet_len);
         _libssh2_store_u32(&s, sftp->mkdir_request_id);
         _libssh2_store_str(&s, path, path_len);
 
@@ -3078,6 +5354,8 @@ libssh2_sftp_mkdir_ex(LIBSSH2_SFTP *sftp, const char *path,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, sftp->channel->session,
                  sftp_mkdir(sftp, path, path_len, mode));
+    if (rc != LIBSSH2_ERROR_EAGAIN)
+        sftp_attr_cache_drop(sftp, path, path_len);
     return rc;
 }
 
@@ -3108,7 +5386,8 @@ static int sftp_rmdir(LIBSSH2_SFTP *sftp, const char *path,
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_RMDIR;
-        sftp->rmdir_request_id = sftp->request_id++;
+        sftp->rmdir_request_id = sftp_request_id(sftp, SSH_FXP_RMDIR,
+                                                 packet_len);
         _libssh2_store_u32(&s, sftp->rmdir_request_id);
         _libssh2_store_str(&s, path, path_len);
 
@@ -3169,6 +5448,8 @@ libssh2_sftp_rmdir_ex(LIBSSH2_SFTP *sftp, const char *path,
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, sftp->channel->session,
                  sftp_rmdir(sftp, path, path_len));
+    if (rc != LIBSSH2_ERROR_EAGAIN)
+        sftp_attr_cache_drop(sftp, path, path_len);
     return rc;
 }
 
@@ -3179,122 +5460,1528 @@ static int sftp_stat(LIBSSH2_SFTP *sftp, const char *path,
                      unsigned int path_len, int stat_type,
                      LIBSSH2_SFTP_ATTRIBUTES * attrs)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
-    ssize_t packet_len =
-        path_len + 13 +
-        ((stat_type ==
-          LIBSSH2_SFTP_SETSTAT) ? sftp_attrsize(attrs->flags) : 0);
-    unsigned char *s, *data;
-    static const unsigned char stat_responses[2] =
-        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
     int rc;
 
-    if (sftp->stat_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%s %s",
-                       (stat_type == LIBSSH2_SFTP_SETSTAT) ? "Set-statting" :
-                       (stat_type ==
-                        LIBSSH2_SFTP_LSTAT ? "LStatting" : "Statting"), path);
-        s = sftp->stat_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->stat_packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_*STAT "
-                                  "packet");
+    if (!sftp->stat_op) {
+        if (stat_type != LIBSSH2_SFTP_SETSTAT) {
+            struct sftp_attr_entry *entry =
+                sftp_attr_cache_find(sftp, path, path_len, stat_type);
+            if (entry) {
+                *attrs = entry->attrs;
+                return 0;
+            }
         }
 
-        _libssh2_store_u32(&s, packet_len - 4);
+        sftp->stat_op = sftp_op_stat(sftp, path, path_len, stat_type, attrs);
+        if (!sftp->stat_op)
+            return LIBSSH2_ERROR_ALLOC;
+    }
 
-        switch (stat_type) {
-        case LIBSSH2_SFTP_SETSTAT:
-            *(s++) = SSH_FXP_SETSTAT;
-            break;
+    rc = sftp_op_stat_result(sftp->stat_op, attrs);
+    if (rc != LIBSSH2_ERROR_EAGAIN)
+        sftp->stat_op = NULL;
+    if (!rc && (stat_type != LIBSSH2_SFTP_SETSTAT))
+        sftp_attr_cache_put(sftp, NULL, 0, path, path_len, stat_type, attrs,
+                            NULL, 0);
+    return rc;
+}
 
-        case LIBSSH2_SFTP_LSTAT:
-            *(s++) = SSH_FXP_LSTAT;
-            break;
+/* libssh2_sftp_stat_ex
+ * Stat a file or symbolic link
+ */
+LIBSSH2_API int
+libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, int stat_type,
+                     LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    int rc;
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_stat(sftp, path, path_len, stat_type, attrs));
+    return rc;
+}
 
-        case LIBSSH2_SFTP_STAT:
-        default:
-            *(s++) = SSH_FXP_STAT;
-        }
-        sftp->stat_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->stat_request_id);
-        _libssh2_store_str(&s, path, path_len);
+/* libssh2_sftp_attr_cache
+ * Keep the attributes of paths for a while, or stop doing so
+ */
+LIBSSH2_API int
+libssh2_sftp_attr_cache(LIBSSH2_SFTP *sftp, unsigned long ttl_ms,
+                        unsigned int max_entries)
+{
+    struct sftp_attr_cache *cache;
+    uint32_t size = 16;
 
-        if (stat_type == LIBSSH2_SFTP_SETSTAT)
-            s += sftp_attr2bin(s, attrs);
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    cache = &sftp->attr_cache;
+    sftp_attr_cache_flush(sftp);
+    cache->ttl_ms = ttl_ms;
+    if (!ttl_ms)
+        return 0;
 
-        sftp->stat_state = libssh2_NB_state_created;
+    if (!max_entries)
+        max_entries = SFTP_ATTR_CACHE_ENTRIES;
+    while ((size < max_entries) && (size < 0x10000))
+        size *= 2;
+
+    cache->table = LIBSSH2_CALLOC(sftp->channel->session,
+                                  size * sizeof(struct sftp_attr_entry *));
+    if (!cache->table) {
+        cache->ttl_ms = 0;
+        return _libssh2_error(sftp->channel->session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate attribute cache");
     }
+    cache->size = size;
+    cache->max_entries = max_entries;
+    return 0;
+}
 
-    if (sftp->stat_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->stat_packet, packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
+/* libssh2_sftp_op_stat
+ * Start a STAT, LSTAT or SETSTAT operation
+ */
+LIBSSH2_API LIBSSH2_SFTP_OP *
+libssh2_sftp_op_stat(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, int stat_type,
+                     const LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP_OP *op;
+
+    if(!sftp)
+        return NULL;
+    if((stat_type == LIBSSH2_SFTP_SETSTAT) && !attrs) {
+        _libssh2_error(sftp->channel->session, LIBSSH2_ERROR_BAD_USE,
+                       "SETSTAT needs attributes to set");
+        return NULL;
+    }
+
+    op = sftp_op_stat(sftp, path, path_len, stat_type, attrs);
+    if(op)
+        /* get it going, the result call sends whatever is left */
+        sftp_op_send(sftp);
+    return op;
+}
+
+/* libssh2_sftp_op_stat_result
+ * Collect the outcome of a libssh2_sftp_op_stat() operation
+ */
+LIBSSH2_API int
+libssh2_sftp_op_stat_result(LIBSSH2_SFTP_OP *op,
+                            LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+
+    if(!op || ((op->type != SSH_FXP_STAT) && (op->type != SSH_FXP_LSTAT) &&
+               (op->type != SSH_FXP_SETSTAT)))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    /* the operation is gone once it is done */
+    session = op->sftp->channel->session;
+    BLOCK_ADJUST(rc, session, sftp_op_stat_result(op, attrs));
+    return rc;
+}
+
+/* libssh2_sftp_op_open
+ * Start an OPEN or OPENDIR operation
+ */
+LIBSSH2_API LIBSSH2_SFTP_OP *
+libssh2_sftp_op_open(LIBSSH2_SFTP *sftp, const char *filename,
+                     unsigned int filename_len, unsigned long flags,
+                     long mode, int open_type)
+{
+    LIBSSH2_SFTP_OP *op;
+
+    if(!sftp)
+        return NULL;
+
+    op = sftp_op_open(sftp, filename, filename_len, flags, mode, open_type);
+    if(op)
+        sftp_op_send(sftp);
+    return op;
+}
+
+/* libssh2_sftp_op_open_result
+ * Collect the handle of a libssh2_sftp_op_open() operation
+ */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+libssh2_sftp_op_open_result(LIBSSH2_SFTP_OP *op)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_SFTP_HANDLE *hnd;
+
+    if(!op || ((op->type != SSH_FXP_OPEN) && (op->type != SSH_FXP_OPENDIR)))
+        return NULL;
+
+    session = op->sftp->channel->session;
+    BLOCK_ADJUST_ERRNO(hnd, session, sftp_op_open_result(op));
+    return hnd;
+}
+
+/* libssh2_sftp_op_free
+ * Give up on an operation, its result is thrown away when it arrives
+ */
+LIBSSH2_API void
+libssh2_sftp_op_free(LIBSSH2_SFTP_OP *op)
+{
+    if(!op)
+        return;
+
+    sftp_op_abandon(op);
+}
+
+/* ******************************* *
+ * SFTP Transfer Engine            *
+ * ******************************* */
+
+/*
+ * sftp_xfer_chunk_free
+ *
+ * Forget a read or write, giving up on it if it is still out
+ */
+static void
+sftp_xfer_chunk_free(struct sftp_xfer_file *file,
+                     struct sftp_xfer_chunk *chunk)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+
+    if (chunk->op)
+        sftp_op_abandon(chunk->op);
+    xfer->bytes_in_flight -= chunk->len;
+    _libssh2_list_remove(&chunk->node);
+    _libssh2_slab_free(xfer->sftp->channel->session, chunk,
+                       sizeof(struct sftp_xfer_chunk));
+}
+
+/*
+ * sftp_xfer_drop_chunks
+ *
+ * Forget all reads or writes of a file
+ */
+static void
+sftp_xfer_drop_chunks(struct sftp_xfer_file *file)
+{
+    struct sftp_xfer_chunk *chunk;
+
+    while ((chunk = _libssh2_list_first(&file->chunks)))
+        sftp_xfer_chunk_free(file, chunk);
+}
+
+/*
+ * sftp_xfer_fail
+ *
+ * Remember the first thing that went wrong with a file. Nothing more is read
+ * or written once something did.
+ */
+static void
+sftp_xfer_fail(struct sftp_xfer_file *file, int rc)
+{
+    if (!file->rc) {
+        file->rc = rc;
+        if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL)
+            file->sftp_errno = file->xfer->sftp->last_errno;
+    }
+    file->eof = 1;
+}
+
+/*
+ * sftp_xfer_finish
+ *
+ * Move a file to the ones to report
+ */
+static void
+sftp_xfer_finish(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+
+    if (file->fp) {
+        if (fclose(file->fp) && !file->rc)
+            file->rc = LIBSSH2_ERROR_FILE;
+        file->fp = NULL;
+    }
+
+    _libssh2_list_remove(&file->node);
+    _libssh2_list_add(&xfer->done, &file->node);
+    xfer->active_files--;
+
+    if (file->direction == LIBSSH2_SFTP_UPLOAD)
+        sftp_attr_cache_drop(xfer->sftp, file->remote, file->remote_len);
+
+    _libssh2_debug(xfer->sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                   "Transfer of %s done: %d", file->remote, file->rc);
+}
+
+/*
+ * sftp_xfer_free_file
+ *
+ * Free a file of a transfer and whatever it still has going
+ */
+static void
+sftp_xfer_free_file(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SESSION *session = file->xfer->sftp->channel->session;
+
+    sftp_xfer_drop_chunks(file);
+    if (file->op)
+        sftp_op_abandon(file->op);
+    if (file->stat_op)
+        sftp_op_abandon(file->stat_op);
+    if (file->fp)
+        fclose(file->fp);
+
+    _libssh2_list_remove(&file->node);
+    LIBSSH2_FREE(session, file);
+}
+
+/*
+ * sftp_xfer_seek
+ *
+ * Move a local file to where a range starts
+ */
+static int
+sftp_xfer_seek(FILE *fp, libssh2_uint64_t offset)
+{
+#ifdef WIN32
+    return _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+/*
+ * sftp_xfer_local_open
+ *
+ * Open the local file of a transfer. The ranges of a striped download share
+ * it, so it is created if need be but never truncated for one.
+ */
+static FILE *
+sftp_xfer_local_open(struct sftp_xfer_file *file)
+{
+    FILE *fp;
+
+    if (file->direction == LIBSSH2_SFTP_UPLOAD)
+        fp = fopen(file->local, "rb");
+    else if (!file->ranged)
+        return fopen(file->local, "wb");
+    else {
+        fp = fopen(file->local, "ab");
+        if (!fp)
+            return NULL;
+        fclose(fp);
+        fp = fopen(file->local, "r+b");
+    }
+
+    if (fp && file->start && sftp_xfer_seek(fp, file->start)) {
+        fclose(fp);
+        fp = NULL;
+    }
+    return fp;
+}
+
+/*
+ * sftp_xfer_start
+ *
+ * Open the local file and make the OPEN for the remote one. A download also
+ * asks for the size of the file, so that it knows when to stop reading.
+ */
+static void
+sftp_xfer_start(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+    LIBSSH2_SFTP *sftp = xfer->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    int download = (file->direction == LIBSSH2_SFTP_DOWNLOAD);
+
+    _libssh2_list_remove(&file->node);
+    _libssh2_list_add(&xfer->active, &file->node);
+    xfer->active_files++;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Starting %s of %s",
+                   download ? "download" : "upload", file->remote);
+
+    file->fp = sftp_xfer_local_open(file);
+    if (!file->fp) {
+        file->rc = _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                                  "Unable to open local file");
+        sftp_xfer_finish(file);
+        return;
+    }
+
+    file->op = sftp_op_open(sftp, file->remote, file->remote_len,
+                            download ? LIBSSH2_FXF_READ :
+                            (LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                             (file->ranged ? 0 : LIBSSH2_FXF_TRUNC)),
+                            file->mode,
+                            LIBSSH2_SFTP_OPENFILE);
+    if (!file->op) {
+        file->rc = LIBSSH2_ERROR_ALLOC;
+        sftp_xfer_finish(file);
+        return;
+    }
+
+    if (download)
+        /* without it the file is simply read until EOF */
+        file->stat_op = sftp_op_stat(sftp, file->remote,
+                                     (unsigned int)file->remote_len,
+                                     LIBSSH2_SFTP_STAT, NULL);
+}
+
+/*
+ * sftp_xfer_opened
+ *
+ * Collect the handle of a file, and its size for a download. Returns
+ * LIBSSH2_ERROR_EAGAIN until both are here.
+ */
+static int
+sftp_xfer_opened(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc;
+
+    if (file->op) {
+        rc = sftp_op_open_handle(file->op, file->handle, &file->handle_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
-        } else if (packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->stat_packet);
-            sftp->stat_packet = NULL;
-            sftp->stat_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send STAT/LSTAT/SETSTAT command");
+        file->op = NULL;
+        if (rc) {
+            sftp_xfer_fail(file, rc);
+            return rc;
+        }
+        xfer->progress++;
+    }
+
+    if (file->stat_op) {
+        rc = sftp_op_stat_result(file->stat_op, &attrs);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+        file->stat_op = NULL;
+        xfer->progress++;
+
+        /* a range ends early if the file does */
+        if (!rc && (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) &&
+            (!file->sized || (attrs.filesize < file->size))) {
+            file->size = attrs.filesize;
+            file->sized = 1;
+        }
+    }
+
+    file->state = sftp_xfer_data;
+    return 0;
+}
+
+/*
+ * sftp_xfer_zero
+ *
+ * Whether a block is all zero. Comparing it with itself one byte on runs at
+ * the speed of the C library's vectorised memcmp().
+ */
+static int
+sftp_xfer_zero(const unsigned char *buf, size_t len)
+{
+    return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+/*
+ * sftp_xfer_hole
+ *
+ * Move a sparse upload past the hole its local file is at, where the system
+ * tells where holes are. Returns the bytes skipped.
+ */
+static libssh2_uint64_t
+sftp_xfer_hole(struct sftp_xfer_file *file)
+{
+#if defined(SEEK_DATA) && defined(HAVE_UNISTD_H) && !defined(WIN32)
+    int fd = fileno(file->fp);
+    off_t pos = ftello(file->fp);
+    off_t cur, data;
+
+    if (pos < 0)
+        return 0;
+
+    /* the stream's buffer is ahead of it, the descriptor is put back the
+       way it was before the stream moves */
+    cur = lseek(fd, 0, SEEK_CUR);
+    if (cur < 0)
+        return 0;
+    data = lseek(fd, pos, SEEK_DATA);
+    if ((data < 0) && (errno == ENXIO))
+        /* nothing but a hole up to the end */
+        data = lseek(fd, 0, SEEK_END);
+    if (lseek(fd, cur, SEEK_SET) < 0)
+        return 0;
+
+    if (data <= pos)
+        return 0;
+    if (file->sized && ((libssh2_uint64_t)(data - pos) >
+                        file->size - file->offset_sent))
+        data = pos + (off_t)(file->size - file->offset_sent);
+
+    if (sftp_xfer_seek(file->fp, (libssh2_uint64_t)data))
+        return 0;
+    return (libssh2_uint64_t)(data - pos);
+#else
+    (void)file;
+    return 0;
+#endif
+}
+
+/*
+ * sftp_xfer_sparse
+ *
+ * Trim what a sparse upload read to the first run of blocks with data in it.
+ * The zero blocks before it are skipped and the local file is moved back to
+ * the zero blocks after it, for the next write. Returns the bytes left to
+ * write, which start at 'buf'.
+ */
+static size_t
+sftp_xfer_sparse(struct sftp_xfer_file *file, unsigned char *buf, size_t len)
+{
+    size_t zero = 0;
+    size_t end;
+
+    while ((zero < len) &&
+           sftp_xfer_zero(buf + zero, (len - zero < SFTP_XFER_SPARSE_BLOCK) ?
+                          len - zero : SFTP_XFER_SPARSE_BLOCK))
+        zero += SFTP_XFER_SPARSE_BLOCK;
+    if (zero >= len) {
+        file->offset += len;
+        file->offset_sent += len;
+        file->sparse_tail = 1;
+        return 0;
+    }
+
+    end = zero + SFTP_XFER_SPARSE_BLOCK;
+    while ((end < len) &&
+           !sftp_xfer_zero(buf + end, (len - end < SFTP_XFER_SPARSE_BLOCK) ?
+                           len - end : SFTP_XFER_SPARSE_BLOCK))
+        end += SFTP_XFER_SPARSE_BLOCK;
+    if (end > len)
+        end = len;
+
+    if ((end < len) && !sftp_xfer_seek(file->fp, file->offset_sent + end))
+        /* the rest is read again */
+        file->eof = 0;
+    else
+        end = len;
+
+    if (zero)
+        memmove(buf, buf + zero, end - zero);
+    file->offset += zero;
+    file->offset_sent += zero;
+    file->sparse_tail = 0;
+    return end - zero;
+}
+
+/*
+ * sftp_xfer_issue
+ *
+ * Make the next READ or WRITE of a file. Returns 1 if one was made. Uploads
+ * read the local file straight into the request.
+ */
+static int
+sftp_xfer_issue(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+    LIBSSH2_SFTP *sftp = xfer->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_xfer_chunk *chunk;
+    LIBSSH2_SFTP_OP *op;
+    unsigned char *s;
+    size_t len;
+
+    if (file->eof)
+        return 0;
+
+    chunk = _libssh2_slab_alloc(session, sizeof(struct sftp_xfer_chunk));
+    if (!chunk) {
+        sftp_xfer_fail(file, _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                            "Unable to allocate transfer "
+                                            "chunk"));
+        return 0;
+    }
+
+    if (file->direction == LIBSSH2_SFTP_DOWNLOAD) {
+        len = sftp->max_read_len;
+        if (file->sized) {
+            if (file->offset_sent >= file->size) {
+                LIBSSH2_FREE(session, chunk);
+                file->eof = 1;
+                return 0;
+            }
+            if (file->size - file->offset_sent < len)
+                len = (size_t)(file->size - file->offset_sent);
+        }
+
+        /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+           handle_len (4) + offset(8) + count(4) */
+        op = sftp_op_new(sftp, SSH_FXP_READ, file->handle_len + 25, &s);
+        if (op) {
+            _libssh2_store_str(&s, file->handle, file->handle_len);
+            _libssh2_store_u64(&s, file->offset_sent);
+            _libssh2_store_u32(&s, (uint32_t)len);
+        }
+    }
+    else {
+        size_t want = sftp->max_write_len;
+        libssh2_uint64_t hole = 0;
+
+        if (file->sparse) {
+            hole = sftp_xfer_hole(file);
+            file->offset += hole;
+            file->offset_sent += hole;
+            if (hole)
+                file->sparse_tail = 1;
+        }
+
+        if (file->sized) {
+            if (file->offset_sent >= file->size) {
+                LIBSSH2_FREE(session, chunk);
+                file->eof = 1;
+                return hole ? 1 : 0;
+            }
+            if (file->size - file->offset_sent < want)
+                want = (size_t)(file->size - file->offset_sent);
+        }
+
+        /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+           handle_len (4) + offset(8) + count(4) */
+        op = sftp_op_new(sftp, SSH_FXP_WRITE,
+                         file->handle_len + 25 + sftp->max_write_len, &s);
+        if (op) {
+            unsigned char *offset, *size;
+
+            _libssh2_store_str(&s, file->handle, file->handle_len);
+            offset = s;
+            size = s + 8;
+            s += 12;
+            len = fread(s, 1, want, file->fp);
+
+            if (len < want) {
+                if (ferror(file->fp)) {
+                    sftp_op_destroy(op);
+                    LIBSSH2_FREE(session, chunk);
+                    sftp_xfer_fail(file, _libssh2_error(session,
+                                                        LIBSSH2_ERROR_FILE,
+                                                        "Unable to read "
+                                                        "local file"));
+                    return 0;
+                }
+                file->eof = 1;
+            }
+
+            if (len && file->sparse) {
+                size_t read_len = len;
+
+                len = sftp_xfer_sparse(file, s, len);
+                hole += read_len - len;
+            }
+            if (!len) {
+                /* nothing read, or all of it zero */
+                sftp_op_destroy(op);
+                LIBSSH2_FREE(session, chunk);
+                return hole ? 1 : 0;
+            }
+
+            if (len < sftp->max_write_len) {
+                /* the request is sent as long as what was read */
+                op->packet_len = file->handle_len + 25 + len;
+                s = op->packet;
+                _libssh2_store_u32(&s, (uint32_t)(op->packet_len - 4));
+            }
+            _libssh2_store_u64(&offset, file->offset_sent);
+            _libssh2_store_u32(&size, (uint32_t)len);
+        }
+    }
+
+    if (!op) {
+        LIBSSH2_FREE(session, chunk);
+        sftp_xfer_fail(file, LIBSSH2_ERROR_ALLOC);
+        return 0;
+    }
+
+    chunk->op = op;
+    chunk->len = len;
+    _libssh2_list_add(&file->chunks, &chunk->node);
+    xfer->bytes_in_flight += len;
+    file->offset_sent += len;
+
+    return 1;
+}
+
+/*
+ * sftp_xfer_chunk_result
+ *
+ * Handle the response to the oldest READ or WRITE of a file
+ */
+static int
+sftp_xfer_chunk_result(struct sftp_xfer_file *file,
+                       struct sftp_xfer_chunk *chunk)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+    LIBSSH2_SFTP *sftp = xfer->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    static const unsigned char read_responses[2] =
+        { SSH_FXP_DATA, SSH_FXP_STATUS };
+    static const unsigned char write_responses[2] =
+        { SSH_FXP_STATUS, SSH_FXP_STATUS };
+    int download = (file->direction == LIBSSH2_SFTP_DOWNLOAD);
+    unsigned char *data;
+    size_t data_len;
+    uint32_t len;
+    int rc;
+
+    rc = sftp_op_wait(chunk->op, download ? read_responses : write_responses,
+                      &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    chunk->op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(chunk->op);
+    chunk->op = NULL;
+    xfer->progress++;
+    if (rc)
+        return rc;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        uint32_t retcode = _libssh2_ntohu32(data + 5);
+        _libssh2_slab_free(session, data, data_len);
+
+        if ((retcode == LIBSSH2_FX_OK) && !download)
+            file->offset += chunk->len;
+        else if ((retcode == LIBSSH2_FX_EOF) && download)
+            file->eof = 1;
+        else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
+        sftp_xfer_chunk_free(file, chunk);
+        return 0;
+    }
+
+    len = _libssh2_ntohu32(data + 5);
+    if ((len > chunk->len) || (len > data_len - 9)) {
+        _libssh2_slab_free(session, data, data_len);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Read Packet too large");
+    }
+
+    if (fwrite(data + 9, 1, len, file->fp) != len) {
+        _libssh2_slab_free(session, data, data_len);
+        return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                              "Unable to write local file");
+    }
+    _libssh2_slab_free(session, data, data_len);
+    file->offset += len;
+
+    if (!len)
+        file->eof = 1;
+    else if (len < chunk->len) {
+        /* the later reads start at the wrong offset, ask again from here */
+        sftp_xfer_chunk_free(file, chunk);
+        sftp_xfer_drop_chunks(file);
+        file->offset_sent = file->offset;
+        return 0;
+    }
+
+    sftp_xfer_chunk_free(file, chunk);
+    return 0;
+}
+
+/*
+ * sftp_xfer_step
+ *
+ * Handle whatever responses a file has waiting, and CLOSE it once all its
+ * data is through
+ */
+static void
+sftp_xfer_step(struct sftp_xfer_file *file)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer = file->xfer;
+    LIBSSH2_SFTP *sftp = xfer->sftp;
+    static const unsigned char close_responses[2] =
+        { SSH_FXP_STATUS, SSH_FXP_STATUS };
+    struct sftp_xfer_chunk *chunk;
+    unsigned char *data, *s;
+    size_t data_len;
+    int rc;
+
+    if (file->state == sftp_xfer_open) {
+        rc = sftp_xfer_opened(file);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return;
+        if (rc) {
+            sftp_xfer_finish(file);
+            return;
+        }
+    }
+
+    /* the responses to one file come in the order its requests went out */
+    while ((chunk = _libssh2_list_first(&file->chunks))) {
+        rc = sftp_xfer_chunk_result(file, chunk);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            break;
+        if (rc) {
+            sftp_xfer_fail(file, rc);
+            sftp_xfer_drop_chunks(file);
+        }
+    }
+
+    if (file->state == sftp_xfer_data) {
+        /* an upload can close right behind its last write, a download only
+           knows it has all once the reads are back */
+        if (!file->eof || (chunk && (file->direction ==
+                                     LIBSSH2_SFTP_DOWNLOAD)))
+            return;
+
+        /* zeros skipped up to the end of the local file leave the remote one
+           short, its size is set ahead of the CLOSE. A range that stops
+           before the end leaves the size to the later ones */
+        if (file->sparse_tail && !file->rc &&
+            (!file->sized || (getc(file->fp) == EOF))) {
+            LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+            memset(&attrs, 0, sizeof(attrs));
+            attrs.flags = LIBSSH2_SFTP_ATTR_SIZE;
+            attrs.filesize = file->offset_sent;
+
+            /* 13 = packet_len(4) + packet_type(1) + request_id(4) +
+               handle_len(4) */
+            file->stat_op = sftp_op_new(sftp, SSH_FXP_FSETSTAT,
+                                        file->handle_len + 13 +
+                                        sftp_attrsize(attrs.flags), &s);
+            if (!file->stat_op) {
+                sftp_xfer_fail(file, LIBSSH2_ERROR_ALLOC);
+                sftp_xfer_finish(file);
+                return;
+            }
+            _libssh2_store_str(&s, file->handle, file->handle_len);
+            sftp_attr2bin(s, &attrs);
+        }
+
+        /* 13 = packet_len(4) + packet_type(1) + request_id(4) +
+           handle_len(4) */
+        file->op = sftp_op_new(sftp, SSH_FXP_CLOSE, file->handle_len + 13,
+                               &s);
+        if (!file->op) {
+            sftp_xfer_fail(file, LIBSSH2_ERROR_ALLOC);
+            sftp_xfer_finish(file);
+            return;
+        }
+        _libssh2_store_str(&s, file->handle, file->handle_len);
+        file->state = sftp_xfer_close;
+    }
+
+    if (_libssh2_list_first(&file->chunks))
+        return;
+
+    if (file->stat_op) {
+        rc = sftp_op_wait(file->stat_op, close_responses, &data, &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return;
+
+        file->stat_op->state = libssh2_NB_state_idle;
+        sftp_op_destroy(file->stat_op);
+        file->stat_op = NULL;
+        xfer->progress++;
+
+        if (!rc) {
+            uint32_t retcode = _libssh2_ntohu32(data + 5);
+            LIBSSH2_FREE(sftp->channel->session, data);
+            if (retcode != LIBSSH2_FX_OK) {
+                sftp->last_errno = retcode;
+                rc = _libssh2_error(sftp->channel->session,
+                                    LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                    "SFTP Protocol Error");
+            }
+        }
+        if (rc)
+            sftp_xfer_fail(file, rc);
+    }
+
+    rc = sftp_op_wait(file->op, close_responses, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return;
+
+    file->op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(file->op);
+    file->op = NULL;
+    xfer->progress++;
+
+    if (!rc) {
+        uint32_t retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(sftp->channel->session, data);
+        if (retcode != LIBSSH2_FX_OK) {
+            sftp->last_errno = retcode;
+            rc = _libssh2_error(sftp->channel->session,
+                                LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                "SFTP Protocol Error");
+        }
+    }
+    if (rc)
+        sftp_xfer_fail(file, rc);
+
+    sftp_xfer_finish(file);
+}
+
+/*
+ * sftp_xfer_fill
+ *
+ * Make reads and writes for the files with data left, one per file at a
+ * time so that they share the bytes in flight fairly. A file with nothing in
+ * flight always gets one.
+ */
+static void
+sftp_xfer_fill(LIBSSH2_SFTP_TRANSFER *xfer)
+{
+    struct sftp_xfer_file *file;
+    int made;
+
+    do {
+        made = 0;
+        for (file = _libssh2_list_first(&xfer->active); file;
+             file = _libssh2_list_next(&file->node)) {
+            if ((file->state != sftp_xfer_data) || file->eof)
+                continue;
+            if ((xfer->bytes_in_flight >= xfer->max_bytes) &&
+                _libssh2_list_first(&file->chunks))
+                continue;
+            made += sftp_xfer_issue(file);
+        }
+    } while (made && (xfer->bytes_in_flight < xfer->max_bytes));
+}
+
+/*
+ * sftp_transfer_run
+ *
+ * Move the transfer along until a file is done
+ */
+static int
+sftp_transfer_run(LIBSSH2_SFTP_TRANSFER *xfer,
+                  LIBSSH2_SFTP_TRANSFER_RESULT *result)
+{
+    LIBSSH2_SFTP *sftp = xfer->sftp;
+    struct sftp_xfer_file *file, *next;
+
+    if (xfer->reported) {
+        sftp_xfer_free_file(xfer->reported);
+        xfer->reported = NULL;
+    }
+
+    for (;;) {
+        file = _libssh2_list_first(&xfer->done);
+        if (file) {
+            _libssh2_list_remove(&file->node);
+            xfer->reported = file;
+
+            result->remote = file->remote;
+            result->local = file->local;
+            result->direction = file->sparse ? LIBSSH2_SFTP_UPLOAD_SPARSE :
+                file->direction;
+            result->abstract = file->abstract;
+            result->rc = file->rc;
+            result->sftp_errno = file->sftp_errno;
+            result->bytes = file->offset - file->start;
+            return 1;
+        }
+
+        while ((xfer->active_files < xfer->max_files) &&
+               (file = _libssh2_list_first(&xfer->pending)))
+            sftp_xfer_start(file);
+
+        if (!xfer->active_files) {
+            if (_libssh2_list_first(&xfer->done))
+                continue;
+            return 0;
+        }
+
+        sftp_xfer_fill(xfer);
+        sftp_op_send(sftp);
+
+        xfer->progress = 0;
+        for (file = _libssh2_list_first(&xfer->active); file; file = next) {
+            next = _libssh2_list_next(&file->node);
+            sftp_xfer_step(file);
+        }
+
+        if (!xfer->progress && !_libssh2_list_first(&xfer->done)) {
+            /* what the files made last goes out before waiting */
+            sftp_xfer_fill(xfer);
+            sftp_op_send(sftp);
+            return _libssh2_error(sftp->channel->session,
+                                  LIBSSH2_ERROR_EAGAIN,
+                                  "Would block waiting for transfer");
+        }
+    }
+}
+
+/* libssh2_sftp_transfer_init
+ * Start a transfer of many files at once
+ */
+LIBSSH2_API LIBSSH2_SFTP_TRANSFER *
+libssh2_sftp_transfer_init(LIBSSH2_SFTP *sftp, unsigned int max_files,
+                           size_t max_bytes)
+{
+    LIBSSH2_SFTP_TRANSFER *xfer;
+
+    if(!sftp)
+        return NULL;
+
+    xfer = LIBSSH2_CALLOC(sftp->channel->session,
+                          sizeof(LIBSSH2_SFTP_TRANSFER));
+    if(!xfer) {
+        _libssh2_error(sftp->channel->session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate SFTP transfer");
+        return NULL;
+    }
+
+    xfer->sftp = sftp;
+    xfer->max_files = max_files ? max_files : LIBSSH2_SFTP_TRANSFER_FILES;
+    xfer->max_bytes = max_bytes ? max_bytes : LIBSSH2_SFTP_TRANSFER_BYTES;
+    _libssh2_list_init(&xfer->pending);
+    _libssh2_list_init(&xfer->active);
+    _libssh2_list_init(&xfer->done);
+
+    return xfer;
+}
+
+/*
+ * sftp_transfer_add
+ *
+ * Queue a file, or with 'ranged' a part of it, for a transfer
+ */
+static int
+sftp_transfer_add(LIBSSH2_SFTP_TRANSFER *xfer, const char *remote,
+                  const char *local, int direction, long mode,
+                  int ranged, libssh2_uint64_t offset,
+                  libssh2_uint64_t length, void *abstract)
+{
+    LIBSSH2_SESSION *session;
+    struct sftp_xfer_file *file;
+    size_t remote_len, local_len;
+
+    if(!xfer || !remote || !local || ((direction != LIBSSH2_SFTP_DOWNLOAD) &&
+                                      (direction != LIBSSH2_SFTP_UPLOAD) &&
+                                      (direction != LIBSSH2_SFTP_UPLOAD_SPARSE)))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    session = xfer->sftp->channel->session;
+    remote_len = strlen(remote);
+    local_len = strlen(local);
+
+    /* the names are kept right after the struct */
+    file = LIBSSH2_CALLOC(session, sizeof(struct sftp_xfer_file) +
+                          remote_len + local_len + 2);
+    if(!file)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate transfer file");
+
+    file->xfer = xfer;
+    file->remote = (char *)(file + 1);
+    memcpy(file->remote, remote, remote_len + 1);
+    file->remote_len = remote_len;
+    file->local = file->remote + remote_len + 1;
+    memcpy(file->local, local, local_len + 1);
+    if (direction == LIBSSH2_SFTP_UPLOAD_SPARSE) {
+        direction = LIBSSH2_SFTP_UPLOAD;
+        file->sparse = 1;
+    }
+    file->direction = direction;
+    file->mode = mode;
+    file->abstract = abstract;
+    file->state = sftp_xfer_open;
+    _libssh2_list_init(&file->chunks);
+
+    if (ranged) {
+        file->ranged = 1;
+        file->start = offset;
+        file->offset = offset;
+        file->offset_sent = offset;
+        if (length) {
+            file->size = offset + length;
+            file->sized = 1;
+        }
+    }
+
+    _libssh2_list_add(&xfer->pending, &file->node);
+    return 0;
+}
+
+/* libssh2_sftp_transfer_add
+ * Add a file to download or upload to a transfer
+ */
+LIBSSH2_API int
+libssh2_sftp_transfer_add(LIBSSH2_SFTP_TRANSFER *xfer, const char *remote,
+                          const char *local, int direction, long mode,
+                          void *abstract)
+{
+    return sftp_transfer_add(xfer, remote, local, direction, mode, 0, 0, 0,
+                             abstract);
+}
+
+/* libssh2_sftp_transfer_add_range
+ * Add a part of a file to download or upload to a transfer
+ */
+LIBSSH2_API int
+libssh2_sftp_transfer_add_range(LIBSSH2_SFTP_TRANSFER *xfer,
+                                const char *remote, const char *local,
+                                int direction, long mode,
+                                libssh2_uint64_t offset,
+                                libssh2_uint64_t length, void *abstract)
+{
+    return sftp_transfer_add(xfer, remote, local, direction, mode, 1, offset,
+                             length, abstract);
+}
+
+/* libssh2_sftp_transfer_run
+ * Move a transfer along, returning each file as it is done
+ */
+LIBSSH2_API int
+libssh2_sftp_transfer_run(LIBSSH2_SFTP_TRANSFER *xfer,
+                          LIBSSH2_SFTP_TRANSFER_RESULT *result)
+{
+    int rc;
+    if(!xfer || !result)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, xfer->sftp->channel->session,
+                 sftp_transfer_run(xfer, result));
+    return rc;
+}
+
+/* libssh2_sftp_transfer_free
+ * Free a transfer, giving up on the files not done
+ */
+LIBSSH2_API void
+libssh2_sftp_transfer_free(LIBSSH2_SFTP_TRANSFER *xfer)
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SESSION *session;
+    struct list_head *lists[3];
+    struct sftp_xfer_file *file;
+    unsigned char *s;
+    int i;
+
+    if(!xfer)
+        return;
+
+    sftp = xfer->sftp;
+    session = sftp->channel->session;
+    lists[0] = &xfer->pending;
+    lists[1] = &xfer->active;
+    lists[2] = &xfer->done;
+
+    if (xfer->reported)
+        sftp_xfer_free_file(xfer->reported);
+
+    for (i = 0; i < 3; i++) {
+        while ((file = _libssh2_list_first(lists[i]))) {
+            if ((file->state == sftp_xfer_data) && file->fp) {
+                /* the server keeps an open handle around otherwise. Nobody
+                   waits for the response */
+                LIBSSH2_SFTP_OP *op =
+                    sftp_op_new(sftp, SSH_FXP_CLOSE, file->handle_len + 13,
+                                &s);
+                if (op) {
+                    _libssh2_store_str(&s, file->handle, file->handle_len);
+                    op->abandoned = 1;
+                }
+            }
+            else if ((file->state == sftp_xfer_close) && file->op &&
+                     (file->op->state == libssh2_NB_state_created)) {
+                /* let the CLOSE go out all the same */
+                file->op->abandoned = 1;
+                file->op = NULL;
+            }
+            sftp_xfer_free_file(file);
+        }
+    }
+
+    sftp_op_send(sftp);
+    LIBSSH2_FREE(session, xfer);
+}
+
+/*
+ * sftp_walk_add
+ *
+ * Queue directory 'dir' joined with 'name', or 'name' alone without a
+ * 'dir', to be listed after the ones found before it
+ */
+static int
+sftp_walk_add(LIBSSH2_SFTP_WALK *walk, const char *dir, size_t dir_len,
+              const char *name, size_t name_len)
+{
+    LIBSSH2_SESSION *session = walk->sftp->channel->session;
+    struct sftp_walk_dir *wdir;
+    size_t sep = (dir && dir_len && (dir[dir_len - 1] != '/')) ? 1 : 0;
+    size_t path_len = (dir ? dir_len : 0) + sep + name_len;
+    char *p;
+
+    wdir = LIBSSH2_CALLOC(session, sizeof(struct sftp_walk_dir) +
+                          path_len + 1);
+    if (!wdir)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate walk directory");
+
+    p = wdir->path = (char *)(wdir + 1);
+    if (dir) {
+        memcpy(p, dir, dir_len);
+        p += dir_len;
+        if (sep)
+            *p++ = '/';
+    }
+    memcpy(p, name, name_len);
+    p[name_len] = '\0';
+    wdir->path_len = path_len;
+    wdir->state = sftp_walk_open;
+
+    _libssh2_list_add(&walk->pending, &wdir->node);
+    return 0;
+}
+
+/*
+ * sftp_walk_free_dir
+ *
+ * Free a directory of a walk and whatever it still has going
+ */
+static void
+sftp_walk_free_dir(LIBSSH2_SFTP_WALK *walk, struct sftp_walk_dir *wdir)
+{
+    if (wdir->op)
+        sftp_op_abandon(wdir->op);
+    _libssh2_list_remove(&wdir->node);
+    LIBSSH2_FREE(walk->sftp->channel->session, wdir);
+}
+
+/*
+ * sftp_walk_request
+ *
+ * Ask for the next names of a directory, or CLOSE it with 'close'
+ */
+static void
+sftp_walk_request(LIBSSH2_SFTP_WALK *walk, struct sftp_walk_dir *wdir,
+                  int close)
+{
+    unsigned char *s;
+
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    wdir->op = sftp_op_new(walk->sftp, close ? SSH_FXP_CLOSE : SSH_FXP_READDIR,
+                           wdir->handle_len + 13, &s);
+    if (!wdir->op) {
+        /* the server keeps the handle, the walk goes on without it */
+        walk->listing--;
+        sftp_walk_free_dir(walk, wdir);
+        return;
+    }
+    _libssh2_store_str(&s, wdir->handle, wdir->handle_len);
+
+    if (close) {
+        walk->listing--;
+        wdir->state = sftp_walk_close;
+    }
+    else
+        wdir->state = sftp_walk_read;
+}
+
+/*
+ * sftp_walk_names
+ *
+ * Hand the names of an FXP_NAME to the callback, queueing the directories
+ * among them. Returns non-zero if the names could not be gone through.
+ */
+static int
+sftp_walk_names(LIBSSH2_SFTP_WALK *walk, struct sftp_walk_dir *wdir,
+                unsigned char *data, size_t data_len)
+{
+    LIBSSH2_SFTP *sftp = walk->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *s = data + 9;
+    unsigned char *end = data + data_len;
+    LIBSSH2_SFTP_DIRENT entry;
+    uint32_t count;
+    ssize_t len;
+    int rc;
+
+    if (data_len < 9)
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Too small FXP_NAME");
+
+    for (count = _libssh2_ntohu32(data + 5); count; count--) {
+        len = sftp_name_parse(session, s, end, &entry);
+        if (len < 0)
+            return (int)len;
+        s += len;
+
+        /* both strings end where a field already decoded started */
+        ((char *) entry.name)[entry.name_len] = '\0';
+        ((char *) entry.longentry)[entry.longentry_len] = '\0';
+
+        if (((entry.name_len == 1) && (entry.name[0] == '.')) ||
+            ((entry.name_len == 2) && !memcmp(entry.name, "..", 2)))
+            continue;
+
+        sftp_attr_cache_dirent(sftp, wdir->path, wdir->path_len, &entry);
+
+        rc = walk->callback(wdir->path, wdir->path_len, &entry, 0,
+                            walk->abstract);
+        if (rc < 0) {
+            walk->rc = rc;
+            return 0;
         }
-        LIBSSH2_FREE(session, sftp->stat_packet);
-        sftp->stat_packet = NULL;
 
-        sftp->stat_state = libssh2_NB_state_sent;
+        /* a symlink to a directory is not followed, so a walk never loops */
+        if ((rc != LIBSSH2_SFTP_WALK_SKIP) &&
+            (entry.attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+            LIBSSH2_SFTP_S_ISDIR(entry.attrs.permissions)) {
+            rc = sftp_walk_add(walk, wdir->path, wdir->path_len,
+                               entry.name, entry.name_len);
+            if (rc)
+                return rc;
+        }
+    }
+    return 0;
+}
+
+/*
+ * sftp_walk_fail
+ *
+ * Tell the callback a directory could not be listed to the end, and CLOSE
+ * it if it is open
+ */
+static void
+sftp_walk_fail(LIBSSH2_SFTP_WALK *walk, struct sftp_walk_dir *wdir, int rc)
+{
+    int ret = walk->callback(wdir->path, wdir->path_len, NULL, rc,
+                             walk->abstract);
+    if (ret < 0)
+        walk->rc = ret;
+
+    if (wdir->state == sftp_walk_read)
+        sftp_walk_request(walk, wdir, 1);
+    else {
+        walk->listing--;
+        sftp_walk_free_dir(walk, wdir);
+    }
+}
+
+/*
+ * sftp_walk_step
+ *
+ * Handle the response a directory of a walk waits for, if it is there
+ */
+static void
+sftp_walk_step(LIBSSH2_SFTP_WALK *walk, struct sftp_walk_dir *wdir)
+{
+    LIBSSH2_SFTP *sftp = walk->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    static const unsigned char read_responses[2] =
+        { SSH_FXP_NAME, SSH_FXP_STATUS };
+    static const unsigned char close_responses[2] =
+        { SSH_FXP_STATUS, SSH_FXP_STATUS };
+    unsigned char *data;
+    size_t data_len;
+    uint32_t retcode;
+    int rc;
+
+    if (wdir->state == sftp_walk_open) {
+        rc = sftp_op_open_handle(wdir->op, wdir->handle, &wdir->handle_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return;
+        wdir->op = NULL;
+        walk->progress++;
+        if (rc)
+            sftp_walk_fail(walk, wdir, rc);
+        else
+            sftp_walk_request(walk, wdir, 0);
+        return;
     }
 
-    rc = sftp_packet_requirev(sftp, 2, stat_responses,
-                              sftp->stat_request_id, &data, &data_len);
+    rc = sftp_op_wait(wdir->op, (wdir->state == sftp_walk_read) ?
+                      read_responses : close_responses, &data, &data_len);
     if (rc == LIBSSH2_ERROR_EAGAIN)
-        return rc;
-    else if (rc) {
-        sftp->stat_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Timeout waiting for status message");
+        return;
+
+    wdir->op->state = libssh2_NB_state_idle;
+    sftp_op_destroy(wdir->op);
+    wdir->op = NULL;
+    walk->progress++;
+
+    if (wdir->state == sftp_walk_close) {
+        if (!rc)
+            LIBSSH2_FREE(session, data);
+        sftp_walk_free_dir(walk, wdir);
+        return;
     }
 
-    sftp->stat_state = libssh2_NB_state_idle;
+    if (rc) {
+        sftp_walk_fail(walk, wdir, rc);
+        return;
+    }
 
     if (data[0] == SSH_FXP_STATUS) {
-        int retcode;
-
         retcode = _libssh2_ntohu32(data + 5);
         LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_OK) {
-            return 0;
-        } else {
+        if (retcode == LIBSSH2_FX_EOF)
+            sftp_walk_request(walk, wdir, 1);
+        else {
             sftp->last_errno = retcode;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
+            sftp_walk_fail(walk, wdir,
+                           _libssh2_error(session,
+                                          LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                          "SFTP Protocol Error"));
         }
+        return;
     }
 
-    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    sftp_bin2attr(attrs, data + 5);
+    rc = sftp_walk_names(walk, wdir, data, data_len);
     LIBSSH2_FREE(session, data);
+    if (rc)
+        sftp_walk_fail(walk, wdir, rc);
+    else if (!walk->rc)
+        sftp_walk_request(walk, wdir, 0);
+}
 
-    return 0;
+/*
+ * sftp_walk_run
+ *
+ * Keep up to 'max_dirs' directories being listed, the next ones opened as
+ * soon as others are done, until all are
+ */
+static int
+sftp_walk_run(LIBSSH2_SFTP_WALK *walk)
+{
+    LIBSSH2_SFTP *sftp = walk->sftp;
+    struct sftp_walk_dir *wdir, *next;
+
+    for (;;) {
+        if (walk->rc)
+            return walk->rc;
+
+        while ((walk->listing < walk->max_dirs) &&
+               (wdir = _libssh2_list_first(&walk->pending))) {
+            wdir->op = sftp_op_open(sftp, wdir->path, wdir->path_len, 0, 0,
+                                    LIBSSH2_SFTP_OPENDIR);
+            if (!wdir->op)
+                return LIBSSH2_ERROR_ALLOC;
+            _libssh2_list_remove(&wdir->node);
+            _libssh2_list_add(&walk->active, &wdir->node);
+            walk->listing++;
+        }
+
+        if (!_libssh2_list_first(&walk->active))
+            return 0;
+
+        sftp_op_send(sftp);
+
+        walk->progress = 0;
+        for (wdir = _libssh2_list_first(&walk->active); wdir; wdir = next) {
+            next = _libssh2_list_next(&wdir->node);
+            sftp_walk_step(walk, wdir);
+            if (walk->rc)
+                return walk->rc;
+        }
+
+        if (!walk->progress) {
+            /* the requests made last go out before waiting */
+            sftp_op_send(sftp);
+            return _libssh2_error(sftp->channel->session,
+                                  LIBSSH2_ERROR_EAGAIN,
+                                  "Would block waiting for directory walk");
+        }
+    }
 }
 
-/* libssh2_sftp_stat_ex
- * Stat a file or symbolic link
+/* libssh2_sftp_walk_init
+ * Start walking the tree below a directory
+ */
+LIBSSH2_API LIBSSH2_SFTP_WALK *
+libssh2_sftp_walk_init(LIBSSH2_SFTP *sftp, const char *path,
+                       unsigned int path_len, unsigned int max_dirs,
+                       LIBSSH2_SFTP_WALK_FUNC((*callback)), void *abstract)
+{
+    LIBSSH2_SFTP_WALK *walk;
+
+    if(!sftp || !path || !callback)
+        return NULL;
+
+    walk = LIBSSH2_CALLOC(sftp->channel->session, sizeof(LIBSSH2_SFTP_WALK));
+    if(!walk) {
+        _libssh2_error(sftp->channel->session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate SFTP walk");
+        return NULL;
+    }
+
+    walk->sftp = sftp;
+    walk->callback = callback;
+    walk->abstract = abstract;
+    walk->max_dirs = max_dirs ? max_dirs : LIBSSH2_SFTP_WALK_DIRS;
+    _libssh2_list_init(&walk->pending);
+    _libssh2_list_init(&walk->active);
+
+    if (sftp_walk_add(walk, NULL, 0, path, path_len)) {
+        LIBSSH2_FREE(sftp->channel->session, walk);
+        return NULL;
+    }
+    return walk;
+}
+
+/* libssh2_sftp_walk_run
+ * Walk the tree, calling back for every entry in it
  */
 LIBSSH2_API int
-libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp, const char *path,
-                     unsigned int path_len, int stat_type,
-                     LIBSSH2_SFTP_ATTRIBUTES *attrs)
+libssh2_sftp_walk_run(LIBSSH2_SFTP_WALK *walk)
 {
     int rc;
-    if(!sftp)
+    if(!walk)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_stat(sftp, path, path_len, stat_type, attrs));
+    BLOCK_ADJUST(rc, walk->sftp->channel->session, sftp_walk_run(walk));
     return rc;
 }
 
+/* libssh2_sftp_walk_free
+ * Free a walk, giving up on the directories not done
+ */
+LIBSSH2_API void
+libssh2_sftp_walk_free(LIBSSH2_SFTP_WALK *walk)
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SESSION *session;
+    struct sftp_walk_dir *wdir;
+    unsigned char *s;
+
+    if(!walk)
+        return;
+
+    sftp = walk->sftp;
+    session = sftp->channel->session;
+
+    while ((wdir = _libssh2_list_first(&walk->pending)))
+        sftp_walk_free_dir(walk, wdir);
+
+    while ((wdir = _libssh2_list_first(&walk->active))) {
+        if (wdir->state == sftp_walk_read) {
+            /* the server keeps an open handle around otherwise. Nobody waits
+               for the response */
+            LIBSSH2_SFTP_OP *op =
+                sftp_op_new(sftp, SSH_FXP_CLOSE, wdir->handle_len + 13, &s);
+            if (op) {
+                _libssh2_store_str(&s, wdir->handle, wdir->handle_len);
+                op->abandoned = 1;
+            }
+        }
+        else if ((wdir->state == sftp_walk_close) && wdir->op &&
+                 (wdir->op->state == libssh2_NB_state_created)) {
+            /* let the CLOSE go out all the same */
+            wdir->op->abandoned = 1;
+            wdir->op = NULL;
+        }
+        sftp_walk_free_dir(walk, wdir);
+    }
+
+    LIBSSH2_FREE(session, walk);
+}
+
 /* sftp_symlink
  * Read or set a symlink
  */
@@ -3348,7 +7035,8 @@ static int sftp_symlink(LIBSSH2_SFTP *sftp, const char *path,
         default:
             *(s++) = SSH_FXP_READLINK;
         }
-        sftp->symlink_request_id = sftp->request_id++;
+        sftp->symlink_request_id =
+            sftp_request_id(sftp, sftp->symlink_packet[4], packet_len);
         _libssh2_store_u32(&s, sftp->symlink_request_id);
         _libssh2_store_str(&s, path, path_len);
 
@@ -3432,12 +7120,31 @@ libssh2_sftp_symlink_ex(LIBSSH2_SFTP *sftp, const char *path,
                         unsigned int path_len, char *target,
                         unsigned int target_len, int link_type)
 {
+    struct sftp_attr_entry *entry;
     int rc;
     if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
+
+    if ((link_type == LIBSSH2_SFTP_REALPATH) &&
+        (sftp->symlink_state == libssh2_NB_state_idle) &&
+        (entry = sftp_attr_cache_find(sftp, path, path_len,
+                                      SFTP_ATTR_CACHE_REALPATH))) {
+        if (entry->target_len >= target_len)
+            return LIBSSH2_ERROR_BUFFER_TOO_SMALL;
+        memcpy(target, entry->target, entry->target_len + 1);
+        return (int)entry->target_len;
+    }
+
     BLOCK_ADJUST(rc, sftp->channel->session,
                  sftp_symlink(sftp, path, path_len, target, target_len,
                               link_type));
+
+    if ((link_type == LIBSSH2_SFTP_REALPATH) && (rc >= 0))
+        sftp_attr_cache_put(sftp, NULL, 0, path, path_len,
+                            SFTP_ATTR_CACHE_REALPATH, NULL, target, rc);
+    else if ((link_type == LIBSSH2_SFTP_SYMLINK) &&
+             (rc != LIBSSH2_ERROR_EAGAIN))
+        sftp_attr_cache_drop(sftp, path, path_len);
     return rc;
 }
 
@@ -40,8 +40,10 @@
  */
 
 /*
- * MAX_SFTP_OUTGOING_SIZE MUST not be larger than 32500 or so. This is the
- * amount of data sent in each FXP_WRITE packet
+ * MAX_SFTP_OUTGOING_SIZE is the amount of data sent in each FXP_WRITE packet
+ * unless the server's channel packet size or limits@openssh.com allow more.
+ * It keeps the whole SFTP packet below the 34000 bytes every server must
+ * support.
  */
 #define MAX_SFTP_OUTGOING_SIZE 30000
 
@@ -50,31 +52,137 @@
  */
 #define MAX_SFTP_READ_SIZE 30000
 
+/* The largest FXP_READ and FXP_WRITE sizes used with a server that allows
+ * bigger ones than the above with limits@openssh.com
+ */
+#define LIBSSH2_SFTP_MAX_RW_SIZE (256*1024)
+
+/* The channel packet size advertised for SFTP, large enough for the server
+ * to send a FXP_DATA of LIBSSH2_SFTP_MAX_RW_SIZE bytes in few packets
+ */
+#define LIBSSH2_SFTP_CHANNEL_PACKET MAX_CHANNEL_PACKET_LEN
+
+/* extensions from the server's FXP_VERSION that the library makes use of */
+#define LIBSSH2_SFTP_EXT_POSIX_RENAME   0x0001 /* posix-rename@openssh.com */
+#define LIBSSH2_SFTP_EXT_STATVFS        0x0002 /* statvfs@openssh.com */
+#define LIBSSH2_SFTP_EXT_FSTATVFS       0x0004 /* fstatvfs@openssh.com */
+#define LIBSSH2_SFTP_EXT_HARDLINK       0x0008 /* hardlink@openssh.com */
+#define LIBSSH2_SFTP_EXT_FSYNC          0x0010 /* fsync@openssh.com */
+#define LIBSSH2_SFTP_EXT_LIMITS         0x0020 /* limits@openssh.com */
+#define LIBSSH2_SFTP_EXT_COPY_DATA      0x0040 /* copy-data */
+#define LIBSSH2_SFTP_EXT_CHECK_FILE     0x0080 /* check-file */
+
 struct sftp_pipeline_chunk {
     struct list_node node;
     libssh2_uint64_t offset; /* READ: offset at which to start reading
-                                WRITE: not used */
+                                WRITE: offset the data is written at */
     size_t len; /* WRITE: size of the data to write
                    READ: how many bytes that was asked for */
     size_t sent;
     ssize_t lefttosend; /* if 0, the entire packet has been sent off */
     uint32_t request_id;
+    const unsigned char *data; /* WRITE: the application's data, sent right
+                                  after the request header in 'packet' */
+    int waited; /* READ: the response was not in when first looked for */
     unsigned char packet[1]; /* data */
 };
 
-struct sftp_zombie_requests {
+/* what a chunk of a handle is asked for from the slab, its request header
+   included: 25 = packet_len(4) + packet_type(1) + request_id(4) +
+   handle_len(4) + offset(8) + count(4) */
+#define SFTP_CHUNK_SIZE(handle) \
+    (sizeof(struct sftp_pipeline_chunk) + (handle)->handle_len + 25)
+
+/* Incoming packets and zombie requests are kept in a list, in the order
+   they were added, and are also hashed on their request id. Both start with
+   this entry.  */
+struct sftp_id_entry {
     struct list_node node;
     uint32_t request_id;
+    struct sftp_id_entry *hash_next; /* next entry in the same bucket */
+};
+
+/* request id lookup table. Without a table (memory ran out) the list is
+   searched instead */
+struct sftp_id_hash {
+    struct sftp_id_entry **table;
+    uint32_t size; /* number of buckets, always a power of two */
+    uint32_t count;
+};
+
+/* initial number of buckets of a request id table */
+#define LIBSSH2_SFTP_ID_HASH_INITIAL 64
+
+/* When a request went out, for the latency histograms. Slots are picked by
+   the request id, so with more requests outstanding than there are slots
+   the older ones go uncounted. */
+struct sftp_latency {
+    uint32_t request_id;
+    unsigned char type;
+    libssh2_uint64_t sent_us; /* 0 for a free slot */
+};
+
+#define LIBSSH2_SFTP_LATENCY_SLOTS 1024
+
+/* A path in the attribute cache, see libssh2_sftp_attr_cache(). The path
+   is kept right after the struct, followed by what a REALPATH resolved it
+   to */
+struct sftp_attr_entry {
+    struct list_node node; /* in the cache's lru, the least recently used
+                              first */
+    struct sftp_attr_entry *hash_next; /* next entry in the same bucket */
+    uint32_t hash;
+    int type; /* LIBSSH2_SFTP_STAT, LIBSSH2_SFTP_LSTAT or
+                 SFTP_ATTR_CACHE_REALPATH */
+    libssh2_uint64_t expires; /* milliseconds on the monotonic clock */
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    char *path;
+    size_t path_len;
+    char *target;
+    size_t target_len;
+};
+
+/* the cache is off while 'ttl_ms' is 0 */
+struct sftp_attr_cache {
+    struct sftp_attr_entry **table;
+    uint32_t size; /* number of buckets, always a power of two */
+    unsigned int count;
+    unsigned int max_entries;
+    unsigned long ttl_ms;
+    struct list_head lru;
+};
+
+/* next to LIBSSH2_SFTP_STAT and LIBSSH2_SFTP_LSTAT in the cache */
+#define SFTP_ATTR_CACHE_REALPATH 2
+
+/* paths kept when libssh2_sftp_attr_cache() is given no limit */
+#define SFTP_ATTR_CACHE_ENTRIES 4096
+
+struct sftp_zombie_requests {
+    struct sftp_id_entry entry;
 };
 
 #ifndef MIN
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #endif
 
+/* The largest read-ahead a handle can be configured with, and where the
+   adaptive read-ahead starts out */
+#define LIBSSH2_SFTP_READ_AHEAD_MAX (64*1024*1024)
+#define LIBSSH2_SFTP_READ_AHEAD_INITIAL (4*MAX_SFTP_READ_SIZE)
+
+/* The amount of written data sftp_write() has in flight unless configured
+   otherwise with libssh2_sftp_write_behind(), and the largest allowed */
+#define LIBSSH2_SFTP_WRITE_BEHIND_DEFAULT (4*LIBSSH2_CHANNEL_WINDOW_DEFAULT)
+#define LIBSSH2_SFTP_WRITE_BEHIND_MAX LIBSSH2_SFTP_READ_AHEAD_MAX
+
+/* the adaptive read-ahead stops growing after this many rounds in a row
+   that didn't get the rate up by at least a quarter */
+#define LIBSSH2_SFTP_READ_AHEAD_STALLS 3
+
 struct _LIBSSH2_SFTP_PACKET
 {
-    struct list_node node;   /* linked list header */
-    uint32_t request_id;
+    struct sftp_id_entry entry; /* list node and request id */
     unsigned char *data;
     size_t data_len;              /* payload size */
 };
@@ -83,6 +191,193 @@ typedef struct _LIBSSH2_SFTP_PACKET LIBSSH2_SFTP_PACKET;
 
 #define SFTP_HANDLE_MAXLEN 256 /* according to spec! */
 
+/* the granularity zeros are skipped at in a sparse upload */
+#define SFTP_XFER_SPARSE_BLOCK 4096
+
+/* how sftp_packet_read() receives the packet it is in the middle of */
+#define SFTP_PARTIAL_PACKET 0 /* into 'partial_packet' */
+#define SFTP_PARTIAL_HEADER 1 /* the header into 'partial_head' */
+#define SFTP_PARTIAL_DIRECT 2 /* the data into 'partial_direct' */
+
+/* A READ whose data is read off the channel straight into the buffer it
+   is meant for, instead of into a packet first. Found by the request id
+   when the header of an FXP_DATA comes in, see sftp_packet_read() */
+struct sftp_direct {
+    struct sftp_id_entry entry; /* in sftp->direct_reads */
+    unsigned char *buffer;
+    size_t len;
+    char listed; /* in the list, the FXP_DATA hasn't started coming in */
+    char done;   /* the data is in the buffer */
+};
+
+/* the part of an FXP_DATA that comes before the data: packet_type(1) +
+   request_id(4) + data_len(4) */
+#define SFTP_DATA_HEADER_LEN 9
+
+/* A CLOSE or fsync made with libssh2_sftp_async_mode() on. Nobody waits for
+   its FXP_STATUS, which is handed to the callback or kept for
+   libssh2_sftp_async_wait() when sftp_packet_add() finds it */
+struct sftp_async {
+    struct sftp_id_entry entry; /* in sftp->async_ops */
+    LIBSSH2_SFTP_OP *op;
+    int type; /* LIBSSH2_SFTP_ASYNC_*, 0 if not in the list */
+};
+
+/* One request with its own state, so that any number of them can be in
+   flight on the same SFTP channel. See libssh2_sftp_op_stat() */
+struct _LIBSSH2_SFTP_OP
+{
+    struct list_node node; /* in sftp->ops */
+
+    LIBSSH2_SFTP *sftp;
+
+    unsigned char type; /* SSH_FXP_* of the request */
+    uint32_t request_id;
+
+    /* created: request (partly) unsent, sent: waiting for the response,
+       sent1: an OPEN got FX_OK back and waits for its HANDLE, end: sending
+       failed with 'error' */
+    libssh2_nonblocking_states state;
+    int error;
+    char abandoned; /* freed by the application while partly sent */
+
+    /* READ: where the data goes. Once it is there, the FXP_DATA packet
+       the response is waited for with only holds the header */
+    struct sftp_direct direct;
+
+    struct sftp_async async;
+
+    size_t size; /* as asked for from the slab */
+    size_t packet_len;
+    size_t packet_sent;
+    unsigned char packet[1]; /* the request */
+};
+
+/* A READ or WRITE of a libssh2_sftp_readv() or libssh2_sftp_writev() */
+struct sftp_vec_chunk {
+    struct list_node node; /* in the handle's 'vec_chunks' */
+    LIBSSH2_SFTP_OP *op;
+    unsigned int index; /* of the range in the vector */
+    size_t offset;      /* within the range */
+    size_t len;
+};
+
+/* files a transfer has going at once, and bytes of reads and writes it has
+   in flight, unless told otherwise */
+#define LIBSSH2_SFTP_TRANSFER_FILES 16
+#define LIBSSH2_SFTP_TRANSFER_BYTES (2*1024*1024)
+
+/* A READ or WRITE of a file being transferred */
+struct sftp_xfer_chunk {
+    struct list_node node; /* in the file's 'chunks', in the order sent */
+    LIBSSH2_SFTP_OP *op;
+    size_t len;
+};
+
+/* A file in a transfer, see libssh2_sftp_transfer_add() */
+struct sftp_xfer_file {
+    struct list_node node; /* in the transfer's pending, active or done */
+    LIBSSH2_SFTP_TRANSFER *xfer;
+
+    char *remote;
+    size_t remote_len;
+    char *local;
+    int direction;
+    long mode;
+    void *abstract;
+
+    enum {
+        sftp_xfer_open,  /* waiting for the OPEN (and STAT) */
+        sftp_xfer_data,  /* reading or writing */
+        sftp_xfer_close  /* the CLOSE is sent */
+    } state;
+
+    FILE *fp;
+    LIBSSH2_SFTP_OP *op; /* the OPEN or CLOSE */
+    LIBSSH2_SFTP_OP *stat_op; /* download: the size of the remote file,
+                                 sparse upload: the FSETSTAT of its size */
+    char handle[SFTP_HANDLE_MAXLEN];
+    size_t handle_len;
+
+    libssh2_uint64_t size; /* where to stop, if 'sized' */
+    char sized;
+    libssh2_uint64_t start; /* where a range starts */
+    char ranged; /* a range, other parts of the file are left alone */
+    libssh2_uint64_t offset; /* bytes done */
+    libssh2_uint64_t offset_sent; /* bytes asked for or sent */
+    char eof; /* nothing more to ask for or send */
+    char sparse; /* an upload that skips the zeros */
+    char sparse_tail; /* the zeros skipped last still need the size set */
+
+    struct list_head chunks;
+
+    int rc; /* the first error */
+    unsigned long sftp_errno;
+};
+
+struct _LIBSSH2_SFTP_TRANSFER
+{
+    LIBSSH2_SFTP *sftp;
+
+    /* files not started yet, going and finished but not reported */
+    struct list_head pending;
+    struct list_head active;
+    struct list_head done;
+
+    unsigned int max_files;
+    unsigned int active_files;
+    size_t max_bytes;
+    size_t bytes_in_flight;
+
+    /* responses handled in the last round, if none the caller must wait */
+    unsigned int progress;
+
+    /* the file last reported, its names are in the result */
+    struct sftp_xfer_file *reported;
+};
+
+/* directories listed at once by a walk without a limit given */
+#define LIBSSH2_SFTP_WALK_DIRS 32
+
+/* A directory in a walk, see libssh2_sftp_walk_init(). The path is kept
+   right after the struct */
+struct sftp_walk_dir {
+    struct list_node node; /* in the walk's pending or active */
+
+    enum {
+        sftp_walk_open,  /* waiting for the OPENDIR */
+        sftp_walk_read,  /* waiting for a READDIR */
+        sftp_walk_close  /* the CLOSE is sent */
+    } state;
+
+    LIBSSH2_SFTP_OP *op; /* the request waited for */
+    char handle[SFTP_HANDLE_MAXLEN];
+    size_t handle_len;
+
+    char *path;
+    size_t path_len;
+};
+
+struct _LIBSSH2_SFTP_WALK
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_WALK_FUNC((*callback));
+    void *abstract;
+
+    /* directories found but not opened yet, breadth first, and the ones
+       being listed or closed */
+    struct list_head pending;
+    struct list_head active;
+
+    unsigned int max_dirs;
+    unsigned int listing; /* of the active ones, those not closing */
+
+    /* responses handled in the last round, if none the caller must wait */
+    unsigned int progress;
+
+    int rc; /* what the callback stopped the walk with */
+};
+
 struct _LIBSSH2_SFTP_HANDLE
 {
     struct list_node node;
@@ -116,12 +411,54 @@ struct _LIBSSH2_SFTP_HANDLE
             size_t data_left;
 
             char eof; /* we have read to the end */
+
+            /* read-ahead settings, see libssh2_sftp_handle_read_ahead().
+               A zero 'read_ahead' means it is derived from the size of the
+               buffer passed to sftp_read() */
+            size_t read_ahead;
+            unsigned int read_ahead_requests;
+            unsigned long read_ahead_flags;
+
+            /* write-behind settings, see libssh2_sftp_handle_write_behind().
+               A zero 'write_behind' means LIBSSH2_SFTP_WRITE_BEHIND_DEFAULT,
+               zero 'write_behind_requests' no limit on requests */
+            size_t write_behind;
+            unsigned int write_behind_requests;
+
+            /* the libssh2_sftp_readv() or libssh2_sftp_writev() in
+               progress. Requests are made for range 'vec_next' from
+               'vec_next_off' on, as long as the read-ahead or write-behind
+               limits allow */
+            LIBSSH2_SFTP_IOVEC *vec;
+            unsigned int vec_count;
+            int vec_write;
+            unsigned int vec_next;
+            size_t vec_next_off;
+            size_t vec_in_flight;
+            unsigned int vec_requests;
+            struct list_head vec_chunks;
+
+            /* state of the adaptive read-ahead. 'ra_window' is the current
+               number of bytes to keep asked for. A round is timed from the
+               moment requests are sent until the data up to 'ra_round_end'
+               has been returned, and the rate measured over it decides if
+               the window keeps growing */
+            size_t ra_window;
+            libssh2_uint64_t ra_round_start; /* microseconds, 0 if none */
+            libssh2_uint64_t ra_round_begin;
+            libssh2_uint64_t ra_round_end;
+            libssh2_uint64_t ra_best_rate; /* bytes per second */
+            int ra_stalls; /* rounds in a row without a faster rate */
         } file;
         struct _libssh2_sftp_handle_dir_data
         {
             uint32_t names_left;
             void *names_packet;
             char *next_name;
+            char *names_end; /* end of the FXP_NAME packet */
+
+            /* the FXP_READDIR asking for the batch after this one */
+            LIBSSH2_SFTP_OP *readdir_op;
         } dir;
     } u;
 
@@ -129,10 +466,21 @@ struct _LIBSSH2_SFTP_HANDLE
     libssh2_nonblocking_states close_state;
     uint32_t close_request_id;
     unsigned char *close_packet;
+    LIBSSH2_SFTP_OP *close_op; /* an asynchronous CLOSE still being sent */
 
     /* list of outstanding packets sent to server */
     struct list_head packet_list;
 
+    /* counters for libssh2_sftp_handle_stats() */
+    LIBSSH2_SFTP_HANDLE_STATS stats;
+
+    /* the path the handle was opened with, while the attribute cache is on.
+       'cache_write' if the file was opened to be changed, its attributes
+       are dropped from the cache again once it is closed */
+    char *cache_path;
+    size_t cache_path_len;
+    char cache_write;
+
 };
 
 struct _LIBSSH2_SFTP
@@ -142,31 +490,81 @@ struct _LIBSSH2_SFTP
     uint32_t request_id, version;
 
     struct list_head packets;
+    struct sftp_id_hash packet_hash;
 
     /* List of FXP_READ responses to ignore because EOF already received. */
     struct list_head zombie_requests;
+    struct sftp_id_hash zombie_hash;
+
+    /* READs with the buffer their data goes straight to */
+    struct list_head direct_reads;
+    struct sftp_id_hash direct_hash;
+
+    /* see libssh2_sftp_async_mode(). CLOSEs and fsyncs of 'async_flags'
+       are in 'async_ops' until answered. Without a callback the first
+       failure is kept in 'async_rc' and 'async_errno' */
+    unsigned long async_flags;
+    LIBSSH2_SFTP_ASYNC_FUNC((*async_callback));
+    void *async_abstract;
+    struct list_head async_ops;
+    struct sftp_id_hash async_hash;
+    int async_rc;
+    uint32_t async_errno;
 
     /* a list of _LIBSSH2_SFTP_HANDLE structs */
     struct list_head sftp_handles;
 
+    /* LIBSSH2_SFTP_LATENCY_SLOTS of them, made once the session keeps
+       histograms */
+    struct sftp_latency *latency;
+
     uint32_t last_errno;
 
+    /* the extension-pairs of the server's FXP_VERSION, and which of them
+       are known as LIBSSH2_SFTP_EXT_* bits */
+    unsigned char *extensions;
+    size_t extensions_len;
+    unsigned long extension_flags;
+
+    /* data asked for in each FXP_READ and sent in each FXP_WRITE at most */
+    size_t max_read_len;
+    size_t max_write_len;
+
+    /* operation used by sftp_init() to get limits@openssh.com */
+    LIBSSH2_SFTP_OP *limits_op;
+
+    /* read-ahead settings given to new file handles */
+    size_t read_ahead;
+    unsigned int read_ahead_requests;
+    unsigned long read_ahead_flags;
+
+    /* write-behind settings given to new file handles */
+    size_t write_behind;
+    unsigned int write_behind_requests;
+
     /* Holder for partial packet, use in libssh2_sftp_packet_read() */
     unsigned char partial_size[4];      /* buffer for size field   */
     size_t partial_size_len;            /* size field length       */
     unsigned char *partial_packet;      /* The data                */
     uint32_t partial_len;               /* Desired number of bytes */
     size_t partial_received;            /* Bytes received so far   */
+    /* with READs in 'direct_reads', the header of a packet is read first,
+       to see if it is an FXP_DATA that answers one of them. Its data then
+       goes to 'partial_direct', or nowhere once that went away */
+    unsigned char partial_head[SFTP_DATA_HEADER_LEN];
+    char partial_mode;                  /* SFTP_PARTIAL_* */
+    struct sftp_direct *partial_direct;
 
     /* Time that libssh2_sftp_packet_requirev() started reading */
     time_t requirev_start;
 
-    /* State variables used in libssh2_sftp_open_ex() */
-    libssh2_nonblocking_states open_state;
-    unsigned char *open_packet;
-    uint32_t open_packet_len; /* 32 bit on the wire */
-    size_t open_packet_sent;
-    uint32_t open_request_id;
+    /* all operations not finished or freed yet, in the order they were
+       made, and how many of them still have request data to send */
+    struct list_head ops;
+    unsigned int ops_unsent;
+
+    /* operation used by libssh2_sftp_open_ex() */
+    LIBSSH2_SFTP_OP *open_op;
 
     /* State variable used in sftp_read() */
     libssh2_nonblocking_states read_state;
@@ -181,11 +579,7 @@ struct _LIBSSH2_SFTP
     libssh2_nonblocking_states fsync_state;
     unsigned char *fsync_packet;
     uint32_t fsync_request_id;
-
-    /* State variables used in libssh2_sftp_readdir() */
-    libssh2_nonblocking_states readdir_state;
-    unsigned char *readdir_packet;
-    uint32_t readdir_request_id;
+    LIBSSH2_SFTP_OP *fsync_op; /* an asynchronous fsync still being sent */
 
     /* State variables used in libssh2_sftp_fstat_ex() */
     libssh2_nonblocking_states fstat_state;
@@ -223,10 +617,17 @@ struct _LIBSSH2_SFTP
     unsigned char *rmdir_packet;
     uint32_t rmdir_request_id;
 
-    /* State variables used in libssh2_sftp_stat() */
-    libssh2_nonblocking_states stat_state;
-    unsigned char *stat_packet;
-    uint32_t stat_request_id;
+    /* operation used by libssh2_sftp_stat_ex() */
+    LIBSSH2_SFTP_OP *stat_op;
+
+    /* attributes and resolved paths got before, see
+       libssh2_sftp_attr_cache() */
+    struct sftp_attr_cache attr_cache;
+
+    /* operations used by libssh2_sftp_copy_data() and
+       libssh2_sftp_check_file() */
+    LIBSSH2_SFTP_OP *copy_data_op;
+    LIBSSH2_SFTP_OP *check_file_op;
 
     /* State variables used in libssh2_sftp_symlink() */
     libssh2_nonblocking_states symlink_state;
@@ -0,0 +1,314 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+#include "libssh2_priv.h"
+#include "thread.h"
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef LIBSSH2_THREADS
+
+static void *
+pool_worker(void *arg)
+{
+    libssh2_pool *pool = arg;
+    int worker;
+
+    pthread_mutex_lock(&pool->lock);
+    worker = pool->started++;
+
+    while (1) {
+        libssh2_job *job;
+
+        while (!pool->first && !pool->quit)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->quit)
+            break;
+
+        job = pool->first;
+        pool->first = job->next;
+        if (!pool->first)
+            pool->last = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->run(job, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * _libssh2_pool_init
+ *
+ * Start a pool of 'nthreads' worker threads. Returns NULL on failure.
+ */
+libssh2_pool *
+_libssh2_pool_init(LIBSSH2_SESSION *session, int nthreads)
+{
+    libssh2_pool *pool;
+
+    if (nthreads > LIBSSH2_POOL_MAX_THREADS)
+        nthreads = LIBSSH2_POOL_MAX_THREADS;
+
+    pool = LIBSSH2_CALLOC(session, sizeof(libssh2_pool));
+    if (!pool)
+        return NULL;
+    pool->session = session;
+
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        LIBSSH2_FREE(session, pool);
+        return NULL;
+    }
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    while (pool->nthreads < nthreads) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                           pool_worker, pool))
+            break;
+        pool->nthreads++;
+    }
+
+    if (!pool->nthreads) {
+        _libssh2_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/*
+ * _libssh2_pool_free
+ *
+ * Stop the threads of a pool and free it
+ */
+void
+_libssh2_pool_free(libssh2_pool *pool)
+{
+    LIBSSH2_SESSION *session = pool->session;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    LIBSSH2_FREE(session, pool);
+}
+
+/*
+ * _libssh2_pool_submit
+ *
+ * Queue a job for the next idle worker
+ */
+void
+_libssh2_pool_submit(libssh2_pool *pool, libssh2_job *job)
+{
+    job->next = NULL;
+    job->done = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->last)
+        pool->last->next = job;
+    else
+        pool->first = job;
+    pool->last = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * _libssh2_pool_wait
+ *
+ * Wait for a submitted job to be done
+ */
+void
+_libssh2_pool_wait(libssh2_pool *pool, libssh2_job *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * _libssh2_lock_init
+ *
+ * Give the session a lock
+ */
+int
+_libssh2_lock_init(LIBSSH2_SESSION *session)
+{
+    libssh2_lock *lock;
+    pthread_mutexattr_t attr;
+    int rc;
+
+    if (session->lock)
+        return 0;
+
+    lock = LIBSSH2_CALLOC(session, sizeof(libssh2_lock));
+    if (!lock)
+        return LIBSSH2_ERROR_ALLOC;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    rc = pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc) {
+        LIBSSH2_FREE(session, lock);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+    pthread_mutex_init(&lock->wait_lock, NULL);
+    pthread_cond_init(&lock->waited, NULL);
+
+    session->lock = lock;
+    return 0;
+}
+
+/*
+ * _libssh2_lock_free
+ *
+ * Remove the session's lock
+ */
+void
+_libssh2_lock_free(LIBSSH2_SESSION *session)
+{
+    libssh2_lock *lock = session->lock;
+
+    if (!lock)
+        return;
+
+    pthread_cond_destroy(&lock->waited);
+    pthread_mutex_destroy(&lock->wait_lock);
+    pthread_mutex_destroy(&lock->mutex);
+    LIBSSH2_FREE(session, lock);
+    session->lock = NULL;
+}
+
+void
+_libssh2_lock_enter(libssh2_lock *lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+    lock->depth++;
+}
+
+void
+_libssh2_lock_leave(libssh2_lock *lock)
+{
+    lock->depth--;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/*
+ * _libssh2_lock_wait_begin
+ *
+ * Let go of the lock entirely before waiting on the socket, unless another
+ * thread already does
+ */
+int
+_libssh2_lock_wait_begin(libssh2_lock *lock)
+{
+    int depth = lock->depth;
+    int i;
+
+    lock->depth = 0;
+    for(i = 0; i < depth; i++)
+        pthread_mutex_unlock(&lock->mutex);
+
+    pthread_mutex_lock(&lock->wait_lock);
+    if (!lock->waiting) {
+        lock->waiting = 1;
+        pthread_mutex_unlock(&lock->wait_lock);
+        return depth;
+    }
+    else {
+        /* what comes in may be for this thread, or the socket may take
+           data by now. Look again when the other thread has read, or
+           after a little while. */
+        struct timeval now;
+        struct timespec until;
+
+        gettimeofday(&now, NULL);
+        until.tv_sec = now.tv_sec;
+        until.tv_nsec = (now.tv_usec + LIBSSH2_LOCK_WAIT_MS * 1000) * 1000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&lock->waited, &lock->wait_lock, &until);
+        pthread_mutex_unlock(&lock->wait_lock);
+    }
+
+    for(i = 0; i < depth; i++)
+        pthread_mutex_lock(&lock->mutex);
+    lock->depth = depth;
+
+    return -1;
+}
+
+/*
+ * _libssh2_lock_wait_end
+ *
+ * Take the lock back after waiting on the socket
+ */
+void
+_libssh2_lock_wait_end(libssh2_lock *lock, int depth)
+{
+    int i;
+
+    pthread_mutex_lock(&lock->wait_lock);
+    lock->waiting = 0;
+    pthread_cond_broadcast(&lock->waited);
+    pthread_mutex_unlock(&lock->wait_lock);
+
+    for(i = 0; i < depth; i++)
+        pthread_mutex_lock(&lock->mutex);
+    lock->depth = depth;
+}
+
+#endif /* LIBSSH2_THREADS */
@@ -0,0 +1,170 @@
+#ifndef __LIBSSH2_THREAD_H
+#define __LIBSSH2_THREAD_H
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/*
+ * Worker threads. libssh2 itself does all its work on the thread that calls
+ * it; a pool only runs self-contained jobs, such as checking the MAC of a
+ * packet, that the calling thread hands out and later waits for. Without
+ * thread support (LIBSSH2_THREADS undefined) there is no pool, and callers
+ * do the work themselves.
+ */
+
+#include "libssh2_priv.h"
+
+#ifdef HAVE_PTHREAD
+#define LIBSSH2_THREADS
+#include <pthread.h>
+#endif
+
+/* most threads a pool gets */
+#define LIBSSH2_POOL_MAX_THREADS 16
+
+typedef struct _libssh2_job libssh2_job;
+
+struct _libssh2_job
+{
+    /* runs on a worker thread, 'worker' is its index in the pool */
+    void (*run)(libssh2_job *job, int worker);
+    libssh2_job *next;
+    int done;
+};
+
+#ifdef LIBSSH2_THREADS
+
+typedef struct _libssh2_pool
+{
+    LIBSSH2_SESSION *session;
+    pthread_t threads[LIBSSH2_POOL_MAX_THREADS];
+    int nthreads;
+    int started;            /* threads that took their index so far */
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* signalled when a job is queued */
+    pthread_cond_t done;    /* broadcast when a job is done */
+    libssh2_job *first;     /* jobs not picked up yet, oldest first */
+    libssh2_job *last;
+    int quit;
+} libssh2_pool;
+
+/*
+ * _libssh2_pool_init
+ *
+ * Start a pool of 'nthreads' worker threads. Returns NULL on failure.
+ */
+libssh2_pool *_libssh2_pool_init(LIBSSH2_SESSION *session, int nthreads);
+
+/*
+ * _libssh2_pool_free
+ *
+ * Stop the threads of a pool and free it. Jobs still queued are not run.
+ */
+void _libssh2_pool_free(libssh2_pool *pool);
+
+/*
+ * _libssh2_pool_submit
+ *
+ * Queue a job for the next idle worker. The job must stay valid until
+ * _libssh2_pool_wait() returned for it.
+ */
+void _libssh2_pool_submit(libssh2_pool *pool, libssh2_job *job);
+
+/*
+ * _libssh2_pool_wait
+ *
+ * Wait for a submitted job to be done
+ */
+void _libssh2_pool_wait(libssh2_pool *pool, libssh2_job *job);
+
+/*
+ * Session lock, see libssh2_session_thread_safe(). The thread that holds it
+ * may take it again, every _libssh2_lock_enter() needs its
+ * _libssh2_lock_leave(). Only one thread at a time waits on the socket,
+ * the others wait for it to be back.
+ */
+
+/* how long a thread waits for the one waiting on the socket before it tries
+   again by itself, in milliseconds */
+#define LIBSSH2_LOCK_WAIT_MS 10
+
+typedef struct _libssh2_lock libssh2_lock;
+
+struct _libssh2_lock
+{
+    pthread_mutex_t mutex;      /* recursive */
+    int depth;                  /* how many times the owner holds it */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t waited;      /* broadcast when the socket wait is over */
+    int waiting;                /* a thread waits on the socket */
+};
+
+/*
+ * _libssh2_lock_init
+ *
+ * Give the session a lock. Returns 0 or LIBSSH2_ERROR_ALLOC.
+ */
+int _libssh2_lock_init(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_lock_free
+ *
+ * Remove the session's lock. No thread may hold it.
+ */
+void _libssh2_lock_free(LIBSSH2_SESSION *session);
+
+void _libssh2_lock_enter(libssh2_lock *lock);
+void _libssh2_lock_leave(libssh2_lock *lock);
+
+/*
+ * _libssh2_lock_wait_begin
+ *
+ * Let go of the lock entirely before waiting on the socket. Returns how
+ * many times it was held, to be passed to _libssh2_lock_wait_end(), or -1
+ * if another thread already waits on the socket. In that case this thread
+ * waited for that one instead and holds the lock again.
+ */
+int _libssh2_lock_wait_begin(libssh2_lock *lock);
+
+/*
+ * _libssh2_lock_wait_end
+ *
+ * Take the lock back after waiting on the socket
+ */
+void _libssh2_lock_wait_end(libssh2_lock *lock, int depth);
+
+#endif /* LIBSSH2_THREADS */
+
+#endif /* __LIBSSH2_THREAD_H */
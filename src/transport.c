@@ -50,10 +50,208 @@
 
 #include "transport.h"
 #include "mac.h"
+#include "thread.h"
+#include "session.h"
 
 #define MAX_BLOCKSIZE 32    /* MUST fit biggest crypto block size we use/get */
 #define MAX_MACSIZE 64      /* MUST fit biggest MAC length we support */
 
+#ifdef LIBSSH2_THREADS
+/*
+ * Checking MACs ahead of time. With encrypt-then-MAC the MAC of a packet
+ * covers the bytes as they came off the network, so every complete packet
+ * sitting in the receive buffer can have its MAC checked before it gets
+ * decrypted. Worker threads do that for the packets following the one the
+ * caller is busy with, the caller then only looks up the result. Decrypting
+ * stays with the caller as the ciphers carry state from packet to packet.
+ */
+
+/* most packets checked ahead of the current one */
+#define AHEAD_JOBS 32
+
+/* smaller packets are cheaper to check than to hand to a worker */
+#define AHEAD_MIN_PACKET 1024
+
+struct transport_ahead;
+
+struct ahead_job
+{
+    libssh2_job job;            /* must be first */
+    struct transport_ahead *ahead;
+    uint32_t seqno;
+    unsigned int gen;           /* remote.mac_gen of the key it uses */
+    const unsigned char *data;  /* packet_length field and the packet */
+    uint32_t len;               /* packet_length */
+    int ok;                     /* set when the MAC matched */
+};
+
+struct transport_ahead
+{
+    LIBSSH2_SESSION *session;
+    libssh2_pool *pool;
+
+    /* the MAC of the remote end, as one abstract per worker */
+    const LIBSSH2_MAC_METHOD *mac;
+    unsigned int gen;
+    void *mac_abstract[LIBSSH2_POOL_MAX_THREADS];
+    int nabstract;
+
+    /* jobs handed out, oldest first */
+    struct ahead_job jobs[AHEAD_JOBS];
+    int first;
+    int count;
+
+    /* where in the receive buffer the next packet to check starts */
+    size_t scan;
+    uint32_t scan_seqno;
+};
+
+static void
+ahead_run(libssh2_job *job, int worker)
+{
+    struct ahead_job *j = (struct ahead_job *)job;
+    struct transport_ahead *a = j->ahead;
+    unsigned char macbuf[MAX_MACSIZE];
+
+    a->mac->hash(a->session, macbuf, j->seqno, j->data, 4,
+                 j->data + 4, j->len, NULL, 0, &a->mac_abstract[worker]);
+    j->ok = !memcmp(macbuf, j->data + 4 + j->len, a->mac->mac_len);
+}
+
+/*
+ * ahead_drain
+ *
+ * Wait for all jobs and forget them. Must be done before the data in the
+ * receive buffer moves.
+ */
+static void
+ahead_drain(struct transport_ahead *a)
+{
+    while (a->count) {
+        _libssh2_pool_wait(a->pool, &a->jobs[a->first].job);
+        a->first = (a->first + 1) % AHEAD_JOBS;
+        a->count--;
+    }
+    a->first = 0;
+}
+
+static void
+ahead_clear_macs(struct transport_ahead *a)
+{
+    int i;
+
+    for(i = 0; i < a->nabstract; i++)
+        a->mac->dtor(a->session, &a->mac_abstract[i]);
+    a->nabstract = 0;
+}
+
+/*
+ * ahead_scan
+ *
+ * Hand out the MAC checks of the complete packets in the receive buffer
+ * that follow the one starting at readidx
+ */
+static void
+ahead_scan(LIBSSH2_SESSION * session)
+{
+    struct transportpacket *p = &session->packet;
+    struct transport_ahead *a = session->crypto_ahead;
+    size_t mac_len = session->remote.mac->mac_len;
+    int skip = 0;
+
+    if ((a->mac != session->remote.mac) ||
+        (a->gen != session->remote.mac_gen)) {
+        /* new keys, the workers need their own copies of them */
+        ahead_drain(a);
+        ahead_clear_macs(a);
+        a->mac = session->remote.mac;
+        a->gen = session->remote.mac_gen;
+        while (a->nabstract < a->pool->nthreads) {
+            if (_libssh2_mac_dup(session, a->mac,
+                                 session->remote.mac_abstract,
+                                 &a->mac_abstract[a->nabstract])) {
+                ahead_clear_macs(a);
+                break;
+            }
+            a->nabstract++;
+        }
+    }
+    if (!a->nabstract)
+        /* not a MAC that can be shared */
+        return;
+
+    if (!a->count || (a->scan < p->readidx)) {
+        /* the caller checks the current packet itself */
+        a->scan = p->readidx;
+        a->scan_seqno = session->remote.seqno;
+        skip = 1;
+    }
+
+    while (a->count < AHEAD_JOBS) {
+        struct ahead_job *j;
+        uint32_t len;
+
+        if (p->writeidx - a->scan < 4)
+            break;
+        len = _libssh2_ntohu32(&p->buf[a->scan]);
+        if ((len < 5) || (len + mac_len > p->maxpayload) ||
+            (p->writeidx - a->scan < 4 + len + mac_len))
+            /* not all here yet, or transport_read() will refuse it */
+            break;
+
+        if (!skip && (len >= AHEAD_MIN_PACKET)) {
+            j = &a->jobs[(a->first + a->count) % AHEAD_JOBS];
+            j->job.run = ahead_run;
+            j->ahead = a;
+            j->seqno = a->scan_seqno;
+            j->gen = a->gen;
+            j->data = &p->buf[a->scan];
+            j->len = len;
+            j->ok = 0;
+            _libssh2_pool_submit(a->pool, &j->job);
+            a->count++;
+        }
+        skip = 0;
+
+        a->scan += 4 + len + mac_len;
+        a->scan_seqno++;
+    }
+}
+
+/*
+ * ahead_result
+ *
+ * Returns 1 if a worker found the MAC of the current packet to match, 0 if
+ * it did not and -1 if the packet was not checked ahead
+ */
+static int
+ahead_result(LIBSSH2_SESSION * session)
+{
+    struct transportpacket *p = &session->packet;
+    struct transport_ahead *a = session->crypto_ahead;
+
+    while (a->count) {
+        struct ahead_job *j = &a->jobs[a->first];
+        int32_t diff = (int32_t)(j->seqno - session->remote.seqno);
+        int match = (j->gen == session->remote.mac_gen);
+
+        if ((diff > 0) && match)
+            /* for a later packet */
+            return -1;
+
+        _libssh2_pool_wait(a->pool, &j->job);
+        a->first = (a->first + 1) % AHEAD_JOBS;
+        a->count--;
+
+        if (!diff && match && (j->len == p->packet_length) &&
+            !memcmp(j->data + 4 + j->len, p->payload + p->packet_length,
+                    a->mac->mac_len))
+            return j->ok;
+    }
+    return -1;
+}
+#endif /* LIBSSH2_THREADS */
+
 #ifdef LIBSSH2DEBUG
 #define UNPRINTABLE_CHAR '.'
 static void
@@ -122,39 +320,329 @@ debugdump(LIBSSH2_SESSION * session,
 #endif
 
 
-/* decrypt() decrypts 'len' bytes from 'source' to 'dest'.
+/* time taken by the cipher, MAC and compression, counted in the session
+   stats with LIBSSH2_FLAG_STATS_TIMING set. STATS_START() is 0 otherwise. */
+#define STATS_START(session) \
+    ((session)->flag.stats_timing ? _libssh2_time_us() : 0)
+#define STATS_STOP(session, counter, start)                             \
+    do {                                                                \
+        if (start)                                                      \
+            (session)->stats.counter += _libssh2_time_us() - (start);   \
+    } while(0)
+
+/*
+ * The transport kernels. _libssh2_transport_kernels() picks one for each
+ * direction when new keys take effect, by the negotiated cipher and MAC. A
+ * kernel seals (MACs and encrypts) outgoing packets and opens (decrypts)
+ * incoming ones, for the ciphers that are neither AEAD nor used with
+ * encrypt-then-MAC. The generic kernel makes a pass of the cipher and a
+ * pass of the MAC over each packet. The fused one runs both over one chunk
+ * of the packet after the other, so that the bytes are still in the cache
+ * for the second.
+ */
+struct _libssh2_transport_kernel
+{
+    const char *name;
+    /* MAC and encrypt the 'packet_length' bytes of a packet at 'out', the
+       MAC goes to out + packet_length. 'direct_len' bytes at 'direct_off'
+       are taken from 'direct', see _libssh2_transport_send() */
+    int (*seal)(LIBSSH2_SESSION *session, unsigned char *out,
+                size_t packet_length, const unsigned char *direct,
+                size_t direct_off, size_t direct_len);
+    /* decrypt the next 'len' bytes of the incoming packet from 'src' to
+       'dest', 'first' is set for the first block of a packet */
+    int (*open)(LIBSSH2_SESSION *session, const unsigned char *src,
+                unsigned char *dest, size_t len, int first);
+    /* the MAC of the packet that was opened */
+    void (*open_mac)(LIBSSH2_SESSION *session, unsigned char *macbuf);
+};
+
+/* what the fused kernel runs the cipher and the MAC over at a time, a
+   multiple of every block size */
+#define KERNEL_CHUNK 4096
+
+static int encrypt_packet(LIBSSH2_SESSION *session, unsigned char *outbuf,
+                          size_t start, size_t packet_length,
+                          const unsigned char *direct, size_t direct_off,
+                          size_t direct_len);
+
+static int
+generic_seal(LIBSSH2_SESSION *session, unsigned char *out,
+             size_t packet_length, const unsigned char *direct,
+             size_t direct_off, size_t direct_len)
+{
+    libssh2_uint64_t start = STATS_START(session);
+
+    /* The MAC is calculated on the entire unencrypted packet, including
+       all fields except the MAC field itself. */
+    if (direct)
+        session->local.mac->hash(session, out + packet_length,
+                                 session->local.seqno, out,
+                                 direct_off, direct, direct_len,
+                                 out + direct_off + direct_len,
+                                 packet_length - direct_off - direct_len,
+                                 &session->local.mac_abstract);
+    else
+        session->local.mac->hash(session, out + packet_length,
+                                 session->local.seqno, out,
+                                 packet_length, NULL, 0, NULL, 0,
+                                 &session->local.mac_abstract);
+    STATS_STOP(session, mac_us, start);
+
+    /* Encrypt the whole packet data in one go. packet_length is always
+       a multiple of the cipher block size. The MAC field is not
+       encrypted. */
+    return encrypt_packet(session, out, 0, packet_length,
+                          direct, direct_off, direct_len);
+}
+
+static int
+generic_open(LIBSSH2_SESSION *session, const unsigned char *src,
+             unsigned char *dest, size_t len, int first)
+{
+    libssh2_uint64_t start;
+    int rc;
+    (void)first;
+
+    memcpy(dest, src, len);
+
+    start = STATS_START(session);
+    rc = session->remote.crypt->crypt(session, dest, len,
+                                      &session->remote.crypt_abstract);
+    STATS_STOP(session, crypt_us, start);
+    return rc;
+}
+
+static void
+generic_open_mac(LIBSSH2_SESSION *session, unsigned char *macbuf)
+{
+    struct transportpacket *p = &session->packet;
+    libssh2_uint64_t start = STATS_START(session);
+
+    session->remote.mac->hash(session, macbuf, session->remote.seqno,
+                              p->init, 5, p->payload,
+                              session->fullpacket_payload_len, NULL, 0,
+                              &session->remote.mac_abstract);
+    STATS_STOP(session, mac_us, start);
+}
+
+/* MAC 'len' bytes and encrypt them from 'src' to 'dst', which is the same
+   buffer when 'src' is NULL, a chunk at a time */
+static int
+fused_seal_range(LIBSSH2_SESSION *session, const unsigned char *src,
+                 unsigned char *dst, size_t len)
+{
+    const LIBSSH2_CRYPT_METHOD *crypt = session->local.crypt;
+    void *mac = session->local.mac_abstract;
+    size_t n;
+
+    while (len) {
+        n = len < KERNEL_CHUNK ? len : KERNEL_CHUNK;
+        if (src) {
+            _libssh2_mac_stream_update(mac, src, n);
+            if (crypt->crypt_to(session, src, dst, n,
+                                &session->local.crypt_abstract))
+                return -1;
+            src += n;
+        }
+        else {
+            _libssh2_mac_stream_update(mac, dst, n);
+            if (crypt->crypt(session, dst, n,
+                             &session->local.crypt_abstract))
+                return -1;
+        }
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+fused_seal(LIBSSH2_SESSION *session, unsigned char *out,
+           size_t packet_length, const unsigned char *direct,
+           size_t direct_off, size_t direct_len)
+{
+    libssh2_uint64_t start = STATS_START(session);
+    size_t direct_end = direct_off + direct_len;
+    int rc;
+
+    _libssh2_mac_stream_start(session->local.mac,
+                              session->local.mac_abstract,
+                              session->local.seqno);
+    if (!direct)
+        rc = fused_seal_range(session, NULL, out, packet_length);
+    else
+        /* the three parts are whole blocks, like in encrypt_packet() */
+        rc = fused_seal_range(session, NULL, out, direct_off) ||
+            fused_seal_range(session, direct, out + direct_off,
+                             direct_len) ||
+            fused_seal_range(session, NULL, out + direct_end,
+                             packet_length - direct_end);
+    _libssh2_mac_stream_final(session->local.mac_abstract,
+                              out + packet_length);
+    STATS_STOP(session, crypt_us, start);
+    return rc;
+}
+
+static int
+fused_open(LIBSSH2_SESSION *session, const unsigned char *src,
+           unsigned char *dest, size_t len, int first)
+{
+    const LIBSSH2_CRYPT_METHOD *crypt = session->remote.crypt;
+    void *mac = session->remote.mac_abstract;
+    libssh2_uint64_t start = STATS_START(session);
+    size_t n;
+
+    if (first)
+        _libssh2_mac_stream_start(session->remote.mac, mac,
+                                  session->remote.seqno);
+
+    while (len) {
+        n = len < KERNEL_CHUNK ? len : KERNEL_CHUNK;
+        if (crypt->crypt_to(session, src, dest, n,
+                            &session->remote.crypt_abstract))
+            return -1;
+        _libssh2_mac_stream_update(mac, dest, n);
+        src += n;
+        dest += n;
+        len -= n;
+    }
+    STATS_STOP(session, crypt_us, start);
+    return 0;
+}
+
+static void
+fused_open_mac(LIBSSH2_SESSION *session, unsigned char *macbuf)
+{
+    /* all of the packet was fed while it was decrypted */
+    _libssh2_mac_stream_final(session->remote.mac_abstract, macbuf);
+}
+
+static const struct _libssh2_transport_kernel kernel_generic = {
+    "generic",
+    generic_seal,
+    generic_open,
+    generic_open_mac
+};
+
+static const struct _libssh2_transport_kernel kernel_fused = {
+    "fused",
+    fused_seal,
+    fused_open,
+    fused_open_mac
+};
+
+/* the kernel of one direction, also before any keys were set up */
+#define KERNEL(end) ((end)->kernel ? (end)->kernel : &kernel_generic)
+
+/*
+ * kernel_pick
+ *
+ * The kernel for a cipher and MAC pair
+ */
+static const struct _libssh2_transport_kernel *
+kernel_pick(const LIBSSH2_CRYPT_METHOD *crypt, const LIBSSH2_MAC_METHOD *mac)
+{
+    if (crypt && mac && crypt->crypt_to && crypt->blocksize >= 8 &&
+        !(crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD) && !mac->etm &&
+        _libssh2_mac_stream(mac))
+        return &kernel_fused;
+    return &kernel_generic;
+}
+
+/*
+ * _libssh2_transport_kernels
+ *
+ * Pick the kernels for the ciphers and MACs that were just set up
+ */
+void
+_libssh2_transport_kernels(LIBSSH2_SESSION *session)
+{
+    session->local.kernel = kernel_pick(session->local.crypt,
+                                        session->local.mac);
+    session->remote.kernel = kernel_pick(session->remote.crypt,
+                                         session->remote.mac);
+    _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
+                   "Packet kernels: %s out, %s in",
+                   session->local.kernel->name,
+                   session->remote.kernel->name);
+}
+
+/* decrypt() decrypts 'len' bytes from 'source' to 'dest', with the kernel
+ * of the incoming direction. 'first' is set for the first block of a
+ * packet.
+ *
+ * 'source' is left untouched.
  *
  * returns 0 on success and negative on failure
  */
 
 static int
 decrypt(LIBSSH2_SESSION * session, unsigned char *source,
-        unsigned char *dest, int len)
+        unsigned char *dest, int len, int first)
 {
-    struct transportpacket *p = &session->packet;
     int blocksize = session->remote.crypt->blocksize;
 
     /* if we get called with a len that isn't an even number of blocksizes
        we risk losing those extra bytes */
     assert((len % blocksize) == 0);
 
-    while (len >= blocksize) {
-        if (session->remote.crypt->crypt(session, source, blocksize,
-                                         &session->remote.crypt_abstract)) {
-            LIBSSH2_FREE(session, p->payload);
-            return LIBSSH2_ERROR_DECRYPT;
-        }
+    if (KERNEL(&session->remote)->open(session, source, dest, len, first))
+        return LIBSSH2_ERROR_DECRYPT;
 
-        /* if the crypt() function would write to a given address it
-           wouldn't have to memcpy() and we could avoid this memcpy()
-           too */
-        memcpy(dest, source, blocksize);
+    return LIBSSH2_ERROR_NONE;         /* all is fine */
+}
 
-        len -= blocksize;       /* less bytes left */
-        dest += blocksize;      /* advance write pointer */
-        source += blocksize;    /* advance read pointer */
+/* RFC 4344 3.1: re-key well before the sequence numbers can wrap */
+#define LIBSSH2_REKEY_PACKETS ((uint32_t)1 << 31)
+
+/*
+ * rekey_limit_hit
+ *
+ * Whether the keys of one direction carried enough to be replaced, see
+ * libssh2_session_rekey_limit()
+ */
+static int
+rekey_limit_hit(LIBSSH2_SESSION *session, libssh2_endpoint_data *end)
+{
+    libssh2_uint64_t bytes = session->rekey_limit_bytes;
+    uint32_t packets = session->rekey_limit_packets ?
+        session->rekey_limit_packets : LIBSSH2_REKEY_PACKETS;
+
+    if (!bytes) {
+        /* RFC 4344 3.2: at most 2^(L/4) blocks with an L bit block cipher,
+           and 1GB with the small block ones */
+        int blocksize = end->crypt->blocksize;
+
+        if (blocksize >= 16)
+            bytes = ((libssh2_uint64_t)1 << 32) * blocksize;
+        else
+            bytes = (libssh2_uint64_t)1 << 30;
     }
-    return LIBSSH2_ERROR_NONE;         /* all is fine */
+    return (end->rekey_bytes >= bytes) || (end->rekey_packets >= packets);
+}
+
+/*
+ * rekey_start
+ *
+ * Start a key re-exchange of our own once a limit was hit. Only done between
+ * two packets, never while a sender waits to finish its own. Returns 0 if
+ * there is nothing to do, or what _libssh2_kex_exchange() returned.
+ */
+static int
+rekey_start(LIBSSH2_SESSION *session)
+{
+    if (!session->rekey_due || session->packet.olen ||
+        (session->state & LIBSSH2_STATE_EXCHANGING_KEYS))
+        return 0;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_TRANS, "Starting a key "
+                   "re-exchange after %u packets out and %u packets in",
+                   session->local.rekey_packets,
+                   session->remote.rekey_packets);
+    session->rekey_due = 0;
+    memset(&session->startup_key_state, 0, sizeof(key_exchange_state_t));
+    return _libssh2_kex_exchange(session, 1, &session->startup_key_state);
 }
 
 /*
@@ -170,18 +658,89 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     int compressed;
 
     if (session->fullpacket_state == libssh2_NB_state_idle) {
+        int aead = encrypted &&
+            (session->remote.crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD);
+        int etm = encrypted && session->remote.mac->etm;
+        libssh2_uint64_t start;
+
         session->fullpacket_macstate = LIBSSH2_MAC_CONFIRMED;
         session->fullpacket_payload_len = p->packet_length - 1;
 
-        if (encrypted) {
+        if (aead) {
+            /* The payload buffer holds everything after the packet_length
+               field, still encrypted. Check the tag and decrypt it all in
+               one go. There is no use in handing a packet that fails the
+               check to the MAC error callback, it is just noise. */
+            start = STATS_START(session);
+            rc = session->remote.crypt->
+                aead_crypt(session, session->remote.seqno, p->init,
+                           p->payload, p->packet_length,
+                           p->payload + p->packet_length,
+                           &session->remote.crypt_abstract);
+            STATS_STOP(session, crypt_us, start);
+            if (rc) {
+                LIBSSH2_FREE(session, p->payload);
+                return LIBSSH2_ERROR_INVALID_MAC;
+            }
+        }
+        else if (etm) {
+            /* Encrypt-then-MAC: the MAC covers the packet as it was sent,
+               so check it before spending any time on decrypting. Without
+               a MAC error callback that could accept it anyway, a bad
+               packet is dropped right here. */
+            int ok = -1;
+
+#ifdef LIBSSH2_THREADS
+            if (session->crypto_ahead)
+                ok = ahead_result(session);
+#endif
+            if (ok < 0) {
+                start = STATS_START(session);
+                session->remote.mac->hash(session, macbuf,
+                                          session->remote.seqno,
+                                          p->init, 4,
+                                          p->payload, p->packet_length,
+                                          NULL, 0,
+                                          &session->remote.mac_abstract);
+                STATS_STOP(session, mac_us, start);
+                ok = !memcmp(macbuf, p->payload + p->packet_length,
+                             session->remote.mac->mac_len);
+            }
+            if (!ok) {
+                session->fullpacket_macstate = LIBSSH2_MAC_INVALID;
+                if (!session->macerror) {
+                    LIBSSH2_FREE(session, p->payload);
+                    return LIBSSH2_ERROR_INVALID_MAC;
+                }
+            }
+
+            start = STATS_START(session);
+            rc = session->remote.crypt->
+                crypt(session, p->payload, p->packet_length,
+                      &session->remote.crypt_abstract);
+            STATS_STOP(session, crypt_us, start);
+            if (rc) {
+                LIBSSH2_FREE(session, p->payload);
+                return LIBSSH2_ERROR_DECRYPT;
+            }
+        }
+
+        if (aead || etm) {
+            p->padding_length = p->payload[0];
+            if (p->padding_length >= session->fullpacket_payload_len) {
+                LIBSSH2_FREE(session, p->payload);
+                return LIBSSH2_ERROR_DECRYPT;
+            }
+
+            /* move the payload to the start of the buffer where the rest
+               of the code expects it */
+            memmove(p->payload, p->payload + 1,
+                    session->fullpacket_payload_len);
+        }
+        else if (encrypted) {
 
             /* Calculate MAC hash */
-            session->remote.mac->hash(session, macbuf,  /* store hash here */
-                                      session->remote.seqno,
-                                      p->init, 5,
-                                      p->payload,
-                                      session->fullpacket_payload_len,
-                                      &session->remote.mac_abstract);
+            KERNEL(&session->remote)->open_mac(session, macbuf);
 
             /* Compare the calculated hash with the MAC we just read from
              * the network. The read one is at the very end of the payload
@@ -195,6 +754,14 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
         }
 
         session->remote.seqno++;
+        session->stats.packets_received++;
+
+        if (encrypted) {
+            session->remote.rekey_bytes += p->packet_length + 4;
+            session->remote.rekey_packets++;
+            if (rekey_limit_hit(session, &session->remote))
+                session->rekey_due = 1;
+        }
 
         /* ignore the padding */
         session->fullpacket_payload_len -= p->padding_length;
@@ -215,21 +782,40 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
 
             unsigned char *data;
             size_t data_len;
+            start = STATS_START(session);
             rc = session->remote.comp->decomp(session,
                                               &data, &data_len,
                                               LIBSSH2_PACKET_MAXDECOMP,
                                               p->payload,
                                               session->fullpacket_payload_len,
                                               &session->remote.comp_abstract);
-            LIBSSH2_FREE(session, p->payload);
-            if(rc)
+            STATS_STOP(session, comp_us, start);
+            if(rc) {
+                LIBSSH2_FREE(session, p->payload);
                 return rc;
+            }
 
-            p->payload = data;
+            /* the inflated data lives in the decompressor's own buffer.
+               Short packets fit where the compressed one was read, with its
+               padding and MAC, anything longer gets a new one */
+            if (data_len > p->total_num) {
+                unsigned char *plain = _libssh2_slab_alloc(session, data_len);
+                if (!plain) {
+                    LIBSSH2_FREE(session, p->payload);
+                    return LIBSSH2_ERROR_ALLOC;
+                }
+                _libssh2_slab_free(session, p->payload, p->total_num);
+                p->payload = plain;
+                p->total_num = data_len;
+            }
+            memcpy(p->payload, data, data_len);
             session->fullpacket_payload_len = data_len;
         }
 
         session->fullpacket_packet_type = p->payload[0];
+        _libssh2_event(session, LIBSSH2_EVENT_PACKET_RECEIVED, 0,
+                       session->remote.seqno - 1, p->payload[0],
+                       session->fullpacket_payload_len);
 
         debugdump(session, "libssh2_transport_read() plain",
                   p->payload, session->fullpacket_payload_len);
@@ -240,6 +826,7 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     if (session->fullpacket_state == libssh2_NB_state_created) {
         rc = _libssh2_packet_add(session, p->payload,
                                  session->fullpacket_payload_len,
+                                 p->total_num,
                                  session->fullpacket_macstate);
         if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
@@ -254,6 +841,38 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
     return session->fullpacket_packet_type;
 }
 
+/*
+ * release_buffers
+ *
+ * With LIBSSH2_FLAG_RELEASE_BUFFERS set an idle session gives back its
+ * transport buffers: the input buffer once a read finds nothing, the output
+ * buffer when no packet waits in it, and the spare packet buffers. They are
+ * allocated again when traffic resumes.
+ */
+static void
+release_buffers(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+
+    if (p->buf) {
+        LIBSSH2_FREE(session, p->buf);
+        p->buf = NULL;
+        p->buf_size = 0;
+        p->readidx = p->writeidx = 0;
+    }
+    if (p->outbuf && !p->ototal_num) {
+        LIBSSH2_FREE(session, p->outbuf);
+        p->outbuf = NULL;
+        p->outbuf_size = 0;
+    }
+    if (p->osegs && !p->oseg_count) {
+        LIBSSH2_FREE(session, p->osegs);
+        p->osegs = NULL;
+        p->oseg_size = 0;
+        p->oseg_first = 0;
+    }
+    _libssh2_slab_clear(session);
+}
 
 /*
  * _libssh2_transport_read
@@ -270,6 +889,8 @@ fullpacket(LIBSSH2_SESSION * session, int encrypted /* 1 or 0 */ )
  *
  * DOES NOT call _libssh2_error() for ANY error case.
  */
+static int send_pending(LIBSSH2_SESSION *session);
+
 int _libssh2_transport_read(LIBSSH2_SESSION * session)
 {
     int rc;
@@ -281,11 +902,21 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     unsigned char block[MAX_BLOCKSIZE];
     int blocksize;
     int encrypted = 1;
+    int aead = 0;
+    int etm = 0;
     size_t total_num;
 
     /* default clear the bit */
     session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_INBOUND;
 
+    /* packets queued while the socket was full go out before we wait for
+       what the peer answers to them. Corked ones stay where they are. */
+    if (p->oqueued) {
+        rc = send_pending(session);
+        if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+            return rc;
+    }
+
     /*
      * All channels, systems, subsystems, etc eventually make it down here
      * when looking for more incoming data. If a key exchange is going on
@@ -298,6 +929,14 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
      * of packet_read, then don't redirect, as that would be an infinite loop!
      */
 
+    if (session->rekey_due) {
+        /* the peer keeps sending until it has our KEXINIT, what comes in
+           meanwhile is queued as usual */
+        rc = rekey_start(session);
+        if (rc)
+            return rc;
+    }
+
     if (session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
         !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
 
@@ -329,6 +968,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
 
         if (session->state & LIBSSH2_STATE_NEWKEYS) {
             blocksize = session->remote.crypt->blocksize;
+            aead = session->remote.crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD;
+            etm = session->remote.mac->etm;
+            if (aead || etm)
+                /* nothing gets decrypted before the whole packet is here,
+                   all we need up front is the packet_length */
+                blocksize = 4;
         } else {
             encrypted = 0;      /* not encrypted */
             blocksize = 5;      /* not strictly true, but we can use 5 here to
@@ -353,6 +998,12 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                little data to deal with, read more */
             ssize_t nread;
 
+#ifdef LIBSSH2_THREADS
+            if (session->crypto_ahead)
+                /* the workers may still be reading from it */
+                ahead_drain(session->crypto_ahead);
+#endif
+
             /* move any remainder to the start of the buffer so
                that we can do a full refill */
             if (remainbuf) {
@@ -364,30 +1015,47 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 p->readidx = p->writeidx = 0;
             }
 
+            if (p->buf_size != p->buf_want) {
+                /* (re)size it now that at most a block is left in it */
+                unsigned char *buf = LIBSSH2_REALLOC(session, p->buf,
+                                                     p->buf_want);
+                if (!buf)
+                    return LIBSSH2_ERROR_ALLOC;
+                p->buf = buf;
+                p->buf_size = p->buf_want;
+            }
+
             /* now read a big chunk from the network into the temp buffer */
             nread =
                 LIBSSH2_RECV(session, &p->buf[remainbuf],
-                              PACKETBUFSIZE - remainbuf,
+                              p->buf_size - remainbuf,
                               LIBSSH2_SOCKET_RECV_FLAGS(session));
+            _libssh2_stats_io(session, 0, nread);
             if (nread <= 0) {
                 /* check if this is due to EAGAIN and return the special
                    return code if so, error out normally otherwise */
                 if ((nread < 0) && (nread == -EAGAIN)) {
                     session->socket_block_directions |=
                         LIBSSH2_SESSION_BLOCK_INBOUND;
+                    if (!remainbuf && session->flag.release_buffers)
+                        /* nothing is buffered in this direction */
+                        release_buffers(session);
                     return LIBSSH2_ERROR_EAGAIN;
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                                "Error recving %d bytes (got %d)",
-                               PACKETBUFSIZE - remainbuf, -nread);
+                               (int)(p->buf_size - remainbuf), -nread);
                 return LIBSSH2_ERROR_SOCKET_RECV;
             }
             _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                            "Recved %d/%d bytes to %p+%d", nread,
-                           PACKETBUFSIZE - remainbuf, p->buf, remainbuf);
+                           (int)(p->buf_size - remainbuf), p->buf, remainbuf);
 
             debugdump(session, "libssh2_transport_read() raw",
                       &p->buf[remainbuf], nread);
+            if (session->group_entry)
+                /* pushes its session group timeout back */
+                session->group_entry->recv_ms = _libssh2_time_ns() / 1000000;
             /* advance write pointer */
             p->writeidx += nread;
 
@@ -413,74 +1081,127 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 return LIBSSH2_ERROR_EAGAIN;
             }
 
-            if (encrypted) {
-                rc = decrypt(session, &p->buf[p->readidx], block, blocksize);
-                if (rc != LIBSSH2_ERROR_NONE) {
-                    return rc;
+            if (aead || etm) {
+#ifdef LIBSSH2_THREADS
+                if (etm && !aead && session->crypto_ahead)
+                    ahead_scan(session);
+#endif
+
+                /* keep the packet_length field as it was sent, it is
+                   authenticated along with the rest */
+                memcpy(p->init, &p->buf[p->readidx], 4);
+                p->readidx += 4;
+
+                if (session->remote.crypt->get_len) {
+                    if (session->remote.crypt->
+                        get_len(session, session->remote.seqno, p->init,
+                                &p->packet_length,
+                                &session->remote.crypt_abstract))
+                        return LIBSSH2_ERROR_DECRYPT;
                 }
-                /* save the first 5 bytes of the decrypted package, to be
-                   used in the hash calculation later down. */
-                memcpy(p->init, &p->buf[p->readidx], 5);
-            } else {
-                /* the data is plain, just copy it verbatim to
-                   the working block buffer */
-                memcpy(block, &p->buf[p->readidx], blocksize);
+                else
+                    p->packet_length = _libssh2_ntohu32(p->init);
+
+                /* padding_length is encrypted, fullpacket() sets it. What
+                   follows packet_length is whole blocks, also with AES-GCM
+                   which has no use for them, and a packet that says
+                   otherwise goes no further */
+                if (p->packet_length < 5)
+                    return LIBSSH2_ERROR_DECRYPT;
+                if (p->packet_length % session->remote.crypt->blocksize)
+                    return LIBSSH2_ERROR_DECRYPT;
+
+                /* everything after packet_length goes to the payload
+                   buffer, including padding_length and the tag or MAC */
+                total_num = p->packet_length +
+                    (aead ? session->remote.crypt->auth_len :
+                     session->remote.mac->mac_len);
+                if (total_num > p->maxpayload)
+                    return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
+
+                p->payload = _libssh2_slab_alloc(session, total_num);
+                if (!p->payload)
+                    return LIBSSH2_ERROR_ALLOC;
+                p->total_num = total_num;
+                p->wptr = p->payload;
+                p->data_num = 0;
+
+                numbytes -= 4;
             }
+            else {
+                if (encrypted) {
+                    rc = decrypt(session, &p->buf[p->readidx], block,
+                                 blocksize, 1);
+                    if (rc != LIBSSH2_ERROR_NONE) {
+                        return rc;
+                    }
+                    /* save the first 5 bytes of the decrypted package, to be
+                       used in the hash calculation later down. */
+                    memcpy(p->init, block, 5);
+                } else {
+                    /* the data is plain, just copy it verbatim to
+                       the working block buffer */
+                    memcpy(block, &p->buf[p->readidx], blocksize);
+                }
 
-            /* advance the read pointer */
-            p->readidx += blocksize;
+                /* advance the read pointer */
+                p->readidx += blocksize;
+
+                /* we now have the initial blocksize bytes decrypted,
+                 * and we can extract packet and padding length from it
+                 */
+                p->packet_length = _libssh2_ntohu32(block);
+                if (p->packet_length < 1)
+                    return LIBSSH2_ERROR_DECRYPT;
+
+                p->padding_length = block[4];
+
+                /* total_num is the number of bytes following the initial
+                   (5 bytes) packet length and padding length fields */
+                total_num =
+                    p->packet_length - 1 +
+                    (encrypted ? session->remote.mac->mac_len : 0);
+
+                /* RFC4253 section 6.1 Maximum Packet Length says:
+                 *
+                 * "All implementations MUST be able to process
+                 * packets with uncompressed payload length of 32768
+                 * bytes or less and total packet size of 35000 bytes
+                 * or less (including length, padding length, payload,
+                 * padding, and MAC.)."
+                 *
+                 * maxpayload starts out a bit above that and grows when a
+                 * channel advertises a larger packet size.
+                 */
+                if (total_num > p->maxpayload) {
+                    return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
+                }
 
-            /* we now have the initial blocksize bytes decrypted,
-             * and we can extract packet and padding length from it
-             */
-            p->packet_length = _libssh2_ntohu32(block);
-            if (p->packet_length < 1)
-                return LIBSSH2_ERROR_DECRYPT;
+                /* Get a packet handle put data into. We get one to
+                   hold all data, including padding and MAC. */
+                p->payload = _libssh2_slab_alloc(session, total_num);
+                if (!p->payload) {
+                    return LIBSSH2_ERROR_ALLOC;
+                }
+                p->total_num = total_num;
+                /* init write pointer to start of payload buffer */
+                p->wptr = p->payload;
+
+                if (blocksize > 5) {
+                    /* copy the data from index 5 to the end of
+                       the blocksize from the temporary buffer to
+                       the start of the decrypted buffer */
+                    memcpy(p->wptr, &block[5], blocksize - 5);
+                    p->wptr += blocksize - 5;       /* advance write pointer */
+                }
 
-            p->padding_length = block[4];
-
-            /* total_num is the number of bytes following the initial
-               (5 bytes) packet length and padding length fields */
-            total_num =
-                p->packet_length - 1 +
-                (encrypted ? session->remote.mac->mac_len : 0);
-
-            /* RFC4253 section 6.1 Maximum Packet Length says:
-             *
-             * "All implementations MUST be able to process
-             * packets with uncompressed payload length of 32768
-             * bytes or less and total packet size of 35000 bytes
-             * or less (including length, padding length, payload,
-             * padding, and MAC.)."
-             */
-            if (total_num > LIBSSH2_PACKET_MAXPAYLOAD) {
-                return LIBSSH2_ERROR_OUT_OF_BOUNDARY;
-            }
+                /* init the data_num field to the number of bytes of
+                   the package read so far */
+                p->data_num = p->wptr - p->payload;
 
-            /* Get a packet handle put data into. We get one to
-               hold all data, including padding and MAC. */
-            p->payload = LIBSSH2_ALLOC(session, total_num);
-            if (!p->payload) {
-                return LIBSSH2_ERROR_ALLOC;
+                /* we already dealt with a blocksize worth of data */
+                numbytes -= blocksize;
             }
-            p->total_num = total_num;
-            /* init write pointer to start of payload buffer */
-            p->wptr = p->payload;
-
-            if (blocksize > 5) {
-                /* copy the data from index 5 to the end of
-                   the blocksize from the temporary buffer to
-                   the start of the decrypted buffer */
-                memcpy(p->wptr, &block[5], blocksize - 5);
-                p->wptr += blocksize - 5;       /* advance write pointer */
-            }
-
-            /* init the data_num field to the number of bytes of
-               the package read so far */
-            p->data_num = p->wptr - p->payload;
-
-            /* we already dealt with a blocksize worth of data */
-            numbytes -= blocksize;
         }
 
         /* how much there is left to add to the current payload
@@ -493,7 +1214,7 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             numbytes = remainpack;
         }
 
-        if (encrypted) {
+        if (encrypted && !aead && !etm) {
             /* At the end of the incoming stream, there is a MAC,
                and we don't want to decrypt that since we need it
                "raw". We MUST however decrypt the padding data
@@ -519,15 +1240,19 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                 }
             }
         } else {
-            /* unencrypted data should not be decrypted at all */
+            /* unencrypted data should not be decrypted at all, AEAD and
+               encrypt-then-MAC packets are decrypted as a whole in
+               fullpacket() */
             numdecrypt = 0;
         }
 
         /* if there are bytes to decrypt, do that */
         if (numdecrypt > 0) {
-            /* now decrypt the lot */
-            rc = decrypt(session, &p->buf[p->readidx], p->wptr, numdecrypt);
+            /* now decrypt the lot, straight into the payload buffer */
+            rc = decrypt(session, &p->buf[p->readidx], p->wptr, numdecrypt,
+                         0);
             if (rc != LIBSSH2_ERROR_NONE) {
+                LIBSSH2_FREE(session, p->payload);
                 p->total_num = 0;   /* no packet buffer available */
                 return rc;
             }
@@ -592,70 +1317,315 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     return LIBSSH2_ERROR_SOCKET_RECV; /* we never reach this point */
 }
 
-static int
-send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
-              size_t data_len, ssize_t *ret)
+/*
+ * oseg_retire
+ *
+ * Let the channels whose data packets went out have their share of the
+ * queue back
+ */
+static void
+oseg_retire(struct transportpacket *p)
+{
+    while (p->oseg_count) {
+        struct transport_oseg *seg = &p->osegs[p->oseg_first];
+
+        if (seg->end > p->obytes_out)
+            break;
+        if (seg->channel) {
+            seg->channel->tx_queued -= seg->len;
+            if (!seg->channel->tx_queued)
+                p->oweights -= CHANNEL_WEIGHT(seg->channel);
+        }
+        p->oseg_first = (p->oseg_first + 1) % p->oseg_size;
+        p->oseg_count--;
+    }
+}
+
+/*
+ * oseg_add
+ *
+ * Note the data packet of 'channel' that was just put last in the queue.
+ * Without memory for it, the packet just isn't counted.
+ */
+static void
+oseg_add(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel, size_t len)
 {
-    ssize_t rc;
-    ssize_t length;
     struct transportpacket *p = &session->packet;
+    struct transport_oseg *seg;
 
-    if (!p->olen) {
-        *ret = 0;
-        return LIBSSH2_ERROR_NONE;
+    if (p->oseg_count == p->oseg_size) {
+        size_t size = p->oseg_size ? p->oseg_size * 2 : 16;
+        struct transport_oseg *segs =
+            LIBSSH2_ALLOC(session, size * sizeof(struct transport_oseg));
+        size_t i;
+
+        if (!segs)
+            return;
+        for (i = 0; i < p->oseg_count; i++)
+            segs[i] = p->osegs[(p->oseg_first + i) % p->oseg_size];
+        if (p->osegs)
+            LIBSSH2_FREE(session, p->osegs);
+        p->osegs = segs;
+        p->oseg_size = size;
+        p->oseg_first = 0;
     }
 
-    /* send as much as possible of the existing packet */
-    if ((data != p->odata) || (data_len != p->olen)) {
-        /* When we are about to complete the sending of a packet, it is vital
-           that the caller doesn't try to send a new/different packet since
-           we don't add this one up until the previous one has been sent. To
-           make the caller really notice his/hers flaw, we return error for
-           this case */
-        return LIBSSH2_ERROR_BAD_USE;
+    seg = &p->osegs[(p->oseg_first + p->oseg_count) % p->oseg_size];
+    seg->channel = channel;
+    seg->end = p->obytes_in;
+    seg->len = len;
+    p->oseg_count++;
+    if (!channel->tx_queued)
+        p->oweights += CHANNEL_WEIGHT(channel);
+    channel->tx_queued += len;
+}
+
+/*
+ * transport_share
+ *
+ * Whether a data packet of 'len' bytes of 'channel' may join the queue while
+ * the socket is full. Every channel with packets in the queue is due a part
+ * of it by its weight, so the packets of one sending a lot can only hold up
+ * those of the others by so much, while a channel sending alone may fill
+ * all of it. One packet at a time is always let in.
+ */
+static int
+transport_share(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel,
+                size_t len)
+{
+    if (!channel->tx_queued)
+        return 1;
+
+    /* the channel is one of those counted in oweights */
+    return (channel->tx_queued + len) * session->packet.oweights <=
+        (libssh2_uint64_t)LIBSSH2_OUTQUEUE_MAX * CHANNEL_WEIGHT(channel);
+}
+
+/*
+ * _libssh2_transport_forget
+ *
+ * Stop counting the queued packets of a channel that is being freed
+ */
+void
+_libssh2_transport_forget(LIBSSH2_SESSION *session, LIBSSH2_CHANNEL *channel)
+{
+    struct transportpacket *p = &session->packet;
+    size_t i;
+
+    for (i = 0; i < p->oseg_count; i++) {
+        struct transport_oseg *seg =
+            &p->osegs[(p->oseg_first + i) % p->oseg_size];
+        if (seg->channel == channel)
+            seg->channel = NULL;
+    }
+    if (channel->tx_queued) {
+        p->oweights -= CHANNEL_WEIGHT(channel);
+        channel->tx_queued = 0;
     }
+    if (p->ochannel == channel)
+        p->ochannel = NULL;
+}
 
-    *ret = 1;                   /* set to make our parent return */
+/*
+ * send_pending
+ *
+ * Send what is left of the encrypted packets in outbuf, in as few send()
+ * calls as the socket takes them.
+ */
+static int
+send_pending(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    ssize_t rc;
+    size_t length = p->ototal_num - p->osent;
 
-    /* number of bytes left to send */
-    length = p->ototal_num - p->osent;
+    if (!length)
+        return LIBSSH2_ERROR_NONE;
+
+    if (session->flag.feed) {
+        /* they stay here until libssh2_session_feed_out() takes them */
+        session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+        return LIBSSH2_ERROR_EAGAIN;
+    }
 
     rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
                        LIBSSH2_SOCKET_SEND_FLAGS(session));
+    _libssh2_stats_io(session, 1, rc);
     if (rc < 0)
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %d bytes: %d", length, -rc);
+                       "Error sending %d bytes: %d", (int)length, (int)-rc);
     else {
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Sent %d/%d bytes at %p+%d", rc, length, p->outbuf,
-                       p->osent);
+                       "Sent %d/%d bytes at %p+%d", (int)rc, (int)length,
+                       p->outbuf, (int)p->osent);
         debugdump(session, "libssh2_transport_write send()",
                   &p->outbuf[p->osent], rc);
     }
 
-    if (rc == length) {
-        /* the remainder of the package was sent */
+    if (rc > 0) {
+        p->obytes_out += rc;
+        oseg_retire(p);
+    }
+
+    if (rc == (ssize_t)length) {
+        /* all of it is out */
         p->ototal_num = 0;
-        p->olen = 0;
-        /* we leave *ret set so that the parent returns as we MUST return back
-           a send success now, so that we don't risk sending EAGAIN later
-           which then would confuse the parent function */
+        p->osent = 0;
+        p->oqueued = 0;
+        session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
         return LIBSSH2_ERROR_NONE;
-
     }
     else if (rc < 0) {
         /* nothing was sent */
         if (rc != -EAGAIN)
             /* send failure! */
             return LIBSSH2_ERROR_SOCKET_SEND;
+    }
+    else
+        p->osent += rc;         /* we sent away this much data */
 
-        session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-        return LIBSSH2_ERROR_EAGAIN;
+    session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+    return LIBSSH2_ERROR_EAGAIN;
+}
+
+/*
+ * _libssh2_transport_take
+ */
+size_t
+_libssh2_transport_take(LIBSSH2_SESSION *session, unsigned char *buffer,
+                        size_t length)
+{
+    struct transportpacket *p = &session->packet;
+    size_t n = p->ototal_num - p->osent;
+
+    if (n > length)
+        n = length;
+    if (!n)
+        return 0;
+
+    memcpy(buffer, &p->outbuf[p->osent], n);
+    debugdump(session, "libssh2_transport_write feed", buffer, n);
+    p->osent += n;
+    p->obytes_out += n;
+    oseg_retire(p);
+
+    if (p->osent == p->ototal_num) {
+        /* all of it is out */
+        p->ototal_num = 0;
+        p->osent = 0;
+        p->oqueued = 0;
+        session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
     }
+    return n;
+}
 
-    p->osent += rc;         /* we sent away this much data */
+static int
+send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
+              size_t data_len, ssize_t *ret)
+{
+    int rc;
+    struct transportpacket *p = &session->packet;
+
+    if (!p->olen) {
+        *ret = 0;
+        return LIBSSH2_ERROR_NONE;
+    }
 
-    return rc < length ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_NONE;
+    /* send as much as possible of the existing packet */
+    if ((data != p->odata) || (data_len != p->olen)) {
+        /* When we are about to complete the sending of a packet, it is vital
+           that the caller doesn't try to send a new/different packet since
+           we don't add this one up until the previous one has been sent. To
+           make the caller really notice his/hers flaw, we return error for
+           this case */
+        return LIBSSH2_ERROR_BAD_USE;
+    }
+
+    *ret = 1;                   /* set to make our parent return */
+
+    rc = send_pending(session);
+    if (rc == LIBSSH2_ERROR_NONE)
+        /* the remainder of the package was sent. we leave *ret set so that
+           the parent returns as we MUST return back a send success now, so
+           that we don't risk sending EAGAIN later which then would confuse
+           the parent function */
+        p->olen = 0;
+
+    return rc;
+}
+
+/*
+ * _libssh2_transport_flush
+ *
+ * Send the packets that corked channel writes left in the output buffer.
+ * Returns LIBSSH2_ERROR_EAGAIN if not all of them could be sent yet.
+ */
+int _libssh2_transport_flush(LIBSSH2_SESSION *session)
+{
+    /* a packet whose sender got EAGAIN stays owned by it: once it is out,
+       the sender's retry finds nothing left and returns success */
+    return send_pending(session);
+}
+
+/*
+ * outbuf_reserve
+ *
+ * Make sure the output buffer holds at least 'len' bytes. It starts out at
+ * MAX_SSH_PACKET_LEN and only grows for the larger packets that channels
+ * with a bigger negotiated packet size produce, or to hold the packets of
+ * corked writes. Packets pending in the buffer are kept.
+ */
+static int
+outbuf_reserve(LIBSSH2_SESSION *session, size_t len)
+{
+    struct transportpacket *p = &session->packet;
+    unsigned char *buf;
+
+    if (len <= p->outbuf_size)
+        return LIBSSH2_ERROR_NONE;
+    if (len < MAX_SSH_PACKET_LEN)
+        len = MAX_SSH_PACKET_LEN;
+
+    buf = LIBSSH2_REALLOC(session, p->outbuf, len);
+    if (!buf)
+        return LIBSSH2_ERROR_ALLOC;
+    p->outbuf = buf;
+    p->outbuf_size = len;
+    return LIBSSH2_ERROR_NONE;
+}
+
+/*
+ * encrypt_packet
+ *
+ * Encrypt outbuf[start, packet_length). If 'direct' is set, the 'direct_len'
+ * bytes at outbuf[direct_off] were never copied there and get encrypted
+ * straight out of 'direct' instead. Returns non-zero on failure.
+ */
+static int
+encrypt_packet(LIBSSH2_SESSION *session, unsigned char *outbuf, size_t start,
+               size_t packet_length, const unsigned char *direct,
+               size_t direct_off, size_t direct_len)
+{
+    const LIBSSH2_CRYPT_METHOD *crypt = session->local.crypt;
+    void **abstract = &session->local.crypt_abstract;
+    size_t direct_end = direct_off + direct_len;
+    libssh2_uint64_t stats_start = STATS_START(session);
+    int rc;
+
+    if (!direct)
+        rc = crypt->crypt(session, outbuf + start, packet_length - start,
+                          abstract);
+    else
+        /* all three parts are whole blocks, so the cipher state carries on
+           from one call to the next just like with a single call */
+        rc = crypt->crypt(session, outbuf + start, direct_off - start,
+                          abstract) ||
+            crypt->crypt_to(session, direct, outbuf + direct_off, direct_len,
+                            abstract) ||
+            crypt->crypt(session, outbuf + direct_end,
+                         packet_length - direct_end, abstract);
+    STATS_STOP(session, crypt_us, stats_start);
+    return rc;
 }
 
 /*
@@ -666,13 +1636,20 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
  *
  * The data is provided as _two_ data areas that are combined by this
  * function.  The 'data' part is sent immediately before 'data2'. 'data2' may
- * be set to NULL to only use a single part.
+ * be set to NULL to only use a single part. 'data' is meant for a message
+ * header and 'data2' for a payload: when the cipher allows it, the bulk of
+ * 'data2' is encrypted straight from the caller's buffer instead of being
+ * copied into the output buffer first.
  *
- * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
- * not sent yet. If it does so, the caller should call this function again as
- * soon as it is likely that more data can be sent, and this function MUST
- * then be called with the same argument set (same data pointer and same
- * data_len) until ERROR_NONE or failure is returned.
+ * Returns LIBSSH2_ERROR_EAGAIN if the socket doesn't take all of the
+ * packet. With LIBSSH2_FLAG_SEND_QUEUE set, or LIBSSH2_FLAG_FEED, what the
+ * socket does not take right away is queued in the output buffer instead,
+ * behind any packets already waiting there, and sent ahead of the next
+ * packet. Then LIBSSH2_ERROR_EAGAIN is only returned once more than
+ * LIBSSH2_OUTQUEUE_MAX bytes wait. If it is returned, the caller should call
+ * this function again as soon as it is likely that more data can be sent, and
+ * this function MUST then be called with the same argument set (same data
+ * pointer and same data_len) until ERROR_NONE or failure is returned.
  *
  * This function DOES NOT call _libssh2_error() on any errors.
  */
@@ -692,11 +1669,22 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 #endif
     struct transportpacket *p = &session->packet;
     int encrypted;
+    int aead;
+    int etm;
     int compressed;
     ssize_t ret;
     int rc;
     const unsigned char *orgdata = data;
     size_t orgdata_len = data_len;
+    /* the part of data2 that is not copied into the output buffer */
+    const unsigned char *direct = NULL;
+    size_t direct_off = 0;
+    size_t direct_len = 0;
+    /* where in outbuf this packet is built, after the ones still waiting
+       to be sent */
+    size_t base;
+    unsigned char *out;
+    libssh2_uint64_t stats_start;
 
     /*
      * If the last read operation was interrupted in the middle of a key
@@ -705,6 +1693,13 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
      *
      * See the similar block in _libssh2_transport_read for more details.
      */
+    if (session->rekey_due) {
+        /* packets already queued go out ahead of our KEXINIT */
+        rc = rekey_start(session);
+        if (rc)
+            return rc;
+    }
+
     if (session->state & LIBSSH2_STATE_EXCHANGING_KEYS &&
         !(session->state & LIBSSH2_STATE_KEX_ACTIVE)) {
         /* Don't write any new packets if we're still in the middle of a key
@@ -732,7 +1727,29 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
         /* set by send_existing if data was sent */
         return rc;
 
+    if (p->ochannel && !p->cork && (p->ototal_num > p->osent)) {
+        /* the socket was full. What it takes now no longer counts, and a
+           channel past its share has to wait for its own packets to go */
+        rc = send_pending(session);
+        if ((rc == LIBSSH2_ERROR_EAGAIN) &&
+            !transport_share(session, p->ochannel, data_len + data2_len))
+            return rc;
+        else if (rc && (rc != LIBSSH2_ERROR_EAGAIN))
+            return rc;
+    }
+
+    if (p->osent) {
+        /* move what is left of the queued packets to the front */
+        memmove(p->outbuf, &p->outbuf[p->osent], p->ototal_num - p->osent);
+        p->ototal_num -= (int)p->osent;
+        p->osent = 0;
+    }
+    base = p->ototal_num;
+
     encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
+    aead = encrypted &&
+        (session->local.crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD);
+    etm = encrypted && session->local.mac->etm;
 
     compressed =
         session->local.comp != NULL &&
@@ -744,12 +1761,26 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
         /* the idea here is that these function must fail if the output gets
            larger than what fits in the assigned buffer so thus they don't
            check the input size as we don't know how much it compresses */
-        size_t dest_len = MAX_SSH_PACKET_LEN-5-256;
-        size_t dest2_len = dest_len;
+        size_t dest_len;
+        size_t dest2_len;
+        /* room for data that does not compress at all */
+        size_t need = data_len + data2_len;
+
+        need += need / 64 + 0x100;
+        if (need > MAX_SSH_PACKET_LIMIT)
+            need = MAX_SSH_PACKET_LIMIT;
+        rc = outbuf_reserve(session, base + need);
+        if (rc)
+            return rc;
+
+        out = p->outbuf + base;
+        dest_len = p->outbuf_size-base-5-256;
+        dest2_len = dest_len;
 
         /* compress directly to the target buffer */
+        stats_start = STATS_START(session);
         rc = session->local.comp->comp(session,
-                                       &p->outbuf[5], &dest_len,
+                                       &out[5], &dest_len,
                                        data, data_len,
                                        &session->local.comp_abstract);
         if(rc)
@@ -761,27 +1792,40 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             dest2_len -= dest_len;
 
             rc = session->local.comp->comp(session,
-                                           &p->outbuf[5+dest_len], &dest2_len,
+                                           &out[5+dest_len], &dest2_len,
                                            data2, data2_len,
                                            &session->local.comp_abstract);
         }
         else
             dest2_len = 0;
+        STATS_STOP(session, comp_us, stats_start);
         if(rc)
             return rc;     /* compression failure */
 
         data_len = dest_len + dest2_len; /* use the combined length */
     }
     else {
-        if((data_len + data2_len) >= (MAX_SSH_PACKET_LEN-0x100))
+        if((data_len + data2_len) >= (MAX_SSH_PACKET_LIMIT-0x100))
             /* too large packet, return error for this until we make this
                function split it up and send multiple SSH packets */
             return LIBSSH2_ERROR_INVAL;
 
+        rc = outbuf_reserve(session, base + data_len + data2_len + 0x100);
+        if (rc)
+            return rc;
+        out = p->outbuf + base;
+
         /* copy the payload data */
-        memcpy(&p->outbuf[5], data, data_len);
-        if(data2 && data2_len)
-            memcpy(&p->outbuf[5+data_len], data2, data2_len);
+        memcpy(&out[5], data, data_len);
+        if(data2 && data2_len) {
+            if(encrypted && !aead && session->local.crypt->crypt_to) {
+                /* what gets copied is decided once the padding is known */
+                direct = data2;
+                direct_off = 5 + data_len;
+            }
+            else
+                memcpy(&out[5+data_len], data2, data2_len);
+        }
         data_len += data2_len; /* use the combined length */
     }
 
@@ -799,8 +1843,10 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     /* at this point we have it all except the padding */
 
     /* first figure out our minimum padding amount to make it an even
-       block size */
-    padding_length = blocksize - (packet_length % blocksize);
+       block size. AEAD ciphers and encrypt-then-MAC leave the
+       packet_length field out of the encrypted blocks. */
+    padding_length = blocksize - ((packet_length - ((aead || etm) ? 4 : 0)) %
+                                  blocksize);
 
     /* if the padding becomes too small we add another blocksize worth
        of it (taken from the original libssh2 where it didn't have any
@@ -821,71 +1867,163 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     packet_length += padding_length;
 
-    /* append the MAC length to the total_length size */
-    total_length =
-        packet_length + (encrypted ? session->local.mac->mac_len : 0);
+    if (direct) {
+        /* Only the whole cipher blocks within data2 are encrypted from the
+           caller's buffer. The bytes before and after them share blocks
+           with the header or the padding and are copied as usual. */
+        size_t start = etm ? 4 : 0;
+        size_t data2_end = direct_off + data2_len;
+        size_t first = start + ((direct_off - start + blocksize - 1) /
+                                blocksize) * blocksize;
+        size_t last = start + ((data2_end - start) / blocksize) * blocksize;
+
+        if (last > first) {
+            memcpy(&out[direct_off], data2, first - direct_off);
+            memcpy(&out[last], data2 + (last - direct_off),
+                   data2_end - last);
+            direct = data2 + (first - direct_off);
+            direct_off = first;
+            direct_len = last - first;
+        }
+        else {
+            memcpy(&out[direct_off], data2, data2_len);
+            direct = NULL;
+        }
+    }
+
+    /* append the MAC or authentication tag length to the total_length
+       size */
+    total_length = packet_length;
+    if (aead)
+        total_length += session->local.crypt->auth_len;
+    else if (encrypted)
+        total_length += session->local.mac->mac_len;
 
     /* store packet_length, which is the size of the whole packet except
        the MAC and the packet_length field itself */
-    _libssh2_htonu32(p->outbuf, packet_length - 4);
+    _libssh2_htonu32(out, packet_length - 4);
     /* store padding_length */
-    p->outbuf[4] = (unsigned char)padding_length;
+    out[4] = (unsigned char)padding_length;
 
     /* fill the padding area with random junk */
-    _libssh2_random(p->outbuf + 5 + data_len, padding_length);
+    _libssh2_random(out + 5 + data_len, padding_length);
+
+    if (aead) {
+        /* Encrypt and authenticate everything after the packet_length
+           field in one pass. The tag goes where the MAC would be. */
+        stats_start = STATS_START(session);
+        rc = session->local.crypt->aead_crypt(session, session->local.seqno,
+                                              out, out + 4,
+                                              packet_length - 4,
+                                              out + packet_length,
+                                              &session->local.crypt_abstract);
+        STATS_STOP(session, crypt_us, stats_start);
+        if (rc)
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
+    }
+    else if (etm) {
+        /* Encrypt everything after the packet_length field, then
+           calculate the MAC over the packet as it goes out on the wire */
+        if (encrypt_packet(session, out, 4, packet_length,
+                           direct, direct_off, direct_len))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
+
+        stats_start = STATS_START(session);
+        session->local.mac->hash(session, out + packet_length,
+                                 session->local.seqno, out,
+                                 packet_length, NULL, 0, NULL, 0,
+                                 &session->local.mac_abstract);
+        STATS_STOP(session, mac_us, stats_start);
+    }
+    else if (encrypted) {
+        /* MAC and encrypt the packet with the kernel picked for the keys.
+           The MAC goes at index packet_length, since that size includes
+           the whole packet. */
+        if (KERNEL(&session->local)->seal(session, out, packet_length,
+                                          direct, direct_off, direct_len))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
+    }
+
+    session->local.seqno++;
+    session->stats.packets_sent++;
+    _libssh2_event(session, LIBSSH2_EVENT_PACKET_SENT, 0,
+                   session->local.seqno - 1, orgdata[0],
+                   orgdata_len + data2_len);
+    p->ototal_num += total_length;
+    p->obytes_in += total_length;
+    if (p->ochannel)
+        oseg_add(session, p->ochannel, total_length);
 
     if (encrypted) {
-        size_t i;
+        session->local.rekey_bytes += total_length;
+        session->local.rekey_packets++;
+        if (rekey_limit_hit(session, &session->local))
+            session->rekey_due = 1;
+    }
 
-        /* Calculate MAC hash. Put the output at index packet_length,
-           since that size includes the whole packet. The MAC is
-           calculated on the entire unencrypted packet, including all
-           fields except the MAC field itself. */
-        session->local.mac->hash(session, p->outbuf + packet_length,
-                                 session->local.seqno, p->outbuf,
-                                 packet_length, NULL, 0,
-                                 &session->local.mac_abstract);
+    if (p->cork && (p->ototal_num < LIBSSH2_CORK_MAX))
+        /* leave it for a later packet or _libssh2_transport_flush() to
+           send along */
+        return LIBSSH2_ERROR_NONE;
 
-        /* Encrypt the whole packet data, one block size at a time.
-           The MAC field is not encrypted. */
-        for(i = 0; i < packet_length; i += session->local.crypt->blocksize) {
-            unsigned char *ptr = &p->outbuf[i];
-            if (session->local.crypt->crypt(session, ptr,
-                                            session->local.crypt->blocksize,
-                                            &session->local.crypt_abstract))
-                return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
-        }
+    rc = send_pending(session);
+    if ((rc == LIBSSH2_ERROR_EAGAIN) &&
+        (!(session->flag.send_queue || session->flag.feed) ||
+         (p->ototal_num - p->osent > LIBSSH2_OUTQUEUE_MAX))) {
+        /* not queueing, or the queue is full: the caller has to wait until
+           the rest of this packet got sent. Returning success would leave
+           it to a later call to push it out, which an application that
+           only waits for the socket to become readable never makes. */
+        p->odata = orgdata;
+        p->olen = orgdata_len;
+        return rc;
     }
 
-    session->local.seqno++;
-
-    ret = LIBSSH2_SEND(session, p->outbuf, total_length,
-                        LIBSSH2_SOCKET_SEND_FLAGS(session));
-    if (ret < 0)
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Error sending %d bytes: %d", total_length, -ret);
-    else {
-        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET, "Sent %d/%d bytes at %p",
-                       ret, total_length, p->outbuf);
-        debugdump(session, "libssh2_transport_write send()", p->outbuf, ret);
-    }
-
-    if (ret != total_length) {
-        if (ret >= 0 || ret == -EAGAIN) {
-            /* the whole packet could not be sent, save the rest */
-            session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
-            p->odata = orgdata;
-            p->olen = orgdata_len;
-            p->osent = ret <= 0 ? 0 : ret;
-            p->ototal_num = total_length;
-            return LIBSSH2_ERROR_EAGAIN;
-        }
-        return LIBSSH2_ERROR_SOCKET_SEND;
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        /* what the socket did not take is sent ahead of the next packet, or
+           by the next _libssh2_transport_read() */
+        p->oqueued = 1;
+        return LIBSSH2_ERROR_NONE;
     }
+    return rc;
+}
 
-    /* the whole thing got sent away */
-    p->odata = NULL;
-    p->olen = 0;
+/*
+ * _libssh2_transport_threads
+ *
+ * Set the number of worker threads that check incoming MACs ahead of time,
+ * 0 stops them
+ */
+int
+_libssh2_transport_threads(LIBSSH2_SESSION *session, int threads)
+{
+#ifdef LIBSSH2_THREADS
+    struct transport_ahead *a = session->crypto_ahead;
+
+    if (a) {
+        ahead_drain(a);
+        ahead_clear_macs(a);
+        _libssh2_pool_free(a->pool);
+        LIBSSH2_FREE(session, a);
+        session->crypto_ahead = NULL;
+    }
+    if (threads <= 0)
+        return 0;
+
+    a = LIBSSH2_CALLOC(session, sizeof(struct transport_ahead));
+    if (!a)
+        return LIBSSH2_ERROR_ALLOC;
+    a->session = session;
+    a->pool = _libssh2_pool_init(session, threads);
+    if (!a->pool) {
+        LIBSSH2_FREE(session, a);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+    session->crypto_ahead = a;
 
-    return LIBSSH2_ERROR_NONE;         /* all is good */
+    return 0;
+#else
+    (void)session;
+    return threads > 0 ? LIBSSH2_ERROR_METHOD_NOT_SUPPORTED : 0;
+#endif
 }
@@ -55,8 +55,13 @@
  * function.  The 'data' part is sent immediately before 'data2'. 'data2' can
  * be set to NULL (or data2_len to 0) to only use a single part.
  *
- * Returns LIBSSH2_ERROR_EAGAIN if it would block or if the whole packet was
- * not sent yet. If it does so, the caller should call this function again as
+ * Packets the socket does not take right away are queued, up to
+ * LIBSSH2_OUTQUEUE_MAX bytes, and sent ahead of the next packet.
+ *
+ * Returns LIBSSH2_ERROR_EAGAIN if it would block and the queue is full, or
+ * if the socket is full and the data packet of 'session->packet.ochannel'
+ * would take that channel past its share of the queue. If it
+ * does so, the caller should call this function again as
  * soon as it is likely that more data can be sent, and this function MUST
  * then be called with the same argument set (same data pointer and same
  * data_len) until ERROR_NONE or failure is returned.
@@ -67,6 +72,14 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                             const unsigned char *data, size_t data_len,
                             const unsigned char *data2, size_t data2_len);
 
+/*
+ * _libssh2_transport_flush
+ *
+ * Send the packets still held in the output buffer, such as those of corked
+ * channel writes. Returns LIBSSH2_ERROR_EAGAIN if not all could be sent.
+ */
+int _libssh2_transport_flush(LIBSSH2_SESSION *session);
+
 /*
  * _libssh2_transport_read
  *
@@ -84,4 +97,41 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
  */
 int _libssh2_transport_read(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_transport_take
+ *
+ * Copy up to 'length' bytes of the packets waiting in the output buffer to
+ * 'buffer' and count them as sent. For LIBSSH2_FLAG_FEED, where they are
+ * not sent to a socket. Returns the number of bytes copied.
+ */
+size_t _libssh2_transport_take(LIBSSH2_SESSION *session,
+                               unsigned char *buffer, size_t length);
+
+/*
+ * _libssh2_transport_forget
+ *
+ * Stop counting the data packets of 'channel' still in the output buffer
+ * against its share of it. Called when the channel is freed.
+ */
+void _libssh2_transport_forget(LIBSSH2_SESSION *session,
+                               LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_transport_kernels
+ *
+ * Pick how the packets of each direction are sealed and opened, for the
+ * ciphers and MACs that were just set up. Called whenever new keys take
+ * effect.
+ */
+void _libssh2_transport_kernels(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_threads
+ *
+ * Set how many worker threads check the MACs of incoming packets, 0 to stop
+ * and free them. Returns LIBSSH2_ERROR_METHOD_NOT_SUPPORTED when libssh2 is
+ * built without thread support.
+ */
+int _libssh2_transport_threads(LIBSSH2_SESSION *session, int threads);
+
 #endif /* __LIBSSH2_TRANSPORT_H */
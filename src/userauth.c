@@ -52,6 +52,7 @@
 #include "transport.h"
 #include "session.h"
 #include "userauth.h"
+#include "thread.h"
 
 /* libssh2_userauth_list
  *
@@ -71,6 +72,11 @@ static char *userauth_list(LIBSSH2_SESSION *session, const char *username,
     unsigned char *s;
     int rc;
 
+    if (session->userauth_list_known &&
+        (session->userauth_list_state == libssh2_NB_state_idle))
+        /* no need for a round trip to the server */
+        return session->userauth_list_known;
+
     if (session->userauth_list_state == libssh2_NB_state_idle) {
         /* Zero the whole thing out */
         memset(&session->userauth_list_packet_requirev_state, 0,
@@ -175,6 +181,33 @@ libssh2_userauth_list(LIBSSH2_SESSION * session, const char *user,
     return ptr;
 }
 
+/* libssh2_userauth_list_set
+ *
+ * Tell the session which authentication methods the server allows, known
+ * from an earlier session, so that libssh2_userauth_list() doesn't ask
+ */
+LIBSSH2_API int
+libssh2_userauth_list_set(LIBSSH2_SESSION *session, const char *methods,
+                          unsigned int methods_len)
+{
+    char *known = NULL;
+
+    if (methods) {
+        known = LIBSSH2_ALLOC(session, methods_len + 1);
+        if (!known)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "userauth list");
+        memcpy(known, methods, methods_len);
+        known[methods_len] = '\0';
+    }
+
+    if (session->userauth_list_known)
+        LIBSSH2_FREE(session, session->userauth_list_known);
+    session->userauth_list_known = known;
+    return 0;
+}
+
 /*
  * libssh2_userauth_authenticated
  *
@@ -613,6 +646,65 @@ file_read_publickey(LIBSSH2_SESSION * session, unsigned char **method,
     return 0;
 }
 
+/*
+ * openssh_read_publickey
+ *
+ * An "openssh-key-v1" private key carries its public key in the clear, so
+ * no crypto backend is needed to get it. Exactly one of privkeyfile and
+ * privkeyfiledata is given.
+ *
+ * Returns 1 when the private key is in some other format, 0 with the method
+ * and key allocated as file_read_publickey() does, or an error.
+ */
+static int
+openssh_read_publickey(LIBSSH2_SESSION * session, unsigned char **method,
+                       size_t *method_len,
+                       unsigned char **pubkeydata,
+                       size_t *pubkeydata_len,
+                       const char *privkeyfile,
+                       const char *privkeyfiledata,
+                       size_t privkeyfiledata_len)
+{
+    struct _libssh2_openssh_key key;
+    int rc;
+
+    if (privkeyfile) {
+        FILE *fp = fopen(privkeyfile, "r");
+        if (!fp)
+            return 1;
+        rc = _libssh2_openssh_pem_parse(session, fp, &key);
+        fclose(fp);
+    }
+    else
+        rc = _libssh2_openssh_pem_parse_memory(session, privkeyfiledata,
+                                               privkeyfiledata_len, &key);
+    if (rc)
+        return 1;
+
+    _libssh2_debug(session, LIBSSH2_TRACE_AUTH,
+                   "Public key taken from OpenSSH private key");
+
+    *method = LIBSSH2_ALLOC(session, key.type_len);
+    *pubkeydata = LIBSSH2_ALLOC(session, key.pubkey_len);
+    if (!*method || !*pubkeydata) {
+        if (*method)
+            LIBSSH2_FREE(session, *method);
+        if (*pubkeydata)
+            LIBSSH2_FREE(session, *pubkeydata);
+        _libssh2_openssh_key_free(session, &key);
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for public key "
+                              "data");
+    }
+    memcpy(*method, key.type, key.type_len);
+    *method_len = key.type_len;
+    memcpy(*pubkeydata, key.pubkey, key.pubkey_len);
+    *pubkeydata_len = key.pubkey_len;
+
+    _libssh2_openssh_key_free(session, &key);
+    return 0;
+}
+
 static int
 memory_read_privatekey(LIBSSH2_SESSION * session,
                        const LIBSSH2_HOSTKEY_METHOD ** hostkey_method,
@@ -808,12 +900,18 @@ userauth_hostbased_fromfile(LIBSSH2_SESSION *session,
                 return rc;
         }
         else {
-            /* Compute public key from private key. */
-            rc = _libssh2_pub_priv_keyfile(session,
-                                           &session->userauth_host_method,
-                                           &session->userauth_host_method_len,
-                                           &pubkeydata, &pubkeydata_len,
-                                           privatekey, passphrase);
+            rc = openssh_read_publickey(session,
+                                        &session->userauth_host_method,
+                                        &session->userauth_host_method_len,
+                                        &pubkeydata, &pubkeydata_len,
+                                        privatekey, NULL, 0);
+            if (rc == 1)
+                /* Compute public key from private key. */
+                rc = _libssh2_pub_priv_keyfile(session,
+                                               &session->userauth_host_method,
+                                               &session->userauth_host_method_len,
+                                               &pubkeydata, &pubkeydata_len,
+                                               privatekey, passphrase);
             if (rc)
                 /* libssh2_pub_priv_keyfile calls _libssh2_error() */
                 return rc;
@@ -1140,7 +1238,14 @@ _libssh2_userauth_publickey(LIBSSH2_SESSION *session,
         _libssh2_debug(session, LIBSSH2_TRACE_AUTH,
                        "Attempting publickey authentication");
 
-        session->userauth_pblc_state = libssh2_NB_state_created;
+        if (session->flag.publickey_direct) {
+            /* the key is known to be accepted, it is signed right away
+               instead of asking the server first */
+            *session->userauth_pblc_b = 0x01;
+            session->userauth_pblc_state = libssh2_NB_state_sent1;
+        }
+        else
+            session->userauth_pblc_state = libssh2_NB_state_created;
     }
 
     if (session->userauth_pblc_state == libssh2_NB_state_created) {
@@ -1226,26 +1331,40 @@ _libssh2_userauth_publickey(LIBSSH2_SESSION *session,
         unsigned char *sig;
         size_t sig_len;
 
-        s = buf = LIBSSH2_ALLOC(session, 4 + session->session_id_len
-                                + session->userauth_pblc_packet_len);
-        if (!buf) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "userauth-publickey signed data");
-        }
+        if (!session->userauth_pblc_sign) {
+            /* a callback that returns EAGAIN gets the very same data again
+               when it is called next, it may hold on to it meanwhile */
+            s = buf = LIBSSH2_ALLOC(session, 4 + session->session_id_len
+                                    + session->userauth_pblc_packet_len);
+            if (!buf) {
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "Unable to allocate memory for "
+                                      "userauth-publickey signed data");
+            }
+
+            _libssh2_store_str(&s, (const char *)session->session_id,
+                               session->session_id_len);
 
-        _libssh2_store_str(&s, (const char *)session->session_id,
-                           session->session_id_len);
+            memcpy (s, session->userauth_pblc_packet,
+                    session->userauth_pblc_packet_len);
+            s += session->userauth_pblc_packet_len;
 
-        memcpy (s, session->userauth_pblc_packet,
-                session->userauth_pblc_packet_len);
-        s += session->userauth_pblc_packet_len;
+            session->userauth_pblc_sign = buf;
+            session->userauth_pblc_sign_len = s - buf;
+        }
 
-        rc = sign_callback(session, &sig, &sig_len, buf, s - buf, abstract);
-        LIBSSH2_FREE(session, buf);
+        rc = sign_callback(session, &sig, &sig_len,
+                           session->userauth_pblc_sign,
+                           session->userauth_pblc_sign_len, abstract);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
+            /* the signature is made elsewhere, there is nothing to wait for
+               on the socket until it is done */
+            session->socket_block_directions = 0;
             return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN, "Would block");
-        } else if (rc) {
+        }
+        LIBSSH2_FREE(session, session->userauth_pblc_sign);
+        session->userauth_pblc_sign = NULL;
+        if (rc) {
             LIBSSH2_FREE(session, session->userauth_pblc_method);
             session->userauth_pblc_method = NULL;
             LIBSSH2_FREE(session, session->userauth_pblc_packet);
@@ -1391,16 +1510,26 @@ userauth_publickey_frommemory(LIBSSH2_SESSION *session,
                 return rc;
         }
         else if (privatekeydata_len && privatekeydata) {
-            /* Compute public key from private key. */
-            if (_libssh2_pub_priv_keyfilememory(session,
-                                                &session->userauth_pblc_method,
-                                                &session->userauth_pblc_method_len,
-                                                &pubkeydata, &pubkeydata_len,
-                                                privatekeydata, privatekeydata_len,
-                                                passphrase))
-                return _libssh2_error(session, LIBSSH2_ERROR_FILE,
-                                      "Unable to extract public key "
-                                      "from private key.");
+            rc = openssh_read_publickey(session,
+                                        &session->userauth_pblc_method,
+                                        &session->userauth_pblc_method_len,
+                                        &pubkeydata, &pubkeydata_len,
+                                        NULL, privatekeydata,
+                                        privatekeydata_len);
+            if (rc == 1) {
+                /* Compute public key from private key. */
+                if (_libssh2_pub_priv_keyfilememory(session,
+                                                    &session->userauth_pblc_method,
+                                                    &session->userauth_pblc_method_len,
+                                                    &pubkeydata, &pubkeydata_len,
+                                                    privatekeydata, privatekeydata_len,
+                                                    passphrase))
+                    return _libssh2_error(session, LIBSSH2_ERROR_FILE,
+                                          "Unable to extract public key "
+                                          "from private key.");
+            }
+            else if (rc)
+                return rc;
         }
         else {
             return _libssh2_error(session, LIBSSH2_ERROR_FILE,
@@ -1447,12 +1576,18 @@ userauth_publickey_fromfile(LIBSSH2_SESSION *session,
                 return rc;
         }
         else {
-            /* Compute public key from private key. */
-            rc = _libssh2_pub_priv_keyfile(session,
-                                           &session->userauth_pblc_method,
-                                           &session->userauth_pblc_method_len,
-                                           &pubkeydata, &pubkeydata_len,
-                                           privatekey, passphrase);
+            rc = openssh_read_publickey(session,
+                                        &session->userauth_pblc_method,
+                                        &session->userauth_pblc_method_len,
+                                        &pubkeydata, &pubkeydata_len,
+                                        privatekey, NULL, 0);
+            if (rc == 1)
+                /* Compute public key from private key. */
+                rc = _libssh2_pub_priv_keyfile(session,
+                                               &session->userauth_pblc_method,
+                                               &session->userauth_pblc_method_len,
+                                               &pubkeydata, &pubkeydata_len,
+                                               privatekey, passphrase);
 
             /* _libssh2_pub_priv_keyfile calls _libssh2_error() */
             if (rc)
@@ -1549,6 +1684,234 @@ libssh2_userauth_publickey(LIBSSH2_SESSION *session,
 
 
 
+/* A key pair loaded once to authenticate any number of sessions with */
+struct _LIBSSH2_USERAUTH_KEY
+{
+    LIBSSH2_SESSION *session;   /* the key's own, it allocated all below */
+    unsigned char *method;
+    size_t method_len;
+    unsigned char *pubkeydata;
+    size_t pubkeydata_len;
+    const LIBSSH2_HOSTKEY_METHOD *hostkey;
+    void *abstract;             /* the crypto backend's private key */
+#ifdef LIBSSH2_THREADS
+    /* crypto backends are not all fine with signing with the same key from
+       two threads at once */
+    pthread_mutex_t lock;
+#endif
+};
+
+static void
+userauth_key_free(LIBSSH2_USERAUTH_KEY *key)
+{
+    LIBSSH2_SESSION *session = key->session;
+
+    if (key->hostkey && key->hostkey->dtor)
+        key->hostkey->dtor(session, &key->abstract);
+    if (key->method)
+        LIBSSH2_FREE(session, key->method);
+    if (key->pubkeydata)
+        LIBSSH2_FREE(session, key->pubkeydata);
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_destroy(&key->lock);
+#endif
+    LIBSSH2_FREE(session, key);
+    libssh2_session_free(session);
+}
+
+/*
+ * userauth_key_load
+ *
+ * Makes a key and reads its public half the way the _fromfile and
+ * _frommemory functions do: from the public key if given, else out of the
+ * private key. Exactly one of privatekey and privatekeydata is given.
+ */
+static int
+userauth_key_load(LIBSSH2_USERAUTH_KEY **keyp,
+                  const char *publickey,
+                  const char *publickeydata, size_t publickeydata_len,
+                  const char *privatekey,
+                  const char *privatekeydata, size_t privatekeydata_len,
+                  const char *passphrase)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_USERAUTH_KEY *key;
+    int rc;
+
+    *keyp = NULL;
+
+    session = libssh2_session_init();
+    if (!session)
+        return LIBSSH2_ERROR_ALLOC;
+
+    key = LIBSSH2_CALLOC(session, sizeof *key);
+    if (!key) {
+        libssh2_session_free(session);
+        return LIBSSH2_ERROR_ALLOC;
+    }
+    key->session = session;
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_init(&key->lock, NULL);
+#endif
+
+    if(NULL == passphrase)
+        passphrase="";
+
+    if (publickey)
+        rc = file_read_publickey(session, &key->method, &key->method_len,
+                                 &key->pubkeydata, &key->pubkeydata_len,
+                                 publickey);
+    else if (publickeydata_len && publickeydata)
+        rc = memory_read_publickey(session, &key->method, &key->method_len,
+                                   &key->pubkeydata, &key->pubkeydata_len,
+                                   publickeydata, publickeydata_len);
+    else {
+        rc = openssh_read_publickey(session, &key->method, &key->method_len,
+                                    &key->pubkeydata, &key->pubkeydata_len,
+                                    privatekey, privatekeydata,
+                                    privatekeydata_len);
+        if (rc == 1) {
+            /* Compute public key from private key. */
+            if (privatekey)
+                rc = _libssh2_pub_priv_keyfile(session, &key->method,
+                                               &key->method_len,
+                                               &key->pubkeydata,
+                                               &key->pubkeydata_len,
+                                               privatekey, passphrase);
+            else
+                rc = _libssh2_pub_priv_keyfilememory(session, &key->method,
+                                                     &key->method_len,
+                                                     &key->pubkeydata,
+                                                     &key->pubkeydata_len,
+                                                     privatekeydata,
+                                                     privatekeydata_len,
+                                                     passphrase);
+            if (rc)
+                rc = LIBSSH2_ERROR_FILE;
+        }
+    }
+
+    if (!rc) {
+        if (privatekey)
+            rc = file_read_privatekey(session, &key->hostkey, &key->abstract,
+                                      key->method, key->method_len,
+                                      privatekey, passphrase);
+        else
+            rc = memory_read_privatekey(session, &key->hostkey,
+                                        &key->abstract,
+                                        key->method, key->method_len,
+                                        privatekeydata, privatekeydata_len,
+                                        passphrase);
+    }
+
+    if (rc) {
+        /* a half read key may have left this behind */
+        if (!key->abstract)
+            key->hostkey = NULL;
+        userauth_key_free(key);
+        return rc;
+    }
+
+    *keyp = key;
+    return 0;
+}
+
+/* libssh2_userauth_key_fromfile
+ * Load a keypair found in the named files, to authenticate sessions with
+ */
+LIBSSH2_API int
+libssh2_userauth_key_fromfile(LIBSSH2_USERAUTH_KEY **key,
+                              const char *publickey,
+                              const char *privatekey,
+                              const char *passphrase)
+{
+    if (!key || !privatekey)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    return userauth_key_load(key, publickey, NULL, 0, privatekey, NULL, 0,
+                             passphrase);
+}
+
+/* libssh2_userauth_key_frommemory
+ * Load a keypair from memory, to authenticate sessions with
+ */
+LIBSSH2_API int
+libssh2_userauth_key_frommemory(LIBSSH2_USERAUTH_KEY **key,
+                                const char *publickeyfiledata,
+                                size_t publickeyfiledata_len,
+                                const char *privatekeyfiledata,
+                                size_t privatekeyfiledata_len,
+                                const char *passphrase)
+{
+    if (!key || !privatekeyfiledata || !privatekeyfiledata_len)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    return userauth_key_load(key, NULL, publickeyfiledata,
+                             publickeyfiledata_len, NULL,
+                             privatekeyfiledata, privatekeyfiledata_len,
+                             passphrase);
+}
+
+/* libssh2_userauth_key_free
+ * Free a loaded keypair
+ */
+LIBSSH2_API void
+libssh2_userauth_key_free(LIBSSH2_USERAUTH_KEY *key)
+{
+    if (key)
+        userauth_key_free(key);
+}
+
+static int
+sign_fromkey(LIBSSH2_SESSION *session, unsigned char **sig, size_t *sig_len,
+             const unsigned char *data, size_t data_len, void **abstract)
+{
+    LIBSSH2_USERAUTH_KEY *key = (LIBSSH2_USERAUTH_KEY *) (*abstract);
+    struct iovec datavec;
+    int rc;
+
+    libssh2_prepare_iovec(&datavec, 1);
+    datavec.iov_base = (void *)data;
+    datavec.iov_len  = data_len;
+
+    /* the signature is allocated with the session that authenticates */
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_lock(&key->lock);
+#endif
+    rc = key->hostkey->signv(session, sig, sig_len, 1, &datavec,
+                             &key->abstract);
+#ifdef LIBSSH2_THREADS
+    pthread_mutex_unlock(&key->lock);
+#endif
+
+    return rc ? -1 : 0;
+}
+
+/* libssh2_userauth_publickey_key
+ * Authenticate using a keypair loaded before
+ */
+LIBSSH2_API int
+libssh2_userauth_publickey_key(LIBSSH2_SESSION *session,
+                               const char *user,
+                               size_t user_len,
+                               LIBSSH2_USERAUTH_KEY *key)
+{
+    void *abstract = key;
+    int rc;
+
+    if(!session || !key)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, session,
+                 _libssh2_userauth_publickey(session, user, user_len,
+                                             key->pubkeydata,
+                                             key->pubkeydata_len,
+                                             sign_fromkey, &abstract));
+    return rc;
+}
+
+
+
 /*
  * userauth_keyboard_interactive
  *
@@ -125,6 +125,10 @@
 #define BCRYPT_ALG_HANDLE_HMAC_FLAG 0x00000008
 #endif
 
+#ifndef BCRYPT_HASH_REUSABLE_FLAG
+#define BCRYPT_HASH_REUSABLE_FLAG 0x00000020
+#endif
+
 #ifndef BCRYPT_DSA_PUBLIC_BLOB
 #define BCRYPT_DSA_PUBLIC_BLOB L"DSAPUBLICBLOB"
 #endif
@@ -207,6 +211,23 @@
  * Windows CNG backend: Generic functions
  */
 
+static BOOL
+_libssh2_wincng_open_hmac(BCRYPT_ALG_HANDLE *phAlg, LPCWSTR pszAlgId)
+{
+    /* Reusable hash objects (Windows 8 and later) are back in their keyed
+       state after BCryptFinishHash, so the HMAC key setup is not redone
+       for every packet */
+    int ret = BCryptOpenAlgorithmProvider(phAlg, pszAlgId, NULL,
+                                          BCRYPT_ALG_HANDLE_HMAC_FLAG |
+                                          BCRYPT_HASH_REUSABLE_FLAG);
+    if (BCRYPT_SUCCESS(ret))
+        return TRUE;
+
+    (void)BCryptOpenAlgorithmProvider(phAlg, pszAlgId, NULL,
+                                      BCRYPT_ALG_HANDLE_HMAC_FLAG);
+    return FALSE;
+}
+
 void
 _libssh2_wincng_init(void)
 {
@@ -224,18 +245,15 @@ _libssh2_wincng_init(void)
     (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgHashSHA512,
                                       BCRYPT_SHA512_ALGORITHM, NULL, 0);
 
-    (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgHmacMD5,
-                                      BCRYPT_MD5_ALGORITHM, NULL,
-                                      BCRYPT_ALG_HANDLE_HMAC_FLAG);
-    (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgHmacSHA1,
-                                      BCRYPT_SHA1_ALGORITHM, NULL,
-                                      BCRYPT_ALG_HANDLE_HMAC_FLAG);
-    (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgHmacSHA256,
-                                      BCRYPT_SHA256_ALGORITHM, NULL,
-                                      BCRYPT_ALG_HANDLE_HMAC_FLAG);
-    (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgHmacSHA512,
-                                      BCRYPT_SHA512_ALGORITHM, NULL,
-                                      BCRYPT_ALG_HANDLE_HMAC_FLAG);
+    _libssh2_wincng.bHmacReusable =
+        _libssh2_wincng_open_hmac(&_libssh2_wincng.hAlgHmacMD5,
+                                  BCRYPT_MD5_ALGORITHM) &
+        _libssh2_wincng_open_hmac(&_libssh2_wincng.hAlgHmacSHA1,
+                                  BCRYPT_SHA1_ALGORITHM) &
+        _libssh2_wincng_open_hmac(&_libssh2_wincng.hAlgHmacSHA256,
+                                  BCRYPT_SHA256_ALGORITHM) &
+        _libssh2_wincng_open_hmac(&_libssh2_wincng.hAlgHmacSHA512,
+                                  BCRYPT_SHA512_ALGORITHM);
 
     (void)BCryptOpenAlgorithmProvider(&_libssh2_wincng.hAlgRSA,
                                       BCRYPT_RSA_ALGORITHM, NULL, 0);
@@ -443,6 +461,16 @@ _libssh2_wincng_hmac_final(_libssh2_wincng_hash_ctx *ctx,
     return BCRYPT_SUCCESS(ret) ? 0 : -1;
 }
 
+int
+_libssh2_wincng_hmac_reset(_libssh2_wincng_hash_ctx *ctx)
+{
+    (void)ctx;
+
+    /* only a reusable hash object can be used again after
+       BCryptFinishHash, the others have to be keyed again */
+    return _libssh2_wincng.bHmacReusable ? 0 : -1;
+}
+
 void
 _libssh2_wincng_hmac_cleanup(_libssh2_wincng_hash_ctx *ctx)
 {
@@ -1739,40 +1767,35 @@ _libssh2_wincng_cipher_crypt(_libssh2_cipher_ctx *ctx,
                              unsigned char *block,
                              size_t blocklen)
 {
-    unsigned char *pbOutput;
+    return _libssh2_wincng_cipher_crypt_to(ctx, type, encrypt,
+                                           block, block, blocklen);
+}
+
+int
+_libssh2_wincng_cipher_crypt_to(_libssh2_cipher_ctx *ctx,
+                                _libssh2_cipher_type(type),
+                                int encrypt,
+                                const unsigned char *src,
+                                unsigned char *dst,
+                                size_t len)
+{
     unsigned long cbOutput, cbInput;
     int ret;
 
     (void)type;
 
-    cbInput = (unsigned long)blocklen;
+    cbInput = (unsigned long)len;
 
+    /* No padding is requested and the length is always a multiple of the
+       block size, so CNG can work on the whole buffer, in place or not */
     if (encrypt) {
-        ret = BCryptEncrypt(ctx->hKey, block, cbInput, NULL,
-                            ctx->pbIV, ctx->dwIV, NULL, 0, &cbOutput, 0);
+        ret = BCryptEncrypt(ctx->hKey, (unsigned char *)src, cbInput, NULL,
+                            ctx->pbIV, ctx->dwIV,
+                            dst, cbInput, &cbOutput, 0);
     } else {
-        ret = BCryptDecrypt(ctx->hKey, block, cbInput, NULL,
-                            ctx->pbIV, ctx->dwIV, NULL, 0, &cbOutput, 0);
-    }
-    if (BCRYPT_SUCCESS(ret)) {
-        pbOutput = malloc(cbOutput);
-        if (pbOutput) {
-            if (encrypt) {
-                ret = BCryptEncrypt(ctx->hKey, block, cbInput, NULL,
-                                    ctx->pbIV, ctx->dwIV,
-                                    pbOutput, cbOutput, &cbOutput, 0);
-            } else {
-                ret = BCryptDecrypt(ctx->hKey, block, cbInput, NULL,
-                                    ctx->pbIV, ctx->dwIV,
-                                    pbOutput, cbOutput, &cbOutput, 0);
-            }
-            if (BCRYPT_SUCCESS(ret)) {
-                memcpy(block, pbOutput, cbOutput);
-            }
-
-            _libssh2_wincng_safe_free(pbOutput, cbOutput);
-        } else
-            ret = STATUS_NO_MEMORY;
+        ret = BCryptDecrypt(ctx->hKey, (unsigned char *)src, cbInput, NULL,
+                            ctx->pbIV, ctx->dwIV,
+                            dst, cbInput, &cbOutput, 0);
     }
 
     return BCRYPT_SUCCESS(ret) ? 0 : -1;
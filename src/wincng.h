@@ -56,6 +56,10 @@
 
 #define LIBSSH2_AES 1
 #define LIBSSH2_AES_CTR 0
+#define LIBSSH2_AES_GCM 0
+#define LIBSSH2_CHACHA20_POLY1305 0
+/* CNG runs AES on AES-NI where the CPU has it */
+#define LIBSSH2_ACCEL_BACKEND LIBSSH2_ACCEL_AES
 #define LIBSSH2_BLOWFISH 0
 #define LIBSSH2_RC4 1
 #define LIBSSH2_CAST 0
@@ -90,6 +94,7 @@ struct _libssh2_wincng_ctx {
     BCRYPT_ALG_HANDLE hAlgAES_CBC;
     BCRYPT_ALG_HANDLE hAlgRC4_NA;
     BCRYPT_ALG_HANDLE hAlg3DES_CBC;
+    BOOL bHmacReusable;
 };
 
 struct _libssh2_wincng_ctx _libssh2_wincng;
@@ -202,6 +207,8 @@ typedef struct __libssh2_wincng_hash_ctx {
   _libssh2_wincng_hash_update(&ctx, (unsigned char *) data, datalen)
 #define libssh2_hmac_final(ctx, hash) \
   _libssh2_wincng_hmac_final(&ctx, hash)
+#define libssh2_hmac_reset(ctx) \
+  _libssh2_wincng_hmac_reset(&ctx)
 #define libssh2_hmac_cleanup(ctx) \
   _libssh2_wincng_hmac_cleanup(ctx)
 
@@ -323,6 +330,8 @@ struct _libssh2_wincng_cipher_type {
   _libssh2_wincng_cipher_init(ctx, type, iv, secret, encrypt)
 #define _libssh2_cipher_crypt(ctx, type, encrypt, block, blocklen) \
   _libssh2_wincng_cipher_crypt(ctx, type, encrypt, block, blocklen)
+#define _libssh2_cipher_crypt_to(ctx, type, encrypt, src, dst, len) \
+  _libssh2_wincng_cipher_crypt_to(ctx, type, encrypt, src, dst, len)
 #define _libssh2_cipher_dtor(ctx) \
   _libssh2_wincng_cipher_dtor(ctx)
 
@@ -333,7 +342,7 @@ struct _libssh2_wincng_cipher_type {
 
 #define _libssh2_bn_ctx int /* not used */
 #define _libssh2_bn_ctx_new() 0 /* not used */
-#define _libssh2_bn_ctx_free(bnctx) ((void)0) /* not used */
+#define _libssh2_bn_ctx_free(bnctx) ((void)(bnctx)) /* not used */
 
 
 /*******************************************************************/
@@ -401,6 +410,8 @@ _libssh2_wincng_hash(unsigned char *data, unsigned long datalen,
 int
 _libssh2_wincng_hmac_final(_libssh2_wincng_hash_ctx *ctx,
                            unsigned char *hash);
+int
+_libssh2_wincng_hmac_reset(_libssh2_wincng_hash_ctx *ctx);
 void
 _libssh2_wincng_hmac_cleanup(_libssh2_wincng_hash_ctx *ctx);
 
@@ -525,6 +536,13 @@ _libssh2_wincng_cipher_crypt(_libssh2_cipher_ctx *ctx,
                              int encrypt,
                              unsigned char *block,
                              size_t blocklen);
+int
+_libssh2_wincng_cipher_crypt_to(_libssh2_cipher_ctx *ctx,
+                                _libssh2_cipher_type(type),
+                                int encrypt,
+                                const unsigned char *src,
+                                unsigned char *dst,
+                                size_t len);
 void
 _libssh2_wincng_cipher_dtor(_libssh2_cipher_ctx *ctx);
 
@@ -0,0 +1,509 @@
+/* Benchmarks, run against the same sshd fixture as the self test.
+ *
+ * Measures raw channel throughput, SFTP reads and writes at several request
+ * sizes and pipeline depths, SCP, handshake time for each key exchange
+ * method and throughput over many multiplexed channels. Each result is
+ * printed as one tab separated line:
+ *
+ *   name <TAB> parameters <TAB> value <TAB> unit
+ *
+ * where parameters is a comma separated list of key=value pairs, or "-".
+ * Lines starting with '#' are comments. Failures are reported on stderr and
+ * make the exit code non-zero.
+ *
+ * The benchmark groups to run (kex, channel, sftp, scp, mux) may be given on
+ * the command line, all are run otherwise. The environment variables
+ * BENCH_BYTES (bytes per transfer, default 64MB), BENCH_ROUNDS (handshakes
+ * per key exchange method, default 10), BENCH_PORT (default 4711) and
+ * BENCH_DIR (remote directory for the SFTP and SCP files, default /tmp)
+ * change what is measured.
+ */
+
+#include "libssh2_config.h"
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+#include "bench_util.h"
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+# ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+# ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#define getpid() GetCurrentProcessId()
+#else
+#define closesocket(s) close(s)
+#endif
+
+/* the most channels one sshd connection allows by default (MaxSessions) */
+#define MUX_CHANNELS 10
+
+static libssh2_uint64_t total = 64 * 1024 * 1024;
+static int rounds = 10;
+
+static int only_count;
+static char **only;
+
+static char buf[256 * 1024];
+
+static int wanted(const char *group)
+{
+    int i;
+
+    if (!only_count)
+        return 1;
+    for (i = 0; i < only_count; i++)
+        if (!strcmp(only[i], group))
+            return 1;
+    return 0;
+}
+
+static int waitsocket(int sock, LIBSSH2_SESSION *session)
+{
+    struct timeval timeout;
+    fd_set fd;
+    fd_set *writefd = NULL;
+    fd_set *readfd = NULL;
+    int dir;
+
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+
+    FD_ZERO(&fd);
+    FD_SET(sock, &fd);
+
+    dir = libssh2_session_block_directions(session);
+    if (dir & LIBSSH2_SESSION_BLOCK_INBOUND)
+        readfd = &fd;
+    if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+        writefd = &fd;
+
+    return select(sock + 1, readfd, writefd, NULL, &timeout);
+}
+
+/* Time a full handshake with each key exchange method this build has */
+static void bench_kex(void)
+{
+    LIBSSH2_SESSION *session;
+    const char **algs;
+    char params[128];
+    double t, sum, best;
+    int count, i, r, rc, sock;
+
+    session = libssh2_session_init();
+    count = libssh2_session_supported_algs(session, LIBSSH2_METHOD_KEX, &algs);
+    if (count < 0) {
+        failed("kex", "-", session);
+        libssh2_session_free(session);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        sprintf(params, "method=%.100s", algs[i]);
+        sum = 0;
+        best = 0;
+        for (r = 0; r < rounds; r++) {
+            LIBSSH2_SESSION *s;
+
+            sock = open_socket();
+            if (sock < 0) {
+                failed("kex", params, NULL);
+                break;
+            }
+            s = libssh2_session_init();
+            libssh2_session_method_pref(s, LIBSSH2_METHOD_KEX, algs[i]);
+            t = now();
+            rc = libssh2_session_handshake(s, sock);
+            t = now() - t;
+            if (rc == LIBSSH2_ERROR_KEX_FAILURE) {
+                fprintf(stderr, "kex %s: not offered by the server\n",
+                        params);
+                stop(s, sock);
+                break;
+            }
+            if (rc) {
+                failed("kex", params, s);
+                stop(s, sock);
+                break;
+            }
+            stop(s, sock);
+            sum += t;
+            if (!r || t < best)
+                best = t;
+        }
+        if (r == rounds) {
+            result("kex", params, sum / rounds * 1000, "ms");
+            result("kex_min", params, best * 1000, "ms");
+        }
+    }
+
+    libssh2_free(session, algs);
+    libssh2_session_free(session);
+}
+
+static int write_all(LIBSSH2_CHANNEL *channel, libssh2_uint64_t bytes)
+{
+    ssize_t rc;
+
+    while (bytes) {
+        size_t len = bytes < sizeof(buf) ? (size_t)bytes : sizeof(buf);
+        rc = libssh2_channel_write(channel, buf, len);
+        if (rc < 0)
+            return -1;
+        bytes -= rc;
+    }
+    return 0;
+}
+
+static libssh2_uint64_t read_all(LIBSSH2_CHANNEL *channel)
+{
+    libssh2_uint64_t got = 0;
+    ssize_t rc;
+
+    while ((rc = libssh2_channel_read(channel, buf, sizeof(buf))) > 0)
+        got += rc;
+    return rc < 0 ? (libssh2_uint64_t)-1 : got;
+}
+
+/* Raw channel throughput, to a sink and from a source */
+static void bench_channel(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel;
+    char cmd[128];
+    double t;
+
+    channel = libssh2_channel_open_session(session);
+    if (!channel || libssh2_channel_exec(channel, "cat > /dev/null")) {
+        failed("channel_write", "-", session);
+        if (channel)
+            libssh2_channel_free(channel);
+        return;
+    }
+    t = now();
+    if (write_all(channel, total) || libssh2_channel_send_eof(channel) ||
+        libssh2_channel_wait_eof(channel))
+        failed("channel_write", "-", session);
+    else
+        result("channel_write", "-", mbps(total, now() - t), "MB/s");
+    libssh2_channel_free(channel);
+
+    sprintf(cmd, "dd if=/dev/zero bs=65536 count=%lu 2>/dev/null",
+            (unsigned long)(total / 65536));
+    channel = libssh2_channel_open_session(session);
+    if (!channel || libssh2_channel_exec(channel, cmd)) {
+        failed("channel_read", "-", session);
+        if (channel)
+            libssh2_channel_free(channel);
+        return;
+    }
+    t = now();
+    if (read_all(channel) != total / 65536 * 65536)
+        failed("channel_read", "-", session);
+    else
+        result("channel_read", "-", mbps(total / 65536 * 65536, now() - t),
+               "MB/s");
+    libssh2_channel_free(channel);
+}
+
+/* SFTP writes and reads with each request size and pipeline depth */
+static void bench_sftp(LIBSSH2_SESSION *session)
+{
+    static const size_t sizes[] = { 4096, 16384, 32768 };
+    static const unsigned int depths[] = { 1, 4, 16, 64 };
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    char path[256];
+    char params[64];
+    libssh2_uint64_t done;
+    ssize_t rc;
+    double t;
+    size_t s;
+    size_t d;
+
+    sftp = libssh2_sftp_init(session);
+    if (!sftp) {
+        failed("sftp", "-", session);
+        return;
+    }
+    sprintf(path, "%.200s/libssh2-bench-sftp.%d", remote_dir, (int)getpid());
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            sprintf(params, "req=%lu,depth=%u", (unsigned long)sizes[s],
+                    depths[d]);
+
+            handle = libssh2_sftp_open(sftp, path,
+                                       LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                                       LIBSSH2_FXF_TRUNC, 0644);
+            if (!handle) {
+                failed("sftp_write", params, session);
+                goto shutdown;
+            }
+            libssh2_sftp_handle_write_behind(handle, sizes[s] * depths[d],
+                                             depths[d]);
+            t = now();
+            for (done = 0; done < total; done += rc) {
+                size_t len = sizes[s];
+                if (total - done < len)
+                    len = (size_t)(total - done);
+                rc = libssh2_sftp_write(handle, buf, len);
+                if (rc < 0)
+                    break;
+            }
+            if (libssh2_sftp_close(handle) || done < total)
+                failed("sftp_write", params, session);
+            else
+                result("sftp_write", params, mbps(total, now() - t), "MB/s");
+
+            handle = libssh2_sftp_open(sftp, path, LIBSSH2_FXF_READ, 0);
+            if (!handle) {
+                failed("sftp_read", params, session);
+                goto shutdown;
+            }
+            libssh2_sftp_handle_read_ahead(handle, sizes[s] * depths[d],
+                                           depths[d], 0);
+            t = now();
+            done = 0;
+            while ((rc = libssh2_sftp_read(handle, buf, sizes[s])) > 0)
+                done += rc;
+            t = now() - t;
+            if (libssh2_sftp_close(handle) || rc < 0 || done != total)
+                failed("sftp_read", params, session);
+            else
+                result("sftp_read", params, mbps(total, t), "MB/s");
+        }
+    }
+
+  shutdown:
+    libssh2_sftp_unlink(sftp, path);
+    libssh2_sftp_shutdown(sftp);
+}
+
+/* An SCP upload followed by downloading the same file */
+static void bench_scp(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL *channel;
+    libssh2_struct_stat st;
+    libssh2_uint64_t got;
+    char path[256];
+    char cmd[300];
+    ssize_t rc;
+    double t;
+
+    sprintf(path, "%.200s/libssh2-bench-scp.%d", remote_dir, (int)getpid());
+
+    t = now();
+    channel = libssh2_scp_send64(session, path, 0644, total, 0, 0);
+    if (!channel) {
+        failed("scp_send", "-", session);
+        return;
+    }
+    if (write_all(channel, total) || libssh2_channel_send_eof(channel) ||
+        libssh2_channel_wait_eof(channel))
+        failed("scp_send", "-", session);
+    else
+        result("scp_send", "-", mbps(total, now() - t), "MB/s");
+    libssh2_channel_free(channel);
+
+    t = now();
+    channel = libssh2_scp_recv2(session, path, &st);
+    if (!channel) {
+        failed("scp_recv", "-", session);
+    }
+    else {
+        got = 0;
+        while (got < (libssh2_uint64_t)st.st_size) {
+            size_t len = sizeof(buf);
+            if ((libssh2_uint64_t)st.st_size - got < len)
+                len = (size_t)(st.st_size - got);
+            rc = libssh2_channel_read(channel, buf, len);
+            if (rc <= 0)
+                break;
+            got += rc;
+        }
+        if (got != total)
+            failed("scp_recv", "-", session);
+        else
+            result("scp_recv", "-", mbps(total, now() - t), "MB/s");
+        libssh2_channel_free(channel);
+    }
+
+    sprintf(cmd, "rm -f %s", path);
+    channel = libssh2_channel_open_session(session);
+    if (channel) {
+        libssh2_channel_exec(channel, cmd);
+        libssh2_channel_free(channel);
+    }
+}
+
+/* Echo data over several channels at once, without blocking on any of
+   them */
+static void bench_mux(LIBSSH2_SESSION *session, int sock)
+{
+    static const int counts[] = { 1, 4, MUX_CHANNELS };
+    LIBSSH2_CHANNEL *channels[MUX_CHANNELS];
+    libssh2_uint64_t sent[MUX_CHANNELS];
+    libssh2_uint64_t recvd[MUX_CHANNELS];
+    libssh2_uint64_t each;
+    char params[64];
+    int c, n, i, done, progress;
+    ssize_t rc;
+    double t;
+
+    for (c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++) {
+        n = counts[c];
+        each = total / n;
+        sprintf(params, "channels=%d", n);
+
+        t = now();
+        for (i = 0; i < n; i++) {
+            channels[i] = libssh2_channel_open_session(session);
+            if (!channels[i] || libssh2_channel_exec(channels[i], "cat")) {
+                failed("mux", params, session);
+                if (channels[i])
+                    i++;
+                goto cleanup;
+            }
+            sent[i] = recvd[i] = 0;
+        }
+        result("mux_open", params, (now() - t) / n * 1000, "ms");
+
+        libssh2_session_set_blocking(session, 0);
+        t = now();
+        done = 0;
+        while (done < n) {
+            progress = 0;
+            for (i = 0; i < n; i++) {
+                if (sent[i] < each) {
+                    size_t len = 32768;
+                    if (each - sent[i] < len)
+                        len = (size_t)(each - sent[i]);
+                    /* a partly sent packet has to be finished before
+                       anything else is sent on the session */
+                    while ((rc = libssh2_channel_write(channels[i], buf,
+                                                       len)) ==
+                           LIBSSH2_ERROR_EAGAIN)
+                        waitsocket(sock, session);
+                    if (rc > 0) {
+                        sent[i] += rc;
+                        progress = 1;
+                    }
+                    else
+                        break;
+                }
+                if (recvd[i] < each) {
+                    rc = libssh2_channel_read(channels[i], buf + 32768,
+                                              sizeof(buf) - 32768);
+                    if (rc > 0) {
+                        recvd[i] += rc;
+                        progress = 1;
+                        if (recvd[i] >= each)
+                            done++;
+                    }
+                    else if (rc != LIBSSH2_ERROR_EAGAIN)
+                        break;
+                }
+            }
+            if (i < n)
+                break;
+            if (!progress)
+                waitsocket(sock, session);
+        }
+        t = now() - t;
+        libssh2_session_set_blocking(session, 1);
+
+        if (done < n)
+            failed("mux", params, session);
+        else
+            result("mux", params, mbps(each * n, t), "MB/s");
+        i = n;
+
+      cleanup:
+        while (i-- > 0)
+            libssh2_channel_free(channels[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    LIBSSH2_SESSION *session;
+    int sock;
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int err;
+
+    err = WSAStartup(MAKEWORD(2,0), &wsadata);
+    if (err != 0) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+        return -1;
+    }
+#endif
+
+    only = argv + 1;
+    only_count = argc - 1;
+
+    read_environment();
+    if (getenv("BENCH_BYTES"))
+        total = strtoul(getenv("BENCH_BYTES"), NULL, 10);
+    if (getenv("BENCH_ROUNDS"))
+        rounds = atoi(getenv("BENCH_ROUNDS"));
+    if (rounds < 1)
+        rounds = 1;
+
+    memset(buf, 'x', sizeof(buf));
+    libssh2_init(0);
+
+    printf("# name\tparameters\tvalue\tunit\n");
+
+    if (wanted("kex"))
+        bench_kex();
+
+    if (wanted("channel") || wanted("sftp") || wanted("scp") ||
+        wanted("mux")) {
+        session = start(&sock);
+        if (session) {
+            if (wanted("channel"))
+                bench_channel(session);
+            if (wanted("sftp"))
+                bench_sftp(session);
+            if (wanted("scp"))
+                bench_scp(session);
+            if (wanted("mux"))
+                bench_mux(session, sock);
+            stop(session, sock);
+        }
+    }
+
+    libssh2_exit();
+
+#ifdef WIN32
+    WSACleanup();
+#endif
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/* Helpers shared by the benchmark programs, see bench_util.h */
+
+#include "libssh2_config.h"
+#include "bench_util.h"
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#ifndef WIN32
+/* replay-bench builds this with the configuration of the library itself,
+   which doesn't look for these */
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#define closesocket(s) close(s)
+#endif
+
+const char *username = "username";
+const char *pubkeyfile = "etc/user.pub";
+const char *privkeyfile = "etc/user";
+const char *remote_dir = "/tmp";
+unsigned short port = 4711;
+
+int failures;
+
+void read_environment(void)
+{
+    if (getenv("USER"))
+        username = getenv("USER");
+    if (getenv("PRIVKEY"))
+        privkeyfile = getenv("PRIVKEY");
+    if (getenv("PUBKEY"))
+        pubkeyfile = getenv("PUBKEY");
+    if (getenv("BENCH_DIR"))
+        remote_dir = getenv("BENCH_DIR");
+    if (getenv("BENCH_PORT"))
+        port = (unsigned short)atoi(getenv("BENCH_PORT"));
+}
+
+double now(void)
+{
+#ifdef WIN32
+    return GetTickCount() / 1000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+double mbps(libssh2_uint64_t bytes, double seconds)
+{
+    return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
+
+void result(const char *name, const char *params, double value,
+            const char *unit)
+{
+    printf("%s\t%s\t%.3f\t%s\n", name, params, value, unit);
+    fflush(stdout);
+}
+
+void failed(const char *name, const char *params, LIBSSH2_SESSION *session)
+{
+    char *msg = NULL;
+    int rc = 0;
+
+    if (session)
+        rc = libssh2_session_last_error(session, &msg, NULL, 0);
+    else
+        /* a failed connect() or file operation */
+        rc = errno;
+    fprintf(stderr, "%s %s: failed: %s (%d)\n", name, params,
+            msg ? msg : strerror(rc), rc);
+    failures++;
+}
+
+int open_socket(void)
+{
+    struct sockaddr_in sin;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(0x7F000001);
+    if (connect(sock, (struct sockaddr*)(&sin),
+                sizeof(struct sockaddr_in)) != 0) {
+        closesocket(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int login(LIBSSH2_SESSION *session, int sock)
+{
+    char *userauthlist;
+
+    if (libssh2_session_handshake(session, sock)) {
+        failed("handshake", "-", session);
+        return -1;
+    }
+
+    userauthlist = libssh2_userauth_list(session, username, strlen(username));
+    if (!userauthlist && !libssh2_userauth_authenticated(session)) {
+        failed("userauth", "-", session);
+        return -1;
+    }
+    if (userauthlist &&
+        libssh2_userauth_publickey_fromfile(session, username, pubkeyfile,
+                                            privkeyfile, NULL)) {
+        failed("userauth", "-", session);
+        return -1;
+    }
+    return 0;
+}
+
+void stop(LIBSSH2_SESSION *session, int sock)
+{
+    libssh2_session_disconnect(session, "Normal Shutdown");
+    libssh2_session_free(session);
+    closesocket(sock);
+}
+
+LIBSSH2_SESSION *start(int *sockp)
+{
+    LIBSSH2_SESSION *session;
+    int sock;
+
+    sock = open_socket();
+    if (sock < 0) {
+        failed("connect", "-", NULL);
+        return NULL;
+    }
+
+    session = libssh2_session_init();
+    if (!session) {
+        failed("session", "-", NULL);
+        closesocket(sock);
+        return NULL;
+    }
+    if (login(session, sock)) {
+        stop(session, sock);
+        return NULL;
+    }
+
+    *sockp = sock;
+    return session;
+}
@@ -0,0 +1,41 @@
+/* What the benchmark programs bench.c, stress.c and replay_bench.c share:
+ * the sshd fixture they run against, how results and failures are printed
+ * and how a session is set up there.
+ */
+#ifndef LIBSSH2_BENCH_UTIL_H
+#define LIBSSH2_BENCH_UTIL_H
+
+#include <libssh2.h>
+
+/* the account and server, from USER, PRIVKEY, PUBKEY, BENCH_DIR and
+   BENCH_PORT once read_environment() has run */
+extern const char *username;
+extern const char *pubkeyfile;
+extern const char *privkeyfile;
+extern const char *remote_dir;
+extern unsigned short port;
+
+/* number of failed() calls, the exit code is non-zero if there were any */
+extern int failures;
+
+void read_environment(void);
+
+/* seconds since some point in the past */
+double now(void);
+double mbps(libssh2_uint64_t bytes, double seconds);
+
+/* print a result line: name <TAB> parameters <TAB> value <TAB> unit */
+void result(const char *name, const char *params, double value,
+            const char *unit);
+/* report a failure on stderr, with the last error of 'session' if given */
+void failed(const char *name, const char *params, LIBSSH2_SESSION *session);
+
+/* a socket connected to the sshd, -1 on failure */
+int open_socket(void);
+/* handshake and authenticate on a connected socket, 0 on success */
+int login(LIBSSH2_SESSION *session, int sock);
+/* connect, handshake and authenticate, NULL on failure */
+LIBSSH2_SESSION *start(int *sockp);
+void stop(LIBSSH2_SESSION *session, int sock);
+
+#endif /* LIBSSH2_BENCH_UTIL_H */
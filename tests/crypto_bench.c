@@ -0,0 +1,426 @@
+/* Micro benchmarks for the cipher, MAC and compression methods.
+ *
+ * Runs every method of the crypto backend libssh2 was built with through
+ * the same calls the transport layer makes for each packet: one crypt call
+ * (or aead_crypt) per whole packet, one MAC hash per packet over the packet
+ * and a separate sequence number, and one comp/decomp call per payload on a
+ * stream kept across packets. Results use the tab separated format of
+ * bench.c, in MB/s and, where the CPU has a cycle counter, cycles/byte:
+ *
+ *   name <TAB> parameters <TAB> value <TAB> unit
+ *
+ * The groups to run (crypt, mac, comp) may be given on the command line.
+ * BENCH_SECONDS sets how long each measurement runs, default 0.2.
+ *
+ * This reaches into the library internals, so it is linked statically.
+ */
+
+#include "libssh2_priv.h"
+#include "mac.h"
+#include "comp.h"
+
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+# include <intrin.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_PACKET 32768
+/* compressed packets kept for timing decompression */
+#define COMP_PACKETS 256
+
+static const size_t sizes[] = { 64, 1024, 16384, MAX_PACKET };
+
+static double seconds = 0.2;
+static int only_count;
+static char **only;
+static int failures;
+
+static unsigned char packet[MAX_PACKET + 256];
+static unsigned char text[MAX_PACKET];
+static unsigned char noise[MAX_PACKET];
+
+static double now(void)
+{
+#ifdef WIN32
+    return GetTickCount() / 1000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_CYCLES 1
+static libssh2_uint64_t cycles(void)
+{
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((libssh2_uint64_t)hi << 32) | lo;
+}
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define HAVE_CYCLES 1
+static libssh2_uint64_t cycles(void)
+{
+    return __rdtsc();
+}
+#else
+static libssh2_uint64_t cycles(void)
+{
+    return 0;
+}
+#endif
+
+/* A measurement in progress */
+struct timing {
+    double start;
+    libssh2_uint64_t start_cycles;
+    libssh2_uint64_t bytes;
+    unsigned long rounds;
+};
+
+static void timing_start(struct timing *t)
+{
+    t->bytes = 0;
+    t->rounds = 0;
+    t->start = now();
+    t->start_cycles = cycles();
+}
+
+/* count another round of 'bytes', returns 0 once the time is up */
+static int timing_more(struct timing *t, size_t bytes)
+{
+    t->bytes += bytes;
+    /* don't read the clock for every small packet */
+    if (++t->rounds & 15)
+        return 1;
+    return now() - t->start < seconds;
+}
+
+static void timing_report(struct timing *t, const char *name,
+                          const char *params)
+{
+    double elapsed = now() - t->start;
+    libssh2_uint64_t used = cycles() - t->start_cycles;
+
+    printf("%s\t%s\t%.3f\tMB/s\n", name, params,
+           elapsed > 0 ? t->bytes / elapsed / (1024 * 1024) : 0);
+#ifdef HAVE_CYCLES
+    printf("%s\t%s\t%.3f\tcycles/byte\n", name, params,
+           t->bytes ? (double)used / t->bytes : 0);
+#else
+    (void)used;
+#endif
+    fflush(stdout);
+}
+
+static void failed(const char *name, const char *params)
+{
+    fprintf(stderr, "%s %s: failed\n", name, params);
+    failures++;
+}
+
+static int wanted(const char *group)
+{
+    int i;
+
+    if (!only_count)
+        return 1;
+    for (i = 0; i < only_count; i++)
+        if (!strcmp(only[i], group))
+            return 1;
+    return 0;
+}
+
+/* a key or IV as the key exchange hands it over: allocated, and kept by
+   the method unless it says *free_it */
+static unsigned char *key_material(LIBSSH2_SESSION *session, int len)
+{
+    unsigned char *key;
+
+    if (len < 64)
+        len = 64;
+    key = LIBSSH2_ALLOC(session, len);
+    if (key)
+        memset(key, 0x5a, len);
+    return key;
+}
+
+static void bench_crypt_method(LIBSSH2_SESSION *session,
+                               const LIBSSH2_CRYPT_METHOD *method,
+                               int encrypt)
+{
+    const char *name = encrypt ? "encrypt" : "decrypt";
+    int aead = method->flags & LIBSSH2_CRYPT_FLAG_AEAD;
+    void *abstract;
+    unsigned char *iv, *secret;
+    int free_iv, free_secret;
+    struct timing t;
+    char params[128];
+    uint32_t seqno = 0;
+    size_t s, len;
+    int rc = 0;
+
+    /* the packets coming in would need valid tags, and decrypting them
+       costs the same as encrypting them */
+    if (aead && !encrypt)
+        return;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        sprintf(params, "method=%.80s,size=%lu", method->name,
+                (unsigned long)sizes[s]);
+
+        abstract = NULL;
+        free_iv = free_secret = !method->init;
+        iv = key_material(session, method->iv_len);
+        secret = key_material(session, method->secret_len);
+        if (!iv || !secret ||
+            (method->init &&
+             method->init(session, method, iv, &free_iv, secret,
+                          &free_secret, encrypt, &abstract))) {
+            failed(name, params);
+            return;
+        }
+        if (free_iv)
+            LIBSSH2_FREE(session, iv);
+        if (free_secret)
+            LIBSSH2_FREE(session, secret);
+
+        /* what gets encrypted is a whole number of blocks, and for AEAD
+           methods the part after the length field */
+        len = sizes[s] + method->blocksize - 1;
+        len -= len % method->blocksize;
+
+        timing_start(&t);
+        do {
+            if (aead)
+                rc = method->aead_crypt(session, seqno++, packet,
+                                        packet + 4, len, packet + 4 + len,
+                                        &abstract);
+            else
+                rc = method->crypt(session, packet, len, &abstract);
+            if (rc)
+                break;
+        } while (timing_more(&t, len));
+
+        if (rc)
+            failed(name, params);
+        else
+            timing_report(&t, name, params);
+
+        if (method->dtor)
+            method->dtor(session, &abstract);
+    }
+}
+
+static void bench_crypt(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_CRYPT_METHOD **methods = libssh2_crypt_methods();
+    int i;
+
+    for (i = 0; methods[i]; i++) {
+        bench_crypt_method(session, methods[i], 1);
+        bench_crypt_method(session, methods[i], 0);
+    }
+}
+
+static void bench_mac(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_MAC_METHOD **methods = _libssh2_mac_methods();
+    unsigned char macbuf[64];
+    unsigned char *key;
+    void *abstract;
+    int free_key;
+    struct timing t;
+    char params[128];
+    uint32_t seqno;
+    size_t s;
+    int i;
+
+    for (i = 0; methods[i]; i++) {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            sprintf(params, "method=%.80s,size=%lu", methods[i]->name,
+                    (unsigned long)sizes[s]);
+            abstract = NULL;
+            free_key = !methods[i]->init;
+            key = key_material(session, methods[i]->key_len);
+            if (!key || (methods[i]->init &&
+                         methods[i]->init(session, key, &free_key,
+                                          &abstract))) {
+                failed("mac", params);
+                return;
+            }
+            if (free_key)
+                LIBSSH2_FREE(session, key);
+
+            seqno = 0;
+            timing_start(&t);
+            do {
+                methods[i]->hash(session, macbuf, seqno++, packet,
+                                 (uint32_t)sizes[s], NULL, 0, NULL, 0,
+                                 &abstract);
+            } while (timing_more(&t, sizes[s]));
+            timing_report(&t, "mac", params);
+
+            if (methods[i]->dtor)
+                methods[i]->dtor(session, &abstract);
+        }
+    }
+}
+
+static void bench_comp_method(LIBSSH2_SESSION *session,
+                              const LIBSSH2_COMP_METHOD *method,
+                              const unsigned char *data, const char *kind)
+{
+    unsigned char *out;
+    unsigned char *stored;
+    size_t stored_len[COMP_PACKETS];
+    size_t out_size, dest_len;
+    unsigned char *dest;
+    void *abstract;
+    struct timing t;
+    char params[128];
+    size_t s, n;
+    int rc = 0;
+
+    out_size = MAX_PACKET + MAX_PACKET / 64 + 0x100;
+    out = malloc(out_size);
+    stored = malloc(out_size * COMP_PACKETS);
+    if (!out || !stored) {
+        free(out);
+        free(stored);
+        failed("compress", method->name);
+        return;
+    }
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        sprintf(params, "method=%.80s,size=%lu,data=%s", method->name,
+                (unsigned long)sizes[s], kind);
+
+        abstract = NULL;
+        if (method->init && method->init(session, 1, &abstract)) {
+            failed("compress", params);
+            break;
+        }
+        n = 0;
+        timing_start(&t);
+        do {
+            dest_len = out_size;
+            rc = method->comp(session, out, &dest_len, data, sizes[s],
+                              &abstract);
+            if (rc)
+                break;
+            /* keep the first packets of the stream for decompressing */
+            if (n < COMP_PACKETS) {
+                memcpy(stored + n * out_size, out, dest_len);
+                stored_len[n++] = dest_len;
+            }
+        } while (timing_more(&t, sizes[s]) || n < COMP_PACKETS);
+        if (method->dtor)
+            method->dtor(session, 1, &abstract);
+        if (rc) {
+            failed("compress", params);
+            continue;
+        }
+        timing_report(&t, "compress", params);
+
+        /* a stream can only be decompressed from its start, so run the
+           stored packets through a fresh stream as often as needed */
+        timing_start(&t);
+        do {
+            abstract = NULL;
+            if (method->init && method->init(session, 0, &abstract)) {
+                rc = -1;
+                break;
+            }
+            for (n = 0; !rc && n < COMP_PACKETS; n++) {
+                rc = method->decomp(session, &dest, &dest_len,
+                                    LIBSSH2_PACKET_MAXDECOMP,
+                                    stored + n * out_size, stored_len[n],
+                                    &abstract);
+                /* the transport copies the result out of the stream */
+                if (!rc)
+                    memcpy(out, dest, dest_len);
+            }
+            if (method->dtor)
+                method->dtor(session, 0, &abstract);
+        } while (!rc && timing_more(&t, sizes[s] * COMP_PACKETS));
+        if (rc)
+            failed("decompress", params);
+        else
+            timing_report(&t, "decompress", params);
+    }
+
+    free(out);
+    free(stored);
+}
+
+static void bench_comp(LIBSSH2_SESSION *session)
+{
+    const LIBSSH2_COMP_METHOD **methods;
+    int i;
+
+    libssh2_session_flag(session, LIBSSH2_FLAG_COMPRESS, 1);
+    methods = _libssh2_comp_methods(session);
+
+    for (i = 0; methods[i]; i++) {
+        bench_comp_method(session, methods[i], text, "text");
+        bench_comp_method(session, methods[i], noise, "random");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *words[] = {
+        "channel", "packet", "window", "the", "of", "data", "session",
+        "sftp", "read", "write", "\n", "0x7f", "a", "key", "exchange"
+    };
+    LIBSSH2_SESSION *session;
+    size_t i, len;
+
+    only = argv + 1;
+    only_count = argc - 1;
+    if (getenv("BENCH_SECONDS"))
+        seconds = atof(getenv("BENCH_SECONDS"));
+
+    /* something like a log file, and something that doesn't compress */
+    srand(1);
+    for (i = 0; i < MAX_PACKET; i += len) {
+        const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+        len = strlen(w) + 1;
+        if (len > MAX_PACKET - i)
+            len = MAX_PACKET - i;
+        memcpy(text + i, w, len - 1);
+        text[i + len - 1] = ' ';
+    }
+    for (i = 0; i < MAX_PACKET; i++)
+        noise[i] = (unsigned char)(rand() >> 4);
+    memcpy(packet, noise, sizeof(packet) < sizeof(noise) ?
+           sizeof(packet) : sizeof(noise));
+
+    libssh2_init(0);
+    session = libssh2_session_init();
+    if (!session) {
+        fprintf(stderr, "libssh2_session_init failed\n");
+        return 1;
+    }
+
+    printf("# name\tparameters\tvalue\tunit\n");
+
+    if (wanted("crypt"))
+        bench_crypt(session);
+    if (wanted("mac"))
+        bench_mac(session);
+    if (wanted("comp"))
+        bench_comp(session);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,361 @@
+/* Unit tests for library internals that the public API does not reach
+ * directly, in the manner of simple.c: each test prints what went wrong
+ * and returns non-zero, and the program fails if any of them did.
+ *
+ * This reaches into the library internals, so it is linked statically.
+ */
+
+#include "libssh2_priv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* FIPS 180-2 appendix C and D test messages */
+static const char abc[] = "abc";
+static const char two_blocks[] =
+    "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+    "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu";
+
+static int check_digest(const char *name, const unsigned char *digest,
+                        size_t len, const char *expect)
+{
+    char hex[2 * SHA512_DIGEST_LENGTH + 1];
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+
+    if (strcmp(hex, expect))
+    {
+        fprintf(stderr, "%s digest is %s, expected %s\n", name, hex, expect);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_sha384(void)
+{
+    libssh2_sha384_ctx ctx;
+    unsigned char digest[SHA384_DIGEST_LENGTH];
+    int failed = 0;
+
+    if (!libssh2_sha384_init(&ctx))
+    {
+        fprintf(stderr, "libssh2_sha384_init() failed\n");
+        return 1;
+    }
+    libssh2_sha384_update(ctx, abc, strlen(abc));
+    libssh2_sha384_final(ctx, digest);
+    failed |= check_digest("sha384(abc)", digest, sizeof(digest),
+                           "cb00753f45a35e8bb5a03d699ac65007"
+                           "272c32ab0eded1631a8b605a43ff5bed"
+                           "8086072ba1e7cc2358baeca134c825a7");
+
+    /* the message in two updates that split a block */
+    if (!libssh2_sha384_init(&ctx))
+    {
+        fprintf(stderr, "libssh2_sha384_init() failed\n");
+        return 1;
+    }
+    libssh2_sha384_update(ctx, two_blocks, 13);
+    libssh2_sha384_update(ctx, two_blocks + 13, strlen(two_blocks) - 13);
+    libssh2_sha384_final(ctx, digest);
+    failed |= check_digest("sha384(two blocks)", digest, sizeof(digest),
+                           "09330c33f71147e83d192fc782cd1b47"
+                           "53111b173b3b05d22fa08086e3b0f712"
+                           "fcc7c71a557e2db966c3e9fa91746039");
+    return failed;
+}
+
+static int test_sha512(void)
+{
+    libssh2_sha512_ctx ctx;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    int failed = 0;
+
+    if (!libssh2_sha512_init(&ctx))
+    {
+        fprintf(stderr, "libssh2_sha512_init() failed\n");
+        return 1;
+    }
+    libssh2_sha512_update(ctx, abc, strlen(abc));
+    libssh2_sha512_final(ctx, digest);
+    failed |= check_digest("sha512(abc)", digest, sizeof(digest),
+                           "ddaf35a193617abacc417349ae204131"
+                           "12e6fa4e89a97ea20a9eeee64b55d39a"
+                           "2192992a274fc1a836ba3c23a3feebbd"
+                           "454d4423643ce80e2a9ac94fa54ca49f");
+
+    if (!libssh2_sha512_init(&ctx))
+    {
+        fprintf(stderr, "libssh2_sha512_init() failed\n");
+        return 1;
+    }
+    libssh2_sha512_update(ctx, two_blocks, 13);
+    libssh2_sha512_update(ctx, two_blocks + 13, strlen(two_blocks) - 13);
+    libssh2_sha512_final(ctx, digest);
+    failed |= check_digest("sha512(two blocks)", digest, sizeof(digest),
+                           "8e959b75dae313da8cf4f72814fc143f"
+                           "8f7779c6eb9f7fa17299aeadb6889018"
+                           "501d289e4900f7e4331b99dec4b5433a"
+                           "c7d329eeb6dd26545e96e55b874be909");
+    return failed;
+}
+
+static int test_get_string(void)
+{
+    /* "ssh-ed25519", an empty string and a length running past the end */
+    static const unsigned char blob[] = {
+        0, 0, 0, 11, 's', 's', 'h', '-', 'e', 'd', '2', '5', '5', '1', '9',
+        0, 0, 0, 0,
+        0, 0, 0, 5, 'k', 'e', 'y'
+    };
+    unsigned char buf[sizeof(blob)];
+    unsigned char *p = buf;
+    const unsigned char *end = buf + sizeof(buf);
+    unsigned char *str;
+    size_t len;
+
+    memcpy(buf, blob, sizeof(buf));
+
+    if (_libssh2_get_string(&p, end, &str, &len) || (len != 11) ||
+        memcmp(str, "ssh-ed25519", 11) || (p != buf + 15))
+    {
+        fprintf(stderr, "_libssh2_get_string() misread a string\n");
+        return 1;
+    }
+    if (_libssh2_get_string(&p, end, &str, &len) || len || (p != buf + 19))
+    {
+        fprintf(stderr, "_libssh2_get_string() misread an empty string\n");
+        return 1;
+    }
+    if (!_libssh2_get_string(&p, end, &str, &len) || (p != buf + 19))
+    {
+        fprintf(stderr, "_libssh2_get_string() read past the end\n");
+        return 1;
+    }
+    /* not even a whole length left */
+    p = buf + sizeof(buf) - 3;
+    if (!_libssh2_get_string(&p, end, &str, &len))
+    {
+        fprintf(stderr, "_libssh2_get_string() read a partial length\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int test_base64(void)
+{
+    /* RFC 4648 section 10 */
+    static const char *vectors[][2] = {
+        { "", "" }, { "f", "Zg==" }, { "fo", "Zm8=" }, { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" }, { "fooba", "Zm9vYmE=" },
+        { "foobar", "Zm9vYmFy" }
+    };
+    unsigned char bytes[100];
+    /* the decoder wants room for 3/4 of its input */
+    unsigned char decoded[3 * LIBSSH2_BASE64_LEN(100) / 4];
+    char encoded[LIBSSH2_BASE64_LEN(100)];
+    size_t len;
+    size_t n;
+    int rc;
+
+    for (n = 0; n < sizeof(vectors) / sizeof(vectors[0]); n++)
+    {
+        len = _libssh2_base64_encode_into(encoded,
+                                          (const unsigned char *)
+                                          vectors[n][0],
+                                          strlen(vectors[n][0]));
+        if ((len != strlen(vectors[n][1])) || strcmp(encoded, vectors[n][1]))
+        {
+            fprintf(stderr, "base64 of \"%s\" is %s, expected %s\n",
+                    vectors[n][0], encoded, vectors[n][1]);
+            return 1;
+        }
+    }
+
+    /* every length up to a few groups, and every byte value */
+    for (n = 0; n < sizeof(bytes); n++)
+        bytes[n] = (unsigned char)(n * 83 + 7);
+    for (n = 0; n <= sizeof(bytes); n++)
+    {
+        len = _libssh2_base64_encode_into(encoded, bytes, n);
+        if ((len != LIBSSH2_BASE64_LEN(n) - 1) || (strlen(encoded) != len))
+        {
+            fprintf(stderr, "base64 of %lu bytes is %lu long\n",
+                    (unsigned long)n, (unsigned long)len);
+            return 1;
+        }
+
+        rc = _libssh2_base64_decode_into(decoded, encoded, len);
+        if ((rc != (int)n) || memcmp(decoded, bytes, n))
+        {
+            fprintf(stderr, "base64 round trip of %lu bytes failed\n",
+                    (unsigned long)n);
+            return 1;
+        }
+
+        /* and in place */
+        rc = _libssh2_base64_decode_into((unsigned char *)encoded, encoded,
+                                         len);
+        if ((rc != (int)n) || memcmp(encoded, bytes, n))
+        {
+            fprintf(stderr, "base64 decode in place of %lu bytes failed\n",
+                    (unsigned long)n);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* what the slab test's session asked its allocator for */
+static size_t alloc_last;
+static int alloc_calls;
+static int free_calls;
+
+static LIBSSH2_ALLOC_FUNC(count_alloc)
+{
+    (void)abstract;
+    alloc_last = count;
+    alloc_calls++;
+    return malloc(count);
+}
+
+static LIBSSH2_FREE_FUNC(count_free)
+{
+    (void)abstract;
+    free_calls++;
+    free(ptr);
+}
+
+static LIBSSH2_REALLOC_FUNC(count_realloc)
+{
+    (void)abstract;
+    return realloc(ptr, count);
+}
+
+static int test_slab(void)
+{
+    /* asked for, block size of the class it lands in */
+    static const size_t classes[][2] = {
+        { 1, 64 }, { 64, 64 }, { 65, 80 }, { 100, 112 }, { 128, 128 },
+        { 129, 160 }, { 1000, 1024 }, { 32768 + 13, 40960 },
+        { 262144, 262144 },
+        { 262145, 262145 }  /* above the largest class, not rounded */
+    };
+    LIBSSH2_SESSION *session;
+    void *block;
+    void *again;
+    void *kept[40];
+    size_t i;
+    int calls;
+    int failed = 0;
+
+    session = libssh2_session_init_ex(count_alloc, count_free,
+                                      count_realloc, NULL);
+    if (!session)
+    {
+        fprintf(stderr, "libssh2_session_init_ex() failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        _libssh2_slab_clear(session);
+        calls = alloc_calls;
+        block = _libssh2_slab_alloc(session, classes[i][0]);
+        if (!block || (alloc_calls != calls + 1) ||
+            (alloc_last != classes[i][1]))
+        {
+            fprintf(stderr, "slab block for %lu bytes is %lu, expected %lu\n",
+                    (unsigned long)classes[i][0], (unsigned long)alloc_last,
+                    (unsigned long)classes[i][1]);
+            failed = 1;
+        }
+        calls = free_calls;
+        _libssh2_slab_free(session, block, classes[i][0]);
+        if ((classes[i][0] > 262144) != (free_calls == calls + 1))
+        {
+            fprintf(stderr, "slab block for %lu bytes %s\n",
+                    (unsigned long)classes[i][0],
+                    classes[i][0] > 262144 ? "was kept" : "was not kept");
+            failed = 1;
+        }
+    }
+
+    /* a freed block comes back for any size of its class */
+    block = _libssh2_slab_alloc(session, 70);
+    _libssh2_slab_free(session, block, 70);
+    calls = alloc_calls;
+    again = _libssh2_slab_alloc(session, 80);
+    if ((again != block) || (alloc_calls != calls))
+    {
+        fprintf(stderr, "slab did not reuse a freed block\n");
+        failed = 1;
+    }
+    _libssh2_slab_free(session, again, 80);
+
+    /* no more than LIBSSH2_SLAB_KEEP bytes are kept */
+    _libssh2_slab_clear(session);
+    for (i = 0; i < sizeof(kept) / sizeof(kept[0]); i++)
+        kept[i] = _libssh2_slab_alloc(session, 65536);
+    calls = free_calls;
+    for (i = 0; i < sizeof(kept) / sizeof(kept[0]); i++)
+        _libssh2_slab_free(session, kept[i], 65536);
+    if ((session->slab.bytes != LIBSSH2_SLAB_KEEP) ||
+        (free_calls - calls != (int)(sizeof(kept) / sizeof(kept[0])) -
+         LIBSSH2_SLAB_KEEP / 65536))
+    {
+        fprintf(stderr, "slab keeps %lu bytes, expected %lu\n",
+                (unsigned long)session->slab.bytes,
+                (unsigned long)LIBSSH2_SLAB_KEEP);
+        failed = 1;
+    }
+
+    calls = free_calls;
+    _libssh2_slab_clear(session);
+    if ((session->slab.bytes != 0) ||
+        (free_calls - calls != LIBSSH2_SLAB_KEEP / 65536))
+    {
+        fprintf(stderr, "_libssh2_slab_clear() left blocks behind\n");
+        failed = 1;
+    }
+
+    libssh2_session_free(session);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+    int failed = 0;
+    (void)argv;
+    (void)argc;
+
+    rc = libssh2_init (0);
+    if (rc != 0)
+    {
+        fprintf (stderr, "libssh2_init() failed: %d\n", rc);
+        return 1;
+    }
+
+    session = libssh2_session_init();
+    if (!session)
+    {
+        fprintf (stderr, "libssh2_session_init() failed\n");
+        return 1;
+    }
+
+    failed |= test_sha384();
+    failed |= test_sha512();
+    failed |= test_slab();
+    failed |= test_get_string();
+    failed |= test_base64();
+
+    libssh2_session_free(session);
+
+    libssh2_exit ();
+
+    return failed;
+}
@@ -0,0 +1,863 @@
+/* Replays a recorded session through the receive path.
+ *
+ * Records what a session gets from the sshd fixture, as it is once
+ * decrypted, and feeds that back to a fresh session through a LIBSSH2_RECV
+ * callback at memory speed while whatever it sends is thrown away. This
+ * times the packet reader, the packet queue and the channel and SFTP code
+ * taking the packets, without a server or the network in the way, and the
+ * same on every run. Along with the stream, the recording keeps how many
+ * packets the session had sent when each packet came in, and the replay
+ * holds a packet back until it has sent as many, as a server would.
+ *
+ * The replay makes the same calls as the recorded session did: it reads
+ * the output of a command over a channel, reads a file over SFTP and lists
+ * a directory. As the recording starts once the session is authenticated,
+ * the replay starts out as if keys were exchanged and it had logged in.
+ * Every recording is replayed twice: with mode=none there is no cipher or
+ * MAC, which leaves only the parsing, and with mode=crypt the packets are
+ * sealed again with fixed keys, so that decrypting and checking them is
+ * part of it. BENCH_CIPHER and BENCH_MAC choose the methods for that,
+ * aes128-ctr and hmac-sha2-256 by default. AEAD and encrypt-then-MAC
+ * methods are not supported.
+ *
+ *   replay-bench record FILE   records against the sshd fixture
+ *   replay-bench FILE          replays FILE
+ *   replay-bench               records to replay.dat and replays it
+ *
+ * Results use the tab separated format of bench.c, in MB/s of the recorded
+ * stream and nanoseconds per packet, for the fastest of BENCH_ROUNDS
+ * replays (default 10). The recorded session transfers BENCH_BYTES
+ * (default 16MB) each way through a file in BENCH_DIR (default /tmp), at
+ * the sshd on BENCH_PORT (default 4711). A replay that doesn't use up
+ * exactly the recorded stream has gone a different way than the recording
+ * and is reported as a failure.
+ *
+ * This reaches into the library internals, so it is linked statically.
+ */
+
+#include "libssh2_priv.h"
+#include "mac.h"
+#include "transport.h"
+#include <libssh2_sftp.h>
+#include "bench_util.h"
+
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifndef WIN32
+/* the configuration of the library itself doesn't look for these */
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+#define getpid() GetCurrentProcessId()
+#else
+#define closesocket(s) close(s)
+#endif
+
+/* first line of a recording, followed by what the calls returned and the
+   number of packets. Then come the packets sent before each packet, as 32
+   bit numbers, and then the packets. */
+#define REPLAY_MAGIC "libssh2-replay 1"
+
+static const char *cipher_name = "aes128-ctr";
+static const char *mac_name = "hmac-sha2-256";
+static libssh2_uint64_t total = 16 * 1024 * 1024;
+static int rounds = 10;
+
+static char buf[64 * 1024];
+
+/* what the calls got, which a replay must get too */
+struct outcome {
+    unsigned long channel_bytes;
+    unsigned long sftp_bytes;
+    unsigned long entries;
+};
+
+/* a recording as it is loaded */
+struct recording {
+    struct outcome want;
+    unsigned char *file;
+    const unsigned char *marks;
+    const unsigned char *plain;
+    size_t len;
+    unsigned long packets;
+};
+
+/* the recording as the replaying session reads it, a socket buffer of it
+   at a time */
+#define FEED_CHUNK (64 * 1024)
+/* times the replay may find a packet held back before it gets it anyway */
+#define FEED_PATIENCE 16
+struct feed {
+    LIBSSH2_SESSION *session;
+    const unsigned char *data;
+    size_t len;
+    size_t off;
+    size_t ready;
+
+    /* packets are let through once the session has sent as many packets
+       as the recorded one had when it got them */
+    const unsigned char *plain;
+    size_t plain_off;
+    size_t extra;
+    const unsigned char *marks;
+    unsigned long packets;
+    unsigned long next;
+    size_t limit;
+    int stalls;
+};
+
+/*
+ * run_calls
+ *
+ * The calls whose packets are recorded and replayed. What they send only
+ * depends on what came in before, so a replay asks for the same things in
+ * the same order and gets the recorded answers.
+ */
+static int run_calls(LIBSSH2_SESSION *session, struct outcome *o)
+{
+    LIBSSH2_CHANNEL *channel;
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    char path[256];
+    char cmd[640];
+    ssize_t rc;
+
+    memset(o, 0, sizeof(*o));
+    sprintf(path, "%.200s/libssh2-replay.%d", remote_dir, (int)getpid());
+    sprintf(cmd, "dd if=/dev/zero of=%s bs=65536 count=%lu 2>/dev/null && "
+            "cat %s", path, (unsigned long)(total / 65536), path);
+
+    channel = libssh2_channel_open_session(session);
+    if (!channel)
+        return -1;
+    if (libssh2_channel_exec(channel, cmd)) {
+        libssh2_channel_free(channel);
+        return -1;
+    }
+    while ((rc = libssh2_channel_read(channel, buf, sizeof(buf))) > 0)
+        o->channel_bytes += rc;
+    libssh2_channel_free(channel);
+    if (rc < 0)
+        return -1;
+
+    sftp = libssh2_sftp_init(session);
+    if (!sftp)
+        return -1;
+
+    handle = libssh2_sftp_open(sftp, path, LIBSSH2_FXF_READ, 0);
+    if (!handle)
+        goto fail;
+    while ((rc = libssh2_sftp_read(handle, buf, sizeof(buf))) > 0)
+        o->sftp_bytes += rc;
+    if (libssh2_sftp_close(handle) || (rc < 0))
+        goto fail;
+
+    handle = libssh2_sftp_opendir(sftp, remote_dir);
+    if (!handle)
+        goto fail;
+    while ((rc = libssh2_sftp_readdir(handle, buf, sizeof(buf), &attrs)) > 0)
+        o->entries++;
+    if (libssh2_sftp_closedir(handle) || (rc < 0))
+        goto fail;
+
+    if (libssh2_sftp_unlink(sftp, path))
+        goto fail;
+    return libssh2_sftp_shutdown(sftp) ? -1 : 0;
+
+  fail:
+    libssh2_sftp_shutdown(sftp);
+    return -1;
+}
+
+/* The recording: the stream the cipher of the session decrypted after it
+   logged in */
+static const LIBSSH2_CRYPT_METHOD *record_crypt;
+static LIBSSH2_CRYPT_METHOD record_method;
+static unsigned char *record_data;
+static size_t record_len;
+static size_t record_size;
+static int record_nomem;
+/* packets the session had sent when each recorded packet came in */
+static unsigned char *record_marks;
+static unsigned long record_packets;
+static unsigned long record_marks_size;
+static uint32_t record_seqno;
+static uint32_t record_sent;
+
+static void record_add(const unsigned char *data, size_t len)
+{
+    if (record_len + len > record_size) {
+        size_t size = record_size ? record_size : 1024 * 1024;
+        unsigned char *grown;
+
+        while (size < record_len + len)
+            size *= 2;
+        grown = realloc(record_data, size);
+        if (!grown) {
+            record_nomem = 1;
+            return;
+        }
+        record_data = grown;
+        record_size = size;
+    }
+    memcpy(record_data + record_len, data, len);
+    record_len += len;
+}
+
+static void record_mark(LIBSSH2_SESSION *session)
+{
+    if (record_packets && (session->remote.seqno == record_seqno))
+        /* more of the same packet */
+        return;
+    if (record_packets == record_marks_size) {
+        unsigned long size = record_marks_size ? record_marks_size * 2 :
+            1024;
+        unsigned char *grown = realloc(record_marks, size * 4);
+
+        if (!grown) {
+            record_nomem = 1;
+            return;
+        }
+        record_marks = grown;
+        record_marks_size = size;
+    }
+    _libssh2_htonu32(record_marks + record_packets * 4,
+                     session->local.seqno - record_sent);
+    record_packets++;
+    record_seqno = session->remote.seqno;
+}
+
+/* the negotiated cipher, keeping what it decrypted */
+static int record_decrypt(LIBSSH2_SESSION *session, unsigned char *block,
+                          size_t len, void **abstract)
+{
+    int rc = record_crypt->crypt(session, block, len, abstract);
+
+    if (!rc) {
+        record_mark(session);
+        record_add(block, len);
+    }
+    return rc;
+}
+
+static int record_decrypt_to(LIBSSH2_SESSION *session,
+                             const unsigned char *src, unsigned char *dst,
+                             size_t len, void **abstract)
+{
+    int rc = record_crypt->crypt_to(session, src, dst, len, abstract);
+
+    if (!rc) {
+        record_mark(session);
+        record_add(dst, len);
+    }
+    return rc;
+}
+
+/* Record the calls against sshd into 'file' */
+static void record(const char *file)
+{
+    LIBSSH2_SESSION *session;
+    struct outcome o;
+    FILE *f;
+    int sock;
+    int rc;
+
+    sock = open_socket();
+    if (sock < 0) {
+        failed("record", "connect", NULL);
+        return;
+    }
+
+    session = libssh2_session_init();
+    /* the packets as they are sent, once decrypted: no compression, and
+       the packet length encrypted along with the rest so that the stream
+       can be replayed without any cipher */
+    libssh2_session_method_pref(session, LIBSSH2_METHOD_CRYPT_SC,
+                                "aes128-ctr,aes192-ctr,aes256-ctr");
+    libssh2_session_method_pref(session, LIBSSH2_METHOD_MAC_SC,
+                                "hmac-sha2-256,hmac-sha2-512,hmac-sha1");
+    libssh2_session_method_pref(session, LIBSSH2_METHOD_COMP_SC, "none");
+
+    if (login(session, sock))
+        goto done;
+
+    /* blocking calls return between two packets, so the recording starts
+       with a whole one */
+    record_crypt = session->remote.crypt;
+    record_method = *record_crypt;
+    record_method.crypt = record_decrypt;
+    if (record_crypt->crypt_to)
+        record_method.crypt_to = record_decrypt_to;
+    session->remote.crypt = &record_method;
+    record_sent = session->local.seqno;
+
+    rc = run_calls(session, &o);
+    session->remote.crypt = record_crypt;
+    if (rc || record_nomem) {
+        failed("record", "-", session);
+        goto done;
+    }
+
+    f = fopen(file, "wb");
+    if (!f) {
+        failed("record", file, NULL);
+        goto done;
+    }
+    fprintf(f, "%s %lu %lu %lu %lu\n", REPLAY_MAGIC, o.channel_bytes,
+            o.sftp_bytes, o.entries, record_packets);
+    if ((fwrite(record_marks, 4, record_packets, f) != record_packets) ||
+        (fwrite(record_data, 1, record_len, f) != record_len) || fclose(f))
+        failed("record", file, NULL);
+    else
+        printf("# recorded %lu bytes to %s\n", (unsigned long)record_len,
+               file);
+
+  done:
+    libssh2_session_disconnect(session, "Normal Shutdown");
+    libssh2_session_free(session);
+    closesocket(sock);
+    free(record_data);
+    free(record_marks);
+    record_data = record_marks = NULL;
+    record_len = record_size = 0;
+    record_packets = record_marks_size = 0;
+}
+
+/*
+ * load
+ *
+ * Read a recording and count its packets. A packet at the end that isn't
+ * all there is left out.
+ */
+static int load(const char *file, struct recording *r)
+{
+    char line[128];
+    unsigned char *data = NULL;
+    unsigned long marked;
+    size_t len = 0;
+    size_t size = 0;
+    size_t n;
+    size_t off;
+    FILE *f;
+
+    f = fopen(file, "rb");
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f) ||
+        (sscanf(line, REPLAY_MAGIC " %lu %lu %lu %lu",
+                &r->want.channel_bytes, &r->want.sftp_bytes,
+                &r->want.entries, &marked) != 4)) {
+        fclose(f);
+        return -1;
+    }
+    do {
+        if (len == size) {
+            unsigned char *grown;
+
+            size = size ? size * 2 : 1024 * 1024;
+            grown = realloc(data, size);
+            if (!grown) {
+                free(data);
+                fclose(f);
+                return -1;
+            }
+            data = grown;
+        }
+        n = fread(data + len, 1, size - len, f);
+        len += n;
+    } while (n);
+    fclose(f);
+    if (len / 4 < marked) {
+        free(data);
+        return -1;
+    }
+
+    r->file = data;
+    r->marks = data;
+    r->plain = data + marked * 4;
+    len -= marked * 4;
+    r->packets = 0;
+    for (off = 0; len - off >= 4; off += n) {
+        n = 4 + _libssh2_ntohu32(r->plain + off);
+        if ((n < 9) || (n > len - off) || (r->packets == marked))
+            break;
+        r->packets++;
+    }
+    if (!r->packets) {
+        free(data);
+        return -1;
+    }
+    r->len = off;
+    return 0;
+}
+
+/* a key or IV of the fixed keys, allocated as the key exchange hands it
+   over */
+static unsigned char *key_material(LIBSSH2_SESSION *session, int len)
+{
+    unsigned char *key;
+
+    if (len < 64)
+        len = 64;
+    key = LIBSSH2_ALLOC(session, len);
+    if (key)
+        memset(key, 0x5a, len);
+    return key;
+}
+
+/* set up a cipher and MAC with the fixed keys */
+static int fixed_keys(LIBSSH2_SESSION *session,
+                      const LIBSSH2_CRYPT_METHOD *crypt,
+                      const LIBSSH2_MAC_METHOD *mac, int encrypt,
+                      void **crypt_abstract, void **mac_abstract)
+{
+    unsigned char *iv = key_material(session, crypt->iv_len);
+    unsigned char *secret = key_material(session, crypt->secret_len);
+    unsigned char *key = key_material(session, mac->key_len);
+    int free_iv = 0, free_secret = 0, free_key = 0;
+    int rc = -1;
+
+    if (iv && secret && key &&
+        !crypt->init(session, crypt, iv, &free_iv, secret, &free_secret,
+                     encrypt, crypt_abstract)) {
+        if (mac->init(session, key, &free_key, mac_abstract))
+            free_key = 1;
+        else
+            rc = 0;
+    }
+    else
+        free_iv = free_secret = free_key = 1;
+
+    if (iv && free_iv)
+        LIBSSH2_FREE(session, iv);
+    if (secret && free_secret)
+        LIBSSH2_FREE(session, secret);
+    if (key && free_key)
+        LIBSSH2_FREE(session, key);
+    return rc;
+}
+
+/*
+ * seal
+ *
+ * The recorded packets encrypted and MACed again with the fixed keys, as
+ * they would come in from a server using them
+ */
+static unsigned char *seal(LIBSSH2_SESSION *session,
+                           const unsigned char *data, size_t len,
+                           unsigned long packets,
+                           const LIBSSH2_CRYPT_METHOD *crypt,
+                           const LIBSSH2_MAC_METHOD *mac, size_t *sealed_len)
+{
+    unsigned char *sealed;
+    unsigned char *out;
+    void *crypt_abstract = NULL;
+    void *mac_abstract = NULL;
+    uint32_t seqno = 0;
+    size_t off;
+    size_t n;
+
+    sealed = malloc(len + packets * mac->mac_len);
+    if (!sealed)
+        return NULL;
+    if (fixed_keys(session, crypt, mac, 1, &crypt_abstract, &mac_abstract)) {
+        free(sealed);
+        return NULL;
+    }
+
+    out = sealed;
+    for (off = 0; off < len; off += n) {
+        n = 4 + _libssh2_ntohu32(data + off);
+        if (n % crypt->blocksize)
+            break;
+        memcpy(out, data + off, n);
+        mac->hash(session, out + n, seqno++, out, (uint32_t)n, NULL, 0,
+                  NULL, 0, &mac_abstract);
+        if (crypt->crypt(session, out, n, &crypt_abstract))
+            break;
+        out += n + mac->mac_len;
+    }
+
+    if (crypt->dtor)
+        crypt->dtor(session, &crypt_abstract);
+    if (mac->dtor)
+        mac->dtor(session, &mac_abstract);
+    if (off < len) {
+        free(sealed);
+        return NULL;
+    }
+    *sealed_len = out - sealed;
+    return sealed;
+}
+
+/* let the next packet through */
+static void feed_release(struct feed *feed)
+{
+    size_t n = 4 + _libssh2_ntohu32(feed->plain + feed->plain_off);
+
+    feed->plain_off += n;
+    feed->limit += n + feed->extra;
+    feed->next++;
+}
+
+static LIBSSH2_RECV_FUNC(replay_recv)
+{
+    struct feed *feed = (struct feed *)*abstract;
+    uint32_t sent = feed->session->local.seqno;
+    size_t n;
+
+    (void)socket;
+    (void)flags;
+    while ((feed->next < feed->packets) &&
+           (_libssh2_ntohu32(feed->marks + feed->next * 4) <= sent))
+        feed_release(feed);
+    if ((feed->off == feed->limit) && (feed->next < feed->packets)) {
+        /* A server doesn't answer what it hasn't been asked yet, and a
+           packet for a channel that isn't open yet would be thrown away.
+           Unless the session waits for the packet all the same, which it
+           does when it sent window adjustments at other times than the
+           recorded one. */
+        if (++feed->stalls < FEED_PATIENCE)
+            return -EAGAIN;
+        feed_release(feed);
+    }
+    feed->stalls = 0;
+
+    /* like a socket read dry, so that the blocking calls stop reading and
+       look at what they have got */
+    n = feed->limit - feed->off;
+    if (n && !feed->ready) {
+        feed->ready = FEED_CHUNK;
+        return -EAGAIN;
+    }
+    if (n > feed->ready)
+        n = feed->ready;
+    if (n > length)
+        n = length;
+    memcpy(buffer, feed->data + feed->off, n);
+    feed->off += n;
+    feed->ready -= n;
+    return (ssize_t)n;
+}
+
+static LIBSSH2_SEND_FUNC(replay_send)
+{
+    (void)socket;
+    (void)buffer;
+    (void)flags;
+    (void)abstract;
+    return (ssize_t)length;
+}
+
+/*
+ * ready_socket
+ *
+ * A socket that always has something to read, for the session to wait on
+ * when the feed says EAGAIN: a datagram sent to itself and never read.
+ */
+static int ready_socket(void)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    int sock;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0x7F000001);
+    if (bind(sock, (struct sockaddr*)(&sin), sizeof(sin)) ||
+        getsockname(sock, (struct sockaddr*)(&sin), &sinlen) ||
+        (sendto(sock, "", 1, 0, (struct sockaddr*)(&sin), sinlen) != 1)) {
+        closesocket(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int none_crypt(LIBSSH2_SESSION *session, unsigned char *block,
+                      size_t len, void **abstract)
+{
+    (void)session;
+    (void)block;
+    (void)len;
+    (void)abstract;
+    return 0;
+}
+
+static int none_mac(LIBSSH2_SESSION *session, unsigned char *buf,
+                    uint32_t seqno, const unsigned char *packet,
+                    uint32_t packet_len, const unsigned char *addtl,
+                    uint32_t addtl_len, const unsigned char *addtl2,
+                    uint32_t addtl2_len, void **abstract)
+{
+    (void)session;
+    (void)buf;
+    (void)seqno;
+    (void)packet;
+    (void)packet_len;
+    (void)addtl;
+    (void)addtl_len;
+    (void)addtl2;
+    (void)addtl2_len;
+    (void)abstract;
+    return 0;
+}
+
+static const LIBSSH2_CRYPT_METHOD none_crypt_method = {
+    "none",
+    8,                     /* blocksize */
+    0,                     /* iv_len */
+    0,                     /* secret_len */
+    0,                     /* flags */
+    NULL,
+    none_crypt,
+    NULL,
+    NULL
+};
+
+static const LIBSSH2_MAC_METHOD none_mac_method = {
+    "none",
+    0,
+    0,
+    NULL,
+    none_mac,
+    NULL
+};
+
+/*
+ * replay_once
+ *
+ * Run the calls on a session fed the recording, which is sealed with the
+ * fixed keys for 'crypt' and 'mac' unless they are NULL
+ */
+static int replay_once(const struct recording *r,
+                       const unsigned char *data, size_t len,
+                       const LIBSSH2_CRYPT_METHOD *crypt,
+                       const LIBSSH2_MAC_METHOD *mac, const char *params,
+                       double *seconds)
+{
+    LIBSSH2_SESSION *session;
+    struct outcome got;
+    struct feed feed;
+    double t;
+    int sock;
+    int rc;
+
+    memset(&feed, 0, sizeof(feed));
+    feed.data = data;
+    feed.len = len;
+    feed.plain = r->plain;
+    feed.extra = crypt ? mac->mac_len : 0;
+    feed.marks = r->marks;
+    feed.packets = r->packets;
+    sock = ready_socket();
+    if (sock < 0) {
+        fprintf(stderr, "replay %s: failed: no socket to wait on\n", params);
+        failures++;
+        return -1;
+    }
+    session = libssh2_session_init_ex(NULL, NULL, NULL, &feed);
+    if (!session) {
+        closesocket(sock);
+        failed("replay", params, NULL);
+        return -1;
+    }
+    session->socket_fd = sock;
+    feed.session = session;
+    libssh2_session_callback_set(session, LIBSSH2_CALLBACK_RECV,
+                                 (void *)replay_recv);
+    libssh2_session_callback_set(session, LIBSSH2_CALLBACK_SEND,
+                                 (void *)replay_send);
+
+    /* where the recording started: keys exchanged and logged in */
+    session->state |= LIBSSH2_STATE_NEWKEYS | LIBSSH2_STATE_AUTHENTICATED;
+    session->local.crypt = &none_crypt_method;
+    session->local.mac = &none_mac_method;
+    if (crypt) {
+        session->remote.crypt = crypt;
+        session->remote.mac = mac;
+        if (fixed_keys(session, crypt, mac, 0,
+                       &session->remote.crypt_abstract,
+                       &session->remote.mac_abstract)) {
+            session->remote.crypt = NULL;
+            session->remote.mac = NULL;
+            failed("replay", params, session);
+            libssh2_session_free(session);
+            closesocket(sock);
+            return -1;
+        }
+    }
+    else {
+        session->remote.crypt = &none_crypt_method;
+        session->remote.mac = &none_mac_method;
+    }
+    _libssh2_transport_kernels(session);
+
+    t = now();
+    rc = run_calls(session, &got);
+    *seconds = now() - t;
+
+    if (rc)
+        failed("replay", params, session);
+    else if ((got.channel_bytes != r->want.channel_bytes) ||
+             (got.sftp_bytes != r->want.sftp_bytes) ||
+             (got.entries != r->want.entries) || (feed.off != feed.len)) {
+        fprintf(stderr, "replay %s: failed: went another way than the "
+                "recording, %lu of %lu bytes used\n", params,
+                (unsigned long)feed.off, (unsigned long)feed.len);
+        failures++;
+        rc = -1;
+    }
+    libssh2_session_free(session);
+    closesocket(sock);
+    return rc;
+}
+
+/* Time the fastest of the rounds of replaying */
+static void replay_rounds(const struct recording *r,
+                          const unsigned char *data, size_t len,
+                          const LIBSSH2_CRYPT_METHOD *crypt,
+                          const LIBSSH2_MAC_METHOD *mac)
+{
+    char params[128];
+    double best = 0;
+    double seconds;
+    int i;
+
+    if (crypt)
+        sprintf(params, "mode=crypt,cipher=%.40s,mac=%.40s,packets=%lu",
+                crypt->name, mac->name, r->packets);
+    else
+        sprintf(params, "mode=none,packets=%lu", r->packets);
+
+    for (i = 0; i < rounds; i++) {
+        if (replay_once(r, data, len, crypt, mac, params, &seconds))
+            return;
+        if (!i || (seconds < best))
+            best = seconds;
+    }
+    result("replay", params, mbps(len, best), "MB/s");
+    result("replay", params, best * 1e9 / r->packets, "ns/packet");
+}
+
+/* Replay 'file' in both modes */
+static void replay(const char *file)
+{
+    const LIBSSH2_CRYPT_METHOD **crypts = libssh2_crypt_methods();
+    const LIBSSH2_MAC_METHOD **macs = _libssh2_mac_methods();
+    const LIBSSH2_CRYPT_METHOD *crypt = NULL;
+    const LIBSSH2_MAC_METHOD *mac = NULL;
+    LIBSSH2_SESSION *session;
+    struct recording r;
+    unsigned char *sealed;
+    size_t sealed_len;
+    int i;
+
+    if (load(file, &r)) {
+        failed("replay", file, NULL);
+        return;
+    }
+
+    replay_rounds(&r, r.plain, r.len, NULL, NULL);
+
+    for (i = 0; crypts[i]; i++)
+        if (!strcmp(crypts[i]->name, cipher_name))
+            crypt = crypts[i];
+    for (i = 0; macs[i]; i++)
+        if (!strcmp(macs[i]->name, mac_name))
+            mac = macs[i];
+    if (!crypt || !mac || (crypt->flags & LIBSSH2_CRYPT_FLAG_AEAD) ||
+        mac->etm) {
+        fprintf(stderr, "replay %s %s: not supported\n", cipher_name,
+                mac_name);
+        failures++;
+        free(r.file);
+        return;
+    }
+
+    session = libssh2_session_init();
+    sealed = session ?
+        seal(session, r.plain, r.len, r.packets, crypt, mac, &sealed_len) :
+        NULL;
+    if (sealed)
+        replay_rounds(&r, sealed, sealed_len, crypt, mac);
+    else
+        failed("replay", "seal", session);
+    free(sealed);
+    if (session)
+        libssh2_session_free(session);
+    free(r.file);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file = "replay.dat";
+    int recording = 1;
+    int replaying = 1;
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int err;
+
+    err = WSAStartup(MAKEWORD(2,0), &wsadata);
+    if (err != 0) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+        return -1;
+    }
+#endif
+
+    if ((argc > 1) && !strcmp(argv[1], "record")) {
+        replaying = 0;
+        if (argc > 2)
+            file = argv[2];
+    }
+    else if (argc > 1) {
+        recording = 0;
+        file = argv[1];
+    }
+
+    read_environment();
+    if (getenv("BENCH_BYTES"))
+        total = strtoul(getenv("BENCH_BYTES"), NULL, 10);
+    if (getenv("BENCH_ROUNDS"))
+        rounds = atoi(getenv("BENCH_ROUNDS"));
+    if (getenv("BENCH_CIPHER"))
+        cipher_name = getenv("BENCH_CIPHER");
+    if (getenv("BENCH_MAC"))
+        mac_name = getenv("BENCH_MAC");
+    if (rounds < 1)
+        rounds = 1;
+
+    libssh2_init(0);
+
+    printf("# name\tparameters\tvalue\tunit\n");
+
+    if (recording)
+        record(file);
+    if (replaying && !failures)
+        replay(file);
+
+    libssh2_exit();
+
+#ifdef WIN32
+    WSACleanup();
+#endif
+
+    return failures ? 1 : 0;
+}
@@ -38,39 +38,499 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libssh2.h"
 
 static int test_libssh2_base64_decode (LIBSSH2_SESSION *session)
 {
+    static const struct {
+        const char *src;
+        const char *expect; /* NULL when it is to be refused */
+    } cases[] = {
+        { "Zm5vcmQ=", "fnord" },
+        { "", "" },
+        /* two, one and no padding characters */
+        { "Zg==", "f" },
+        { "Zm8=", "fo" },
+        { "Zm9v", "foo" },
+        { "Zg", "f" },
+        /* several whole groups */
+        { "Zm9vYmFyYmF6cXV4", "foobarbazqux" },
+        /* line breaks and other characters that aren't base64 are
+           skipped, also in the middle of a group */
+        { "Zm9v\nYmFy\r\n", "foobar" },
+        { "Zm9 vYm*E=", "fooba" },
+        /* a character left over that makes no whole byte */
+        { "Z", NULL },
+        { "Zm9vY", NULL },
+        { "Zm9v\nY===", NULL }
+    };
     char *data;
     unsigned int datalen;
-    const char *src = "Zm5vcmQ=";
-    unsigned int src_len = strlen (src);
+    int failed = 0;
     int ret;
+    int i;
 
-    ret = libssh2_base64_decode(session, &data, &datalen,
-                                src, src_len);
-    if (ret)
-        return ret;
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        ret = libssh2_base64_decode(session, &data, &datalen, cases[i].src,
+                                    strlen (cases[i].src));
+        if (!cases[i].expect)
+        {
+            if (ret != LIBSSH2_ERROR_INVAL)
+            {
+                fprintf (stderr, "libssh2_base64_decode(%s) returned %d\n",
+                         cases[i].src, ret);
+                failed = 1;
+            }
+            if (!ret)
+                free (data);
+            continue;
+        }
+        if (ret)
+        {
+            fprintf (stderr, "libssh2_base64_decode(%s) failed: %d\n",
+                     cases[i].src, ret);
+            failed = 1;
+            continue;
+        }
+
+        if (datalen != strlen (cases[i].expect) ||
+            memcmp (data, cases[i].expect, datalen))
+        {
+            fprintf (stderr,
+                     "libssh2_base64_decode(%s) failed (%d, %.*s)\n",
+                     cases[i].src, datalen, datalen, data);
+            failed = 1;
+        }
+
+        free (data);
+    }
 
-    if (datalen != 5 || strcmp (data, "fnord") != 0)
+    return failed;
+}
+
+static int check_host(LIBSSH2_KNOWNHOSTS *hosts, const char *host, int port,
+                      const char *key, int expect,
+                      struct libssh2_knownhost **found)
+{
+    int rc = libssh2_knownhost_checkp(hosts, host, port, key, strlen(key),
+                                      LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                      LIBSSH2_KNOWNHOST_KEYENC_RAW |
+                                      LIBSSH2_KNOWNHOST_KEY_SSHRSA, found);
+    if (rc != expect)
     {
-        fprintf (stderr,
-                 "libssh2_base64_decode() failed (%d, %.*s)\n",
-                 datalen, datalen, data);
+        fprintf (stderr, "libssh2_knownhost_checkp(%s, %d, %s) returned %d, "
+                 "expected %d\n", host, port, key, rc, expect);
         return 1;
     }
+    return 0;
+}
+
+static int test_libssh2_knownhost_index (LIBSSH2_SESSION *session)
+{
+    /* the keys are base64 of "key a bytes" and so on */
+    static const char *lines[] = {
+        "a.example.com ssh-rsa a2V5IGEgYnl0ZXM=\n",
+        "[a.example.com]:2222 ssh-rsa a2V5IGIgYnl0ZXM=\n",
+        "a.example.com ssh-rsa a2V5IGMgYnl0ZXM=\n",
+        /* h.example.com */
+        "|1|AQIDBAUGBwgJCgsMDQ4PEBESExQ=|rb9llaT5EvK4tMxoWs6+p592vFo= "
+        "ssh-rsa a2V5IGEgYnl0ZXM=\n"
+    };
+    LIBSSH2_KNOWNHOSTS *hosts;
+    struct libssh2_knownhost *found;
+    struct libssh2_knownhost *entry;
+    char line[64];
+    int count;
+    int failed = 0;
+    int i;
 
-    free (data);
+    hosts = libssh2_knownhost_init(session);
+    if (!hosts)
+    {
+        fprintf (stderr, "libssh2_knownhost_init() failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(lines) / sizeof(lines[0])); i++)
+    {
+        if (libssh2_knownhost_readline(hosts, lines[i], strlen(lines[i]),
+                                       LIBSSH2_KNOWNHOST_FILE_OPENSSH))
+        {
+            fprintf (stderr, "libssh2_knownhost_readline(%s) failed\n",
+                     lines[i]);
+            failed = 1;
+        }
+    }
+    /* enough hosts for the index to grow a few times */
+    for (i = 0; i < 300; i++)
+    {
+        sprintf (line, "host%d.example.com ssh-rsa a2V5IGEgYnl0ZXM=\n", i);
+        if (libssh2_knownhost_readline(hosts, line, strlen(line),
+                                       LIBSSH2_KNOWNHOST_FILE_OPENSSH))
+        {
+            fprintf (stderr, "libssh2_knownhost_readline(%s) failed\n",
+                     line);
+            failed = 1;
+        }
+    }
+
+    failed |= check_host(hosts, "a.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    /* no [a.example.com]:22 entry, so the plain one is used */
+    failed |= check_host(hosts, "a.example.com", 22, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "a.example.com", 2222, "key b bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "a.example.com", -1, "key b bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MISMATCH, NULL);
+    /* the second entry of a host is found as well */
+    failed |= check_host(hosts, "a.example.com", -1, "key c bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    /* and a mismatch reports the first entry with a wrong key */
+    failed |= check_host(hosts, "a.example.com", -1, "key d bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MISMATCH, &found);
+    if (!failed && strcmp (found->key, "a2V5IGEgYnl0ZXM="))
+    {
+        fprintf (stderr, "mismatch reported key %s\n", found->key);
+        failed = 1;
+    }
+    failed |= check_host(hosts, "h.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "h.example.com", -1, "key b bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MISMATCH, NULL);
+    failed |= check_host(hosts, "host150.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, &found);
+    failed |= check_host(hosts, "nothere.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_NOTFOUND, NULL);
+    if (failed)
+    {
+        libssh2_knownhost_free(hosts);
+        return failed;
+    }
+
+    /* deleted entries are gone from the index too */
+    if (libssh2_knownhost_del(hosts, found))
+    {
+        fprintf (stderr, "libssh2_knownhost_del() failed\n");
+        failed = 1;
+    }
+    failed |= check_host(hosts, "host150.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_NOTFOUND, NULL);
+    failed |= check_host(hosts, "host151.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
 
+    failed |= check_host(hosts, "a.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, &found);
+    if (!failed && libssh2_knownhost_del(hosts, found))
+    {
+        fprintf (stderr, "libssh2_knownhost_del() failed\n");
+        failed = 1;
+    }
+    failed |= check_host(hosts, "a.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MISMATCH, NULL);
+    failed |= check_host(hosts, "a.example.com", -1, "key c bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+
+    /* what is left is still in file order */
+    count = 0;
+    entry = NULL;
+    while (!libssh2_knownhost_get(hosts, &entry, entry))
+    {
+        if (!count && (!entry->name ||
+                       strcmp (entry->name, "[a.example.com]:2222")))
+        {
+            fprintf (stderr, "first entry is %s\n",
+                     entry->name ? entry->name : "hashed");
+            failed = 1;
+        }
+        count++;
+    }
+    if (count != 302)
+    {
+        fprintf (stderr, "%d entries left, expected 302\n", count);
+        failed = 1;
+    }
+
+    libssh2_knownhost_free(hosts);
+    return failed;
+}
+
+static int test_libssh2_knownhost_key_types (LIBSSH2_SESSION *session)
+{
+    static const struct {
+        const char *name;
+        int type;
+    } types[] = {
+        { "ecdsa-sha2-nistp256", LIBSSH2_KNOWNHOST_KEY_ECDSA_256 },
+        { "ecdsa-sha2-nistp384", LIBSSH2_KNOWNHOST_KEY_ECDSA_384 },
+        { "ecdsa-sha2-nistp521", LIBSSH2_KNOWNHOST_KEY_ECDSA_521 },
+        { "ssh-ed25519", LIBSSH2_KNOWNHOST_KEY_ED25519 },
+        /* only the whole name counts */
+        { "ssh-ed25519x", LIBSSH2_KNOWNHOST_KEY_UNKNOWN },
+        { "ecdsa-sha2-nistp2561", LIBSSH2_KNOWNHOST_KEY_UNKNOWN }
+    };
+    LIBSSH2_KNOWNHOSTS *hosts;
+    struct libssh2_knownhost *found;
+    char line[128];
+    char out[128];
+    size_t outlen;
+    int failed = 0;
+    int rc;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++)
+    {
+        hosts = libssh2_knownhost_init(session);
+        if (!hosts)
+        {
+            fprintf (stderr, "libssh2_knownhost_init() failed\n");
+            return 1;
+        }
+
+        sprintf (line, "k.example.com %s a2V5IGEgYnl0ZXM=\n", types[i].name);
+        if (libssh2_knownhost_readline(hosts, line, strlen(line),
+                                       LIBSSH2_KNOWNHOST_FILE_OPENSSH) ||
+            libssh2_knownhost_get(hosts, &found, NULL))
+        {
+            fprintf (stderr, "libssh2_knownhost_readline(%s) failed\n",
+                     line);
+            libssh2_knownhost_free(hosts);
+            failed = 1;
+            continue;
+        }
+        if ((found->typemask & LIBSSH2_KNOWNHOST_KEY_MASK) != types[i].type)
+        {
+            fprintf (stderr, "%s read as key type %d, expected %d\n",
+                     types[i].name,
+                     found->typemask & LIBSSH2_KNOWNHOST_KEY_MASK,
+                     types[i].type);
+            failed = 1;
+        }
+
+        if (types[i].type != LIBSSH2_KNOWNHOST_KEY_UNKNOWN)
+        {
+            /* the key only matches with its own type */
+            rc = libssh2_knownhost_checkp(hosts, "k.example.com", -1,
+                                          "key a bytes", 11,
+                                          LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                                          LIBSSH2_KNOWNHOST_KEYENC_RAW |
+                                          types[i].type, NULL);
+            if (rc != LIBSSH2_KNOWNHOST_CHECK_MATCH)
+            {
+                fprintf (stderr, "%s key did not match: %d\n",
+                         types[i].name, rc);
+                failed = 1;
+            }
+            failed |= check_host(hosts, "k.example.com", -1, "key a bytes",
+                                 LIBSSH2_KNOWNHOST_CHECK_NOTFOUND, NULL);
+        }
+
+        /* and is written out under its name */
+        if (libssh2_knownhost_writeline(hosts, found, out, sizeof(out),
+                                        &outlen,
+                                        LIBSSH2_KNOWNHOST_FILE_OPENSSH) ||
+            strcmp (out, line))
+        {
+            fprintf (stderr, "%s written as %s", types[i].name, out);
+            failed = 1;
+        }
+
+        libssh2_knownhost_free(hosts);
+    }
+
+    return failed;
+}
+
+static int write_file(const char *name, const char *data)
+{
+    FILE *fp = fopen(name, "w");
+
+    if (!fp || (fputs(data, fp) < 0) || fclose(fp))
+    {
+        fprintf (stderr, "writing %s failed\n", name);
+        return 1;
+    }
     return 0;
 }
 
+static int test_libssh2_knownhost_readfile (LIBSSH2_SESSION *session)
+{
+    /* the first file is read whole and ends in a newline, the second one
+       does not */
+    static const char whole[] = "# known hosts\n"
+        "\n"
+        "b.example.com,c.example.com ssh-rsa a2V5IGEgYnl0ZXM= laptop\n"
+        "d.example.com ssh-rsa a2V5IGIgYnl0ZXM=\n";
+    static const char unterminated[] = "e.example.com ssh-rsa a2V5IGMgYnl0ZXM=";
+    static const char *files[] = {
+        "simple_known_hosts_1", "simple_known_hosts_2",
+        "simple_known_hosts_3"
+    };
+    LIBSSH2_KNOWNHOSTS *hosts;
+    struct libssh2_knownhost *found;
+    int failed = 0;
+    int rc;
+    int i;
+
+    if (write_file(files[0], whole) || write_file(files[1], unterminated))
+        return 1;
+
+    hosts = libssh2_knownhost_init(session);
+    if (!hosts)
+    {
+        fprintf (stderr, "libssh2_knownhost_init() failed\n");
+        return 1;
+    }
+
+    rc = libssh2_knownhost_readfile(hosts, files[0],
+                                    LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+    if (rc != 4)
+    {
+        fprintf (stderr, "libssh2_knownhost_readfile(%s) returned %d\n",
+                 files[0], rc);
+        failed = 1;
+    }
+    rc = libssh2_knownhost_readfile(hosts, files[1],
+                                    LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+    if (rc != 1)
+    {
+        fprintf (stderr, "libssh2_knownhost_readfile(%s) returned %d\n",
+                 files[1], rc);
+        failed = 1;
+    }
+
+    failed |= check_host(hosts, "b.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "c.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "e.example.com", -1, "key c bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "d.example.com", -1, "key b bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, &found);
+
+    /* entries read from a file and added ones are deleted and written out
+       alike */
+    if (!failed && libssh2_knownhost_del(hosts, found))
+    {
+        fprintf (stderr, "libssh2_knownhost_del() failed\n");
+        failed = 1;
+    }
+    if (libssh2_knownhost_addc(hosts, "f.example.com", NULL, "key d bytes",
+                               11, "added", 5,
+                               LIBSSH2_KNOWNHOST_TYPE_PLAIN |
+                               LIBSSH2_KNOWNHOST_KEYENC_RAW |
+                               LIBSSH2_KNOWNHOST_KEY_SSHRSA, NULL))
+    {
+        fprintf (stderr, "libssh2_knownhost_addc() failed\n");
+        failed = 1;
+    }
+    if (libssh2_knownhost_writefile(hosts, files[2],
+                                    LIBSSH2_KNOWNHOST_FILE_OPENSSH))
+    {
+        fprintf (stderr, "libssh2_knownhost_writefile() failed\n");
+        failed = 1;
+    }
+    libssh2_knownhost_free(hosts);
+
+    hosts = libssh2_knownhost_init(session);
+    if (!hosts)
+    {
+        fprintf (stderr, "libssh2_knownhost_init() failed\n");
+        return 1;
+    }
+    if (libssh2_knownhost_readfile(hosts, files[2],
+                                   LIBSSH2_KNOWNHOST_FILE_OPENSSH) < 0)
+    {
+        fprintf (stderr, "libssh2_knownhost_readfile(%s) failed\n",
+                 files[2]);
+        failed = 1;
+    }
+    failed |= check_host(hosts, "b.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "c.example.com", -1, "key a bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "d.example.com", -1, "key b bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_NOTFOUND, NULL);
+    failed |= check_host(hosts, "e.example.com", -1, "key c bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    failed |= check_host(hosts, "f.example.com", -1, "key d bytes",
+                         LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+    libssh2_knownhost_free(hosts);
+
+    for (i = 0; i < 3; i++)
+        remove (files[i]);
+
+    return failed;
+}
+
+static int test_libssh2_knownhost_store (void)
+{
+    static const char lines[] =
+        "b.example.com,c.example.com ssh-rsa a2V5IGEgYnl0ZXM=\n"
+        "d.example.com ssh-rsa a2V5IGIgYnl0ZXM=\n";
+    static const char *file = "simple_known_hosts_store";
+    LIBSSH2_KNOWNHOST_STORE *store;
+    LIBSSH2_KNOWNHOSTS *hosts;
+    int failed = 0;
+    int rc;
+    int i;
+
+    if (write_file(file, lines))
+        return 1;
+
+    store = libssh2_knownhost_store_init();
+    if (!store)
+    {
+        fprintf (stderr, "libssh2_knownhost_store_init() failed\n");
+        return 1;
+    }
+    rc = libssh2_knownhost_store_readfile(store, file,
+                                          LIBSSH2_KNOWNHOST_FILE_OPENSSH);
+    if (rc != 2)
+    {
+        fprintf (stderr, "libssh2_knownhost_store_readfile(%s) returned "
+                 "%d\n", file, rc);
+        failed = 1;
+    }
+    hosts = libssh2_knownhost_store_get(store);
+    if (!hosts)
+    {
+        fprintf (stderr, "libssh2_knownhost_store_get() failed\n");
+        libssh2_knownhost_store_free(store);
+        return 1;
+    }
+
+    /* a shared collection has every key decoded before it is handed out,
+       so the same checks keep giving the same answers */
+    for (i = 0; i < 3; i++)
+    {
+        failed |= check_host(hosts, "b.example.com", -1, "key a bytes",
+                             LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+        failed |= check_host(hosts, "c.example.com", -1, "key a bytes",
+                             LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+        failed |= check_host(hosts, "d.example.com", -1, "key b bytes",
+                             LIBSSH2_KNOWNHOST_CHECK_MATCH, NULL);
+        failed |= check_host(hosts, "d.example.com", -1, "key a bytes",
+                             LIBSSH2_KNOWNHOST_CHECK_MISMATCH, NULL);
+        failed |= check_host(hosts, "e.example.com", -1, "key a bytes",
+                             LIBSSH2_KNOWNHOST_CHECK_NOTFOUND, NULL);
+    }
+
+    libssh2_knownhost_free(hosts);
+    libssh2_knownhost_store_free(store);
+    remove (file);
+
+    return failed;
+}
+
 int main(int argc, char *argv[])
 {
     LIBSSH2_SESSION *session;
     int rc;
+    int failed = 0;
     (void)argv;
     (void)argc;
 
@@ -88,11 +548,15 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    test_libssh2_base64_decode (session);
+    failed |= test_libssh2_base64_decode (session);
+    failed |= test_libssh2_knownhost_index (session);
+    failed |= test_libssh2_knownhost_readfile (session);
+    failed |= test_libssh2_knownhost_key_types (session);
+    failed |= test_libssh2_knownhost_store ();
 
     libssh2_session_free(session);
 
     libssh2_exit ();
 
-    return 0;
+    return failed;
 }
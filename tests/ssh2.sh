@@ -8,7 +8,7 @@
 srcdir=${srcdir:-$PWD}
 SSHD=${SSHD:-/usr/sbin/sshd}
 
-cmd="./ssh2${EXEEXT}"
+cmd="${1:-./ssh2${EXEEXT}}"
 srcdir=`cd "$srcdir"; pwd`
 
 PRIVKEY=$srcdir/etc/user
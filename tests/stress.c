@@ -0,0 +1,560 @@
+/* Load generator, run against the same sshd fixture as the self test.
+ *
+ * Opens N sessions with M echo channels and one SFTP instance holding M open
+ * handles each, then drives all of them at once from a single non-blocking
+ * loop for a while: messages of mixed sizes are echoed through "cat" on the
+ * channels, while the SFTP handles take turns reading a shared file with
+ * read-ahead, so that many requests are outstanding on every session. This
+ * is repeated for each combination of N and M, and the results are printed
+ * in the same tab separated format as the benchmarks:
+ *
+ *   name <TAB> parameters <TAB> value <TAB> unit
+ *
+ * stress_setup is the time to set up one session and its channels and
+ * handles, stress the aggregate throughput, stress_ops the completed echoes
+ * and SFTP reads per second, stress_p50 and stress_p99 their latencies and
+ * stress_rss the resident size of the process with everything open (Linux
+ * only). Failures are reported on stderr and make the exit code non-zero.
+ *
+ * The environment variables STRESS_SESSIONS and STRESS_CHANNELS (comma
+ * separated values of N and M, default "1,4,16" and "1,4,9"),
+ * STRESS_SECONDS (how long each combination runs, default 5) and
+ * STRESS_FILE (size of the file read over SFTP, default 1MB) change what is
+ * run. BENCH_PORT and BENCH_DIR are used as by the benchmarks.
+ */
+
+#include "libssh2_config.h"
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+#include "bench_util.h"
+
+#ifdef HAVE_WINDOWS_H
+# include <windows.h>
+#endif
+#ifdef HAVE_WINSOCK2_H
+# include <winsock2.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+# include <netinet/in.h>
+#endif
+# ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+# ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#define getpid() GetCurrentProcessId()
+#else
+#define closesocket(s) close(s)
+#endif
+
+/* sshd allows 10 channels per connection by default (MaxSessions), one of
+   them is taken by SFTP */
+#define STRESS_CHANNELS 9
+
+/* SFTP read size and how many reads each handle keeps ahead */
+#define STRESS_READ 32768
+#define STRESS_AHEAD 4
+
+static const char *session_counts = "1,4,16";
+static const char *channel_counts = "1,4,9";
+static double seconds = 5;
+static libssh2_uint64_t file_size = 1024 * 1024;
+static char path[256];
+
+
+static char buf[64 * 1024];
+
+/* the sizes of the echoed messages, used in turn */
+static const size_t echo_sizes[] = { 64, 1024, 16384 };
+
+struct echo {
+    LIBSSH2_CHANNEL *channel;
+    size_t len;                 /* size of the message being echoed */
+    size_t sent;
+    size_t recvd;
+    unsigned int count;         /* messages echoed so far */
+    double start;
+};
+
+struct stress {
+    LIBSSH2_SESSION *session;
+    int sock;
+    int failed;
+    struct echo echo[STRESS_CHANNELS];
+    int channels;
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handles[STRESS_CHANNELS];
+    int handle;                 /* the handle that reads next */
+    int reading;
+    double read_start;
+    /* the operation that left a packet partly sent. Nothing else may be
+       sent on the session until it is called again and finishes it */
+    void *owner;
+};
+
+/* the latencies of everything completed in one run, in seconds */
+static double *latencies;
+static size_t latency_count;
+static size_t latency_size;
+
+static libssh2_uint64_t moved;
+
+static void latency(double t)
+{
+    if (latency_count == latency_size) {
+        size_t size = latency_size ? latency_size * 2 : 4096;
+        double *l = realloc(latencies, size * sizeof(*l));
+        if (!l)
+            return;
+        latencies = l;
+        latency_size = size;
+    }
+    latencies[latency_count++] = t;
+}
+
+static int compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(int p)
+{
+    if (!latency_count)
+        return 0;
+    return latencies[(latency_count - 1) * p / 100];
+}
+
+/* Resident size of the process in KB, -1 if unknown */
+static long rss_kb(void)
+{
+    long kb = -1;
+#ifdef __linux__
+    char line[128];
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, "VmRSS:", 6)) {
+            kb = strtol(line + 6, NULL, 10);
+            break;
+        }
+    fclose(f);
+#endif
+    return kb;
+}
+
+/* Read the next value of a comma separated list, NULL at its end */
+static const char *next_count(const char *list, int *count)
+{
+    if (!*list)
+        return NULL;
+    *count = atoi(list);
+    list += strcspn(list, ",");
+    return *list ? list + 1 : list;
+}
+
+/* Write the file the SFTP handles read */
+static int make_file(void)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SFTP_HANDLE *handle;
+    libssh2_uint64_t done = 0;
+    ssize_t rc = 0;
+    int sock;
+
+    session = start(&sock);
+    if (!session)
+        return -1;
+    sftp = libssh2_sftp_init(session);
+    if (!sftp) {
+        failed("stress_file", "-", session);
+        stop(session, sock);
+        return -1;
+    }
+    handle = libssh2_sftp_open(sftp, path,
+                               LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                               LIBSSH2_FXF_TRUNC, 0644);
+    if (handle) {
+        while (done < file_size) {
+            size_t len = sizeof(buf);
+            if (file_size - done < len)
+                len = (size_t)(file_size - done);
+            rc = libssh2_sftp_write(handle, buf, len);
+            if (rc < 0)
+                break;
+            done += rc;
+        }
+        if (libssh2_sftp_close(handle))
+            rc = -1;
+    }
+    if (!handle || rc < 0)
+        failed("stress_file", "-", session);
+    libssh2_sftp_shutdown(sftp);
+    stop(session, sock);
+    return (handle && rc >= 0) ? 0 : -1;
+}
+
+static void remove_file(void)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_SFTP *sftp;
+    int sock;
+
+    session = start(&sock);
+    if (!session)
+        return;
+    sftp = libssh2_sftp_init(session);
+    if (sftp) {
+        libssh2_sftp_unlink(sftp, path);
+        libssh2_sftp_shutdown(sftp);
+    }
+    stop(session, sock);
+}
+
+/* Take down a session with all its channels and handles */
+static void teardown(struct stress *s)
+{
+    int i;
+
+    if (!s->session)
+        return;
+    libssh2_session_set_blocking(s->session, 1);
+    for (i = 0; i < s->channels; i++) {
+        if (s->handles[i])
+            libssh2_sftp_close(s->handles[i]);
+        if (s->echo[i].channel)
+            libssh2_channel_free(s->echo[i].channel);
+    }
+    if (s->sftp)
+        libssh2_sftp_shutdown(s->sftp);
+    stop(s->session, s->sock);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Open a session with its echo channels and SFTP handles */
+static int setup(struct stress *s, int channels, const char *params)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->session = start(&s->sock);
+    if (!s->session)
+        return -1;
+    s->channels = channels;
+
+    for (i = 0; i < channels; i++) {
+        s->echo[i].channel = libssh2_channel_open_session(s->session);
+        if (!s->echo[i].channel ||
+            libssh2_channel_exec(s->echo[i].channel, "cat"))
+            break;
+    }
+    if (i == channels) {
+        s->sftp = libssh2_sftp_init(s->session);
+        for (i = 0; s->sftp && i < channels; i++) {
+            s->handles[i] = libssh2_sftp_open(s->sftp, path,
+                                              LIBSSH2_FXF_READ, 0);
+            if (!s->handles[i])
+                break;
+            libssh2_sftp_handle_read_ahead(s->handles[i],
+                                           STRESS_READ * STRESS_AHEAD,
+                                           STRESS_AHEAD, 0);
+        }
+    }
+    if (!s->sftp || i < channels) {
+        failed("stress_setup", params, s->session);
+        teardown(s);
+        return -1;
+    }
+
+    libssh2_session_set_blocking(s->session, 0);
+    return 0;
+}
+
+/* Note who has to be called next after an operation returned 'rc'. Returns
+   non-zero if the operation failed */
+static int track(struct stress *s, void *op, ssize_t rc)
+{
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        if (libssh2_session_block_directions(s->session) &
+            LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            s->owner = op;
+        else if (s->owner == op)
+            s->owner = NULL;
+        return 0;
+    }
+    if (s->owner == op)
+        s->owner = NULL;
+    return rc < 0;
+}
+
+/* Move an echo message along. Returns 1 if something happened */
+static int step_echo(struct stress *s, struct echo *e, int stopping)
+{
+    ssize_t rc;
+
+    if ((s->owner || stopping) && (s->owner != e))
+        return 0;
+
+    if (!stopping && (e->recvd >= e->len)) {
+        /* start the next message */
+        e->len = echo_sizes[e->count % (sizeof(echo_sizes) /
+                                        sizeof(echo_sizes[0]))];
+        e->sent = e->recvd = 0;
+        e->start = now();
+    }
+
+    if (e->sent < e->len) {
+        rc = libssh2_channel_write(e->channel, buf, e->len - e->sent);
+        if (track(s, e, rc))
+            return -1;
+        if (rc > 0)
+            e->sent += rc;
+        if (s->owner == e)
+            return 0;
+    }
+
+    rc = libssh2_channel_read(e->channel, buf, sizeof(buf));
+    if (track(s, e, rc))
+        return -1;
+    if (rc <= 0)
+        return 0;
+    e->recvd += rc;
+    moved += rc;
+    if ((e->recvd >= e->len) && (e->sent == e->len)) {
+        latency(now() - e->start);
+        e->count++;
+    }
+    return 1;
+}
+
+/* Move the SFTP reads along, the handles take turns */
+static int step_sftp(struct stress *s, int stopping)
+{
+    LIBSSH2_SFTP_HANDLE *handle = s->handles[s->handle];
+    ssize_t rc;
+
+    if ((s->owner || stopping) && (s->owner != s->sftp))
+        return 0;
+    if (!s->reading) {
+        s->reading = 1;
+        s->read_start = now();
+    }
+
+    rc = libssh2_sftp_read(handle, buf, STRESS_READ);
+    if (track(s, s->sftp, rc))
+        return -1;
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return 0;
+
+    latency(now() - s->read_start);
+    s->reading = 0;
+    moved += rc;
+    if (!rc)
+        libssh2_sftp_seek64(handle, 0);
+    s->handle = (s->handle + 1) % s->channels;
+    return 1;
+}
+
+/* Wait for any of the sessions to be able to go on */
+static void wait_all(struct stress *all, int count)
+{
+    struct timeval timeout;
+    fd_set readfd;
+    fd_set writefd;
+    int maxfd = 0;
+    int dir;
+    int i;
+
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+
+    FD_ZERO(&readfd);
+    FD_ZERO(&writefd);
+    for (i = 0; i < count; i++) {
+        if (!all[i].session || all[i].failed)
+            continue;
+        dir = libssh2_session_block_directions(all[i].session);
+        if (!dir || (dir & LIBSSH2_SESSION_BLOCK_INBOUND))
+            FD_SET(all[i].sock, &readfd);
+        if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            FD_SET(all[i].sock, &writefd);
+        if (all[i].sock > maxfd)
+            maxfd = all[i].sock;
+    }
+
+    select(maxfd + 1, &readfd, &writefd, NULL, &timeout);
+}
+
+/* Drive all sessions until the time is up and no packet is left half
+   sent */
+static void run(struct stress *all, int count, const char *params)
+{
+    double end = now() + seconds;
+    int stopping = 0;
+    int progress;
+    int pending;
+    int i, c;
+
+    do {
+        stopping = stopping || (now() >= end);
+        progress = 0;
+        pending = 0;
+        for (i = 0; i < count; i++) {
+            struct stress *s = &all[i];
+            int rc = 0;
+
+            if (!s->session || s->failed)
+                continue;
+            for (c = 0; c < s->channels && rc >= 0; c++) {
+                rc = step_echo(s, &s->echo[c], stopping);
+                progress |= rc > 0;
+            }
+            if (rc >= 0) {
+                rc = step_sftp(s, stopping);
+                progress |= rc > 0;
+            }
+            if (rc < 0) {
+                failed("stress", params, s->session);
+                s->failed = 1;
+                s->owner = NULL;
+            }
+            if (s->owner)
+                pending = 1;
+        }
+        if (!progress)
+            wait_all(all, count);
+    } while (!stopping || pending);
+}
+
+static void stress(int sessions, int channels)
+{
+    struct stress *all;
+    char params[64];
+    double t;
+    long kb;
+    int i;
+
+    sprintf(params, "sessions=%d,channels=%d", sessions, channels);
+
+    all = calloc(sessions, sizeof(*all));
+    if (!all) {
+        failed("stress", params, NULL);
+        return;
+    }
+
+    t = now();
+    for (i = 0; i < sessions; i++)
+        if (setup(&all[i], channels, params))
+            break;
+    if (i < sessions) {
+        while (i-- > 0)
+            teardown(&all[i]);
+        free(all);
+        return;
+    }
+    result("stress_setup", params, (now() - t) / sessions * 1000, "ms");
+
+    kb = rss_kb();
+    if (kb >= 0)
+        result("stress_rss", params, kb, "KB");
+
+    latency_count = 0;
+    moved = 0;
+    t = now();
+    run(all, sessions, params);
+    t = now() - t;
+
+    qsort(latencies, latency_count, sizeof(*latencies), compare);
+    result("stress", params, t > 0 ? moved / t / (1024 * 1024) : 0, "MB/s");
+    result("stress_ops", params, t > 0 ? latency_count / t : 0, "ops/s");
+    result("stress_p50", params, percentile(50) * 1000, "ms");
+    result("stress_p99", params, percentile(99) * 1000, "ms");
+
+    for (i = 0; i < sessions; i++)
+        teardown(&all[i]);
+    free(all);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *n;
+    const char *m;
+    int sessions;
+    int channels;
+
+#ifdef WIN32
+    WSADATA wsadata;
+    int err;
+
+    err = WSAStartup(MAKEWORD(2,0), &wsadata);
+    if (err != 0) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+        return -1;
+    }
+#endif
+
+    (void)argc;
+    (void)argv;
+
+    read_environment();
+    if (getenv("STRESS_SESSIONS"))
+        session_counts = getenv("STRESS_SESSIONS");
+    if (getenv("STRESS_CHANNELS"))
+        channel_counts = getenv("STRESS_CHANNELS");
+    if (getenv("STRESS_SECONDS"))
+        seconds = atof(getenv("STRESS_SECONDS"));
+    if (getenv("STRESS_FILE"))
+        file_size = strtoul(getenv("STRESS_FILE"), NULL, 10);
+
+    memset(buf, 'x', sizeof(buf));
+    sprintf(path, "%.200s/libssh2-stress.%d", remote_dir, (int)getpid());
+    libssh2_init(0);
+
+    printf("# name\tparameters\tvalue\tunit\n");
+
+    if (!make_file()) {
+        n = session_counts;
+        while ((n = next_count(n, &sessions)) != NULL) {
+            m = channel_counts;
+            while ((m = next_count(m, &channels)) != NULL) {
+                if ((sessions < 1) || (channels < 1))
+                    continue;
+                if (channels > STRESS_CHANNELS) {
+                    fprintf(stderr, "stress: at most %d channels per "
+                            "session\n", STRESS_CHANNELS);
+                    channels = STRESS_CHANNELS;
+                }
+                stress(sessions, channels);
+            }
+        }
+        remove_file();
+    }
+
+    free(latencies);
+    libssh2_exit();
+
+#ifdef WIN32
+    WSACleanup();
+#endif
+
+    return failures ? 1 : 0;
+}